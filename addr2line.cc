@@ -5,13 +5,16 @@
 
 #include "addr2line.h"
 
+#include <algorithm>
 #include <cstdint>
 #include <map>
 #include <string>
+#include <vector>
 
 #include "base/commandlineflags.h"
 #include "base/logging.h"
 #include "symbol_map.h"
+#include "symbolization_cache.h"
 #include "third_party/abseil/absl/container/node_hash_map.h"
 #include "third_party/abseil/absl/flags/flag.h"
 #include "llvm/DebugInfo/DWARF/DWARFContext.h"
@@ -20,6 +23,10 @@
 
 ABSL_RETIRED_FLAG(bool, use_legacy_symbolizer, false,
                   "whether to use google3 symbolizer");
+ABSL_FLAG(std::string, symbolization_cache_dir, "",
+          "If set, the inline stacks of every binary are cached in this "
+          "directory under its build-id, and later runs on the same binary "
+          "read them from there instead of the debug info.");
 
 namespace {
 // This maps from a string naming a section to a pair containing a
@@ -39,6 +46,60 @@ llvm::object::OwningBinary<llvm::object::ObjectFile> GetOwningBinary(
   }
   return std::move(object_owning_binary_or_err.get());
 }
+
+// Appends the start and end of every address range of DIE to BOUNDARIES.
+void AppendRangeBoundaries(const llvm::DWARFDie &die,
+                           std::vector<uint64_t> *boundaries) {
+  auto ranges_or_err = die.getAddressRanges();
+  if (!ranges_or_err) {
+    llvm::consumeError(ranges_or_err.takeError());
+    return;
+  }
+  for (const llvm::DWARFAddressRange &range : ranges_or_err.get()) {
+    boundaries->push_back(range.LowPC);
+    boundaries->push_back(range.HighPC);
+  }
+}
+
+// Appends the range boundaries of all inlined subroutines nested in DIE to
+// BOUNDARIES. These are the only addresses where the inlined chain of
+// addresses in DIE can change.
+void AppendInlinedSubroutineBoundaries(const llvm::DWARFDie &die,
+                                       std::vector<uint64_t> *boundaries) {
+  for (const llvm::DWARFDie &child : die.children()) {
+    switch (child.getTag()) {
+      case llvm::dwarf::DW_TAG_inlined_subroutine:
+        AppendRangeBoundaries(child, boundaries);
+        AppendInlinedSubroutineBoundaries(child, boundaries);
+        break;
+      case llvm::dwarf::DW_TAG_lexical_block:
+        AppendInlinedSubroutineBoundaries(child, boundaries);
+        break;
+      default:
+        break;
+    }
+  }
+}
+
+// Returns true if the address ranges of DIE cover [START_ADDR, END_ADDR).
+bool RangesCover(const llvm::DWARFDie &die, uint64_t start_addr,
+                 uint64_t end_addr) {
+  auto ranges_or_err = die.getAddressRanges();
+  if (!ranges_or_err) {
+    llvm::consumeError(ranges_or_err.takeError());
+    return false;
+  }
+  llvm::DWARFAddressRangesVector ranges = std::move(ranges_or_err.get());
+  std::sort(ranges.begin(), ranges.end(),
+            [](const llvm::DWARFAddressRange &a,
+               const llvm::DWARFAddressRange &b) { return a.LowPC < b.LowPC; });
+  uint64_t covered_until = start_addr;
+  for (const llvm::DWARFAddressRange &range : ranges) {
+    if (range.LowPC > covered_until) break;
+    covered_until = std::max(covered_until, range.HighPC);
+  }
+  return covered_until >= end_addr;
+}
 }  // namespace
 
 namespace devtools_crosstool_autofdo {
@@ -49,13 +110,35 @@ Addr2line *Addr2line::Create(const std::string &binary_name) {
 
 Addr2line *Addr2line::CreateWithSampledFunctions(
     const std::string &binary_name,
-    const std::map<uint64_t, uint64_t> *sampled_functions) {
+    const SampledFunctions *sampled_functions) {
+  const std::string cache_dir = absl::GetFlag(FLAGS_symbolization_cache_dir);
+  if (!cache_dir.empty()) {
+    if (Addr2line *cache = SymbolizationCache::Load(cache_dir, binary_name)) {
+      LOG(INFO) << "Read the symbolization of '" << binary_name
+                << "' from the cache in " << cache_dir;
+      return cache;
+    }
+  }
   Addr2line *addr2line = new LLVMAddr2line(binary_name);
   if (!addr2line->Prepare()) {
     delete addr2line;
     return nullptr;
-  } else {
-    return addr2line;
+  }
+  // LLVMAddr2line does not filter by sampled functions, so the cache is
+  // complete for any later run.
+  if (!cache_dir.empty()) {
+    SymbolizationCache::Save(cache_dir, binary_name, *addr2line);
+  }
+  return addr2line;
+}
+
+void Addr2line::GetInlineStacksForRange(
+    uint64_t start_addr, uint64_t end_addr,
+    const InlineStackRangeCallback &callback) const {
+  for (uint64_t addr = start_addr; addr < end_addr; addr++) {
+    SourceStack stack;
+    GetInlineStack(addr, &stack);
+    callback(addr, addr + 1, stack);
   }
 }
 
@@ -71,6 +154,21 @@ bool LLVMAddr2line::Prepare() {
   return true;
 }
 
+bool LLVMAddr2line::PrepareForConcurrentQueries() {
+  if (dwarf_info_ == nullptr) return false;
+  if (prepared_for_concurrent_queries_) return true;
+  dwarf_info_->getDebugAranges();
+  for (const auto &[offset, unit] : unit_map_) {
+    dwarf_info_->getLineTableForUnit(unit);
+    // Extracts the DIEs and builds the address to DIE map of the unit, and of
+    // its split DWARF unit if any.
+    llvm::SmallVector<llvm::DWARFDie, 4> inlined_chain;
+    unit->getInlinedChainForAddress(0, inlined_chain);
+  }
+  prepared_for_concurrent_queries_ = true;
+  return true;
+}
+
 void LLVMAddr2line::GetInlineStack(uint64_t address, SourceStack *stack) const {
   auto cu_iter =
       unit_map_.find(dwarf_info_->getDebugAranges()->findAddress(address));
@@ -112,4 +210,56 @@ void LLVMAddr2line::GetInlineStack(uint64_t address, SourceStack *stack) const {
     FunctionDIE.getCallerFrame(file, line, col, discriminator);
   }
 }
+
+void LLVMAddr2line::GetInlineStacksForRange(
+    uint64_t start_addr, uint64_t end_addr,
+    const InlineStackRangeCallback &callback) const {
+  if (start_addr >= end_addr) return;
+  auto cu_iter =
+      unit_map_.find(dwarf_info_->getDebugAranges()->findAddress(start_addr));
+  if (cu_iter == unit_map_.end()) {
+    Addr2line::GetInlineStacksForRange(start_addr, end_addr, callback);
+    return;
+  }
+  const llvm::DWARFDebugLine::LineTable *line_table =
+      dwarf_info_->getLineTableForUnit(cu_iter->second);
+  llvm::DWARFDie subprogram =
+      cu_iter->second->getSubroutineForAddress(start_addr);
+  // The sweep below relies on all addresses being in the same subprogram.
+  // Anything else, e.g. a symbol spanning several functions, takes the slow
+  // path.
+  if (line_table == nullptr || !subprogram.isValid() ||
+      !RangesCover(subprogram, start_addr, end_addr)) {
+    Addr2line::GetInlineStacksForRange(start_addr, end_addr, callback);
+    return;
+  }
+
+  // The inline stack of an address only depends on its line table row and its
+  // inlined chain, so it is constant between any two consecutive boundaries.
+  std::vector<uint64_t> boundaries = {start_addr, end_addr};
+  std::vector<uint32_t> rows;
+  if (line_table->lookupAddressRange(
+          {start_addr, llvm::object::SectionedAddress::UndefSection},
+          end_addr - start_addr, rows)) {
+    for (uint32_t row : rows) {
+      boundaries.push_back(line_table->Rows[row].Address.Address);
+      if (row + 1 < line_table->Rows.size())
+        boundaries.push_back(line_table->Rows[row + 1].Address.Address);
+    }
+  }
+  AppendInlinedSubroutineBoundaries(subprogram, &boundaries);
+  std::sort(boundaries.begin(), boundaries.end());
+  boundaries.erase(std::unique(boundaries.begin(), boundaries.end()),
+                   boundaries.end());
+
+  // Visit the ranges between consecutive boundaries in [start_addr, end_addr].
+  auto begin = std::lower_bound(boundaries.begin(), boundaries.end(),
+                                start_addr);
+  auto end = std::upper_bound(begin, boundaries.end(), end_addr);
+  for (auto it = begin; std::next(it) != end; ++it) {
+    SourceStack stack;
+    GetInlineStack(*it, &stack);
+    callback(*it, *std::next(it), stack);
+  }
+}
 }  // namespace devtools_crosstool_autofdo
@@ -7,16 +7,21 @@
 #define AUTOFDO_ADDR2LINE_H_
 
 #include <cstdint>
+#include <functional>
 #include <map>
+#include <memory>
 #include <string>
 
 #include "base/integral_types.h"
 #include "base/macros.h"
 #include "source_info.h"
+#include "symbolize/sampled_functions.h"
 #if defined(HAVE_LLVM)
 #include "llvm/DebugInfo/DWARF/DWARFContext.h"
 #include "llvm/Object/Binary.h"
 #include "llvm/Object/ObjectFile.h"
+#else
+#include "symbolize/dwarf2reader.h"
 #endif
 
 namespace devtools_crosstool_autofdo {
@@ -31,15 +36,40 @@ class Addr2line {
 
   static Addr2line *CreateWithSampledFunctions(
       const std::string &binary_name,
-      const std::map<uint64_t, uint64_t> *sampled_functions);
+      const SampledFunctions *sampled_functions);
 
   // Reads the binary to prepare necessary binary in data.
   // Returns True on success.
   virtual bool Prepare() = 0;
 
+  // Makes the const methods safe to call from multiple threads at once, by
+  // materializing any state that the queries would otherwise build lazily.
+  // Must be called after Prepare() and before the concurrent queries start;
+  // calling it again is cheap. Returns false if the implementation does not
+  // support concurrent queries, in which case the queries must be serialized.
+  virtual bool PrepareForConcurrentQueries() { return false; }
+
   // Stores the inline stack of ADDR in STACK.
   virtual void GetInlineStack(uint64_t addr, SourceStack *stack) const = 0;
 
+  // Called with consecutive, non-overlapping address ranges [BEGIN, END) that
+  // cover the queried range, where every address in [BEGIN, END) has the
+  // inline stack STACK.
+  using InlineStackRangeCallback = std::function<void(
+      uint64_t begin, uint64_t end, const SourceStack &stack)>;
+
+  // Calls CALLBACK for the inline stacks of all addresses in
+  // [START_ADDR, END_ADDR). The default implementation queries every address
+  // separately.
+  virtual void GetInlineStacksForRange(
+      uint64_t start_addr, uint64_t end_addr,
+      const InlineStackRangeCallback &callback) const;
+
+  // Returns an estimate of the bytes held by the line tables and inline
+  // stacks read from the binary, or 0 if the implementation does not track
+  // them.
+  virtual uint64_t MemoryUsage() const { return 0; }
+
  protected:
   std::string binary_name_;
 
@@ -52,15 +82,28 @@ class LLVMAddr2line : public Addr2line {
  public:
   explicit LLVMAddr2line(const std::string &binary_name);
   bool Prepare() override;
+  // Eagerly parses everything that is otherwise lazily parsed by the queries,
+  // i.e. the address ranges, line tables and DIEs of all compile units and
+  // their split DWARF units, and the address to DIE maps of the units.
+  bool PrepareForConcurrentQueries() override;
   void GetInlineStack(uint64_t address, SourceStack *stack) const override;
+  // Only queries the inline stack of the start of every line table row and
+  // inlined subroutine range in [START_ADDR, END_ADDR), since the stack
+  // cannot change in between.
+  void GetInlineStacksForRange(
+      uint64_t start_addr, uint64_t end_addr,
+      const InlineStackRangeCallback &callback) const override;
 
  private:
   // map from cu_offset to the CompileUnit.
   std::map<uint32_t, llvm::DWARFUnit *> unit_map_;
   llvm::object::OwningBinary<llvm::object::ObjectFile> binary_;
   std::unique_ptr<llvm::DWARFContext> dwarf_info_;
+  bool prepared_for_concurrent_queries_ = false;
 };
 #else
+class AbbrevTableCache;
+class DwpFile;
 class AddressQuery;
 class InlineStackHandler;
 class LineIdentifier;
@@ -70,16 +113,48 @@ class AddressToLineMap;
 class Google3Addr2line : public Addr2line {
  public:
   explicit Google3Addr2line(const string &binary_name,
-                            const std::map<uint64_t, uint64_t> *sampled_functions);
+                            const SampledFunctions *sampled_functions);
   virtual ~Google3Addr2line();
   virtual bool Prepare();
+  // The line map and inline stacks are fully built by Prepare() and only read
+  // by the queries.
+  bool PrepareForConcurrentQueries() override { return true; }
   virtual void GetInlineStack(uint64_t address, SourceStack *stack) const;
+  uint64_t MemoryUsage() const override;
 
  private:
+  // Reads the compilation unit at OFFSET in .debug_info into line_map_ and
+  // inline_stack_handler_. Returns the number of bytes to advance to the
+  // next unit and sets MALFORMED if the unit could not be read. The
+  // abbreviation table of the unit is taken from ABBREV_CACHE, and its
+  // split DWARF from DWP_FILE if it is not in a .dwo file.
+  uint64_t ReadCompilationUnit(const SectionMap &sections, uint64_t offset,
+                               ByteReader *reader,
+                               AbbrevTableCache *abbrev_cache,
+                               DwpFile *dwp_file, bool *malformed);
+
+  // Returns the start and end offsets of the compilation units whose
+  // .debug_aranges ranges contain no sampled function.
+  std::map<uint64_t, uint64_t> GetUnitsWithoutSampledFunctions(
+      const SectionMap &sections);
+
+  // Reads the units in SKIPPED_UNITS that the subprograms read so far
+  // refer to, and removes them from SKIPPED_UNITS.
+  void ReadReferencedUnits(const SectionMap &sections, ByteReader *reader,
+                           AbbrevTableCache *abbrev_cache, DwpFile *dwp_file,
+                           std::map<uint64_t, uint64_t> *skipped_units);
+
+  // Reads the compilation units in .debug_info on num_threads threads and
+  // merges them into line_map_ and inline_stack_handler_ in section order.
+  // The units in SKIPPED_UNITS are not read. The workers share DWP_FILE.
+  void ParseCompilationUnitsInParallel(
+      const SectionMap &sections, int address_size, int num_threads,
+      const std::map<uint64_t, uint64_t> &skipped_units, DwpFile *dwp_file);
+
   AddressToLineMap *line_map_;
   InlineStackHandler *inline_stack_handler_;
-  ElfReader *elf_;
-  const std::map<uint64_t, uint64_t> *sampled_functions_;
+  std::shared_ptr<ElfReader> elf_;
+  const SampledFunctions *sampled_functions_;
   DISALLOW_COPY_AND_ASSIGN(Google3Addr2line);
 };
 #endif
@@ -0,0 +1,240 @@
+// Microbenchmarks of the hot paths of profile generation, driven by the
+// binaries and perf data files in testdata/ and, to measure the scaling, by
+// synthetic programs. Run from the build directory, where the "prepare"
+// target links testdata/, for example with
+//   autofdo_benchmarks --benchmark_out=autofdo_benchmarks.json \
+//       --benchmark_out_format=json
+// or through the run_autofdo_benchmarks target, which does exactly that.
+
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "base/logging.h"
+#include "addr2line.h"
+#include "benchmark/benchmark.h"
+#include "gcov.h"
+#include "instruction_map.h"
+#include "llvm_profile_writer.h"
+#include "llvm_propeller_cfg.h"
+#include "llvm_propeller_code_layout.h"
+#include "llvm_propeller_code_layout_scorer.h"
+#include "llvm_propeller_file_perf_data_provider.h"
+#include "llvm_propeller_mock_whole_program_info.h"
+#include "llvm_propeller_node_chain_builder.h"
+#include "llvm_propeller_options.pb.h"
+#include "llvm_propeller_options_builder.h"
+#include "llvm_propeller_synthetic_workload.h"
+#include "perfdata_reader.h"
+#include "profile_creator.h"
+#include "profile_writer.h"
+#include "sample_reader.h"
+#include "symbol_map.h"
+#include "third_party/abseil/absl/flags/flag.h"
+#include "llvm/ProfileData/SampleProf.h"
+
+namespace devtools_crosstool_autofdo {
+namespace {
+
+std::string TestDataPath(const std::string &name) {
+  return "testdata/" + name;
+}
+
+// The text of testdata/test.binary, see symbol_map_test and
+// instruction_map_test for the functions in it.
+constexpr uint64_t kTestBinaryTextBegin = 0x401000;
+constexpr uint64_t kTestBinaryTextEnd = 0x406000;
+
+// A symbol map with the profile of testdata/llvm_function_samples.binary,
+// shared by the profile writer benchmarks.
+SymbolMap *GetProfiledSymbolMap() {
+  static SymbolMap *symbol_map = [] {
+    const std::string binary = TestDataPath("llvm_function_samples.binary");
+    ProfileCreator creator(binary);
+    CHECK(creator.ReadSample(TestDataPath("llvm_function_samples_perf.data"),
+                             "perf"));
+    auto *symbol_map = new SymbolMap(binary);
+    CHECK(creator.ComputeProfile(symbol_map));
+    return symbol_map;
+  }();
+  return symbol_map;
+}
+
+// Aggregates the LBR samples of propeller_sample.perfdata on as many threads
+// as the argument.
+void BM_AggregateLBR(benchmark::State &state) {
+  PerfDataReader reader;
+  BinaryPerfInfo binary_perf_info;
+  CHECK(reader.SelectBinaryInfo(TestDataPath("propeller_sample.bin"),
+                                &binary_perf_info.binary_info));
+  FilePerfDataProvider provider({TestDataPath("propeller_sample.perfdata")});
+  auto perf_data = provider.GetNext();
+  CHECK(perf_data.ok() && perf_data->has_value());
+  CHECK(reader.SelectPerfInfo(std::move(**perf_data), "", &binary_perf_info));
+  for (auto _ : state) {
+    LBRAggregation aggregation;
+    benchmark::DoNotOptimize(
+        reader.AggregateLBR(binary_perf_info, &aggregation, state.range(0)));
+    benchmark::DoNotOptimize(aggregation);
+  }
+  state.SetItemsProcessed(state.iterations() *
+                          binary_perf_info.lbr_samples.size());
+}
+BENCHMARK(BM_AggregateLBR)->Arg(1)->Arg(4)->UseRealTime();
+
+// Looks up the symbol of every address of the text of test.binary.
+void BM_GetSymbolInfoByAddr(benchmark::State &state) {
+  SymbolMap symbol_map(TestDataPath("test.binary"));
+  for (auto _ : state) {
+    for (uint64_t addr = kTestBinaryTextBegin; addr < kTestBinaryTextEnd;
+         ++addr) {
+      const std::string *name = nullptr;
+      uint64_t start_addr, end_addr;
+      benchmark::DoNotOptimize(
+          symbol_map.GetSymbolInfoByAddr(addr, &name, &start_addr, &end_addr));
+    }
+  }
+  state.SetItemsProcessed(state.iterations() *
+                          (kTestBinaryTextEnd - kTestBinaryTextBegin));
+}
+BENCHMARK(BM_GetSymbolInfoByAddr);
+
+// Symbolizes every address of the text of test.binary.
+void BM_GetInlineStack(benchmark::State &state) {
+  std::unique_ptr<Addr2line> addr2line(
+      Addr2line::Create(TestDataPath("test.binary")));
+  CHECK(addr2line != nullptr);
+  for (auto _ : state) {
+    for (uint64_t addr = kTestBinaryTextBegin; addr < kTestBinaryTextEnd;
+         ++addr) {
+      SourceStack stack;
+      addr2line->GetInlineStack(addr, &stack);
+      benchmark::DoNotOptimize(stack);
+    }
+  }
+  state.SetItemsProcessed(state.iterations() *
+                          (kTestBinaryTextEnd - kTestBinaryTextBegin));
+}
+BENCHMARK(BM_GetInlineStack);
+
+// Builds the instruction map of longest_match in test.binary.
+void BM_BuildPerFunctionInstructionMap(benchmark::State &state) {
+  std::unique_ptr<Addr2line> addr2line(
+      Addr2line::Create(TestDataPath("test.binary")));
+  CHECK(addr2line != nullptr);
+  SymbolMap symbol_map(TestDataPath("test.binary"));
+  symbol_map.AddSymbol("longest_match");
+  for (auto _ : state) {
+    InstructionMap inst_map(addr2line.get(), &symbol_map);
+    inst_map.BuildPerFunctionInstructionMap("longest_match", 0x401680,
+                                            0x401871);
+    benchmark::DoNotOptimize(inst_map.size());
+  }
+}
+BENCHMARK(BM_BuildPerFunctionInstructionMap);
+
+// Builds the intra-function chains of every hot CFG of
+// propeller_sample.protobuf.
+void BM_BuildChains(benchmark::State &state) {
+  const PropellerOptions options(PropellerOptionsBuilder().AddPerfNames(
+      TestDataPath("propeller_sample.protobuf")));
+  MockPropellerWholeProgramInfo whole_program_info(options);
+  CHECK(whole_program_info.CreateCfgs(CfgCreationMode::kAllFunctions).ok());
+  const std::vector<ControlFlowGraph *> cfgs = whole_program_info.GetHotCfgs();
+  const PropellerCodeLayoutScorer scorer(options.code_layout_params());
+  for (auto _ : state) {
+    CodeLayoutStats stats;
+    for (ControlFlowGraph *cfg : cfgs) {
+      benchmark::DoNotOptimize(
+          NodeChainBuilder::CreateNodeChainBuilder(scorer, {cfg}, stats)
+              .BuildChains());
+    }
+  }
+  state.SetItemsProcessed(state.iterations() * cfgs.size());
+}
+BENCHMARK(BM_BuildChains);
+
+// Builds the intra-function chains of every cfg of a synthetic program with
+// as many functions as the argument.
+void BM_BuildChainsSynthetic(benchmark::State &state) {
+  SyntheticWorkloadOptions workload_options;
+  workload_options.num_functions = state.range(0);
+  const PropellerOptions options;
+  SyntheticPropellerWholeProgramInfo whole_program_info(options,
+                                                        workload_options);
+  CHECK(whole_program_info.CreateCfgs(CfgCreationMode::kAllFunctions).ok());
+  const std::vector<ControlFlowGraph *> cfgs = whole_program_info.GetHotCfgs();
+  const PropellerCodeLayoutScorer scorer(options.code_layout_params());
+  for (auto _ : state) {
+    CodeLayoutStats stats;
+    for (ControlFlowGraph *cfg : cfgs) {
+      benchmark::DoNotOptimize(
+          NodeChainBuilder::CreateNodeChainBuilder(scorer, {cfg}, stats)
+              .BuildChains());
+    }
+  }
+  state.SetItemsProcessed(state.iterations() * cfgs.size());
+}
+BENCHMARK(BM_BuildChainsSynthetic)
+    ->RangeMultiplier(10)
+    ->Range(1000, 100000)
+    ->Unit(benchmark::kMillisecond);
+
+// Reads the text samples of a synthetic program with as many functions as
+// the argument.
+void BM_ReadTextSamplesSynthetic(benchmark::State &state) {
+  SyntheticWorkloadOptions workload_options;
+  workload_options.num_functions = state.range(0);
+  const std::string profile = "autofdo_benchmarks.samples.txt";
+  TextSampleReaderWriter writer(profile);
+  GenerateSyntheticSamples(workload_options, &writer);
+  CHECK(writer.Write());
+  for (auto _ : state) {
+    TextSampleReaderWriter reader(profile);
+    CHECK(reader.ReadAndSetTotalCount());
+    benchmark::DoNotOptimize(reader.GetTotalCount());
+  }
+}
+BENCHMARK(BM_ReadTextSamplesSynthetic)
+    ->RangeMultiplier(10)
+    ->Range(1000, 100000)
+    ->Unit(benchmark::kMillisecond);
+
+// Writes the profile of llvm_function_samples.binary in the gcov format.
+void BM_AutoFDOProfileWriterWriteToFile(benchmark::State &state) {
+  const SymbolMap *symbol_map = GetProfiledSymbolMap();
+  for (auto _ : state) {
+    AutoFDOProfileWriter writer(symbol_map,
+                                absl::GetFlag(FLAGS_gcov_version));
+    CHECK(writer.WriteToFile("autofdo_benchmarks.afdo"));
+  }
+}
+BENCHMARK(BM_AutoFDOProfileWriterWriteToFile);
+
+// Converts and writes the profile of llvm_function_samples.binary in the
+// extensible binary LLVM format.
+void BM_LLVMProfileBuilderWrite(benchmark::State &state) {
+  const SymbolMap *symbol_map = GetProfiledSymbolMap();
+  const std::string output_filename = "autofdo_benchmarks.llvm.afdo";
+  StringIndexMap name_table;
+  StringTableUpdater::Update(*symbol_map, &name_table);
+  for (auto _ : state) {
+    LLVMProfileWriter writer(llvm::sampleprof::SPF_Ext_Binary);
+    llvm::sampleprof::SampleProfileWriter *sample_profile_writer =
+        writer.CreateSampleWriter(output_filename);
+    CHECK(sample_profile_writer != nullptr);
+    CHECK(LLVMProfileBuilder::Write(output_filename,
+                                    llvm::sampleprof::SPF_Ext_Binary,
+                                    *symbol_map, name_table,
+                                    sample_profile_writer));
+  }
+}
+BENCHMARK(BM_LLVMProfileBuilderWrite);
+
+}  // namespace
+}  // namespace devtools_crosstool_autofdo
+
+BENCHMARK_MAIN();
@@ -1,6 +1,8 @@
 #ifndef AUTOFDO_BASE_PROFILE_READER_H_
 #define AUTOFDO_BASE_PROFILE_READER_H_
 
+#include <cmath>
+#include <cstdint>
 #include <string>
 
 namespace devtools_crosstool_autofdo {
@@ -9,6 +11,19 @@ class ProfileReader {
   virtual ~ProfileReader() {}
 
   virtual bool ReadFromFile(const std::string &output_file) = 0;
+
+  // Makes ReadFromFile scale every count it reads by WEIGHT, rounded like
+  // SymbolMap::UpdateWithRatio, e.g. to weight the inputs of a merge without
+  // another pass over the symbols.
+  void set_weight(double weight) { weight_ = weight; }
+
+ protected:
+  uint64_t ScaleCount(uint64_t count) const {
+    return weight_ == 1 ? count : roundl(count * weight_);
+  }
+
+ private:
+  double weight_ = 1;
 };
 }  // namespace devtools_crosstool_autofdo
 
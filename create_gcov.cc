@@ -18,8 +18,12 @@
 //   8. perflab --arch=ikaria_westmere --label=opt table k8
 
 #include "base/commandlineflags.h"
+#include "base/logging.h"
 #include "gcov.h"
 #include "profile_creator.h"
+#include "profile_reader.h"
+#include "symbol_map.h"
+#include "trace_events.h"
 #include "third_party/abseil/absl/flags/flag.h"
 #include "third_party/abseil/absl/flags/parse.h"
 #include "third_party/abseil/absl/flags/usage.h"
@@ -32,20 +36,47 @@ ABSL_FLAG(std::string, gcov, "fbdata.afdo",
               "Output file name");
 ABSL_FLAG(std::string, binary, "data.binary",
               "Binary file name");
+ABSL_FLAG(std::string, base_profile, "",
+          "Profile previously created by create_gcov for the same binary. If "
+          "set, the profile of the samples in --profile is added to it, so "
+          "that only the new samples are symbolized.");
+ABSL_FLAG(std::string, trace_out, "",
+          "If set, record the spans of the pipeline stages and of their "
+          "worker tasks, and write them to this file in the Chrome trace event "
+          "JSON format, which chrome://tracing and Perfetto load.");
 
 int main(int argc, char **argv) {
   absl::SetProgramUsageMessage(argv[0]);
   absl::ParseCommandLine(argc, argv);
+  const std::string trace_out = absl::GetFlag(FLAGS_trace_out);
+  if (!trace_out.empty())
+    devtools_crosstool_autofdo::TraceRecorder::GetInstance().Start();
 
   devtools_crosstool_autofdo::AutoFDOProfileWriter writer(
       absl::GetFlag(FLAGS_gcov_version));
   devtools_crosstool_autofdo::ProfileCreator creator(
       absl::GetFlag(FLAGS_binary));
-  if (creator.CreateProfile(absl::GetFlag(FLAGS_profile),
-                            absl::GetFlag(FLAGS_profiler), &writer,
-                            absl::GetFlag(FLAGS_gcov))) {
-    return 0;
-  } else {
+  devtools_crosstool_autofdo::SymbolMap base_profile;
+  if (!absl::GetFlag(FLAGS_base_profile).empty()) {
+    devtools_crosstool_autofdo::AutoFDOProfileReader reader(&base_profile,
+                                                            true);
+    if (!reader.ReadFromFile(absl::GetFlag(FLAGS_base_profile))) {
+      LOG(ERROR) << "Failed to read --base_profile="
+                 << absl::GetFlag(FLAGS_base_profile);
+      return -1;
+    }
+    creator.set_base_profile(&base_profile);
+  }
+  if (!creator.CreateProfile(absl::GetFlag(FLAGS_profile),
+                             absl::GetFlag(FLAGS_profiler), &writer,
+                             absl::GetFlag(FLAGS_gcov))) {
+    return -1;
+  }
+  if (!trace_out.empty() &&
+      !devtools_crosstool_autofdo::TraceRecorder::GetInstance().WriteJson(
+          trace_out)) {
+    LOG(ERROR) << "Failed to write the trace to '" << trace_out << "'.";
     return -1;
   }
+  return 0;
 }
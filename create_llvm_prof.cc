@@ -9,15 +9,28 @@
 #include <fstream>
 #include <memory>
 #include <string>
+#include <vector>
 
 #include "base/commandlineflags.h"
 #include "base/logging.h"
+#include "llvm_profile_reader.h"
 #include "llvm_profile_writer.h"
+#include "llvm_propeller_file_perf_data_provider.h"
 #include "llvm_propeller_options.pb.h"
 #include "llvm_propeller_options_builder.h"
+#include "llvm_propeller_perf_data_provider.h"
+#include "llvm_propeller_prefetching_perf_data_provider.h"
 #include "llvm_propeller_profile_writer.h"
+#include "llvm_propeller_stream_perf_data_provider.h"
+#include "parallel_for.h"
 #include "profile_creator.h"
+#include "profile_server.h"
+#include "stage_metrics.h"
+#include "trace_events.h"
+#include "google/protobuf/text_format.h"
 #include "third_party/abseil/absl/status/status.h"
+#include "third_party/abseil/absl/status/statusor.h"
+#include "third_party/abseil/absl/strings/str_cat.h"
 #include "third_party/abseil/absl/strings/str_split.h"
 #include "third_party/abseil/absl/flags/parse.h"
 #include "third_party/abseil/absl/flags/usage.h"
@@ -26,15 +39,25 @@ ABSL_FLAG(std::string, profile, "perf.data",
           "Input profile file name. When --format=propeller, this accepts "
           "multiple profile file names concatnated by ';' and if the file name "
           "has prefix \"@\", then the profile is treated as a list file whose "
-          "lines are interpreted as input profile paths.");
+          "lines are interpreted as input profile paths. It also accepts "
+          "pipe-mode perf data (perf record -o -) streamed from stdin with "
+          "\"-\" or from a Unix domain socket with \"unix:<path>\".");
 ABSL_FLAG(std::string, profiler, "perf",
-          "Input profile type. Possible values: perf, text, or prefetch");
+          "Input profile type. Possible values: perf, text, binary, or "
+          "prefetch");
 ABSL_FLAG(std::string, prefetch_hints, "", "Input cache prefetch hints");
-ABSL_FLAG(std::string, out, "", "Output profile file name");
+ABSL_FLAG(std::string, out, "",
+          "Output profile file name. When --binary lists multiple binaries, "
+          "this lists their output file names in the same order, separated by "
+          "';'.");
 ABSL_FLAG(std::string, gcov, "",
           "Output profile file name. Alias for --out; used for "
           "flag compatibility with create_gcov");
-ABSL_FLAG(std::string, binary, "a.out", "Binary file name");
+ABSL_FLAG(std::string, binary, "a.out",
+          "Binary file name. When --format=propeller, this accepts multiple "
+          "binary file names separated by ';', e.g. an executable and the "
+          "shared objects it loads. Their profiles are then created from a "
+          "single pass over the perf data.");
 // FIXME(dnovillo) - This should default to 'binary'.  However, the binary
 // representation is currently version locked to the latest LLVM upstream
 // sources. This may cause incompatibilities with the currently released version
@@ -48,13 +71,51 @@ ABSL_FLAG(std::string, format, "text",
           "easily to be extended. propeller format is used exclusively by "
           "post linker optimizer.");
 ABSL_FLAG(std::string, propeller_symorder, "",
-          "Propeller symbol ordering output file name.");
+          "Propeller symbol ordering output file name. When --binary lists "
+          "multiple binaries, this lists one file name per binary, separated "
+          "by ';'.");
 ABSL_FLAG(std::string, propeller_cfg_dump_dir, "",
           "Directory for dumping the cfgs. The directory will be created if "
           "does not exist.");
+ABSL_FLAG(uint32_t, propeller_cfg_dump_max_functions, 0,
+          "If non-zero, only dump the cfgs of this many functions with the "
+          "highest entry frequencies into --propeller_cfg_dump_dir.");
+ABSL_FLAG(std::string, propeller_cfg_snapshot, "",
+          "Propeller cfg snapshot input file name. When set, the cfgs are read "
+          "from this file instead of from --binary and --profile, so only the "
+          "code layout is recomputed.");
+ABSL_FLAG(std::string, propeller_cfg_snapshot_out, "",
+          "Propeller cfg snapshot output file name. When set, the cfgs created "
+          "from the profiles are written into this file for later use with "
+          "--propeller_cfg_snapshot.");
+ABSL_FLAG(std::string, propeller_layout_sweep, "",
+          "Propeller code layout configurations to try, concatenated by ';'. "
+          "Each configuration is a text-format PropellerCodeLayoutParameters "
+          "message with fields separated by spaces, e.g. "
+          "\"forward_jump_distance:512 backward_jump_distance:340\". Fields "
+          "unset in a configuration take their values from the other flags. "
+          "Only the layout with the highest score under the other flags is "
+          "written.");
 ABSL_FLAG(uint32_t, propeller_chain_split_threshold, 0,
           "Maximum chain length (in number of nodes) for which propeller tries "
           "splitting and remerging at every splitting position.");
+ABSL_FLAG(uint32_t, propeller_chain_split_budget, 0,
+          "Maximum number of chain splitting candidates propeller evaluates "
+          "for each function. Once exceeded, chains of that function are only "
+          "merged without splitting. 0 means no limit.");
+ABSL_FLAG(uint32_t, propeller_hot_text_page_size, 0,
+          "Size of the pages the hot text is mapped onto, e.g. 2097152 for "
+          "2MB huge pages. When non-zero, propeller orders the hot clusters "
+          "to fit the hottest code in as few pages as possible.");
+ABSL_FLAG(bool, propeller_compute_original_layout_scores, true,
+          "Whether propeller computes the ext-tsp scores of the original "
+          "layout to report the change in score. Turning this off saves a "
+          "pass over all the CFGs.");
+ABSL_FLAG(double, propeller_chain_assembly_pruning_fraction, 0,
+          "When non-zero, propeller does not consider merging chains whose "
+          "best possible score gain is below this fraction of the best score "
+          "gain found so far, which speeds up the layout of large functions "
+          "at some cost in layout score.");
 ABSL_FLAG(bool, propeller_chain_split, false,
           "Whether propeller is allowed to split chains before merging with "
           "other chains.");
@@ -67,6 +128,50 @@ ABSL_FLAG(bool, propeller_inter_function_ordering, false,
           "Whether propeller should reorder basic blocks inter-procedurally, "
           "i.e., basic blocks of a function can be interleaved by basic blocks "
           "from other functions.");
+ABSL_FLAG(uint32_t, propeller_lbr_aggregation_threads, 1,
+          "Number of threads used by propeller to aggregate the LBR samples "
+          "of each perf data file.");
+ABSL_FLAG(uint32_t, propeller_perf_parse_threads, 1,
+          "Number of perf data files propeller reads and aggregates "
+          "concurrently when multiple files are given in --profile.");
+ABSL_FLAG(uint32_t, propeller_cfg_creation_threads, 1,
+          "Number of threads used by propeller to create the control flow "
+          "graphs of different functions concurrently.");
+ABSL_FLAG(uint32_t, propeller_output_threads, 1,
+          "Number of threads used by propeller to format the cluster output "
+          "file and the cfg dumps.");
+ABSL_FLAG(double, propeller_lbr_sample_fraction, 1.0,
+          "Fraction of the LBR samples of each perf data file propeller "
+          "aggregates, with counts scaled to stand for all samples. It is "
+          "rounded to 1/N for an integer N, and one sample of every N "
+          "consecutive samples is aggregated.");
+ABSL_FLAG(uint64_t, propeller_lbr_sample_seed, 0,
+          "Seed selecting the samples aggregated with "
+          "--propeller_lbr_sample_fraction.");
+ABSL_FLAG(bool, propeller_estimate_lbr_sample_fraction_error, false,
+          "With --propeller_lbr_sample_fraction, report how much the branch "
+          "counters are estimated to differ from those of all samples.");
+ABSL_FLAG(std::string, propeller_lbr_aggregation_cache_dir, "",
+          "Directory caching the aggregated LBR samples of the perf data "
+          "files, keyed by their contents, the binary's build id and the mmap "
+          "selection. Later runs on the same perf data and binary read the "
+          "aggregation from it instead of decoding the perf data again.");
+ABSL_FLAG(int64_t, propeller_stream_chunk_size, 256 << 20,
+          "Number of bytes of events propeller reads from streamed pipe-mode "
+          "perf data before aggregating them.");
+ABSL_FLAG(uint32_t, propeller_prefetch_perf_data, 0,
+          "Number of perf.data files propeller reads ahead on a background "
+          "thread while earlier ones are parsed. 0 reads every file when it is "
+          "parsed.");
+ABSL_FLAG(int64_t, propeller_prefetch_memory_budget, int64_t{4} << 30,
+          "Number of bytes of perf data that --propeller_prefetch_perf_data "
+          "may hold in memory before it is parsed. The budget is exceeded by "
+          "at most one file.");
+ABSL_FLAG(uint32_t, propeller_layout_threads, 1,
+          "Number of threads used by propeller to lay out the basic blocks of "
+          "different functions concurrently. With "
+          "--propeller_inter_function_ordering, the functions connected by "
+          "hot calls and branches are laid out together.");
 ABSL_FLAG(uint32_t, propeller_forward_jump_distance, 1024,
           "Distance threshold to use for forward branches in propeller code "
           "layout score computation.");
@@ -80,13 +185,38 @@ ABSL_FLAG(
     "executable name, use this option to select the mmap events we are "
     "interested in. Also note, \"--profiled_binary_name\" should have the same "
     "bits as the file given by \"--binary\" but may have different name with "
-    "it.");
+    "it. When --binary lists multiple binaries, this lists one name per "
+    "binary, separated by ';'.");
 ABSL_FLAG(bool, prof_sym_list, false,
           "Generate profile symbol list from the binary. The symbol list will "
           "be kept and saved in the profile. The option can only be enabled "
           "when --format=extbinary.");
+ABSL_FLAG(std::string, base_profile, "",
+          "Profile previously created by create_llvm_prof for the same binary. "
+          "If set, the profile of the samples in --profile is added to it, so "
+          "that only the new samples are symbolized. Not supported with "
+          "--format=propeller.");
 ABSL_FLAG(bool, http, false,
           "Enable http to server statusz requests.");
+ABSL_FLAG(std::string, serve_socket, "",
+          "If set, run as a server listening on this Unix domain socket "
+          "instead of creating a single profile. Every connection sends one "
+          "line of space-separated key=value pairs, with the keys binary, "
+          "profile, profiler, out, format and prof_sym_list, and reads back OK "
+          "or ERROR once the profile is written. The symbols and debug info of "
+          "every binary are only read for the first request on its build id. "
+          "A connection sending \"shutdown\" stops the server. Propeller "
+          "profiles are not supported in this mode.");
+ABSL_FLAG(int32_t, serve_max_binaries, 8,
+          "Maximum number of binaries whose symbolization state the server "
+          "started by --serve_socket keeps resident.");
+ABSL_FLAG(std::string, stage_metrics_out, "",
+          "If set, write the wall time and memory usage of every pipeline "
+          "stage to this file as JSON.");
+ABSL_FLAG(std::string, trace_out, "",
+          "If set, record the spans of the pipeline stages and of their "
+          "worker tasks, and write them to this file in the Chrome trace event "
+          "JSON format, which chrome://tracing and Perfetto load.");
 
 // While reading perfdata file, we use build id to match a binary and its pids
 // in perf file. We may also want to use file name to do the match, which is
@@ -108,6 +238,7 @@ ABSL_FLAG(bool, propeller_layout_only, false,
           "--propeller_split_only. Only valid when --format=propeller.");
 
 devtools_crosstool_autofdo::PropellerOptions CreatePropellerOptionsFromFlags() {
+  using devtools_crosstool_autofdo::GetStageThreads;
   devtools_crosstool_autofdo::PropellerOptionsBuilder option_builder;
   std::string pstr = absl::GetFlag(FLAGS_profile);
   if (!pstr.empty() && pstr[0] == '@') {
@@ -126,6 +257,30 @@ devtools_crosstool_autofdo::PropellerOptions CreatePropellerOptionsFromFlags() {
   if (!absl::GetFlag(FLAGS_propeller_cfg_dump_dir).empty()) {
     option_builder.SetCfgDumpDirName(
         absl::GetFlag(FLAGS_propeller_cfg_dump_dir));
+    option_builder.SetCfgDumpMaxFunctions(
+        absl::GetFlag(FLAGS_propeller_cfg_dump_max_functions));
+  }
+  if (!absl::GetFlag(FLAGS_propeller_cfg_snapshot).empty()) {
+    option_builder.SetCfgSnapshotName(
+        absl::GetFlag(FLAGS_propeller_cfg_snapshot));
+  }
+  if (!absl::GetFlag(FLAGS_propeller_cfg_snapshot_out).empty()) {
+    option_builder.SetCfgSnapshotOutName(
+        absl::GetFlag(FLAGS_propeller_cfg_snapshot_out));
+  }
+  if (!absl::GetFlag(FLAGS_propeller_lbr_aggregation_cache_dir).empty()) {
+    option_builder.SetLbrAggregationCacheDir(
+        absl::GetFlag(FLAGS_propeller_lbr_aggregation_cache_dir));
+  }
+  for (absl::string_view sweep_params :
+       absl::StrSplit(absl::GetFlag(FLAGS_propeller_layout_sweep), ';',
+                      absl::SkipWhitespace())) {
+    devtools_crosstool_autofdo::PropellerCodeLayoutParameters params;
+    CHECK(google::protobuf::TextFormat::ParseFromString(
+        std::string(sweep_params), &params))
+        << "Invalid --propeller_layout_sweep configuration: '" << sweep_params
+        << "'.";
+    option_builder.AddCodeLayoutSweepParams(params);
   }
 
   return devtools_crosstool_autofdo::PropellerOptions(
@@ -138,6 +293,14 @@ devtools_crosstool_autofdo::PropellerOptions CreatePropellerOptionsFromFlags() {
               absl::GetFlag(FLAGS_propeller_chain_split))
           .SetCodeLayoutParamsChainSplitThreshold(
               absl::GetFlag(FLAGS_propeller_chain_split_threshold))
+          .SetCodeLayoutParamsChainSplitBudget(
+              absl::GetFlag(FLAGS_propeller_chain_split_budget))
+          .SetCodeLayoutParamsHotTextPageSize(
+              absl::GetFlag(FLAGS_propeller_hot_text_page_size))
+          .SetCodeLayoutParamsComputeOriginalScores(
+              absl::GetFlag(FLAGS_propeller_compute_original_layout_scores))
+          .SetCodeLayoutParamsChainAssemblyPruningFraction(
+              absl::GetFlag(FLAGS_propeller_chain_assembly_pruning_fraction))
           .SetCodeLayoutParamsBackwardJumpDistance(
               absl::GetFlag(FLAGS_propeller_backward_jump_distance))
           .SetCodeLayoutParamsForwardJumpDistance(
@@ -150,14 +313,169 @@ devtools_crosstool_autofdo::PropellerOptions CreatePropellerOptionsFromFlags() {
               !absl::GetFlag(FLAGS_propeller_layout_only))
           .SetCodeLayoutParamsInterFunctionReordering(
               absl::GetFlag(FLAGS_propeller_inter_function_ordering))
+          .SetCodeLayoutParamsLayoutThreads(
+              GetStageThreads(FLAGS_propeller_layout_threads))
+          .SetLbrAggregationThreads(
+              GetStageThreads(FLAGS_propeller_lbr_aggregation_threads))
+          .SetPerfParseThreads(
+              GetStageThreads(FLAGS_propeller_perf_parse_threads))
+          .SetCfgCreationThreads(
+              GetStageThreads(FLAGS_propeller_cfg_creation_threads))
+          .SetOutputThreads(GetStageThreads(FLAGS_propeller_output_threads))
+          .SetJobs(absl::GetFlag(FLAGS_jobs))
+          .SetHotCoverage(absl::GetFlag(FLAGS_hot_coverage))
+          .SetLbrSampleFraction(
+              absl::GetFlag(FLAGS_propeller_lbr_sample_fraction))
+          .SetLbrSampleSeed(absl::GetFlag(FLAGS_propeller_lbr_sample_seed))
+          .SetEstimateLbrSampleFractionError(absl::GetFlag(
+              FLAGS_propeller_estimate_lbr_sample_fraction_error))
           .SetHttp(absl::GetFlag(FLAGS_http))
           .SetVerboseClusterOutput(
               absl::GetFlag(FLAGS_propeller_verbose_cluster_output)));
 }
 
+// Returns the provider of the perf data of `options`: a stream if its only
+// perf name is a stream source, the files of its perf names otherwise.
+absl::StatusOr<std::unique_ptr<devtools_crosstool_autofdo::PerfDataProvider>>
+CreateUnbufferedPerfDataProvider(
+    const devtools_crosstool_autofdo::PropellerOptions &options) {
+  using devtools_crosstool_autofdo::StreamPerfDataProvider;
+  if (options.perf_names_size() == 1 &&
+      StreamPerfDataProvider::IsStreamSource(options.perf_names(0))) {
+    return StreamPerfDataProvider::Create(
+        options.perf_names(0),
+        absl::GetFlag(FLAGS_propeller_stream_chunk_size));
+  }
+  for (const std::string &perf_name : options.perf_names()) {
+    if (StreamPerfDataProvider::IsStreamSource(perf_name)) {
+      return absl::InvalidArgumentError(
+          absl::StrCat("Stream '", perf_name,
+                       "' cannot be combined with other profiles."));
+    }
+  }
+  return std::make_unique<devtools_crosstool_autofdo::FilePerfDataProvider>(
+      std::vector<std::string>(options.perf_names().begin(),
+                               options.perf_names().end()));
+}
+
+// Returns the provider of the perf data of `options`, reading ahead as
+// requested by --propeller_prefetch_perf_data.
+absl::StatusOr<std::unique_ptr<devtools_crosstool_autofdo::PerfDataProvider>>
+CreatePerfDataProvider(
+    const devtools_crosstool_autofdo::PropellerOptions &options) {
+  absl::StatusOr<std::unique_ptr<devtools_crosstool_autofdo::PerfDataProvider>>
+      provider = CreateUnbufferedPerfDataProvider(options);
+  const uint32_t prefetch = absl::GetFlag(FLAGS_propeller_prefetch_perf_data);
+  if (!provider.ok() || prefetch == 0) return provider;
+  return std::make_unique<
+      devtools_crosstool_autofdo::PrefetchingPerfDataProvider>(
+      *std::move(provider), prefetch,
+      absl::GetFlag(FLAGS_propeller_prefetch_memory_budget));
+}
+
+// Writes the collected stage metrics to --stage_metrics_out and the trace to
+// --trace_out, if given.
+bool WriteStageMetrics() {
+  const std::string file_name = absl::GetFlag(FLAGS_stage_metrics_out);
+  if (!file_name.empty() &&
+      !devtools_crosstool_autofdo::StageMetricsRegistry::GetInstance()
+           .WriteJson(file_name)) {
+    LOG(ERROR) << "Failed to write stage metrics to '" << file_name << "'.";
+    return false;
+  }
+  const std::string trace_file_name = absl::GetFlag(FLAGS_trace_out);
+  if (!trace_file_name.empty() &&
+      !devtools_crosstool_autofdo::TraceRecorder::GetInstance().WriteJson(
+          trace_file_name)) {
+    LOG(ERROR) << "Failed to write the trace to '" << trace_file_name << "'.";
+    return false;
+  }
+  return true;
+}
+
+// Batch mode of --format=propeller: creates the profiles of all the binaries
+// listed in --binary from a single pass over the perf data. Returns the exit
+// code.
+int GeneratePropellerProfilesOfBinariesFromFlags() {
+  const devtools_crosstool_autofdo::PropellerOptions options =
+      CreatePropellerOptionsFromFlags();
+  const std::vector<std::string> binaries =
+      absl::StrSplit(absl::GetFlag(FLAGS_binary), ';');
+  // Splits `value`, the value of --`flag_name`, which must be empty or list
+  // one name per binary.
+  auto split_per_binary =
+      [&binaries](absl::string_view flag_name, const std::string &value,
+                  std::vector<std::string> &result) {
+        if (value.empty()) {
+          result.assign(binaries.size(), "");
+          return true;
+        }
+        result = absl::StrSplit(value, ';');
+        if (result.size() == binaries.size()) return true;
+        LOG(ERROR) << "--" << flag_name << " lists " << result.size()
+                   << " names for " << binaries.size() << " binaries.";
+        return false;
+      };
+  std::vector<std::string> outs, symorders, profiled_binary_names;
+  if (!split_per_binary("out", absl::GetFlag(FLAGS_out), outs) ||
+      !split_per_binary("propeller_symorder",
+                        absl::GetFlag(FLAGS_propeller_symorder), symorders) ||
+      !split_per_binary("profiled_binary_name",
+                        absl::GetFlag(FLAGS_profiled_binary_name),
+                        profiled_binary_names)) {
+    return 1;
+  }
+
+  std::vector<devtools_crosstool_autofdo::PropellerOptions> binary_options;
+  for (int i = 0; i != binaries.size(); ++i) {
+    if (binaries[i].empty() || outs[i].empty()) {
+      LOG(ERROR) << "Every binary in --binary needs a name and an output file "
+                    "name in --out.";
+      return 1;
+    }
+    devtools_crosstool_autofdo::PropellerOptions &opts =
+        binary_options.emplace_back(options);
+    opts.set_binary_name(binaries[i]);
+    opts.set_cluster_out_name(outs[i]);
+    opts.set_symbol_order_out_name(symorders[i]);
+    opts.set_profiled_binary_name(profiled_binary_names[i]);
+  }
+  absl::StatusOr<std::unique_ptr<devtools_crosstool_autofdo::PerfDataProvider>>
+      perf_data_provider = CreatePerfDataProvider(options);
+  if (!perf_data_provider.ok()) {
+    LOG(ERROR) << perf_data_provider.status();
+    return 1;
+  }
+  absl::Status status =
+      devtools_crosstool_autofdo::GeneratePropellerProfilesOfBinaries(
+          binary_options, *std::move(perf_data_provider));
+  if (!status.ok()) {
+    LOG(ERROR) << status;
+    return 1;
+  }
+  return WriteStageMetrics() ? 0 : 1;
+}
+
 int main(int argc, char **argv) {
   absl::SetProgramUsageMessage(argv[0]);
   absl::ParseCommandLine(argc, argv);
+  if (!absl::GetFlag(FLAGS_trace_out).empty())
+    devtools_crosstool_autofdo::TraceRecorder::GetInstance().Start();
+
+  if (!absl::GetFlag(FLAGS_serve_socket).empty()) {
+    devtools_crosstool_autofdo::ProfileServerOptions server_options;
+    server_options.max_binaries = absl::GetFlag(FLAGS_serve_max_binaries);
+    server_options.http = absl::GetFlag(FLAGS_http);
+    devtools_crosstool_autofdo::ProfileServer server(server_options);
+    absl::SetFlag(&FLAGS_use_discriminator_encoding, true);
+    absl::Status status =
+        server.ServeUnixSocket(absl::GetFlag(FLAGS_serve_socket));
+    if (!status.ok()) {
+      LOG(ERROR) << status;
+      return 1;
+    }
+    return WriteStageMetrics() ? 0 : 1;
+  }
 
   // If the user specified --gcov instead of --out, use that value.
   // If both are used, they must match.
@@ -184,6 +502,12 @@ int main(int argc, char **argv) {
     return 1;
   }
 
+  if (!absl::GetFlag(FLAGS_base_profile).empty() &&
+      absl::GetFlag(FLAGS_format) == "propeller") {
+    LOG(ERROR) << "--base_profile is not supported with --format=propeller.";
+    return 1;
+  }
+
   // Propeller profile format does not use CreateProfile so check it separately
   // before checking for other formats.
   if (absl::GetFlag(FLAGS_format) == "propeller") {
@@ -193,13 +517,24 @@ int main(int argc, char **argv) {
                     "--propeller_split_only can be used.";
       return 1;
     }
+    if (absl::StrContains(absl::GetFlag(FLAGS_binary), ';'))
+      return GeneratePropellerProfilesOfBinariesFromFlags();
+    const devtools_crosstool_autofdo::PropellerOptions options =
+        CreatePropellerOptionsFromFlags();
+    absl::StatusOr<
+        std::unique_ptr<devtools_crosstool_autofdo::PerfDataProvider>>
+        perf_data_provider = CreatePerfDataProvider(options);
+    if (!perf_data_provider.ok()) {
+      LOG(ERROR) << perf_data_provider.status();
+      return 1;
+    }
     absl::Status status = devtools_crosstool_autofdo::GeneratePropellerProfiles(
-        CreatePropellerOptionsFromFlags());
+        options, *std::move(perf_data_provider));
     if (!status.ok()) {
       LOG(ERROR) << status;
       return 1;
     }
-    return 0;
+    return WriteStageMetrics() ? 0 : 1;
   }
 
   // Make sure "--profile" does not contain multiple perf files when dealing
@@ -243,12 +578,23 @@ int main(int argc, char **argv) {
 
   devtools_crosstool_autofdo::ProfileCreator creator(
       absl::GetFlag(FLAGS_binary));
+  devtools_crosstool_autofdo::SymbolMap base_profile;
+  if (!absl::GetFlag(FLAGS_base_profile).empty()) {
+    devtools_crosstool_autofdo::LLVMProfileReader reader(&base_profile);
+    reader.set_read_total_samples(true);
+    if (!reader.ReadFromFile(absl::GetFlag(FLAGS_base_profile))) {
+      LOG(ERROR) << "Failed to read --base_profile="
+                 << absl::GetFlag(FLAGS_base_profile);
+      return 1;
+    }
+    creator.set_base_profile(&base_profile);
+  }
   absl::SetFlag(&FLAGS_use_discriminator_encoding, true);
   if (creator.CreateProfile(absl::GetFlag(FLAGS_profile),
                             absl::GetFlag(FLAGS_profiler), writer.get(),
                             absl::GetFlag(FLAGS_out),
                             absl::GetFlag(FLAGS_prof_sym_list))) {
-    return 0;
+    return WriteStageMetrics() ? 0 : 1;
   } else {
     return -1;
   }
@@ -14,11 +14,118 @@
 
 // Read the gcda file and dump the information.
 
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <regex>  // NOLINT
+#include <string>
+#include <utility>
+#include <vector>
+
 #include "base/commandlineflags.h"
+#include "base/logging.h"
+#include "parallel_for.h"
+#include "profile_index.h"
 #include "profile_reader.h"
 #include "symbol_map.h"
+#include "third_party/abseil/absl/container/flat_hash_set.h"
+#include "third_party/abseil/absl/flags/flag.h"
 #include "third_party/abseil/absl/flags/parse.h"
 #include "third_party/abseil/absl/flags/usage.h"
+#include "third_party/abseil/absl/strings/string_view.h"
+
+ABSL_FLAG(std::vector<std::string>, functions, {},
+          "Comma-separated top-level functions to dump. The records of the "
+          "other functions are skipped without being decoded. Dumps every "
+          "function if empty.");
+ABSL_FLAG(std::string, function, "",
+          "If set, dumps only the top-level functions whose names match this "
+          "regex, and implies --stream.");
+ABSL_FLAG(bool, stream, false,
+          "Print every top-level function as soon as its record is read, in "
+          "file order, instead of reading the whole profile first and "
+          "printing the functions by decreasing total count. Only one "
+          "function is held in memory at a time.");
+ABSL_FLAG(std::string, index_file, "",
+          "Index of the function records of the profile, which lets "
+          "--function, --functions and --top_functions read the matching "
+          "records directly. It is written if it does not exist or is for "
+          "another version of the profile. If empty, the index written next "
+          "to the profile by --write_profile_index is used if it is current.");
+ABSL_FLAG(uint32_t, top_functions, 0,
+          "If set, dumps only this many top-level functions with the largest "
+          "total counts, by decreasing total count.");
+ABSL_FLAG(uint32_t, dump_threads, 1,
+          "Number of threads used to format the functions when the whole "
+          "profile is dumped by decreasing total count.");
+
+namespace {
+using devtools_crosstool_autofdo::AutoFDOProfileReader;
+using devtools_crosstool_autofdo::ProfileIndex;
+
+// Returns the size of FILE_NAME, or -1 if it cannot be read.
+off_t GetFileSize(const std::string &file_name) {
+  struct stat st;
+  return stat(file_name.c_str(), &st) == 0 ? st.st_size : -1;
+}
+
+// Returns the index of PROFILE, from --index_file or from next to the
+// profile. If --index_file is set but missing or stale, it is first built
+// from a scan of the profile. Returns null if there is no usable index.
+std::unique_ptr<ProfileIndex> GetIndex(const std::string &profile) {
+  const off_t profile_size = GetFileSize(profile);
+  const std::string index_file = absl::GetFlag(FLAGS_index_file);
+  if (index_file.empty())
+    return ProfileIndex::Open(ProfileIndex::FileFor(profile), profile_size);
+  if (auto index = ProfileIndex::Open(index_file, profile_size)) return index;
+
+  std::vector<AutoFDOProfileReader::FunctionRecord> records;
+  AutoFDOProfileReader().ReadFunctionRecords(profile, &records);
+  std::vector<ProfileIndex::Entry> entries;
+  entries.reserve(records.size());
+  for (auto &record : records) {
+    entries.push_back({.name = std::move(record.name),
+                       .offset = record.offset,
+                       .total_count = record.total_count});
+  }
+  if (!ProfileIndex::Write(index_file, profile_size, std::move(entries))) {
+    LOG(ERROR) << "Cannot write " << index_file;
+    return nullptr;
+  }
+  return ProfileIndex::Open(index_file, profile_size);
+}
+
+// Returns the offsets of the records of the N functions of PROFILE with the
+// largest total counts, by decreasing total count.
+std::vector<size_t> GetTopFunctionOffsets(const std::string &profile,
+                                          const ProfileIndex *index,
+                                          size_t n) {
+  std::vector<size_t> offsets;
+  if (index != nullptr) {
+    for (size_t i : index->TopEntries(n)) offsets.push_back(index->offset(i));
+    return offsets;
+  }
+  std::vector<AutoFDOProfileReader::FunctionRecord> records;
+  AutoFDOProfileReader().ReadFunctionRecords(profile, &records);
+  n = std::min(n, records.size());
+  std::partial_sort(records.begin(), records.begin() + n, records.end(),
+                    [](const auto &a, const auto &b) {
+                      if (a.total_count != b.total_count)
+                        return a.total_count > b.total_count;
+                      return a.name < b.name;
+                    });
+  for (size_t i = 0; i < n; ++i) offsets.push_back(records[i].offset);
+  return offsets;
+}
+
+void DumpFunction(const devtools_crosstool_autofdo::SymbolMap &symbol_map) {
+  symbol_map.Dump();
+}
+}  // namespace
 
 int main(int argc, char **argv) {
   absl::SetProgramUsageMessage(argv[0]);
@@ -28,10 +135,74 @@ int main(int argc, char **argv) {
     LOG(FATAL) << "Please use: dump_gcov file_path\n";
     return -1;
   }
+  const std::string profile = argv[1];
+  const std::string function_regex = absl::GetFlag(FLAGS_function);
+  const std::vector<std::string> functions = absl::GetFlag(FLAGS_functions);
+  const uint32_t top_functions = absl::GetFlag(FLAGS_top_functions);
+  // The index is only looked for when a part of the profile is dumped.
+  const std::unique_ptr<ProfileIndex> index =
+      top_functions != 0 || !function_regex.empty() ||
+              absl::GetFlag(FLAGS_stream) || !functions.empty()
+          ? GetIndex(profile)
+          : nullptr;
+  AutoFDOProfileReader reader;
+  if (top_functions != 0) {
+    reader.StreamFunctionsAtOffsets(
+        profile, GetTopFunctionOffsets(profile, index.get(), top_functions),
+        DumpFunction);
+    return 0;
+  }
+  if (!function_regex.empty() || absl::GetFlag(FLAGS_stream)) {
+    const std::regex re(function_regex);
+    auto matches = [&](absl::string_view name) {
+      return function_regex.empty() ||
+             std::regex_search(name.begin(), name.end(), re);
+    };
+    if (index == nullptr) {
+      reader.StreamFunctionsFromFile(profile, matches, DumpFunction);
+      return 0;
+    }
+    // The records are read in file order.
+    std::vector<size_t> offsets;
+    for (size_t i = 0; i < index->size(); ++i) {
+      if (matches(index->name(i))) offsets.push_back(index->offset(i));
+    }
+    std::sort(offsets.begin(), offsets.end());
+    reader.StreamFunctionsAtOffsets(profile, offsets, DumpFunction);
+    return 0;
+  }
+
+  if (!functions.empty() && index != nullptr) {
+    // The functions are dumped by decreasing total count, as SymbolMap::Dump
+    // orders them.
+    std::vector<size_t> entries;
+    for (const std::string &function : functions) {
+      if (std::optional<size_t> entry = index->Find(function))
+        entries.push_back(*entry);
+    }
+    std::sort(entries.begin(), entries.end(), [&](size_t a, size_t b) {
+      if (index->total_count(a) != index->total_count(b))
+        return index->total_count(a) > index->total_count(b);
+      return a < b;
+    });
+    entries.erase(std::unique(entries.begin(), entries.end()), entries.end());
+    std::vector<size_t> offsets;
+    for (size_t entry : entries) offsets.push_back(index->offset(entry));
+    reader.StreamFunctionsAtOffsets(profile, offsets, DumpFunction);
+    return 0;
+  }
+
   devtools_crosstool_autofdo::SymbolMap symbol_map;
-  devtools_crosstool_autofdo::AutoFDOProfileReader reader(
-      &symbol_map, false);
-  reader.ReadFromFile(argv[1]);
-  symbol_map.Dump();
+  AutoFDOProfileReader full_reader(&symbol_map, false);
+  if (functions.empty()) {
+    full_reader.ReadFromFile(profile);
+  } else {
+    full_reader.ReadFunctionsFromFile(
+        profile,
+        absl::flat_hash_set<std::string>(functions.begin(), functions.end()));
+  }
+  symbol_map.Dump(/*dump_for_analysis=*/false,
+                  devtools_crosstool_autofdo::GetStageThreads(
+                      FLAGS_dump_threads));
   return 0;
 }
@@ -14,11 +14,19 @@
 
 // Define the flag used by gcov.
 
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <stddef.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
 
+#include <algorithm>
 
 #include "gcov.h"
 #include "third_party/abseil/absl/flags/flag.h"
@@ -36,203 +44,223 @@ const uint32 GCOV_TAG_AFDO_WORKING_SET = 0xaf000000;
 const uint32 GCOV_DATA_MAGIC = 0x67636461; /* "gcda" */
 const char *GCOV_ELF_SECTION_NAME = ".gnu.switches.text";
 
-#define GCOV_BLOCK_BYTE_SIZE (1 << 12)
-
-struct gcov_var {
-  FILE *file;
-  uint32 byte_offset;
-  uint32 byte_length;
-  int32 error;
-  int32 mode;
-  uint64 byte_alloc;
-  char *buffer;
-};
-
-static struct gcov_var gcov_var;
-
-static void gcov_write_block(unsigned byte_size) {
-  if (fwrite(gcov_var.buffer, byte_size, 1, gcov_var.file) != 1) {
-    gcov_var.error = 1;
-  }
-  gcov_var.byte_offset -= byte_size;
-}
-
-int gcov_open(const char *name, int mode) {
-  CHECK(!gcov_var.file);
-  gcov_var.byte_offset = gcov_var.byte_length = 0;
-  gcov_var.error = 0;
-  if (mode >= 0)
-    gcov_var.file = fopen(name, (mode > 0) ? "rb" : "r+b");
-
-  if (gcov_var.file) {
-    gcov_var.mode = 1;
-  } else if (mode <= 0) {
-    gcov_var.file = fopen(name, "w+b");
-    if (gcov_var.file) {
-      gcov_var.mode = mode * 2 + 1;
+namespace {
+// Pending writes are flushed once they reach this size.
+constexpr size_t kWriteBlockSize = 1 << 20;
+}  // namespace
+
+int GcovStream::Open(const char *name, int mode) {
+  CHECK(file_ == nullptr && !reading_);
+  error_ = 0;
+  if (mode >= 0) {
+    int fd = open(name, O_RDONLY);
+    if (fd < 0 && mode == 0) {
+      fd = open(name, O_RDWR | O_CREAT, 0666);
+    }
+    if (fd < 0) {
+      return 0;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+      close(fd);
+      return 0;
     }
+    if (st.st_size > 0) {
+      void *data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (data == MAP_FAILED) {
+        close(fd);
+        return 0;
+      }
+      read_data_ = static_cast<const char *>(data);
+      read_size_ = st.st_size;
+    }
+    close(fd);
+    read_offset_ = 0;
+    reading_ = true;
+    return 1;
   }
-  if (!gcov_var.file) {
+
+  file_ = fopen(name, "wb");
+  if (!file_) {
     return 0;
   }
-
-  setbuf(gcov_var.file, NULL);
-
+  // Writes are already collected into large blocks.
+  setbuf(file_, NULL);
+  write_buffer_.resize(kWriteBlockSize);
+  write_offset_ = 0;
+  write_size_ = 0;
   return 1;
 }
 
-int gcov_close(void) {
-  if (gcov_var.file) {
-    if (gcov_var.byte_offset && gcov_var.mode < 0) {
-      gcov_write_block(gcov_var.byte_offset);
+int GcovStream::Close() {
+  if (file_) {
+    if (!FlushWrites()) {
+      error_ = 1;
+    }
+    if (fclose(file_) != 0) {
+      error_ = 1;
     }
-    fclose(gcov_var.file);
-    gcov_var.file = 0;
-    gcov_var.byte_length = 0;
+    file_ = nullptr;
+    std::vector<char>().swap(write_buffer_);
   }
-  gcov_var.mode = 0;
-  int err = gcov_var.error;
-  return err;
+  if (read_data_) {
+    munmap(const_cast<char *>(read_data_), read_size_);
+    read_data_ = nullptr;
+    read_size_ = 0;
+  }
+  reading_ = false;
+  return error_;
 }
 
-static inline void gcov_allocate(unsigned byte_length) {
-  uint64 new_byte_size = gcov_var.byte_alloc;
-
-  if (!new_byte_size) {
-    new_byte_size = GCOV_BLOCK_BYTE_SIZE;
+bool GcovStream::FlushWrites() {
+  if (write_offset_ == 0) {
+    return true;
   }
-  new_byte_size += byte_length;
-  new_byte_size *= 2;
-
-  gcov_var.byte_alloc = new_byte_size;
-  gcov_var.buffer =
-      static_cast<char *>(realloc(gcov_var.buffer, new_byte_size));
+  const bool ok =
+      fwrite(write_buffer_.data(), write_offset_, 1, file_) == 1;
+  write_offset_ = 0;
+  return ok;
 }
 
-static inline char *gcov_write_bytes(unsigned bytes) {
-  char *result;
-
-  CHECK_LT(gcov_var.mode, 0);
-  if (gcov_var.byte_offset + bytes > gcov_var.byte_alloc) {
-    gcov_allocate(gcov_var.byte_offset + bytes);
+char *GcovStream::WriteBytes(size_t bytes) {
+  CHECK(file_ != nullptr);
+  if (write_offset_ + bytes > write_buffer_.size()) {
+    if (!FlushWrites()) {
+      error_ = 1;
+    }
+    if (bytes > write_buffer_.size()) {
+      write_buffer_.resize(bytes);
+    }
   }
-  result = &gcov_var.buffer[gcov_var.byte_offset];
-  gcov_var.byte_offset += bytes;
-
+  char *result = &write_buffer_[write_offset_];
+  write_offset_ += bytes;
+  write_size_ += bytes;
   return result;
 }
 
-static inline uint32 *gcov_write_words(unsigned words) {
-  uint32 *result;
-  unsigned bytes = words << 2;
-
-  return reinterpret_cast<uint32 *>(gcov_write_bytes(bytes));
+void GcovStream::WriteUnsigned(uint32 value) {
+  memcpy(WriteBytes(4), &value, 4);
 }
 
-
-void gcov_write_unsigned(uint32 value) {
-  uint32 *buffer = gcov_write_words(1);
-  buffer[0] = value;
+void GcovStream::WriteCounter(uint64 value) {
+  uint32 words[2] = {static_cast<uint32>(value),
+                     static_cast<uint32>(value >> 32)};
+  memcpy(WriteBytes(8), words, 8);
 }
 
-void gcov_write_counter(uint64 value) {
-  uint32 *buffer = gcov_write_words(2);
-
-  buffer[0] = static_cast<uint32>(value);
-  buffer[1] = static_cast<uint32>(value >> 32);
-}
-
-void gcov_write_string(const char *string) {
+void GcovStream::WriteString(const char *string) {
   unsigned length = 0;
   unsigned alloc = 0;
-  uint32 *buffer;
+  char *buffer;
 
   if (string) {
     length = strlen(string);
-    if (absl::GetFlag(FLAGS_gcov_version) == 2) {
+    if (version_ == 2) {
       // Length includes the terminating 0 and is saved in bytes.
       alloc = length + 1;
-      char *byte_buffer = gcov_write_bytes(4 + alloc);
-      byte_buffer[3 + alloc] = 0;
-      buffer = reinterpret_cast<uint32 *>(byte_buffer);
-    }
-    else {
+      buffer = WriteBytes(4 + alloc);
+      buffer[3 + alloc] = 0;
+    } else {
       // Length is saved in words and padding is added.
       alloc = (length + 4) >> 2;
-      buffer = gcov_write_words(1 + alloc);
-      buffer[alloc] = 0;
+      buffer = WriteBytes(4 + 4 * alloc);
+      memset(buffer + 4 * alloc, 0, 4);
     }
+  } else {
+    buffer = WriteBytes(4);
   }
 
-  buffer[0] = alloc;
-  memcpy(&buffer[1], string, length);
+  memcpy(buffer, &alloc, 4);
+  if (length) {
+    memcpy(buffer + 4, string, length);
+  }
 }
 
-static inline const char *gcov_read_bytes(unsigned bytes) {
-  const char *result;
-  unsigned excess_bytes = gcov_var.byte_length - gcov_var.byte_offset;
-
-  CHECK_GT(gcov_var.mode, 0);
-  CHECK(bytes < GCOV_BLOCK_BYTE_SIZE);
-  if (excess_bytes < bytes) {
-    memmove(gcov_var.buffer, gcov_var.buffer + gcov_var.byte_offset, excess_bytes);
-    gcov_var.byte_offset = 0;
-    gcov_var.byte_length = excess_bytes;
-    if (gcov_var.byte_length + bytes > gcov_var.byte_alloc) {
-      gcov_allocate(gcov_var.byte_length + bytes);
+void GcovStream::WriteBlocks(absl::Span<const std::string> blocks) {
+  CHECK(file_ != nullptr);
+  // The file is unbuffered, so once the pending writes are flushed the
+  // blocks can be written to its descriptor directly.
+  if (!FlushWrites()) {
+    error_ = 1;
+  }
+  std::vector<struct iovec> iovecs;
+  iovecs.reserve(std::min<size_t>(blocks.size(), IOV_MAX));
+  for (size_t begin = 0; begin < blocks.size(); begin += IOV_MAX) {
+    iovecs.clear();
+    const size_t end = std::min<size_t>(blocks.size(), begin + IOV_MAX);
+    for (size_t i = begin; i < end; ++i) {
+      if (blocks[i].empty()) continue;
+      write_size_ += blocks[i].size();
+      iovecs.push_back({const_cast<char *>(blocks[i].data()),
+                        blocks[i].size()});
     }
-    excess_bytes = gcov_var.byte_alloc - gcov_var.byte_length;
-    excess_bytes = fread(gcov_var.buffer + gcov_var.byte_length,
-                   1, excess_bytes, gcov_var.file);
-    gcov_var.byte_length += excess_bytes;
-    if (gcov_var.byte_length < bytes) {
-      gcov_var.byte_length = 0;
-      return 0;
+    struct iovec *pending = iovecs.data();
+    int num_pending = iovecs.size();
+    while (num_pending > 0) {
+      const ssize_t written = writev(fileno(file_), pending, num_pending);
+      if (written < 0) {
+        if (errno == EINTR) continue;
+        error_ = 1;
+        return;
+      }
+      // Skip what was written; a short write may end inside a block.
+      for (size_t rest = written; rest > 0;) {
+        if (rest < pending->iov_len) {
+          pending->iov_base = static_cast<char *>(pending->iov_base) + rest;
+          pending->iov_len -= rest;
+          break;
+        }
+        rest -= pending->iov_len;
+        ++pending;
+        --num_pending;
+      }
     }
   }
-  result = &gcov_var.buffer[gcov_var.byte_offset];
-  gcov_var.byte_offset += bytes;
-  return result;
 }
 
-static inline const uint32 *gcov_read_words(unsigned words) {
-  unsigned bytes = words << 2;
-  return reinterpret_cast<const uint32 *>(gcov_read_bytes(bytes));
+const char *GcovStream::ReadBytes(size_t bytes) {
+  CHECK(reading_);
+  if (read_size_ - read_offset_ < bytes) {
+    read_offset_ = read_size_;
+    return nullptr;
+  }
+  const char *result = read_data_ + read_offset_;
+  read_offset_ += bytes;
+  return result;
 }
 
-uint32 gcov_read_unsigned(void) {
-  uint32 value;
-  const uint32 *buffer = gcov_read_words(1);
+uint32 GcovStream::ReadUnsigned() {
+  const char *buffer = ReadBytes(4);
 
   if (!buffer) {
     return 0;
   }
-  value = buffer[0];
+  uint32 value;
+  memcpy(&value, buffer, 4);
   return value;
 }
 
-uint64 gcov_read_counter(void) {
-  uint64 value;
-  const uint32 *buffer = gcov_read_words(2);
+uint64 GcovStream::ReadCounter() {
+  const char *buffer = ReadBytes(8);
 
-  if (!buffer)
+  if (!buffer) {
     return 0;
-  value = buffer[0];
-  value |= (static_cast<uint64>(buffer[1])) << 32;
-  return value;
+  }
+  uint32 words[2];
+  memcpy(words, buffer, 8);
+  return words[0] | (static_cast<uint64>(words[1]) << 32);
 }
 
-const char * gcov_read_string(void) {
-  unsigned length = gcov_read_unsigned();
+const char *GcovStream::ReadString() {
+  unsigned length = ReadUnsigned();
 
   if (!length) {
     return 0;
   }
 
-  if (absl::GetFlag(FLAGS_gcov_version) == 2) {
-    return gcov_read_bytes (length);
-  }
-  else {
-    return (const char *) gcov_read_words (length);
+  if (version_ == 2) {
+    return ReadBytes(length);
+  } else {
+    return ReadBytes(4 * static_cast<size_t>(length));
   }
 }
@@ -17,8 +17,15 @@
 #ifndef AUTOFDO_GCOV_H_
 #define AUTOFDO_GCOV_H_
 
+#include <cstdio>
+#include <string>
+#include <vector>
+
 #include "base/common.h"
+#include "base/macros.h"
 #include "third_party/abseil/absl/flags/declare.h"
+#include "third_party/abseil/absl/flags/flag.h"
+#include "third_party/abseil/absl/types/span.h"
 
 extern const uint32 GCOV_TAG_AFDO_FILE_NAMES;
 extern const uint32 GCOV_TAG_AFDO_FUNCTION;
@@ -40,20 +47,71 @@ enum hist_type {
   HIST_TYPE_INDIR_CALL_TOPN
 };
 
-int gcov_open(const char *name, int mode);
+// Reads or writes one gcov data file. Every stream owns its file and
+// buffer, so several streams can be used at the same time, e.g. to read
+// or write several profiles in parallel.
+class GcovStream {
+ public:
+  // Strings are encoded as expected by gcov VERSION, see --gcov_version.
+  explicit GcovStream(uint64 version) : version_(version) {}
+  GcovStream() : GcovStream(absl::GetFlag(FLAGS_gcov_version)) {}
+  ~GcovStream() { Close(); }
+
+  // Opens NAME for reading if MODE is positive, and for writing if MODE is
+  // negative. A zero MODE reads NAME, creating it if it does not exist.
+  // Returns 1 on success and 0 on failure.
+  int Open(const char *name, int mode);
 
-int gcov_close(void);
+  // Flushes pending writes and closes the file. Returns nonzero if any
+  // write failed.
+  int Close();
 
-void gcov_write_unsigned(uint32 value);
+  uint64 version() const { return version_; }
+  void set_version(uint64 version) { version_ = version; }
 
-void gcov_write_counter(uint64 value);
+  void WriteUnsigned(uint32 value);
+  void WriteCounter(uint64 value);
+  void WriteString(const char *string);
+  // Writes the concatenation of BLOCKS, which hold already encoded data,
+  // with vectored writes instead of copying them into the write buffer.
+  void WriteBlocks(absl::Span<const std::string> blocks);
+  // The number of bytes written since the file was opened, including those
+  // not flushed yet, i.e. the offset of the next write.
+  size_t write_size() const { return write_size_; }
 
-void gcov_write_string(const char *string);
+  // Return 0 once the end of the file is reached.
+  uint32 ReadUnsigned();
+  uint64 ReadCounter();
+  // The returned string lives until the stream is closed.
+  const char *ReadString();
+  // The offset of the next read from the start of the file. Reads can be
+  // moved to any offset up to the end of the file with SeekRead.
+  size_t read_offset() const { return read_offset_; }
+  void SeekRead(size_t offset) {
+    CHECK(reading_ && offset <= read_size_);
+    read_offset_ = offset;
+  }
 
-uint32 gcov_read_unsigned(void);
+ private:
+  char *WriteBytes(size_t bytes);
+  bool FlushWrites();
+  const char *ReadBytes(size_t bytes);
 
-uint64 gcov_read_counter(void);
+  uint64 version_;
+  // Set while writing. Writes are collected in write_buffer_ and written
+  // in blocks of at least kWriteBlockSize bytes.
+  FILE *file_ = nullptr;
+  std::vector<char> write_buffer_;
+  size_t write_offset_ = 0;
+  size_t write_size_ = 0;
+  // Set while reading. The file is mapped into memory.
+  const char *read_data_ = nullptr;
+  size_t read_size_ = 0;
+  size_t read_offset_ = 0;
+  bool reading_ = false;
+  int error_ = 0;
 
-const char * gcov_read_string(void);
+  DISALLOW_COPY_AND_ASSIGN(GcovStream);
+};
 
 #endif  // AUTOFDO_GCOV_H_
@@ -0,0 +1,194 @@
+// Finds the instruction boundaries and the control transfers of the functions
+// of a binary.
+
+#include "instruction_decoder.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "base/logging.h"
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/ADT/Triple.h"
+#include "llvm/MC/MCInst.h"
+#include "llvm/MC/MCTargetOptions.h"
+#include "llvm/Support/TargetSelect.h"
+#include "llvm/Support/raw_ostream.h"
+#if LLVM_VERSION_MAJOR >= 14
+#include "llvm/MC/TargetRegistry.h"
+#else
+#include "llvm/Support/TargetRegistry.h"
+#endif
+
+namespace devtools_crosstool_autofdo {
+
+InstructionDecoder::~InstructionDecoder() {}
+
+std::unique_ptr<InstructionDecoder> InstructionDecoder::Create(
+    const std::string &binary_name) {
+  llvm::InitializeAllTargetInfos();
+  llvm::InitializeAllTargetMCs();
+  llvm::InitializeAllDisassemblers();
+
+  auto binary_or_err =
+      llvm::object::ObjectFile::createObjectFile(llvm::StringRef(binary_name));
+  if (!binary_or_err) {
+    LOG(WARNING) << "Cannot open " << binary_name
+                 << " to decode instructions: "
+                 << llvm::toString(binary_or_err.takeError());
+    return nullptr;
+  }
+  std::unique_ptr<InstructionDecoder> decoder(new InstructionDecoder());
+  decoder->binary_ = std::move(binary_or_err.get());
+
+  const llvm::Triple triple = decoder->binary_.getBinary()->makeTriple();
+  std::string error;
+  const llvm::Target *target =
+      llvm::TargetRegistry::lookupTarget(triple.getTriple(), error);
+  if (target == nullptr) {
+    LOG(WARNING) << "Cannot decode instructions of " << binary_name << ": "
+                 << error;
+    return nullptr;
+  }
+  decoder->register_info_.reset(target->createMCRegInfo(triple.getTriple()));
+  if (decoder->register_info_ == nullptr) return nullptr;
+  decoder->asm_info_.reset(target->createMCAsmInfo(
+      *decoder->register_info_, triple.getTriple(), llvm::MCTargetOptions()));
+  if (decoder->asm_info_ == nullptr) return nullptr;
+  decoder->subtarget_info_.reset(
+      target->createMCSubtargetInfo(triple.getTriple(), "", ""));
+  if (decoder->subtarget_info_ == nullptr) return nullptr;
+  decoder->context_ = std::make_unique<llvm::MCContext>(
+      triple, decoder->asm_info_.get(), decoder->register_info_.get(),
+      decoder->subtarget_info_.get());
+  decoder->disassembler_.reset(
+      target->createMCDisassembler(*decoder->subtarget_info_,
+                                   *decoder->context_));
+  if (decoder->disassembler_ == nullptr) {
+    LOG(WARNING) << "No disassembler for " << triple.getTriple();
+    return nullptr;
+  }
+  decoder->instr_info_.reset(target->createMCInstrInfo());
+  if (decoder->instr_info_ != nullptr) {
+    decoder->instr_analysis_.reset(
+        target->createMCInstrAnalysis(decoder->instr_info_.get()));
+  }
+  return decoder;
+}
+
+const std::vector<uint64_t> &InstructionDecoder::GetInstructionStarts(
+    uint64_t start_addr, uint64_t end_addr) {
+  absl::MutexLock lock(&mutex_);
+  auto [it, inserted] = starts_.try_emplace(start_addr);
+  if (inserted) Decode(start_addr, end_addr, &it->second);
+  return it->second;
+}
+
+void InstructionDecoder::Release(uint64_t start_addr) {
+  absl::MutexLock lock(&mutex_);
+  starts_.erase(start_addr);
+}
+
+void InstructionDecoder::Decode(uint64_t start_addr, uint64_t end_addr,
+                                std::vector<uint64_t> *starts) const {
+  for (const llvm::object::SectionRef &section :
+       binary_.getBinary()->sections()) {
+    if (!section.isText() || start_addr < section.getAddress() ||
+        start_addr >= section.getAddress() + section.getSize())
+      continue;
+    llvm::Expected<llvm::StringRef> contents = section.getContents();
+    if (!contents) {
+      llvm::consumeError(contents.takeError());
+      return;
+    }
+    const uint64_t section_end =
+        section.getAddress() + std::min<uint64_t>(section.getSize(),
+                                                  contents->size());
+    end_addr = std::min(end_addr, section_end);
+    llvm::ArrayRef<uint8_t> bytes(
+        reinterpret_cast<const uint8_t *>(contents->data()),
+        contents->size());
+    for (uint64_t addr = start_addr; addr < end_addr;) {
+      llvm::MCInst inst;
+      uint64_t size = 0;
+      const auto status = disassembler_->getInstruction(
+          inst, size,
+          bytes.slice(addr - section.getAddress(), end_addr - addr), addr,
+          llvm::nulls());
+      // Skip undecodable bytes, such as padding or data in code, but keep
+      // them as potential instruction starts to never lose a sample.
+      starts->push_back(addr);
+      addr += (status == llvm::MCDisassembler::Success && size > 0) ? size
+                                                                     : 1;
+    }
+    return;
+  }
+}
+
+std::optional<ControlTransfer> InstructionDecoder::FindNextControlTransfer(
+    uint64_t addr) const {
+  if (instr_analysis_ == nullptr) return std::nullopt;
+  for (const llvm::object::SectionRef &section :
+       binary_.getBinary()->sections()) {
+    if (!section.isText() || addr < section.getAddress() ||
+        addr >= section.getAddress() + section.getSize())
+      continue;
+    llvm::Expected<llvm::StringRef> contents = section.getContents();
+    if (!contents) {
+      llvm::consumeError(contents.takeError());
+      return std::nullopt;
+    }
+    llvm::ArrayRef<uint8_t> bytes(
+        reinterpret_cast<const uint8_t *>(contents->data()),
+        contents->size());
+    const uint64_t section_end = section.getAddress() + bytes.size();
+    while (addr < section_end) {
+      llvm::MCInst inst;
+      uint64_t size = 0;
+      if (disassembler_->getInstruction(
+              inst, size, bytes.slice(addr - section.getAddress()), addr,
+              llvm::nulls()) != llvm::MCDisassembler::Success ||
+          size == 0)
+        return std::nullopt;
+      ControlTransfer transfer = {.address = addr, .size = size};
+      auto is_direct = [&]() {
+        return instr_analysis_->evaluateBranch(inst, addr, size,
+                                               transfer.target);
+      };
+      const llvm::StringRef name = instr_info_->getName(inst.getOpcode());
+      if (instr_analysis_->isReturn(inst)) {
+        transfer.kind = ControlTransfer::kReturn;
+      } else if (instr_analysis_->isCall(inst)) {
+        transfer.kind = is_direct() ? ControlTransfer::kDirectCall
+                                    : ControlTransfer::kIndirectCall;
+      } else if (name.startswith("XBEGIN")) {
+        // Transactions only branch when they abort, which the trace tells
+        // like an interrupt.
+        addr += size;
+        continue;
+      } else if (instr_analysis_->isConditionalBranch(inst)) {
+        if (!is_direct()) return std::nullopt;
+        transfer.kind = ControlTransfer::kConditionalBranch;
+      } else if (instr_analysis_->isBranch(inst)) {
+        transfer.kind = is_direct() ? ControlTransfer::kDirectJump
+                                    : ControlTransfer::kIndirectJump;
+      } else if (name == "SYSCALL" || name == "SYSENTER" || name == "INT" ||
+                 name == "INT3" || name == "INTO") {
+        transfer.kind = ControlTransfer::kFarTransfer;
+      } else {
+        addr += size;
+        continue;
+      }
+      return transfer;
+    }
+    return std::nullopt;
+  }
+  return std::nullopt;
+}
+
+}  // namespace devtools_crosstool_autofdo
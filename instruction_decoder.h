@@ -0,0 +1,105 @@
+// Finds the instruction boundaries and the control transfers of the functions
+// of a binary.
+#ifndef AUTOFDO_INSTRUCTION_DECODER_H_
+#define AUTOFDO_INSTRUCTION_DECODER_H_
+
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "base/macros.h"
+#include "third_party/abseil/absl/base/thread_annotations.h"
+#include "third_party/abseil/absl/container/node_hash_map.h"
+#include "third_party/abseil/absl/synchronization/mutex.h"
+#include "llvm/MC/MCAsmInfo.h"
+#include "llvm/MC/MCContext.h"
+#include "llvm/MC/MCDisassembler/MCDisassembler.h"
+#include "llvm/MC/MCInstrAnalysis.h"
+#include "llvm/MC/MCInstrInfo.h"
+#include "llvm/MC/MCRegisterInfo.h"
+#include "llvm/MC/MCSubtargetInfo.h"
+#include "llvm/Object/ObjectFile.h"
+
+namespace devtools_crosstool_autofdo {
+
+// An instruction that may transfer control elsewhere than to the next
+// instruction, as needed to follow the flow of execution through a branch
+// trace.
+struct ControlTransfer {
+  enum Kind {
+    kConditionalBranch,
+    kDirectJump,
+    kDirectCall,
+    kIndirectJump,
+    kIndirectCall,
+    kReturn,
+    // System calls and software interrupts.
+    kFarTransfer,
+  };
+
+  Kind kind;
+  uint64_t address;
+  uint64_t size;
+  // The target of conditional branches and direct jumps and calls.
+  uint64_t target = 0;
+};
+
+// Decodes the machine code of a binary with the LLVM disassembler, to tell
+// the start addresses of the instructions from the other bytes of the code.
+// The methods are safe to call from multiple threads at once.
+class InstructionDecoder {
+ public:
+  ~InstructionDecoder();
+
+  // Returns the decoder of BINARY_NAME, or nullptr if the binary cannot be
+  // read or the disassembler does not support its target.
+  static std::unique_ptr<InstructionDecoder> Create(
+      const std::string &binary_name);
+
+  // Returns the sorted start addresses of the instructions in
+  // [START_ADDR, END_ADDR), decoding from START_ADDR, which must be the start
+  // of a function. The result is cached by START_ADDR, so every function is
+  // decoded only once. Returns an empty vector if the range is not in an
+  // executable section.
+  const std::vector<uint64_t> &GetInstructionStarts(uint64_t start_addr,
+                                                    uint64_t end_addr);
+
+  // Frees the cached instruction starts of the function at START_ADDR, once
+  // they are no longer used.
+  void Release(uint64_t start_addr);
+
+  // Returns the first control transfer at or after ADDR, which must be the
+  // start of an instruction, decoding the instructions up to it. Returns
+  // std::nullopt if ADDR is not in an executable section or an instruction
+  // on the way can not be decoded. Nothing is cached.
+  std::optional<ControlTransfer> FindNextControlTransfer(uint64_t addr) const;
+
+ private:
+  InstructionDecoder() = default;
+
+  // Decodes [START_ADDR, END_ADDR) into STARTS.
+  void Decode(uint64_t start_addr, uint64_t end_addr,
+              std::vector<uint64_t> *starts) const;
+
+  llvm::object::OwningBinary<llvm::object::ObjectFile> binary_;
+  std::unique_ptr<llvm::MCRegisterInfo> register_info_;
+  std::unique_ptr<llvm::MCAsmInfo> asm_info_;
+  std::unique_ptr<llvm::MCSubtargetInfo> subtarget_info_;
+  std::unique_ptr<llvm::MCContext> context_;
+  std::unique_ptr<llvm::MCDisassembler> disassembler_;
+  std::unique_ptr<llvm::MCInstrInfo> instr_info_;
+  std::unique_ptr<llvm::MCInstrAnalysis> instr_analysis_;
+
+  absl::Mutex mutex_;
+  // Instruction starts by function start address.
+  absl::node_hash_map<uint64_t, std::vector<uint64_t>> starts_
+      ABSL_GUARDED_BY(mutex_);
+
+  DISALLOW_COPY_AND_ASSIGN(InstructionDecoder);
+};
+
+}  // namespace devtools_crosstool_autofdo
+
+#endif  // AUTOFDO_INSTRUCTION_DECODER_H_
@@ -0,0 +1,74 @@
+#include "instruction_decoder.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+#define FLAGS_test_srcdir std::string(testing::UnitTest::GetInstance()->original_working_dir())
+
+namespace {
+
+using ::devtools_crosstool_autofdo::ControlTransfer;
+using ::devtools_crosstool_autofdo::InstructionDecoder;
+
+TEST(InstructionDecoderTest, GetInstructionStarts) {
+  std::unique_ptr<InstructionDecoder> decoder =
+      InstructionDecoder::Create(FLAGS_test_srcdir + "/testdata/test.binary");
+  ASSERT_NE(decoder, nullptr);
+  const std::vector<uint64_t> &starts =
+      decoder->GetInstructionStarts(0x400b80, 0x400eac);
+  ASSERT_FALSE(starts.empty());
+  EXPECT_EQ(starts.front(), 0x400b80);
+  EXPECT_TRUE(std::is_sorted(starts.begin(), starts.end()));
+  EXPECT_LT(starts.back(), 0x400eac);
+  // Fewer instructions than bytes.
+  EXPECT_LT(starts.size(), (0x400eac - 0x400b80) / 2);
+  // A call, a conditional jump and a return.
+  for (uint64_t addr : {0x400cdd, 0x400ccd, 0x400d81}) {
+    EXPECT_TRUE(std::binary_search(starts.begin(), starts.end(), addr))
+        << std::hex << addr;
+  }
+  // The same function is decoded only once.
+  EXPECT_EQ(&decoder->GetInstructionStarts(0x400b80, 0x400eac), &starts);
+  EXPECT_TRUE(decoder->GetInstructionStarts(0x10, 0x20).empty());
+}
+
+TEST(InstructionDecoderTest, FindNextControlTransfer) {
+  std::unique_ptr<InstructionDecoder> decoder =
+      InstructionDecoder::Create(FLAGS_test_srcdir + "/testdata/test.binary");
+  ASSERT_NE(decoder, nullptr);
+  // jg 0x400da0
+  std::optional<ControlTransfer> transfer =
+      decoder->FindNextControlTransfer(0x400ccd);
+  ASSERT_TRUE(transfer.has_value());
+  EXPECT_EQ(transfer->kind, ControlTransfer::kConditionalBranch);
+  EXPECT_EQ(transfer->address, 0x400ccd);
+  EXPECT_EQ(transfer->size, 6);
+  EXPECT_EQ(transfer->target, 0x400da0);
+  // Three instructions up to call 0x404930.
+  transfer = decoder->FindNextControlTransfer(0x400cd3);
+  ASSERT_TRUE(transfer.has_value());
+  EXPECT_EQ(transfer->kind, ControlTransfer::kDirectCall);
+  EXPECT_EQ(transfer->address, 0x400cdd);
+  EXPECT_EQ(transfer->size, 5);
+  EXPECT_EQ(transfer->target, 0x404930);
+  // xor, pop and ret.
+  transfer = decoder->FindNextControlTransfer(0x400d7e);
+  ASSERT_TRUE(transfer.has_value());
+  EXPECT_EQ(transfer->kind, ControlTransfer::kReturn);
+  EXPECT_EQ(transfer->address, 0x400d81);
+  EXPECT_EQ(transfer->size, 1);
+  EXPECT_FALSE(decoder->FindNextControlTransfer(0x10).has_value());
+}
+
+TEST(InstructionDecoderTest, MissingBinary) {
+  EXPECT_EQ(InstructionDecoder::Create(FLAGS_test_srcdir +
+                                       "/testdata/no_such.binary"),
+            nullptr);
+}
+}  // namespace
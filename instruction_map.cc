@@ -7,7 +7,9 @@
 
 #include <string.h>
 
+#include <algorithm>
 #include <cstdint>
+#include <limits>
 #include <string>
 
 #include "addr2line.h"
@@ -21,19 +23,59 @@ void InstructionMap::BuildPerFunctionInstructionMap(const std::string &name,
   if (start_addr >= end_addr) {
     return;
   }
+  BuildRuns(name, {{start_addr, end_addr}});
+}
+
+void InstructionMap::BuildPerFunctionInstructionMap(
+    const std::string &name,
+    const std::vector<std::pair<uint64_t, uint64_t>> &ranges) {
+  BuildRuns(name, ranges);
+}
 
+void InstructionMap::BuildRuns(
+    const std::string &name,
+    const std::vector<std::pair<uint64_t, uint64_t>> &ranges) {
   // Make sure nobody has set up inst_map_ yet.
   CHECK(inst_map_.empty());
 
-  start_addr_ = start_addr;
-  inst_map_.resize(end_addr - start_addr);
-  for (uint64_t addr = start_addr; addr < end_addr; addr++) {
-    InstInfo *info = &inst_map_[addr - start_addr];
-    addr2line_->GetInlineStack(addr, &info->source_stack);
-    if (info->source_stack.size() > 0) {
-      symbol_map_->AddSourceCount(name, info->source_stack, 0, 1, 1,
-                                  SymbolMap::PERFDATA);
+  for (const auto &[begin, end] : ranges) {
+    if (begin >= end) continue;
+    if (!runs_.empty() && runs_.back().end_addr >= begin) {
+      CHECK_EQ(runs_.back().end_addr, begin) << "Overlapping ranges";
+      runs_.back().end_addr = end;
+      continue;
     }
+    const uint64_t first_index =
+        runs_.empty() ? 0
+                      : runs_.back().first_index + runs_.back().end_addr -
+                            runs_.back().start_addr;
+    runs_.push_back({begin, end, first_index});
+  }
+  if (runs_.empty()) return;
+  inst_map_.resize(runs_.back().first_index + runs_.back().end_addr -
+                   runs_.back().start_addr);
+  for (const Run &run : runs_) {
+    addr2line_->GetInlineStacksForRange(
+        run.start_addr, run.end_addr,
+        [&](uint64_t begin, uint64_t end, const SourceStack &stack) {
+          if (stack.empty()) return;
+          CHECK_LT(source_stacks_.size(), std::numeric_limits<uint32_t>::max());
+          const uint32_t source_stack_id = source_stacks_.size();
+          source_stacks_.push_back(stack);
+          for (uint64_t addr = begin; addr < end; addr++) {
+            inst_map_[run.first_index + addr - run.start_addr]
+                .source_stack_id = source_stack_id;
+          }
+          uint64_t num_inst = end - begin;
+          if (instruction_starts_ != nullptr) {
+            num_inst = std::lower_bound(instruction_starts_->begin(),
+                                        instruction_starts_->end(), end) -
+                       std::lower_bound(instruction_starts_->begin(),
+                                        instruction_starts_->end(), begin);
+          }
+          symbol_map_->AddSourceCount(name, stack, 0, num_inst, 1,
+                                      SymbolMap::PERFDATA);
+        });
   }
 }
 
@@ -6,10 +6,13 @@
 #ifndef AUTOFDO_INSTRUCTION_MAP_H_
 #define AUTOFDO_INSTRUCTION_MAP_H_
 
+#include <algorithm>
 #include <cstdint>
+#include <iterator>
 #include <map>
 #include <string>
 #include <utility>
+#include <vector>
 
 #include "base/integral_types.h"
 #include "base/logging.h"
@@ -33,30 +36,96 @@ class InstructionMap {
   //           according to the debug info of each instruction.
   InstructionMap(Addr2line *addr2line,
                  SymbolMap *symbol)
-      : symbol_map_(symbol), addr2line_(addr2line) {
+      : source_stacks_(1), symbol_map_(symbol), addr2line_(addr2line) {
+  }
+
+  // Makes BuildPerFunctionInstructionMap count only the addresses in STARTS,
+  // sorted instruction start addresses, as instructions. Without it, every
+  // byte counts as an instruction. STARTS must outlive the build.
+  void set_instruction_starts(const std::vector<uint64_t> *starts) {
+    instruction_starts_ = starts;
   }
 
   // Builds instruction map for a function.
   void BuildPerFunctionInstructionMap(const std::string &name,
                                       uint64_t start_addr, uint64_t end_addr);
 
+  // Builds instruction map for a function, but only for the addresses in
+  // RANGES: sorted, disjoint [begin, end) address ranges. The instructions
+  // outside of them are not symbolized and get no instruction count.
+  void BuildPerFunctionInstructionMap(
+      const std::string &name,
+      const std::vector<std::pair<uint64_t, uint64_t>> &ranges);
+
+  // Id of the empty source stack, used for instructions without debug info.
+  static constexpr uint32_t kEmptySourceStackId = 0;
+
   // Contains information about each instruction.
   struct InstInfo {
-    SourceStack source_stack;
+    // Id of the instruction's source stack, see source_stack().
+    uint32_t source_stack_id = kEmptySourceStackId;
   };
 
+  // Returns the source stack of an instruction.
+  const SourceStack &source_stack(const InstInfo &info) const {
+    return source_stacks_[info.source_stack_id];
+  }
+
   InstInfo *lookup(uint64_t addr) {
-    uint64_t idx = addr - start_addr_;  // May underflow, which is OK.
-    return idx < inst_map_.size() ? &inst_map_[idx] : nullptr;
+    uint64_t index;
+    return FindIndex(addr, &index, nullptr) ? &inst_map_[index] : nullptr;
+  }
+
+  // The mapped addresses form runs of consecutive addresses, which are
+  // numbered consecutively from 0 to size() - 1 in address order.
+  struct Run {
+    uint64_t start_addr;
+    uint64_t end_addr;
+    // The index of start_addr.
+    uint64_t first_index;
+  };
+  const std::vector<Run> &runs() const { return runs_; }
+  uint64_t size() const { return inst_map_.size(); }
+
+  // Returns false if ADDR is not mapped. Otherwise sets INDEX to the index
+  // of ADDR and, if RUN_END is not null, *RUN_END to the end of its run.
+  bool FindIndex(uint64_t addr, uint64_t *index, uint64_t *run_end) const {
+    const Run *run = nullptr;
+    if (runs_.size() == 1) {
+      run = &runs_[0];
+    } else {
+      auto it = std::upper_bound(
+          runs_.begin(), runs_.end(), addr,
+          [](uint64_t addr, const Run &run) { return addr < run.start_addr; });
+      if (it == runs_.begin()) return false;
+      run = &*std::prev(it);
+    }
+    if (addr - run->start_addr >=  // May underflow, which is OK.
+        run->end_addr - run->start_addr)
+      return false;
+    *index = run->first_index + (addr - run->start_addr);
+    if (run_end != nullptr) *run_end = run->end_addr;
+    return true;
   }
 
  private:
-  // A map from instruction address to its information.
+  // Maps the addresses in RANGES, see BuildPerFunctionInstructionMap.
+  void BuildRuns(const std::string &name,
+                 const std::vector<std::pair<uint64_t, uint64_t>> &ranges);
+
+  // A map from instruction index to its information.
   std::vector<InstInfo> inst_map_;
 
-  // The starting address for inst_map_.  inst_map_[pc - start_addr_] maps to
-  // the information associated with pc.
-  uint64_t start_addr_;
+  // The runs of mapped addresses, sorted by address. Adjacent runs are
+  // merged, so a run always ends at an unmapped address.
+  std::vector<Run> runs_;
+
+  // The instruction starts, or nullptr if every byte counts as one.
+  const std::vector<uint64_t> *instruction_starts_ = nullptr;
+
+  // Source stacks indexed by InstInfo::source_stack_id. Adjacent instructions
+  // mapped to the same line table row share one entry.
+  std::vector<SourceStack> source_stacks_;
 
   // A map from symbol name to symbol data.
   SymbolMap *symbol_map_;
@@ -6,12 +6,19 @@
 
 #include "instruction_map.h"
 
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <thread>  // NOLINT(build/c++11)
+#include <vector>
+
 #include "base/commandlineflags.h"
 #include "addr2line.h"
 #include "sample_reader.h"
 #include "symbol_map.h"
 #include "gtest/gtest.h"
 #include "third_party/abseil/absl/flags/flag.h"
+#include "third_party/abseil/absl/strings/str_cat.h"
 
 ABSL_FLAG(std::string, binary, "", "Binary file name");
 
@@ -47,6 +54,165 @@ TEST_F(InstructionMapTest, PerFunctionInstructionMap) {
       addr2line, &symbol_map);
   symbol_map.AddSymbol("longest_match");
   inst_map.BuildPerFunctionInstructionMap("longest_match", 0x401680, 0x401871);
+  const devtools_crosstool_autofdo::InstructionMap::InstInfo *info =
+      inst_map.lookup(0x401680);
+  ASSERT_NE(info, nullptr);
+  ASSERT_FALSE(inst_map.source_stack(*info).empty());
+  EXPECT_STREQ(inst_map.source_stack(*info)[0].func_name, "longest_match");
+  // Bytes of the same line table row share one source stack.
+  const devtools_crosstool_autofdo::InstructionMap::InstInfo *row_begin =
+      inst_map.lookup(0x401681);
+  const devtools_crosstool_autofdo::InstructionMap::InstInfo *row_end =
+      inst_map.lookup(0x401683);
+  ASSERT_NE(row_begin, nullptr);
+  ASSERT_NE(row_end, nullptr);
+  EXPECT_EQ(row_begin->source_stack_id, row_end->source_stack_id);
+  EXPECT_NE(row_begin->source_stack_id, info->source_stack_id);
+  EXPECT_EQ(inst_map.lookup(0x401871), nullptr);
   delete addr2line;
 }
+
+TEST_F(InstructionMapTest, SparseInstructionMap) {
+  std::unique_ptr<Addr2line> addr2line(
+      Addr2line::Create(FLAGS_test_srcdir + kTestDataDir + "test.binary"));
+  ASSERT_NE(addr2line, nullptr);
+  devtools_crosstool_autofdo::SymbolMap symbol_map(
+      FLAGS_test_srcdir + kTestDataDir + "test.binary");
+  symbol_map.AddSymbol("longest_match");
+  devtools_crosstool_autofdo::InstructionMap dense_map(addr2line.get(),
+                                                       &symbol_map);
+  dense_map.BuildPerFunctionInstructionMap("longest_match", 0x401680,
+                                           0x401871);
+  devtools_crosstool_autofdo::InstructionMap sparse_map(addr2line.get(),
+                                                        &symbol_map);
+  // The first two ranges touch, so they form one run.
+  sparse_map.BuildPerFunctionInstructionMap(
+      "longest_match",
+      {{0x401680, 0x401690}, {0x401690, 0x4016a0}, {0x401800, 0x401810}});
+  ASSERT_EQ(sparse_map.runs().size(), 2);
+  EXPECT_EQ(sparse_map.size(), 0x30);
+
+  uint64_t index, run_end;
+  ASSERT_TRUE(sparse_map.FindIndex(0x401805, &index, &run_end));
+  EXPECT_EQ(index, 0x25);
+  EXPECT_EQ(run_end, 0x401810);
+  EXPECT_EQ(sparse_map.lookup(0x40167f), nullptr);
+  EXPECT_EQ(sparse_map.lookup(0x4016a0), nullptr);
+  EXPECT_EQ(sparse_map.lookup(0x401810), nullptr);
+  for (uint64_t addr : {0x401680, 0x40169f, 0x401800, 0x40180f}) {
+    const devtools_crosstool_autofdo::InstructionMap::InstInfo *sparse_info =
+        sparse_map.lookup(addr);
+    const devtools_crosstool_autofdo::InstructionMap::InstInfo *dense_info =
+        dense_map.lookup(addr);
+    ASSERT_NE(sparse_info, nullptr);
+    ASSERT_NE(dense_info, nullptr);
+    const devtools_crosstool_autofdo::SourceStack &sparse_stack =
+        sparse_map.source_stack(*sparse_info);
+    const devtools_crosstool_autofdo::SourceStack &dense_stack =
+        dense_map.source_stack(*dense_info);
+    ASSERT_EQ(sparse_stack.size(), dense_stack.size());
+    for (int i = 0; i < sparse_stack.size(); ++i) {
+      EXPECT_EQ(sparse_stack[i].line, dense_stack[i].line);
+    }
+  }
+}
+
+TEST_F(InstructionMapTest, InlineStacksForRangeMatchPerAddressStacks) {
+  std::unique_ptr<Addr2line> addr2line(
+      Addr2line::Create(FLAGS_test_srcdir + kTestDataDir + "test.binary"));
+  ASSERT_NE(addr2line, nullptr);
+  const uint64_t start_addr = 0x401de0;
+  const uint64_t end_addr = 0x401de0 + 2440;
+  uint64_t next_addr = start_addr;
+  int num_ranges = 0;
+  addr2line->GetInlineStacksForRange(
+      start_addr, end_addr,
+      [&](uint64_t begin, uint64_t end,
+          const devtools_crosstool_autofdo::SourceStack &stack) {
+        EXPECT_EQ(begin, next_addr);
+        EXPECT_LT(begin, end);
+        next_addr = end;
+        ++num_ranges;
+        for (uint64_t addr = begin; addr < end; ++addr) {
+          devtools_crosstool_autofdo::SourceStack expected;
+          addr2line->GetInlineStack(addr, &expected);
+          ASSERT_EQ(stack.size(), expected.size());
+          for (int i = 0; i < stack.size(); ++i) {
+            EXPECT_STREQ(stack[i].func_name, expected[i].func_name);
+            EXPECT_EQ(stack[i].file_name, expected[i].file_name);
+            EXPECT_EQ(stack[i].start_line, expected[i].start_line);
+            EXPECT_EQ(stack[i].line, expected[i].line);
+            EXPECT_EQ(stack[i].discriminator, expected[i].discriminator);
+          }
+        }
+      });
+  EXPECT_EQ(next_addr, end_addr);
+  // One range per line table row, not per byte.
+  EXPECT_LT(num_ranges, end_addr - start_addr);
+}
+
+TEST_F(InstructionMapTest, ConcurrentQueriesMatchSequentialQueries) {
+  const std::string binary = FLAGS_test_srcdir + kTestDataDir + "test.binary";
+  const uint64_t start_addr = 0x401680;
+  const uint64_t end_addr = 0x401871;
+  // Renders the inline stacks of all addresses of longest_match, through both
+  // query methods.
+  auto query_all = [&](const Addr2line &addr2line) {
+    std::vector<std::string> stacks;
+    auto add_stack = [&](const devtools_crosstool_autofdo::SourceStack &stack) {
+      std::string rendered;
+      for (const devtools_crosstool_autofdo::SourceInfo &info : stack) {
+        absl::StrAppend(&rendered, info.func_name ? info.func_name : "", ":",
+                        info.file_name, ":", info.start_line, ":", info.line,
+                        ".", info.discriminator, ";");
+      }
+      stacks.push_back(std::move(rendered));
+    };
+    for (uint64_t addr = start_addr; addr < end_addr; ++addr) {
+      devtools_crosstool_autofdo::SourceStack stack;
+      addr2line.GetInlineStack(addr, &stack);
+      add_stack(stack);
+    }
+    addr2line.GetInlineStacksForRange(
+        start_addr, end_addr,
+        [&](uint64_t begin, uint64_t end,
+            const devtools_crosstool_autofdo::SourceStack &stack) {
+          for (uint64_t addr = begin; addr < end; ++addr) add_stack(stack);
+        });
+    return stacks;
+  };
+
+  std::unique_ptr<Addr2line> sequential(Addr2line::Create(binary));
+  ASSERT_NE(sequential, nullptr);
+  const std::vector<std::string> expected = query_all(*sequential);
+
+  // No query runs before the concurrent ones, so they would race on any state
+  // left to be parsed lazily.
+  std::unique_ptr<Addr2line> concurrent(Addr2line::Create(binary));
+  ASSERT_NE(concurrent, nullptr);
+  ASSERT_TRUE(concurrent->PrepareForConcurrentQueries());
+  constexpr int kNumThreads = 8;
+  std::vector<std::vector<std::string>> results(kNumThreads);
+  std::vector<uint64_t> num_instructions(kNumThreads);
+  std::vector<std::thread> threads;
+  for (int t = 0; t < kNumThreads; ++t) {
+    threads.emplace_back([&, t]() {
+      results[t] = query_all(*concurrent);
+      // InstructionMaps of the same Addr2line may be built concurrently if
+      // they update different symbol maps.
+      devtools_crosstool_autofdo::SymbolMap symbol_map;
+      symbol_map.AddSymbol("longest_match");
+      devtools_crosstool_autofdo::InstructionMap inst_map(concurrent.get(),
+                                                          &symbol_map);
+      inst_map.BuildPerFunctionInstructionMap("longest_match", start_addr,
+                                              end_addr);
+      num_instructions[t] = inst_map.size();
+    });
+  }
+  for (std::thread &thread : threads) thread.join();
+  for (int t = 0; t < kNumThreads; ++t) {
+    EXPECT_EQ(results[t], expected) << "thread " << t;
+    EXPECT_EQ(num_instructions[t], end_addr - start_addr) << "thread " << t;
+  }
+}
 }  // namespace
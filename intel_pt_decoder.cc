@@ -0,0 +1,683 @@
+#include "intel_pt_decoder.h"
+
+#include <cstdint>
+#include <optional>
+#include <utility>
+#include <vector>
+
+#include "instruction_decoder.h"
+#include "third_party/abseil/absl/functional/function_ref.h"
+#include "third_party/abseil/absl/strings/string_view.h"
+#include "third_party/abseil/absl/types/span.h"
+
+namespace devtools_crosstool_autofdo {
+namespace {
+// The PSB packet, 02 82 repeated 8 times.
+constexpr absl::string_view kPsb(
+    "\x02\x82\x02\x82\x02\x82\x02\x82\x02\x82\x02\x82\x02\x82\x02\x82", 16);
+
+// Size of the IP payload of the packets of the TIP family, by their IPBytes
+// field, or -1 if the value is reserved.
+constexpr int kIpPayloadSizes[8] = {0, 2, 4, 6, 6, -1, 8, -1};
+
+// Depth of the call stack of return compression.
+constexpr int kMaxCallStackDepth = 64;
+
+// More direct branches than this without a packet, e.g. in a loop of direct
+// jumps, are taken as a desync.
+constexpr int kMaxPendingBranches = 1 << 12;
+
+enum class PacketType {
+  // Packets that do not matter to the flow, such as timing packets.
+  kIgnored,
+  kTnt,
+  kTip,
+  kTipPge,
+  kTipPgd,
+  kFup,
+  kPsb,
+  kPsbEnd,
+  kOverflow,
+  kModeTsx,
+  kTraceStop,
+  // Packets followed by a FUP that gives the address of their instruction,
+  // rather than of an interrupt.
+  kBindsFup,
+};
+
+struct Packet {
+  PacketType type = PacketType::kIgnored;
+  int64_t size = 0;
+  // The TNT bits, the oldest at bit tnt_count - 1.
+  uint64_t tnt_bits = 0;
+  int tnt_count = 0;
+  // The IP compression and payload of the packets of the TIP family.
+  int ip_bytes = 0;
+  uint64_t ip_payload = 0;
+  // The IP of the packets of the TIP family, unless it is suppressed.
+  std::optional<uint64_t> ip;
+  // Whether a MODE.TSX packet tells that the transaction aborted.
+  bool tsx_abort = false;
+};
+
+uint64_t LoadLittleEndian(absl::string_view data, int64_t pos, int size) {
+  uint64_t value = 0;
+  for (int i = size - 1; i >= 0; --i)
+    value = value << 8 | static_cast<uint8_t>(data[pos + i]);
+  return value;
+}
+
+// Returns the index of the highest set bit of VALUE, which must not be 0.
+int HighestBit(uint64_t value) { return 63 - __builtin_clzll(value); }
+
+// Parses the packet at POS of DATA into PACKET. Returns false if the packet is
+// truncated, not valid or not supported.
+bool ParsePacket(absl::string_view data, int64_t pos, Packet *packet) {
+  *packet = Packet();
+  const int64_t left = static_cast<int64_t>(data.size()) - pos;
+  auto sized = [&](int64_t size) {
+    packet->size = size;
+    return size <= left;
+  };
+  if (left <= 0) return false;
+  const uint8_t b = data[pos];
+  if (b == 0x00) return sized(1);  // PAD
+  if (b != 0x02 && (b & 1) == 0) {
+    // Short TNT, up to 6 bits below a stop bit.
+    const uint64_t payload = b >> 1;
+    packet->type = PacketType::kTnt;
+    packet->tnt_count = HighestBit(payload);
+    packet->tnt_bits = payload & ~(1ULL << packet->tnt_count);
+    return sized(1);
+  }
+  if ((b & 3) == 3) {
+    // CYC, followed by more bytes as long as the last one has bit 0 set.
+    int64_t size = 1;
+    bool more = b & 4;
+    while (more) {
+      if (size >= left) return false;
+      more = data[pos + size] & 1;
+      ++size;
+    }
+    return sized(size);
+  }
+  switch (b & 0x1f) {
+    case 0x0d:
+      packet->type = PacketType::kTip;
+      break;
+    case 0x11:
+      packet->type = PacketType::kTipPge;
+      break;
+    case 0x01:
+      packet->type = PacketType::kTipPgd;
+      break;
+    case 0x1d:
+      packet->type = PacketType::kFup;
+      break;
+  }
+  if (packet->type != PacketType::kIgnored) {
+    packet->ip_bytes = b >> 5;
+    const int payload_size = kIpPayloadSizes[packet->ip_bytes];
+    if (payload_size < 0 || !sized(1 + payload_size)) return false;
+    packet->ip_payload = LoadLittleEndian(data, pos + 1, payload_size);
+    return true;
+  }
+  if (b == 0x19) return sized(8);  // TSC
+  if (b == 0x59) return sized(2);  // MTC
+  if (b == 0x99) {
+    // MODE, of which only MODE.TSX matters.
+    if (!sized(2)) return false;
+    const uint8_t mode = data[pos + 1];
+    if (mode >> 5 == 1) {
+      packet->type = PacketType::kModeTsx;
+      packet->tsx_abort = mode & 2;
+    }
+    return true;
+  }
+  if (b != 0x02 || left < 2) return false;
+
+  const uint8_t c = data[pos + 1];
+  switch (c) {
+    case 0xa3: {
+      // Long TNT, up to 47 bits below a stop bit.
+      if (!sized(8)) return false;
+      const uint64_t payload = LoadLittleEndian(data, pos + 2, 6);
+      if (payload == 0) return false;
+      packet->type = PacketType::kTnt;
+      packet->tnt_count = HighestBit(payload);
+      packet->tnt_bits = payload & ~(1ULL << packet->tnt_count);
+      return true;
+    }
+    case 0x82:
+      packet->type = PacketType::kPsb;
+      return sized(kPsb.size()) && data.substr(pos, kPsb.size()) == kPsb;
+    case 0x23:
+      packet->type = PacketType::kPsbEnd;
+      return sized(2);
+    case 0xf3:
+      packet->type = PacketType::kOverflow;
+      return sized(2);
+    case 0x83:
+      packet->type = PacketType::kTraceStop;
+      return sized(2);
+    case 0x43:  // PIP
+      return sized(8);
+    case 0x03:  // CBR
+      return sized(4);
+    case 0xc8:  // VMCS
+    case 0x73:  // TMA
+    case 0xa2:  // PWRX
+      return sized(7);
+    case 0xc3:  // MNT
+      return sized(11);
+    case 0x62:  // EXSTOP
+      return sized(2);
+    case 0xe2:  // EXSTOP with IP
+      packet->type = PacketType::kBindsFup;
+      return sized(2);
+    case 0xc2:  // MWAIT
+      return sized(10);
+    case 0x22:  // PWRE
+      return sized(4);
+  }
+  if ((c & 0x1f) == 0x12) {
+    // PTWRITE, with a 4 or 8 byte payload.
+    const int payload_size = (c >> 5 & 3) == 0 ? 4 : (c >> 5 & 3) == 1 ? 8 : -1;
+    if (payload_size < 0) return false;
+    if (c & 0x80) packet->type = PacketType::kBindsFup;
+    return sized(2 + payload_size);
+  }
+  // Block and event trace packets, and unknown ones.
+  return false;
+}
+
+// Returns the IP of a packet of the TIP family, given the last IP, or
+// std::nullopt if it is suppressed.
+std::optional<uint64_t> PacketIp(const Packet &packet, uint64_t last_ip) {
+  switch (packet.ip_bytes) {
+    case 0:
+      return std::nullopt;
+    case 1:
+      return (last_ip & ~0xffffULL) | packet.ip_payload;
+    case 2:
+      return (last_ip & ~0xffffffffULL) | packet.ip_payload;
+    case 3:
+      // Sign-extended from 48 bits.
+      return static_cast<uint64_t>(
+          static_cast<int64_t>(packet.ip_payload << 16) >> 16);
+    case 4:
+      return (last_ip & ~0xffffffffffffULL) | packet.ip_payload;
+    default:
+      return packet.ip_payload;
+  }
+}
+
+// Follows the flow of one segment through the code.
+//
+// The flow is walked from control transfer to control transfer. Direct jumps
+// and calls need no packet, so they are kept pending until the next packet
+// tells that the flow got past them: an interrupt on the way is told by a FUP
+// with its address, and only the pending branches before that address were
+// taken.
+class SegmentDecoder {
+ public:
+  SegmentDecoder(
+      absl::string_view trace, int64_t begin, int64_t end,
+      absl::FunctionRef<std::optional<ControlTransfer>(uint64_t)>
+          read_control_transfer,
+      absl::FunctionRef<void(absl::Span<const std::pair<uint64_t, uint64_t>>)>
+          add_run)
+      : trace_(trace),
+        pos_(begin),
+        end_(end),
+        read_control_transfer_(read_control_transfer),
+        add_run_(add_run) {}
+
+  IntelPtDecodeStats Decode();
+
+ private:
+  // A direct branch on the way to the control transfer being resolved, and
+  // the start of the sequential code that ends with it.
+  struct PendingBranch {
+    uint64_t start;
+    uint64_t from;
+    uint64_t to;
+  };
+
+  bool InCode(uint64_t ip) {
+    return read_control_transfer_(ip).has_value();
+  }
+
+  // Reads the next packet that matters to the flow into PACKET. Returns false
+  // at the end of the trace or at a packet that can not be parsed.
+  bool NextPacket(Packet *packet);
+
+  // Reads the packets of a PSB+ up to its PSBEND, after the PSB, and sets IP
+  // to the address of its FUP, if any. Returns false if they can not be
+  // parsed.
+  bool ReadPsbPlus(std::optional<uint64_t> *ip);
+
+  // Reads the next TNT or TIP packet into PACKET, to resolve the control
+  // transfer at ADDRESS. Returns false if another packet or the end of the
+  // packets came first, which is then handled.
+  bool NextResolvingPacket(uint64_t address, Packet *packet);
+
+  // Handles a packet that stops the flow before the control transfer at
+  // ADDRESS is resolved.
+  void HandleEvent(const Packet &packet, uint64_t address);
+
+  // Returns whether the conditional branch at ADDRESS is taken, or
+  // std::nullopt if the flow was stopped first.
+  std::optional<bool> NextTnt(uint64_t address);
+
+  // Returns the target of an indirect branch, a return or a far transfer, or
+  // std::nullopt if the flow was stopped first.
+  std::optional<uint64_t> NextTarget(const ControlTransfer &transfer);
+
+  // Reads packets until the flow enters the code, if the segment does not
+  // end first.
+  void WaitForEnable();
+
+  void Enable(uint64_t ip) {
+    enabled_ = true;
+    ip_ = ip;
+    tnt_count_ = 0;
+  }
+
+  void PushCall(uint64_t return_address) {
+    if (call_stack_.size() == kMaxCallStackDepth)
+      call_stack_.erase(call_stack_.begin());
+    call_stack_.push_back(return_address);
+  }
+
+  // Adds the pending branches taken before the flow got to IP to the run.
+  // Returns false if IP is not on the way to the control transfer at
+  // ADDRESS.
+  bool CommitPendingBefore(uint64_t ip, uint64_t address);
+
+  void CommitPending() {
+    for (const PendingBranch &branch : pending_)
+      run_.emplace_back(branch.from, branch.to);
+    pending_.clear();
+  }
+
+  // Ends the current run, dropping the pending branches.
+  void EndRun();
+
+  // Stops decoding the segment.
+  void Desync() {
+    ++stats_.desyncs;
+    EndRun();
+    done_ = true;
+  }
+
+  const absl::string_view trace_;
+  int64_t pos_;
+  const int64_t end_;
+  absl::FunctionRef<std::optional<ControlTransfer>(uint64_t)>
+      read_control_transfer_;
+  absl::FunctionRef<void(absl::Span<const std::pair<uint64_t, uint64_t>>)>
+      add_run_;
+
+  uint64_t last_ip_ = 0;
+  // Whether the flow is followed from ip_, rather than disabled or out of
+  // the code.
+  bool enabled_ = false;
+  uint64_t ip_ = 0;
+  // The start of the sequential code that ends with the control transfer
+  // being resolved.
+  uint64_t start_ = 0;
+  uint64_t tnt_bits_ = 0;
+  int tnt_count_ = 0;
+  bool ignore_next_fup_ = false;
+  bool after_overflow_ = false;
+  bool done_ = false;
+  std::vector<uint64_t> call_stack_;
+  std::vector<PendingBranch> pending_;
+  std::vector<std::pair<uint64_t, uint64_t>> run_;
+  IntelPtDecodeStats stats_;
+};
+
+IntelPtDecodeStats SegmentDecoder::Decode() {
+  stats_.segments = 1;
+  Packet packet;
+  std::optional<uint64_t> ip;
+  if (!ParsePacket(trace_, pos_, &packet) ||
+      packet.type != PacketType::kPsb) {
+    Desync();
+    return stats_;
+  }
+  pos_ += packet.size;
+  if (!ReadPsbPlus(&ip)) {
+    Desync();
+    return stats_;
+  }
+  if (ip.has_value() && InCode(*ip)) Enable(*ip);
+
+  while (!done_) {
+    if (!enabled_) {
+      WaitForEnable();
+      continue;
+    }
+    start_ = ip_;
+    const std::optional<ControlTransfer> transfer =
+        read_control_transfer_(ip_);
+    if (!transfer.has_value()) {
+      Desync();
+      break;
+    }
+    switch (transfer->kind) {
+      case ControlTransfer::kDirectCall:
+      case ControlTransfer::kDirectJump:
+        if (pending_.size() == kMaxPendingBranches) {
+          Desync();
+          break;
+        }
+        if (transfer->kind == ControlTransfer::kDirectCall)
+          PushCall(transfer->address + transfer->size);
+        pending_.push_back({start_, transfer->address, transfer->target});
+        ip_ = transfer->target;
+        break;
+      case ControlTransfer::kConditionalBranch: {
+        const std::optional<bool> taken = NextTnt(transfer->address);
+        if (!taken.has_value()) break;
+        CommitPending();
+        if (*taken) {
+          run_.emplace_back(transfer->address, transfer->target);
+          ip_ = transfer->target;
+        } else {
+          ip_ = transfer->address + transfer->size;
+        }
+        break;
+      }
+      default: {
+        const std::optional<uint64_t> target = NextTarget(*transfer);
+        if (!target.has_value()) break;
+        CommitPending();
+        if (transfer->kind == ControlTransfer::kIndirectCall)
+          PushCall(transfer->address + transfer->size);
+        // Far transfers leave the code of the process.
+        if (transfer->kind == ControlTransfer::kFarTransfer ||
+            !InCode(*target)) {
+          EndRun();
+          enabled_ = false;
+          break;
+        }
+        run_.emplace_back(transfer->address, *target);
+        ip_ = *target;
+        break;
+      }
+    }
+  }
+  EndRun();
+  return stats_;
+}
+
+bool SegmentDecoder::NextPacket(Packet *packet) {
+  while (true) {
+    // A packet that ran over the end of the segment tells that the PSB found
+    // there is a part of the packet.
+    if (pos_ > end_ || !ParsePacket(trace_, pos_, packet)) return false;
+    pos_ += packet->size;
+    switch (packet->type) {
+      case PacketType::kTip:
+      case PacketType::kTipPge:
+      case PacketType::kTipPgd:
+      case PacketType::kFup:
+        packet->ip = PacketIp(*packet, last_ip_);
+        if (packet->ip.has_value()) last_ip_ = *packet->ip;
+        break;
+      default:
+        break;
+    }
+    switch (packet->type) {
+      case PacketType::kIgnored:
+      case PacketType::kPsbEnd:
+        continue;
+      case PacketType::kBindsFup:
+        ignore_next_fup_ = true;
+        continue;
+      case PacketType::kModeTsx:
+        // The FUP of an abort is followed by the TIP to the abort handler,
+        // like an interrupt.
+        if (!packet->tsx_abort) ignore_next_fup_ = true;
+        continue;
+      case PacketType::kFup:
+        if (!ignore_next_fup_) return true;
+        ignore_next_fup_ = false;
+        continue;
+      default:
+        return true;
+    }
+  }
+}
+
+bool SegmentDecoder::ReadPsbPlus(std::optional<uint64_t> *ip) {
+  last_ip_ = 0;
+  ignore_next_fup_ = false;
+  Packet packet;
+  while (ParsePacket(trace_, pos_, &packet)) {
+    pos_ += packet.size;
+    if (packet.type == PacketType::kPsbEnd) return true;
+    if (packet.type == PacketType::kFup) {
+      *ip = PacketIp(packet, last_ip_);
+      if (ip->has_value()) last_ip_ = **ip;
+    }
+  }
+  return false;
+}
+
+bool SegmentDecoder::NextResolvingPacket(uint64_t address, Packet *packet) {
+  if (!NextPacket(packet)) {
+    // The trace may end anywhere, the pending branches are then unknown.
+    if (pos_ >= static_cast<int64_t>(trace_.size())) {
+      EndRun();
+      done_ = true;
+    } else {
+      Desync();
+    }
+    return false;
+  }
+  if (packet->type == PacketType::kTnt || packet->type == PacketType::kTip)
+    return true;
+  HandleEvent(*packet, address);
+  return false;
+}
+
+void SegmentDecoder::HandleEvent(const Packet &packet, uint64_t address) {
+  switch (packet.type) {
+    case PacketType::kFup:
+      // An interrupt, an exception or a transaction abort before the
+      // instruction at the FUP address, followed by a TIP to its handler or a
+      // TIP.PGD. The handler is followed if it is in the code.
+      if (!packet.ip.has_value() ||
+          !CommitPendingBefore(*packet.ip, address)) {
+        Desync();
+        return;
+      }
+      EndRun();
+      enabled_ = false;
+      return;
+    case PacketType::kTipPgd: {
+      // Tracing was disabled by the control transfer at ADDRESS, or by a
+      // pending branch to the address of the TIP.PGD, if it has one.
+      size_t taken = pending_.size();
+      for (size_t i = 0; packet.ip.has_value() && i < pending_.size(); ++i) {
+        if (pending_[i].to == *packet.ip) {
+          taken = i;
+          break;
+        }
+      }
+      pending_.resize(taken);
+      CommitPending();
+      EndRun();
+      enabled_ = false;
+      return;
+    }
+    case PacketType::kOverflow:
+      // Tracing resumes at the address of the next FUP.
+      ++stats_.overflows;
+      EndRun();
+      enabled_ = false;
+      after_overflow_ = true;
+      return;
+    case PacketType::kPsb: {
+      // The end of the segment. The next segment follows the flow from the
+      // FUP of its PSB+.
+      std::optional<uint64_t> ip;
+      if (ReadPsbPlus(&ip) && ip.has_value())
+        CommitPendingBefore(*ip, address);
+      EndRun();
+      done_ = true;
+      return;
+    }
+    case PacketType::kTraceStop:
+      EndRun();
+      done_ = true;
+      return;
+    default:
+      // A TIP.PGE while tracing is enabled.
+      Desync();
+      return;
+  }
+}
+
+std::optional<bool> SegmentDecoder::NextTnt(uint64_t address) {
+  if (tnt_count_ == 0) {
+    Packet packet;
+    if (!NextResolvingPacket(address, &packet)) return std::nullopt;
+    if (packet.type != PacketType::kTnt) {
+      Desync();
+      return std::nullopt;
+    }
+    tnt_bits_ = packet.tnt_bits;
+    tnt_count_ = packet.tnt_count;
+  }
+  --tnt_count_;
+  return (tnt_bits_ >> tnt_count_ & 1) != 0;
+}
+
+std::optional<uint64_t> SegmentDecoder::NextTarget(
+    const ControlTransfer &transfer) {
+  const bool is_return = transfer.kind == ControlTransfer::kReturn;
+  // Only returns are resolved by a TNT bit, when they are compressed.
+  if (!is_return && tnt_count_ != 0) {
+    Desync();
+    return std::nullopt;
+  }
+  if (!is_return || tnt_count_ == 0) {
+    Packet packet;
+    if (!NextResolvingPacket(transfer.address, &packet)) return std::nullopt;
+    if (packet.type == PacketType::kTip) {
+      if (!packet.ip.has_value()) {
+        // The target is out of context.
+        CommitPending();
+        EndRun();
+        enabled_ = false;
+        return std::nullopt;
+      }
+      if (is_return && !call_stack_.empty() &&
+          call_stack_.back() == *packet.ip)
+        call_stack_.pop_back();
+      return packet.ip;
+    }
+    if (!is_return) {
+      Desync();
+      return std::nullopt;
+    }
+    tnt_bits_ = packet.tnt_bits;
+    tnt_count_ = packet.tnt_count;
+  }
+  --tnt_count_;
+  if ((tnt_bits_ >> tnt_count_ & 1) == 0 || call_stack_.empty()) {
+    Desync();
+    return std::nullopt;
+  }
+  const uint64_t target = call_stack_.back();
+  call_stack_.pop_back();
+  return target;
+}
+
+void SegmentDecoder::WaitForEnable() {
+  Packet packet;
+  while (!done_) {
+    if (!NextPacket(&packet)) {
+      if (pos_ < static_cast<int64_t>(trace_.size())) ++stats_.desyncs;
+      done_ = true;
+      return;
+    }
+    switch (packet.type) {
+      case PacketType::kTip:
+      case PacketType::kTipPge:
+        if (packet.ip.has_value() && InCode(*packet.ip)) {
+          Enable(*packet.ip);
+          return;
+        }
+        break;
+      case PacketType::kFup:
+        if (after_overflow_ && packet.ip.has_value() && InCode(*packet.ip)) {
+          after_overflow_ = false;
+          Enable(*packet.ip);
+          return;
+        }
+        break;
+      case PacketType::kOverflow:
+        ++stats_.overflows;
+        after_overflow_ = true;
+        break;
+      case PacketType::kPsb:
+      case PacketType::kTraceStop:
+        done_ = true;
+        return;
+      default:
+        // TNT bits and TIP.PGD of code that is not followed.
+        break;
+    }
+  }
+}
+
+bool SegmentDecoder::CommitPendingBefore(uint64_t ip, uint64_t address) {
+  for (size_t i = 0; i < pending_.size(); ++i) {
+    if (pending_[i].start <= ip && ip <= pending_[i].from) {
+      pending_.resize(i);
+      CommitPending();
+      return true;
+    }
+  }
+  if (start_ <= ip && ip <= address) {
+    CommitPending();
+    return true;
+  }
+  return false;
+}
+
+void SegmentDecoder::EndRun() {
+  pending_.clear();
+  if (run_.empty()) return;
+  add_run_(run_);
+  ++stats_.runs;
+  stats_.branches += run_.size();
+  run_.clear();
+}
+}  // namespace
+
+std::vector<int64_t> FindPsbOffsets(absl::string_view trace) {
+  std::vector<int64_t> offsets;
+  for (size_t pos = trace.find(kPsb); pos != absl::string_view::npos;
+       pos = trace.find(kPsb, pos + kPsb.size())) {
+    offsets.push_back(pos);
+  }
+  return offsets;
+}
+
+IntelPtDecodeStats DecodeIntelPtSegment(
+    absl::string_view trace, int64_t begin, int64_t end,
+    absl::FunctionRef<std::optional<ControlTransfer>(uint64_t)>
+        read_control_transfer,
+    absl::FunctionRef<void(absl::Span<const std::pair<uint64_t, uint64_t>>)>
+        add_run) {
+  return SegmentDecoder(trace, begin, end, read_control_transfer, add_run)
+      .Decode();
+}
+
+}  // namespace devtools_crosstool_autofdo
@@ -0,0 +1,78 @@
+// Decodes Intel Processor Trace (PT) data into the taken branches of the
+// traced code, see the Intel SDM, Volume 3, chapter "Intel Processor Trace".
+
+#ifndef AUTOFDO_INTEL_PT_DECODER_H_
+#define AUTOFDO_INTEL_PT_DECODER_H_
+
+#include <cstdint>
+#include <optional>
+#include <utility>
+#include <vector>
+
+#include "instruction_decoder.h"
+#include "third_party/abseil/absl/functional/function_ref.h"
+#include "third_party/abseil/absl/strings/string_view.h"
+#include "third_party/abseil/absl/types/span.h"
+
+namespace devtools_crosstool_autofdo {
+
+// Statistics of the decoding of Intel PT segments.
+struct IntelPtDecodeStats {
+  uint64_t segments = 0;
+  // Runs of branches that were followed without interruption.
+  uint64_t runs = 0;
+  uint64_t branches = 0;
+  // Segments whose decoding stopped early, because the trace did not match
+  // the code, left the code without a packet telling where it went, or has
+  // packets that are not supported.
+  uint64_t desyncs = 0;
+  // Overflow packets, each of which tells that some trace was lost.
+  uint64_t overflows = 0;
+
+  IntelPtDecodeStats &operator+=(const IntelPtDecodeStats &s) {
+    segments += s.segments;
+    runs += s.runs;
+    branches += s.branches;
+    desyncs += s.desyncs;
+    overflows += s.overflows;
+    return *this;
+  }
+};
+
+// Returns the offsets of the PSB packets of TRACE, in increasing order. The
+// decoder can start at every PSB packet, so the trace between two of them is
+// a segment that can be decoded independently of the others.
+std::vector<int64_t> FindPsbOffsets(absl::string_view trace);
+
+// Decodes the segment of TRACE that starts at the PSB packet at BEGIN and ends
+// at END, the offset of the next PSB packet or the size of TRACE. The flow is
+// followed through the code with READ_CONTROL_TRANSFER, which returns the
+// first control transfer at or after an address of the traced code, with the
+// targets of direct branches in the same address space, or std::nullopt if
+// the address is not in the traced code.
+//
+// ADD_RUN is called with the taken branches, <from, to> address pairs in
+// execution order, of every run of the flow that was followed without
+// interruption, like the branch stack of an LBR sample but unbounded. The
+// code between the target of a branch and the source of the next branch of a
+// run is executed in sequence. A run ends where tracing is disabled, the flow
+// leaves the code read by READ_CONTROL_TRANSFER or is interrupted, and the
+// flow is followed again where it reenters the code.
+//
+// The decoder supports the traces of user-space code in 64-bit mode. Tracing
+// is best filtered to the binary, e.g. with `perf record -e intel_pt//u
+// --filter 'filter * @ <binary>'`, and return compression disabled with the
+// `noretcomp` term, as returns whose calls are not in the segment can only be
+// followed if they are not compressed. Timing, power and PTWRITE packets are
+// skipped, and segments with block (BBP) or event trace (CFE, EVD) packets
+// are only decoded up to them.
+IntelPtDecodeStats DecodeIntelPtSegment(
+    absl::string_view trace, int64_t begin, int64_t end,
+    absl::FunctionRef<std::optional<ControlTransfer>(uint64_t)>
+        read_control_transfer,
+    absl::FunctionRef<void(absl::Span<const std::pair<uint64_t, uint64_t>>)>
+        add_run);
+
+}  // namespace devtools_crosstool_autofdo
+
+#endif  // AUTOFDO_INTEL_PT_DECODER_H_
@@ -0,0 +1,238 @@
+#include "intel_pt_decoder.h"
+
+#include <cstdint>
+#include <map>
+#include <optional>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+#include "instruction_decoder.h"
+#include "third_party/abseil/absl/types/span.h"
+
+namespace {
+
+using ::devtools_crosstool_autofdo::ControlTransfer;
+using ::devtools_crosstool_autofdo::DecodeIntelPtSegment;
+using ::devtools_crosstool_autofdo::FindPsbOffsets;
+using ::devtools_crosstool_autofdo::IntelPtDecodeStats;
+using ::testing::ElementsAre;
+using ::testing::IsEmpty;
+using ::testing::Pair;
+
+// The code of the tests is in [kCodeStart, kCodeEnd).
+constexpr uint64_t kCodeStart = 0x1000;
+constexpr uint64_t kCodeEnd = 0x4000;
+
+// Builds the packets of a trace.
+class Trace {
+ public:
+  Trace &Psb() {
+    for (int i = 0; i < 8; ++i) data_ += "\x02\x82";
+    return *this;
+  }
+  Trace &PsbEnd() { return Bytes({0x02, 0x23}); }
+  Trace &Overflow() { return Bytes({0x02, 0xf3}); }
+  // Taken and not taken bits, the oldest first.
+  Trace &Tnt(const std::vector<bool> &bits) {
+    uint8_t payload = 1;
+    for (bool bit : bits) payload = payload << 1 | bit;
+    return Bytes({static_cast<uint8_t>(payload << 1)});
+  }
+  Trace &Fup(uint64_t ip) { return Ip(0x1d, ip); }
+  Trace &Tip(uint64_t ip) { return Ip(0x0d, ip); }
+  Trace &TipPge(uint64_t ip) { return Ip(0x11, ip); }
+  // A TIP.PGD with its IP suppressed.
+  Trace &TipPgd() { return Bytes({0x01}); }
+  // A TIP that only updates the low 16 bits of the last IP.
+  Trace &TipLow16(uint16_t ip) {
+    return Bytes(
+        {0x2d, static_cast<uint8_t>(ip), static_cast<uint8_t>(ip >> 8)});
+  }
+  // PAD, TSC, MTC and CYC packets.
+  Trace &Timing() {
+    return Bytes({0x00, 0x19, 1, 2, 3, 4, 5, 6, 7, 0x59, 8, 0x07, 0x02});
+  }
+  Trace &Bytes(const std::vector<uint8_t> &bytes) {
+    data_.append(bytes.begin(), bytes.end());
+    return *this;
+  }
+
+  const std::string &data() const { return data_; }
+
+ private:
+  // A packet of the TIP family with the full IP.
+  Trace &Ip(uint8_t type, uint64_t ip) {
+    data_ += static_cast<char>(6 << 5 | type);
+    for (int i = 0; i < 8; ++i) data_ += static_cast<char>(ip >> (8 * i));
+    return *this;
+  }
+
+  std::string data_;
+};
+
+struct Decoded {
+  std::vector<std::vector<std::pair<uint64_t, uint64_t>>> runs;
+  IntelPtDecodeStats stats;
+};
+
+// Decodes the segment of TRACE at [BEGIN, END), or the whole trace, in code
+// with TRANSFERS.
+Decoded Decode(const Trace &trace,
+               const std::vector<ControlTransfer> &transfers,
+               int64_t begin = 0, int64_t end = -1) {
+  std::map<uint64_t, ControlTransfer> code;
+  for (const ControlTransfer &transfer : transfers)
+    code.emplace(transfer.address, transfer);
+  auto read_control_transfer =
+      [&](uint64_t ip) -> std::optional<ControlTransfer> {
+    if (ip < kCodeStart || ip >= kCodeEnd) return std::nullopt;
+    auto it = code.lower_bound(ip);
+    if (it == code.end()) return std::nullopt;
+    return it->second;
+  };
+  Decoded decoded;
+  auto add_run = [&](absl::Span<const std::pair<uint64_t, uint64_t>> run) {
+    decoded.runs.emplace_back(run.begin(), run.end());
+  };
+  decoded.stats = DecodeIntelPtSegment(
+      trace.data(), begin, end < 0 ? trace.data().size() : end,
+      read_control_transfer, add_run);
+  return decoded;
+}
+
+TEST(IntelPtDecoderTest, FollowsBranches) {
+  const std::vector<ControlTransfer> code = {
+      {ControlTransfer::kConditionalBranch, 0x1008, 2, 0x1000},
+      {ControlTransfer::kDirectCall, 0x100a, 5, 0x2000},
+      {ControlTransfer::kIndirectJump, 0x100f, 2},
+      {ControlTransfer::kReturn, 0x2004, 1},
+      {ControlTransfer::kConditionalBranch, 0x3004, 2, 0x3100},
+      {ControlTransfer::kReturn, 0x3010, 1},
+  };
+  Trace trace;
+  trace.Psb().Fup(0x1000).PsbEnd().Timing();
+  // Two iterations of the loop, the call and the return.
+  trace.Tnt({true, true, false}).Timing().TipLow16(0x100f);
+  // The indirect jump, then the return leaves the traced code.
+  trace.Tip(0x3000).Tnt({false}).TipPgd();
+
+  const Decoded decoded = Decode(trace, code);
+  EXPECT_THAT(decoded.runs,
+              ElementsAre(ElementsAre(
+                  Pair(0x1008, 0x1000), Pair(0x1008, 0x1000),
+                  Pair(0x100a, 0x2000), Pair(0x2004, 0x100f),
+                  Pair(0x100f, 0x3000))));
+  EXPECT_EQ(decoded.stats.segments, 1);
+  EXPECT_EQ(decoded.stats.runs, 1);
+  EXPECT_EQ(decoded.stats.branches, 5);
+  EXPECT_EQ(decoded.stats.desyncs, 0);
+}
+
+TEST(IntelPtDecoderTest, FollowsCompressedReturns) {
+  const std::vector<ControlTransfer> code = {
+      {ControlTransfer::kDirectCall, 0x1000, 5, 0x2000},
+      {ControlTransfer::kConditionalBranch, 0x1005, 2, 0x1000},
+      {ControlTransfer::kIndirectJump, 0x1010, 2},
+      {ControlTransfer::kReturn, 0x2000, 1},
+  };
+  Trace trace;
+  trace.Psb().Fup(0x1000).PsbEnd().Tnt({true, true, true, false});
+
+  const Decoded decoded = Decode(trace, code);
+  EXPECT_THAT(decoded.runs,
+              ElementsAre(ElementsAre(
+                  Pair(0x1000, 0x2000), Pair(0x2000, 0x1005),
+                  Pair(0x1005, 0x1000), Pair(0x1000, 0x2000),
+                  Pair(0x2000, 0x1005))));
+  EXPECT_EQ(decoded.stats.desyncs, 0);
+}
+
+TEST(IntelPtDecoderTest, InterruptEndsRun) {
+  const std::vector<ControlTransfer> code = {
+      {ControlTransfer::kDirectJump, 0x1004, 2, 0x1100},
+      {ControlTransfer::kDirectJump, 0x1104, 2, 0x1200},
+      {ControlTransfer::kConditionalBranch, 0x1208, 2, 0x1000},
+      {ControlTransfer::kReturn, 0x1210, 1},
+  };
+  Trace trace;
+  trace.Psb().Fup(0x1000).PsbEnd();
+  // An interrupt at 0x1102 is handled in the kernel.
+  trace.Fup(0x1102).TipPgd().TipPge(0x1102).Tnt({false});
+
+  const Decoded decoded = Decode(trace, code);
+  // The trace ends before the return is resolved.
+  EXPECT_THAT(decoded.runs, ElementsAre(ElementsAre(Pair(0x1004, 0x1100)),
+                                        ElementsAre(Pair(0x1104, 0x1200))));
+  EXPECT_EQ(decoded.stats.runs, 2);
+  EXPECT_EQ(decoded.stats.desyncs, 0);
+}
+
+TEST(IntelPtDecoderTest, OverflowResumesAtFup) {
+  const std::vector<ControlTransfer> code = {
+      {ControlTransfer::kConditionalBranch, 0x1008, 2, 0x1000},
+      {ControlTransfer::kIndirectJump, 0x100a, 2},
+  };
+  Trace trace;
+  trace.Psb().Fup(0x1000).PsbEnd().Tnt({true});
+  trace.Overflow().Tnt({true}).Fup(0x1000).Tnt({true, false}).TipPgd();
+
+  const Decoded decoded = Decode(trace, code);
+  EXPECT_THAT(decoded.runs, ElementsAre(ElementsAre(Pair(0x1008, 0x1000)),
+                                        ElementsAre(Pair(0x1008, 0x1000))));
+  EXPECT_EQ(decoded.stats.overflows, 1);
+  EXPECT_EQ(decoded.stats.desyncs, 0);
+}
+
+TEST(IntelPtDecoderTest, SegmentsAreDecodedIndependently) {
+  const std::vector<ControlTransfer> code = {
+      {ControlTransfer::kDirectJump, 0x1004, 2, 0x1100},
+      {ControlTransfer::kDirectJump, 0x1104, 2, 0x1200},
+      {ControlTransfer::kConditionalBranch, 0x1208, 2, 0x1000},
+  };
+  Trace trace;
+  trace.Psb().Fup(0x1000).PsbEnd();
+  const int64_t second = trace.data().size();
+  trace.Psb().Fup(0x1202).PsbEnd().Tnt({true});
+
+  const std::vector<int64_t> offsets = FindPsbOffsets(trace.data());
+  EXPECT_THAT(offsets, ElementsAre(0, second));
+  // The pending jumps of the first segment are taken before the FUP of the
+  // next PSB+.
+  EXPECT_THAT(Decode(trace, code, 0, second).runs,
+              ElementsAre(ElementsAre(Pair(0x1004, 0x1100),
+                                      Pair(0x1104, 0x1200))));
+  EXPECT_THAT(Decode(trace, code, second).runs,
+              ElementsAre(ElementsAre(Pair(0x1208, 0x1000))));
+}
+
+TEST(IntelPtDecoderTest, StopsAtMismatch) {
+  const std::vector<ControlTransfer> code = {
+      {ControlTransfer::kConditionalBranch, 0x1008, 2, 0x1000},
+      {ControlTransfer::kIndirectJump, 0x100a, 2},
+  };
+  Trace trace;
+  trace.Psb().Fup(0x1000).PsbEnd().Tnt({true});
+  // A TNT bit for an indirect jump.
+  trace.Tnt({false, true});
+  Decoded decoded = Decode(trace, code);
+  EXPECT_THAT(decoded.runs, ElementsAre(ElementsAre(Pair(0x1008, 0x1000))));
+  EXPECT_EQ(decoded.stats.desyncs, 1);
+
+  // Block trace packets are not supported.
+  Trace blocks;
+  blocks.Psb().Fup(0x1000).PsbEnd().Bytes({0x02, 0x63, 0x00});
+  decoded = Decode(blocks, code);
+  EXPECT_THAT(decoded.runs, IsEmpty());
+  EXPECT_EQ(decoded.stats.desyncs, 1);
+}
+
+TEST(IntelPtDecoderTest, NoPsb) {
+  EXPECT_THAT(FindPsbOffsets(std::string("\x02\x82\x02\x82", 4)), IsEmpty());
+  Trace trace;
+  trace.Tnt({true});
+  EXPECT_EQ(Decode(trace, {}).stats.desyncs, 1);
+}
+}  // namespace
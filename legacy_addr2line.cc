@@ -18,7 +18,17 @@
 
 #include <string.h>
 
+#include <atomic>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <set>
+#include <thread>  // NOLINT(build/c++11)
+#include <utility>
+#include <vector>
+
 #include "base/logging.h"
+#include "parallel_for.h"
 #include "symbolize/bytereader.h"
 #include "symbolize/dwarf2reader.h"
 #include "symbolize/dwarf3ranges.h"
@@ -26,6 +36,15 @@
 #include "symbolize/functioninfo.h"
 #include "symbolize/elf_reader.h"
 #include "symbol_map.h"
+#include "trace_events.h"
+#include "third_party/abseil/absl/flags/flag.h"
+
+ABSL_FLAG(uint32_t, addr2line_prepare_threads, 1,
+          "Number of threads used to read the compilation units in "
+          ".debug_info when preparing the legacy symbolizer.");
+ABSL_FLAG(bool, addr2line_skip_unsampled_units, true,
+          "When symbolizing only the sampled functions, skip the compilation "
+          "units whose .debug_aranges ranges contain none of them.");
 
 namespace {
 void GetSection(const devtools_crosstool_autofdo::SectionMap &sections,
@@ -52,6 +71,90 @@ void GetSection(const devtools_crosstool_autofdo::SectionMap &sections,
   if (size_p)
     *size_p = size;
 }
+
+// Returns the offsets of the compilation units in .debug_info by walking
+// the unit headers only. The last offset is that of the first unit whose
+// length is unusable, which the caller will find malformed when parsing.
+std::vector<uint64_t> GetCompilationUnitOffsets(const char *debug_info_data,
+                                                size_t debug_info_size) {
+  devtools_crosstool_autofdo::ByteReader reader(
+      devtools_crosstool_autofdo::ENDIANNESS_LITTLE);
+  std::vector<uint64_t> offsets;
+  uint64_t pos = 0;
+  while (pos < debug_info_size) {
+    offsets.push_back(pos);
+    if (pos + 4 >= debug_info_size) break;
+    size_t initial_length_size;
+    const uint64_t length =
+        reader.ReadInitialLength(debug_info_data + pos, &initial_length_size);
+    if (length == 0 || length > debug_info_size - pos - initial_length_size)
+      break;
+    pos += length + initial_length_size;
+  }
+  return offsets;
+}
+
+// Returns the address ranges of every compilation unit listed in
+// .debug_aranges, keyed by the offset of the unit in .debug_info.
+std::map<uint64_t, std::vector<std::pair<uint64_t, uint64_t>>>
+ReadArangesUnitRanges(const char *aranges_data, size_t aranges_size) {
+  devtools_crosstool_autofdo::ByteReader reader(
+      devtools_crosstool_autofdo::ENDIANNESS_LITTLE);
+  std::map<uint64_t, std::vector<std::pair<uint64_t, uint64_t>>> unit_ranges;
+  uint64_t pos = 0;
+  while (pos + 4 < aranges_size) {
+    const char *set_start = aranges_data + pos;
+    size_t initial_length_size;
+    const uint64_t length =
+        reader.ReadInitialLength(set_start, &initial_length_size);
+    if (length == 0 || length > aranges_size - pos - initial_length_size)
+      break;
+    const char *set_end = set_start + initial_length_size + length;
+    const char *ptr = set_start + initial_length_size;
+    // version (2), debug_info_offset, address_size (1), segment_size (1).
+    if (ptr + 2 + reader.OffsetSize() + 2 > set_end) break;
+    ptr += 2;
+    const uint64_t unit_offset = reader.ReadOffset(ptr);
+    ptr += reader.OffsetSize();
+    const uint8 address_size = reader.ReadOneByte(ptr);
+    ptr += 2;
+    if (address_size != 4 && address_size != 8) break;
+    reader.SetAddressSize(address_size);
+    // The tuples are aligned to twice the address size.
+    const size_t tuple_size = 2 * address_size;
+    ptr = set_start + (ptr - set_start + tuple_size - 1) / tuple_size *
+                          tuple_size;
+    std::vector<std::pair<uint64_t, uint64_t>> &ranges =
+        unit_ranges[unit_offset];
+    while (ptr + tuple_size <= set_end) {
+      const uint64_t address = reader.ReadAddress(ptr);
+      const uint64_t range_length = reader.ReadAddress(ptr + address_size);
+      ptr += tuple_size;
+      if (address == 0 && range_length == 0) break;
+      ranges.emplace_back(address, address + range_length);
+    }
+    pos += initial_length_size + length;
+  }
+  return unit_ranges;
+}
+
+// Returns true if any of RANGES overlaps a function in SAMPLED_FUNCTIONS.
+bool RangesContainSampledFunction(
+    const std::vector<std::pair<uint64_t, uint64_t>> &ranges,
+    const SampledFunctions &sampled_functions) {
+  for (const auto &range : ranges) {
+    if (sampled_functions.Overlaps(range.first, range.second)) return true;
+  }
+  return false;
+}
+
+// Line and inline information read from a single compilation unit.
+struct CompilationUnitInfo {
+  std::unique_ptr<devtools_crosstool_autofdo::AddressToLineMap> line_map;
+  std::unique_ptr<devtools_crosstool_autofdo::InlineStackHandler>
+      inline_stack_handler;
+  bool malformed = false;
+};
 }  // namespace
 
 namespace devtools_crosstool_autofdo {
@@ -61,7 +164,7 @@ Addr2line *Addr2line::Create(const string &binary_name) {
 }
 
 Addr2line *Addr2line::CreateWithSampledFunctions(
-    const string &binary_name, const map<uint64_t, uint64_t> *sampled_functions) {
+    const string &binary_name, const SampledFunctions *sampled_functions) {
   Addr2line *addr2line = new Google3Addr2line(binary_name, sampled_functions);
   if (!addr2line->Prepare()) {
     delete addr2line;
@@ -72,14 +175,13 @@ Addr2line *Addr2line::CreateWithSampledFunctions(
 }
 
 Google3Addr2line::Google3Addr2line(const string &binary_name,
-                                   const map<uint64_t, uint64_t> *sampled_functions)
+                                   const SampledFunctions *sampled_functions)
     : Addr2line(binary_name), line_map_(new AddressToLineMap()),
-      inline_stack_handler_(NULL), elf_(new ElfReader(binary_name)),
+      inline_stack_handler_(NULL), elf_(ElfReader::GetShared(binary_name)),
       sampled_functions_(sampled_functions) {}
 
 Google3Addr2line::~Google3Addr2line() {
   delete line_map_;
-  delete elf_;
   if (inline_stack_handler_) {
     delete inline_stack_handler_;
   }
@@ -101,8 +203,11 @@ bool Google3Addr2line::Prepare() {
   SectionMap sections;
   const char *debug_section_names[] = {
     ".debug_line", ".debug_abbrev", ".debug_info", ".debug_str",
-    ".debug_ranges", ".debug_addr", ".debug_rnglists", ".debug_line_str"
+    ".debug_ranges", ".debug_addr", ".debug_rnglists", ".debug_line_str",
+    ".debug_aranges"
   };
+  elf_->LoadSections(std::vector<string>(std::begin(debug_section_names),
+                                         std::end(debug_section_names)));
   for (const char *section_name : debug_section_names) {
     size_t section_size;
     const char *section_data = elf_->GetSectionByName(section_name,
@@ -144,20 +249,33 @@ bool Google3Addr2line::Prepare() {
   // If .debug_info section is available, we will locate .debug_line using
   // .debug_info. Otherwise, we'll iterate through .debug_line section,
   // assuming that compilation units are stored continuously in it.
-  if (debug_info_size > 0) {
+  const uint32_t num_threads = GetStageThreads(FLAGS_addr2line_prepare_threads);
+  std::map<uint64_t, uint64_t> skipped_units;
+  if (debug_info_size > 0 && sampled_functions_ != NULL &&
+      absl::GetFlag(FLAGS_addr2line_skip_unsampled_units)) {
+    skipped_units = GetUnitsWithoutSampledFunctions(sections);
+  }
+  // Compilation units often share their abbreviation table, e.g. after
+  // LTO, so every table is decoded only once.
+  AbbrevTableCache abbrev_cache;
+  // With split DWARF, the .dwp file and its index are opened only once.
+  DwpFile dwp_file(binary_name_ + ".dwp");
+  if (debug_info_size > 0 && num_threads > 1) {
+    ParseCompilationUnitsInParallel(sections, width, num_threads,
+                                    skipped_units, &dwp_file);
+  } else if (debug_info_size > 0) {
     size_t debug_info_pos = 0;
     while (debug_info_pos < debug_info_size) {
-      DirectoryVector dirs;
-      FileVector files;
-      CULineInfoHandler handler(&files, &dirs, line_map_, sampled_functions_);
-      inline_stack_handler_->set_directory_names(&dirs);
-      inline_stack_handler_->set_file_names(&files);
-      inline_stack_handler_->set_line_handler(&handler);
-      CompilationUnit compilation_unit(
-          binary_name_, sections, debug_info_pos, &reader,
-          inline_stack_handler_);
-      debug_info_pos += compilation_unit.Start();
-      if (compilation_unit.malformed()) {
+      auto skipped_unit = skipped_units.find(debug_info_pos);
+      if (skipped_unit != skipped_units.end()) {
+        debug_info_pos = skipped_unit->second;
+        continue;
+      }
+      bool malformed;
+      debug_info_pos += ReadCompilationUnit(sections, debug_info_pos, &reader,
+                                            &abbrev_cache, &dwp_file,
+                                            &malformed);
+      if (malformed) {
         LOG(WARNING) << "File '" << binary_name_ << "' has mangled "
                      << ".debug_info section.";
         // If the compilation unit is malformed, we do not know how
@@ -165,6 +283,10 @@ bool Google3Addr2line::Prepare() {
         break;
       }
     }
+  }
+  if (debug_info_size > 0) {
+    ReadReferencedUnits(sections, &reader, &abbrev_cache, &dwp_file,
+                        &skipped_units);
   } else {
     const char *data;
     size_t size;
@@ -188,11 +310,180 @@ bool Google3Addr2line::Prepare() {
       }
     }
   }
+  line_map_->Freeze();
   inline_stack_handler_->PopulateSubprogramsByAddress();
 
   return true;
 }
 
+uint64_t Google3Addr2line::ReadCompilationUnit(const SectionMap &sections,
+                                               uint64_t offset,
+                                               ByteReader *reader,
+                                               AbbrevTableCache *abbrev_cache,
+                                               DwpFile *dwp_file,
+                                               bool *malformed) {
+  DirectoryVector dirs;
+  FileVector files;
+  CULineInfoHandler handler(&files, &dirs, line_map_, sampled_functions_);
+  inline_stack_handler_->set_directory_names(&dirs);
+  inline_stack_handler_->set_file_names(&files);
+  inline_stack_handler_->set_line_handler(&handler);
+  CompilationUnit compilation_unit(binary_name_, sections, offset, reader,
+                                   inline_stack_handler_);
+  compilation_unit.set_abbrev_cache(abbrev_cache);
+  compilation_unit.set_dwp_file(dwp_file);
+  const uint64_t size = compilation_unit.Start();
+  *malformed = compilation_unit.malformed();
+  return size;
+}
+
+std::map<uint64_t, uint64_t> Google3Addr2line::GetUnitsWithoutSampledFunctions(
+    const SectionMap &sections) {
+  std::map<uint64_t, uint64_t> skipped_units;
+  const char *aranges_data;
+  size_t aranges_size;
+  GetSection(sections, ".debug_aranges", &aranges_data, &aranges_size,
+             binary_name_, "All compilation units will be read.");
+  if (aranges_data == NULL) return skipped_units;
+  const auto unit_ranges = ReadArangesUnitRanges(aranges_data, aranges_size);
+
+  // Units not listed in .debug_aranges are always read, as is the last
+  // unit, whose end the header walk does not record.
+  const auto &debug_info = sections.at(".debug_info");
+  const std::vector<uint64_t> offsets =
+      GetCompilationUnitOffsets(debug_info.first, debug_info.second);
+  for (size_t i = 0; i + 1 < offsets.size(); ++i) {
+    auto ranges = unit_ranges.find(offsets[i]);
+    if (ranges != unit_ranges.end() &&
+        !RangesContainSampledFunction(ranges->second, *sampled_functions_)) {
+      skipped_units[offsets[i]] = offsets[i + 1];
+    }
+  }
+  LOG(INFO) << "Skipping " << skipped_units.size() << " of " << offsets.size()
+            << " compilation units without sampled functions.";
+  return skipped_units;
+}
+
+void Google3Addr2line::ReadReferencedUnits(
+    const SectionMap &sections, ByteReader *reader,
+    AbbrevTableCache *abbrev_cache, DwpFile *dwp_file,
+    std::map<uint64_t, uint64_t> *skipped_units) {
+  // Sampled subprograms may refer to declarations in skipped units
+  // through DW_FORM_ref_addr, e.g. after LTO. Read those units, and the
+  // units they refer to in turn, until every reference resolves.
+  while (!skipped_units->empty()) {
+    std::set<uint64> references;
+    inline_stack_handler_->GetUnresolvedReferences(&references);
+    std::set<uint64_t> units_to_read;
+    for (uint64 reference : references) {
+      auto unit = skipped_units->upper_bound(reference);
+      if (unit == skipped_units->begin()) continue;
+      --unit;
+      if (reference < unit->second) units_to_read.insert(unit->first);
+    }
+    if (units_to_read.empty()) break;
+    for (uint64_t offset : units_to_read) {
+      skipped_units->erase(offset);
+      bool malformed;
+      ReadCompilationUnit(sections, offset, reader, abbrev_cache, dwp_file,
+                          &malformed);
+      if (malformed) {
+        LOG(WARNING) << "File '" << binary_name_ << "' has mangled "
+                     << ".debug_info section.";
+      }
+    }
+  }
+}
+
+void Google3Addr2line::ParseCompilationUnitsInParallel(
+    const SectionMap &sections, int address_size, int num_threads,
+    const std::map<uint64_t, uint64_t> &skipped_units, DwpFile *dwp_file) {
+  const auto &debug_info = sections.at(".debug_info");
+  const std::vector<uint64_t> offsets =
+      GetCompilationUnitOffsets(debug_info.first, debug_info.second);
+
+  const char *debug_addr_data = NULL;
+  const char *debug_ranges_data = NULL;
+  size_t debug_addr_size = 0;
+  size_t debug_ranges_size = 0;
+  bool is_rnglists_section = false;
+  GetSection(sections, ".debug_addr", &debug_addr_data, &debug_addr_size,
+             binary_name_, "");
+  GetSection(sections, ".debug_ranges", &debug_ranges_data,
+             &debug_ranges_size, binary_name_, "");
+  if (debug_ranges_data == NULL) {
+    GetSection(sections, ".debug_rnglists", &debug_ranges_data,
+               &debug_ranges_size, binary_name_, "");
+    is_rnglists_section = debug_ranges_data != NULL;
+  }
+
+  // Each unit is read into its own line map and handler. The readers
+  // keep per-unit state, so every worker has its own.
+  std::vector<CompilationUnitInfo> units(offsets.size());
+  std::atomic<size_t> next_unit{0};
+  std::vector<std::thread> workers;
+  workers.reserve(num_threads);
+  for (int i = 0; i < num_threads; ++i) {
+    workers.emplace_back([&]() {
+      ByteReader reader(ENDIANNESS_LITTLE);
+      reader.SetAddressSize(address_size);
+      AbbrevTableCache abbrev_cache;
+      AddressRangeList debug_ranges(debug_ranges_data, debug_ranges_size,
+                                    &reader, is_rnglists_section,
+                                    debug_addr_data, debug_addr_size);
+      for (size_t u = next_unit++; u < units.size(); u = next_unit++) {
+        if (skipped_units.count(offsets[u])) continue;
+        ScopedTraceSpan trace_span(
+            "ReadCompilationUnit",
+            {{"offset", static_cast<int64_t>(offsets[u])}});
+        CompilationUnitInfo &unit = units[u];
+        unit.line_map.reset(new AddressToLineMap());
+        unit.inline_stack_handler.reset(new InlineStackHandler(
+            &debug_ranges, sections, &reader, sampled_functions_,
+            elf_->VaddrOfFirstLoadSegment()));
+        DirectoryVector dirs;
+        FileVector files;
+        CULineInfoHandler handler(&files, &dirs, unit.line_map.get(),
+                                  sampled_functions_);
+        unit.inline_stack_handler->set_directory_names(&dirs);
+        unit.inline_stack_handler->set_file_names(&files);
+        unit.inline_stack_handler->set_line_handler(&handler);
+        CompilationUnit compilation_unit(binary_name_, sections, offsets[u],
+                                         &reader,
+                                         unit.inline_stack_handler.get());
+        compilation_unit.set_abbrev_cache(&abbrev_cache);
+        compilation_unit.set_dwp_file(dwp_file);
+        compilation_unit.Start();
+        unit.malformed = compilation_unit.malformed();
+        unit.inline_stack_handler->set_address_range_list(NULL);
+      }
+    });
+  }
+  for (std::thread &worker : workers) worker.join();
+
+  // Merge in section order so that later units override earlier ones
+  // exactly as in the serial loop, stopping after the first bad unit.
+  for (CompilationUnitInfo &unit : units) {
+    if (unit.line_map == nullptr) continue;
+    line_map_->MergeFrom(unit.line_map.get());
+    inline_stack_handler_->MergeFrom(unit.inline_stack_handler.get());
+    unit.line_map.reset();
+    unit.inline_stack_handler.reset();
+    if (unit.malformed) {
+      LOG(WARNING) << "File '" << binary_name_ << "' has mangled "
+                   << ".debug_info section.";
+      break;
+    }
+  }
+}
+
+uint64_t Google3Addr2line::MemoryUsage() const {
+  uint64_t bytes = line_map_->MemoryUsage();
+  if (inline_stack_handler_ != nullptr)
+    bytes += inline_stack_handler_->MemoryUsage();
+  return bytes;
+}
+
 void Google3Addr2line::GetInlineStack(uint64_t address,
                                       SourceStack *stack) const {
   AddressToLineMap::const_iterator iter = line_map_->upper_bound(address);
@@ -206,47 +497,26 @@ void Google3Addr2line::GetInlineStack(uint64_t address,
   if (LI.line == 0)
     return;
 
-  const SubprogramInfo *subprog =
-      inline_stack_handler_->GetSubprogramForAddress(address);
+  int num_frames;
+  const InlineStackHandler::InlineFrame *frames =
+      inline_stack_handler_->GetInlineStack(address, &num_frames);
 
-  const char *function_name = NULL;
-  uint32_t start_line = 0;
-  if (subprog != NULL) {
-    const SubprogramInfo *declaration =
-        inline_stack_handler_->GetDeclaration(subprog);
-    function_name = declaration->name().c_str();
-    start_line =
-        inline_stack_handler_->GetAbstractOrigin(subprog)->callsite_line();
-    if (start_line == 0)
-      start_line = declaration->callsite_line();
-  }
-
-  stack->push_back(SourceInfo(function_name,
+  stack->push_back(SourceInfo(num_frames > 0 ? frames[0].function_name : NULL,
                               LI.file.first,
                               LI.file.second,
-                              start_line,
+                              num_frames > 0 ? frames[0].start_line : 0,
                               LI.line,
                               LI.discriminator));
 
-  while (subprog != NULL && subprog->inlined()) {
-    const SubprogramInfo *canonical_parent =
-        inline_stack_handler_->GetDeclaration(subprog->parent());
-    CHECK(subprog->parent() != NULL);
-    uint32_t start_line = inline_stack_handler_->GetAbstractOrigin(
-        subprog->parent())->callsite_line();
-    if (start_line == 0)
-      start_line = canonical_parent->callsite_line();
-    if (start_line == 0)
-      start_line = subprog->callsite_line();
-
+  for (int i = 1; i < num_frames; ++i) {
+    const InlineStackHandler::InlineFrame &frame = frames[i];
     stack->push_back(SourceInfo(
-        canonical_parent->name().c_str(),
-        subprog->callsite_directory(),
-        subprog->callsite_filename(),
-        start_line,
-        subprog->callsite_line(),
-        subprog->callsite_discr()));
-    subprog = subprog->parent();
+        frame.function_name,
+        frame.callsite_directory,
+        frame.callsite_filename,
+        frame.start_line,
+        frame.callsite_line,
+        frame.callsite_discr));
   }
 }
 }  // namespace autofdo
@@ -1,17 +1,36 @@
 #include "llvm_profile_reader.h"
 
+#include <cstdint>
 #include <memory>
 #include <string>
+#include <thread>  // NOLINT(build/c++11)
 #include <utility>
+#include <vector>
 
+#include "md5_name_table.h"
+#include "name_interner.h"
 #include "symbol_map.h"
+#include "third_party/abseil/absl/flags/flag.h"
+#include "third_party/abseil/absl/hash/hash.h"
+#include "third_party/abseil/absl/strings/string_view.h"
 #include "llvm/Config/llvm-config.h"
 #include "llvm/ProfileData/SampleProfReader.h"
 
 namespace devtools_crosstool_autofdo {
 
 const char *LLVMProfileReader::GetName(const llvm::StringRef &N) {
-  return names_.insert(N.str()).first->c_str();
+  const absl::string_view name(N.data(), N.size());
+  // Names of profiles with MD5 name tables are MD5 names already.
+  if (use_md5_names_ && !profile_is_md5_)
+    return Md5NameTable::Global().GetMd5Name(name);
+  return NameInterner::Global().InternName(name);
+}
+
+std::string LLVMProfileReader::GetTargetName(const llvm::StringRef &N) {
+  if (!use_md5_names_ || profile_is_md5_)
+    return symbol_map_->GetOriginalName(GetName(N));
+  // The suffixes are elided from the name, which an MD5 name does not show.
+  return GetName(symbol_map_->GetOriginalName(std::string(N).c_str()));
 }
 
 #if LLVM_VERSION_MAJOR >= 12
@@ -43,6 +62,7 @@ bool LLVMProfileReader::ReadFromFile(const std::string &filename) {
     LOG(ERROR) << "Cannot read profile: " << read_error.message();
     return false;
   }
+  profile_is_md5_ = reader->useMD5();
 
   // LLVMProfileReader's profile symbol list will live longer than sample
   // profile reader, so need to use ProfileSymbolList::merge to copy the
@@ -56,9 +76,20 @@ bool LLVMProfileReader::ReadFromFile(const std::string &filename) {
     SetProfileSymbolList(std::move(prof_sym_list));
   }
 
+  std::vector<const llvm::sampleprof::FunctionSamples *> functions;
   for (const auto &name_profile : reader->getProfiles()) {
-    SourceStack stack;
-    ReadFromFunctionSamples(stack, name_profile.second);
+    const llvm::sampleprof::FunctionSamples &fs = name_profile.second;
+    if (!functions_to_read_.empty() &&
+        !functions_to_read_.contains(
+            absl::string_view(fs.getName().data(), fs.getName().size())))
+      continue;
+    functions.push_back(&fs);
+  }
+  if (num_threads_ > 1) {
+    ReadFunctionsInParallel(functions);
+  } else {
+    for (const llvm::sampleprof::FunctionSamples *fs : functions)
+      ReadFromFunctionSamples(*fs);
   }
 #if LLVM_VERSION_MAJOR >= 12
   profile_is_fs_ = llvm::sampleprof::FunctionSamples::ProfileIsFS;
@@ -67,42 +98,19 @@ bool LLVMProfileReader::ReadFromFile(const std::string &filename) {
 }
 
 void LLVMProfileReader::ReadFromFunctionSamples(
-    const SourceStack &stack, const llvm::sampleprof::FunctionSamples &fs) {
+    const llvm::sampleprof::FunctionSamples &fs) {
   const char *func_name = GetName(fs.getName());
+  if (!shouldMergeProfileForSym(func_name)) return;
 
-  if (stack.empty() && !shouldMergeProfileForSym(func_name)) return;
-
-  const char *top_func_name = nullptr;
-  if (stack.empty()) {
-    top_func_name = func_name;
-    symbol_map_->AddSymbol(func_name);
-    symbol_map_->AddSymbolEntryCount(func_name, fs.getHeadSamples());
-  } else {
-    top_func_name = stack.back().func_name;
-  }
-  for (const auto &loc_sample : fs.getBodySamples()) {
-    SourceInfo info(func_name, "", "", 0, loc_sample.first.LineOffset,
-                    loc_sample.first.Discriminator);
-    SourceStack new_stack;
-    new_stack.push_back(info);
-    new_stack.insert(new_stack.end(), stack.begin(), stack.end());
-    symbol_map_->AddSourceCount(top_func_name, new_stack,
-                                loc_sample.second.getSamples(), 1);
-    for (const auto &target_count : loc_sample.second.getCallTargets()) {
-      symbol_map_->AddIndirectCallTarget(top_func_name, new_stack,
-                                         GetName(target_count.getKey()),
-                                         target_count.getValue());
-    }
-  }
-  for (const auto &loc_fsmap : fs.getCallsiteSamples()) {
-    SourceInfo info(func_name, "", "", 0, loc_fsmap.first.LineOffset,
-                    loc_fsmap.first.Discriminator);
-    SourceStack new_stack;
-    new_stack.push_back(info);
-    new_stack.insert(new_stack.end(), stack.begin(), stack.end());
-    for (const auto &name_fs : loc_fsmap.second)
-      ReadFromFunctionSamples(new_stack, name_fs.second);
-  }
+  symbol_map_->AddSymbol(func_name);
+  symbol_map_->AddSymbolEntryCount(func_name,
+                                   ScaleCount(fs.getHeadSamples()));
+  Symbol *symbol = symbol_map_->map().at(func_name);
+  const uint64_t total_count_before = symbol->total_count;
+  symbol->total_count += WithDiscriminatorEncoding(
+      absl::GetFlag(FLAGS_use_discriminator_encoding), [&](auto encoding) {
+        return ReadInlineTree<decltype(encoding)>(symbol, fs);
+      });
 
   // The total count for a top-level function can be non-zero but the body
   // samples may be zero if there is no debug information for the function.
@@ -111,10 +119,122 @@ void LLVMProfileReader::ReadFromFunctionSamples(
   // NB: For inline instances, this can theoritically happen if lines without
   // debug information receive samples and lines with debug information don't.
   // It's not something we have seen in practice so it's not being implemented.
-  if (stack.empty() &&
-      symbol_map_->map().at(func_name)->total_count == 0) {
-    symbol_map_->AddSymbolEntryCount(func_name, 0, fs.getTotalSamples());
+  if (read_total_samples_) {
+    symbol->total_count =
+        total_count_before + ScaleCount(fs.getTotalSamples());
+  } else if (symbol->total_count == 0) {
+    symbol_map_->AddSymbolEntryCount(func_name, 0,
+                                     ScaleCount(fs.getTotalSamples()));
+  }
+}
+
+void LLVMProfileReader::ReadFunctionsInParallel(
+    const std::vector<const llvm::sampleprof::FunctionSamples *> &functions) {
+  // shouldMergeProfileForSym may update special_syms_ and the symbol map, so
+  // it is evaluated first, in order. The functions are then partitioned by
+  // name, so that every function is converted into exactly one shard.
+  const int num_shards = num_threads_;
+  std::vector<std::vector<const llvm::sampleprof::FunctionSamples *>>
+      shard_functions(num_shards);
+  for (const llvm::sampleprof::FunctionSamples *fs : functions) {
+    const char *func_name = GetName(fs->getName());
+    if (!shouldMergeProfileForSym(func_name)) continue;
+    shard_functions[absl::Hash<absl::string_view>()(func_name) % num_shards]
+        .push_back(fs);
+  }
+
+  const bool use_discriminator_encoding =
+      absl::GetFlag(FLAGS_use_discriminator_encoding);
+  std::vector<std::unique_ptr<SymbolMap>> shards(num_shards);
+  // The functions without body samples and their total samples, which are
+  // added to their total counts only if those are still zero after merging,
+  // as ReadFromFunctionSamples does.
+  std::vector<std::vector<std::pair<const char *, uint64_t>>> empty_bodies(
+      num_shards);
+  std::vector<std::thread> workers;
+  workers.reserve(num_shards);
+  for (int i = 0; i < num_shards; ++i) {
+    shards[i] = std::make_unique<SymbolMap>();
+    workers.emplace_back([&, i]() {
+      SymbolMap &shard = *shards[i];
+      for (const llvm::sampleprof::FunctionSamples *fs : shard_functions[i]) {
+        const char *func_name = GetName(fs->getName());
+        shard.AddSymbol(func_name);
+        Symbol *symbol = shard.map().at(func_name);
+        symbol->head_count += ScaleCount(fs->getHeadSamples());
+        uint64_t total_count = WithDiscriminatorEncoding(
+            use_discriminator_encoding, [&](auto encoding) {
+              return ReadInlineTree<decltype(encoding)>(symbol, *fs);
+            });
+        if (read_total_samples_) {
+          total_count = ScaleCount(fs->getTotalSamples());
+        } else if (total_count == 0) {
+          empty_bodies[i].emplace_back(func_name,
+                                       ScaleCount(fs->getTotalSamples()));
+        }
+        symbol->total_count += total_count;
+      }
+    });
+  }
+  for (std::thread &worker : workers) worker.join();
+
+  for (int i = 0; i < num_shards; ++i) {
+    symbol_map_->AddProfilesFrom(shards[i].get());
+    shards[i].reset();
+  }
+  for (const auto &empty_body : empty_bodies) {
+    for (const auto &[func_name, total_samples] : empty_body) {
+      if (symbol_map_->map().at(func_name)->total_count == 0)
+        symbol_map_->AddSymbolEntryCount(func_name, 0, total_samples);
+    }
+  }
+}
+
+// The inline tree of FS is walked once, holding the symbol of the current
+// inline instance, rather than building the inline stack of every sample and
+// walking it down from the outline symbol.
+template <typename Encoding>
+uint64_t LLVMProfileReader::ReadInlineTree(
+    Symbol *symbol, const llvm::sampleprof::FunctionSamples &fs) {
+  const char *func_name = GetName(fs.getName());
+  uint64_t total_count = 0;
+  for (const auto &loc_sample : fs.getBodySamples()) {
+    const uint64_t offset = Encoding::Offset(
+        SourceInfo(func_name, "", "", 0, loc_sample.first.LineOffset,
+                   loc_sample.first.Discriminator));
+    const uint64_t count = ScaleCount(loc_sample.second.getSamples());
+    total_count += count;
+    ProfileInfo &pos_info = symbol->pos_counts[offset];
+    pos_info.count += count;
+    pos_info.num_inst += 1;
+    for (const auto &target_count : loc_sample.second.getCallTargets()) {
+      pos_info.target_map[GetTargetName(target_count.getKey())] =
+          ScaleCount(target_count.getValue());
+    }
   }
+  for (const auto &loc_fsmap : fs.getCallsiteSamples()) {
+    const uint64_t offset = Encoding::Offset(
+        SourceInfo(func_name, "", "", 0, loc_fsmap.first.LineOffset,
+                   loc_fsmap.first.Discriminator));
+    for (const auto &name_fs : loc_fsmap.second) {
+      const Callsite callsite(offset, GetName(name_fs.second.getName()));
+      auto [it, inserted] = symbol->callsites.try_emplace(callsite, nullptr);
+      if (inserted) it->second = new Symbol(callsite.second, "", "", 0);
+      // Inserting into the callsites of the callee does not move it.
+      Symbol *callee = it->second;
+      const uint64_t callee_count =
+          ReadInlineTree<Encoding>(callee, name_fs.second);
+      callee->total_count += callee_count;
+      total_count += callee_count;
+      // An inline instance without any sample is not added to the profile.
+      if (inserted && callee->pos_counts.empty() &&
+          callee->callsites.empty()) {
+        delete callee;
+        symbol->callsites.erase(callsite);
+      }
+    }
+  }
+  return total_count;
 }
 
 // Return whether to read the samples from current profile for the
@@ -123,12 +243,18 @@ void LLVMProfileReader::ReadFromFunctionSamples(
 bool LLVMProfileReader::shouldMergeProfileForSym(const std::string name) {
   // If no special_syms_ specified, merge profile for every symbol.
   if (!special_syms_) return true;
+  // NAME keys the symbol map, but the special symbols are matched by the
+  // names that MD5 names stand for.
+  std::string match_name = name;
+  if (use_md5_names_ && !profile_is_md5_) {
+    if (const char *original = Md5NameTable::Global().GetName(name))
+      match_name = original;
+  }
 
-  if (special_syms_->skip_set.find(name) != special_syms_->skip_set.end())
-    return false;
+  if (special_syms_->skip_set.contains(match_name)) return false;
 
   for (const std::string &sym_name : special_syms_->strip_all)
-    if (name.compare(0, sym_name.length(), sym_name) == 0) return false;
+    if (match_name.compare(0, sym_name.length(), sym_name) == 0) return false;
 
   for (const std::string &sym_name : special_syms_->keep_sole) {
     // If the symbol doesn't exist in symbol_map_, return true so the
@@ -136,22 +262,22 @@ bool LLVMProfileReader::shouldMergeProfileForSym(const std::string name) {
     // we see the same symbol in another profile, remove it from
     // symbol_map_ and add it to skip_set to skip the rest of the
     // profiles.
-    if (name.compare(0, sym_name.length(), sym_name) == 0) {
+    if (match_name.compare(0, sym_name.length(), sym_name) == 0) {
       if (!symbol_map_->GetSymbolByName(name)) return true;
       symbol_map_->RemoveSymbol(name);
-      special_syms_->skip_set.insert(name);
+      special_syms_->skip_set.insert(match_name);
       return false;
     }
   }
   for (const std::string &sym_name : special_syms_->keep_cold) {
-    if (name.compare(0, sym_name.length(), sym_name) == 0) {
+    if (match_name.compare(0, sym_name.length(), sym_name) == 0) {
       // Add a cold profile into symbol_map_ the first time we see
       // the symbol and add the symbol to skip_set to skip the rest
       // of the profiles.
       if (!symbol_map_->GetSymbolByName(name)) {
         symbol_map_->AddSymbol(name);
         symbol_map_->AddSymbolEntryCount(name, 0, kMinSamples + 1);
-        special_syms_->skip_set.insert(name);
+        special_syms_->skip_set.insert(match_name);
       }
       return false;
     }
@@ -5,10 +5,12 @@
 
 #include <string>
 #include <utility>
+#include <vector>
 
 #include "base/commandlineflags.h"
 #include "base_profile_reader.h"
 #include "source_info.h"
+#include "third_party/abseil/absl/container/flat_hash_set.h"
 #include "third_party/abseil/absl/container/node_hash_set.h"
 #include "third_party/abseil/absl/flags/declare.h"
 #include "third_party/abseil/absl/flags/flag.h"
@@ -31,6 +33,7 @@ ABSL_DECLARE_FLAG(bool, use_base_only_in_fs_discriminator);
 #endif
 
 namespace devtools_crosstool_autofdo {
+class Symbol;
 class SymbolMap;
 
 struct SpecialSyms {
@@ -50,10 +53,11 @@ struct SpecialSyms {
 
 class LLVMProfileReader : public ProfileReader {
  public:
+  // Names read from the profile are kept in NameInterner::Global(), so the
+  // symbols outlive the reader.
   explicit LLVMProfileReader(SymbolMap *symbol_map,
-                             absl::node_hash_set<std::string>& names,
                              SpecialSyms *special_syms = nullptr)
-      : symbol_map_(symbol_map), names_(names), special_syms_(special_syms) {}
+      : symbol_map_(symbol_map), special_syms_(special_syms) {}
 
 #if LLVM_VERSION_MAJOR >= 12
   bool ReadFromFile(const std::string &output_file) override {
@@ -75,6 +79,35 @@ class LLVMProfileReader : public ProfileReader {
 
   bool shouldMergeProfileForSym(const std::string name);
 
+  // Makes ReadFromFile add the total samples of every function in the profile
+  // to its total count, instead of the sum of its body samples, so that the
+  // functions of a profile written by LLVMProfileWriter read back with the
+  // total counts they were written with.
+  void set_read_total_samples(bool read_total_samples) {
+    read_total_samples_ = read_total_samples;
+  }
+
+  // Makes ReadFromFile convert the functions of the profile on up to
+  // NUM_THREADS threads. Every thread converts the functions whose names hash
+  // to it into a symbol map of its own, and the maps are then moved into the
+  // symbol map of the reader.
+  void set_num_threads(int num_threads) { num_threads_ = num_threads; }
+
+  // Makes ReadFromFile only read the outline functions named in FUNCTIONS,
+  // if it is not empty.
+  void set_functions_to_read(absl::flat_hash_set<std::string> functions) {
+    functions_to_read_ = std::move(functions);
+  }
+
+  // Makes ReadFromFile key the symbols, callsites and call targets by the MD5
+  // names of the functions, which Md5NameTable::Global() maps back to the
+  // names. This is for profiles that are written with MD5 name tables, whose
+  // writers hash the names anyway, and saves holding and hashing long names.
+  // The functions to read and the special symbols are still given by name.
+  void set_use_md5_names(bool use_md5_names) {
+    use_md5_names_ = use_md5_names;
+  }
+
   void SetProfileSymbolList(
       std::unique_ptr<llvm::sampleprof::ProfileSymbolList> list) {
     prof_sym_list_ = std::move(list);
@@ -87,15 +120,38 @@ class LLVMProfileReader : public ProfileReader {
  private:
   const char *GetName(const llvm::StringRef &N);
 
-  void ReadFromFunctionSamples(const SourceStack &stack,
-                               const llvm::sampleprof::FunctionSamples &fs);
+  // Returns the name of the call target N, without the suffixes that
+  // SymbolMap elides.
+  std::string GetTargetName(const llvm::StringRef &N);
+
+  // Reads the outline function FS into the symbol map.
+  void ReadFromFunctionSamples(const llvm::sampleprof::FunctionSamples &fs);
+
+  // Reads the outline functions FUNCTIONS into the symbol map on up to
+  // num_threads_ threads.
+  void ReadFunctionsInParallel(
+      const std::vector<const llvm::sampleprof::FunctionSamples *> &functions);
+
+  // Adds the samples of FS, the profile of SYMBOL, and of its inline instances
+  // to SYMBOL and its callsites, creating them as needed. Returns the sum of
+  // the body samples of FS and its inline instances, which the caller adds to
+  // the total count of SYMBOL. The offsets are encoded by "Encoding", a
+  // DiscriminatorEncoding.
+  template <typename Encoding>
+  uint64_t ReadInlineTree(Symbol *symbol,
+                          const llvm::sampleprof::FunctionSamples &fs);
 
   SymbolMap *symbol_map_;
-  absl::node_hash_set<std::string>& names_;
   SpecialSyms *special_syms_;
+  int num_threads_ = 1;
+  absl::flat_hash_set<std::string> functions_to_read_;
   std::unique_ptr<llvm::sampleprof::ProfileSymbolList> prof_sym_list_;
+  bool use_md5_names_ = false;
+  // Whether the profile being read has an MD5 name table.
+  bool profile_is_md5_ = false;
 #if LLVM_VERSION_MAJOR >= 12
   bool profile_is_fs_ = false;
+  bool read_total_samples_ = false;
 #endif
 };
 }  // namespace devtools_crosstool_autofdo
@@ -7,7 +7,6 @@
 #include "base/commandlineflags.h"
 #include "symbol_map.h"
 #include "gtest/gtest.h"
-#include "third_party/abseil/absl/container/node_hash_set.h"
 #include "third_party/abseil/absl/flags/flag.h"
 
 #define FLAGS_test_tmpdir std::string(testing::UnitTest::GetInstance()->original_working_dir())
@@ -34,8 +33,7 @@ void VerifySymbolMap(const devtools_crosstool_autofdo::SymbolMap &symbol_map) {
 
 TEST(LLVMProfileReaderTest, ReadBinaryTest) {
   devtools_crosstool_autofdo::SymbolMap symbol_map;
-  absl::node_hash_set<std::string> names;
-  devtools_crosstool_autofdo::LLVMProfileReader reader(&symbol_map, names);
+  devtools_crosstool_autofdo::LLVMProfileReader reader(&symbol_map);
   reader.ReadFromFile(FLAGS_test_srcdir +
                       "/testdata/"
                       "llvm_autoprof.golden.binprof");
@@ -44,8 +42,7 @@ TEST(LLVMProfileReaderTest, ReadBinaryTest) {
 
 TEST(LLVMProfileReaderTest, ReadTextTest) {
   devtools_crosstool_autofdo::SymbolMap symbol_map;
-  absl::node_hash_set<std::string> names;
-  devtools_crosstool_autofdo::LLVMProfileReader reader(&symbol_map, names);
+  devtools_crosstool_autofdo::LLVMProfileReader reader(&symbol_map);
   EXPECT_TRUE(
       reader.ReadFromFile(FLAGS_test_srcdir +
                           "/testdata/"
@@ -56,8 +53,7 @@ TEST(LLVMProfileReaderTest, ReadTextTest) {
 
 TEST(LLVMProfileReaderTest, ReadEmptyBodyNonZeroFunctionTotalTest) {
   devtools_crosstool_autofdo::SymbolMap symbol_map;
-  absl::node_hash_set<std::string> names;
-  devtools_crosstool_autofdo::LLVMProfileReader reader(&symbol_map, names);
+  devtools_crosstool_autofdo::LLVMProfileReader reader(&symbol_map);
   reader.ReadFromFile(FLAGS_test_srcdir +
                       "/testdata/"
                       "llvm_testzero.golden.textprof");
@@ -66,4 +62,65 @@ TEST(LLVMProfileReaderTest, ReadEmptyBodyNonZeroFunctionTotalTest) {
 
   EXPECT_EQ(data->total_count, 1000);
 }
-}  // namespace
+
+TEST(LLVMProfileReaderTest, ReadInlineTreeTest) {
+  using devtools_crosstool_autofdo::SourceInfo;
+  devtools_crosstool_autofdo::SymbolMap symbol_map;
+  devtools_crosstool_autofdo::LLVMProfileReader reader(&symbol_map);
+  ASSERT_TRUE(reader.ReadFromFile(FLAGS_test_srcdir +
+                                  "/testdata/"
+                                  "llvm_inline_tree.textprof"));
+  const auto *main = symbol_map.map().at("main");
+  // The body samples of inline instances count towards their callers.
+  EXPECT_EQ(main->total_count, 130);
+  EXPECT_EQ(main->head_count, 10);
+  EXPECT_EQ(main->pos_counts.at(SourceInfo::GenerateOffset(2, 0)).count, 20);
+  EXPECT_EQ(main->pos_counts.at(SourceInfo::GenerateOffset(2, 0))
+                .target_map.at("foo"),
+            5);
+  // Inline instances without any sample are not added.
+  ASSERT_EQ(main->callsites.size(), 1);
+
+  const auto *bar =
+      main->callsites.at({SourceInfo::GenerateOffset(3, 0), "bar"});
+  EXPECT_EQ(bar->total_count, 100);
+  EXPECT_EQ(bar->pos_counts.at(SourceInfo::GenerateOffset(1, 0)).count, 40);
+  ASSERT_EQ(bar->callsites.size(), 1);
+  const auto *baz =
+      bar->callsites.at({SourceInfo::GenerateOffset(2, 0), "baz"});
+  EXPECT_EQ(baz->total_count, 60);
+  EXPECT_EQ(baz->pos_counts.at(SourceInfo::GenerateOffset(1, 2)).count, 60);
+  EXPECT_TRUE(baz->callsites.empty());
+}
+TEST(LLVMProfileReaderTest, ReadInParallelTest) {
+  devtools_crosstool_autofdo::SymbolMap serial_map, parallel_map;
+  devtools_crosstool_autofdo::LLVMProfileReader serial_reader(&serial_map);
+  devtools_crosstool_autofdo::LLVMProfileReader parallel_reader(&parallel_map);
+  parallel_reader.set_num_threads(4);
+  const std::string file_name =
+      FLAGS_test_srcdir + "/testdata/llvm_autoprof.golden.textprof";
+  ASSERT_TRUE(serial_reader.ReadFromFile(file_name));
+  ASSERT_TRUE(parallel_reader.ReadFromFile(file_name));
+
+  VerifySymbolMap(parallel_map);
+  ASSERT_EQ(parallel_map.map().size(), serial_map.map().size());
+  for (const auto &[name, symbol] : serial_map.map()) {
+    const auto *parallel_symbol = parallel_map.map().at(name);
+    EXPECT_EQ(parallel_symbol->total_count, symbol->total_count) << name;
+    EXPECT_EQ(parallel_symbol->head_count, symbol->head_count) << name;
+    EXPECT_EQ(parallel_symbol->pos_counts.size(), symbol->pos_counts.size())
+        << name;
+  }
+}
+
+TEST(LLVMProfileReaderTest, ReadSelectedFunctionsTest) {
+  devtools_crosstool_autofdo::SymbolMap symbol_map;
+  devtools_crosstool_autofdo::LLVMProfileReader reader(&symbol_map);
+  reader.set_functions_to_read({"main"});
+  ASSERT_TRUE(reader.ReadFromFile(FLAGS_test_srcdir +
+                                  "/testdata/"
+                                  "llvm_autoprof.golden.textprof"));
+  EXPECT_EQ(symbol_map.map().count("main"), 1);
+  EXPECT_EQ(symbol_map.map().count("_Z11compute_noii"), 0);
+}
+}  // namespace}  // namespace
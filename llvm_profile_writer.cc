@@ -8,34 +8,38 @@
 #include <stdio.h>
 
 #include <algorithm>
+#include <atomic>
 #include <map>
 #include <set>
 #include <string>
+#include <thread>  // NOLINT(build/c++11)
 #include <utility>
 #include <vector>
 
 #include "base/commandlineflags.h"
 #include "base/logging.h"
 #include "llvm_profile_writer.h"
+#include "md5_name_table.h"
+#include "parallel_for.h"
 #include "profile_writer.h"
+#include "third_party/abseil/absl/container/flat_hash_map.h"
+#include "third_party/abseil/absl/container/flat_hash_set.h"
 #include "third_party/abseil/absl/flags/declare.h"
 #include "third_party/abseil/absl/flags/flag.h"
 #include "third_party/abseil/absl/strings/match.h"
 #include "llvm/Config/llvm-config.h"
 
 ABSL_DECLARE_FLAG(bool, debug_dump);
+ABSL_DECLARE_FLAG(uint32_t, profile_writer_threads);
 
 namespace devtools_crosstool_autofdo {
 
-bool LLVMProfileBuilder::Write(
-    const std::string &output_filename,
-    llvm::sampleprof::SampleProfileFormat format, const SymbolMap &symbol_map,
-    const StringIndexMap &name_table,
+namespace {
+// Writes PROFILES to OUTPUT_FILENAME with SAMPLE_PROFILE_WRITER.
+template <typename ProfileMap>
+bool WriteProfiles(
+    const std::string &output_filename, const ProfileMap &profiles,
     llvm::sampleprof::SampleProfileWriter *sample_profile_writer) {
-  // Collect the profiles for every symbol in the name table.
-  LLVMProfileBuilder builder(name_table);
-  const auto &profiles = builder.ConvertProfiles(symbol_map);
-
 #if LLVM_VERSION_MAJOR >= 12
   // Tell the profile writer if FS Discriminators are used.
   llvm::sampleprof::FunctionSamples::ProfileIsFS =
@@ -57,6 +61,28 @@ bool LLVMProfileBuilder::Write(
   sample_profile_writer->getOutputStream().flush();
   return true;
 }
+}  // namespace
+
+bool LLVMProfileBuilder::Write(
+    const std::string &output_filename,
+    llvm::sampleprof::SampleProfileFormat format, const SymbolMap &symbol_map,
+    const StringIndexMap &name_table,
+    llvm::sampleprof::SampleProfileWriter *sample_profile_writer) {
+  // Collect the profiles for every symbol in the name table.
+  LLVMProfileBuilder builder(name_table);
+  return WriteProfiles(output_filename, builder.ConvertProfiles(symbol_map),
+                       sample_profile_writer);
+}
+
+bool LLVMProfileBuilder::WriteAndRelease(
+    const std::string &output_filename, SymbolMap *symbol_map,
+    const StringIndexMap &name_table,
+    llvm::sampleprof::SampleProfileWriter *sample_profile_writer) {
+  LLVMProfileBuilder builder(name_table);
+  return WriteProfiles(output_filename,
+                       builder.ConvertAndReleaseProfiles(symbol_map),
+                       sample_profile_writer);
+}
 
 // LLVM_BEFORE_SAMPLEFDO_SPLIT_CONTEXT is defined when llvm version is before
 // https://reviews.llvm.org/rGb9db70369b7799887b817e13109801795e4d70fc
@@ -67,14 +93,124 @@ const llvm::sampleprof::SampleProfileMap &LLVMProfileBuilder::ConvertProfiles(
 const llvm::StringMap<llvm::sampleprof::FunctionSamples>
     &LLVMProfileBuilder::ConvertProfiles(const SymbolMap &symbol_map) {
 #endif
-  Start(symbol_map);
+  const int num_threads = GetStageThreads(FLAGS_profile_writer_threads);
+  if (num_threads > 1) {
+    StartInParallel(symbol_map, /*release=*/false, num_threads);
+  } else {
+    Start(symbol_map);
+  }
   return GetProfiles();
 }
 
+#ifndef LLVM_BEFORE_SAMPLEFDO_SPLIT_CONTEXT
+const llvm::sampleprof::SampleProfileMap &
+LLVMProfileBuilder::ConvertAndReleaseProfiles(SymbolMap *symbol_map) {
+#else
+const llvm::StringMap<llvm::sampleprof::FunctionSamples>
+    &LLVMProfileBuilder::ConvertAndReleaseProfiles(SymbolMap *symbol_map) {
+#endif
+  const int num_threads = GetStageThreads(FLAGS_profile_writer_threads);
+  if (num_threads > 1) {
+    StartInParallel(*symbol_map, /*release=*/true, num_threads);
+  } else {
+    StartAndRelease(symbol_map);
+  }
+  return GetProfiles();
+}
+
+void LLVMProfileBuilder::StartAndRelease(SymbolMap *symbol_map) {
+  // Aliases share a symbol, which may only be released after all of its
+  // names have been visited.
+  absl::flat_hash_map<const Symbol *, int> num_names;
+  for (const auto &name_symbol : symbol_map->map()) {
+    num_names[name_symbol.second]++;
+  }
+  for (const auto &name_symbol : symbol_map->map()) {
+    Symbol *symbol = name_symbol.second;
+    if (symbol_map->ShouldEmit(symbol->total_count)) {
+      VisitTopSymbol(name_symbol.first, symbol);
+      Traverse(symbol);
+    }
+    if (--num_names[symbol] == 0) {
+      symbol->ReleaseProfile();
+    }
+  }
+}
+
+void LLVMProfileBuilder::StartInParallel(const SymbolMap &symbol_map,
+                                         bool release, int num_threads) {
+  std::vector<const NameSymbolMap::value_type *> functions;
+  absl::flat_hash_map<const Symbol *, int> symbol_indexes;
+  std::vector<int> num_names;
+  for (const auto &name_symbol : symbol_map.map()) {
+    functions.push_back(&name_symbol);
+    auto [it, inserted] =
+        symbol_indexes.try_emplace(name_symbol.second, num_names.size());
+    if (inserted) num_names.push_back(0);
+    num_names[it->second]++;
+  }
+  // Aliases share a symbol, which may only be released after all of its
+  // names have been converted, possibly by different threads.
+  std::vector<std::atomic<int>> num_unconverted_names(num_names.size());
+  for (int i = 0; i < num_names.size(); ++i) {
+    num_unconverted_names[i].store(num_names[i], std::memory_order_relaxed);
+  }
+
+  std::vector<llvm::sampleprof::FunctionSamples> converted(functions.size());
+  std::vector<char> emitted(functions.size(), false);
+  std::vector<llvm::sampleprof_error> results(
+      num_threads, llvm::sampleprof_error::success);
+  std::atomic<size_t> next_function{0};
+  auto convert = [&](int thread) {
+    LLVMProfileBuilder builder(name_table_);
+    for (size_t f = next_function++; f < functions.size();
+         f = next_function++) {
+      Symbol *symbol = functions[f]->second;
+      if (symbol_map.ShouldEmit(symbol->total_count)) {
+        builder.VisitTopSymbol(functions[f]->first, symbol, &converted[f]);
+        builder.Traverse(symbol);
+        emitted[f] = true;
+      }
+      if (release &&
+          --num_unconverted_names[symbol_indexes.at(symbol)] == 0) {
+        symbol->ReleaseProfile();
+      }
+    }
+    results[thread] = builder.result_;
+  };
+  std::vector<std::thread> workers;
+  for (int i = 1; i < num_threads; ++i) workers.emplace_back(convert, i);
+  convert(0);
+  for (std::thread &worker : workers) worker.join();
+
+  // Names from the name table are unique, so they are identified by their
+  // address.
+  absl::flat_hash_set<const char *> added_names;
+  for (size_t f = 0; f < functions.size(); ++f) {
+    if (!emitted[f]) continue;
+    llvm::StringRef name_ref = GetNameRef(functions[f]->first);
+    llvm::sampleprof::FunctionSamples &profile = profiles_[name_ref];
+    if (added_names.insert(name_ref.data()).second) {
+      profile = std::move(converted[f]);
+    } else {
+      llvm::MergeResult(result_, profile.merge(converted[f]));
+    }
+  }
+  for (llvm::sampleprof_error result : results) {
+    llvm::MergeResult(result_, result);
+  }
+}
+
 void LLVMProfileBuilder::VisitTopSymbol(const std::string &name,
                                         const Symbol *node) {
+  VisitTopSymbol(name, node, &profiles_[GetNameRef(name)]);
+}
+
+void LLVMProfileBuilder::VisitTopSymbol(
+    const std::string &name, const Symbol *node,
+    llvm::sampleprof::FunctionSamples *profile_ptr) {
   llvm::StringRef name_ref = GetNameRef(name);
-  llvm::sampleprof::FunctionSamples &profile = profiles_[name_ref];
+  llvm::sampleprof::FunctionSamples &profile = *profile_ptr;
   if (std::error_code EC =
           llvm::MergeResult(result_, profile.addHeadSamples(node->head_count)))
     LOG(FATAL) << "Error updating head samples for '" << name
@@ -136,11 +272,14 @@ void LLVMProfileBuilder::Visit(const Symbol *node) {
     // or more functions.
     const auto &target_map = pos_count.second.target_map;
     for (const auto &target_count : target_map) {
+      // Refer to the name table rather than to the symbol, which may be
+      // released before the profiles are written.
+      StringIndexMap::const_iterator target =
+          name_table_.find(target_count.first);
+      CHECK(target != name_table_.end());
       if (std::error_code EC = llvm::MergeResult(
               result_, profile.addCalledTargetSamples(
-                           line, discriminator,
-                           llvm::StringRef(target_count.first.data(),
-                                           target_count.first.size()),
+                           line, discriminator, GetOutputName(target->first),
                            target_count.second)))
         LOG(FATAL) << "Error updating called target samples for '"
                    << node->info.func_name << "': " << EC.message();
@@ -157,7 +296,14 @@ llvm::StringRef LLVMProfileBuilder::GetNameRef(const std::string &str) {
     LOG(WARNING) << "Unexpected character '.' in function name: " << ret->first
                << ". Likely thin LTO .llvm.<hash> suffix has not been cleared.";
   }
-  return llvm::StringRef(ret->first);
+  return GetOutputName(ret->first);
+}
+
+llvm::StringRef LLVMProfileBuilder::GetOutputName(absl::string_view name) {
+  // LLVM hashes the names itself, so MD5 names are written as their names.
+  if (const char *original = Md5NameTable::Global().GetName(name))
+    return llvm::StringRef(original);
+  return llvm::StringRef(name.data(), name.size());
 }
 
 llvm::sampleprof::SampleProfileWriter *LLVMProfileWriter::CreateSampleWriter(
@@ -194,6 +340,25 @@ bool LLVMProfileWriter::WriteToFile(const std::string &output_filename) {
                                    name_table, sample_prof_writer_.get());
 }
 
+bool LLVMProfileWriter::WriteToFileAndRelease(
+    const std::string &output_filename, SymbolMap *symbol_map) {
+  setSymbolMap(symbol_map);
+  if (absl::GetFlag(FLAGS_debug_dump)) Dump();
+
+  StringIndexMap name_table;
+  StringTableUpdater::Update(*symbol_map, &name_table);
+
+  if (!sample_prof_writer_) {
+    if (!CreateSampleWriter(output_filename)) {
+      return false;
+    }
+  }
+
+  // The converted profiles replace the symbol profiles one at a time.
+  return LLVMProfileBuilder::WriteAndRelease(
+      output_filename, symbol_map, name_table, sample_prof_writer_.get());
+}
+
 }  // namespace devtools_crosstool_autofdo
 
 #endif  // HAVE_LLVM
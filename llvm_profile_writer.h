@@ -5,6 +5,7 @@
 #include <string>
 
 #include "profile_writer.h"
+#include "third_party/abseil/absl/strings/string_view.h"
 #include "llvm/Config/llvm-config.h"
 #include "llvm/ProfileData/SampleProf.h"
 #include "llvm/ProfileData/SampleProfWriter.h"
@@ -23,6 +24,13 @@ class LLVMProfileWriter : public ProfileWriter {
 
   bool WriteToFile(const std::string &output_filename) override;
 
+  // Same as WriteToFile for SYMBOL_MAP, but frees the profile of every
+  // symbol as soon as it has been converted, so that the symbol map and the
+  // LLVM profile are never both held in full. Only the total and head
+  // counts of the symbols are left in SYMBOL_MAP.
+  bool WriteToFileAndRelease(const std::string &output_filename,
+                             SymbolMap *symbol_map);
+
   llvm::sampleprof::SampleProfileWriter *GetSampleProfileWriter() {
     return sample_prof_writer_.get();
   }
@@ -48,11 +56,20 @@ class LLVMProfileBuilder : public SymbolTraverser {
       const StringIndexMap &name_table,
       llvm::sampleprof::SampleProfileWriter *sample_profile_writer);
 
+  // Same as Write, but releases the profile of every symbol of SYMBOL_MAP
+  // once it has been converted, see Symbol::ReleaseProfile.
+  static bool WriteAndRelease(
+      const std::string &output_filename, SymbolMap *symbol_map,
+      const StringIndexMap &name_table,
+      llvm::sampleprof::SampleProfileWriter *sample_profile_writer);
+
 // LLVM_BEFORE_SAMPLEFDO_SPLIT_CONTEXT is defined when llvm version is before
 // https://reviews.llvm.org/rGb9db70369b7799887b817e13109801795e4d70fc
 #ifndef LLVM_BEFORE_SAMPLEFDO_SPLIT_CONTEXT
   const llvm::sampleprof::SampleProfileMap &ConvertProfiles(
       const SymbolMap &symbol_map);
+  const llvm::sampleprof::SampleProfileMap &ConvertAndReleaseProfiles(
+      SymbolMap *symbol_map);
 
   const llvm::sampleprof::SampleProfileMap &GetProfiles() const {
     return profiles_;
@@ -60,6 +77,8 @@ class LLVMProfileBuilder : public SymbolTraverser {
 #else
   const llvm::StringMap<llvm::sampleprof::FunctionSamples> &ConvertProfiles(
       const SymbolMap &symbol_map);
+  const llvm::StringMap<llvm::sampleprof::FunctionSamples>
+      &ConvertAndReleaseProfiles(SymbolMap *symbol_map);
 
   const llvm::StringMap<llvm::sampleprof::FunctionSamples> &GetProfiles()
       const {
@@ -73,7 +92,24 @@ class LLVMProfileBuilder : public SymbolTraverser {
   void Visit(const Symbol *node) override;
   llvm::StringRef GetNameRef(const std::string &str);
 
+  // Returns the name that NAME, a name of the name table, is written as.
+  static llvm::StringRef GetOutputName(absl::string_view name);
+
  private:
+  // Visits the symbols of SYMBOL_MAP like Start, and releases the profile
+  // of each symbol after its last name has been visited.
+  void StartAndRelease(SymbolMap *symbol_map);
+  // Converts the symbols of SYMBOL_MAP like Start on NUM_THREADS threads.
+  // Each top-level function is converted into its own FunctionSamples, and
+  // those are added to profiles_ in name order, so the result does not
+  // depend on NUM_THREADS. If RELEASE, the profile of each symbol is
+  // released like in StartAndRelease.
+  void StartInParallel(const SymbolMap &symbol_map, bool release,
+                       int num_threads);
+  // Starts converting the top-level symbol NODE named NAME into PROFILE.
+  void VisitTopSymbol(const std::string &name, const Symbol *node,
+                      llvm::sampleprof::FunctionSamples *profile);
+
 // LLVM_BEFORE_SAMPLEFDO_SPLIT_CONTEXT is defined when llvm version is before
 // https://reviews.llvm.org/rGb9db70369b7799887b817e13109801795e4d70fc
 #ifndef LLVM_BEFORE_SAMPLEFDO_SPLIT_CONTEXT
@@ -3,12 +3,17 @@
 #include <string>
 
 #include "addr2line.h"
+#include "llvm_profile_reader.h"
 #include "profile_creator.h"
 #include "symbol_map.h"
 #include "gmock/gmock.h"
+#include "third_party/abseil/absl/flags/declare.h"
 #include "third_party/abseil/absl/flags/flag.h"
 #include "third_party/abseil/absl/strings/str_cat.h"
 #include "llvm/Config/llvm-config.h"
+#include "llvm/Support/raw_ostream.h"
+
+ABSL_DECLARE_FLAG(uint32_t, profile_writer_threads);
 
 #define FLAGS_test_tmpdir std::string(testing::UnitTest::GetInstance()->original_working_dir())
 
@@ -85,6 +90,47 @@ TEST(LlvmProfileWriterTest, ReadProfile) {
   ASSERT_EQ(call_targets.lookup("_Z3bari"), 8045);
 }
 
+TEST(LlvmProfileWriterTest, AddNewSamplesToBaseProfile) {
+  const std::string binary =
+      absl::StrCat(FLAGS_test_srcdir,
+                   "/testdata/"
+                   "llvm_function_samples.binary");
+  const std::string profile =
+      absl::StrCat(FLAGS_test_srcdir,
+                   "/testdata/"
+                   "llvm_function_samples_perf.data");
+  const std::string base_out =
+      absl::StrCat(FLAGS_test_tmpdir, "/base_profile.afdo");
+  const std::string updated_out =
+      absl::StrCat(FLAGS_test_tmpdir, "/updated_profile.afdo");
+
+  {
+    LLVMProfileWriter writer(llvm::sampleprof::SPF_Text);
+    ProfileCreator creator(binary);
+    ASSERT_TRUE(creator.CreateProfile(profile, "perf", &writer, base_out));
+  }
+  // Updating the profile with the same samples again doubles its counts.
+  SymbolMap base_profile;
+  LLVMProfileReader base_reader(&base_profile);
+  base_reader.set_read_total_samples(true);
+  ASSERT_TRUE(base_reader.ReadFromFile(base_out));
+  {
+    LLVMProfileWriter writer(llvm::sampleprof::SPF_Text);
+    ProfileCreator creator(binary);
+    creator.set_base_profile(&base_profile);
+    ASSERT_TRUE(creator.CreateProfile(profile, "perf", &writer, updated_out));
+  }
+  EXPECT_TRUE(base_profile.map().empty());
+
+  SymbolMap updated_profile;
+  LLVMProfileReader updated_reader(&updated_profile);
+  updated_reader.set_read_total_samples(true);
+  ASSERT_TRUE(updated_reader.ReadFromFile(updated_out));
+  ASSERT_EQ(updated_profile.map().count("main"), 1);
+  const Symbol *main = updated_profile.map().at("main");
+  EXPECT_EQ(main->total_count, 2 * 1186160);
+}
+
 TEST(LlvmProfileWriterTest, ConvertProfile) {
   SymbolMap symbol_map;
   symbol_map.set_count_threshold(1);
@@ -138,4 +184,75 @@ TEST(LlvmProfileWriterTest, ConvertProfile) {
   CHECK(baz_profile != nullptr);
   CHECK_EQ(*baz_profile->findSamplesAt(200, 0), 100);
 }
+
+TEST(LlvmProfileWriterTest, ConvertAndReleaseProfiles) {
+  SymbolMap symbol_map;
+  symbol_map.set_count_threshold(1);
+  symbol_map.AddSymbol("foo");
+  SourceStack src1, src2;
+  src1.push_back(SourceInfo("bar", "", "", 0, 20, 0));
+  src1.push_back(SourceInfo("foo", "", "", 0, 2, 0));
+  symbol_map.AddSourceCount("foo", src1, 100, 1);
+  src2.push_back(SourceInfo("foo", "", "", 0, 3, 0));
+  symbol_map.AddSourceCount("foo", src2, 200, 1);
+  symbol_map.AddIndirectCallTarget("foo", src2, "qux", 150);
+
+  StringIndexMap name_table;
+  StringTableUpdater::Update(symbol_map, &name_table);
+  LLVMProfileBuilder expected_builder(name_table);
+  const auto &expected = expected_builder.ConvertProfiles(symbol_map);
+  LLVMProfileBuilder builder(name_table);
+  const auto &profiles = builder.ConvertAndReleaseProfiles(&symbol_map);
+
+  ASSERT_EQ(profiles.size(), 1);
+  std::string profile_text, expected_text;
+  llvm::raw_string_ostream profile_os(profile_text), expected_os(expected_text);
+  profiles.begin()->second.print(profile_os);
+  expected.begin()->second.print(expected_os);
+  EXPECT_EQ(profile_os.str(), expected_os.str());
+  const Symbol *foo = symbol_map.map().at("foo");
+  EXPECT_EQ(foo->total_count, 300);
+  EXPECT_TRUE(foo->pos_counts.empty());
+  EXPECT_TRUE(foo->callsites.empty());
+}
+
+TEST(LlvmProfileWriterTest, ConvertProfilesInParallel) {
+  SymbolMap symbol_map;
+  symbol_map.set_count_threshold(1);
+  for (int i = 0; i < 100; ++i) {
+    const std::string name = absl::StrCat("foo", i);
+    symbol_map.AddSymbol(name);
+    SourceStack src1, src2;
+    src1.push_back(SourceInfo("bar", "", "", 0, 20 + i, 0));
+    src1.push_back(SourceInfo(name.c_str(), "", "", 0, 2, 0));
+    symbol_map.AddSourceCount(name, src1, 100 + i, 1);
+    src2.push_back(SourceInfo(name.c_str(), "", "", 0, 3, 0));
+    symbol_map.AddSourceCount(name, src2, 200, 1);
+    symbol_map.AddIndirectCallTarget(name, src2, "qux", 150 + i);
+  }
+
+  StringIndexMap name_table;
+  StringTableUpdater::Update(symbol_map, &name_table);
+  LLVMProfileBuilder expected_builder(name_table);
+  const auto &expected = expected_builder.ConvertProfiles(symbol_map);
+  absl::SetFlag(&FLAGS_profile_writer_threads, 4);
+  LLVMProfileBuilder builder(name_table);
+  const auto &profiles = builder.ConvertAndReleaseProfiles(&symbol_map);
+  absl::SetFlag(&FLAGS_profile_writer_threads, 1);
+
+  ASSERT_EQ(profiles.size(), expected.size());
+  for (const auto &expected_profile : expected) {
+    const auto it = profiles.find(expected_profile.first);
+    ASSERT_NE(it, profiles.end());
+    std::string profile_text, expected_text;
+    llvm::raw_string_ostream profile_os(profile_text),
+        expected_os(expected_text);
+    it->second.print(profile_os);
+    expected_profile.second.print(expected_os);
+    EXPECT_EQ(profile_os.str(), expected_os.str());
+  }
+  for (const auto &[name, symbol] : symbol_map.map()) {
+    EXPECT_TRUE(symbol->pos_counts.empty()) << name;
+  }
+}
 }  // namespace devtools_crosstool_autofdo
@@ -8,6 +8,7 @@
 #include <vector>
 
 #include "llvm_propeller_cfg.h"
+#include "llvm_propeller_cold_functions.h"
 #include "llvm_propeller_options.pb.h"
 #include "llvm_propeller_statistics.h"
 #include "third_party/abseil/absl/status/status.h"
@@ -25,6 +26,8 @@ enum class CfgCreationMode {
 // This is the data interface between the frontend (protobuf / binary+perf) and
 // the code layout algorith. The main data carried here:
 //   cfgs() - ControlFlowGraphs indexed by name
+//   cold_functions() - functions without a ControlFlowGraph, see
+//                      `compact_cold_functions`
 //   options() - frontend options
 class AbstractPropellerWholeProgramInfo {
  public:
@@ -43,6 +46,10 @@ class AbstractPropellerWholeProgramInfo {
   virtual absl::Status CreateCfgs(CfgCreationMode cfg_creation_mode) = 0;
 
   const CFGMapTy &cfgs() const { return cfgs_; }
+
+  // The functions which get no cfg with `options_.compact_cold_functions()`.
+  // None of them is hot, so the code layout only needs their original order.
+  const ColdFunctions &cold_functions() const { return cold_functions_; }
   const PropellerOptions &options() const { return options_; }
   const PropellerStats &stats() const { return stats_; }
 
@@ -64,6 +71,7 @@ class AbstractPropellerWholeProgramInfo {
  protected:
   // See CFGMapTy.
   CFGMapTy cfgs_;
+  ColdFunctions cold_functions_;
   const PropellerOptions options_;
   PropellerStats stats_;
 };
@@ -9,6 +9,7 @@
 #include <vector>
 
 #include "base/logging.h"
+#include "memory_usage.h"
 
 namespace devtools_crosstool_autofdo {
 std::string CFGNode::GetName() const {
@@ -23,9 +24,12 @@ std::string CFGNode::GetName() const {
 void ControlFlowGraph::CreateNodes(
     const llvm::object::BBAddrMap &func_bb_addr_map, uint64_t ordinal) {
   CHECK(nodes_.empty());
+  nodes_.reserve(func_bb_addr_map.BBEntries.size());
   int bb_index = 0;
+  // Ordinals are assigned in increasing order, so appending keeps `nodes_`
+  // sorted.
   for (const auto &bb_entry : func_bb_addr_map.BBEntries) {
-    nodes_.insert(std::make_unique<CFGNode>(
+    nodes_.push_back(std::make_unique<CFGNode>(
         /*symbol_ordinal=*/ordinal++,
         /*addr=*/func_bb_addr_map.Addr + bb_entry.Offset,
         /*bb_index=*/bb_index++,
@@ -35,6 +39,14 @@ void ControlFlowGraph::CreateNodes(
   }
 }
 
+CFGNode *ControlFlowGraph::InsertNode(std::unique_ptr<CFGNode> node) {
+  auto it = std::lower_bound(nodes_.begin(), nodes_.end(), node,
+                             CFGNodeUniquePtrLessComparator());
+  if (it != nodes_.end() && !CFGNodeUniquePtrLessComparator()(node, *it))
+    return it->get();
+  return nodes_.insert(it, std::move(node))->get();
+}
+
 CFGEdge *ControlFlowGraph::CreateEdge(CFGNode *from, CFGNode *to,
                                       uint64_t weight,
                                       CFGEdge::Kind kind) {
@@ -61,6 +73,19 @@ CFGEdge *ControlFlowGraph::CreateEdge(CFGNode *from, CFGNode *to,
   return ret;
 }
 
+uint64_t ControlFlowGraph::MemoryUsage() const {
+  uint64_t bytes =
+      sizeof(*this) + VectorBytes(nodes_) + VectorBytes(intra_edges_) +
+      VectorBytes(inter_edges_) +
+      (intra_edges_.size() + inter_edges_.size()) * sizeof(CFGEdge);
+  for (const std::unique_ptr<CFGNode> &node : nodes_) {
+    bytes += sizeof(CFGNode) + VectorBytes(node->intra_outs()) +
+             VectorBytes(node->intra_ins()) + VectorBytes(node->inter_outs()) +
+             VectorBytes(node->inter_ins());
+  }
+  return bytes;
+}
+
 void ControlFlowGraph::CalculateNodeFreqs() {
   if (nodes_.empty()) return;
   ForEachNodeRef([&](CFGNode &node) {
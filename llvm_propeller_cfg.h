@@ -5,7 +5,6 @@
 #include <memory>
 #include <numeric>
 #include <ostream>
-#include <set>
 #include <string>
 #include <utility>
 #include <vector>
@@ -115,6 +114,7 @@ class CFGNode final {
  private:
   friend class ControlFlowGraph;
   friend class CFGNodeBundle;
+  friend class CodeLayout;
 
   friend void PrintTo(const CFGNode &node, std::ostream *os) {
     *os << absl::StreamFormat(
@@ -145,6 +145,12 @@ class CFGNode final {
     bundle_offset_ = bundle_offset;
   }
 
+  // Detaches this node from its bundle so it can be laid out again.
+  void clear_bundle() {
+    bundle_ = nullptr;
+    bundle_offset_ = 0;
+  }
+
   const uint64_t symbol_ordinal_;
   const uint64_t addr_;
   // Zero-based index of the basic block in the function. A zero value indicates
@@ -226,11 +232,13 @@ class ControlFlowGraph {
   // after constructing all nodes and edges.
   void CalculateNodeFreqs();
 
+  // Returns an estimate of the bytes held by the CFG and its nodes and edges.
+  uint64_t MemoryUsage() const;
+
   const llvm::SmallVectorImpl<llvm::StringRef> &names() const {
     return names_;
   }
-  const std::set<std::unique_ptr<CFGNode>, CFGNodeUniquePtrLessComparator>
-      &nodes() const {
+  const std::vector<std::unique_ptr<CFGNode>> &nodes() const {
     return nodes_;
   }
 
@@ -249,7 +257,7 @@ class ControlFlowGraph {
   }
 
   CFGNode *InsertNodeForTest(std::unique_ptr<CFGNode> node) {
-    return nodes_.insert(std::move(node)).first->get();
+    return InsertNode(std::move(node));
   }
 
   // Writes the dot format of CFG into the given stream. The second argument
@@ -260,9 +268,14 @@ class ControlFlowGraph {
       const absl::flat_hash_map<int, int> &layout_index_map) const;
 
  private:
-  friend class MockPropellerWholeProgramInfo;
+  friend class PropellerCfgSnapshotWholeProgramInfo;
   friend class PropellerProfWriter;
 
+  // Inserts `node` into `nodes_` at its position in the ordinal order and
+  // returns it. If a node with the same ordinal already exists, `node` is
+  // discarded and the existing node is returned instead.
+  CFGNode *InsertNode(std::unique_ptr<CFGNode> node);
+
   bool hot_tag_ = false;
   int n_landing_pads_ = 0;
   int n_hot_landing_pads_ = 0;
@@ -272,8 +285,10 @@ class ControlFlowGraph {
   llvm::SmallVector<llvm::StringRef, 3> names_;
 
   // CFGs own all nodes. Nodes here are *strictly* sorted by addresses /
-  // ordinals.
-  std::set<std::unique_ptr<CFGNode>, CFGNodeUniquePtrLessComparator> nodes_;
+  // ordinals. This is kept as a sorted vector rather than a tree so that
+  // traversals, which are far more frequent than insertions, walk contiguous
+  // memory.
+  std::vector<std::unique_ptr<CFGNode>> nodes_;
 
   // CFGs own all edges. All edges are owned by their src's CFGs and they
   // appear exactly once in one of the following two fields. The src and sink
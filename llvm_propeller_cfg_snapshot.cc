@@ -0,0 +1,248 @@
+#include "llvm_propeller_cfg_snapshot.h"
+
+#include <fcntl.h>  // for "O_RDONLY"
+
+#include <algorithm>
+#include <fstream>
+#include <limits>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "llvm_propeller_abstract_whole_program_info.h"
+#include "llvm_propeller_cfg.h"
+#include "llvm_propeller_cfg.pb.h"
+#include "llvm_propeller_cold_functions.h"
+#include "llvm_propeller_statistics.h"
+#include "parallel_for.h"
+#include "google/protobuf/arena.h"
+#include "google/protobuf/io/coded_stream.h"
+#include "google/protobuf/io/zero_copy_stream_impl.h"  // for "typename google::protobuf::io::FileInputStream"
+#include "third_party/abseil/absl/container/flat_hash_map.h"
+#include "third_party/abseil/absl/status/status.h"
+#include "third_party/abseil/absl/strings/str_format.h"
+#include "third_party/abseil/absl/types/span.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/Allocator.h"
+#include "llvm/Support/StringSaver.h"
+
+namespace devtools_crosstool_autofdo {
+
+static CFGEdgePb::Kind convertToPBKind(CFGEdge::Kind kind) {
+  switch (kind) {
+    case CFGEdge::Kind::kBranchOrFallthough:
+      return CFGEdgePb::BRANCH_OR_FALLTHROUGH;
+    case CFGEdge::Kind::kCall:
+      return CFGEdgePb::CALL;
+    case CFGEdge::Kind::kRet:
+      return CFGEdgePb::RETURN;
+  }
+}
+
+static CFGEdge::Kind convertFromPBKind(CFGEdgePb::Kind kindpb) {
+  switch (kindpb) {
+    case CFGEdgePb::BRANCH_OR_FALLTHROUGH:
+      return CFGEdge::Kind::kBranchOrFallthough;
+    case CFGEdgePb::CALL:
+      return CFGEdge::Kind::kCall;
+    case CFGEdgePb::RETURN:
+      return CFGEdge::Kind::kRet;
+  }
+}
+
+static void AddEdgePb(
+    const CFGEdge &edge,
+    google::protobuf::RepeatedPtrField<CFGEdgePb> *edges_pb) {
+  CFGEdgePb *edge_pb = edges_pb->Add();
+  edge_pb->set_source(edge.src()->symbol_ordinal());
+  edge_pb->set_sink(edge.sink()->symbol_ordinal());
+  edge_pb->set_weight(edge.weight());
+  edge_pb->set_kind(convertToPBKind(edge.kind()));
+}
+
+PropellerPb CreateCfgSnapshot(
+    const AbstractPropellerWholeProgramInfo &whole_program_info) {
+  PropellerPb propeller_pb;
+  for (const auto &[unused, cfg] : whole_program_info.cfgs()) {
+    ControlFlowGraphPb *cfg_pb = propeller_pb.add_cfg();
+    for (llvm::StringRef name : cfg->names()) cfg_pb->add_name(name.str());
+    for (const std::unique_ptr<CFGNode> &node : cfg->nodes()) {
+      CFGNodePb *node_pb = cfg_pb->add_node();
+      node_pb->set_symbol_ordinal(node->symbol_ordinal());
+      node_pb->set_size(node->size());
+      node_pb->set_freq(node->freq());
+      node_pb->set_bb_index(node->bb_index());
+      node_pb->set_is_landing_pad(node->is_landing_pad());
+      for (const CFGEdge *edge : node->intra_outs())
+        AddEdgePb(*edge, node_pb->mutable_intra_outs());
+      for (const CFGEdge *edge : node->inter_outs())
+        AddEdgePb(*edge, node_pb->mutable_inter_outs());
+    }
+  }
+  // The cold functions are recorded as cfgs without edges.
+  const ColdFunctions &cold_functions = whole_program_info.cold_functions();
+  for (int i = 0; i != cold_functions.size(); ++i) {
+    ControlFlowGraphPb *cfg_pb = propeller_pb.add_cfg();
+    for (llvm::StringRef name : cold_functions.names(i))
+      cfg_pb->add_name(name.str());
+    const absl::Span<const uint32_t> bb_sizes = cold_functions.bb_sizes(i);
+    for (int bb_index = 0; bb_index != bb_sizes.size(); ++bb_index) {
+      CFGNodePb *node_pb = cfg_pb->add_node();
+      node_pb->set_symbol_ordinal(cold_functions.first_ordinal(i) + bb_index);
+      node_pb->set_size(bb_sizes[bb_index]);
+      node_pb->set_freq(0);
+      node_pb->set_bb_index(bb_index);
+      node_pb->set_is_landing_pad(cold_functions.is_landing_pad(i, bb_index));
+    }
+  }
+  return propeller_pb;
+}
+
+absl::Status WriteCfgSnapshot(
+    const AbstractPropellerWholeProgramInfo &whole_program_info,
+    const std::string &snapshot_name) {
+  const PropellerPb propeller_pb = CreateCfgSnapshot(whole_program_info);
+  std::ofstream out_stream(snapshot_name, std::ios::out | std::ios::binary);
+  if (!out_stream.good() || !propeller_pb.SerializeToOstream(&out_stream)) {
+    return absl::InternalError(
+        absl::StrFormat("Failed to write cfg snapshot '%s'.", snapshot_name));
+  }
+  LOG(INFO) << "Wrote " << propeller_pb.cfg_size() << " cfgs to '"
+            << snapshot_name << "'.";
+  return absl::OkStatus();
+}
+
+absl::Status PropellerCfgSnapshotWholeProgramInfo::CreateCfgs(
+    CfgCreationMode cfg_creation_mode) {
+  const std::string &snapshot_name = options_.cfg_snapshot_name();
+  int fd = open(snapshot_name.c_str(), O_RDONLY);
+  if (fd == -1) {
+    return absl::FailedPreconditionError(absl::StrFormat(
+        "Failed to open and read cfg snapshot '%s'.", snapshot_name));
+  }
+  typename google::protobuf::io::FileInputStream fis(fd);
+  fis.SetCloseOnDelete(true);
+  LOG(INFO) << "Reading from '" << snapshot_name << "'.";
+  // Snapshots of large programs easily exceed the default limit of the coded
+  // stream.
+  google::protobuf::io::CodedInputStream cis(&fis);
+  cis.SetTotalBytesLimit(std::numeric_limits<int>::max());
+  // The messages of the snapshot are allocated in an arena, which is freed at
+  // once when the cfgs are created.
+  google::protobuf::Arena arena;
+  PropellerPb *propeller_pb =
+      google::protobuf::Arena::CreateMessage<PropellerPb>(&arena);
+  if (!propeller_pb->ParseFromCodedStream(&cis) ||
+      !cis.ConsumedEntireMessage()) {
+    return absl::InternalError(absl::StrFormat(
+        "Unable to parse cfg snapshot '%s'", snapshot_name));
+  }
+  CreateCfgsFromProtobuf(*propeller_pb);
+  return absl::OkStatus();
+}
+
+static std::unique_ptr<CFGNode> CreateNodeFromNodePb(const CFGNodePb &nodepb,
+                                                     ControlFlowGraph *cfg) {
+  return std::make_unique<CFGNode>(
+      /*symbol_ordinal=*/nodepb.symbol_ordinal(), /*addr=*/0,
+      /*bb_index=*/nodepb.bb_index(), /*size=*/nodepb.size(),
+      /*is_landing_pad=*/nodepb.is_landing_pad(), /*cfg=*/cfg,
+      /*freq=*/nodepb.freq());
+}
+
+// Creates the cfgs and their nodes and intra-function edges on
+// `cfg_creation_threads` threads, one cfg per task, then the remaining edges,
+// which may connect the nodes of different cfgs, on the calling thread.
+void PropellerCfgSnapshotWholeProgramInfo::CreateCfgsFromProtobuf(
+    const PropellerPb &propeller_pb) {
+  bump_ptr_allocator_ = std::make_unique<llvm::BumpPtrAllocator>();
+  string_saver_ = std::make_unique<llvm::StringSaver>(*bump_ptr_allocator_);
+  const int num_cfgs = propeller_pb.cfg_size();
+  // The string saver is not thread-safe, so the names are saved up front.
+  std::vector<llvm::SmallVector<llvm::StringRef, 3>> cfg_names(num_cfgs);
+  for (int i = 0; i != num_cfgs; ++i) {
+    for (const auto &name : propeller_pb.cfg(i).name())
+      cfg_names[i].emplace_back(string_saver_->save(name));
+  }
+  std::vector<std::unique_ptr<ControlFlowGraph>> cfgs(num_cfgs);
+  const int num_threads =
+      std::max<int>(std::min<int>(options_.cfg_creation_threads(), num_cfgs),
+                    1);
+  ParallelFor("CreateCfgNodes", num_threads, num_cfgs, [&](int i, int) {
+    auto cfg = std::make_unique<ControlFlowGraph>(std::move(cfg_names[i]));
+    for (const auto &nodepb : propeller_pb.cfg(i).node()) {
+      std::unique_ptr<CFGNode> node = CreateNodeFromNodePb(nodepb, cfg.get());
+      if (node->freq()) {
+        cfg->hot_tag_ = true;
+        if (node->is_landing_pad()) ++cfg->n_hot_landing_pads_;
+      }
+      if (node->is_landing_pad()) ++cfg->n_landing_pads_;
+      cfg->InsertNode(std::move(node));
+    }
+    cfgs[i] = std::move(cfg);
+  });
+
+  // The first node with an ordinal is the endpoint of its edges.
+  absl::flat_hash_map<uint64_t, CFGNode *> ordinal_to_node_map;
+  for (const std::unique_ptr<ControlFlowGraph> &cfg : cfgs) {
+    ++stats_.cfgs_created;
+    stats_.nodes_created += cfg->nodes_.size();
+    for (const std::unique_ptr<CFGNode> &node : cfg->nodes_)
+      ordinal_to_node_map.try_emplace(node->symbol_ordinal(), node.get());
+  }
+  auto get_node = [&ordinal_to_node_map](uint64_t ordinal) {
+    auto it = ordinal_to_node_map.find(ordinal);
+    CHECK(it != ordinal_to_node_map.end()) << ordinal;
+    return it->second;
+  };
+  auto create_edge = [](const CFGEdgePb &edgepb, CFGNode *from_n,
+                        CFGNode *to_n, PropellerStats &stats) {
+    auto edge_kind = convertFromPBKind(edgepb.kind());
+    from_n->cfg()->CreateEdge(from_n, to_n, edgepb.weight(), edge_kind);
+    ++stats.edges_created_by_kind[edge_kind];
+    stats.total_edge_weight_by_kind[edge_kind] += edgepb.weight();
+  };
+
+  // Edges between the nodes of one cfg only touch that cfg, so they are
+  // created in parallel.
+  std::vector<PropellerStats> stats_per_thread(num_threads);
+  auto create_intra_cfg_edges = [&](int i, int thread) {
+    for (const auto &nodepb : propeller_pb.cfg(i).node()) {
+      for (const auto &edgepb : nodepb.intra_outs()) {
+        CFGNode *from_n = get_node(edgepb.source());
+        CFGNode *to_n = get_node(edgepb.sink());
+        if (from_n->cfg() != cfgs[i].get() || to_n->cfg() != cfgs[i].get())
+          continue;
+        create_edge(edgepb, from_n, to_n, stats_per_thread[thread]);
+      }
+    }
+  };
+  ParallelFor("CreateIntraCfgEdges", num_threads, num_cfgs,
+              create_intra_cfg_edges);
+  for (const PropellerStats &stats : stats_per_thread) stats_ += stats;
+
+  for (int i = 0; i != num_cfgs; ++i) {
+    for (const auto &nodepb : propeller_pb.cfg(i).node()) {
+      for (const auto &edgepb : nodepb.intra_outs()) {
+        CFGNode *from_n = get_node(edgepb.source());
+        CFGNode *to_n = get_node(edgepb.sink());
+        if (from_n->cfg() == cfgs[i].get() && to_n->cfg() == cfgs[i].get())
+          continue;
+        create_edge(edgepb, from_n, to_n, stats_);
+      }
+      for (const auto &edgepb : nodepb.inter_outs()) {
+        create_edge(edgepb, get_node(edgepb.source()), get_node(edgepb.sink()),
+                    stats_);
+      }
+    }
+  }
+
+  for (std::unique_ptr<ControlFlowGraph> &cfg : cfgs) {
+    llvm::StringRef name = cfg->names().front();
+    cfgs_.emplace(name, std::move(cfg));
+  }
+}
+
+}  // namespace devtools_crosstool_autofdo
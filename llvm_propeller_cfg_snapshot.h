@@ -0,0 +1,65 @@
+#ifndef AUTOFDO_LLVM_PROPELLER_CFG_SNAPSHOT_H_
+#define AUTOFDO_LLVM_PROPELLER_CFG_SNAPSHOT_H_
+
+#if defined(HAVE_LLVM)
+
+#include <memory>
+#include <string>
+
+#include "llvm_propeller_abstract_whole_program_info.h"
+#include "llvm_propeller_cfg.pb.h"
+#include "llvm_propeller_options.pb.h"
+#include "third_party/abseil/absl/status/status.h"
+#include "llvm/Support/Allocator.h"
+#include "llvm/Support/StringSaver.h"
+
+namespace devtools_crosstool_autofdo {
+
+// Returns all the cfgs in `whole_program_info` as a PropellerPb. Only the
+// outgoing edges of every node are recorded, since the incoming edges are
+// implied by them. The cold functions without a cfg are recorded as cfgs
+// without edges.
+PropellerPb CreateCfgSnapshot(
+    const AbstractPropellerWholeProgramInfo &whole_program_info);
+
+// Writes `CreateCfgSnapshot(whole_program_info)` into `snapshot_name` as a
+// binary-encoded PropellerPb.
+absl::Status WriteCfgSnapshot(
+    const AbstractPropellerWholeProgramInfo &whole_program_info,
+    const std::string &snapshot_name);
+
+// Whole program info which reads the cfgs from a snapshot written by
+// `WriteCfgSnapshot`, instead of from the binary and the perf data. This
+// allows rerunning the code layout with different parameters without paying
+// for the profile processing again.
+class PropellerCfgSnapshotWholeProgramInfo
+    : public AbstractPropellerWholeProgramInfo {
+ public:
+  explicit PropellerCfgSnapshotWholeProgramInfo(const PropellerOptions &options)
+      : AbstractPropellerWholeProgramInfo(options) {}
+
+  ~PropellerCfgSnapshotWholeProgramInfo() override {}
+
+  // Reads the snapshot from `options_.cfg_snapshot_name()`. The snapshot only
+  // contains the cfgs it was created with, so `cfg_creation_mode` is ignored.
+  absl::Status CreateCfgs(CfgCreationMode cfg_creation_mode) override;
+
+ protected:
+  // Creates the cfgs from `propeller_pb`, in parallel on
+  // `options_.cfg_creation_threads()` threads. The cfgs do not refer to
+  // `propeller_pb`, which may be freed afterwards.
+  void CreateCfgsFromProtobuf(const PropellerPb &propeller_pb);
+
+ private:
+  // When we construct Symbols/CFGs from protobuf, bump_ptr_allocator_ and
+  // string_saver_ are used to keep all the string content. (Whereas in case of
+  // constructing from binary files, the strings are kept in
+  // binary_file_content.)
+  std::unique_ptr<llvm::BumpPtrAllocator> bump_ptr_allocator_;
+  std::unique_ptr<llvm::StringSaver> string_saver_;
+};
+
+}  // namespace devtools_crosstool_autofdo
+
+#endif
+#endif  // AUTOFDO_LLVM_PROPELLER_CFG_SNAPSHOT_H_
@@ -1,6 +1,7 @@
 #include "llvm_propeller_chain_cluster_builder.h"
 
 #include <utility>
+#include <vector>
 
 #include "llvm_propeller_cfg.h"
 #include "llvm_propeller_node_chain.h"
@@ -20,85 +21,145 @@ constexpr absl::int128 kExecutionDensityDegradationThreshold = 8;
 // We avoid clustering chains with less than kChainExecutionDensityThreshold
 // execution density.
 constexpr double kChainExecutionDensityThreshold = 0.005;
+// Number of the densest unplaced clusters considered for filling each page.
+constexpr int kPagePackingLookahead = 64;
 }  // namespace
 
-void ChainClusterBuilder::MergeWithBestPredecessorCluster(
-    const NodeChain &chain) {
-  ChainCluster *cluster = chain_to_cluster_map_.at(&chain);
+int ChainClusterBuilder::FindClusterRoot(int chain_index) {
+  // Path halving: point every visited index to its grandparent.
+  while (cluster_parent_[chain_index] != chain_index) {
+    cluster_parent_[chain_index] =
+        cluster_parent_[cluster_parent_[chain_index]];
+    chain_index = cluster_parent_[chain_index];
+  }
+  return chain_index;
+}
+
+std::vector<uint64_t> ChainClusterBuilder::ComputeChainEdgeWeights() {
+  std::vector<uint64_t> weight_to(chains_.size(), 0);
+  pred_chain_weights_.assign(chains_.size(), {});
+  for (int chain_index = 0; chain_index != chains_.size(); ++chain_index) {
+    const NodeChain &chain = *chains_[chain_index];
+    if (!code_layout_params_.inter_function_reordering()) {
+      CHECK(chain.GetFirstNode()->is_entry())
+          << "First node in the chain for function \""
+          << chain.cfg_->GetPrimaryName().str() << "\" is not an entry block.";
+    }
+    std::vector<std::pair<int, uint64_t>> &pred_weights =
+        pred_chain_weights_[chain_index];
+    chain.VisitEachNodeRef([&](const CFGNode &node) {
+      // Without inter-function reordering, only the incoming edges to the
+      // entry block are considered for merging.
+      const bool merge_eligible_sink =
+          code_layout_params_.inter_function_reordering() ||
+          &node == chain.GetFirstNode();
+      node.ForEachInEdgeRef([&](const CFGEdge &edge) {
+        // Omit return edges since optimizing them does not improve performance.
+        if (edge.IsReturn()) return;
+        const NodeChain &src_chain = GetNodeChain(edge.src());
+        // Omit intra-chain edges.
+        if (src_chain.id() == chain.id()) return;
+        weight_to[chain_index] += edge.weight();
+        if (!merge_eligible_sink) return;
+        // Omit the edge if it's cold relative to the sink.
+        if (edge.weight() * kHotEdgeRelativeFrequencyThreshold <
+            edge.sink()->freq()) {
+          return;
+        }
+        pred_weights.emplace_back(chain_index_.at(&src_chain), edge.weight());
+      });
+    });
+    // Aggregate the weights from each predecessor chain.
+    absl::c_sort(pred_weights, [](const auto &lhs, const auto &rhs) {
+      return lhs.first < rhs.first;
+    });
+    int num_preds = 0;
+    for (const auto &[pred_index, weight] : pred_weights) {
+      if (num_preds != 0 && pred_weights[num_preds - 1].first == pred_index) {
+        pred_weights[num_preds - 1].second += weight;
+      } else {
+        pred_weights[num_preds++] = {pred_index, weight};
+      }
+    }
+    pred_weights.resize(num_preds);
+  }
+  return weight_to;
+}
+
+void ChainClusterBuilder::MergeWithBestPredecessorCluster(int chain_index) {
+  const int root = FindClusterRoot(chain_index);
+  ChainCluster *cluster = root_cluster_[root];
   // If the cluster is too big, avoid merging as it is unlikely to have
   // significant benefit.
   if (cluster->size() > code_layout_params_.cluster_merge_size_threshold())
     return;
 
-  // Create a map to compute the total incoming edge weight to `cluster`
-  // from each other cluster.
-  absl::flat_hash_map<ChainCluster *, uint64_t> weight_from;
-
-  // Update the `weight_from` edges by visiting all incoming edges to the given
-  // `node`.
-  auto inspect_in_edges = [&](const CFGNode &node) {
-    node.ForEachInEdgeRef([&](const CFGEdge &edge) {
-      // Omit return edges since optimizing them does not improve performance.
-      if (edge.IsReturn()) return;
-      // Omit the edge if it's cold relative to the sink.
-      if (edge.weight() * kHotEdgeRelativeFrequencyThreshold <
-          edge.sink()->freq()) {
-        return;
-      }
-      const NodeChain &src_chain = GetNodeChain(edge.src());
-      // Omit intra-chain edges.
-      if (src_chain.id() == chain.id()) return;
-      ChainCluster *src_cluster = chain_to_cluster_map_.at(&src_chain);
-      if (src_cluster->id() == cluster->id()) return;
-      // Ignore clusters that are larger than the threshold.
-      if (src_cluster->size() >
-          code_layout_params_.cluster_merge_size_threshold()) {
-        return;
-      }
-      // Avoid merging if the predecessor cluster's density would degrade by
-      // more than 1/kDensityDegradationThreshold by the merge.
-      if (kExecutionDensityDegradationThreshold * src_cluster->size() *
-              (cluster->freq() + src_cluster->freq()) <
-          src_cluster->freq() * (cluster->size() + src_cluster->size())) {
-        return;
-      }
-      weight_from[src_cluster] += edge.weight();
-    });
-  };
-
-  if (!code_layout_params_.inter_function_reordering()) {
-    CHECK(chain.GetFirstNode()->is_entry())
-        << "First node in the chain for function \""
-        << chain.cfg_->GetPrimaryName().str() << "\" is not an entry block.";
-    inspect_in_edges(*chain.GetFirstNode());
-  } else {
-    chain.VisitEachNodeRef(inspect_in_edges);
+  // Compute the total incoming edge weight to the chain from each other
+  // cluster, keyed by the cluster's union-find root.
+  std::vector<std::pair<int, uint64_t>> weight_from;
+  for (const auto &[pred_index, weight] : pred_chain_weights_[chain_index]) {
+    const int src_root = FindClusterRoot(pred_index);
+    if (src_root == root) continue;
+    const ChainCluster *src_cluster = root_cluster_[src_root];
+    // Ignore clusters that are larger than the threshold.
+    if (src_cluster->size() >
+        code_layout_params_.cluster_merge_size_threshold()) {
+      continue;
+    }
+    // Avoid merging if the predecessor cluster's density would degrade by
+    // more than 1/kDensityDegradationThreshold by the merge.
+    if (kExecutionDensityDegradationThreshold * src_cluster->size() *
+            (cluster->freq() + src_cluster->freq()) <
+        src_cluster->freq() * (cluster->size() + src_cluster->size())) {
+      continue;
+    }
+    weight_from.emplace_back(src_root, weight);
   }
 
   if (weight_from.empty()) return;
 
+  absl::c_sort(weight_from, [](const auto &lhs, const auto &rhs) {
+    return lhs.first < rhs.first;
+  });
   // Find the predecessor cluster with the largest (total) incoming edge weight.
-  ChainCluster *best_pred_cluster =
-      absl::c_max_element(weight_from, [](const auto &p1, const auto &p2) {
-        return std::forward_as_tuple(p1.second, p1.first->id()) <
-               std::forward_as_tuple(p2.second, p2.first->id());
-      })->first;
+  int best_pred_root = -1;
+  uint64_t best_weight = 0;
+  for (auto it = weight_from.begin(); it != weight_from.end();) {
+    const int src_root = it->first;
+    uint64_t weight = 0;
+    for (; it != weight_from.end() && it->first == src_root; ++it)
+      weight += it->second;
+    if (best_pred_root == -1 ||
+        std::forward_as_tuple(weight, root_cluster_[src_root]->id()) >
+            std::forward_as_tuple(best_weight,
+                                  root_cluster_[best_pred_root]->id())) {
+      best_pred_root = src_root;
+      best_weight = weight;
+    }
+  }
 
-  MergeClusters(*best_pred_cluster, std::move(*cluster));
+  MergeClusters(best_pred_root, root);
 }
 
-// Merges `right_clusters` into and to the right side of `left_cluster` and
-// removes it from `clusters_`.
-void ChainClusterBuilder::MergeClusters(ChainCluster &left_cluster,
-                                        ChainCluster right_cluster) {
-  // Update chain to cluster mapping for chains in right_cluster, as they will
-  // be placed in left_cluster.
-  for (const std::unique_ptr<const NodeChain> &chain : right_cluster.chains())
-    chain_to_cluster_map_[chain.get()] = &left_cluster;
+// Merges the cluster rooted at `right_root` into and to the right side of the
+// cluster rooted at `left_root` and removes it from `clusters_`.
+void ChainClusterBuilder::MergeClusters(int left_root, int right_root) {
+  ChainCluster *left_cluster = root_cluster_[left_root];
+  ChainCluster *right_cluster = root_cluster_[right_root];
+  // Link the smaller tree under the larger one, so that root lookups stay
+  // shallow. The root only identifies the cluster; the merged order is
+  // determined by `MergeWith`.
+  const int new_root =
+      left_cluster->chains().size() >= right_cluster->chains().size()
+          ? left_root
+          : right_root;
+  cluster_parent_[left_root] = new_root;
+  cluster_parent_[right_root] = new_root;
+  root_cluster_[new_root] = left_cluster;
 
-  auto right_cluster_it = clusters_.find(right_cluster.id());
+  auto right_cluster_it = clusters_.find(right_cluster->id());
   // Join right_cluster into left_cluster.
-  left_cluster.MergeWith(std::move(right_cluster));
+  left_cluster->MergeWith(std::move(*right_cluster));
 
   // Delete the defunct right_cluster.
   clusters_.erase(right_cluster_it);
@@ -119,36 +180,24 @@ ChainClusterBuilder::BuildClusters() && {
 
   // Total incoming edge weight to each chain excluding return edges and
   // intra-chain edges.
-  absl::flat_hash_map<const NodeChain *, uint64_t> weight_to;
-  for (const auto &[chain, unused] : chain_to_cluster_map_){
-    uint64_t chain_id = chain->id();
-    uint64_t weight = 0;
-    chain->VisitEachNodeRef([&](const CFGNode &node) {
-      node.ForEachInEdgeRef([&](CFGEdge &edge) {
-        if (edge.IsReturn() || GetNodeChain(edge.src()).id() == chain_id) {
-          return;
-        }
-        weight += edge.weight();
-      });
-    });
-    if (weight != 0) weight_to.insert({chain, weight});
-  }
+  const std::vector<uint64_t> weight_to = ComputeChainEdgeWeights();
 
-  std::vector<const NodeChain *> chains_sorted_by_incoming_weight;
-  for (const auto &[chain, unused] : weight_to)
-    chains_sorted_by_incoming_weight.push_back(chain);
+  std::vector<int> chains_sorted_by_incoming_weight;
+  for (int chain_index = 0; chain_index != chains_.size(); ++chain_index)
+    if (weight_to[chain_index] != 0)
+      chains_sorted_by_incoming_weight.push_back(chain_index);
 
   // Sort chains in decreasing order of their total incoming edge weights.
-  absl::c_sort(chains_sorted_by_incoming_weight,
-               [&weight_to](const NodeChain *lhs, const NodeChain *rhs) {
-                 return std::forward_as_tuple(-weight_to[lhs], lhs->id()) <
-                        std::forward_as_tuple(-weight_to[rhs], rhs->id());
-               });
+  absl::c_sort(chains_sorted_by_incoming_weight, [&](int lhs, int rhs) {
+    return std::forward_as_tuple(-weight_to[lhs], chains_[lhs]->id()) <
+           std::forward_as_tuple(-weight_to[rhs], chains_[rhs]->id());
+  });
 
-  for (const NodeChain *chain : chains_sorted_by_incoming_weight) {
+  for (int chain_index : chains_sorted_by_incoming_weight) {
     // Do not merge clusters when the execution density is negligible.
-    if (chain->exec_density() < kChainExecutionDensityThreshold) continue;
-    MergeWithBestPredecessorCluster(*chain);
+    if (chains_[chain_index]->exec_density() < kChainExecutionDensityThreshold)
+      continue;
+    MergeWithBestPredecessorCluster(chain_index);
   }
 
   for (auto &[unused_id, cluster] : clusters_)
@@ -161,4 +210,96 @@ ChainClusterBuilder::BuildClusters() && {
   return built_clusters;
 }
 
+PagePackingStats PackClustersIntoPages(
+    uint64_t page_size,
+    std::vector<std::unique_ptr<const ChainCluster>> *clusters) {
+  CHECK_GT(page_size, 0);
+  const int n_clusters = clusters->size();
+  absl::flat_hash_map<const NodeChain *, int> cluster_index_by_chain;
+  for (int i = 0; i != n_clusters; ++i) {
+    for (const std::unique_ptr<const NodeChain> &chain :
+         (*clusters)[i]->chains()) {
+      cluster_index_by_chain.emplace(chain.get(), i);
+    }
+  }
+
+  PagePackingStats stats;
+  std::vector<bool> placed(n_clusters, false);
+  std::vector<int> order;
+  order.reserve(n_clusters);
+  // Free space in the current page.
+  uint64_t page_free_size = page_size;
+  // Total weight of the edges between each unplaced cluster and the clusters
+  // in the current page.
+  absl::flat_hash_map<int, uint64_t> page_affinity;
+
+  // Adds the weights of the edges between cluster `index` and the unplaced
+  // clusters to `page_affinity`.
+  auto add_page_affinity = [&](int index) {
+    auto add_edge = [&](const CFGNode *other_node, uint64_t weight) {
+      if (other_node->bundle() == nullptr || weight == 0) return;
+      auto it = cluster_index_by_chain.find(&GetNodeChain(other_node));
+      if (it == cluster_index_by_chain.end() || placed[it->second]) return;
+      page_affinity[it->second] += weight;
+    };
+    (*clusters)[index]->VisitEachNodeRef([&](const CFGNode &node) {
+      node.ForEachOutEdgeRef(
+          [&](CFGEdge &edge) { add_edge(edge.sink(), edge.weight()); });
+      node.ForEachInEdgeRef(
+          [&](CFGEdge &edge) { add_edge(edge.src(), edge.weight()); });
+    });
+  };
+
+  auto place = [&](int index) {
+    placed[index] = true;
+    page_affinity.erase(index);
+    order.push_back(index);
+    const uint64_t size = (*clusters)[index]->size();
+    stats.size += size;
+    if (size < page_free_size) {
+      page_free_size -= size;
+      add_page_affinity(index);
+      return;
+    }
+    // The cluster fills the current page and possibly spills into the next.
+    if (size > page_free_size && size <= page_size)
+      ++stats.n_straddling_clusters;
+    const uint64_t spill_size = (size - page_free_size) % page_size;
+    page_free_size = page_size - spill_size;
+    page_affinity.clear();
+    if (spill_size != 0) add_page_affinity(index);
+  };
+
+  int first_unplaced = 0;
+  while (first_unplaced != n_clusters) {
+    // Among the densest unplaced clusters which fit in the current page, pick
+    // the one with the largest affinity to the page.
+    int best_index = -1;
+    uint64_t best_affinity = 0;
+    for (int i = first_unplaced, n_considered = 0;
+         i != n_clusters && n_considered != kPagePackingLookahead; ++i) {
+      if (placed[i]) continue;
+      ++n_considered;
+      if ((*clusters)[i]->size() > page_free_size) continue;
+      auto it = page_affinity.find(i);
+      const uint64_t affinity = it == page_affinity.end() ? 0 : it->second;
+      if (best_index == -1 || affinity > best_affinity) {
+        best_index = i;
+        best_affinity = affinity;
+      }
+    }
+    place(best_index == -1 ? first_unplaced : best_index);
+    while (first_unplaced != n_clusters && placed[first_unplaced])
+      ++first_unplaced;
+  }
+
+  stats.n_pages = (stats.size + page_size - 1) / page_size;
+  std::vector<std::unique_ptr<const ChainCluster>> packed_clusters;
+  packed_clusters.reserve(n_clusters);
+  for (int index : order)
+    packed_clusters.push_back(std::move((*clusters)[index]));
+  *clusters = std::move(packed_clusters);
+  return stats;
+}
+
 }  // namespace devtools_crosstool_autofdo
@@ -27,7 +27,7 @@ class ChainCluster {
   ChainCluster(const ChainCluster &) = delete;
   ChainCluster &operator=(const ChainCluster &) = delete;
 
-  const std::vector<std::unique_ptr<const NodeChain>> &chains() {
+  const std::vector<std::unique_ptr<const NodeChain>> &chains() const {
     return chains_;
   }
 
@@ -88,7 +88,10 @@ class ChainClusterBuilder {
       const NodeChain *chain_ptr = chain.get();
       // Transfer the ownership of chains to clusters.
       auto cluster = std::make_unique<ChainCluster>(std::move(chain));
-      chain_to_cluster_map_.emplace(chain_ptr, cluster.get());
+      chain_index_.emplace(chain_ptr, chains_.size());
+      chains_.push_back(chain_ptr);
+      cluster_parent_.push_back(cluster_parent_.size());
+      root_cluster_.push_back(cluster.get());
       auto cluster_id = cluster->id();
       bool inserted = clusters_.emplace(cluster_id, std::move(cluster)).second;
       CHECK(inserted) << "Duplicate cluster id: " << cluster_id << ".";
@@ -104,13 +107,13 @@ class ChainClusterBuilder {
   // [1] https://dl.acm.org/doi/10.5555/3049832.3049858
   std::vector<std::unique_ptr<const ChainCluster>> BuildClusters() &&;
 
-  // Finds the most frequent predecessor cluster of `chain` and merges it with
-  // `chain`'s cluster.
-  void MergeWithBestPredecessorCluster(const NodeChain &chain);
+  // Finds the most frequent predecessor cluster of the chain with index
+  // `chain_index` and merges it with that chain's cluster.
+  void MergeWithBestPredecessorCluster(int chain_index);
 
-  // Merges `right_cluster` into `left_cluster`. This call consumes
-  // `right_cluster`.
-  void MergeClusters(ChainCluster &left_cluster, ChainCluster right_cluster);
+  // Merges the cluster rooted at `right_root` into the cluster rooted at
+  // `left_root`. The right cluster is consumed by this call.
+  void MergeClusters(int left_root, int right_root);
 
  private:
   devtools_crosstool_autofdo::PropellerCodeLayoutParameters code_layout_params_;
@@ -118,10 +121,61 @@ class ChainClusterBuilder {
   // All clusters currently in process.
   absl::flat_hash_map<uint64_t, std::unique_ptr<const ChainCluster>> clusters_;
 
-  // This maps every chain to its containing cluster.
-  absl::flat_hash_map<const NodeChain *, ChainCluster *> chain_to_cluster_map_;
+  // Returns the union-find root of the chain with index `chain_index`. Chains
+  // with the same root are in the same cluster.
+  int FindClusterRoot(int chain_index);
+
+  // Returns the cluster containing the chain with index `chain_index`.
+  ChainCluster *GetCluster(int chain_index) {
+    return root_cluster_[FindClusterRoot(chain_index)];
+  }
+
+  // Computes `pred_chain_weights_` and returns the total incoming edge weight
+  // to each chain, excluding return and intra-chain edges.
+  std::vector<uint64_t> ComputeChainEdgeWeights();
+
+  // All chains, indexed by their position in the constructor's input.
+  std::vector<const NodeChain *> chains_;
+
+  // Maps every chain to its index in `chains_`.
+  absl::flat_hash_map<const NodeChain *, int> chain_index_;
+
+  // Union-find forest over chain indexes: the parent of each chain index, or
+  // the index itself for roots.
+  std::vector<int> cluster_parent_;
+
+  // The cluster represented by each union-find root. Entries for non-root
+  // indexes are stale.
+  std::vector<ChainCluster *> root_cluster_;
+
+  // For every chain, the total weight of its merge-eligible incoming edges
+  // from each other chain (by index), sorted by chain index. These edges don't
+  // change during clustering, so they are aggregated once up front.
+  std::vector<std::vector<std::pair<int, uint64_t>>> pred_chain_weights_;
 };
 
+// Page occupancy of the clusters reordered by `PackClustersIntoPages`.
+struct PagePackingStats {
+  // Number of pages spanned by the clusters.
+  int n_pages = 0;
+  // Total size of the clusters.
+  uint64_t size = 0;
+  // Number of clusters which fit in a page but straddle a page boundary.
+  int n_straddling_clusters = 0;
+};
+
+// Reorders `clusters`, which must be in decreasing order of their execution
+// density, so that the hottest code spans as few `page_size`-byte pages as
+// possible, assuming the clusters are laid out contiguously from a page
+// boundary. Each page is filled greedily with clusters that fit in its
+// remaining space, taken from the densest clusters not yet placed and
+// preferring the ones with the largest edge weight to the clusters already in
+// the page. When no such cluster fits, the densest remaining cluster is placed
+// across the page boundary.
+PagePackingStats PackClustersIntoPages(
+    uint64_t page_size,
+    std::vector<std::unique_ptr<const ChainCluster>> *clusters);
+
 }  // namespace devtools_crosstool_autofdo
 
 #endif  //  AUTOFDO_LLVM_PROPELLER_CHAIN_CLUSTER_BUILDER_H_
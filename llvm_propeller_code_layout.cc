@@ -1,6 +1,8 @@
 #include "llvm_propeller_code_layout.h"
 
+#include <algorithm>
 #include <iterator>
+#include <limits>
 #include <memory>
 #include <tuple>
 #include <utility>
@@ -9,94 +11,338 @@
 #include "llvm_propeller_cfg.h"
 #include "llvm_propeller_chain_cluster_builder.h"
 #include "llvm_propeller_node_chain_builder.h"
+#include "parallel_for.h"
 #include "third_party/abseil/absl/algorithm/container.h"
 #include "third_party/abseil/absl/container/flat_hash_map.h"
 #include "third_party/abseil/absl/functional/function_ref.h"
 
 namespace devtools_crosstool_autofdo {
+namespace {
+// CFGs with at least this many nodes keep their pending assemblies in a heap.
+// Smaller ones have few enough assemblies that a linear scan is cheaper.
+constexpr int kMinNodesForHeapQueue = 64;
+
+// Builds the chains of one CFG in intra-function mode.
+std::vector<std::unique_ptr<NodeChain>> BuildChainsForCfg(
+    const PropellerCodeLayoutScorer &scorer, ControlFlowGraph *cfg,
+    CodeLayoutStats &stats) {
+  if (cfg->nodes().size() >= kMinNodesForHeapQueue) {
+    return NodeChainBuilder::CreateNodeChainBuilder<
+               NodeChainAssemblyHeapQueue>(scorer, {cfg}, stats)
+        .BuildChains();
+  }
+  return NodeChainBuilder::CreateNodeChainBuilder<
+             NodeChainAssemblyIterativeQueue>(scorer, {cfg}, stats)
+      .BuildChains();
+}
+}  // namespace
 
 // Returns the intra-procedural ext-tsp scores for the given CFGs given a
 // function for getting the address of each CFG node.
 // This is called by ComputeOrigLayoutScores and ComputeOptLayoutScores below.
 CFGScoreMapTy CodeLayout::ComputeCfgScores(
+    const PropellerCodeLayoutScorer &scorer,
     absl::FunctionRef<uint64_t(const CFGNode *)> get_node_addr) {
-  CFGScoreMapTy score_map;
-  for (const ControlFlowGraph *cfg : cfgs_) {
-    uint64_t intra_score = 0;
+  // The score of every CFG only depends on the addresses of its nodes and of
+  // the sinks of its edges, so the CFGs are scored concurrently.
+  std::vector<CFGScore> scores(cfgs_.size());
+  auto score_cfg = [&](const ControlFlowGraph *cfg,
+                       PropellerCodeLayoutScorer::EdgeBatch &batch) {
+    batch.Clear();
     for (const auto &edge : cfg->intra_edges()) {
       if (edge->weight() == 0) continue;
       // Compute the distance between the end of src and beginning of sink.
       int64_t distance = static_cast<int64_t>(get_node_addr(edge->sink())) -
                          get_node_addr(edge->src()) - edge->src()->size();
-      intra_score += code_layout_scorer_.GetEdgeScore(*edge, distance);
+      batch.AddEdge(*edge, distance);
     }
-    uint64_t inter_out_score = 0;
+    uint64_t intra_score = scorer.GetEdgeScoreSum(batch);
+    batch.Clear();
     for (const auto &edge : cfg->inter_edges()) {
       if (edge->weight() == 0 || edge->IsReturn()) continue;
       int64_t distance = static_cast<int64_t>(get_node_addr(edge->sink())) -
                          get_node_addr(edge->src()) - edge->src()->size();
-      inter_out_score += code_layout_scorer_.GetEdgeScore(*edge, distance);
+      batch.AddEdge(*edge, distance);
     }
-    score_map.emplace(cfg, CFGScore({intra_score, inter_out_score}));
-  }
+    uint64_t inter_out_score = scorer.GetEdgeScoreSum(batch);
+    return CFGScore({intra_score, inter_out_score});
+  };
+  const int num_threads = std::max<int>(
+      std::min<int>(code_layout_scorer_.code_layout_params().layout_threads(),
+                    cfgs_.size()),
+      1);
+  std::vector<PropellerCodeLayoutScorer::EdgeBatch> batches(num_threads);
+  ParallelFor("ComputeCfgScores", num_threads, cfgs_.size(),
+              [&](int i, int thread) {
+                scores[i] = score_cfg(cfgs_[i], batches[thread]);
+              });
+
+  CFGScoreMapTy score_map;
+  score_map.reserve(cfgs_.size());
+  for (int i = 0; i < cfgs_.size(); ++i) score_map.emplace(cfgs_[i], scores[i]);
   return score_map;
 }
 
 // Returns the intra-procedural ext-tsp scores for the given CFGs under the
 // original layout.
 CFGScoreMapTy CodeLayout::ComputeOrigLayoutScores() {
-  return ComputeCfgScores([](const CFGNode *n) { return n->addr(); });
+  if (!code_layout_scorer_.code_layout_params().compute_original_scores()) {
+    CFGScoreMapTy score_map;
+    for (const ControlFlowGraph *cfg : cfgs_)
+      score_map.emplace(cfg, CFGScore());
+    return score_map;
+  }
+  return ComputeCfgScores(code_layout_scorer_,
+                          [](const CFGNode *n) { return n->addr(); });
 }
 
 // Returns the intra-procedural ext-tsp scores for the given CFGs under the new
 // layout, which is described by the 'clusters' parameter.
 CFGScoreMapTy CodeLayout::ComputeOptLayoutScores(
+    const PropellerCodeLayoutScorer &scorer,
     const std::vector<std::unique_ptr<const ChainCluster>> &clusters) {
-  // First compute the address of each basic block under the given layout.
+  // First compute the address of each basic block under the given layout,
+  // indexed by its symbol ordinal. The ordinals of the nodes are assigned
+  // consecutively, so this is a dense array rather than a hash map.
+  uint64_t min_ordinal = std::numeric_limits<uint64_t>::max();
+  uint64_t max_ordinal = 0;
+  for (const ControlFlowGraph *cfg : cfgs_) {
+    for (const auto &node : cfg->nodes()) {
+      min_ordinal = std::min(min_ordinal, node->symbol_ordinal());
+      max_ordinal = std::max(max_ordinal, node->symbol_ordinal());
+    }
+  }
+  std::vector<uint64_t> layout_addresses;
+  if (min_ordinal <= max_ordinal)
+    layout_addresses.resize(max_ordinal - min_ordinal + 1);
   uint64_t layout_addr = 0;
-  absl::flat_hash_map<const CFGNode *, uint64_t> layout_address_map;
   for (auto &cluster : clusters) {
     cluster->VisitEachNodeRef([&](const CFGNode &node) {
-      layout_address_map.emplace(&node, layout_addr);
+      layout_addresses[node.symbol_ordinal() - min_ordinal] = layout_addr;
       layout_addr += node.size();
     });
   }
 
-  return ComputeCfgScores([&layout_address_map](const CFGNode *n) {
-    return layout_address_map.at(n);
+  return ComputeCfgScores(scorer, [&](const CFGNode *n) {
+    return layout_addresses[n->symbol_ordinal() - min_ordinal];
   });
 }
 
-std::vector<FunctionClusterInfo> CodeLayout::OrderAll() {
-  // Build optimal node chains for each CFG.
+std::vector<std::unique_ptr<const NodeChain>>
+CodeLayout::BuildIntraFunctionChains(const PropellerCodeLayoutScorer &scorer,
+                                     int num_threads) {
+  num_threads = std::max<int>(std::min<int>(num_threads, cfgs_.size()), 1);
+  std::vector<std::vector<std::unique_ptr<NodeChain>>> chains_per_cfg(
+      cfgs_.size());
+  // Functions are independent here: call and return edges are not visited,
+  // so building the chains of one CFG only touches its own nodes. Hand out
+  // the largest CFGs first so that no thread is left with a big one at the
+  // end.
+  std::vector<int> cfg_order(cfgs_.size());
+  for (int i = 0; i < cfg_order.size(); ++i) cfg_order[i] = i;
+  if (num_threads > 1) {
+    absl::c_stable_sort(cfg_order, [this](int a, int b) {
+      return cfgs_[a]->nodes().size() > cfgs_[b]->nodes().size();
+    });
+  }
+  std::vector<CodeLayoutStats> stats_per_thread(num_threads);
+  ParallelFor("BuildIntraFunctionChains", num_threads, cfg_order.size(),
+              [&](int k, int thread) {
+                const int i = cfg_order[k];
+                chains_per_cfg[i] = BuildChainsForCfg(
+                    scorer, cfgs_[i], stats_per_thread[thread]);
+                if (status_provider_) status_provider_->AddFunctionsLaidOut(1);
+              });
+  for (const CodeLayoutStats &stats : stats_per_thread) stats_.Merge(stats);
+
   std::vector<std::unique_ptr<const NodeChain>> built_chains;
-  if (code_layout_scorer_.code_layout_params().inter_function_reordering()) {
-    absl::c_move(NodeChainBuilder::CreateNodeChainBuilder<
-                     NodeChainAssemblyBalancedTreeQueue>(code_layout_scorer_,
-                                                         cfgs_, stats_)
-                     .BuildChains(),
-                 std::back_inserter(built_chains));
-  } else {
-    for (auto *cfg : cfgs_) {
-      absl::c_move(NodeChainBuilder::CreateNodeChainBuilder<
-                       NodeChainAssemblyIterativeQueue>(code_layout_scorer_,
-                                                        {cfg}, stats_)
-                       .BuildChains(),
-                   std::back_inserter(built_chains));
+  for (auto &chains : chains_per_cfg) {
+    absl::c_move(chains, std::back_inserter(built_chains));
+  }
+  return built_chains;
+}
+
+std::vector<std::vector<ControlFlowGraph *>>
+CodeLayout::PartitionCfgsByHotEdges() const {
+  absl::flat_hash_map<const ControlFlowGraph *, int> cfg_index;
+  cfg_index.reserve(cfgs_.size());
+  for (int i = 0; i < cfgs_.size(); ++i) cfg_index.emplace(cfgs_[i], i);
+
+  // Union-find over the indexes of `cfgs_`, joining the CFGs connected by the
+  // inter-procedural edges which NodeChainBuilder visits.
+  std::vector<int> parent(cfgs_.size());
+  for (int i = 0; i < parent.size(); ++i) parent[i] = i;
+  auto find = [&parent](int i) {
+    while (parent[i] != i) i = parent[i] = parent[parent[i]];
+    return i;
+  };
+  for (int i = 0; i < cfgs_.size(); ++i) {
+    for (const std::unique_ptr<CFGEdge> &edge : cfgs_[i]->inter_edges()) {
+      if (edge->weight() == 0 || edge->IsReturn()) continue;
+      auto it = cfg_index.find(edge->sink()->cfg());
+      if (it == cfg_index.end()) continue;
+      const int a = find(i), b = find(it->second);
+      if (a != b) parent[std::max(a, b)] = std::min(a, b);
     }
   }
 
-  LOG(INFO) << stats_.DebugString();
+  // Components are ordered by their first CFG and keep the order of `cfgs_`.
+  // NodeChainBuilder lays out a single CFG like an intra-function layout, so
+  // all single-CFG components go together in one partition, which is merged
+  // into the last partition if it is still left with one CFG.
+  std::vector<std::vector<ControlFlowGraph *>> partitions;
+  absl::flat_hash_map<int, int> partition_of_root;
+  std::vector<ControlFlowGraph *> isolated_cfgs;
+  std::vector<int> component_size(cfgs_.size(), 0);
+  for (int i = 0; i < cfgs_.size(); ++i) ++component_size[find(i)];
+  for (int i = 0; i < cfgs_.size(); ++i) {
+    const int root = find(i);
+    if (component_size[root] == 1) {
+      isolated_cfgs.push_back(cfgs_[i]);
+      continue;
+    }
+    auto [it, inserted] =
+        partition_of_root.try_emplace(root, partitions.size());
+    if (inserted) partitions.emplace_back();
+    partitions[it->second].push_back(cfgs_[i]);
+  }
+  if (isolated_cfgs.size() == 1 && !partitions.empty()) {
+    partitions.back().push_back(isolated_cfgs.front());
+  } else if (!isolated_cfgs.empty()) {
+    partitions.push_back(std::move(isolated_cfgs));
+  }
+  return partitions;
+}
+
+std::vector<std::unique_ptr<const NodeChain>>
+CodeLayout::BuildInterFunctionChains(const PropellerCodeLayoutScorer &scorer,
+                                     int num_threads) {
+  std::vector<std::vector<ControlFlowGraph *>> partitions =
+      num_threads <= 1 ? std::vector<std::vector<ControlFlowGraph *>>{cfgs_}
+                       : PartitionCfgsByHotEdges();
+  num_threads =
+      std::max<int>(std::min<int>(num_threads, partitions.size()), 1);
+  std::vector<std::vector<std::unique_ptr<NodeChain>>> chains_per_partition(
+      partitions.size());
+  // Chains are only merged along the edges visited by NodeChainBuilder, so
+  // the partitions are laid out independently. The largest partitions are
+  // handed out first.
+  std::vector<int> partition_order(partitions.size());
+  for (int i = 0; i < partition_order.size(); ++i) partition_order[i] = i;
+  absl::c_stable_sort(partition_order, [&partitions](int a, int b) {
+    return partitions[a].size() > partitions[b].size();
+  });
+  std::vector<CodeLayoutStats> stats_per_thread(num_threads);
+  ParallelFor(
+      "BuildInterFunctionChains", num_threads, partition_order.size(),
+      [&](int k, int thread) {
+        const std::vector<ControlFlowGraph *> &cfgs =
+            partitions[partition_order[k]];
+        chains_per_partition[partition_order[k]] =
+            NodeChainBuilder::CreateNodeChainBuilder<
+                NodeChainAssemblyBalancedTreeQueue>(scorer, cfgs,
+                                                    stats_per_thread[thread])
+                .BuildChains();
+        if (status_provider_)
+          status_provider_->AddFunctionsLaidOut(cfgs.size());
+      });
+  for (const CodeLayoutStats &stats : stats_per_thread) stats_.Merge(stats);
+
+  std::vector<std::unique_ptr<const NodeChain>> built_chains;
+  for (auto &chains : chains_per_partition) {
+    absl::c_move(chains, std::back_inserter(built_chains));
+  }
+  return built_chains;
+}
+
+std::vector<std::unique_ptr<const ChainCluster>> CodeLayout::BuildClusters(
+    const PropellerCodeLayoutScorer &scorer) {
+  // Build optimal node chains for each CFG.
+  std::vector<std::unique_ptr<const NodeChain>> built_chains;
+  if (scorer.code_layout_params().inter_function_reordering()) {
+    built_chains = BuildInterFunctionChains(
+        scorer, scorer.code_layout_params().layout_threads());
+  } else {
+    built_chains = BuildIntraFunctionChains(
+        scorer, scorer.code_layout_params().layout_threads());
+  }
 
   // Further cluster the constructed chains to get the global order of all
   // nodes.
-  const std::vector<std::unique_ptr<const ChainCluster>> clusters =
-      ChainClusterBuilder(code_layout_scorer_.code_layout_params(),
-                          std::move(built_chains))
+  std::vector<std::unique_ptr<const ChainCluster>> clusters =
+      ChainClusterBuilder(scorer.code_layout_params(), std::move(built_chains))
           .BuildClusters();
 
+  const uint64_t page_size = scorer.code_layout_params().hot_text_page_size();
+  if (page_size != 0) {
+    const PagePackingStats page_stats =
+        PackClustersIntoPages(page_size, &clusters);
+    stats_.n_hot_text_pages += page_stats.n_pages;
+    stats_.hot_text_page_capacity += page_stats.n_pages * page_size;
+    stats_.hot_text_size += page_stats.size;
+    stats_.n_page_straddling_clusters += page_stats.n_straddling_clusters;
+  }
+
+  LOG(INFO) << stats_.DebugString();
+  return clusters;
+}
+
+void CodeLayout::ClearNodeBundles() {
+  for (ControlFlowGraph *cfg : cfgs_) {
+    for (const std::unique_ptr<CFGNode> &node : cfg->nodes())
+      node->clear_bundle();
+  }
+}
+
+std::vector<FunctionClusterInfo> CodeLayout::OrderAll() {
+  const std::vector<std::unique_ptr<const ChainCluster>> clusters =
+      BuildClusters(code_layout_scorer_);
+  return GetFunctionClusterInfo(
+      clusters, ComputeOptLayoutScores(code_layout_scorer_, clusters));
+}
+
+std::vector<FunctionClusterInfo> CodeLayout::OrderAllWithSweep(
+    const std::vector<PropellerCodeLayoutParameters> &sweep_params,
+    std::vector<CodeLayoutSweepResult> *sweep_results) {
+  if (sweep_params.empty()) return OrderAll();
+  std::vector<std::unique_ptr<const ChainCluster>> best_clusters;
+  CFGScoreMapTy best_score_map;
+  uint64_t best_total_score = 0;
+  for (int i = 0; i < sweep_params.size(); ++i) {
+    const PropellerCodeLayoutScorer scorer(sweep_params[i]);
+    // Nodes still point to the bundles of the previous configuration, which
+    // are alive in `best_clusters` or already destroyed.
+    ClearNodeBundles();
+    std::vector<std::unique_ptr<const ChainCluster>> clusters =
+        BuildClusters(scorer);
+    CodeLayoutSweepResult result = {.code_layout_params = sweep_params[i]};
+    for (const auto &[unused, cfg_score] :
+         ComputeOptLayoutScores(scorer, clusters)) {
+      result.score += cfg_score;
+    }
+    CFGScoreMapTy reference_score_map =
+        ComputeOptLayoutScores(code_layout_scorer_, clusters);
+    for (const auto &[unused, cfg_score] : reference_score_map)
+      result.reference_score += cfg_score;
+    const uint64_t total_score = result.reference_score.intra_score +
+                                 result.reference_score.inter_out_score;
+    LOG(INFO) << "Layout sweep configuration " << i << ": score "
+              << result.score.intra_score + result.score.inter_out_score
+              << ", reference score " << total_score << ".";
+    if (i == 0 || total_score > best_total_score) {
+      best_total_score = total_score;
+      best_clusters = std::move(clusters);
+      best_score_map = std::move(reference_score_map);
+    }
+    if (sweep_results != nullptr) sweep_results->push_back(std::move(result));
+  }
+  return GetFunctionClusterInfo(best_clusters, best_score_map);
+}
+
+std::vector<FunctionClusterInfo> CodeLayout::GetFunctionClusterInfo(
+    const std::vector<std::unique_ptr<const ChainCluster>> &clusters,
+    const CFGScoreMapTy &opt_score_map) {
   CFGScoreMapTy orig_score_map = ComputeOrigLayoutScores();
-  CFGScoreMapTy opt_score_map = ComputeOptLayoutScores(clusters);
 
   // Mapping from the function ordinal to the layout cluster info.
   absl::flat_hash_map<uint64_t, FunctionClusterInfo> function_cluster_info_map;
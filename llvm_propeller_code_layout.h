@@ -12,8 +12,10 @@
 #include "llvm_propeller_chain_cluster_builder.h"
 #include "llvm_propeller_code_layout_scorer.h"
 #include "llvm_propeller_node_chain_assembly.h"
+#include "status_provider.h"
 #include "third_party/abseil/absl/container/flat_hash_map.h"
 #include "third_party/abseil/absl/strings/str_cat.h"
+#include "third_party/abseil/absl/strings/str_format.h"
 #include "third_party/abseil/absl/strings/str_join.h"
 
 namespace devtools_crosstool_autofdo {
@@ -27,6 +29,45 @@ struct CodeLayoutStats {
   int n_single_node_chains = 0;
   // Number of initial multi-node chains.
   int n_multi_node_chains = 0;
+  // Number of initial chains without edges to other chains, which were kept
+  // out of chain merging.
+  int n_isolated_chains = 0;
+  // Number of chain building runs which exhausted `chain_split_budget` and
+  // finished without splitting.
+  int n_split_budget_exhausted = 0;
+  // Number of chain pairs whose assemblies were not built because their score
+  // gain bound is below `chain_assembly_pruning_fraction` of the best score
+  // gain, and number of chain pairs whose splitting assemblies were not
+  // evaluated because their score gain bound is below the gain of merging
+  // them without splitting.
+  int n_pruned_assemblies = 0;
+  int n_pruned_split_searches = 0;
+  // Page occupancy of the hot clusters when `hot_text_page_size` is set:
+  // number of pages spanned, their total capacity, the total size of the
+  // clusters and the number of clusters straddling a page boundary although
+  // they fit in a page.
+  int n_hot_text_pages = 0;
+  uint64_t hot_text_page_capacity = 0;
+  uint64_t hot_text_size = 0;
+  int n_page_straddling_clusters = 0;
+
+  // Adds the stats in `other` to this.
+  void Merge(const CodeLayoutStats &other) {
+    for (const auto &[merge_order, n_assemblies] :
+         other.n_assemblies_by_merge_order) {
+      n_assemblies_by_merge_order[merge_order] += n_assemblies;
+    }
+    n_single_node_chains += other.n_single_node_chains;
+    n_multi_node_chains += other.n_multi_node_chains;
+    n_isolated_chains += other.n_isolated_chains;
+    n_split_budget_exhausted += other.n_split_budget_exhausted;
+    n_pruned_assemblies += other.n_pruned_assemblies;
+    n_pruned_split_searches += other.n_pruned_split_searches;
+    n_hot_text_pages += other.n_hot_text_pages;
+    hot_text_page_capacity += other.hot_text_page_capacity;
+    hot_text_size += other.hot_text_size;
+    n_page_straddling_clusters += other.n_page_straddling_clusters;
+  }
 
   std::string DebugString() const {
     std::string result;
@@ -41,7 +82,24 @@ struct CodeLayoutStats {
         "\n");
     absl::StrAppend(&result, "Initial chains stats: single-node chains: [",
                     n_single_node_chains, "] multi-node chains: [",
-                    n_multi_node_chains, "]");
+                    n_multi_node_chains, "] isolated chains: [",
+                    n_isolated_chains, "]");
+    if (n_split_budget_exhausted != 0) {
+      absl::StrAppend(&result, "\nChain split budget exhausted: [",
+                      n_split_budget_exhausted, "]");
+    }
+    if (n_pruned_assemblies != 0 || n_pruned_split_searches != 0) {
+      absl::StrAppend(&result, "\nPruned assemblies: [", n_pruned_assemblies,
+                      "] pruned split searches: [", n_pruned_split_searches,
+                      "]");
+    }
+    if (n_hot_text_pages != 0) {
+      absl::StrAppend(
+          &result, "\nHot text pages: [", n_hot_text_pages, "] occupancy: [",
+          absl::StrFormat("%.2f%%", 100.0 * hot_text_size /
+                                        hot_text_page_capacity),
+          "] page-straddling clusters: [", n_page_straddling_clusters, "]");
+    }
     return result;
   }
 };
@@ -52,6 +110,12 @@ struct CFGScore {
   // Total score across all inter-function edges for a CFG. We consider
   // only the outgoing edges to prevent from double counting.
   uint64_t inter_out_score = 0;
+
+  CFGScore &operator+=(const CFGScore &other) {
+    intra_score += other.intra_score;
+    inter_out_score += other.inter_out_score;
+    return *this;
+  }
 };
 
 using CFGScoreMapTy = absl::flat_hash_map<const ControlFlowGraph *, CFGScore>;
@@ -89,26 +153,82 @@ struct FunctionClusterInfo {
   unsigned cold_cluster_layout_index = 0;
 };
 
+// Result of laying out the code with one configuration of a parameter sweep.
+struct CodeLayoutSweepResult {
+  PropellerCodeLayoutParameters code_layout_params;
+  // Total score of the layout under its own `code_layout_params`.
+  CFGScore score = {};
+  // Total score of the layout under the parameters the CodeLayout was
+  // constructed with. Unlike `score`, this is comparable across results.
+  CFGScore reference_score = {};
+};
+
 class CodeLayout {
  public:
+  // If non-null, `status_provider` counts the functions laid out, including
+  // those of every sweep configuration. It must outlive this CodeLayout.
   explicit CodeLayout(const PropellerCodeLayoutParameters &code_layout_params,
-                      const std::vector<ControlFlowGraph *> &cfgs)
-      : code_layout_scorer_(code_layout_params), cfgs_(cfgs) {}
+                      const std::vector<ControlFlowGraph *> &cfgs,
+                      DefaultStatusProvider *status_provider = nullptr)
+      : code_layout_scorer_(code_layout_params),
+        cfgs_(cfgs),
+        status_provider_(status_provider) {}
 
   // This performs code layout on all hot cfgs in the prop_prof_writer instance
   // and returns the global order information for all function.
   std::vector<FunctionClusterInfo> OrderAll();
 
+  // Like OrderAll, but computes one layout for every element of `sweep_params`
+  // on the same cfgs and returns the one with the highest total score under
+  // the parameters this CodeLayout was constructed with. The configurations
+  // run one after another, each using its own `layout_threads`. If non-null,
+  // `sweep_results` receives the scores of every configuration, in the order
+  // of `sweep_params`.
+  std::vector<FunctionClusterInfo> OrderAllWithSweep(
+      const std::vector<PropellerCodeLayoutParameters> &sweep_params,
+      std::vector<CodeLayoutSweepResult> *sweep_results = nullptr);
+
+  // Returns the stats accumulated by the layouts computed so far.
+  const CodeLayoutStats &stats() const { return stats_; }
+
  private:
   const PropellerCodeLayoutScorer code_layout_scorer_;
   // CFGs targeted for code layout.
   const std::vector<ControlFlowGraph *> cfgs_;
+  DefaultStatusProvider *const status_provider_;
   CodeLayoutStats stats_;
 
+  // Builds the chains of all CFGs in `cfgs_` and clusters them, using
+  // `scorer` and its parameters.
+  std::vector<std::unique_ptr<const ChainCluster>> BuildClusters(
+      const PropellerCodeLayoutScorer &scorer);
+
+  // Builds the chains of every CFG in `cfgs_` separately, using `num_threads`
+  // threads. Returns the chains in the order of `cfgs_`.
+  std::vector<std::unique_ptr<const NodeChain>> BuildIntraFunctionChains(
+      const PropellerCodeLayoutScorer &scorer, int num_threads);
+
+  // Partitions `cfgs_` into the weakly connected components of their hot
+  // inter-procedural edges, with all single-CFG components in one partition.
+  // Every partition has more than one CFG unless `cfgs_` has a single CFG.
+  std::vector<std::vector<ControlFlowGraph *>> PartitionCfgsByHotEdges() const;
+
+  // Builds the inter-procedural chains of `cfgs_`. With more than one thread,
+  // the partitions of `PartitionCfgsByHotEdges` are laid out concurrently
+  // using `num_threads` threads.
+  std::vector<std::unique_ptr<const NodeChain>> BuildInterFunctionChains(
+      const PropellerCodeLayoutScorer &scorer, int num_threads);
+
+  // Detaches all nodes in `cfgs_` from the bundles of the last layout, so the
+  // cfgs can be laid out again.
+  void ClearNodeBundles();
+
   // Returns the intra-procedural ext-tsp scores for the given CFGs given a
   // function for getting the address of each CFG node.
   // This is called by ComputeOrigLayoutScores and ComputeOptLayoutScores below.
-  CFGScoreMapTy ComputeCfgScores(absl::FunctionRef<uint64_t(const CFGNode *)>);
+  CFGScoreMapTy ComputeCfgScores(
+      const PropellerCodeLayoutScorer &scorer,
+      absl::FunctionRef<uint64_t(const CFGNode *)>);
 
   // Returns the intra-procedural ext-tsp scores for the given CFGs under the
   // original layout.
@@ -117,7 +237,14 @@ class CodeLayout {
   // Returns the intra-procedural ext-tsp scores for the given CFGs under the
   // new layout, which is described by the 'clusters' parameter.
   CFGScoreMapTy ComputeOptLayoutScores(
+      const PropellerCodeLayoutScorer &scorer,
       const std::vector<std::unique_ptr<const ChainCluster>> &clusters);
+
+  // Returns the layout information of every function, given the global layout
+  // in `clusters` and its scores in `opt_score_map`.
+  std::vector<FunctionClusterInfo> GetFunctionClusterInfo(
+      const std::vector<std::unique_ptr<const ChainCluster>> &clusters,
+      const CFGScoreMapTy &opt_score_map);
 };
 
 }  // namespace devtools_crosstool_autofdo
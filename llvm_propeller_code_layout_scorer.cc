@@ -1,6 +1,7 @@
 #include "llvm_propeller_code_layout_scorer.h"
 
 #include <algorithm>
+#include <cstdint>
 
 #include "llvm_propeller_options.pb.h"
 
@@ -89,4 +90,59 @@ int64_t PropellerCodeLayoutScorer::GetEdgeScore(
   return 0;
 }
 
+int64_t PropellerCodeLayoutScorer::GetMaxEdgeScore(const CFGEdge &edge) const {
+  return edge.weight() *
+         std::max({static_cast<uint64_t>(scaled_fallthrough_weight_),
+                   static_cast<uint64_t>(scaled_forward_jump_weight_) *
+                       code_layout_params_.forward_jump_distance(),
+                   static_cast<uint64_t>(scaled_backward_jump_weight_) *
+                       code_layout_params_.backward_jump_distance()});
+}
+
+void PropellerCodeLayoutScorer::EdgeBatch::AddEdge(const CFGEdge &edge,
+                                                   int64_t src_sink_distance) {
+  // Apply the callsite approximations of `GetEdgeScore` up front.
+  if (edge.IsCall()) src_sink_distance += edge.src()->size() / 2;
+  if (edge.IsReturn()) src_sink_distance += edge.sink()->size() / 2;
+  weights_.push_back(edge.weight());
+  distances_.push_back(src_sink_distance);
+  fallthroughs_.push_back(edge.IsFallthrough());
+}
+
+// Computes the same scores as `GetEdgeScore`, with every case evaluated as a
+// select. The three cases are mutually exclusive, so their per-unit scores can
+// be combined with a bitwise or.
+int64_t PropellerCodeLayoutScorer::GetEdgeScoreSum(
+    const EdgeBatch &batch) const {
+  const uint64_t forward_jump_distance =
+      code_layout_params_.forward_jump_distance();
+  const uint64_t backward_jump_distance =
+      code_layout_params_.backward_jump_distance();
+  const uint64_t *weights = batch.weights_.data();
+  const int64_t *distances = batch.distances_.data();
+  const uint8_t *fallthroughs = batch.fallthroughs_.data();
+  uint64_t score = 0;
+  for (int i = 0, n = batch.size(); i != n; ++i) {
+    const int64_t distance = distances[i];
+    const uint64_t absolute_distance =
+        static_cast<uint64_t>(distance < 0 ? -distance : distance);
+    const uint64_t fallthrough_score =
+        (distance == 0) & (fallthroughs[i] != 0) ? scaled_fallthrough_weight_
+                                                 : 0;
+    const uint64_t forward_jump_score =
+        (distance > 0) & (absolute_distance < forward_jump_distance)
+            ? scaled_forward_jump_weight_ *
+                  (forward_jump_distance - absolute_distance)
+            : 0;
+    const uint64_t backward_jump_score =
+        (distance < 0) & (absolute_distance < backward_jump_distance)
+            ? scaled_backward_jump_weight_ *
+                  (backward_jump_distance - absolute_distance)
+            : 0;
+    score += weights[i] *
+             (fallthrough_score | forward_jump_score | backward_jump_score);
+  }
+  return score;
+}
+
 }  // namespace devtools_crosstool_autofdo
@@ -1,6 +1,9 @@
 #ifndef AUTOFDO_LLVM_PROPELLER_CODE_LAYOUT_SCORER_H_
 #define AUTOFDO_LLVM_PROPELLER_CODE_LAYOUT_SCORER_H_
 
+#include <cstdint>
+#include <vector>
+
 #include "llvm_propeller_cfg.h"
 #include "llvm_propeller_options.pb.h"
 
@@ -12,11 +15,46 @@ namespace devtools_crosstool_autofdo {
 // specified code layout parameters.
 class PropellerCodeLayoutScorer {
  public:
+  // A batch of edges and their source-to-sink distances, to be scored together
+  // by `GetEdgeScoreSum`. The edges are kept in structure-of-arrays form so the
+  // scoring loop has no pointer chasing or per-edge branches and can be
+  // vectorized by the compiler.
+  class EdgeBatch {
+   public:
+    // Adds `edge` with the given source-to-sink distance to the batch.
+    void AddEdge(const CFGEdge &edge, int64_t src_sink_distance);
+
+    void Clear() {
+      weights_.clear();
+      distances_.clear();
+      fallthroughs_.clear();
+    }
+
+    int size() const { return weights_.size(); }
+
+   private:
+    friend class PropellerCodeLayoutScorer;
+
+    std::vector<uint64_t> weights_;
+    // Source-to-sink distances, adjusted for calls and returns as in
+    // `GetEdgeScore`.
+    std::vector<int64_t> distances_;
+    // Whether each edge is a fallthrough (0 or 1).
+    std::vector<uint8_t> fallthroughs_;
+  };
+
   explicit PropellerCodeLayoutScorer(
       const PropellerCodeLayoutParameters &params);
 
   int64_t GetEdgeScore(const CFGEdge &edge, int64_t src_sink_distance) const;
 
+  // Returns an upper bound of `GetEdgeScore(edge, d)` over all distances `d`.
+  int64_t GetMaxEdgeScore(const CFGEdge &edge) const;
+
+  // Returns the total score of the edges in `batch`. This is equal to the sum
+  // of `GetEdgeScore` over the edges of the batch.
+  int64_t GetEdgeScoreSum(const EdgeBatch &batch) const;
+
   const PropellerCodeLayoutParameters &code_layout_params() const {
     return code_layout_params_;
   }
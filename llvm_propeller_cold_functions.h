@@ -0,0 +1,84 @@
+#ifndef AUTOFDO_LLVM_PROPELLER_COLD_FUNCTIONS_H_
+#define AUTOFDO_LLVM_PROPELLER_COLD_FUNCTIONS_H_
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+#include "memory_usage.h"
+#include "third_party/abseil/absl/types/span.h"
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Object/ELFTypes.h"
+
+namespace devtools_crosstool_autofdo {
+
+// The functions of a whole program which get no CFG because they are not
+// sampled, packed for their original layout: the names of every function, the
+// symbol ordinal of its first basic block and the sizes of its basic blocks in
+// their original order. The basic blocks of all functions share one array, so
+// a function takes a few words plus 4 bytes per basic block instead of a
+// ControlFlowGraph with a CFGNode per basic block.
+class ColdFunctions {
+ public:
+  // Adds the function with `names` whose basic blocks are `bb_entries`, with
+  // consecutive symbol ordinals from `first_ordinal`.
+  void Add(llvm::ArrayRef<llvm::StringRef> names, uint64_t first_ordinal,
+           llvm::ArrayRef<llvm::object::BBAddrMap::BBEntry> bb_entries) {
+    names_.insert(names_.end(), names.begin(), names.end());
+    name_ends_.push_back(names_.size());
+    first_ordinals_.push_back(first_ordinal);
+    for (const llvm::object::BBAddrMap::BBEntry &bb_entry : bb_entries) {
+      if (bb_entry.IsEHPad) landing_pads_.push_back(bb_sizes_.size());
+      bb_sizes_.push_back(bb_entry.Size);
+    }
+    bb_ends_.push_back(bb_sizes_.size());
+  }
+
+  int size() const { return first_ordinals_.size(); }
+  bool empty() const { return first_ordinals_.empty(); }
+
+  // The names of function `i`, the primary name first.
+  llvm::ArrayRef<llvm::StringRef> names(int i) const {
+    const int begin = i == 0 ? 0 : name_ends_[i - 1];
+    return llvm::ArrayRef<llvm::StringRef>(names_).slice(
+        begin, name_ends_[i] - begin);
+  }
+
+  uint64_t first_ordinal(int i) const { return first_ordinals_[i]; }
+
+  // The sizes of the basic blocks of function `i`, by bb_index.
+  absl::Span<const uint32_t> bb_sizes(int i) const {
+    const int64_t begin = bb_begin(i);
+    return absl::MakeConstSpan(bb_sizes_).subspan(begin, bb_ends_[i] - begin);
+  }
+
+  bool is_landing_pad(int i, int bb_index) const {
+    return std::binary_search(landing_pads_.begin(), landing_pads_.end(),
+                              bb_begin(i) + bb_index);
+  }
+
+  // Returns the estimated heap memory held by the functions.
+  uint64_t MemoryUsage() const {
+    return VectorBytes(names_) + VectorBytes(name_ends_) +
+           VectorBytes(first_ordinals_) + VectorBytes(bb_sizes_) +
+           VectorBytes(bb_ends_) + VectorBytes(landing_pads_);
+  }
+
+ private:
+  int64_t bb_begin(int i) const { return i == 0 ? 0 : bb_ends_[i - 1]; }
+
+  // The names of all functions, and the end of the names of every function.
+  std::vector<llvm::StringRef> names_;
+  std::vector<int> name_ends_;
+  std::vector<uint64_t> first_ordinals_;
+  // The basic block sizes of all functions, the end of the basic blocks of
+  // every function, and the sorted positions of the landing pads.
+  std::vector<uint32_t> bb_sizes_;
+  std::vector<int64_t> bb_ends_;
+  std::vector<int64_t> landing_pads_;
+};
+
+}  // namespace devtools_crosstool_autofdo
+
+#endif  // AUTOFDO_LLVM_PROPELLER_COLD_FUNCTIONS_H_
@@ -6,14 +6,36 @@
 #include <utility>
 
 #include "llvm_propeller_perf_data_provider.h"
+#include "perf_data_decompressor.h"
 #include "third_party/abseil/absl/status/status.h"
 #include "third_party/abseil/absl/status/statusor.h"
 #include "third_party/abseil/absl/strings/str_cat.h"
 #include "third_party/abseil/absl/strings/str_format.h"
+#include "third_party/abseil/absl/strings/string_view.h"
 #include "llvm/Support/ErrorOr.h"
+#include "llvm/ADT/StringRef.h"
 #include "llvm/Support/MemoryBuffer.h"
 
 namespace devtools_crosstool_autofdo {
+namespace {
+// A memory buffer owning its contents, which were decompressed into a string.
+class StringMemoryBuffer : public llvm::MemoryBuffer {
+ public:
+  StringMemoryBuffer(std::string contents, std::string name)
+      : contents_(std::move(contents)), name_(std::move(name)) {
+    init(contents_.data(), contents_.data() + contents_.size(),
+         /*RequiresNullTerminator=*/false);
+  }
+
+  llvm::StringRef getBufferIdentifier() const override { return name_; }
+
+  BufferKind getBufferKind() const override { return MemoryBuffer_Malloc; }
+
+ private:
+  std::string contents_;
+  std::string name_;
+};
+}  // namespace
 
 absl::StatusOr<std::optional<PerfDataProvider::BufferHandle>>
 FilePerfDataProvider::GetNext() {
@@ -29,6 +51,26 @@ FilePerfDataProvider::GetNext() {
                      perf_file_content.getError().message()));
   }
 
+  // Compressed files are decompressed from the mapped file into memory.
+  const CompressionFormat format =
+      DetectCompressionFormat(absl::string_view(
+          (*perf_file_content)->getBufferStart(),
+          (*perf_file_content)->getBufferSize()));
+  if (format != CompressionFormat::kNone) {
+    absl::StatusOr<std::string> contents = DecompressData(
+        absl::string_view((*perf_file_content)->getBufferStart(),
+                          (*perf_file_content)->getBufferSize()),
+        format);
+    if (!contents.ok()) {
+      return absl::Status(contents.status().code(),
+                          absl::StrCat("Error decompressing ",
+                                       file_names_[index_], ": ",
+                                       contents.status().message()));
+    }
+    perf_file_content = std::make_unique<StringMemoryBuffer>(
+        *std::move(contents), file_names_[index_]);
+  }
+
   std::string description = absl::StrFormat(
       "[%d/%d] %s", index_ + 1, file_names_.size(), file_names_[index_]);
   ++index_;
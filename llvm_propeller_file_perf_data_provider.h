@@ -16,6 +16,7 @@
 namespace devtools_crosstool_autofdo {
 
 // A perf.data provider reading (by mmapping if possible) them from files.
+// Files compressed with gzip or zstd are decompressed into memory.
 class FilePerfDataProvider : public PerfDataProvider {
  public:
   explicit FilePerfDataProvider(std::vector<std::string> file_names)
@@ -0,0 +1,156 @@
+#ifndef AUTOFDO_LLVM_PROPELLER_FUNCTION_INDEX_SET_H_
+#define AUTOFDO_LLVM_PROPELLER_FUNCTION_INDEX_SET_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <utility>
+#include <vector>
+
+#include "base/logging.h"
+#include "third_party/abseil/absl/numeric/bits.h"
+
+namespace devtools_crosstool_autofdo {
+
+// A set of function indexes in [0, universe_size()), stored as a dense bitmap.
+// Iteration visits the indexes in increasing order.
+class FunctionIndexSet {
+ public:
+  static constexpr int kBitsPerWord = 64;
+
+  class const_iterator {
+   public:
+    using iterator_category = std::forward_iterator_tag;
+    using value_type = int;
+    using difference_type = std::ptrdiff_t;
+    using pointer = const int *;
+    using reference = int;
+
+    int operator*() const { return index_; }
+    const_iterator &operator++() {
+      index_ = set_->FindNext(index_ + 1);
+      return *this;
+    }
+    const_iterator operator++(int) {
+      const_iterator it = *this;
+      ++*this;
+      return it;
+    }
+    bool operator==(const const_iterator &other) const {
+      return index_ == other.index_;
+    }
+    bool operator!=(const const_iterator &other) const {
+      return !(*this == other);
+    }
+
+   private:
+    friend class FunctionIndexSet;
+    const_iterator(const FunctionIndexSet *set, int index)
+        : set_(set), index_(index) {}
+
+    const FunctionIndexSet *set_;
+    int index_;
+  };
+  using iterator = const_iterator;
+  using value_type = int;
+
+  FunctionIndexSet() = default;
+
+  // Creates a set over [0, `universe_size`) which contains no index or, if
+  // `all` is true, every index.
+  explicit FunctionIndexSet(int universe_size, bool all = false)
+      : universe_size_(universe_size),
+        words_((universe_size + kBitsPerWord - 1) / kBitsPerWord,
+               all ? ~uint64_t{0} : 0) {
+    if (all) ClearBitsBeyondUniverse();
+  }
+
+  // Creates a set over [0, `universe_size`) from its bitmap: index `i` is in
+  // the set iff bit `i % kBitsPerWord` of `words[i / kBitsPerWord]` is set.
+  FunctionIndexSet(int universe_size, std::vector<uint64_t> words)
+      : universe_size_(universe_size), words_(std::move(words)) {
+    CHECK_EQ(words_.size(),
+             (universe_size + kBitsPerWord - 1) / kBitsPerWord);
+    ClearBitsBeyondUniverse();
+  }
+
+  int universe_size() const { return universe_size_; }
+
+  bool contains(int index) const {
+    return index >= 0 && index < universe_size_ &&
+           (words_[index / kBitsPerWord] & Bit(index)) != 0;
+  }
+  void insert(int index) {
+    DCHECK(index >= 0 && index < universe_size_) << index;
+    words_[index / kBitsPerWord] |= Bit(index);
+  }
+  void erase(int index) {
+    DCHECK(index >= 0 && index < universe_size_) << index;
+    words_[index / kBitsPerWord] &= ~Bit(index);
+  }
+
+  // Returns the number of indexes in the set.
+  int size() const {
+    int count = 0;
+    for (uint64_t word : words_) count += absl::popcount(word);
+    return count;
+  }
+  bool empty() const {
+    for (uint64_t word : words_)
+      if (word != 0) return false;
+    return true;
+  }
+
+  const_iterator begin() const { return const_iterator(this, FindNext(0)); }
+  const_iterator end() const { return const_iterator(this, universe_size_); }
+
+  // Removes every index for which `pred(index)` returns true. `pred` is called
+  // once for every index in the set, in increasing order.
+  template <typename Pred>
+  void EraseIf(Pred pred) {
+    for (int w = 0; w != words_.size(); ++w) {
+      uint64_t erased = 0;
+      for (uint64_t rest = words_[w]; rest != 0; rest &= rest - 1) {
+        const int bit = absl::countr_zero(rest);
+        if (pred(w * kBitsPerWord + bit)) erased |= uint64_t{1} << bit;
+      }
+      words_[w] &= ~erased;
+    }
+  }
+
+  bool operator==(const FunctionIndexSet &other) const {
+    return universe_size_ == other.universe_size_ && words_ == other.words_;
+  }
+  bool operator!=(const FunctionIndexSet &other) const {
+    return !(*this == other);
+  }
+
+ private:
+  static uint64_t Bit(int index) {
+    return uint64_t{1} << (index % kBitsPerWord);
+  }
+
+  // Returns the smallest index in the set which is not less than `from`, or
+  // `universe_size_` if there is none.
+  int FindNext(int from) const {
+    if (from >= universe_size_) return universe_size_;
+    int w = from / kBitsPerWord;
+    uint64_t word = words_[w] & (~uint64_t{0} << (from % kBitsPerWord));
+    while (word == 0) {
+      if (++w == words_.size()) return universe_size_;
+      word = words_[w];
+    }
+    return w * kBitsPerWord + absl::countr_zero(word);
+  }
+
+  void ClearBitsBeyondUniverse() {
+    if (universe_size_ % kBitsPerWord != 0)
+      words_.back() &= ~(~uint64_t{0} << (universe_size_ % kBitsPerWord));
+  }
+
+  int universe_size_ = 0;
+  std::vector<uint64_t> words_;
+};
+
+}  // namespace devtools_crosstool_autofdo
+#endif  // AUTOFDO_LLVM_PROPELLER_FUNCTION_INDEX_SET_H_
@@ -1,37 +1,98 @@
-#include "llvm_propeller_abstract_whole_program_info.h"
-#include "llvm_propeller_protobuf.h"
-#include "third_party/abseil/absl/flags/flag.h"
-#include "third_party/abseil/absl/flags/parse.h"
-#include "third_party/abseil/absl/flags/usage.h"
 #if defined(HAVE_LLVM)
 
+#include <fstream>
 #include <memory>
+#include <string>
 
-#include "base/commandlineflags.h"
 #include "base/logging.h"
+#include "llvm_propeller_abstract_whole_program_info.h"
+#include "llvm_propeller_cfg.pb.h"
+#include "llvm_propeller_cfg_snapshot.h"
 #include "llvm_propeller_options.pb.h"
 #include "llvm_propeller_options_builder.h"
+#include "llvm_propeller_synthetic_workload.h"
 #include "llvm_propeller_whole_program_info.h"
+#include "sample_reader.h"
+#include "google/protobuf/io/zero_copy_stream_impl.h"
+#include "google/protobuf/text_format.h"
+#include "third_party/abseil/absl/flags/flag.h"
 #include "third_party/abseil/absl/flags/parse.h"
 #include "third_party/abseil/absl/flags/usage.h"
+#include "third_party/abseil/absl/status/status.h"
 
-DEFINE_string(binary, "a.out", "Binary file name");
-DEFINE_string(profile, "perf.data", "Input profile file name");
-DEFINE_string(propeller_protobuf_out, "",
-              "Instruct propeller to output a protobuf file which can reused "
-              "as testdata input for the code layout algorithm.");
-DEFINE_string(profiled_binary_name, "",
-              "Name specified to compare against perf mmap_events. Same as the "
-              "option in create_llvm_prof.");
-DEFINE_bool(ignore_build_id, false,
-            "Ignore build id, use file name to match data in perfdata file. "
-            "Same as the option in create_llvm_prof.");
+ABSL_FLAG(std::string, binary, "a.out", "Binary file name");
+ABSL_FLAG(std::string, profile, "perf.data", "Input profile file name");
+ABSL_FLAG(std::string, propeller_protobuf_out, "",
+          "Instruct propeller to output a text protobuf file which can be "
+          "reused as testdata input for the code layout algorithm.");
+ABSL_FLAG(std::string, cfg_snapshot_out, "",
+          "Output a binary cfg snapshot, as read with --cfg_snapshot_name, "
+          "which is much smaller and faster to read than "
+          "--propeller_protobuf_out for large programs.");
+ABSL_FLAG(std::string, profiled_binary_name, "",
+          "Name specified to compare against perf mmap_events. Same as the "
+          "option in create_llvm_prof.");
+ABSL_FLAG(bool, ignore_build_id, false,
+          "Ignore build id, use file name to match data in perfdata file. "
+          "Same as the option in create_llvm_prof.");
+ABSL_FLAG(int32_t, synthetic_functions, 0,
+          "If positive, synthesize a program with this many functions "
+          "instead of reading --binary and --profile.");
+ABSL_FLAG(int32_t, synthetic_blocks_per_function, 16,
+          "Average number of basic blocks of a synthetic function.");
+ABSL_FLAG(double, synthetic_edge_skew, 0.9,
+          "Fraction of the executions of a synthetic block which fall "
+          "through to the next block.");
+ABSL_FLAG(double, synthetic_function_skew, 1.0,
+          "Zipf exponent of the entry counts of the synthetic functions.");
+ABSL_FLAG(uint64_t, synthetic_entry_count, 1000000,
+          "Entry count of the hottest synthetic function.");
+ABSL_FLAG(int32_t, synthetic_inlining_depth, 3,
+          "Depth of the call chains of the synthetic program.");
+ABSL_FLAG(uint64_t, synthetic_seed, 1,
+          "Seed of the random choices of the synthetic program.");
+ABSL_FLAG(std::string, synthetic_samples_out, "",
+          "Output the LBR samples of the synthetic program in the text "
+          "sample format.");
 
+using ::devtools_crosstool_autofdo::AbstractPropellerWholeProgramInfo;
 using ::devtools_crosstool_autofdo::CfgCreationMode;
+using ::devtools_crosstool_autofdo::CreateCfgSnapshot;
+using ::devtools_crosstool_autofdo::GenerateSyntheticSamples;
 using ::devtools_crosstool_autofdo::PropellerOptions;
 using ::devtools_crosstool_autofdo::PropellerOptionsBuilder;
+using ::devtools_crosstool_autofdo::PropellerPb;
 using ::devtools_crosstool_autofdo::PropellerWholeProgramInfo;
-using ::devtools_crosstool_autofdo::PropProt;
+using ::devtools_crosstool_autofdo::SyntheticPropellerWholeProgramInfo;
+using ::devtools_crosstool_autofdo::SyntheticWorkloadOptions;
+using ::devtools_crosstool_autofdo::TextSampleReaderWriter;
+using ::devtools_crosstool_autofdo::WriteCfgSnapshot;
+
+namespace {
+// Writes the cfgs of `whole_program_info` to the outputs requested by the
+// flags. Returns false on failure.
+bool WriteCfgs(const AbstractPropellerWholeProgramInfo &whole_program_info) {
+  const std::string &protobuf_out = absl::GetFlag(FLAGS_propeller_protobuf_out);
+  if (!protobuf_out.empty()) {
+    std::ofstream out_stream(protobuf_out);
+    google::protobuf::io::OstreamOutputStream zero_copy_stream(&out_stream);
+    if (!google::protobuf::TextFormat::Print(
+            CreateCfgSnapshot(whole_program_info), &zero_copy_stream)) {
+      LOG(ERROR) << "Could not write testdata protobuf file.";
+      return false;
+    }
+  }
+  const std::string &snapshot_out = absl::GetFlag(FLAGS_cfg_snapshot_out);
+  if (!snapshot_out.empty()) {
+    absl::Status status = WriteCfgSnapshot(whole_program_info, snapshot_out);
+    if (!status.ok()) {
+      LOG(ERROR) << status;
+      return false;
+    }
+  }
+  return true;
+}
+}  // namespace
 
 // This binary is used to generate text protobuf format files for use as
 // testdata for codelayout tests. Example usage:
@@ -40,15 +101,54 @@ using ::devtools_crosstool_autofdo::PropProt;
 // --profiled_binary_name="propeller_sample.bin" \
 // --profile=`pwd`/testdata/propeller_sample.perfdata \
 // --propeller_protobuf_out=$HOME/tmp/propeller_sample.pb
+//
+// It also synthesizes programs of any size for scaling benchmarks, as cfgs
+// and as the matching LBR samples, for example:
+// $ llvm_propeller_generate_testdata --synthetic_functions=1000000 \
+// --cfg_snapshot_out=$HOME/tmp/synthetic.snapshot \
+// --synthetic_samples_out=$HOME/tmp/synthetic.txt
 int main(int argc, char **argv) {
   absl::SetProgramUsageMessage(argv[0]);
   absl::ParseCommandLine(argc, argv);
 
-  if (absl::GetFlag(FLAGS_propeller_protobuf_out).empty()) {
+  if (absl::GetFlag(FLAGS_propeller_protobuf_out).empty() &&
+      absl::GetFlag(FLAGS_cfg_snapshot_out).empty() &&
+      absl::GetFlag(FLAGS_synthetic_samples_out).empty()) {
     LOG(ERROR) << "Path to output protobuf must be specified.";
     return 1;
   }
 
+  if (absl::GetFlag(FLAGS_synthetic_functions) > 0) {
+    SyntheticWorkloadOptions workload_options;
+    workload_options.num_functions = absl::GetFlag(FLAGS_synthetic_functions);
+    workload_options.blocks_per_function =
+        absl::GetFlag(FLAGS_synthetic_blocks_per_function);
+    workload_options.edge_skew = absl::GetFlag(FLAGS_synthetic_edge_skew);
+    workload_options.function_skew =
+        absl::GetFlag(FLAGS_synthetic_function_skew);
+    workload_options.entry_count = absl::GetFlag(FLAGS_synthetic_entry_count);
+    workload_options.inlining_depth =
+        absl::GetFlag(FLAGS_synthetic_inlining_depth);
+    workload_options.seed = absl::GetFlag(FLAGS_synthetic_seed);
+
+    const std::string &samples_out = absl::GetFlag(FLAGS_synthetic_samples_out);
+    if (!samples_out.empty()) {
+      TextSampleReaderWriter writer(samples_out);
+      GenerateSyntheticSamples(workload_options, &writer);
+      if (!writer.Write()) return 1;
+    }
+    if (absl::GetFlag(FLAGS_propeller_protobuf_out).empty() &&
+        absl::GetFlag(FLAGS_cfg_snapshot_out).empty())
+      return 0;
+    SyntheticPropellerWholeProgramInfo whole_program_info(PropellerOptions(),
+                                                          workload_options);
+    if (!whole_program_info.CreateCfgs(CfgCreationMode::kAllFunctions).ok()) {
+      LOG(ERROR) << "Could not create cfs for whole program.";
+      return 1;
+    }
+    return WriteCfgs(whole_program_info) ? 0 : 1;
+  }
+
   PropellerOptions options(
       PropellerOptionsBuilder()
           .SetBinaryName(absl::GetFlag(FLAGS_binary))
@@ -59,23 +159,16 @@ int main(int argc, char **argv) {
 
   std::unique_ptr<PropellerWholeProgramInfo> whole_program_info =
       PropellerWholeProgramInfo::Create(options);
-
-  if (!whole_program_info->CreateCfgs(CfgCreationMode::kAllFunctions).ok()) {
-    LOG(ERROR) << "Could not create cfs for whole program.";
+  if (whole_program_info == nullptr) {
+    LOG(ERROR) << "Could not read " << options.binary_name();
     return 1;
   }
 
-  PropProt prop_prot;
-  if (!prop_prot.InitWriter(absl::GetFlag(FLAGS_propeller_protobuf_out))) {
-    LOG(ERROR) << "Could not initialize protobuf writer.";
-    return 1;
-  }
-  prop_prot.AddCfgs(whole_program_info->cfgs());
-  if (!prop_prot.WriteAndClose()) {
-    LOG(ERROR) << "Could not write testdata protobuf file.";
+  if (!whole_program_info->CreateCfgs(CfgCreationMode::kAllFunctions).ok()) {
+    LOG(ERROR) << "Could not create cfs for whole program.";
     return 1;
   }
-  return 0;
+  return WriteCfgs(*whole_program_info) ? 0 : 1;
 }
 
 #else
@@ -0,0 +1,179 @@
+#include "llvm_propeller_lbr_aggregation_cache.h"
+
+#if defined(HAVE_LLVM)
+
+#include <unistd.h>
+
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <optional>
+#include <string>
+#include <utility>
+
+#include "base/logging.h"
+#include "third_party/abseil/absl/status/status.h"
+#include "third_party/abseil/absl/strings/str_cat.h"
+#include "third_party/abseil/absl/strings/string_view.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/xxhash.h"
+
+namespace devtools_crosstool_autofdo {
+
+namespace {
+constexpr absl::string_view kCacheMagic("LBRAGG01", 8);
+
+void AppendVarint(uint64_t value, std::string &out) {
+  while (value >= 0x80) {
+    out.push_back(static_cast<char>(value | 0x80));
+    value >>= 7;
+  }
+  out.push_back(static_cast<char>(value));
+}
+
+// Reads varints from a buffer, failing on truncated input.
+class VarintReader {
+ public:
+  explicit VarintReader(absl::string_view data) : data_(data) {}
+
+  bool Read(uint64_t &value) {
+    value = 0;
+    for (int shift = 0; shift < 64 && pos_ < data_.size(); shift += 7) {
+      const uint8_t byte = data_[pos_++];
+      value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+      if (byte < 0x80) return true;
+    }
+    return false;
+  }
+
+  bool at_end() const { return pos_ == data_.size(); }
+
+ private:
+  absl::string_view data_;
+  size_t pos_ = 0;
+};
+
+// Appends `counters` sorted by address, with every source address stored as
+// the delta from the previous one and every target address as the zigzag
+// encoded delta from its source.
+void AppendCounters(const LBRAggregation::SortedCountersTy &counters,
+                    std::string &out) {
+  AppendVarint(counters.size(), out);
+  uint64_t last_from = 0;
+  for (const auto &[from_to, count] : counters) {
+    const auto [from, to] = from_to;
+    const int64_t to_delta = static_cast<int64_t>(to - from);
+    AppendVarint(from - last_from, out);
+    AppendVarint((static_cast<uint64_t>(to_delta) << 1) ^
+                     static_cast<uint64_t>(to_delta >> 63),
+                 out);
+    AppendVarint(count, out);
+    last_from = from;
+  }
+}
+
+template <typename CountersTy>
+bool ReadCounters(VarintReader &reader, CountersTy &counters) {
+  uint64_t size = 0;
+  if (!reader.Read(size)) return false;
+  counters.reserve(size);
+  uint64_t from = 0;
+  for (uint64_t i = 0; i < size; ++i) {
+    uint64_t from_delta = 0, to_delta = 0, count = 0;
+    if (!reader.Read(from_delta) || !reader.Read(to_delta) ||
+        !reader.Read(count))
+      return false;
+    from += from_delta;
+    const uint64_t to = from + ((to_delta >> 1) ^ -(to_delta & 1));
+    counters[{from, to}] += count;
+  }
+  return true;
+}
+}  // namespace
+
+std::string GetLbrAggregationCacheKey(
+    absl::Span<const PerfDataProvider::BufferHandle> perf_data,
+    absl::string_view build_id, absl::string_view match_mmap_name,
+    const PropellerOptions &options) {
+  std::string key_data = absl::StrCat(
+      build_id, "\n", match_mmap_name, "\n", options.ignore_build_id(), "\n",
+      options.lbr_sample_fraction(), "\n", options.lbr_sample_seed(), "\n");
+  for (const PerfDataProvider::BufferHandle &buffer : perf_data) {
+    absl::StrAppend(&key_data, buffer.buffer->getBufferSize(), ":",
+                    absl::Hex(llvm::xxHash64(buffer.buffer->getBuffer()),
+                              absl::kZeroPad16),
+                    "\n");
+  }
+  return absl::StrCat(build_id.empty() ? "no-build-id" : build_id, "-",
+                      absl::Hex(llvm::xxHash64(key_data), absl::kZeroPad16));
+}
+
+std::string GetLbrAggregationCachePath(absl::string_view cache_dir,
+                                       absl::string_view key) {
+  return absl::StrCat(cache_dir, "/", key, ".lbragg");
+}
+
+std::optional<CachedLbrAggregation> ReadCachedLbrAggregation(
+    absl::string_view cache_dir, absl::string_view key) {
+  const std::string path = GetLbrAggregationCachePath(cache_dir, key);
+  llvm::ErrorOr<std::unique_ptr<llvm::MemoryBuffer>> buffer =
+      llvm::MemoryBuffer::getFile(path);
+  if (!buffer) return std::nullopt;
+  const absl::string_view data((*buffer)->getBufferStart(),
+                               (*buffer)->getBufferSize());
+  if (data.substr(0, kCacheMagic.size()) != kCacheMagic) {
+    LOG(WARNING) << "Ignoring invalid LBR aggregation cache " << path;
+    return std::nullopt;
+  }
+  VarintReader reader(data.substr(kCacheMagic.size()));
+  CachedLbrAggregation cached;
+  uint64_t perf_file_parsed = 0, binary_mmap_num = 0;
+  if (!reader.Read(perf_file_parsed) || !reader.Read(binary_mmap_num) ||
+      !ReadCounters(reader, cached.lbr_aggregation.branch_counters) ||
+      !ReadCounters(reader, cached.lbr_aggregation.fallthrough_counters) ||
+      !reader.at_end()) {
+    LOG(WARNING) << "Ignoring invalid LBR aggregation cache " << path;
+    return std::nullopt;
+  }
+  cached.perf_file_parsed = perf_file_parsed;
+  cached.binary_mmap_num = binary_mmap_num;
+  return cached;
+}
+
+absl::Status WriteCachedLbrAggregation(absl::string_view cache_dir,
+                                       absl::string_view key,
+                                       const LBRAggregation &lbr_aggregation,
+                                       int perf_file_parsed,
+                                       int binary_mmap_num) {
+  if (std::error_code ec = llvm::sys::fs::create_directories(
+          llvm::StringRef(cache_dir.data(), cache_dir.size()));
+      ec) {
+    return absl::InternalError(absl::StrCat(
+        "Cannot create directory ", cache_dir, ": ", ec.message()));
+  }
+  std::string contents(kCacheMagic);
+  AppendVarint(perf_file_parsed, contents);
+  AppendVarint(binary_mmap_num, contents);
+  AppendCounters(lbr_aggregation.GetSortedBranchCounters(), contents);
+  AppendCounters(lbr_aggregation.GetSortedFallthroughCounters(), contents);
+
+  // Write to a temporary file first so that concurrent runs never see a
+  // partial cache.
+  const std::string path = GetLbrAggregationCachePath(cache_dir, key);
+  const std::string temp_path = absl::StrCat(path, ".tmp.", getpid());
+  FILE *fp = fopen(temp_path.c_str(), "wb");
+  if (fp == nullptr)
+    return absl::InternalError(absl::StrCat("Cannot open ", temp_path));
+  bool ok = fwrite(contents.data(), 1, contents.size(), fp) == contents.size();
+  ok = (fclose(fp) == 0) && ok;
+  if (!ok || rename(temp_path.c_str(), path.c_str()) != 0) {
+    unlink(temp_path.c_str());
+    return absl::InternalError(absl::StrCat("Error writing ", path));
+  }
+  return absl::OkStatus();
+}
+
+}  // namespace devtools_crosstool_autofdo
+
+#endif  // HAVE_LLVM
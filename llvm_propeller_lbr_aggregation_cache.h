@@ -0,0 +1,58 @@
+#ifndef AUTOFDO_LLVM_PROPELLER_LBR_AGGREGATION_CACHE_H_
+#define AUTOFDO_LLVM_PROPELLER_LBR_AGGREGATION_CACHE_H_
+
+#if defined(HAVE_LLVM)
+
+#include <optional>
+#include <string>
+
+#include "llvm_propeller_options.pb.h"
+#include "llvm_propeller_perf_data_provider.h"
+#include "perfdata_reader.h"
+#include "third_party/abseil/absl/status/status.h"
+#include "third_party/abseil/absl/strings/string_view.h"
+#include "third_party/abseil/absl/types/span.h"
+
+namespace devtools_crosstool_autofdo {
+
+// The LBR aggregation of a set of perf data files for one binary, as stored
+// in a cache directory, along with the parsing stats it restores.
+struct CachedLbrAggregation {
+  LBRAggregation lbr_aggregation;
+  int perf_file_parsed = 0;
+  int binary_mmap_num = 0;
+};
+
+// Returns the cache key of the LBR aggregation of `perf_data` for the binary
+// with `build_id`, whose mmaps are selected by `match_mmap_name` (see
+// `PropellerWholeProgramInfo::GetMatchMmapName`). The key covers the contents
+// of the perf data files and every option the aggregation depends on.
+std::string GetLbrAggregationCacheKey(
+    absl::Span<const PerfDataProvider::BufferHandle> perf_data,
+    absl::string_view build_id, absl::string_view match_mmap_name,
+    const PropellerOptions &options);
+
+// Returns the file storing the LBR aggregation of `key` in `cache_dir`.
+std::string GetLbrAggregationCachePath(absl::string_view cache_dir,
+                                       absl::string_view key);
+
+// Reads the LBR aggregation of `key` from `cache_dir`. Returns nullopt if
+// there is none or the file is invalid.
+std::optional<CachedLbrAggregation> ReadCachedLbrAggregation(
+    absl::string_view cache_dir, absl::string_view key);
+
+// Writes `lbr_aggregation`, parsed from `perf_file_parsed` files with
+// `binary_mmap_num` mmaps of the binary, as the LBR aggregation of `key` into
+// `cache_dir`, which is created if it does not exist. The counters are stored
+// sorted by address, delta and varint encoded.
+absl::Status WriteCachedLbrAggregation(absl::string_view cache_dir,
+                                       absl::string_view key,
+                                       const LBRAggregation &lbr_aggregation,
+                                       int perf_file_parsed,
+                                       int binary_mmap_num);
+
+}  // namespace devtools_crosstool_autofdo
+
+#endif  // HAVE_LLVM
+
+#endif  // AUTOFDO_LLVM_PROPELLER_LBR_AGGREGATION_CACHE_H_
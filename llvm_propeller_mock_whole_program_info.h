@@ -3,38 +3,23 @@
 
 #if defined(HAVE_LLVM)
 
-#include <memory>
-
 #include "llvm_propeller_abstract_whole_program_info.h"
-#include "llvm_propeller_cfg.pb.h"
-#include "llvm/Support/Allocator.h"
-#include "llvm/Support/StringSaver.h"
+#include "llvm_propeller_cfg_snapshot.h"
 
 namespace devtools_crosstool_autofdo {
 
-class MockPropellerWholeProgramInfo : public AbstractPropellerWholeProgramInfo {
+// Reads the cfgs from a text-format PropellerPb given as the first perf file.
+class MockPropellerWholeProgramInfo
+    : public PropellerCfgSnapshotWholeProgramInfo {
  public:
   explicit MockPropellerWholeProgramInfo(const PropellerOptions &options)
-      : AbstractPropellerWholeProgramInfo(options) {}
+      : PropellerCfgSnapshotWholeProgramInfo(options) {}
 
   ~MockPropellerWholeProgramInfo() final {}
 
   // "only_for_hot_functions": see comments in
   // "AbstractPropellerWholeProgramInfo".
   absl::Status CreateCfgs(CfgCreationMode cfg_creation_mode) override;
-
- private:
-  void CreateCfgsFromProtobuf();
-
-  // When we construct Symbols/CFGs from protobuf, bump_ptr_allocator_ and
-  // string_saver_ are used to keep all the string content. (Whereas in case of
-  // constructing from binary files, the strings are kept in
-  // binary_file_content.)
-  std::unique_ptr<llvm::BumpPtrAllocator> bump_ptr_allocator_;
-  std::unique_ptr<llvm::StringSaver> string_saver_;
-
-  // Protobuf container.
-  PropellerPb propeller_pb_;
 };
 
 }  // namespace devtools_crosstool_autofdo
@@ -56,14 +56,23 @@ void NodeChain::MergeWith(NodeChainAssembly assembly,
   // Actually merge the nodes of `unsplit_chain` into `*this`, in the order
   // given by `assembly`. `assembly` will be dead after the call to
   // `ConsumeEachNodeBundleInAssemblyOrder`.
-  std::vector<std::unique_ptr<CFGNodeBundle>> merged_node_bundles;
-  int64_t chain_offset = 0;
-  int chain_index = 0;
-  CFGNodeBundle *prev_bundle = nullptr;
   bool should_rebundle =
       ShouldRebundle(assembly, code_layout_scorer.code_layout_params());
   int n_bundles_pre_merge = assembly.split_chain().node_bundles_.size() +
                             assembly.unsplit_chain().node_bundles_.size();
+  // Unless rebundling, the leading bundles of `*this` which keep their
+  // positions are left in place, so that appending a chain only moves and
+  // renumbers the bundles of the appended chain.
+  const int n_unmoved_bundles =
+      should_rebundle ? 0 : assembly.num_unmoved_bundles();
+  std::vector<std::unique_ptr<CFGNodeBundle>> merged_node_bundles;
+  int64_t chain_offset = 0;
+  int chain_index = n_unmoved_bundles;
+  if (n_unmoved_bundles != 0) {
+    const CFGNodeBundle &last_unmoved = *node_bundles_[n_unmoved_bundles - 1];
+    chain_offset = last_unmoved.chain_offset_ + last_unmoved.size_;
+  }
+  CFGNodeBundle *prev_bundle = nullptr;
   std::move(assembly).ConsumeEachNodeBundleInAssemblyOrder(
       [&](std::unique_ptr<CFGNodeBundle> node_bundle) {
         // Try rebundling if this bundle comes from the same CFG as the previous
@@ -81,9 +90,12 @@ void NodeChain::MergeWith(NodeChainAssembly assembly,
           prev_bundle = node_bundle.get();
           merged_node_bundles.push_back(std::move(node_bundle));
         }
-      });
+      },
+      n_unmoved_bundles);
 
-  node_bundles_ = std::move(merged_node_bundles);
+  node_bundles_.resize(n_unmoved_bundles);
+  absl::c_move(std::move(merged_node_bundles),
+               std::back_inserter(node_bundles_));
 
   // Remove intra-bundle edges if we have actually rebundled any chain, i.e.,
   // if the `node_bundles_.size()` has changed since before the merge.
@@ -103,7 +115,7 @@ void NodeChain::MergeChainEdges(NodeChain &other) {
   // `intra_chain_out_edges_` of its source bundle. Otherwise, they will be
   // moved to `from_chain.inter_chain_out_edges_` and
   // `to_chain.inter_chain_in_edges_`.
-  auto move_edges = [](std::vector<CFGEdge *> edges, NodeChain &from_chain,
+  auto move_edges = [](EdgeList edges, NodeChain &from_chain,
                        NodeChain &to_chain) {
     if (&from_chain == &to_chain) {
       for (CFGEdge *edge : edges)
@@ -115,7 +127,7 @@ void NodeChain::MergeChainEdges(NodeChain &other) {
         to_chain.inter_chain_in_edges_.insert(&from_chain);
       } else {
         // If the chain-edge is already present, just add the CFG edges.
-        absl::c_move(std::move(edges), std::back_inserter(it->second));
+        it->second.insert(it->second.end(), edges.begin(), edges.end());
       }
     }
   };
@@ -135,8 +147,11 @@ void NodeChain::MergeChainEdges(NodeChain &other) {
         << "Intra-chain edges found within inter-chain edges.";
     auto edges_to_other = chain->inter_chain_out_edges_.find(&other);
     CHECK(edges_to_other != chain->inter_chain_out_edges_.end());
-    move_edges(std::move(edges_to_other->second), *chain, *this);
+    EdgeList edges = std::move(edges_to_other->second);
+    // Erase the entry first, since `move_edges` may insert into the same map,
+    // which invalidates `edges_to_other`.
     chain->inter_chain_out_edges_.erase(edges_to_other);
+    move_edges(std::move(edges), *chain, *this);
   }
 }
 
@@ -4,7 +4,6 @@
 #include <algorithm>
 #include <iterator>
 #include <list>
-#include <map>
 #include <memory>
 #include <utility>
 #include <vector>
@@ -12,7 +11,9 @@
 #include "llvm_propeller_cfg.h"
 #include "llvm_propeller_code_layout_scorer.h"
 #include "third_party/abseil/absl/algorithm/container.h"
+#include "third_party/abseil/absl/container/btree_map.h"
 #include "third_party/abseil/absl/container/btree_set.h"
+#include "third_party/abseil/absl/container/inlined_vector.h"
 
 // A node chain represents an ordered list of CFG nodes, which are further
 // split into multiple (ordered) list of nodes called bundles. For example
@@ -155,14 +156,21 @@ class NodeChain {
     }
   };
 
+  // The CFG edges from this chain to one other chain. Most pairs of chains are
+  // connected by very few edges, which are stored inline.
+  using EdgeList = absl::InlinedVector<CFGEdge *, 2>;
+
   // Each map key is a NodeChain which has (at least) one CFGNode that is
   // the sink node of an edge in `inter_outs_` or `intra_outs_` of CFGNodes in
   // "this" NodeChain. The corresponding map value is the collection of CFGEdges
   // which have have a sink node equal to one of the CFGNodes of the
   // corresponding map key. Note, we use "NodeChain::PtrComparator" to make sure
-  // the iterating order is deterministic. Note, intra-chain edges won't be
-  // inserted in this map, i.e., this map cannot have "this" NodeChain as a key.
-  std::map<NodeChain *, std::vector<CFGEdge *>, NodeChain::PtrComparator>
+  // the iterating order is deterministic. Like `inter_chain_in_edges_`, this is
+  // a B-tree, which keeps many entries in each node rather than allocating a
+  // node per entry. Inserting or erasing entries invalidates its iterators.
+  // Note, intra-chain edges won't be inserted in this map, i.e., this map
+  // cannot have "this" NodeChain as a key.
+  absl::btree_map<NodeChain *, EdgeList, NodeChain::PtrComparator>
       inter_chain_out_edges_;
 
   // Chains which have outgoing edges to `*this`. We use
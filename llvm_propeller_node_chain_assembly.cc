@@ -263,4 +263,185 @@ bool NodeChainAssembly::NodeChainAssemblyComparator::operator()(
   return lhs.merge_order() < rhs.merge_order();
 }
 
+NodeChainPairEdgeSummary::NodeChainPairEdgeSummary(
+    const PropellerCodeLayoutScorer &scorer, NodeChain &split_chain,
+    NodeChain &unsplit_chain)
+    : scorer_(&scorer),
+      split_chain_(&split_chain),
+      unsplit_chain_(&unsplit_chain) {
+  bundle_offsets_.reserve(split_chain.node_bundles_.size() + 1);
+  for (const auto &bundle : split_chain.node_bundles_)
+    bundle_offsets_.push_back(bundle->chain_offset_);
+  bundle_offsets_.push_back(split_chain.size_);
+
+  for (auto [from_chain, to_chain] :
+       {std::make_pair(&split_chain, &unsplit_chain),
+        std::make_pair(&unsplit_chain, &split_chain)}) {
+    auto it = from_chain->inter_chain_out_edges_.find(to_chain);
+    if (it == from_chain->inter_chain_out_edges_.end()) continue;
+    for (const CFGEdge *edge : it->second) {
+      inter_chain_edges_.push_back(MakeEdgeRecord(*edge));
+      max_score_gain_ += scorer.GetMaxEdgeScore(*edge);
+    }
+  }
+
+  intra_chain_edges_begin_.reserve(split_chain.node_bundles_.size() + 1);
+  for (const auto &bundle : split_chain.node_bundles_) {
+    intra_chain_edges_begin_.push_back(intra_chain_edges_.size());
+    for (const CFGEdge *edge : bundle->intra_chain_out_edges_) {
+      const EdgeRecord &record =
+          intra_chain_edges_.emplace_back(MakeEdgeRecord(*edge));
+      intra_chain_edge_scores_.push_back(scorer.GetEdgeScore(
+          *edge, record.sink_offset - record.src_offset - record.src_size));
+      max_score_gain_ +=
+          scorer.GetMaxEdgeScore(*edge) - intra_chain_edge_scores_.back();
+    }
+  }
+  intra_chain_edges_begin_.push_back(intra_chain_edges_.size());
+}
+
+NodeChainPairEdgeSummary::EdgeRecord NodeChainPairEdgeSummary::MakeEdgeRecord(
+    const CFGEdge &edge) const {
+  auto bundle_index = [&](const CFGNode *node) {
+    return &GetNodeChain(node) == split_chain_ ? node->bundle()->chain_index_
+                                               : -1;
+  };
+  return {.edge = &edge,
+          .src_bundle_index = bundle_index(edge.src()),
+          .sink_bundle_index = bundle_index(edge.sink()),
+          .src_offset = GetNodeOffset(edge.src()),
+          .src_size = static_cast<int64_t>(edge.src()->size()),
+          .sink_offset = GetNodeOffset(edge.sink())};
+}
+
+std::optional<int64_t> NodeChainPairEdgeSummary::ComputeScoreGain(
+    NodeChainAssembly::NodeChainAssemblyBuildingOptions options) const {
+  CHECK(options.merge_order != MergeOrder::kSU)
+      << "The edge summary only evaluates splitting assemblies.";
+  CHECK(options.slice_pos.has_value())
+      << "slice_pos is required for every merge order other than kSU.";
+  const int slice_pos = *options.slice_pos;
+  CHECK_LT(slice_pos, split_chain_->node_bundles_.size())
+      << "Out of bounds slice position.";
+  CHECK_GT(slice_pos, 0) << "Out of bounds slice position.";
+
+  const SliceBounds split1 = {.begin_offset = bundle_offsets_.front(),
+                              .end_offset = bundle_offsets_[slice_pos]};
+  const SliceBounds split2 = {.begin_offset = bundle_offsets_[slice_pos],
+                              .end_offset = bundle_offsets_.back()};
+  const SliceBounds unsplit = {
+      .begin_offset = 0,
+      .end_offset = static_cast<int64_t>(unsplit_chain_->size_)};
+  const CFGNode *split2_first_node =
+      split_chain_->node_bundles_[slice_pos]->nodes_.front();
+
+  // Lay out the slices as `NodeChainAssembly::ConstructSlices` does.
+  SliceBounds slices[3];
+  int split1_index, split2_index, unsplit_index;
+  const CFGNode *first_node;
+  switch (options.merge_order) {
+    case MergeOrder::kSU:
+      LOG(FATAL) << "Unreachable.";
+    case MergeOrder::kS2S1U:
+      split2_index = 0, split1_index = 1, unsplit_index = 2;
+      first_node = split2_first_node;
+      break;
+    case MergeOrder::kS1US2:
+      split1_index = 0, unsplit_index = 1, split2_index = 2;
+      first_node = split_chain_->GetFirstNode();
+      break;
+    case MergeOrder::kUS2S1:
+      unsplit_index = 0, split2_index = 1, split1_index = 2;
+      first_node = unsplit_chain_->GetFirstNode();
+      break;
+    case MergeOrder::kS2US1:
+      split2_index = 0, unsplit_index = 1, split1_index = 2;
+      first_node = split2_first_node;
+      break;
+  }
+  slices[split1_index] = split1;
+  slices[split2_index] = split2;
+  slices[unsplit_index] = unsplit;
+
+  if (!scorer_->code_layout_params().inter_function_reordering() &&
+      (split_chain_->GetFirstNode()->is_entry() ||
+       unsplit_chain_->GetFirstNode()->is_entry()) &&
+      !first_node->is_entry()) {
+    return std::nullopt;
+  }
+
+  auto slice_index = [&](int bundle_index) {
+    if (bundle_index < 0) return unsplit_index;
+    return bundle_index < slice_pos ? split1_index : split2_index;
+  };
+  auto add_edge = [&](PropellerCodeLayoutScorer::EdgeBatch &batch,
+                      const EdgeRecord &record) {
+    batch.AddEdge(*record.edge,
+                  ComputeEdgeDistance(record,
+                                      slice_index(record.src_bundle_index),
+                                      slice_index(record.sink_bundle_index),
+                                      slices));
+  };
+
+  inter_chain_batch_.Clear();
+  for (const EdgeRecord &record : inter_chain_edges_)
+    add_edge(inter_chain_batch_, record);
+  int64_t score_gain = scorer_->GetEdgeScoreSum(inter_chain_batch_);
+  // Like `NodeChainAssembly::ComputeScoreGain`, skip the split chain's edges
+  // when the inter-chain score is zero.
+  if (score_gain != 0) {
+    // Visit the edges between the two slices of `split_chain_` in the same way
+    // as `NodeChainAssembly::ComputeSplitChainScoreGain`.
+    inter_slice_batch_.Clear();
+    for (int i = 0; i < slice_pos; ++i) {
+      for (int j = intra_chain_edges_begin_[i + 1] - 1;
+           j >= intra_chain_edges_begin_[i] &&
+           intra_chain_edges_[j].sink_bundle_index >= slice_pos;
+           --j) {
+        add_edge(inter_slice_batch_, intra_chain_edges_[j]);
+        score_gain -= intra_chain_edge_scores_[j];
+      }
+    }
+    for (int i = slice_pos; i < split_chain_->node_bundles_.size(); ++i) {
+      for (int j = intra_chain_edges_begin_[i];
+           j != intra_chain_edges_begin_[i + 1] &&
+           intra_chain_edges_[j].sink_bundle_index < slice_pos;
+           ++j) {
+        add_edge(inter_slice_batch_, intra_chain_edges_[j]);
+        score_gain -= intra_chain_edge_scores_[j];
+      }
+    }
+    score_gain += scorer_->GetEdgeScoreSum(inter_slice_batch_);
+  }
+  if (score_gain < 0 || (score_gain == 0 && options.error_on_zero_score_gain))
+    return std::nullopt;
+  return score_gain;
+}
+
+int64_t NodeChainPairEdgeSummary::ComputeEdgeDistance(
+    const EdgeRecord &record, int src_slice_index, int sink_slice_index,
+    absl::Span<const SliceBounds> slices) {
+  int64_t src_sink_distance = 0;
+  if (src_slice_index == sink_slice_index) {
+    src_sink_distance =
+        record.sink_offset - record.src_offset - record.src_size;
+  } else {
+    const SliceBounds &src_slice = slices[src_slice_index];
+    const SliceBounds &sink_slice = slices[sink_slice_index];
+    src_sink_distance =
+        src_slice_index < sink_slice_index
+            ? src_slice.end_offset - record.src_offset - record.src_size +
+                  record.sink_offset - sink_slice.begin_offset
+            : src_slice.begin_offset - record.src_offset - record.src_size +
+                  record.sink_offset - sink_slice.end_offset;
+    const int64_t middle_slice_size =
+        slices[1].end_offset - slices[1].begin_offset;
+    if (src_slice_index == 0 && sink_slice_index == 2)
+      src_sink_distance += middle_slice_size;
+    else if (src_slice_index == 2 && sink_slice_index == 0)
+      src_sink_distance -= middle_slice_size;
+  }
+  return src_sink_distance;
+}
+
 }  // namespace devtools_crosstool_autofdo
@@ -13,6 +13,7 @@
 #include "third_party/abseil/absl/functional/function_ref.h"
 #include "third_party/abseil/absl/status/statusor.h"
 #include "third_party/abseil/absl/strings/string_view.h"
+#include "third_party/abseil/absl/types/span.h"
 
 namespace devtools_crosstool_autofdo {
 
@@ -186,11 +187,33 @@ class NodeChainAssembly {
     }
   }
 
+  // Like `VisitEachNodeBundleInAssemblyOrder`, but moves every node bundle
+  // into `func`, except for the first `num_skipped_bundles` bundles, which
+  // are skipped without being visited.
   void ConsumeEachNodeBundleInAssemblyOrder(
-      absl::FunctionRef<void(std::unique_ptr<CFGNodeBundle> bundle)> func) && {
+      absl::FunctionRef<void(std::unique_ptr<CFGNodeBundle> bundle)> func,
+      int num_skipped_bundles = 0) && {
     for (const NodeChainSlice &slice : slices_) {
-      for (auto it = slice.begin_pos(); it != slice.end_pos(); ++it)
-        func(std::move(*it));
+      auto it = slice.begin_pos();
+      const int num_skipped_in_slice =
+          std::min<int>(num_skipped_bundles, slice.end_pos() - it);
+      it += num_skipped_in_slice;
+      num_skipped_bundles -= num_skipped_in_slice;
+      for (; it != slice.end_pos(); ++it) func(std::move(*it));
+    }
+  }
+
+  // Returns the number of leading bundles of `split_chain()` which stay at
+  // the same positions in the assembled chain: all of them for kSU, the
+  // bundles of the first slice for kS1US2 and none otherwise.
+  int num_unmoved_bundles() const {
+    switch (merge_order_) {
+      case MergeOrder::kSU:
+        return split_chain().node_bundles_.size();
+      case MergeOrder::kS1US2:
+        return *slice_pos_;
+      default:
+        return 0;
     }
   }
 
@@ -300,6 +323,91 @@ class NodeChainAssembly {
   // cached here for efficiency.
   int64_t score_gain_;
 };
+
+// This class summarizes the edges which determine the score gain of merging
+// two chains: the edges between `split_chain` and `unsplit_chain` (in both
+// directions) and the intra-chain edges of `split_chain`. Every edge is stored
+// with its endpoints' offsets and bundle indices, so that the score gain of
+// every splitting assembly of the two chains can be evaluated arithmetically,
+// without constructing the `NodeChainAssembly` or looking up the slice of
+// each endpoint. Any change to the two chains invalidates the summary.
+class NodeChainPairEdgeSummary {
+ public:
+  // Builds the summary for `split_chain` and `unsplit_chain`. `scorer` and both
+  // chains must outlive the created summary.
+  NodeChainPairEdgeSummary(const PropellerCodeLayoutScorer &scorer,
+                           NodeChain &split_chain, NodeChain &unsplit_chain);
+
+  NodeChainPairEdgeSummary(const NodeChainPairEdgeSummary &) = delete;
+  NodeChainPairEdgeSummary &operator=(const NodeChainPairEdgeSummary &) =
+      delete;
+
+  // Returns the score gain of the splitting assembly specified by `options`,
+  // or `std::nullopt` if `NodeChainAssembly::BuildNodeChainAssembly` would
+  // return an error for the same chains and options. `options.merge_order`
+  // must not be `kSU`.
+  std::optional<int64_t> ComputeScoreGain(
+      NodeChainAssembly::NodeChainAssemblyBuildingOptions options) const;
+
+  // Returns an upper bound of the score gain of every assembly of the two
+  // chains: the maximum scores of the edges between them plus what the edges
+  // between the bundles of `split_chain` may gain over their current scores.
+  int64_t max_score_gain() const { return max_score_gain_; }
+
+ private:
+  // An edge with its endpoints' offsets in their chains and the indices of
+  // their bundles in `split_chain` (-1 for nodes of `unsplit_chain`).
+  struct EdgeRecord {
+    const CFGEdge *edge;
+    int src_bundle_index;
+    int sink_bundle_index;
+    int64_t src_offset;
+    int64_t src_size;
+    int64_t sink_offset;
+  };
+
+  // The binary-size offsets of the two endpoints of a chain slice.
+  struct SliceBounds {
+    int64_t begin_offset;
+    int64_t end_offset;
+  };
+
+  EdgeRecord MakeEdgeRecord(const CFGEdge &edge) const;
+
+  // Returns the source-to-sink distance of `record` when the two chains are
+  // merged into `slices`, with the source and sink of the edge placed in slices
+  // `src_slice_index` and `sink_slice_index`.
+  static int64_t ComputeEdgeDistance(const EdgeRecord &record,
+                                     int src_slice_index, int sink_slice_index,
+                                     absl::Span<const SliceBounds> slices);
+
+  const PropellerCodeLayoutScorer *scorer_;
+  NodeChain *split_chain_;
+  NodeChain *unsplit_chain_;
+
+  // Offsets of the bundles of `split_chain_`, followed by its size.
+  std::vector<int64_t> bundle_offsets_;
+
+  // Edges between the two chains, in the iteration order of
+  // `NodeChain::inter_chain_out_edges_` (split to unsplit first).
+  std::vector<EdgeRecord> inter_chain_edges_;
+
+  // Intra-chain edges of `split_chain_`, grouped by their source bundle in the
+  // same order as `CFGNodeBundle::intra_chain_out_edges_`. The edges of bundle
+  // `i` are in [`intra_chain_edges_begin_[i]`,
+  // `intra_chain_edges_begin_[i+1]`).
+  std::vector<EdgeRecord> intra_chain_edges_;
+  std::vector<int> intra_chain_edges_begin_;
+  // Score of every edge in `intra_chain_edges_` within the unsplit chain.
+  std::vector<int64_t> intra_chain_edge_scores_;
+
+  int64_t max_score_gain_ = 0;
+
+  // Scratch batches for scoring the inter-chain edges and the inter-slice
+  // edges of `split_chain_` of one assembly.
+  mutable PropellerCodeLayoutScorer::EdgeBatch inter_chain_batch_;
+  mutable PropellerCodeLayoutScorer::EdgeBatch inter_slice_batch_;
+};
 }  // namespace devtools_crosstool_autofdo
 
 #endif  // AUTOFDO_LLVM_PROPELLER_NODE_CHAIN_ASSEMBLY_H_
@@ -1,10 +1,9 @@
 #include "llvm_propeller_node_chain_builder.h"
 
 #include <algorithm>
-#include <map>
+#include <cstdint>
 #include <memory>
 #include <optional>
-#include <set>
 #include <tuple>
 #include <utility>
 #include <vector>
@@ -31,104 +30,100 @@ namespace devtools_crosstool_autofdo {
 using NodeChainAssemblyComparator =
     NodeChainAssembly::NodeChainAssemblyComparator;
 
-std::map<CFGNode *, CFGNode *, CFGNodePtrLessComparator> GetForcedEdges(
-    const ControlFlowGraph &cfg) {
+namespace {
+// Returns the index of `node` in `cfg.nodes()`. The nodes of a CFG normally
+// have consecutive ordinals, which gives the index directly.
+int GetNodeIndex(const ControlFlowGraph &cfg, const CFGNode *node) {
+  const std::vector<std::unique_ptr<CFGNode>> &nodes = cfg.nodes();
+  const uint64_t offset =
+      node->symbol_ordinal() - nodes.front()->symbol_ordinal();
+  if (offset < nodes.size() && nodes[offset].get() == node) return offset;
+  auto it = absl::c_lower_bound(
+      nodes, node->symbol_ordinal(),
+      [](const std::unique_ptr<CFGNode> &n, uint64_t ordinal) {
+        return n->symbol_ordinal() < ordinal;
+      });
+  CHECK(it != nodes.end() && it->get() == node);
+  return it - nodes.begin();
+}
+}  // namespace
+
+std::vector<int> GetForcedEdges(const ControlFlowGraph &cfg) {
   // Each node can participate in a forced edge at most one time as the source
-  // at most one time as the sink.
-  // So we compute these edges as a map from source to sink nodes below.
-  // As we iterate over CFG edges, we insert their source and sinks in this map.
-  // When we visit the second edge for a source node, we nullify the mapped sink
-  // node to indicate that the source has multiple outgoing edges and will not
-  // have a forced edge. We also keep track of the in-degree of each node.
-  // After visiting all edges, we remove all source-sink pairs where
-  // sink == nullptr or if sink has an in-degree larger than one.
-  std::map<CFGNode *, CFGNode *, CFGNodePtrLessComparator> forced_edges;
-  // This stores the number of hot (non-zero weight) incoming edges to every
-  // node (hot in-degree).
-  absl::flat_hash_map<CFGNode *, int> hot_in_degree;
+  // at most one time as the sink. So we count the hot (non-zero weight)
+  // outgoing and incoming edges of every node, and keep the edges whose
+  // source and sink have one of each.
+  const int n_nodes = cfg.nodes().size();
+  std::vector<int> path_next(n_nodes, -1);
+  std::vector<int> hot_out_degree(n_nodes, 0);
+  std::vector<int> hot_in_degree(n_nodes, 0);
   for (const std::unique_ptr<CFGEdge> &edge : cfg.intra_edges()) {
     if (edge->weight() == 0 || edge->IsCall() || edge->IsReturn()) continue;
-    auto [it, inserted] = forced_edges.emplace(edge->src(), edge->sink());
-    // Nullify the edge for the source node if an out-edge has already been
-    // found, indicating that this node does not have a forced edge.
-    if (!inserted) it->second = nullptr;
-    ++hot_in_degree[edge->sink()];
+    const int src = GetNodeIndex(cfg, edge->src());
+    const int sink = GetNodeIndex(cfg, edge->sink());
+    path_next[src] = sink;
+    ++hot_out_degree[src];
+    ++hot_in_degree[sink];
   }
-
-  // Remove from `forced_edges` all edges which sink to nullptr, besides
-  // those which sink to a node having more than one incoming (hot) edge.
-  for (auto it = forced_edges.begin(); it != forced_edges.end();) {
-    if (!it->second || hot_in_degree[it->second] > 1)
-      it = forced_edges.erase(it);
-    else
-      ++it;
+  for (int i = 0; i != n_nodes; ++i) {
+    if (path_next[i] == -1) continue;
+    if (hot_out_degree[i] > 1 || hot_in_degree[path_next[i]] > 1)
+      path_next[i] = -1;
   }
-  return forced_edges;
+  return path_next;
 }
 
-void BreakCycles(
-    std::map<CFGNode *, CFGNode *, CFGNodePtrLessComparator> &path_next) {
-  // This maps each node to the path (id) they belong to. Path ids are 1-based.
-  absl::flat_hash_map<CFGNode *, int> node_to_path_id;
-  // These are the source nodes for all edges that must be cut to break cycles.
-  std::vector<CFGNode *> cycle_cut_nodes;
-  int current_path_id = 0;
-  for (auto it = path_next.begin(); it != path_next.end(); ++it) {
-    // Continue if the node and its path/cycle have already been visited.
-    if (node_to_path_id.contains(it->first)) continue;
-    CFGNode *victim_node = nullptr;
-    // Start traversing the path from this node to find the victim node.
-    auto path_visit_it = it;
-    ++current_path_id;
-    while (path_visit_it != path_next.end()) {
-      auto [node_to_path_id_it, inserted] =
-          node_to_path_id.emplace(path_visit_it->first, current_path_id);
-      if (!inserted) {
-        // If this is already mapped to a path, either it is the same number --
-        // in which case we have found a cycle, or it is a different number --
-        // which means we have found a path to a previously visited path
-        // (non-cycle).
-        if (node_to_path_id_it->second == current_path_id) {
-          // We have found a cycle: add the victim edge
-          cycle_cut_nodes.push_back(victim_node);
-        }
-        break;
-      }
-      if (!victim_node || (path_visit_it->second->symbol_ordinal() <
-                           path_next[victim_node]->symbol_ordinal())) {
-        victim_node = path_visit_it->first;
-      }
-      // Proceed to the next node in the path.
-      path_visit_it = path_next.find(path_visit_it->second);
+void BreakCycles(const ControlFlowGraph &cfg, std::vector<int> &path_next) {
+  // Every node has at most one forced predecessor, so the forced edges form
+  // disjoint paths and cycles. The nodes not reached from the beginning of a
+  // path are on cycles.
+  const int n_nodes = path_next.size();
+  std::vector<bool> has_prev(n_nodes, false);
+  for (int next : path_next)
+    if (next != -1) has_prev[next] = true;
+  std::vector<bool> visited(n_nodes, false);
+  for (int i = 0; i != n_nodes; ++i) {
+    if (has_prev[i] || path_next[i] == -1) continue;
+    for (int j = i; j != -1; j = path_next[j]) visited[j] = true;
+  }
+  for (int i = 0; i != n_nodes; ++i) {
+    if (visited[i] || path_next[i] == -1) continue;
+    // Walk the cycle through `i` to find its victim node, the source of the
+    // edge sinking to the smallest ordinal.
+    int victim = i;
+    for (int j = path_next[i]; j != i; j = path_next[j]) {
+      if (cfg.nodes()[path_next[j]]->symbol_ordinal() <
+          cfg.nodes()[path_next[victim]]->symbol_ordinal())
+        victim = j;
     }
+    visited[i] = true;
+    for (int j = path_next[i]; j != i; j = path_next[j]) visited[j] = true;
+    path_next[victim] = -1;
   }
-  // Remove the victim nodes from the path_next map to break cycles.
-  for (CFGNode *node : cycle_cut_nodes) path_next.erase(node);
 }
 
 std::vector<std::vector<CFGNode *>> GetForcedPaths(
     const ControlFlowGraph &cfg) {
   // First find all forced fallthrough edges. Each of these edges are the only
   // edge to their sink and the only edge from their source.
-  std::map<CFGNode *, CFGNode *, CFGNodePtrLessComparator> path_next =
-      GetForcedEdges(cfg);
+  std::vector<int> path_next = GetForcedEdges(cfg);
 
   // Construct paths from `path_next` after breaking its cycles.
-  BreakCycles(path_next);
+  BreakCycles(cfg, path_next);
 
   // Find the beginning nodes of paths.
-  std::set<CFGNode *, CFGNodePtrLessComparator> path_begin_nodes;
-  for (const auto [source, unused] : path_next) path_begin_nodes.insert(source);
-  for (const auto [unused, sink] : path_next) path_begin_nodes.erase(sink);
+  const int n_nodes = path_next.size();
+  std::vector<bool> has_prev(n_nodes, false);
+  for (int next : path_next)
+    if (next != -1) has_prev[next] = true;
 
   std::vector<std::vector<CFGNode *>> paths;
-  for (CFGNode *begin_node : path_begin_nodes) {
-    // Follow the path specified by bundle_next from this node.
-    std::vector<CFGNode *> path = {begin_node};
-    for (auto it = path_next.find(begin_node); it != path_next.end();
-         it = path_next.find(it->second))
-      path.push_back(it->second);
-    CHECK_GT(path.size(), 1) << "Paths should have more than one node.";
+  for (int begin = 0; begin != n_nodes; ++begin) {
+    if (has_prev[begin] || path_next[begin] == -1) continue;
+    // Follow the path specified by `path_next` from this node.
+    std::vector<CFGNode *> path;
+    for (int i = begin; i != -1; i = path_next[i])
+      path.push_back(cfg.nodes()[i].get());
     paths.push_back(std::move(path));
   }
   return paths;
@@ -231,12 +226,18 @@ void NodeChainBuilder::InitNodeChains() {
 // constructed chains. After this returns, chains_ becomes empty.
 std::vector<std::unique_ptr<NodeChain>> NodeChainBuilder::BuildChains() {
   InitNodeChains();
+  DetachIsolatedChains();
   InitChainEdges();
   InitChainAssemblies();
   // Keep merging chains together until no more score gain can be achieved.
   while (!node_chain_assemblies_->empty()) {
     MergeChains(node_chain_assemblies_->GetBestAssembly());
   }
+  for (std::unique_ptr<NodeChain> &chain : isolated_chains_) {
+    const uint64_t chain_id = chain->id();
+    chains_.emplace(chain_id, std::move(chain));
+  }
+  isolated_chains_.clear();
 
   // Merge all chains into a single chain if `inter_function_reordering=false`
   // or if we only have a single cfg.
@@ -256,36 +257,98 @@ std::vector<std::unique_ptr<NodeChain>> NodeChainBuilder::BuildChains() {
 // Calculates the total score for a node chain. This function aggregates the
 // score of all edges whose src and sink are `chain`.
 int64_t NodeChainBuilder::ComputeScore(NodeChain &chain) const {
-  int64_t score = 0;
+  PropellerCodeLayoutScorer::EdgeBatch batch;
   for (const std::unique_ptr<CFGNodeBundle> &bundle : chain.node_bundles_) {
     for (CFGEdge *edge : bundle->intra_chain_out_edges_) {
       CHECK_NE(edge->sink()->bundle(), bundle.get())
           << "Intra-bundle edges found.";
       int64_t src_offset = GetNodeOffset(edge->src());
       int64_t sink_offset = GetNodeOffset(edge->sink());
-      score += code_layout_scorer_.GetEdgeScore(
-          *edge, sink_offset - src_offset - edge->src()->size());
+      batch.AddEdge(*edge, sink_offset - src_offset - edge->src()->size());
     }
   }
-  return score;
+  return code_layout_scorer_.GetEdgeScoreSum(batch);
 }
 
 void NodeChainBuilder::UpdateNodeChainAssembly(NodeChain &split_chain,
                                                NodeChain &unsplit_chain) {
+  // Splitting assemblies are only scored against `edge_summary`, and only the
+  // best one is built at the end.
+  std::optional<NodeChainPairEdgeSummary> edge_summary;
+  if (ShouldSplitChains())
+    edge_summary.emplace(code_layout_scorer_, split_chain, unsplit_chain);
+
+  const double pruning_fraction =
+      code_layout_scorer_.code_layout_params()
+          .chain_assembly_pruning_fraction();
+  if (pruning_fraction > 0) {
+    const int64_t max_score_gain =
+        edge_summary.has_value()
+            ? edge_summary->max_score_gain()
+            : GetMaxInterChainScore(split_chain, unsplit_chain);
+    if (max_score_gain < pruning_fraction * best_score_gain_) {
+      ++stats_.n_pruned_assemblies;
+      node_chain_assemblies_->RemoveAssembly(
+          {.split_chain = &split_chain, .unsplit_chain = &unsplit_chain});
+      return;
+    }
+  }
+
   absl::StatusOr<NodeChainAssembly> best_assembly =
       NodeChainAssembly::BuildNodeChainAssembly(
           code_layout_scorer_, split_chain, unsplit_chain,
           {.merge_order = MergeOrder::kSU});
 
-  if (code_layout_scorer_.code_layout_params().chain_split()) {
-    auto compare_and_update_best_assembly =
-        [&](absl::StatusOr<NodeChainAssembly> assembly) {
-          if (!assembly.ok()) return;
-          if (!best_assembly.ok() ||
-              NodeChainAssemblyComparator()(*best_assembly, *assembly)) {
-            best_assembly = std::move(assembly);
-          }
-        };
+  // No splitting assembly can beat `best_assembly` if the score gain bound of
+  // the two chains is below its score gain. Splitting assemblies win ties
+  // against `kSU`, so they are searched on equal gains.
+  bool search_splits = edge_summary.has_value();
+  if (search_splits &&
+      edge_summary->max_score_gain() <
+          (best_assembly.ok() ? best_assembly->score_gain() : 1)) {
+    ++stats_.n_pruned_split_searches;
+    search_splits = false;
+  }
+  if (search_splits) {
+    // The score gain and options of the best splitting assembly found so far.
+    std::optional<std::pair<int64_t,
+                            NodeChainAssembly::NodeChainAssemblyBuildingOptions>>
+        best_split;
+    int64_t n_evaluated = 0;
+    // Tie-breaks like `NodeChainAssemblyComparator` for assemblies of the same
+    // chain pair.
+    auto is_better = [](int64_t lhs_score_gain, MergeOrder lhs_merge_order,
+                        std::optional<int> lhs_slice_pos,
+                        int64_t rhs_score_gain, MergeOrder rhs_merge_order,
+                        std::optional<int> rhs_slice_pos) {
+      if (lhs_score_gain != rhs_score_gain)
+        return lhs_score_gain > rhs_score_gain;
+      if (lhs_merge_order == rhs_merge_order)
+        return *lhs_slice_pos > *rhs_slice_pos;
+      return lhs_merge_order > rhs_merge_order;
+    };
+    auto compare_and_update_best_assembly = [&](MergeOrder merge_order,
+                                                int slice_pos) {
+      NodeChainAssembly::NodeChainAssemblyBuildingOptions options = {
+          .merge_order = merge_order, .slice_pos = slice_pos};
+      ++n_evaluated;
+      std::optional<int64_t> score_gain =
+          edge_summary->ComputeScoreGain(options);
+      if (!score_gain.has_value()) return;
+      if (best_split.has_value()) {
+        if (!is_better(*score_gain, merge_order, slice_pos, best_split->first,
+                       best_split->second.merge_order,
+                       best_split->second.slice_pos))
+          return;
+      } else if (best_assembly.ok() &&
+                 !is_better(*score_gain, merge_order, slice_pos,
+                            best_assembly->score_gain(),
+                            best_assembly->merge_order(),
+                            best_assembly->slice_pos())) {
+        return;
+      }
+      best_split.emplace(*score_gain, options);
+    };
 
     // Consider splitting split_chain at every position if the number of bundles
     // does not exceed the splitting threshold.
@@ -295,11 +358,7 @@ void NodeChainBuilder::UpdateNodeChainAssembly(NodeChain &split_chain,
                                      MergeOrder::kUS2S1, MergeOrder::kS2US1}) {
         for (int slice_pos = 1; slice_pos != split_chain.node_bundles_.size();
              ++slice_pos) {
-          // Create the NodeChainAssembly representing this particular assembly.
-          compare_and_update_best_assembly(
-              NodeChainAssembly::BuildNodeChainAssembly(
-                  code_layout_scorer_, split_chain, unsplit_chain,
-                  {.merge_order = merge_order, .slice_pos = slice_pos}));
+          compare_and_update_best_assembly(merge_order, slice_pos);
         }
       }
     } else {
@@ -310,12 +369,8 @@ void NodeChainBuilder::UpdateNodeChainAssembly(NodeChain &split_chain,
                                 absl::Span<const MergeOrder> merge_orders) {
         if (slice_pos == 0 || slice_pos == split_chain.node_bundles_.size())
           return;
-        for (auto merge_order : merge_orders) {
-          compare_and_update_best_assembly(
-              NodeChainAssembly::BuildNodeChainAssembly(
-                  code_layout_scorer_, split_chain, unsplit_chain,
-                  {.merge_order = merge_order, .slice_pos = slice_pos}));
-        }
+        for (auto merge_order : merge_orders)
+          compare_and_update_best_assembly(merge_order, slice_pos);
       };
 
       // Find edges from the end of unsplit_chain to the middle of split_chain.
@@ -337,8 +392,18 @@ void NodeChainBuilder::UpdateNodeChainAssembly(NodeChain &split_chain,
                        {MergeOrder::kS1US2, MergeOrder::kS2S1U});
       });
     }
+
+    ChargeSplitBudget(n_evaluated);
+
+    if (best_split.has_value()) {
+      best_assembly = NodeChainAssembly::BuildNodeChainAssembly(
+          code_layout_scorer_, split_chain, unsplit_chain, best_split->second);
+      CHECK_OK(best_assembly);
+      DCHECK_EQ(best_assembly->score_gain(), best_split->first);
+    }
   }
   if (best_assembly.ok()) {
+    best_score_gain_ = std::max(best_score_gain_, best_assembly->score_gain());
     node_chain_assemblies_->InsertAssembly(std::move(*best_assembly));
   } else {
     node_chain_assemblies_->RemoveAssembly(
@@ -346,6 +411,40 @@ void NodeChainBuilder::UpdateNodeChainAssembly(NodeChain &split_chain,
   }
 }
 
+int64_t NodeChainBuilder::GetMaxInterChainScore(
+    NodeChain &split_chain, NodeChain &unsplit_chain) const {
+  int64_t max_score = 0;
+  for (auto [from_chain, to_chain] :
+       {std::make_pair(&split_chain, &unsplit_chain),
+        std::make_pair(&unsplit_chain, &split_chain)}) {
+    auto it = from_chain->inter_chain_out_edges_.find(to_chain);
+    if (it == from_chain->inter_chain_out_edges_.end()) continue;
+    for (const CFGEdge *edge : it->second)
+      max_score += code_layout_scorer_.GetMaxEdgeScore(*edge);
+  }
+  return max_score;
+}
+
+void NodeChainBuilder::ChargeSplitBudget(int64_t n) {
+  n_split_assemblies_evaluated_ += n;
+  const uint32_t budget =
+      code_layout_scorer_.code_layout_params().chain_split_budget();
+  if (budget == 0 || split_budget_exhausted_ ||
+      n_split_assemblies_evaluated_ <= budget)
+    return;
+  // Assemblies already queued stay valid. Any assembly updated from now on
+  // is rebuilt without splitting.
+  split_budget_exhausted_ = true;
+  ++stats_.n_split_budget_exhausted;
+  if (cfgs_.size() == 1) {
+    LOG(INFO) << "Chain split budget exhausted for function \""
+              << cfgs_.front()->GetPrimaryName().str() << "\".";
+  } else {
+    LOG(INFO) << "Chain split budget exhausted for " << cfgs_.size()
+              << " functions.";
+  }
+}
+
 // Initializes the chain assemblies (merging candidates) across all the chains.
 void NodeChainBuilder::InitChainAssemblies() {
   absl::flat_hash_set<std::pair<NodeChain *, NodeChain *>> visited;
@@ -389,6 +488,33 @@ void NodeChainBuilder::MergeChains(NodeChainAssembly assembly) {
   UpdateAssembliesAfterMerge(split_chain, unsplit_chain);
 }
 
+void NodeChainBuilder::DetachIsolatedChains() {
+  for (auto it = chains_.begin(); it != chains_.end();) {
+    NodeChain *chain = it->second.get();
+    bool isolated = true;
+    auto visit_edge = [&](CFGEdge &edge) {
+      if (!isolated || !ShouldVisitEdge(edge)) return;
+      // Nodes outside of chains are not laid out by this builder.
+      if (!edge.src()->bundle() || !edge.sink()->bundle()) return;
+      if (edge.src()->bundle() == edge.sink()->bundle()) return;
+      if (&GetNodeChain(edge.src()) != chain ||
+          &GetNodeChain(edge.sink()) != chain)
+        isolated = false;
+    };
+    chain->VisitEachNodeRef([&](const CFGNode &n) {
+      n.ForEachOutEdgeRef(visit_edge);
+      n.ForEachInEdgeRef(visit_edge);
+    });
+    if (!isolated) {
+      ++it;
+      continue;
+    }
+    ++stats_.n_isolated_chains;
+    isolated_chains_.push_back(std::move(it->second));
+    it = chains_.erase(it);
+  }
+}
+
 void NodeChainBuilder::InitChainEdges() {
   // Set up the outgoing edges for every chain
   for (auto &elem : chains_) {
@@ -3,6 +3,7 @@
 
 #include <map>
 #include <memory>
+#include <set>
 #include <utility>
 #include <vector>
 
@@ -115,6 +116,78 @@ class NodeChainAssemblyIterativeQueue : public NodeChainAssemblyQueue {
   absl::flat_hash_map<NodeChainPair, NodeChainAssembly> assemblies_;
 };
 
+// Indexed binary max-heap implementation of `NodeChainAssemblyQueue`.
+// `GetBestAssembly` has constant time complexity.
+// `RemoveAssembly` and `InsertAssembly` have logarithmic time complexity.
+// Since `NodeChainAssemblyComparator` is a strict total order over the
+// assemblies in the queue, this picks the same assembly as the other queues.
+class NodeChainAssemblyHeapQueue : public NodeChainAssemblyQueue {
+ public:
+  bool empty() const override { return heap_.empty(); }
+
+  NodeChainAssembly GetBestAssembly() const override { return heap_.front(); }
+
+  void RemoveAssembly(NodeChainPair chain_pair) override {
+    auto it = positions_.find(chain_pair);
+    if (it == positions_.end()) return;
+    const int pos = it->second;
+    positions_.erase(it);
+    const int last = heap_.size() - 1;
+    if (pos != last) {
+      heap_[pos] = std::move(heap_[last]);
+      positions_[heap_[pos].chain_pair()] = pos;
+    }
+    heap_.pop_back();
+    if (pos != last) Restore(pos);
+  }
+
+  void InsertAssembly(NodeChainAssembly assembly) override {
+    auto [it, inserted] = positions_.try_emplace(assembly.chain_pair(),
+                                                 heap_.size());
+    if (inserted) {
+      heap_.push_back(std::move(assembly));
+    } else {
+      heap_[it->second] = std::move(assembly);
+    }
+    Restore(it->second);
+  }
+
+ private:
+  bool Less(int a, int b) const {
+    return NodeChainAssembly::NodeChainAssemblyComparator()(heap_[a],
+                                                            heap_[b]);
+  }
+
+  void Swap(int a, int b) {
+    std::swap(heap_[a], heap_[b]);
+    positions_[heap_[a].chain_pair()] = a;
+    positions_[heap_[b].chain_pair()] = b;
+  }
+
+  // Moves the assembly at `pos` up or down until the heap property holds.
+  void Restore(int pos) {
+    while (pos > 0 && Less((pos - 1) / 2, pos)) {
+      Swap((pos - 1) / 2, pos);
+      pos = (pos - 1) / 2;
+    }
+    const int size = heap_.size();
+    while (true) {
+      int largest = pos;
+      for (int child : {2 * pos + 1, 2 * pos + 2}) {
+        if (child < size && Less(largest, child)) largest = child;
+      }
+      if (largest == pos) return;
+      Swap(pos, largest);
+      pos = largest;
+    }
+  }
+
+  // Assemblies in heap order: no assembly is better than its parent.
+  std::vector<NodeChainAssembly> heap_;
+  // Position of the assembly of each `NodeChain` pair in `heap_`.
+  absl::flat_hash_map<NodeChainPair, int> positions_;
+};
+
 // TODO(b/159842094): Make NodeChainBuilder exception-block aware.
 // This class builds BB chains for one or multiple CFGs.
 class NodeChainBuilder {
@@ -188,6 +261,12 @@ class NodeChainBuilder {
   // Returns the score for `chain`.
   int64_t ComputeScore(NodeChain &chain) const;
 
+  // Moves the chains which have no edges to other chains, like the chain of
+  // all cold nodes of a CFG, from `chains_` to `isolated_chains_`. Merging
+  // them can not gain any score, so they are left out of the chain edges and
+  // assemblies.
+  void DetachIsolatedChains();
+
   // Updates and removes the assemblies for `kept_chain` and `defunct_chain`.
   // This method is called after `defunct_chain` is merged into `kept_chain` and
   // serves to update all assemblies between `kept_chain` and other chains and
@@ -200,6 +279,23 @@ class NodeChainBuilder {
   void UpdateNodeChainAssembly(NodeChain &split_chain,
                                NodeChain &unsplit_chain);
 
+  // Returns an upper bound of the score of the edges between `split_chain`
+  // and `unsplit_chain`, which bounds the score gain of merging them without
+  // splitting.
+  int64_t GetMaxInterChainScore(NodeChain &split_chain,
+                                NodeChain &unsplit_chain) const;
+
+  // Returns whether splitting assemblies should still be considered, which is
+  // when `chain_split` is set and `chain_split_budget` is not exhausted.
+  bool ShouldSplitChains() const {
+    return code_layout_scorer_.code_layout_params().chain_split() &&
+           !split_budget_exhausted_;
+  }
+
+  // Accounts for `n` more evaluated splitting assemblies and marks the split
+  // budget exhausted when they exceed `chain_split_budget`.
+  void ChargeSplitBudget(int64_t n);
+
   // Returns whether `edge` should be considered in constructing the chains.
   bool ShouldVisitEdge(const CFGEdge &edge) {
     return edge.weight() != 0 && !edge.IsReturn() &&
@@ -219,9 +315,23 @@ class NodeChainBuilder {
   // as chains keep merging together, defunct chains are removed from this.
   std::map<uint64_t, std::unique_ptr<NodeChain>> chains_;
 
+  // Chains detached by `DetachIsolatedChains`, which are moved back to
+  // `chains_` before they are coalesced and returned.
+  std::vector<std::unique_ptr<NodeChain>> isolated_chains_;
+
   // Assembly (merge) candidates. This maps every pair of chains to its
   // (non-zero) merge score.
   std::unique_ptr<NodeChainAssemblyQueue> node_chain_assemblies_;
+
+  // Highest score gain of the assemblies inserted so far, against which
+  // `chain_assembly_pruning_fraction` prunes chain pairs.
+  int64_t best_score_gain_ = 0;
+
+  // Number of splitting assemblies evaluated so far.
+  int64_t n_split_assemblies_evaluated_ = 0;
+  // Whether `chain_split_budget` has been exceeded. Once set, only `kSU`
+  // assemblies are considered.
+  bool split_budget_exhausted_ = false;
 };
 
 // Returns vectors of nodes which form forced-fallthrough paths. These are
@@ -245,16 +355,17 @@ class NodeChainBuilder {
 // symbol ordinal.
 std::vector<std::vector<CFGNode *>> GetForcedPaths(const ControlFlowGraph &cfg);
 
-// Returns all mutually-forced edges as a map from their source to their sink.
-// These are the edges which -- based on the profile -- are the only outgoing
-// edges from their source and the only incoming edges to their sinks.
+// Returns all mutually-forced edges as an array indexed by the position of
+// their source in `cfg.nodes()`, holding the position of their sink, or -1 for
+// nodes without a forced outgoing edge. These are the edges which -- based on
+// the profile -- are the only outgoing edges from their source and the only
+// incoming edges to their sinks.
 // Note that the paths represented by these edges may include cycles.
-std::map<CFGNode *, CFGNode *, CFGNodePtrLessComparator> GetForcedEdges(
-    const ControlFlowGraph &cfg);
+std::vector<int> GetForcedEdges(const ControlFlowGraph &cfg);
 
-// Breaks cycles in the `path_next` map by cutting the edge sinking to the
-// smallest address in every cycle (hopefully a loop backedge).
-void BreakCycles(
-    std::map<CFGNode *, CFGNode *, CFGNodePtrLessComparator> &path_next);
+// Breaks cycles in `path_next`, as returned by `GetForcedEdges(cfg)`, by
+// cutting the edge sinking to the smallest address in every cycle (hopefully a
+// loop backedge).
+void BreakCycles(const ControlFlowGraph &cfg, std::vector<int> &path_next);
 }  // namespace devtools_crosstool_autofdo
 #endif  // AUTOFDO_LLVM_PROPELLER_NODE_CHAIN_BUILDER_H_
@@ -138,6 +138,126 @@ PropellerOptionsBuilder& PropellerOptionsBuilder::SetCodeLayoutParamsInterFuncti
   return *this;
 }
 
+PropellerOptionsBuilder& PropellerOptionsBuilder::SetCodeLayoutParamsLayoutThreads(uint32_t value) {
+  data_.mutable_code_layout_params()->set_layout_threads(value);
+  return *this;
+}
+
+PropellerOptionsBuilder&
+PropellerOptionsBuilder::SetCodeLayoutParamsChainSplitBudget(uint32_t value) {
+  data_.mutable_code_layout_params()->set_chain_split_budget(value);
+  return *this;
+}
+
+PropellerOptionsBuilder&
+PropellerOptionsBuilder::SetCodeLayoutParamsHotTextPageSize(uint32_t value) {
+  data_.mutable_code_layout_params()->set_hot_text_page_size(value);
+  return *this;
+}
+
+PropellerOptionsBuilder&
+PropellerOptionsBuilder::SetCodeLayoutParamsComputeOriginalScores(bool value) {
+  data_.mutable_code_layout_params()->set_compute_original_scores(value);
+  return *this;
+}
+
+PropellerOptionsBuilder&
+PropellerOptionsBuilder::SetCodeLayoutParamsChainAssemblyPruningFraction(
+    double value) {
+  data_.mutable_code_layout_params()->set_chain_assembly_pruning_fraction(
+      value);
+  return *this;
+}
+
+PropellerOptionsBuilder& PropellerOptionsBuilder::SetLbrAggregationThreads(
+    uint32_t value) {
+  data_.set_lbr_aggregation_threads(value);
+  return *this;
+}
+
+PropellerOptionsBuilder& PropellerOptionsBuilder::SetPerfParseThreads(
+    uint32_t value) {
+  data_.set_perf_parse_threads(value);
+  return *this;
+}
+
+PropellerOptionsBuilder& PropellerOptionsBuilder::SetCfgCreationThreads(
+    uint32_t value) {
+  data_.set_cfg_creation_threads(value);
+  return *this;
+}
+
+PropellerOptionsBuilder& PropellerOptionsBuilder::SetCfgSnapshotName(
+    const std::string & value) {
+  data_.set_cfg_snapshot_name(value);
+  return *this;
+}
+
+PropellerOptionsBuilder& PropellerOptionsBuilder::SetCfgSnapshotOutName(
+    const std::string & value) {
+  data_.set_cfg_snapshot_out_name(value);
+  return *this;
+}
+
+PropellerOptionsBuilder& PropellerOptionsBuilder::AddCodeLayoutSweepParams(
+    const PropellerCodeLayoutParameters& value) {
+  *data_.add_code_layout_sweep_params() = value;
+  return *this;
+}
+
+PropellerOptionsBuilder& PropellerOptionsBuilder::SetOutputThreads(
+    uint32_t value) {
+  data_.set_output_threads(value);
+  return *this;
+}
+
+PropellerOptionsBuilder& PropellerOptionsBuilder::SetLbrSampleFraction(
+    double value) {
+  data_.set_lbr_sample_fraction(value);
+  return *this;
+}
+
+PropellerOptionsBuilder& PropellerOptionsBuilder::SetLbrSampleSeed(
+    uint64_t value) {
+  data_.set_lbr_sample_seed(value);
+  return *this;
+}
+
+PropellerOptionsBuilder&
+PropellerOptionsBuilder::SetEstimateLbrSampleFractionError(bool value) {
+  data_.set_estimate_lbr_sample_fraction_error(value);
+  return *this;
+}
+
+PropellerOptionsBuilder& PropellerOptionsBuilder::SetLbrAggregationCacheDir(
+    const std::string& value) {
+  data_.set_lbr_aggregation_cache_dir(value);
+  return *this;
+}
+
+PropellerOptionsBuilder& PropellerOptionsBuilder::SetCfgDumpMaxFunctions(
+    uint32_t value) {
+  data_.set_cfg_dump_max_functions(value);
+  return *this;
+}
+
+PropellerOptionsBuilder& PropellerOptionsBuilder::SetJobs(uint32_t value) {
+  data_.set_jobs(value);
+  return *this;
+}
+
+PropellerOptionsBuilder& PropellerOptionsBuilder::SetHotCoverage(
+    double value) {
+  data_.set_hot_coverage(value);
+  return *this;
+}
+
+PropellerOptionsBuilder& PropellerOptionsBuilder::SetCompactColdFunctions(
+    bool value) {
+  data_.set_compact_cold_functions(value);
+  return *this;
+}
+
 PropellerCodeLayoutParametersBuilder&
 PropellerCodeLayoutParametersBuilder::SetFallthroughWeight(uint32_t value) {
   data_.set_fallthrough_weight(value);
@@ -211,4 +331,35 @@ PropellerCodeLayoutParametersBuilder::SetInterFunctionReordering(bool value) {
   return *this;
 }
 
+PropellerCodeLayoutParametersBuilder&
+PropellerCodeLayoutParametersBuilder::SetLayoutThreads(uint32_t value) {
+  data_.set_layout_threads(value);
+  return *this;
+}
+
+PropellerCodeLayoutParametersBuilder&
+PropellerCodeLayoutParametersBuilder::SetChainSplitBudget(uint32_t value) {
+  data_.set_chain_split_budget(value);
+  return *this;
+}
+
+PropellerCodeLayoutParametersBuilder&
+PropellerCodeLayoutParametersBuilder::SetHotTextPageSize(uint32_t value) {
+  data_.set_hot_text_page_size(value);
+  return *this;
+}
+
+PropellerCodeLayoutParametersBuilder&
+PropellerCodeLayoutParametersBuilder::SetComputeOriginalScores(bool value) {
+  data_.set_compute_original_scores(value);
+  return *this;
+}
+
+PropellerCodeLayoutParametersBuilder&
+PropellerCodeLayoutParametersBuilder::SetChainAssemblyPruningFraction(
+    double value) {
+  data_.set_chain_assembly_pruning_fraction(value);
+  return *this;
+}
+
 }  // namespace devtools_crosstool_autofdo
@@ -46,6 +46,28 @@ class PropellerOptionsBuilder {
   PropellerOptionsBuilder& SetCodeLayoutParamsReorderHotBlocks(bool value);
   PropellerOptionsBuilder& SetCodeLayoutParamsSplitFunctions(bool value);
   PropellerOptionsBuilder& SetCodeLayoutParamsInterFunctionReordering(bool value);
+  PropellerOptionsBuilder& SetCodeLayoutParamsLayoutThreads(uint32_t value);
+  PropellerOptionsBuilder& SetCodeLayoutParamsChainSplitBudget(uint32_t value);
+  PropellerOptionsBuilder& SetCodeLayoutParamsHotTextPageSize(uint32_t value);
+  PropellerOptionsBuilder& SetCodeLayoutParamsComputeOriginalScores(bool value);
+  PropellerOptionsBuilder& SetCodeLayoutParamsChainAssemblyPruningFraction(
+      double value);
+  PropellerOptionsBuilder& SetLbrAggregationThreads(uint32_t value);
+  PropellerOptionsBuilder& SetPerfParseThreads(uint32_t value);
+  PropellerOptionsBuilder& SetCfgCreationThreads(uint32_t value);
+  PropellerOptionsBuilder& SetCfgSnapshotName(const std::string & value);
+  PropellerOptionsBuilder& SetCfgSnapshotOutName(const std::string & value);
+  PropellerOptionsBuilder& AddCodeLayoutSweepParams(
+      const PropellerCodeLayoutParameters& value);
+  PropellerOptionsBuilder& SetOutputThreads(uint32_t value);
+  PropellerOptionsBuilder& SetLbrSampleFraction(double value);
+  PropellerOptionsBuilder& SetLbrSampleSeed(uint64_t value);
+  PropellerOptionsBuilder& SetEstimateLbrSampleFractionError(bool value);
+  PropellerOptionsBuilder& SetLbrAggregationCacheDir(const std::string & value);
+  PropellerOptionsBuilder& SetCfgDumpMaxFunctions(uint32_t value);
+  PropellerOptionsBuilder& SetJobs(uint32_t value);
+  PropellerOptionsBuilder& SetHotCoverage(double value);
+  PropellerOptionsBuilder& SetCompactColdFunctions(bool value);
 
  private:
   PropellerOptions data_;
@@ -80,6 +102,12 @@ class PropellerCodeLayoutParametersBuilder {
   PropellerCodeLayoutParametersBuilder& SetSplitFunctions(bool value);
   PropellerCodeLayoutParametersBuilder& SetReorderHotBlocks(bool value);
   PropellerCodeLayoutParametersBuilder& SetInterFunctionReordering(bool value);
+  PropellerCodeLayoutParametersBuilder& SetLayoutThreads(uint32_t value);
+  PropellerCodeLayoutParametersBuilder& SetChainSplitBudget(uint32_t value);
+  PropellerCodeLayoutParametersBuilder& SetHotTextPageSize(uint32_t value);
+  PropellerCodeLayoutParametersBuilder& SetComputeOriginalScores(bool value);
+  PropellerCodeLayoutParametersBuilder& SetChainAssemblyPruningFraction(
+      double value);
 
  private:
   PropellerCodeLayoutParameters data_;
@@ -0,0 +1,92 @@
+#include "llvm_propeller_prefetching_perf_data_provider.h"
+
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <thread>  // NOLINT(build/c++11)
+#include <utility>
+
+#include "llvm_propeller_perf_data_provider.h"
+#include "third_party/abseil/absl/status/status.h"
+#include "third_party/abseil/absl/status/statusor.h"
+#include "third_party/abseil/absl/synchronization/mutex.h"
+#include "llvm/Support/MemoryBuffer.h"
+
+namespace devtools_crosstool_autofdo {
+namespace {
+// Reads a byte of every page of `buffer`, so that a buffer mapped from a file
+// is read into memory.
+void TouchPages(const llvm::MemoryBuffer &buffer) {
+  constexpr int64_t kPageSize = 4096;
+  const volatile char *data = buffer.getBufferStart();
+  char sum = 0;
+  for (int64_t offset = 0; offset < buffer.getBufferSize();
+       offset += kPageSize)
+    sum += data[offset];
+  (void)sum;
+}
+}  // namespace
+
+PrefetchingPerfDataProvider::PrefetchingPerfDataProvider(
+    std::unique_ptr<PerfDataProvider> provider, int max_buffers,
+    int64_t memory_budget)
+    : provider_(std::move(provider)),
+      max_buffers_(max_buffers < 1 ? 1 : max_buffers),
+      memory_budget_(memory_budget) {
+  prefetch_thread_ = std::thread([this]() { Prefetch(); });
+}
+
+PrefetchingPerfDataProvider::~PrefetchingPerfDataProvider() {
+  {
+    absl::MutexLock lock(&mutex_);
+    stopping_ = true;
+  }
+  prefetch_thread_.join();
+}
+
+void PrefetchingPerfDataProvider::Prefetch() {
+  while (true) {
+    {
+      absl::MutexLock lock(&mutex_);
+      auto can_fetch = [this]() ABSL_EXCLUSIVE_LOCKS_REQUIRED(mutex_) {
+        return stopping_ || (static_cast<int>(buffers_.size()) < max_buffers_ &&
+                             buffered_bytes_ < memory_budget_) ||
+               buffers_.empty();
+      };
+      mutex_.Await(absl::Condition(&can_fetch));
+      if (stopping_) return;
+    }
+    // The wrapped provider is only used by this thread, so it is called
+    // without holding the lock.
+    absl::StatusOr<std::optional<BufferHandle>> next = provider_->GetNext();
+    if (next.ok() && next->has_value()) TouchPages(*(*next)->buffer);
+
+    absl::MutexLock lock(&mutex_);
+    if (!next.ok() || !next->has_value()) {
+      status_ = next.status();
+      exhausted_ = true;
+      return;
+    }
+    buffered_bytes_ += (*next)->buffer->getBufferSize();
+    buffers_.push_back(std::move(**next));
+  }
+}
+
+absl::StatusOr<std::optional<PerfDataProvider::BufferHandle>>
+PrefetchingPerfDataProvider::GetNext() {
+  absl::MutexLock lock(&mutex_);
+  auto has_next = [this]() ABSL_EXCLUSIVE_LOCKS_REQUIRED(mutex_) {
+    return !buffers_.empty() || exhausted_;
+  };
+  mutex_.Await(absl::Condition(&has_next));
+  if (buffers_.empty()) {
+    if (!status_.ok()) return status_;
+    return std::nullopt;
+  }
+  BufferHandle handle = std::move(buffers_.front());
+  buffers_.pop_front();
+  buffered_bytes_ -= handle.buffer->getBufferSize();
+  return handle;
+}
+
+}  // namespace devtools_crosstool_autofdo
@@ -0,0 +1,75 @@
+#ifndef AUTOFDO_LLVM_PROPELLER_PREFETCHING_PERF_DATA_PROVIDER_H_
+#define AUTOFDO_LLVM_PROPELLER_PREFETCHING_PERF_DATA_PROVIDER_H_
+
+#if defined(HAVE_LLVM)
+
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <optional>
+#include <thread>  // NOLINT(build/c++11)
+
+#include "llvm_propeller_perf_data_provider.h"
+#include "third_party/abseil/absl/base/thread_annotations.h"
+#include "third_party/abseil/absl/status/status.h"
+#include "third_party/abseil/absl/status/statusor.h"
+#include "third_party/abseil/absl/synchronization/mutex.h"
+
+namespace devtools_crosstool_autofdo {
+
+// A perf.data provider that reads the buffers of another provider ahead on a
+// background thread, so that fetching the next buffers, e.g. from a network
+// file system or an object store, overlaps with parsing the current one.
+//
+// At most `max_buffers` buffers are held before they are returned by
+// `GetNext`. A buffer is only fetched while the held buffers take less than
+// `memory_budget` bytes, so the budget is exceeded by at most one buffer. The
+// pages of every fetched buffer are touched, so that buffers mapped from files
+// are read in by the background thread too.
+//
+// `GetNext` returns the buffers in the order of the wrapped provider. Once the
+// wrapped provider fails, the buffers fetched before are returned and then its
+// error.
+class PrefetchingPerfDataProvider : public PerfDataProvider {
+ public:
+  PrefetchingPerfDataProvider(std::unique_ptr<PerfDataProvider> provider,
+                              int max_buffers, int64_t memory_budget);
+
+  PrefetchingPerfDataProvider(const PrefetchingPerfDataProvider &) = delete;
+  PrefetchingPerfDataProvider &operator=(const PrefetchingPerfDataProvider &) =
+      delete;
+
+  // Stops prefetching, waiting for a fetch in progress to finish.
+  ~PrefetchingPerfDataProvider() override;
+
+  absl::StatusOr<std::optional<PerfDataProvider::BufferHandle>> GetNext()
+      override;
+
+ private:
+  // Body of `prefetch_thread_`.
+  void Prefetch();
+
+  std::unique_ptr<PerfDataProvider> provider_;
+  const int max_buffers_;
+  const int64_t memory_budget_;
+
+  absl::Mutex mutex_;
+  // Buffers fetched and not returned yet, in order.
+  std::deque<BufferHandle> buffers_ ABSL_GUARDED_BY(mutex_);
+  // Total size of `buffers_`.
+  int64_t buffered_bytes_ ABSL_GUARDED_BY(mutex_) = 0;
+  // Set once the wrapped provider has no more buffers or failed with
+  // `status_`.
+  bool exhausted_ ABSL_GUARDED_BY(mutex_) = false;
+  absl::Status status_ ABSL_GUARDED_BY(mutex_);
+  // Set by the destructor to stop prefetching.
+  bool stopping_ ABSL_GUARDED_BY(mutex_) = false;
+
+  std::thread prefetch_thread_;
+};
+
+}  // namespace devtools_crosstool_autofdo
+
+#endif  // HAVE_LLVM
+
+#endif  // AUTOFDO_LLVM_PROPELLER_PREFETCHING_PERF_DATA_PROVIDER_H_
@@ -0,0 +1,102 @@
+#include "llvm_propeller_prefetching_perf_data_provider.h"
+
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "llvm_propeller_perf_data_provider.h"
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+#include "third_party/abseil/absl/status/status.h"
+#include "third_party/abseil/absl/status/statusor.h"
+#include "third_party/abseil/absl/strings/str_cat.h"
+#include "llvm/Support/MemoryBuffer.h"
+
+namespace devtools_crosstool_autofdo {
+namespace {
+
+using ::testing::Eq;
+using ::testing::HasSubstr;
+using ::testing::status::IsOkAndHolds;
+using ::testing::status::StatusIs;
+
+// Provides `num_buffers` buffers of `buffer_size` bytes and then `status`, if
+// it is not ok. Counts the buffers fetched.
+class FakePerfDataProvider : public PerfDataProvider {
+ public:
+  FakePerfDataProvider(int num_buffers, int buffer_size, absl::Status status,
+                       int *fetched)
+      : num_buffers_(num_buffers),
+        buffer_size_(buffer_size),
+        status_(std::move(status)),
+        fetched_(fetched) {}
+
+  absl::StatusOr<std::optional<PerfDataProvider::BufferHandle>> GetNext()
+      override {
+    if (*fetched_ == num_buffers_) {
+      if (!status_.ok()) return status_;
+      return std::nullopt;
+    }
+    std::string description = absl::StrCat("buffer ", (*fetched_)++);
+    return BufferHandle{
+        .description = description,
+        .buffer = llvm::MemoryBuffer::getMemBufferCopy(
+            std::string(buffer_size_, 'x'), description)};
+  }
+
+ private:
+  const int num_buffers_;
+  const int buffer_size_;
+  const absl::Status status_;
+  int *fetched_;
+};
+
+TEST(PrefetchingPerfDataProvider, ReturnsBuffersInOrder) {
+  int fetched = 0;
+  PrefetchingPerfDataProvider provider(
+      std::make_unique<FakePerfDataProvider>(3, 100, absl::OkStatus(),
+                                             &fetched),
+      /*max_buffers=*/2, /*memory_budget=*/1 << 20);
+  for (int i = 0; i < 3; ++i) {
+    auto handle = provider.GetNext();
+    ASSERT_TRUE(handle.ok() && handle->has_value());
+    EXPECT_EQ((*handle)->description, absl::StrCat("buffer ", i));
+    EXPECT_EQ((*handle)->buffer->getBufferSize(), 100);
+  }
+  EXPECT_THAT(provider.GetNext(), IsOkAndHolds(Eq(std::nullopt)));
+  EXPECT_THAT(provider.GetNext(), IsOkAndHolds(Eq(std::nullopt)));
+}
+
+TEST(PrefetchingPerfDataProvider, ReturnsBuffersBeforeError) {
+  int fetched = 0;
+  PrefetchingPerfDataProvider provider(
+      std::make_unique<FakePerfDataProvider>(
+          1, 100, absl::UnavailableError("connection lost"), &fetched),
+      /*max_buffers=*/4, /*memory_budget=*/1 << 20);
+  auto handle = provider.GetNext();
+  ASSERT_TRUE(handle.ok() && handle->has_value());
+  EXPECT_EQ((*handle)->description, "buffer 0");
+  EXPECT_THAT(provider.GetNext(), StatusIs(absl::StatusCode::kUnavailable,
+                                           HasSubstr("connection lost")));
+}
+
+TEST(PrefetchingPerfDataProvider, StopsAtMemoryBudget) {
+  int fetched = 0;
+  {
+    PrefetchingPerfDataProvider provider(
+        std::make_unique<FakePerfDataProvider>(10, 100, absl::OkStatus(),
+                                               &fetched),
+        /*max_buffers=*/8, /*memory_budget=*/150);
+    auto handle = provider.GetNext();
+    ASSERT_TRUE(handle.ok() && handle->has_value());
+  }
+  // One buffer was returned and at most two were held within the budget,
+  // possibly with one more in flight when the provider was destroyed.
+  EXPECT_LE(fetched, 4);
+}
+
+}  // namespace
+}  // namespace devtools_crosstool_autofdo
@@ -3,15 +3,20 @@
 #if defined(HAVE_LLVM)
 
 #include <algorithm>
+#include <atomic>
 #include <filesystem>
 #include <fstream>
 #include <memory>
+#include <numeric>
 #include <ostream>
+#include <sstream>
 #include <string>
+#include <thread>  // NOLINT(build/c++11)
 #include <utility>
 #include <vector>
 
 #include "llvm_propeller_abstract_whole_program_info.h"
+#include "llvm_propeller_cfg_snapshot.h"
 #include "llvm_propeller_code_layout.h"
 #include "llvm_propeller_file_perf_data_provider.h"
 #include "llvm_propeller_formatting.h"
@@ -19,13 +24,16 @@
 #include "llvm_propeller_statistics.h"
 #include "llvm_propeller_whole_program_info.h"
 #include "status_consumer_registry.h"
+#include "stage_metrics.h"
 #include "status_provider.h"
+#include "trace_events.h"
 #include "third_party/abseil/absl/memory/memory.h"
 #include "third_party/abseil/absl/status/status.h"
 #include "third_party/abseil/absl/strings/str_cat.h"
 #include "third_party/abseil/absl/strings/str_format.h"
 #include "third_party/abseil/absl/strings/str_join.h"
 #include "third_party/abseil/absl/strings/string_view.h"
+#include "third_party/abseil/absl/types/span.h"
 #include "llvm/ADT/SmallVector.h"
 #include "llvm/ADT/StringRef.h"
 #include "llvm/Object/ELFObjectFile.h"
@@ -34,9 +42,34 @@
 
 namespace {
 using ::devtools_crosstool_autofdo::FunctionClusterInfo;
+
+// Returns the indexes of the functions of `all_functions_cluster_info` whose
+// cfgs are dumped, in their order in `all_functions_cluster_info`: the
+// `max_functions` functions with the highest entry frequency, or all functions
+// if `max_functions` is 0.
+std::vector<int> SelectCfgsToDump(
+    const std::vector<FunctionClusterInfo> &all_functions_cluster_info,
+    int max_functions) {
+  std::vector<int> indexes(all_functions_cluster_info.size());
+  std::iota(indexes.begin(), indexes.end(), 0);
+  if (max_functions == 0 || max_functions >= indexes.size()) return indexes;
+  auto entry_freq = [&](int i) {
+    return all_functions_cluster_info[i].cfg->GetEntryNode()->freq();
+  };
+  std::stable_sort(indexes.begin(), indexes.end(), [&](int a, int b) {
+    return entry_freq(a) > entry_freq(b);
+  });
+  indexes.resize(max_functions);
+  std::sort(indexes.begin(), indexes.end());
+  return indexes;
+}
+
+// Dumps the cfgs selected by `SelectCfgsToDump` in dot format into
+// `cfg_dump_dir_name`, along with an index file. The cfgs are formatted and
+// written on `num_threads` threads.
 void DumpCfgs(
     const std::vector<FunctionClusterInfo> &all_functions_cluster_info,
-    absl::string_view cfg_dump_dir_name) {
+    absl::string_view cfg_dump_dir_name, int max_functions, int num_threads) {
   // Create the cfg dump directory and the cfg index file.
   std::filesystem::create_directories(cfg_dump_dir_name);
   auto cfg_index_file =
@@ -50,31 +83,97 @@ void DumpCfgs(
                                 " ")
                << "\n";
 
-  for (const FunctionClusterInfo &func_layout_info :
-       all_functions_cluster_info) {
-    // Dump hot cfgs into the given directory.
-    auto func_addr_str = absl::StrCat(
-        "0x", absl::Hex(func_layout_info.cfg->GetEntryNode()->addr()));
+  const std::vector<int> dumped_functions =
+      SelectCfgsToDump(all_functions_cluster_info, max_functions);
+  for (int i : dumped_functions) {
+    const FunctionClusterInfo &func_layout_info = all_functions_cluster_info[i];
     cfg_index_os << func_layout_info.cfg->GetPrimaryName().str() << " "
-                 << func_addr_str << " " << func_layout_info.cfg->nodes().size()
-                 << " " << func_layout_info.clusters.size() << " "
+                 << absl::StrCat("0x", absl::Hex(func_layout_info.cfg
+                                                     ->GetEntryNode()
+                                                     ->addr()))
+                 << " " << func_layout_info.cfg->nodes().size() << " "
+                 << func_layout_info.clusters.size() << " "
                  << func_layout_info.original_score.intra_score << " "
                  << func_layout_info.optimized_score.intra_score << "\n";
+  }
 
+  auto dump_cfg = [&](const FunctionClusterInfo &func_layout_info) {
     // Use the address of the function as the CFG filename for uniqueness.
-    auto cfg_dump_file = std::filesystem::path(cfg_dump_dir_name) /
-                         absl::StrCat(func_addr_str, ".dot");
-    std::ofstream cfg_dump_os(cfg_dump_file, std::ofstream::out);
-    CHECK(cfg_dump_os.good())
-        << "Failed to open " << cfg_dump_file << " for writing.";
-
+    auto cfg_dump_file =
+        std::filesystem::path(cfg_dump_dir_name) /
+        absl::StrCat("0x",
+                     absl::Hex(func_layout_info.cfg->GetEntryNode()->addr()),
+                     ".dot");
     absl::flat_hash_map<int, int> layout_index_map;
     for (auto &cluster : func_layout_info.clusters)
       for (int bbi = 0; bbi < cluster.bb_indexes.size(); ++bbi)
         layout_index_map.insert(
             {cluster.bb_indexes[bbi], cluster.layout_index + bbi});
 
-    func_layout_info.cfg->WriteDotFormat(cfg_dump_os, layout_index_map);
+    // Format the whole cfg before writing it with a single call.
+    std::ostringstream cfg_dump;
+    func_layout_info.cfg->WriteDotFormat(cfg_dump, layout_index_map);
+    std::ofstream cfg_dump_os(cfg_dump_file, std::ofstream::out);
+    CHECK(cfg_dump_os.good())
+        << "Failed to open " << cfg_dump_file << " for writing.";
+    const std::string contents = cfg_dump.str();
+    cfg_dump_os.write(contents.data(), contents.size());
+  };
+  num_threads = std::min<int>(num_threads, dumped_functions.size());
+  if (num_threads <= 1) {
+    for (int i : dumped_functions) dump_cfg(all_functions_cluster_info[i]);
+    return;
+  }
+  std::atomic<int> next_function = 0;
+  std::vector<std::thread> workers;
+  workers.reserve(num_threads);
+  for (int t = 0; t != num_threads; ++t) {
+    workers.emplace_back([&]() {
+      for (int i = next_function++; i < dumped_functions.size();
+           i = next_function++)
+        dump_cfg(all_functions_cluster_info[dumped_functions[i]]);
+    });
+  }
+  for (std::thread &worker : workers) worker.join();
+}
+
+// Number of functions whose cluster file lines are formatted by one task.
+constexpr int kFunctionsPerOutputChunk = 1024;
+// Rough output sizes used to preallocate the output buffers.
+constexpr int kEstimatedClusterBytesPerFunction = 64;
+constexpr int kEstimatedSymbolOrderBytesPerCluster = 32;
+
+// Appends the cluster file lines of one function to `out`.
+void AppendClusterLines(const FunctionClusterInfo &func_layout_info,
+                        bool verbose_cluster_output, std::string &out) {
+  // Print all alias names of the function, separated by '/'.
+  out.push_back('!');
+  const auto &names = func_layout_info.cfg->names();
+  for (int i = 0; i != names.size(); ++i) {
+    if (i) out.push_back('/');
+    out.append(names[i].data(), names[i].size());
+  }
+  out.push_back('\n');
+
+  if (verbose_cluster_output) {
+    // Print the layout score for intra-function and inter-function edges
+    // involving this function. This information allows us to study the impact
+    // on layout score on each individual function.
+    absl::StrAppendFormat(
+        &out, "#ext-tsp score: [intra: %llu -> %llu] [inter: %llu -> %llu]\n",
+        func_layout_info.original_score.intra_score,
+        func_layout_info.optimized_score.intra_score,
+        func_layout_info.original_score.inter_out_score,
+        func_layout_info.optimized_score.inter_out_score);
+    // Print out the frequency of the function entry node.
+    absl::StrAppendFormat(&out, "#entry-freq %llu\n",
+                          func_layout_info.cfg->GetEntryNode()->freq());
+  }
+  for (const FunctionClusterInfo::BBCluster &cluster :
+       func_layout_info.clusters) {
+    for (int bbi = 0; bbi < cluster.bb_indexes.size(); ++bbi)
+      absl::StrAppend(&out, bbi ? " " : "!!", cluster.bb_indexes[bbi]);
+    out.push_back('\n');
   }
 }
 }  // namespace
@@ -85,6 +184,72 @@ using ::devtools_crosstool_autofdo::PropellerOptions;
 using ::llvm::Optional;
 using ::llvm::StringRef;
 
+namespace {
+// Returns `opts` with every unset thread count set to `opts.jobs()`.
+PropellerOptions ApplyJobs(PropellerOptions opts) {
+  const uint32_t jobs = opts.jobs();
+  if (jobs == 0) return opts;
+  if (!opts.has_lbr_aggregation_threads())
+    opts.set_lbr_aggregation_threads(jobs);
+  if (!opts.has_perf_parse_threads()) opts.set_perf_parse_threads(jobs);
+  if (!opts.has_cfg_creation_threads()) opts.set_cfg_creation_threads(jobs);
+  if (!opts.has_output_threads()) opts.set_output_threads(jobs);
+  if (!opts.code_layout_params().has_layout_threads())
+    opts.mutable_code_layout_params()->set_layout_threads(jobs);
+  return opts;
+}
+
+// Lays out the hot cfgs of `writer` with the code layout parameters of `opts`
+// and writes the profiles.
+absl::Status LayOutAndWrite(const PropellerOptions &opts,
+                            PropellerProfWriter &writer,
+                            DefaultStatusProvider *codelayout_status) {
+  std::vector<PropellerCodeLayoutParameters> sweep_params;
+  for (const PropellerCodeLayoutParameters &params :
+       opts.code_layout_sweep_params()) {
+    sweep_params.push_back(opts.code_layout_params());
+    sweep_params.back().MergeFrom(params);
+  }
+  std::vector<CodeLayoutSweepResult> sweep_results;
+  std::vector<FunctionClusterInfo> layout_per_function;
+  {
+    ScopedStageTimer timer("OrderAll");
+    layout_per_function =
+        devtools_crosstool_autofdo::CodeLayout(
+            opts.code_layout_params(),
+            writer.whole_program_info()->GetHotCfgs(), codelayout_status)
+            .OrderAllWithSweep(sweep_params, &sweep_results);
+  }
+  for (const CodeLayoutSweepResult &result : sweep_results) {
+    LOG(INFO) << absl::StreamFormat(
+        "Layout sweep {%s}: [intra: %llu] [inter: %llu] [reference intra: "
+        "%llu] [reference inter: %llu]",
+        result.code_layout_params.ShortDebugString(), result.score.intra_score,
+        result.score.inter_out_score, result.reference_score.intra_score,
+        result.reference_score.inter_out_score);
+  }
+  bool write_ok;
+  {
+    ScopedStageTimer timer("Write");
+    write_ok = writer.Write(layout_per_function);
+  }
+  if (!write_ok)
+    return absl::InternalError("Failed to compute code layout result");
+  return absl::OkStatus();
+}
+
+// RegistryStopper calls "Stop" on all registered status consumers before
+// exiting. Because the stopper "stops" consumers that have a reference to
+// the main status provider, it must be declared after the main status
+// provider so it is deleted first.
+struct RegistryStopper {
+  ~RegistryStopper() {
+    if (registry) registry->Stop();
+  }
+  StatusConsumerRegistry *registry = nullptr;
+};
+}  // namespace
+
 absl::Status GeneratePropellerProfiles(const PropellerOptions &opts) {
   return GeneratePropellerProfiles(
       opts, std::make_unique<FilePerfDataProvider>(std::vector<std::string>(
@@ -92,8 +257,9 @@ absl::Status GeneratePropellerProfiles(const PropellerOptions &opts) {
 }
 
 absl::Status GeneratePropellerProfiles(
-    const PropellerOptions &opts,
+    const PropellerOptions &input_opts,
     std::unique_ptr<PerfDataProvider> perf_data_provider) {
+  const PropellerOptions opts = ApplyJobs(input_opts);
   MultiStatusProvider main_status("generate propeller profiles");
   auto *frontend_status = new MultiStatusProvider("frontend");
   main_status.AddStatusProvider(50, absl::WrapUnique(frontend_status));
@@ -101,16 +267,8 @@ absl::Status GeneratePropellerProfiles(
   main_status.AddStatusProvider(50, absl::WrapUnique(codelayout_status));
   auto *writefile_status = new DefaultStatusProvider("result_writer");
   main_status.AddStatusProvider(1, absl::WrapUnique(writefile_status));
-  // RegistryStopper calls "Stop" on all registered status consumers before
-  // exiting. Because the stopper "stops" consumers that have a reference to
-  // main_status, we must declared "stopper" after "main_status" so "stopper" is
-  // deleted before "main_status".
-  struct RegistryStopper {
-    ~RegistryStopper() {
-      if (registry) registry->Stop();
-    }
-    StatusConsumerRegistry *registry = nullptr;
-  } stopper;
+  // "stopper" must be declared after "main_status", see RegistryStopper.
+  RegistryStopper stopper;
   if (opts.http()) {
     stopper.registry =
         &devtools_crosstool_autofdo::StatusConsumerRegistry::GetInstance();
@@ -120,15 +278,87 @@ absl::Status GeneratePropellerProfiles(
       opts, std::move(perf_data_provider), frontend_status);
   if (!writer)
     return absl::InternalError("Failed to create PropellerProfWriter object");
+  if (opts.has_cfg_snapshot_out_name()) {
+    absl::Status snapshot_status = WriteCfgSnapshot(
+        *writer->whole_program_info(), opts.cfg_snapshot_out_name());
+    if (!snapshot_status.ok()) return snapshot_status;
+  }
   frontend_status->SetDone();
 
-  const std::vector<FunctionClusterInfo> layout_per_function =
-      devtools_crosstool_autofdo::CodeLayout(
-          opts.code_layout_params(), writer->whole_program_info()->GetHotCfgs())
-          .OrderAll();
+  absl::Status status = LayOutAndWrite(opts, *writer, codelayout_status);
+  if (!status.ok()) return status;
+  codelayout_status->SetDone();
+  writefile_status->SetDone();
+  return absl::OkStatus();
+}
+
+absl::Status GeneratePropellerProfilesOfBinaries(
+    absl::Span<const PropellerOptions> binary_opts) {
+  if (binary_opts.empty())
+    return absl::InvalidArgumentError("No binaries are given.");
+  return GeneratePropellerProfilesOfBinaries(
+      binary_opts,
+      std::make_unique<FilePerfDataProvider>(
+          std::vector<std::string>(binary_opts.front().perf_names().begin(),
+                                   binary_opts.front().perf_names().end())));
+}
+
+absl::Status GeneratePropellerProfilesOfBinaries(
+    absl::Span<const PropellerOptions> input_binary_opts,
+    std::unique_ptr<PerfDataProvider> perf_data_provider) {
+  if (input_binary_opts.empty())
+    return absl::InvalidArgumentError("No binaries are given.");
+  std::vector<PropellerOptions> binary_opts;
+  binary_opts.reserve(input_binary_opts.size());
+  for (const PropellerOptions &opts : input_binary_opts)
+    binary_opts.push_back(ApplyJobs(opts));
+  MultiStatusProvider main_status("generate propeller profiles");
+  auto *frontend_status = new MultiStatusProvider("frontend");
+  main_status.AddStatusProvider(50, absl::WrapUnique(frontend_status));
+  auto *codelayout_status = new DefaultStatusProvider("codelayout");
+  main_status.AddStatusProvider(50, absl::WrapUnique(codelayout_status));
+  auto *writefile_status = new DefaultStatusProvider("result_writer");
+  main_status.AddStatusProvider(1, absl::WrapUnique(writefile_status));
+  // "stopper" must be declared after "main_status", see RegistryStopper.
+  RegistryStopper stopper;
+  if (binary_opts.front().http()) {
+    stopper.registry =
+        &devtools_crosstool_autofdo::StatusConsumerRegistry::GetInstance();
+    stopper.registry->Start(main_status);
+  }
+
+  std::vector<std::unique_ptr<PropellerWholeProgramInfo>> whole_program_infos;
+  std::vector<PropellerWholeProgramInfo *> whole_program_info_ptrs;
+  for (const PropellerOptions &opts : binary_opts) {
+    if (opts.has_cfg_snapshot_name() || opts.has_cfg_snapshot_out_name()) {
+      return absl::InvalidArgumentError(
+          "Cfg snapshots are not supported with multiple binaries.");
+    }
+    // The perf data is read by CreateCfgsOfBinaries, for all binaries at once.
+    std::unique_ptr<PropellerWholeProgramInfo> whole_program_info =
+        PropellerWholeProgramInfo::Create(opts, /*perf_data_provider=*/nullptr,
+                                          frontend_status);
+    if (!whole_program_info) {
+      return absl::InternalError(absl::StrCat(
+          "Failed to read binary '", opts.binary_name(), "'."));
+    }
+    whole_program_info_ptrs.push_back(whole_program_info.get());
+    whole_program_infos.push_back(std::move(whole_program_info));
+  }
+  absl::Status status = PropellerWholeProgramInfo::CreateCfgsOfBinaries(
+      whole_program_info_ptrs, *perf_data_provider,
+      CfgCreationMode::kOnlyHotFunctions);
+  if (!status.ok()) return status;
+  frontend_status->SetDone();
+
+  for (int i = 0; i != binary_opts.size(); ++i) {
+    LOG(INFO) << "Laying out '" << binary_opts[i].binary_name() << "'.";
+    std::unique_ptr<PropellerProfWriter> writer = PropellerProfWriter::Create(
+        binary_opts[i], std::move(whole_program_infos[i]));
+    status = LayOutAndWrite(binary_opts[i], *writer, codelayout_status);
+    if (!status.ok()) return status;
+  }
   codelayout_status->SetDone();
-  if (!writer->Write(layout_per_function))
-    return absl::InternalError("Failed to compute code layout result");
   writefile_status->SetDone();
   return absl::OkStatus();
 }
@@ -146,9 +376,16 @@ std::unique_ptr<PropellerProfWriter> PropellerProfWriter::Create(
     const PropellerOptions &options,
     std::unique_ptr<PerfDataProvider> perf_data_provider,
     MultiStatusProvider *frontend_status) {
-  std::unique_ptr<AbstractPropellerWholeProgramInfo> whole_program_info =
-      PropellerWholeProgramInfo::Create(options, std::move(perf_data_provider),
-                                        frontend_status);
+  std::unique_ptr<AbstractPropellerWholeProgramInfo> whole_program_info;
+  if (options.has_cfg_snapshot_name()) {
+    // The snapshot already contains the cfgs, so the binary and the perf data
+    // are not needed.
+    whole_program_info =
+        std::make_unique<PropellerCfgSnapshotWholeProgramInfo>(options);
+  } else {
+    whole_program_info = PropellerWholeProgramInfo::Create(
+        options, std::move(perf_data_provider), frontend_status);
+  }
   if (!whole_program_info) {
     // Error message already logged in PropellerWholeProgramInfo::Create.
     return nullptr;
@@ -163,12 +400,52 @@ std::unique_ptr<PropellerProfWriter> PropellerProfWriter::Create(
       new PropellerProfWriter(options, std::move(whole_program_info)));
 }
 
+std::unique_ptr<PropellerProfWriter> PropellerProfWriter::Create(
+    const PropellerOptions &options,
+    std::unique_ptr<AbstractPropellerWholeProgramInfo> whole_program_info) {
+  return std::unique_ptr<PropellerProfWriter>(
+      new PropellerProfWriter(options, std::move(whole_program_info)));
+}
+
 void PropellerProfWriter::PrintStats() const {
+  TraceRecorder::GetInstance().AddCounters(
+      "PropellerStats",
+      {{"perf_file_parsed", stats_.perf_file_parsed},
+       {"binary_mmap_num", stats_.binary_mmap_num},
+       {"br_counters_accumulated",
+        static_cast<int64_t>(stats_.br_counters_accumulated)},
+       {"cfgs_created", static_cast<int64_t>(stats_.cfgs_created)},
+       {"nodes_created", static_cast<int64_t>(stats_.nodes_created)},
+       {"edges_created", stats_.total_edges_created()},
+       {"hot_functions", static_cast<int64_t>(stats_.hot_functions)},
+       {"optimized_intra_score",
+        static_cast<int64_t>(stats_.optimized_intra_score)},
+       {"optimized_inter_score",
+        static_cast<int64_t>(stats_.optimized_inter_score)},
+       {"lbr_aggregation_bytes",
+        static_cast<int64_t>(stats_.lbr_aggregation_bytes)},
+       {"cfg_bytes", static_cast<int64_t>(stats_.cfg_bytes)}});
   LOG(INFO) << "Parsed " << stats_.perf_file_parsed << " profiles.";
   LOG(INFO) << "Total " << stats_.binary_mmap_num << " binary mmaps.";
   LOG(INFO) << "Total  "
             << CommaStyleNumberFormatter(stats_.br_counters_accumulated)
             << " br entries accumulated.";
+  const uint64_t address_translations =
+      stats_.address_translation_cache_hits +
+      stats_.address_translation_cache_misses;
+  if (address_translations) {
+    LOG(INFO) << "Address translation cache: "
+              << CommaStyleNumberFormatter(
+                     stats_.address_translation_cache_hits)
+              << " hits, "
+              << CommaStyleNumberFormatter(
+                     stats_.address_translation_cache_misses)
+              << " misses ("
+              << absl::StrFormat("%.2f%%",
+                                 100.0 * stats_.address_translation_cache_hits /
+                                     address_translations)
+              << " hit rate).";
+  }
   LOG(INFO) << CommaStyleNumberFormatter(stats_.hot_functions)
             << " hot functions (alias included) found in profiles.";
   LOG(INFO) << "Created " << CommaStyleNumberFormatter(stats_.cfgs_created)
@@ -177,6 +454,10 @@ void PropellerProfWriter::PrintStats() const {
             << " nodes.";
   LOG(INFO) << CommaStyleNumberFormatter(stats_.cfgs_with_hot_landing_pads)
             << " cfgs have hot landing pads.";
+  LOG(INFO) << "Estimated memory: LBR aggregation "
+            << CommaStyleNumberFormatter(stats_.lbr_aggregation_bytes)
+            << " bytes, cfgs "
+            << CommaStyleNumberFormatter(stats_.cfg_bytes) << " bytes.";
 
   int64_t edges_created = stats_.total_edges_created();
   LOG(INFO) << "Created " << CommaStyleNumberFormatter(edges_created)
@@ -225,6 +506,13 @@ void PropellerProfWriter::PrintStats() const {
                  << " bbaddrmap entries, because they do not have "
                     "corresponding symbols in "
                     "binary symtab.";
+  if (!options_.code_layout_params().compute_original_scores()) {
+    LOG(INFO) << "Optimized intra-function (ext-tsp) score: "
+              << stats_.optimized_intra_score
+              << ", inter-function (ext-tsp) score: "
+              << stats_.optimized_inter_score << ".";
+    return;
+  }
   const double intra_score_percent_change =
       100 * (static_cast<double>(stats_.optimized_intra_score) /
                  stats_.original_intra_score -
@@ -259,8 +547,6 @@ bool PropellerProfWriter::Write(
   // function.
   std::vector<const FunctionClusterInfo *> cold_symbol_order(
       all_functions_cluster_info.size());
-  std::ofstream out_stream(options_.cluster_out_name());
-  // TODO(b/160339651): Remove this in favour of structured format in LLVM code.
   for (const FunctionClusterInfo &func_layout_info :
        all_functions_cluster_info) {
     stats_.original_intra_score += func_layout_info.original_score.intra_score;
@@ -271,23 +557,6 @@ bool PropellerProfWriter::Write(
     stats_.optimized_inter_score +=
         func_layout_info.optimized_score.inter_out_score;
 
-    // Print all alias names of the function, separated by '/'.
-    out_stream << "!" << llvm::join(func_layout_info.cfg->names(), "/") << "\n";
-
-    if (options_.verbose_cluster_output()) {
-      // Print the layout score for intra-function and inter-function edges
-      // involving this function. This information allows us to study the impact
-      // on layout score on each individual function.
-      out_stream << absl::StreamFormat(
-          "#ext-tsp score: [intra: %llu -> %llu] [inter: %llu -> %llu]\n",
-          func_layout_info.original_score.intra_score,
-          func_layout_info.optimized_score.intra_score,
-          func_layout_info.original_score.inter_out_score,
-          func_layout_info.optimized_score.inter_out_score);
-      // Print out the frequency of the function entry node.
-      out_stream << absl::StreamFormat(
-          "#entry-freq %llu\n", func_layout_info.cfg->GetEntryNode()->freq());
-    }
     auto &clusters = func_layout_info.clusters;
     for (unsigned cluster_id = 0; cluster_id < clusters.size(); ++cluster_id) {
       auto &cluster = clusters[cluster_id];
@@ -299,28 +568,66 @@ bool PropellerProfWriter::Write(
               func_layout_info.cfg->names_, cluster.bb_indexes.front() == 0
                                                 ? Optional<unsigned>()
                                                 : cluster_id);
-      for (int bbi = 0; bbi < cluster.bb_indexes.size(); ++bbi)
-        out_stream << (bbi ? " " : "!!") << cluster.bb_indexes[bbi];
-      out_stream << "\n";
     }
 
     cold_symbol_order[func_layout_info.cold_cluster_layout_index] =
         &func_layout_info;
   }
 
-  if (options_.has_cfg_dump_dir_name())
-    DumpCfgs(all_functions_cluster_info, options_.cfg_dump_dir_name());
+  // Format the cluster file in chunks of functions, concurrently. The chunks
+  // are then written out in order so the content only depends on
+  // `all_functions_cluster_info`.
+  // TODO(b/160339651): Remove this in favour of structured format in LLVM code.
+  std::vector<std::string> cluster_chunks(
+      (all_functions_cluster_info.size() + kFunctionsPerOutputChunk - 1) /
+      kFunctionsPerOutputChunk);
+  auto format_cluster_chunk = [&](int chunk_index) {
+    std::string &out = cluster_chunks[chunk_index];
+    out.reserve(kFunctionsPerOutputChunk * kEstimatedClusterBytesPerFunction);
+    const int end = std::min<int>(all_functions_cluster_info.size(),
+                                  (chunk_index + 1) * kFunctionsPerOutputChunk);
+    for (int i = chunk_index * kFunctionsPerOutputChunk; i != end; ++i) {
+      AppendClusterLines(all_functions_cluster_info[i],
+                         options_.verbose_cluster_output(), out);
+    }
+  };
+  const int num_threads =
+      std::min<int>(options_.output_threads(), cluster_chunks.size());
+  if (num_threads <= 1) {
+    for (int i = 0; i != cluster_chunks.size(); ++i) format_cluster_chunk(i);
+  } else {
+    std::atomic<int> next_chunk = 0;
+    std::vector<std::thread> workers;
+    workers.reserve(num_threads);
+    for (int t = 0; t != num_threads; ++t) {
+      workers.emplace_back([&]() {
+        for (int i = next_chunk++; i < cluster_chunks.size(); i = next_chunk++)
+          format_cluster_chunk(i);
+      });
+    }
+    for (std::thread &worker : workers) worker.join();
+  }
+  std::ofstream out_stream(options_.cluster_out_name());
+  for (const std::string &chunk : cluster_chunks)
+    out_stream.write(chunk.data(), chunk.size());
+
+  if (options_.has_cfg_dump_dir_name()) {
+    DumpCfgs(all_functions_cluster_info, options_.cfg_dump_dir_name(),
+             options_.cfg_dump_max_functions(), options_.output_threads());
+  }
 
-  std::ofstream symorder_stream(options_.symbol_order_out_name());
+  std::string symorder;
+  symorder.reserve(total_clusters * kEstimatedSymbolOrderBytesPerCluster);
   for (const auto &[func_names, cluster_id] : symbol_order) {
     // Print the symbol names corresponding to every function name alias. This
     // guarantees we get the right order regardless of which function name is
     // picked by the compiler.
     for (auto &func_name : func_names) {
-      symorder_stream << func_name.str();
+      absl::StrAppend(&symorder,
+                      absl::string_view(func_name.data(), func_name.size()));
       if (cluster_id.hasValue())
-        symorder_stream << ".__part." << cluster_id.getValue();
-      symorder_stream << "\n";
+        absl::StrAppend(&symorder, ".__part.", cluster_id.getValue());
+      symorder.push_back('\n');
     }
   }
 
@@ -340,13 +647,16 @@ bool PropellerProfWriter::Write(
                            return cluster.bb_indexes.front() == 0;
                          });
     for (auto &func_name : cluster_info->cfg->names()) {
-      symorder_stream << func_name.str();
+      absl::StrAppend(&symorder,
+                      absl::string_view(func_name.data(), func_name.size()));
       // If the entry node is not in clusters, function name can serve as the
       // cold symbol name. So we don't need the ".cold" suffix.
-      if (entry_is_in_clusters) symorder_stream << ".cold";
-      symorder_stream << "\n";
+      if (entry_is_in_clusters) absl::StrAppend(&symorder, ".cold");
+      symorder.push_back('\n');
     }
   }
+  std::ofstream symorder_stream(options_.symbol_order_out_name());
+  symorder_stream.write(symorder.data(), symorder.size());
 
   stats_ += whole_program_info_->stats();
   PrintStats();
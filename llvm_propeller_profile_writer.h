@@ -14,6 +14,7 @@
 #include "llvm_propeller_statistics.h"
 #include "status_provider.h"
 #include "third_party/abseil/absl/status/status.h"
+#include "third_party/abseil/absl/types/span.h"
 
 namespace devtools_crosstool_autofdo {
 
@@ -26,6 +27,20 @@ absl::Status GeneratePropellerProfiles(
     const devtools_crosstool_autofdo::PropellerOptions &opts,
     std::unique_ptr<PerfDataProvider> perf_data_provider);
 
+// Batch mode: generates the propeller profiles of several binaries profiled in
+// the same perf data, e.g. an executable and its shared objects. `binary_opts`
+// holds the options of every binary, the perf data files are taken from the
+// first element. Each perf data file is read only once and its samples are
+// demultiplexed into the binaries by their mmaps.
+absl::Status GeneratePropellerProfilesOfBinaries(
+    absl::Span<const devtools_crosstool_autofdo::PropellerOptions> binary_opts);
+
+// Like above, but `perf_names` are ignored and `perf_data_provider` is used
+// instead.
+absl::Status GeneratePropellerProfilesOfBinaries(
+    absl::Span<const devtools_crosstool_autofdo::PropellerOptions> binary_opts,
+    std::unique_ptr<PerfDataProvider> perf_data_provider);
+
 class PropellerProfWriter {
  public:
   static std::unique_ptr<PropellerProfWriter> Create(
@@ -38,6 +53,11 @@ class PropellerProfWriter {
       std::unique_ptr<PerfDataProvider> perf_data_provider,
       MultiStatusProvider *status = nullptr);
 
+  // Creates a writer for `whole_program_info`, whose cfgs are already created.
+  static std::unique_ptr<PropellerProfWriter> Create(
+      const PropellerOptions &options,
+      std::unique_ptr<AbstractPropellerWholeProgramInfo> whole_program_info);
+
   // Main entrance of propeller profile writer.
   // Return true if succeeded.
   bool Write(
@@ -1,10 +1,17 @@
 #include "llvm_propeller_profile_writer.h"
 
+#include <filesystem>
+#include <fstream>
+#include <map>
 #include <memory>
 #include <sstream>
 #include <string>
+#include <utility>
+#include <vector>
 
 #include "llvm_propeller_cfg.h"
+#include "llvm_propeller_cfg_snapshot.h"
+#include "llvm_propeller_code_layout.h"
 #include "llvm_propeller_file_perf_data_provider.h"
 #include "llvm_propeller_formatting.h"
 #include "llvm_propeller_options.pb.h"
@@ -145,5 +152,166 @@ TEST(LlvmPropellerProfileWriterTest, ParsePerf1) {
     all_equals &= (i->second == std::next(i)->second);
   EXPECT_FALSE(all_equals);
 }
+
+TEST(LlvmPropellerProfileWriterTest, CfgSnapshotRoundTrip) {
+  const std::string binary =
+      absl::StrCat(FLAGS_test_srcdir,
+                   "/testdata/"
+                   "propeller_sample.bin");
+  const std::string perfdata =
+      absl::StrCat(FLAGS_test_srcdir,
+                   "/testdata/"
+                   "propeller_sample.perfdata");
+  const std::string snapshot =
+      absl::StrCat(FLAGS_test_tmpdir, "/propeller_sample.cfg_snapshot");
+  auto writer_ptr = PropellerProfWriter::Create(
+      PropellerOptions(PropellerOptionsBuilder()
+                           .SetBinaryName(binary)
+                           .AddPerfNames(perfdata)
+                           .SetClusterOutName("dummy.out")
+                           .SetProfiledBinaryName("propeller_sample.bin")));
+  ASSERT_NE(nullptr, writer_ptr);
+  ASSERT_TRUE(
+      WriteCfgSnapshot(*writer_ptr->whole_program_info(), snapshot).ok());
+
+  // The cfgs of the snapshot are created on one and on several threads.
+  for (int cfg_creation_threads : {1, 4}) {
+    SCOPED_TRACE(absl::StrCat("cfg_creation_threads=", cfg_creation_threads));
+    auto snapshot_writer_ptr = PropellerProfWriter::Create(
+        PropellerOptions(PropellerOptionsBuilder()
+                             .SetCfgSnapshotName(snapshot)
+                             .SetClusterOutName("dummy.out")
+                             .SetCfgCreationThreads(cfg_creation_threads)));
+    ASSERT_NE(nullptr, snapshot_writer_ptr);
+    const auto &cfgs = writer_ptr->whole_program_info()->cfgs();
+    const auto &snapshot_cfgs =
+        snapshot_writer_ptr->whole_program_info()->cfgs();
+    ASSERT_EQ(cfgs.size(), snapshot_cfgs.size());
+    for (const auto &[name, cfg] : cfgs) {
+      const ControlFlowGraph *snapshot_cfg =
+          snapshot_writer_ptr->whole_program_info()->FindCfg(name);
+      ASSERT_NE(nullptr, snapshot_cfg) << name.str();
+      EXPECT_EQ(cfg->names(), snapshot_cfg->names());
+      ASSERT_EQ(cfg->nodes().size(), snapshot_cfg->nodes().size());
+      for (int i = 0; i < cfg->nodes().size(); ++i) {
+        const CFGNode &node = *cfg->nodes()[i];
+        const CFGNode &snapshot_node = *snapshot_cfg->nodes()[i];
+        EXPECT_EQ(node.symbol_ordinal(), snapshot_node.symbol_ordinal());
+        EXPECT_EQ(node.bb_index(), snapshot_node.bb_index());
+        EXPECT_EQ(node.size(), snapshot_node.size());
+        EXPECT_EQ(node.freq(), snapshot_node.freq());
+        EXPECT_EQ(node.intra_outs().size(), snapshot_node.intra_outs().size());
+        EXPECT_EQ(node.inter_outs().size(), snapshot_node.inter_outs().size());
+        EXPECT_EQ(node.intra_ins().size(), snapshot_node.intra_ins().size());
+        EXPECT_EQ(node.inter_ins().size(), snapshot_node.inter_ins().size());
+      }
+      EXPECT_EQ(cfg->IsHot(), snapshot_cfg->IsHot());
+    }
+    EXPECT_EQ(writer_ptr->whole_program_info()->stats().total_edges_created(),
+              snapshot_writer_ptr->whole_program_info()
+                  ->stats()
+                  .total_edges_created());
+    EXPECT_EQ(
+        writer_ptr->whole_program_info()->stats().total_edge_weight_created(),
+        snapshot_writer_ptr->whole_program_info()
+            ->stats()
+            .total_edge_weight_created());
+  }
+}
+
+TEST(LlvmPropellerProfileWriterTest, ParallelOutputMatchesSerial) {
+  const std::string binary =
+      absl::StrCat(FLAGS_test_srcdir,
+                   "/testdata/"
+                   "propeller_sample.bin");
+  const std::string perfdata =
+      absl::StrCat(FLAGS_test_srcdir,
+                   "/testdata/"
+                   "propeller_sample.perfdata");
+  auto read_file = [](const std::string &file_name) {
+    std::ifstream in(file_name);
+    std::stringstream content;
+    content << in.rdbuf();
+    return content.str();
+  };
+  std::vector<std::pair<std::string, std::string>> outputs;
+  for (int output_threads : {1, 4}) {
+    const std::string prefix = absl::StrCat(FLAGS_test_tmpdir, "/output_",
+                                            output_threads);
+    const PropellerOptions options(
+        PropellerOptionsBuilder()
+            .SetBinaryName(binary)
+            .AddPerfNames(perfdata)
+            .SetClusterOutName(absl::StrCat(prefix, ".cc_profile.txt"))
+            .SetSymbolOrderOutName(absl::StrCat(prefix, ".symorder.txt"))
+            .SetProfiledBinaryName("propeller_sample.bin")
+            .SetVerboseClusterOutput(true)
+            .SetOutputThreads(output_threads));
+    auto writer_ptr = PropellerProfWriter::Create(options);
+    ASSERT_NE(nullptr, writer_ptr);
+    ASSERT_TRUE(writer_ptr->Write(
+        CodeLayout(options.code_layout_params(),
+                   writer_ptr->whole_program_info()->GetHotCfgs())
+            .OrderAll()));
+    outputs.emplace_back(read_file(options.cluster_out_name()),
+                         read_file(options.symbol_order_out_name()));
+  }
+  EXPECT_THAT(outputs[0].first, Not(testing::IsEmpty()));
+  EXPECT_EQ(outputs[0], outputs[1]);
+}
+
+TEST(LlvmPropellerProfileWriterTest, ParallelCfgDumpMatchesSerial) {
+  const std::string binary =
+      absl::StrCat(FLAGS_test_srcdir,
+                   "/testdata/"
+                   "propeller_sample.bin");
+  const std::string perfdata =
+      absl::StrCat(FLAGS_test_srcdir,
+                   "/testdata/"
+                   "propeller_sample.perfdata");
+  // Returns the contents of the files of `dir` by file name.
+  auto read_dir = [](const std::string &dir) {
+    std::map<std::string, std::string> files;
+    for (const auto &entry : std::filesystem::directory_iterator(dir)) {
+      std::ifstream in(entry.path());
+      std::stringstream content;
+      content << in.rdbuf();
+      files[entry.path().filename().string()] = content.str();
+    }
+    return files;
+  };
+  std::vector<std::map<std::string, std::string>> dumps;
+  for (auto [output_threads, max_functions] :
+       {std::make_pair(1, 0), std::make_pair(4, 0), std::make_pair(4, 1)}) {
+    const std::string prefix =
+        absl::StrCat(FLAGS_test_tmpdir, "/cfg_dump_", output_threads, "_",
+                     max_functions);
+    std::filesystem::remove_all(prefix);
+    const PropellerOptions options(
+        PropellerOptionsBuilder()
+            .SetBinaryName(binary)
+            .AddPerfNames(perfdata)
+            .SetClusterOutName(absl::StrCat(prefix, ".cc_profile.txt"))
+            .SetSymbolOrderOutName(absl::StrCat(prefix, ".symorder.txt"))
+            .SetProfiledBinaryName("propeller_sample.bin")
+            .SetCfgDumpDirName(prefix)
+            .SetCfgDumpMaxFunctions(max_functions)
+            .SetOutputThreads(output_threads));
+    auto writer_ptr = PropellerProfWriter::Create(options);
+    ASSERT_NE(nullptr, writer_ptr);
+    ASSERT_TRUE(writer_ptr->Write(
+        CodeLayout(options.code_layout_params(),
+                   writer_ptr->whole_program_info()->GetHotCfgs())
+            .OrderAll()));
+    dumps.push_back(read_dir(prefix));
+  }
+  EXPECT_GT(dumps[0].size(), 2);
+  EXPECT_EQ(dumps[0], dumps[1]);
+  // The index file and one cfg, which is dumped as without the limit.
+  ASSERT_EQ(dumps[2].size(), 2);
+  for (const auto &[file_name, contents] : dumps[2]) {
+    if (file_name != "cfg-index.txt") EXPECT_EQ(contents, dumps[0][file_name]);
+  }
+}
 }  // namespace
 }  // namespace devtools_crosstool_autofdo
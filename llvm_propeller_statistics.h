@@ -12,6 +12,9 @@ struct PropellerStats {
   int binary_mmap_num = 0;
   int perf_file_parsed = 0;
   uint64_t br_counters_accumulated = 0;
+  // Hits and misses of the last-hit cache used to translate LBR addresses.
+  uint64_t address_translation_cache_hits = 0;
+  uint64_t address_translation_cache_misses = 0;
   uint64_t edges_with_same_src_sink_but_different_type = 0;
   uint64_t cfgs_created = 0;
   // Number of CFGs which have hot landing pads.
@@ -26,6 +29,10 @@ struct PropellerStats {
   uint64_t original_inter_score = 0;
   uint64_t optimized_inter_score = 0;
   uint64_t hot_functions = 0;
+  // Estimated bytes held by the LBR aggregation and by the CFGs once they are
+  // created.
+  uint64_t lbr_aggregation_bytes = 0;
+  uint64_t cfg_bytes = 0;
 
   int64_t total_edges_created() const {
     return absl::c_accumulate(
@@ -48,6 +55,8 @@ struct PropellerStats {
     binary_mmap_num += s.binary_mmap_num;
     perf_file_parsed += s.perf_file_parsed;
     br_counters_accumulated += s.br_counters_accumulated;
+    address_translation_cache_hits += s.address_translation_cache_hits;
+    address_translation_cache_misses += s.address_translation_cache_misses;
     edges_with_same_src_sink_but_different_type +=
         s.edges_with_same_src_sink_but_different_type;
     cfgs_created += s.cfgs_created;
@@ -65,6 +74,8 @@ struct PropellerStats {
     original_inter_score += s.original_inter_score;
     optimized_inter_score += s.optimized_inter_score;
     hot_functions += s.hot_functions;
+    lbr_aggregation_bytes += s.lbr_aggregation_bytes;
+    cfg_bytes += s.cfg_bytes;
 
     return *this;
   }
@@ -0,0 +1,258 @@
+#include "llvm_propeller_stream_perf_data_provider.h"
+
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <optional>
+#include <string>
+#include <utility>
+
+#include "llvm_propeller_perf_data_provider.h"
+#include "third_party/abseil/absl/status/status.h"
+#include "third_party/abseil/absl/status/statusor.h"
+#include "third_party/abseil/absl/strings/match.h"
+#include "third_party/abseil/absl/strings/str_cat.h"
+#include "third_party/abseil/absl/strings/str_format.h"
+#include "llvm/Support/MemoryBuffer.h"
+
+namespace devtools_crosstool_autofdo {
+namespace {
+// "PERFILE2" read as a little-endian uint64_t.
+constexpr uint64_t kPerfMagic = 0x32454c4946524550ULL;
+// Size of the header of pipe-mode perf data: the magic and the header size.
+constexpr int64_t kPipeHeaderSize = 16;
+// Size of a perf_event_header: type (u32), misc (u16) and size (u16).
+constexpr int64_t kEventHeaderSize = 8;
+
+// Event types, see perf_event.h and tools/perf/util/event.h.
+enum : uint32_t {
+  kRecordMmap = 1,
+  kRecordComm = 3,
+  kRecordExit = 4,
+  kRecordFork = 7,
+  kRecordMmap2 = 10,
+  kRecordHeaderAttr = 64,
+  kRecordHeaderTracingData = 66,
+  kRecordFinishedRound = 68,
+  kRecordAuxtrace = 71,
+  kRecordAuxtraceError = 72,
+  kRecordStat = 76,
+  kRecordStatRound = 77,
+  kRecordCompressed = 81,
+};
+
+// Returns whether events of `type` describe the recording or the processes
+// and are thus needed by the samples of later chunks.
+bool IsStateEvent(uint32_t type) {
+  switch (type) {
+    case kRecordMmap:
+    case kRecordComm:
+    case kRecordExit:
+    case kRecordFork:
+    case kRecordMmap2:
+      return true;
+    case kRecordFinishedRound:
+    case kRecordAuxtrace:
+    case kRecordAuxtraceError:
+    case kRecordStat:
+    case kRecordStatRound:
+    case kRecordCompressed:
+      return false;
+    default:
+      // Other synthesized events describe the recording: attributes, event
+      // types, tracing data, build ids, features, ...
+      return type >= kRecordHeaderAttr;
+  }
+}
+
+template <typename T>
+T Load(const std::string &data, int64_t offset) {
+  T value;
+  memcpy(&value, data.data() + offset, sizeof(T));
+  return value;
+}
+}  // namespace
+
+bool StreamPerfDataProvider::IsStreamSource(const std::string &source) {
+  return source == "-" || absl::StartsWith(source, "unix:");
+}
+
+absl::StatusOr<std::unique_ptr<StreamPerfDataProvider>>
+StreamPerfDataProvider::Create(const std::string &source, int64_t chunk_size) {
+  if (source == "-") {
+    return std::make_unique<StreamPerfDataProvider>(
+        STDIN_FILENO, /*owns_fd=*/false, "stdin", chunk_size);
+  }
+  int fd = -1;
+  if (absl::StartsWith(source, "unix:")) {
+    const std::string path = source.substr(strlen("unix:"));
+    sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(address.sun_path)) {
+      return absl::InvalidArgumentError(
+          absl::StrCat("Socket path ", path, " is too long."));
+    }
+    strncpy(address.sun_path, path.c_str(), sizeof(address.sun_path) - 1);
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+      return absl::InternalError(
+          absl::StrCat("Cannot create a socket: ", strerror(errno)));
+    }
+    if (connect(fd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) <
+        0) {
+      const int error = errno;
+      close(fd);
+      return absl::UnavailableError(
+          absl::StrCat("Cannot connect to ", path, ": ", strerror(error)));
+    }
+  } else {
+    fd = open(source.c_str(), O_RDONLY);
+    if (fd < 0) {
+      return absl::NotFoundError(
+          absl::StrCat("Cannot open ", source, ": ", strerror(errno)));
+    }
+  }
+  return std::make_unique<StreamPerfDataProvider>(fd, /*owns_fd=*/true, source,
+                                                  chunk_size);
+}
+
+StreamPerfDataProvider::~StreamPerfDataProvider() {
+  if (owns_fd_) close(fd_);
+}
+
+absl::Status StreamPerfDataProvider::ReadExactly(int64_t size,
+                                                 std::string &out) {
+  const int64_t start = out.size();
+  out.resize(start + size);
+  int64_t done = 0;
+  while (done < size) {
+    ssize_t n = read(fd_, out.data() + start + done, size - done);
+    if (n < 0 && errno == EINTR) continue;
+    if (n < 0) {
+      out.resize(start);
+      return absl::InternalError(
+          absl::StrCat("Error reading ", name_, ": ", strerror(errno)));
+    }
+    if (n == 0) {
+      out.resize(start);
+      if (done == 0) return absl::OutOfRangeError("End of stream.");
+      return absl::DataLossError(
+          absl::StrCat("Truncated perf data in ", name_, "."));
+    }
+    done += n;
+  }
+  return absl::OkStatus();
+}
+
+absl::Status StreamPerfDataProvider::Skip(int64_t size) {
+  std::string discarded;
+  while (size > 0) {
+    const int64_t n = std::min<int64_t>(size, 1 << 20);
+    discarded.clear();
+    absl::Status status = ReadExactly(n, discarded);
+    if (absl::IsOutOfRange(status)) {
+      return absl::DataLossError(
+          absl::StrCat("Truncated perf data in ", name_, "."));
+    }
+    if (!status.ok()) return status;
+    size -= n;
+  }
+  return absl::OkStatus();
+}
+
+absl::Status StreamPerfDataProvider::ReadHeader() {
+  absl::Status status = ReadExactly(kPipeHeaderSize, header_);
+  if (absl::IsOutOfRange(status)) {
+    return absl::DataLossError(absl::StrCat("Empty perf data in ", name_, "."));
+  }
+  if (!status.ok()) return status;
+  if (Load<uint64_t>(header_, 0) != kPerfMagic) {
+    header_.clear();
+    return absl::InvalidArgumentError(absl::StrCat(
+        name_, " is not perf data in the byte order of this host."));
+  }
+  if (Load<uint64_t>(header_, 8) != kPipeHeaderSize) {
+    header_.clear();
+    return absl::InvalidArgumentError(absl::StrCat(
+        name_, " is not pipe-mode perf data, record it with `-o -`."));
+  }
+  return absl::OkStatus();
+}
+
+absl::StatusOr<std::optional<PerfDataProvider::BufferHandle>>
+StreamPerfDataProvider::GetNext() {
+  if (at_end_) return std::nullopt;
+  if (header_.empty()) {
+    absl::Status status = ReadHeader();
+    if (!status.ok()) return status;
+  }
+
+  std::string chunk = header_ + state_events_;
+  int64_t event_bytes = 0;
+  while (event_bytes < chunk_size_) {
+    const int64_t event_start = chunk.size();
+    absl::Status status = ReadExactly(kEventHeaderSize, chunk);
+    if (absl::IsOutOfRange(status)) {
+      at_end_ = true;
+      break;
+    }
+    if (!status.ok()) return status;
+    const uint32_t type = Load<uint32_t>(chunk, event_start);
+    const uint16_t size = Load<uint16_t>(chunk, event_start + 6);
+    if (size < kEventHeaderSize) {
+      return absl::DataLossError(absl::StrFormat(
+          "Invalid size %d of an event of type %d in %s.", size, type, name_));
+    }
+    status = ReadExactly(size - kEventHeaderSize, chunk);
+    if (absl::IsOutOfRange(status)) {
+      return absl::DataLossError(
+          absl::StrCat("Truncated perf data in ", name_, "."));
+    }
+    if (!status.ok()) return status;
+
+    // Some events are followed by data not included in their size.
+    if (type == kRecordHeaderTracingData && size >= kEventHeaderSize + 4) {
+      // The tracing data is padded to 8 bytes.
+      const int64_t data_size =
+          (Load<uint32_t>(chunk, event_start + kEventHeaderSize) + 7) & ~7LL;
+      status = ReadExactly(data_size, chunk);
+      if (absl::IsOutOfRange(status)) {
+        return absl::DataLossError(
+            absl::StrCat("Truncated perf data in ", name_, "."));
+      }
+      if (!status.ok()) return status;
+    } else if (type == kRecordAuxtrace) {
+      if (size < kEventHeaderSize + 8) {
+        return absl::DataLossError(
+            absl::StrCat("Invalid AUXTRACE event in ", name_, "."));
+      }
+      const uint64_t data_size =
+          Load<uint64_t>(chunk, event_start + kEventHeaderSize);
+      chunk.resize(event_start);
+      status = Skip(data_size);
+      if (!status.ok()) return status;
+      continue;
+    }
+
+    if (IsStateEvent(type))
+      state_events_.append(chunk, event_start, std::string::npos);
+    event_bytes += chunk.size() - event_start;
+  }
+  if (event_bytes == 0) return std::nullopt;
+
+  ++chunks_;
+  std::string description = absl::StrFormat("%s [chunk %d, %d bytes]", name_,
+                                             chunks_, event_bytes);
+  return BufferHandle{
+      .description = description,
+      .buffer = llvm::MemoryBuffer::getMemBufferCopy(chunk, description)};
+}
+
+}  // namespace devtools_crosstool_autofdo
@@ -0,0 +1,91 @@
+#ifndef AUTOFDO_LLVM_PROPELLER_STREAM_PERF_DATA_PROVIDER_H_
+#define AUTOFDO_LLVM_PROPELLER_STREAM_PERF_DATA_PROVIDER_H_
+
+#if defined(HAVE_LLVM)
+
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <string>
+#include <utility>
+
+#include "llvm_propeller_perf_data_provider.h"
+#include "third_party/abseil/absl/status/status.h"
+#include "third_party/abseil/absl/status/statusor.h"
+
+namespace devtools_crosstool_autofdo {
+
+// A perf.data provider reading pipe-mode perf data (`perf record -o -`) from a
+// stream, e.g. stdin, a fifo or a socket, as it arrives. The stream is cut at
+// event boundaries into chunks of about `chunk_size` bytes of events, each
+// returned as a self-contained pipe-mode perf.data by `GetNext`, so the
+// samples are aggregated while the profile is still being recorded and at most
+// one chunk is buffered.
+//
+// Samples are only meaningful with the attributes of their events and the
+// mmaps of their processes, which may have been recorded in earlier chunks.
+// The attribute, feature and build id events and the mmap, comm, fork and
+// exit events read so far are therefore repeated at the start of every chunk.
+// Perf writes build ids at the end of the stream, so the chunks before it
+// should be matched with --profiled_binary_name or --ignore_build_id.
+//
+// AUXTRACE data is dropped, and the events of compressed records
+// (`perf record -z`) are not repeated.
+class StreamPerfDataProvider : public PerfDataProvider {
+ public:
+  // Reads from the file descriptor `fd`, which is closed by the destructor if
+  // `owns_fd`. `name` describes the stream in the buffer descriptions.
+  StreamPerfDataProvider(int fd, bool owns_fd, std::string name,
+                         int64_t chunk_size)
+      : fd_(fd),
+        owns_fd_(owns_fd),
+        name_(std::move(name)),
+        chunk_size_(chunk_size) {}
+
+  // Opens `source`: "-" is stdin, "unix:<path>" connects to the Unix domain
+  // socket at <path>, anything else is opened as a file, e.g. a fifo.
+  static absl::StatusOr<std::unique_ptr<StreamPerfDataProvider>> Create(
+      const std::string &source, int64_t chunk_size);
+
+  // Returns whether `source` names a stream accepted by `Create` rather than a
+  // perf.data file.
+  static bool IsStreamSource(const std::string &source);
+
+  StreamPerfDataProvider(const StreamPerfDataProvider &) = delete;
+  StreamPerfDataProvider &operator=(const StreamPerfDataProvider &) = delete;
+
+  ~StreamPerfDataProvider() override;
+
+  absl::StatusOr<std::optional<PerfDataProvider::BufferHandle>> GetNext()
+      override;
+
+ private:
+  // Reads exactly `size` bytes and appends them to `out`. Returns
+  // `OutOfRangeError` if the stream ends before any byte is read and
+  // `DataLossError` if it ends after some.
+  absl::Status ReadExactly(int64_t size, std::string &out);
+
+  // Skips `size` bytes of the stream.
+  absl::Status Skip(int64_t size);
+
+  // Reads and checks the pipe-mode header at the start of the stream.
+  absl::Status ReadHeader();
+
+  int fd_;
+  bool owns_fd_;
+  std::string name_;
+  int64_t chunk_size_;
+  // The pipe-mode header, empty until it is read.
+  std::string header_;
+  // The events repeated at the start of every chunk.
+  std::string state_events_;
+  // Number of chunks returned so far.
+  int chunks_ = 0;
+  bool at_end_ = false;
+};
+
+}  // namespace devtools_crosstool_autofdo
+
+#endif  // HAVE_LLVM
+
+#endif  // AUTOFDO_LLVM_PROPELLER_STREAM_PERF_DATA_PROVIDER_H_
@@ -0,0 +1,120 @@
+#include "llvm_propeller_stream_perf_data_provider.h"
+
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <string_view>
+
+#include "base/logging.h"
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+#include "third_party/abseil/absl/status/status.h"
+#include "third_party/abseil/absl/strings/str_cat.h"
+#include "third_party/abseil/absl/strings/string_view.h"
+
+#define FLAGS_test_tmpdir std::string(testing::UnitTest::GetInstance()->original_working_dir())
+
+namespace devtools_crosstool_autofdo {
+namespace {
+
+using ::testing::Eq;
+using ::testing::HasSubstr;
+using ::testing::status::IsOkAndHolds;
+using ::testing::status::StatusIs;
+
+// Returns a perf event of `type` with `payload_size` bytes of `fill`.
+std::string Event(uint32_t type, int payload_size, char fill) {
+  std::string event(8 + payload_size, fill);
+  const uint16_t misc = 0, size = event.size();
+  memcpy(event.data(), &type, 4);
+  memcpy(event.data() + 4, &misc, 2);
+  memcpy(event.data() + 6, &size, 2);
+  return event;
+}
+
+std::string PipeHeader() {
+  std::string header("PERFILE2", 8);
+  const uint64_t size = 16;
+  header.append(reinterpret_cast<const char *>(&size), 8);
+  return header;
+}
+
+// Writes `contents` to a file in the test directory and returns its name.
+std::string WriteStream(absl::string_view name, absl::string_view contents) {
+  std::string file_name = absl::StrCat(FLAGS_test_tmpdir, "/", name);
+  std::ofstream stream(file_name, std::ios::binary);
+  stream << contents;
+  CHECK(!stream.fail());
+  return file_name;
+}
+
+absl::string_view Contents(const PerfDataProvider::BufferHandle &handle) {
+  return absl::string_view(std::string_view(handle.buffer->getBuffer()));
+}
+
+TEST(StreamPerfDataProvider, RepeatsStateEventsInEveryChunk) {
+  const std::string attr = Event(/*HEADER_ATTR=*/64, 16, 'a');
+  const std::string mmap1 = Event(/*MMAP2=*/10, 24, 'm');
+  const std::string sample1 = Event(/*SAMPLE=*/9, 32, '1');
+  const std::string sample2 = Event(/*SAMPLE=*/9, 32, '2');
+  const std::string mmap2 = Event(/*MMAP2=*/10, 24, 'n');
+  const std::string sample3 = Event(/*SAMPLE=*/9, 32, '3');
+  const std::string file_name = WriteStream(
+      "StreamPerfDataProvider_RepeatsStateEventsInEveryChunk.perf",
+      absl::StrCat(PipeHeader(), attr, mmap1, sample1, sample2, mmap2,
+                   sample3));
+
+  // Every chunk ends with the event that reaches 64 bytes of events.
+  auto provider = StreamPerfDataProvider::Create(file_name, 64);
+  ASSERT_TRUE(provider.ok());
+  auto chunk = (*provider)->GetNext();
+  ASSERT_TRUE(chunk.ok() && chunk->has_value());
+  EXPECT_EQ(Contents(**chunk),
+            absl::StrCat(PipeHeader(), attr, mmap1, sample1));
+  chunk = (*provider)->GetNext();
+  ASSERT_TRUE(chunk.ok() && chunk->has_value());
+  EXPECT_EQ(Contents(**chunk),
+            absl::StrCat(PipeHeader(), attr, mmap1, sample2, mmap2));
+  chunk = (*provider)->GetNext();
+  ASSERT_TRUE(chunk.ok() && chunk->has_value());
+  EXPECT_EQ(Contents(**chunk),
+            absl::StrCat(PipeHeader(), attr, mmap1, mmap2, sample3));
+  EXPECT_THAT((*provider)->GetNext(), IsOkAndHolds(Eq(std::nullopt)));
+}
+
+TEST(StreamPerfDataProvider, RejectsFileModePerfData) {
+  std::string header("PERFILE2", 8);
+  const uint64_t size = 104;
+  header.append(reinterpret_cast<const char *>(&size), 8);
+  auto provider = StreamPerfDataProvider::Create(
+      WriteStream("StreamPerfDataProvider_RejectsFileModePerfData.perf",
+                  header),
+      64);
+  ASSERT_TRUE(provider.ok());
+  EXPECT_THAT((*provider)->GetNext(),
+              StatusIs(absl::StatusCode::kInvalidArgument,
+                       HasSubstr("not pipe-mode perf data")));
+}
+
+TEST(StreamPerfDataProvider, ReportsTruncatedEvents) {
+  const std::string sample = Event(/*SAMPLE=*/9, 32, 's');
+  auto provider = StreamPerfDataProvider::Create(
+      WriteStream("StreamPerfDataProvider_ReportsTruncatedEvents.perf",
+                  absl::StrCat(PipeHeader(), sample.substr(0, 20))),
+      64);
+  ASSERT_TRUE(provider.ok());
+  EXPECT_THAT((*provider)->GetNext(),
+              StatusIs(absl::StatusCode::kDataLoss, HasSubstr("Truncated")));
+}
+
+TEST(StreamPerfDataProvider, PropagatesOpenErrors) {
+  EXPECT_THAT(
+      StreamPerfDataProvider::Create(
+          absl::StrCat(FLAGS_test_tmpdir,
+                       "/StreamPerfDataProvider_does_not_exist"),
+          64),
+      StatusIs(absl::StatusCode::kNotFound, HasSubstr("Cannot open")));
+}
+}  // namespace
+}  // namespace devtools_crosstool_autofdo
@@ -0,0 +1,203 @@
+#include "llvm_propeller_synthetic_workload.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <numeric>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "base/logging.h"
+#include "llvm_propeller_abstract_whole_program_info.h"
+#include "llvm_propeller_cfg.pb.h"
+#include "sample_reader.h"
+#include "third_party/abseil/absl/status/status.h"
+#include "third_party/abseil/absl/strings/str_cat.h"
+
+namespace devtools_crosstool_autofdo {
+namespace {
+
+// Address of the first function of the program.
+constexpr uint64_t kTextStartAddress = 0x400000;
+// Functions start at multiples of this alignment.
+constexpr uint64_t kFunctionAlignment = 16;
+
+struct SyntheticBlock {
+  uint64_t address;
+  uint64_t size;
+  uint64_t freq;
+};
+
+struct SyntheticEdge {
+  // Indexes into SyntheticProgram::blocks.
+  int src;
+  int sink;
+  uint64_t weight;
+  CFGEdgePb::Kind kind;
+};
+
+struct SyntheticProgram {
+  std::vector<SyntheticBlock> blocks;
+  // The blocks of function i are
+  // [function_begins[i], function_begins[i + 1]).
+  std::vector<int> function_begins;
+  std::vector<SyntheticEdge> edges;
+};
+
+SyntheticProgram BuildSyntheticProgram(
+    const SyntheticWorkloadOptions &options) {
+  CHECK_GT(options.num_functions, 0);
+  CHECK_GT(options.blocks_per_function, 0);
+  CHECK_GE(options.inlining_depth, 0);
+  std::mt19937_64 rng(options.seed);
+  auto uniform = [&rng](int low, int high) {
+    return std::uniform_int_distribution<int>(low, high)(rng);
+  };
+
+  std::vector<int> ranks(options.num_functions);
+  std::iota(ranks.begin(), ranks.end(), 0);
+  std::shuffle(ranks.begin(), ranks.end(), rng);
+
+  SyntheticProgram program;
+  uint64_t address = kTextStartAddress;
+  for (int f = 0; f < options.num_functions; ++f) {
+    const int begin = program.blocks.size();
+    const int num_blocks = uniform(1, 2 * options.blocks_per_function - 1);
+    program.function_begins.push_back(begin);
+    for (int b = 0; b < num_blocks; ++b) {
+      const uint64_t size = uniform(2, 64);
+      program.blocks.push_back({address, size, 0});
+      address += size;
+    }
+    address = (address + kFunctionAlignment - 1) / kFunctionAlignment *
+              kFunctionAlignment;
+
+    // Blocks only branch forward, so their counts are final once all the
+    // previous blocks have been visited.
+    program.blocks[begin].freq = static_cast<uint64_t>(
+        options.entry_count / std::pow(ranks[f] + 1.0, options.function_skew));
+    for (int b = begin; b + 1 < begin + num_blocks; ++b) {
+      const uint64_t freq = program.blocks[b].freq;
+      const uint64_t fallthrough =
+          b + 2 < begin + num_blocks
+              ? static_cast<uint64_t>(std::llround(freq * options.edge_skew))
+              : freq;
+      program.blocks[b + 1].freq += fallthrough;
+      program.edges.push_back(
+          {b, b + 1, fallthrough, CFGEdgePb::BRANCH_OR_FALLTHROUGH});
+      if (fallthrough == freq) continue;
+      const int target = uniform(b + 2, begin + num_blocks - 1);
+      program.blocks[target].freq += freq - fallthrough;
+      program.edges.push_back(
+          {b, target, freq - fallthrough, CFGEdgePb::BRANCH_OR_FALLTHROUGH});
+    }
+  }
+  program.function_begins.push_back(program.blocks.size());
+
+  // Function f is in layer f * num_layers / num_functions, and calls a
+  // function of the next layer from one of its blocks once per execution of
+  // that block.
+  const int num_layers = options.inlining_depth + 1;
+  auto layer_begin = [&options, num_layers](int layer) {
+    return static_cast<int>((static_cast<int64_t>(layer) *
+                                 options.num_functions +
+                             num_layers - 1) /
+                            num_layers);
+  };
+  for (int layer = 0; layer + 1 < num_layers; ++layer) {
+    const int callee_begin = layer_begin(layer + 1);
+    const int callee_end = layer_begin(layer + 2);
+    if (callee_begin == callee_end) break;
+    for (int f = layer_begin(layer); f < callee_begin; ++f) {
+      const int call_block = uniform(program.function_begins[f],
+                                     program.function_begins[f + 1] - 1);
+      const int callee = uniform(callee_begin, callee_end - 1);
+      const uint64_t weight = program.blocks[call_block].freq;
+      program.edges.push_back({call_block, program.function_begins[callee],
+                               weight, CFGEdgePb::CALL});
+      program.edges.push_back({program.function_begins[callee + 1] - 1,
+                               call_block, weight, CFGEdgePb::RETURN});
+    }
+  }
+  return program;
+}
+}  // namespace
+
+PropellerPb GenerateSyntheticPropellerPb(
+    const SyntheticWorkloadOptions &options) {
+  const SyntheticProgram program = BuildSyntheticProgram(options);
+  PropellerPb propeller_pb;
+  // Block i has symbol ordinal i + 1.
+  std::vector<CFGNodePb *> nodes_pb;
+  nodes_pb.reserve(program.blocks.size());
+  for (int f = 0; f + 1 < program.function_begins.size(); ++f) {
+    ControlFlowGraphPb *cfg_pb = propeller_pb.add_cfg();
+    cfg_pb->add_name(absl::StrCat("synthetic_function_", f));
+    for (int b = program.function_begins[f];
+         b < program.function_begins[f + 1]; ++b) {
+      CFGNodePb *node_pb = cfg_pb->add_node();
+      node_pb->set_symbol_ordinal(b + 1);
+      node_pb->set_bb_index(b - program.function_begins[f]);
+      node_pb->set_size(program.blocks[b].size);
+      node_pb->set_freq(program.blocks[b].freq);
+      node_pb->set_is_landing_pad(false);
+      nodes_pb.push_back(node_pb);
+    }
+  }
+  for (const SyntheticEdge &edge : program.edges) {
+    CFGNodePb *src_pb = nodes_pb[edge.src];
+    CFGEdgePb *edge_pb = edge.kind == CFGEdgePb::BRANCH_OR_FALLTHROUGH
+                             ? src_pb->add_intra_outs()
+                             : src_pb->add_inter_outs();
+    edge_pb->set_source(edge.src + 1);
+    edge_pb->set_sink(edge.sink + 1);
+    edge_pb->set_weight(edge.weight);
+    edge_pb->set_kind(edge.kind);
+  }
+  return propeller_pb;
+}
+
+void GenerateSyntheticSamples(const SyntheticWorkloadOptions &options,
+                              TextSampleReaderWriter *writer) {
+  const SyntheticProgram program = BuildSyntheticProgram(options);
+  AddressCountMap address_count_map;
+  RangeCountMap range_count_map;
+  BranchCountMap branch_count_map;
+  for (const SyntheticBlock &block : program.blocks) {
+    if (block.freq == 0) continue;
+    address_count_map.emplace_hint(address_count_map.end(), block.address,
+                                   block.freq);
+    range_count_map.emplace_hint(
+        range_count_map.end(),
+        Range(block.address, block.address + block.size - 1), block.freq);
+  }
+  for (const SyntheticEdge &edge : program.edges) {
+    // Fallthroughs are not branches.
+    if (edge.weight == 0 || (edge.kind == CFGEdgePb::BRANCH_OR_FALLTHROUGH &&
+                             edge.sink == edge.src + 1))
+      continue;
+    const SyntheticBlock &src = program.blocks[edge.src];
+    const SyntheticBlock &sink = program.blocks[edge.sink];
+    // Branches are the last instruction of their block. Calls end in the
+    // middle of theirs, where the returns go back to.
+    const uint64_t from = edge.kind == CFGEdgePb::CALL
+                              ? src.address + src.size / 2 - 1
+                              : src.address + src.size - 1;
+    const uint64_t to = edge.kind == CFGEdgePb::RETURN
+                            ? sink.address + sink.size / 2
+                            : sink.address;
+    branch_count_map[Branch(from, to)] += edge.weight;
+  }
+  writer->SetAddressCountMap(address_count_map);
+  writer->SetRangeCountMap(range_count_map);
+  writer->SetBranchCountMap(branch_count_map);
+}
+
+absl::Status SyntheticPropellerWholeProgramInfo::CreateCfgs(
+    CfgCreationMode cfg_creation_mode) {
+  CreateCfgsFromProtobuf(GenerateSyntheticPropellerPb(workload_options_));
+  return absl::OkStatus();
+}
+
+}  // namespace devtools_crosstool_autofdo
@@ -0,0 +1,79 @@
+#ifndef AUTOFDO_LLVM_PROPELLER_SYNTHETIC_WORKLOAD_H_
+#define AUTOFDO_LLVM_PROPELLER_SYNTHETIC_WORKLOAD_H_
+
+#if defined(HAVE_LLVM)
+
+#include <cstdint>
+
+#include "llvm_propeller_abstract_whole_program_info.h"
+#include "llvm_propeller_cfg.pb.h"
+#include "llvm_propeller_cfg_snapshot.h"
+#include "llvm_propeller_options.pb.h"
+#include "sample_reader.h"
+#include "third_party/abseil/absl/status/status.h"
+
+namespace devtools_crosstool_autofdo {
+
+// Describes a synthetic program, used to test and benchmark the profile
+// processing at sizes of which there is no shareable testdata. The same
+// options always describe the same program.
+//
+// The program consists of `num_functions` functions, laid out one after the
+// other. Every block either falls through to the next block of its function
+// or branches forward to a later one, so the profile is free of cycles within
+// a function. The functions are split into `inlining_depth` + 1 layers by
+// index, and every function but those of the last layer calls one function of
+// the next layer, so the call chains are `inlining_depth` calls deep.
+struct SyntheticWorkloadOptions {
+  int num_functions = 1000;
+  // The number of blocks of every function is uniformly distributed in
+  // [1, 2 * `blocks_per_function` - 1].
+  int blocks_per_function = 16;
+  // Fraction of the executions of a block which fall through to the next
+  // block. The others take the branch to a random later block.
+  double edge_skew = 0.9;
+  // The function of hotness rank r, in a random order of the functions, is
+  // entered `entry_count` / (r + 1)^`function_skew` times.
+  double function_skew = 1.0;
+  uint64_t entry_count = 1000000;
+  int inlining_depth = 3;
+  uint64_t seed = 1;
+};
+
+// Returns the cfgs of the program described by `options`, named
+// "synthetic_function_<index>". Like in `WriteCfgSnapshot`, only the
+// outgoing edges of every node are recorded.
+PropellerPb GenerateSyntheticPropellerPb(
+    const SyntheticWorkloadOptions &options);
+
+// Sets the LBR samples of the program described by `options` into `writer`,
+// as if every block and edge had been sampled as often as it is executed:
+// the range of every executed block, the address of its first instruction
+// and the taken branches, calls and returns between the blocks.
+void GenerateSyntheticSamples(const SyntheticWorkloadOptions &options,
+                              TextSampleReaderWriter *writer);
+
+// Whole program info with the cfgs of a synthetic program, which are created
+// in memory instead of being read from a file.
+class SyntheticPropellerWholeProgramInfo
+    : public PropellerCfgSnapshotWholeProgramInfo {
+ public:
+  SyntheticPropellerWholeProgramInfo(
+      const PropellerOptions &options,
+      const SyntheticWorkloadOptions &workload_options)
+      : PropellerCfgSnapshotWholeProgramInfo(options),
+        workload_options_(workload_options) {}
+
+  ~SyntheticPropellerWholeProgramInfo() final {}
+
+  // All the synthetic cfgs are created, regardless of `cfg_creation_mode`.
+  absl::Status CreateCfgs(CfgCreationMode cfg_creation_mode) override;
+
+ private:
+  const SyntheticWorkloadOptions workload_options_;
+};
+
+}  // namespace devtools_crosstool_autofdo
+
+#endif
+#endif  // AUTOFDO_LLVM_PROPELLER_SYNTHETIC_WORKLOAD_H_
@@ -3,10 +3,12 @@
 #include <fcntl.h>  // for "O_RDONLY"
 
 #include <algorithm>
+#include <atomic>
 #include <cstdint>
 #include <future>  // NOLINT(build/c++11)
 #include <ios>
 #include <iterator>
+#include <limits>
 #include <memory>
 #include <numeric>
 #include <optional>
@@ -19,23 +21,29 @@
 
 #include "llvm_propeller_file_perf_data_provider.h"
 #include "llvm_propeller_formatting.h"
+#include "llvm_propeller_lbr_aggregation_cache.h"
 #include "llvm_propeller_options.pb.h"
 #include "llvm_propeller_perf_data_provider.h"
+#include "parallel_for.h"
 #include "perfdata_reader.h"
+#include "stage_metrics.h"
+#include "trace_events.h"
 #include "third_party/abseil/absl/algorithm/container.h"
 #include "third_party/abseil/absl/container/btree_map.h"
-#include "third_party/abseil/absl/container/btree_set.h"
 #include "third_party/abseil/absl/container/flat_hash_map.h"
+#include "third_party/abseil/absl/functional/function_ref.h"
 #include "third_party/abseil/absl/status/status.h"
 #include "third_party/abseil/absl/status/statusor.h"
 #include "third_party/abseil/absl/strings/str_format.h"
 #include "third_party/abseil/absl/strings/string_view.h"
+#include "third_party/abseil/absl/synchronization/mutex.h"
 #include "llvm/ADT/Optional.h"
 #include "llvm/ADT/StringRef.h"
 #include "llvm/BinaryFormat/ELF.h"
 #include "llvm/Object/ELFObjectFile.h"
 #include "llvm/Object/ELFTypes.h"
 #include "llvm/Object/ObjectFile.h"
+#include "llvm/Support/DataExtractor.h"
 #include "llvm/Support/Error.h"
 #include "llvm/Support/FormatAdapters.h"
 
@@ -63,6 +71,22 @@ using ::devtools_crosstool_autofdo::AddressFormatter;
 using ::devtools_crosstool_autofdo::BinaryInfo;
 using ::llvm::object::BBAddrMap;
 
+// Provides perf data buffers already read from another provider.
+class BufferListPerfDataProvider : public PerfDataProvider {
+ public:
+  explicit BufferListPerfDataProvider(std::vector<BufferHandle> buffers)
+      : buffers_(std::move(buffers)) {}
+
+  absl::StatusOr<std::optional<BufferHandle>> GetNext() override {
+    if (next_ == buffers_.size()) return std::nullopt;
+    return std::optional<BufferHandle>(std::move(buffers_[next_++]));
+  }
+
+ private:
+  std::vector<BufferHandle> buffers_;
+  size_t next_ = 0;
+};
+
 // Returns the binary's function symbols by reading from its symbol table.
 SymTabTy ReadSymbolTable(BinaryInfo &binary_info) {
   SymTabTy symtab;
@@ -99,27 +123,137 @@ SymTabTy ReadSymbolTable(BinaryInfo &binary_info) {
   return symtab;
 }
 
-// Returns the binary's `BBAddrMap`s by calling LLVM-side decoding function
-// `ELFObjectFileBase::readBBAddrMap`. Returns error if the call fails or if the
-// result is empty.
-absl::StatusOr<std::vector<BBAddrMap>> ReadBbAddrMap(BinaryInfo &binary_info) {
+using EncodedBbEntries = ::devtools_crosstool_autofdo::
+    PropellerWholeProgramInfo::EncodedBbEntries;
+
+// One basic block entry as encoded in the .llvm_bb_addr_map section.
+struct RawBbEntry {
+  uint32_t id;
+  uint32_t offset;
+  uint32_t size;
+  uint32_t metadata;
+};
+
+// Reads the basic block entry with index `bb_index` at `cursor`, following
+// llvm::object::ELFFile::decodeBBAddrMap. `prev_bb_end_offset` is the end of
+// the previous basic block and is updated to the end of this one.
+RawBbEntry ReadBbEntry(const llvm::DataExtractor &data,
+                       llvm::DataExtractor::Cursor &cursor, uint8_t version,
+                       uint32_t bb_index, uint32_t &prev_bb_end_offset) {
+  RawBbEntry entry;
+  entry.id = version >= 2 ? data.getULEB128(cursor) : bb_index;
+  entry.offset = data.getULEB128(cursor);
+  entry.size = data.getULEB128(cursor);
+  entry.metadata = data.getULEB128(cursor);
+  // From version 1, offsets are relative to the end of the previous block.
+  if (version >= 1) entry.offset += prev_bb_end_offset;
+  prev_bb_end_offset = entry.offset + entry.size;
+  return entry;
+}
+
+// Builds a `BBEntry` with whichever constructor the LLVM in use provides.
+template <typename BBEntry = BBAddrMap::BBEntry>
+BBEntry MakeBbEntry(const RawBbEntry &entry) {
+  if constexpr (std::is_constructible_v<BBEntry, uint32_t, uint32_t, uint32_t,
+                                        uint32_t>) {
+    return BBEntry(entry.id, entry.offset, entry.size, entry.metadata);
+  } else {
+    return BBEntry(entry.offset, entry.size, entry.metadata);
+  }
+}
+
+// Indexes the binary's .llvm_bb_addr_map sections without materializing their
+// basic block entries. Returns the `BBAddrMap` of every function with empty
+// `BBEntries` and stores where its entries are encoded into
+// `encoded_bb_entries`, in the same order. Returns error if the section is
+// malformed, or if the binary does not have a non-empty one.
+absl::StatusOr<std::vector<BBAddrMap>> IndexBbAddrMap(
+    BinaryInfo &binary_info,
+    std::vector<EncodedBbEntries> &encoded_bb_entries) {
   auto *elf_object = llvm::dyn_cast<llvm::object::ELFObjectFileBase>(
       binary_info.object_file.get());
   CHECK(elf_object);
-  Expected<std::vector<BBAddrMap>> bb_addr_map = elf_object->readBBAddrMap();
-  if (!bb_addr_map) {
-    return absl::InternalError(
-        llvm::formatv(
-            "Failed to read the LLVM_BB_ADDR_MAP section from {0}: {1}.",
-            binary_info.file_name, llvm::fmt_consume(bb_addr_map.takeError()))
-            .str());
-  }
-  if (bb_addr_map->empty()) {
+  if (elf_object->isRelocatableObject()) {
+    return absl::FailedPreconditionError(absl::StrFormat(
+        "'%s' is a relocatable object, which is not supported.",
+        binary_info.file_name));
+  }
+  std::vector<BBAddrMap> bb_addr_map;
+  for (const llvm::object::SectionRef &section : elf_object->sections()) {
+    const uint32_t section_type =
+        llvm::object::ELFSectionRef(section).getType();
+    if (section_type != llvm::ELF::SHT_LLVM_BB_ADDR_MAP &&
+        section_type != llvm::ELF::SHT_LLVM_BB_ADDR_MAP_V0)
+      continue;
+    Expected<StringRef> contents = section.getContents();
+    if (!contents) {
+      return absl::InternalError(
+          llvm::formatv(
+              "Failed to read the LLVM_BB_ADDR_MAP section from {0}: {1}.",
+              binary_info.file_name, llvm::fmt_consume(contents.takeError()))
+              .str());
+    }
+    llvm::DataExtractor data(*contents, elf_object->isLittleEndian(),
+                             elf_object->getBytesInAddress());
+    llvm::DataExtractor::Cursor cursor(0);
+    while (cursor && cursor.tell() < contents->size()) {
+      EncodedBbEntries encoded;
+      encoded.section_contents = *contents;
+      if (section_type == llvm::ELF::SHT_LLVM_BB_ADDR_MAP) {
+        encoded.version = data.getU8(cursor);
+        if (cursor && encoded.version > 2) {
+          return absl::InternalError(absl::StrFormat(
+              "Unsupported LLVM_BB_ADDR_MAP version %d in '%s'.",
+              encoded.version, binary_info.file_name));
+        }
+        data.getU8(cursor);  // Feature byte.
+      }
+      const uint64_t function_address = data.getAddress(cursor);
+      encoded.num_blocks = data.getULEB128(cursor);
+      encoded.offset = cursor.tell();
+      uint32_t prev_bb_end_offset = 0;
+      for (uint32_t bb_index = 0; cursor && bb_index != encoded.num_blocks;
+           ++bb_index) {
+        const RawBbEntry entry = ReadBbEntry(data, cursor, encoded.version,
+                                             bb_index, prev_bb_end_offset);
+        encoded.end_offset = entry.offset + entry.size;
+      }
+      if (!cursor) break;
+      bb_addr_map.push_back({function_address, {}});
+      encoded_bb_entries.push_back(encoded);
+    }
+    if (llvm::Error error = cursor.takeError()) {
+      return absl::InternalError(
+          llvm::formatv(
+              "Failed to read the LLVM_BB_ADDR_MAP section from {0}: {1}.",
+              binary_info.file_name, llvm::fmt_consume(std::move(error)))
+              .str());
+    }
+  }
+  if (bb_addr_map.empty()) {
     return absl::FailedPreconditionError(absl::StrFormat(
         "'%s' does not have a non-empty LLVM_BB_ADDR_MAP section.",
         binary_info.file_name));
   }
-  return std::move(*bb_addr_map);
+  return bb_addr_map;
+}
+
+// Returns the BB entries encoded at `encoded`, which has been validated by
+// `IndexBbAddrMap`.
+std::vector<BBAddrMap::BBEntry> DecodeEncodedBbEntries(
+    const EncodedBbEntries &encoded, bool is_little_endian) {
+  llvm::DataExtractor data(encoded.section_contents, is_little_endian,
+                           /*AddressSize=*/8);
+  llvm::DataExtractor::Cursor cursor(encoded.offset);
+  std::vector<BBAddrMap::BBEntry> bb_entries;
+  bb_entries.reserve(encoded.num_blocks);
+  uint32_t prev_bb_end_offset = 0;
+  for (uint32_t bb_index = 0; bb_index != encoded.num_blocks; ++bb_index) {
+    bb_entries.push_back(MakeBbEntry(ReadBbEntry(
+        data, cursor, encoded.version, bb_index, prev_bb_end_offset)));
+  }
+  llvm::cantFail(cursor.takeError());
+  return bb_entries;
 }
 
 // Returns a map from BB-address-map function indexes to their names.
@@ -144,46 +278,157 @@ SetFunctionIndexToNamesMap(const SymTabTy &symtab,
   }
   return function_index_to_names;
 }
+
+// Number of counters resolved by one `ParallelFor` call in `CreateEdges` and
+// `CreateFallthroughs`.
+constexpr int kCountersPerTask = 4096;
+
+// Log2 of the page size of the BB address page index.
+constexpr int kBbAddressPageShift = 12;
+// The page index is only built if the blocks span at most this many pages per
+// block.
+constexpr uint64_t kMaxBbAddressPagesPerBlock = 4;
 }  // namespace
 
-std::optional<int>
-PropellerWholeProgramInfo::FindBbHandleIndexUsingBinaryAddress(
-    uint64_t address, BranchDirection direction) const {
-  std::vector<BbHandle>::const_iterator it = absl::c_upper_bound(
-      bb_handles_, address, [this](uint64_t addr, const BbHandle &bb_handle) {
-        return addr < GetAddress(bb_handle);
-      });
-  if (it == bb_handles_.begin()) return std::nullopt;
-  it = std::prev(it);
-  if (address > GetAddress(*it)) {
-    if (address >= GetAddress(*it) + GetBBEntry(*it).Size)
+void PropellerWholeProgramInfo::BuildFallthroughIndex() {
+  next_non_fallthrough_bb_.resize(bb_handles_.size());
+  for (int i = bb_handles_.size() - 1; i >= 0; --i) {
+    if (!GetBBEntry(bb_handles_[i]).CanFallThrough) {
+      next_non_fallthrough_bb_[i] = i;
+    } else if (i + 1 != bb_handles_.size() &&
+               bb_handles_[i + 1].function_index ==
+                   bb_handles_[i].function_index) {
+      next_non_fallthrough_bb_[i] = next_non_fallthrough_bb_[i + 1];
+    } else {
+      next_non_fallthrough_bb_[i] = i + 1;
+    }
+  }
+}
+
+void PropellerWholeProgramInfo::BuildBbAddressIndex() {
+  bb_addresses_.clear();
+  bb_addresses_.reserve(bb_handles_.size());
+  for (BbHandle bb_handle : bb_handles_)
+    bb_addresses_.push_back(GetAddress(bb_handle));
+  bb_page_starts_.clear();
+  if (bb_addresses_.empty()) return;
+  bb_first_page_ = bb_addresses_.front() >> kBbAddressPageShift;
+  const uint64_t num_pages =
+      (bb_addresses_.back() >> kBbAddressPageShift) - bb_first_page_ + 1;
+  // Blocks that are spread very sparsely are better served by binary search.
+  if (num_pages > kMaxBbAddressPagesPerBlock * bb_addresses_.size()) return;
+  bb_page_starts_.reserve(num_pages + 1);
+  for (int i = 0; i != bb_addresses_.size(); ++i) {
+    const uint64_t page =
+        (bb_addresses_[i] >> kBbAddressPageShift) - bb_first_page_;
+    while (bb_page_starts_.size() <= page) bb_page_starts_.push_back(i);
+  }
+  bb_page_starts_.push_back(bb_addresses_.size());
+}
+
+int PropellerWholeProgramInfo::BbAddressUpperBound(uint64_t address) const {
+  auto begin = bb_addresses_.begin(), end = bb_addresses_.end();
+  if (!bb_page_starts_.empty()) {
+    const uint64_t page = address >> kBbAddressPageShift;
+    if (page < bb_first_page_) return 0;
+    if (page - bb_first_page_ + 1 >= bb_page_starts_.size())
+      return bb_addresses_.size();
+    begin = bb_addresses_.begin() + bb_page_starts_[page - bb_first_page_];
+    end = bb_addresses_.begin() + bb_page_starts_[page - bb_first_page_ + 1];
+  }
+  return std::upper_bound(begin, end, address) - bb_addresses_.begin();
+}
+
+int PropellerWholeProgramInfo::BbAddressUpperBoundFrom(int finger,
+                                                       uint64_t address) const {
+  const int n = bb_addresses_.size();
+  int lo, hi;
+  if (finger < n && bb_addresses_[finger] <= address) {
+    // The result is after `finger`: gallop forward.
+    int step = 1;
+    lo = finger + 1;
+    while (lo + step - 1 < n && bb_addresses_[lo + step - 1] <= address) {
+      lo += step;
+      step *= 2;
+    }
+    hi = std::min(lo + step - 1, n);
+  } else {
+    // The result is at or before `finger`: gallop backward.
+    int step = 1;
+    hi = finger;
+    while (hi - step >= 0 && bb_addresses_[hi - step] > address) {
+      hi -= step;
+      step *= 2;
+    }
+    lo = std::max(hi - step + 1, 0);
+  }
+  return std::upper_bound(bb_addresses_.begin() + lo,
+                          bb_addresses_.begin() + hi, address) -
+         bb_addresses_.begin();
+}
+
+std::optional<int> PropellerWholeProgramInfo::ResolveBbHandleIndex(
+    int upper_bound, uint64_t address, BranchDirection direction) const {
+  if (upper_bound == 0) return std::nullopt;
+  int index = upper_bound - 1;
+  if (address > bb_addresses_[index]) {
+    if (address >= bb_addresses_[index] + GetBBEntry(bb_handles_[index]).Size)
       return std::nullopt;
     else
-      return it - bb_handles_.begin();
+      return index;
   }
-  DCHECK_EQ(address, GetAddress(*it));
+  DCHECK_EQ(address, bb_addresses_[index]);
   // We might have multiple zero-sized BBs at the same address. If we are
   // branching to this address, we find and return the first zero-sized BB (from
   // the same function). If we are branching from this address, we return the
   // single non-zero sized BB.
   switch (direction) {
     case BranchDirection::kTo: {
-      auto prev_it = it;
-      while (prev_it != bb_handles_.begin() &&
-             GetAddress(*--prev_it) == address &&
-             prev_it->function_index == it->function_index) {
-        it = prev_it;
+      const int function_index = bb_handles_[index].function_index;
+      while (index != 0 && bb_addresses_[index - 1] == address &&
+             bb_handles_[index - 1].function_index == function_index) {
+        --index;
       }
-      return it - bb_handles_.begin();
+      return index;
     }
     case BranchDirection::kFrom: {
-      DCHECK_NE(GetBBEntry(*it).Size, 0);
-      return it - bb_handles_.begin();
+      DCHECK_NE(GetBBEntry(bb_handles_[index]).Size, 0);
+      return index;
     }
       LOG(FATAL) << "Invalid edge direction.";
   }
 }
 
+std::optional<int>
+PropellerWholeProgramInfo::FindBbHandleIndexUsingBinaryAddress(
+    uint64_t address, BranchDirection direction) const {
+  return ResolveBbHandleIndex(BbAddressUpperBound(address), address,
+                              direction);
+}
+
+std::vector<std::optional<int>>
+PropellerWholeProgramInfo::FindBbHandleIndexesUsingBinaryAddresses(
+    absl::Span<const uint64_t> addresses, BranchDirection direction) const {
+  std::vector<std::optional<int>> bb_handle_indexes;
+  bb_handle_indexes.reserve(addresses.size());
+  int finger = 0;
+  uint64_t last_address = 0;
+  for (int i = 0; i != addresses.size(); ++i) {
+    const uint64_t address = addresses[i];
+    // Gallop from the last lookup when the address is close to it, otherwise
+    // go through the page index.
+    const uint64_t distance = address > last_address ? address - last_address
+                                                     : last_address - address;
+    finger = i != 0 && distance >> kBbAddressPageShift == 0
+                 ? BbAddressUpperBoundFrom(finger, address)
+                 : BbAddressUpperBound(address);
+    last_address = address;
+    bb_handle_indexes.push_back(
+        ResolveBbHandleIndex(finger, address, direction));
+  }
+  return bb_handle_indexes;
+}
+
 std::unique_ptr<PropellerWholeProgramInfo> PropellerWholeProgramInfo::Create(
     const PropellerOptions &options, MultiStatusProvider *frontend_status) {
   return Create(options,
@@ -215,101 +460,316 @@ std::unique_ptr<PropellerWholeProgramInfo> PropellerWholeProgramInfo::Create(
                                     std::move(perf_data_provider), s2));
 }
 
-// Parse perf data file.
-absl::StatusOr<LBRAggregation> PropellerWholeProgramInfo::ParsePerfData() {
-  std::string match_mmap_name = options_.binary_name();
+std::string PropellerWholeProgramInfo::GetMatchMmapName() const {
+  // If user specified "--profiled_binary_name", we use it.
   if (options_.has_profiled_binary_name())
-    // If user specified "--profiled_binary_name", we use it.
-    match_mmap_name = options_.profiled_binary_name();
-  else if (!options_.ignore_build_id())
-    // Set match_mmap_name to "", so PerfDataReader::SelectPerfInfo auto
-    // picks filename based on build-id, if build id is present; otherwise,
-    // PerfDataReader::SelectPerfInfo uses options_.binary_name to match mmap
-    // event file name.
-    match_mmap_name = "";
+    return options_.profiled_binary_name();
+  // Return "", so PerfDataReader::SelectPerfInfo auto picks filename based on
+  // build-id, if build id is present; otherwise, PerfDataReader::SelectPerfInfo
+  // uses options_.binary_name to match mmap event file name.
+  if (!options_.ignore_build_id()) return "";
+  return options_.binary_name();
+}
 
-  LBRAggregation lbr_aggregation;
+void PropellerWholeProgramInfo::AggregatePerfInfo(
+    const BinaryPerfInfo &file_perf_info, LBRAggregation &lbr_aggregation) {
+  stats_.binary_mmap_num += file_perf_info.binary_mmaps.size();
+  ++stats_.perf_file_parsed;
+  AddressTranslationStats translation_stats = perf_data_reader_.AggregateLBR(
+      file_perf_info, &lbr_aggregation, options_.lbr_aggregation_threads(),
+      lbr_subsampling());
+  if (status_provider_)
+    status_provider_->AddSamplesProcessed(file_perf_info.lbr_samples.size());
+  stats_.address_translation_cache_hits += translation_stats.cache_hits;
+  stats_.address_translation_cache_misses += translation_stats.cache_misses;
+}
 
-  binary_perf_info_.ResetPerfInfo();
-  while (true) {
-    ASSIGN_OR_RETURN(std::optional<PerfDataProvider::BufferHandle> perf_data,
-                     perf_data_provider_->GetNext());
-
-    if (!perf_data.has_value()) break;
-
-    std::string description = perf_data->description;
-    LOG(INFO) << "Parsing " << description << " ...";
-    if (!PerfDataReader().SelectPerfInfo(std::move(*perf_data), match_mmap_name,
-                                         &binary_perf_info_)) {
-      LOG(WARNING) << "Skipped profile " << description
-                   << ", because reading file failed or no mmap found.";
-      continue;
-    }
-    if (binary_perf_info_.binary_mmaps.empty()) {
-      LOG(WARNING) << "Skipped profile " << description
-                   << ", because no matching mmap found.";
-      continue;
-    }
-    stats_.binary_mmap_num += binary_perf_info_.binary_mmaps.size();
-    ++stats_.perf_file_parsed;
-    perf_data_reader_.AggregateLBR(binary_perf_info_, &lbr_aggregation);
-    if (!options_.keep_frontend_intermediate_data()) {
-      // "keep_frontend_intermediate_data" is only used by tests.
-      binary_perf_info_.ResetPerfInfo();  // Release quipper parser memory.
-    } else if (options_.perf_names_size() > 1) {
-      // If there are multiple perf data files, we must always call
-      // ResetPerfInfo regardless of options_.keep_frontend_intermediate_data.
-      return absl::InvalidArgumentError(
-          "--keep_frontend_intermediate_data is only valid for single profile "
-          "file input.");
-    }
-  }
+absl::StatusOr<LBRAggregation> PropellerWholeProgramInfo::FinishParsePerfData(
+    LBRAggregation &&lbr_aggregation) {
   stats_.br_counters_accumulated += std::accumulate(
       lbr_aggregation.branch_counters.begin(),
       lbr_aggregation.branch_counters.end(), 0,
-      [](uint64_t cnt, typename BranchCountersTy::value_type &v) {
+      [](uint64_t cnt, const typename BranchCountersTy::value_type &v) {
         return cnt + v.second;
       });
   if (stats_.br_counters_accumulated <= 100)
     LOG(WARNING) << "Too few branch records in perf data.";
+  if (lbr_subsampling_.has_value() && lbr_subsampling_->halves != nullptr) {
+    const double half_overlap = lbr_subsample_halves_[0].BranchOverlap(
+        lbr_subsample_halves_[1]);
+    LOG(INFO) << "Overlap of the branch counters of the two LBR subsample "
+                 "halves: "
+              << half_overlap
+              << ", estimated overlap with the branch counters of all "
+                 "samples: "
+              << StratifiedSampleSelector::EstimateOverlapWithFull(
+                     half_overlap);
+    for (LBRAggregation &half : lbr_subsample_halves_) half = LBRAggregation();
+  }
   if (!stats_.perf_file_parsed) {
     return absl::FailedPreconditionError(
         "No perf file is parsed, cannot proceed.");
   }
-  return lbr_aggregation;
+  return std::move(lbr_aggregation);
+}
+
+// Parse perf data file.
+absl::StatusOr<LBRAggregation> PropellerWholeProgramInfo::ParsePerfData() {
+  const std::string match_mmap_name = GetMatchMmapName();
+
+  LBRAggregation lbr_aggregation;
+
+  binary_perf_info_.ResetPerfInfo();
+  // The cache only holds the aggregation, neither the mmaps kept by
+  // "keep_frontend_intermediate_data" nor the aggregations of the subsample
+  // halves.
+  const std::string &cache_dir = options_.lbr_aggregation_cache_dir();
+  std::string cache_key;
+  if (!cache_dir.empty() && !options_.keep_frontend_intermediate_data() &&
+      (!lbr_subsampling_.has_value() || lbr_subsampling_->halves == nullptr)) {
+    std::vector<PerfDataProvider::BufferHandle> perf_data;
+    while (true) {
+      ASSIGN_OR_RETURN(std::optional<PerfDataProvider::BufferHandle> next,
+                       perf_data_provider_->GetNext());
+      if (!next.has_value()) break;
+      perf_data.push_back(std::move(*next));
+    }
+    cache_key = GetLbrAggregationCacheKey(perf_data, binary_build_id(),
+                                          match_mmap_name, options_);
+    std::optional<CachedLbrAggregation> cached =
+        ReadCachedLbrAggregation(cache_dir, cache_key);
+    if (cached.has_value()) {
+      LOG(INFO) << "Read the LBR aggregation of " << perf_data.size()
+                << " perf data files from "
+                << GetLbrAggregationCachePath(cache_dir, cache_key);
+      stats_.perf_file_parsed += cached->perf_file_parsed;
+      stats_.binary_mmap_num += cached->binary_mmap_num;
+      return FinishParsePerfData(std::move(cached->lbr_aggregation));
+    }
+    // Parse the perf data already read from the provider.
+    perf_data_provider_ =
+        std::make_unique<BufferListPerfDataProvider>(std::move(perf_data));
+  }
+  const int perf_file_parsed_before = stats_.perf_file_parsed;
+  const int binary_mmap_num_before = stats_.binary_mmap_num;
+  // "keep_frontend_intermediate_data" keeps the mmaps in `binary_perf_info_`,
+  // which is only supported by the sequential path.
+  if (options_.perf_parse_threads() > 1 &&
+      !options_.keep_frontend_intermediate_data()) {
+    ASSIGN_OR_RETURN(lbr_aggregation,
+                     ParsePerfDataInParallel(match_mmap_name));
+  } else {
+    while (true) {
+      ASSIGN_OR_RETURN(std::optional<PerfDataProvider::BufferHandle> perf_data,
+                       perf_data_provider_->GetNext());
+
+      if (!perf_data.has_value()) break;
+
+      std::string description = perf_data->description;
+      const int64_t perf_data_size = perf_data->buffer->getBufferSize();
+      ScopedTraceSpan trace_span("ParsePerfData", {{"bytes", perf_data_size}});
+      LOG(INFO) << "Parsing " << description << " ...";
+      const bool selected = PerfDataReader().SelectPerfInfo(
+          std::move(*perf_data), match_mmap_name, &binary_perf_info_);
+      if (status_provider_) status_provider_->AddBytesParsed(perf_data_size);
+      if (!selected) {
+        LOG(WARNING) << "Skipped profile " << description
+                     << ", because reading file failed or no mmap found.";
+        continue;
+      }
+      if (binary_perf_info_.binary_mmaps.empty()) {
+        LOG(WARNING) << "Skipped profile " << description
+                     << ", because no matching mmap found.";
+        continue;
+      }
+      AggregatePerfInfo(binary_perf_info_, lbr_aggregation);
+      if (!options_.keep_frontend_intermediate_data()) {
+        // "keep_frontend_intermediate_data" is only used by tests.
+        binary_perf_info_.ResetPerfInfo();  // Release quipper parser memory.
+      } else if (options_.perf_names_size() > 1) {
+        // If there are multiple perf data files, we must always call
+        // ResetPerfInfo regardless of
+        // options_.keep_frontend_intermediate_data.
+        return absl::InvalidArgumentError(
+            "--keep_frontend_intermediate_data is only valid for single "
+            "profile file input.");
+      }
+    }
+  }
+  if (!cache_key.empty() &&
+      stats_.perf_file_parsed > perf_file_parsed_before) {
+    absl::Status status = WriteCachedLbrAggregation(
+        cache_dir, cache_key, lbr_aggregation,
+        stats_.perf_file_parsed - perf_file_parsed_before,
+        stats_.binary_mmap_num - binary_mmap_num_before);
+    if (!status.ok())
+      LOG(WARNING) << "Cannot cache the LBR aggregation: " << status;
+  }
+  return FinishParsePerfData(std::move(lbr_aggregation));
+}
+
+absl::StatusOr<LBRAggregation>
+PropellerWholeProgramInfo::ParsePerfDataInParallel(
+    const std::string &match_mmap_name) {
+  const int num_threads = options_.perf_parse_threads();
+  // Guards the perf data provider, which is not thread-safe, and the status
+  // and stats shared by the workers.
+  absl::Mutex mutex;
+  absl::Status status;
+  std::vector<LBRAggregation> partial_aggregations(num_threads);
+
+  auto worker = [&](LBRAggregation *partial_aggregation) {
+    int binary_mmap_num = 0;
+    int perf_file_parsed = 0;
+    AddressTranslationStats translation_stats;
+    // Each worker aggregates the subsample halves into its own counters.
+    std::optional<LbrSubsampling> subsampling = lbr_subsampling_;
+    std::array<LBRAggregation, 2> subsample_halves;
+    if (subsampling.has_value() && subsampling->halves != nullptr)
+      subsampling->halves = &subsample_halves;
+    while (true) {
+      std::optional<PerfDataProvider::BufferHandle> perf_data;
+      {
+        absl::MutexLock lock(&mutex);
+        if (!status.ok()) break;
+        absl::StatusOr<std::optional<PerfDataProvider::BufferHandle>> next =
+            perf_data_provider_->GetNext();
+        if (!next.ok()) {
+          status = next.status();
+          break;
+        }
+        perf_data = std::move(*next);
+      }
+      if (!perf_data.has_value()) break;
+
+      std::string description = perf_data->description;
+      const int64_t perf_data_size = perf_data->buffer->getBufferSize();
+      ScopedTraceSpan trace_span("ParsePerfData", {{"bytes", perf_data_size}});
+      LOG(INFO) << "Parsing " << description << " ...";
+      // Each file gets its own mmaps, the binary metadata is shared by value.
+      BinaryPerfInfo file_perf_info;
+      file_perf_info.binary_info =
+          binary_perf_info_.binary_info.CopyMetadata();
+      const bool selected = PerfDataReader().SelectPerfInfo(
+          std::move(*perf_data), match_mmap_name, &file_perf_info);
+      // The status provider is lock-free, so it is updated outside "mutex".
+      if (status_provider_) status_provider_->AddBytesParsed(perf_data_size);
+      if (!selected) {
+        LOG(WARNING) << "Skipped profile " << description
+                     << ", because reading file failed or no mmap found.";
+        continue;
+      }
+      if (file_perf_info.binary_mmaps.empty()) {
+        LOG(WARNING) << "Skipped profile " << description
+                     << ", because no matching mmap found.";
+        continue;
+      }
+      binary_mmap_num += file_perf_info.binary_mmaps.size();
+      ++perf_file_parsed;
+      translation_stats += perf_data_reader_.AggregateLBR(
+          file_perf_info, partial_aggregation,
+          options_.lbr_aggregation_threads(),
+          subsampling.has_value() ? &*subsampling : nullptr);
+      if (status_provider_) {
+        status_provider_->AddSamplesProcessed(
+            file_perf_info.lbr_samples.size());
+      }
+    }
+    absl::MutexLock lock(&mutex);
+    stats_.binary_mmap_num += binary_mmap_num;
+    stats_.perf_file_parsed += perf_file_parsed;
+    stats_.address_translation_cache_hits += translation_stats.cache_hits;
+    stats_.address_translation_cache_misses += translation_stats.cache_misses;
+    for (int h = 0; h < 2; ++h)
+      lbr_subsample_halves_[h].MergeFrom(subsample_halves[h]);
+  };
+
+  std::vector<std::thread> workers;
+  workers.reserve(num_threads);
+  for (LBRAggregation &partial_aggregation : partial_aggregations)
+    workers.emplace_back(worker, &partial_aggregation);
+  for (std::thread &t : workers) t.join();
+  if (!status.ok()) return status;
+
+  // Reduction tree: at each level, partial k absorbs partial k + stride for
+  // every k that is a multiple of 2 * stride, with all merges of a level
+  // running concurrently.
+  for (int stride = 1; stride < num_threads; stride *= 2) {
+    std::vector<std::thread> mergers;
+    for (int k = 0; k + stride < num_threads; k += 2 * stride) {
+      mergers.emplace_back([&partial_aggregations, k, stride]() {
+        partial_aggregations[k].MergeFrom(partial_aggregations[k + stride]);
+        partial_aggregations[k + stride] = LBRAggregation();
+      });
+    }
+    for (std::thread &t : mergers) t.join();
+  }
+  return std::move(partial_aggregations.front());
 }
 
 absl::Status PropellerWholeProgramInfo::DoCreateCfgs(
     LBRAggregation &&lbr_aggregation,
-    absl::btree_set<int> &&selected_functions) {
-  // Temporary map from symbol ordinal -> CFGNode.
-  absl::flat_hash_map<int, CFGNode *> node_map;
-  // Temporary map from function index -> ControlFlowGraph.
-  absl::btree_map<int, std::unique_ptr<ControlFlowGraph>> cfg_map;
+    FunctionIndexSet &&selected_functions) {
+  const int num_threads = std::max(options_.cfg_creation_threads(), 1u);
+  stats_.lbr_aggregation_bytes = lbr_aggregation.MemoryUsage();
+  if (status_provider_)
+    status_provider_->SetMemoryBytes(stats_.lbr_aggregation_bytes);
+  // Ordinals are assigned consecutively to the nodes of the functions, in the
+  // order of their function index. The functions without a cfg only keep the
+  // sizes of their basic blocks.
+  std::vector<int> func_indexes;
+  std::vector<uint64_t> first_ordinals;
   uint64_t ordinal = 0;
   for (int func_index : selected_functions) {
-    const BBAddrMap &func_bb_addr_map = bb_addr_map_[func_index];
+    const auto &bb_entries = bb_addr_map_[func_index].BBEntries;
+    if (functions_with_cfgs_.has_value() &&
+        !functions_with_cfgs_->contains(func_index)) {
+      cold_functions_.Add(function_index_to_names_map_.at(func_index), ordinal,
+                          bb_entries);
+    } else {
+      func_indexes.push_back(func_index);
+      first_ordinals.push_back(ordinal);
+    }
+    ordinal += bb_entries.size();
+  }
+  if (!cold_functions_.empty()) {
+    stats_.cfg_bytes += cold_functions_.MemoryUsage();
+    LOG(INFO) << "Kept " << cold_functions_.size()
+              << " cold functions without a cfg.";
+  }
+  std::vector<std::unique_ptr<ControlFlowGraph>> cfgs(func_indexes.size());
+  ParallelFor(num_threads, func_indexes.size(), [&](int i) {
+    const BBAddrMap &func_bb_addr_map = bb_addr_map_[func_indexes[i]];
     CHECK(!func_bb_addr_map.BBEntries.empty());
-    auto cfg = std::make_unique<ControlFlowGraph>(
-        function_index_to_names_map_[func_index]);
-    cfg->CreateNodes(func_bb_addr_map, ordinal);
-    CHECK_EQ(cfg->nodes().size(), func_bb_addr_map.BBEntries.size());
-    ordinal += cfg->nodes().size();
+    cfgs[i] = std::make_unique<ControlFlowGraph>(
+        function_index_to_names_map_.at(func_indexes[i]));
+    cfgs[i]->CreateNodes(func_bb_addr_map, first_ordinals[i]);
+    CHECK_EQ(cfgs[i]->nodes().size(), func_bb_addr_map.BBEntries.size());
+  });
+
+  // Temporary map from symbol ordinal -> CFGNode.
+  absl::flat_hash_map<int, CFGNode *> node_map;
+  node_map.reserve(ordinal);
+  for (const std::unique_ptr<ControlFlowGraph> &cfg : cfgs) {
     stats_.nodes_created += cfg->nodes().size();
     // Setup mapping from symbol ordinals <-> nodes
     for (const std::unique_ptr<CFGNode> &node : cfg->nodes())
       node_map.insert({node->symbol_ordinal(), node.get()});
-    cfg_map.emplace(func_index, std::move(cfg));
     ++stats_.cfgs_created;
   }
   if (!CreateEdges(lbr_aggregation, node_map))
     return absl::InternalError("Unable to create edges from LBR profile.");
 
-  for (auto &[func_index, cfg] : cfg_map) {
-    cfg->CalculateNodeFreqs();
-    if (cfg->n_hot_landing_pads() != 0) ++stats_.cfgs_with_hot_landing_pads;
-    cfgs_.insert(
-        {function_index_to_names_map_[func_index].front(), std::move(cfg)});
+  // Node frequencies only depend on the (now final) edge weights, so every CFG
+  // can compute them independently.
+  ParallelFor(num_threads, cfgs.size(),
+              [&](int i) { cfgs[i]->CalculateNodeFreqs(); });
+  for (int i = 0; i != cfgs.size(); ++i) {
+    if (cfgs[i]->n_hot_landing_pads() != 0)
+      ++stats_.cfgs_with_hot_landing_pads;
+    stats_.cfg_bytes += cfgs[i]->MemoryUsage();
+    cfgs_.insert({function_index_to_names_map_[func_indexes[i]].front(),
+                  std::move(cfgs[i])});
   }
 
   // Release / cleanup.
@@ -321,6 +781,12 @@ absl::Status PropellerWholeProgramInfo::DoCreateCfgs(
     function_index_to_names_map_.clear();
     bb_addr_map_.clear();
   }
+  if (status_provider_) {
+    status_provider_->SetMemoryBytes(
+        stats_.cfg_bytes + (options_.keep_frontend_intermediate_data()
+                                ? stats_.lbr_aggregation_bytes
+                                : 0));
+  }
   return absl::OkStatus();
 }
 
@@ -328,7 +794,8 @@ CFGEdge *PropellerWholeProgramInfo::InternalCreateEdge(
     int from_bb_ordinal, int to_bb_ordinal, uint64_t weight,
     CFGEdge::Kind edge_kind,
     const absl::flat_hash_map<int, CFGNode *> &tmp_node_map,
-    absl::flat_hash_map<std::pair<int, int>, CFGEdge *> *tmp_edge_map) {
+    absl::flat_hash_map<std::pair<int, int>, CFGEdge *> *tmp_edge_map,
+    PropellerStats *stats) const {
   CFGEdge *edge = nullptr;
   auto i = tmp_edge_map->find(std::make_pair(from_bb_ordinal, to_bb_ordinal));
   if (i != tmp_edge_map->end()) {
@@ -338,7 +805,7 @@ CFGEdge *PropellerWholeProgramInfo::InternalCreateEdge(
                    << CFGEdgeNameFormatter(edge) << " has type "
                    << CFGEdge::GetCfgEdgeKindString(edge_kind) << " and "
                    <<  CFGEdge::GetCfgEdgeKindString(edge->kind());
-      ++stats_.edges_with_same_src_sink_but_different_type;
+      ++stats->edges_with_same_src_sink_but_different_type;
     }
     edge->IncrementWeight(weight);
   } else {
@@ -350,12 +817,12 @@ CFGEdge *PropellerWholeProgramInfo::InternalCreateEdge(
     CFGNode *to_node = to_ni->second;
     DCHECK(from_node && to_node);
     edge = from_node->cfg()->CreateEdge(from_node, to_node, weight, edge_kind);
-    ++stats_.edges_created_by_kind[edge_kind];
+    ++stats->edges_created_by_kind[edge_kind];
     tmp_edge_map->emplace(std::piecewise_construct,
                           std::forward_as_tuple(from_bb_ordinal, to_bb_ordinal),
                           std::forward_as_tuple(edge));
   }
-  stats_.total_edge_weight_by_kind[edge_kind] += weight;
+  stats->total_edge_weight_by_kind[edge_kind] += weight;
   return edge;
 }
 
@@ -363,31 +830,56 @@ CFGEdge *PropellerWholeProgramInfo::InternalCreateEdge(
 // <from_addr, to_addr> in "branch_counters_", we translate it to <from_symbol,
 // to_symbol> and by using tmp_node_map, we further translate it to <from_node,
 // to_node>, and finally create a CFGEdge for such CFGNode pair.
+//
+// This runs in three steps. First, the branch addresses are translated to
+// basic blocks on `options_.cfg_creation_threads()` threads. Then the branches
+// are partitioned by function and the intra-function edges of every function
+// are created in parallel, since they only touch the nodes of that function.
+// Finally, the inter-function (call and return) edges, which touch the nodes of
+// two CFGs, are created on the calling thread. Every edge list still sees its
+// edges in the order of their branch addresses, so the resulting CFGs are the
+// same as with a single thread.
 bool PropellerWholeProgramInfo::CreateEdges(
     const LBRAggregation &lbr_aggregation,
     const absl::flat_hash_map<int, CFGNode *> &tmp_node_map) {
-  // Temp map that records which CFGEdges are created, so we do not re-create
-  // edges. Note this is necessary: although
+  const int num_threads = std::max(options_.cfg_creation_threads(), 1u);
+  // Note creating an edge twice must be prevented: although
   // "branch_counters_" have no duplicated <from_addr, to_addr> pairs, the
-  // translated <from_bb, to_bb> may have duplicates.
-  absl::flat_hash_map<std::pair<int, int>, CFGEdge *> tmp_edge_map;
+  // translated <from_bb, to_bb> may have duplicates. Intra-function edges are
+  // tracked in `edges_by_function` and inter-function edges in
+  // `inter_function_edge_map`.
+  absl::flat_hash_map<int, IntraFunctionEdges> edges_by_function;
+  absl::flat_hash_map<std::pair<int, int>, CFGEdge *> inter_function_edge_map;
 
   absl::flat_hash_map<std::pair<int, int>, uint64_t>
       tmp_bb_fallthrough_counters;
 
-  uint64_t weight_on_dubious_edges = 0;
-  uint64_t edges_recorded = 0;
-  for (const typename BranchCountersTy::value_type &bcnt :
-       lbr_aggregation.branch_counters) {
-    ++edges_recorded;
+  // A branch counter translated to basic blocks.
+  struct TranslatedBranch {
+    // Whether the branch can be turned into an edge.
+    bool has_edge = false;
+    // Whether the branch is a return to the block after the callsite, which
+    // implies a fallthrough from the callsite block to the next block.
+    bool has_callsite_fallthrough = false;
+    // Whether the branch is neither a return nor a jump to the beginning of a
+    // function or a basic block.
+    bool is_dubious = false;
+    ResolvedBranch branch;
+  };
+
+  // Edges are created in the order of their branch addresses, so that the
+  // resulting CFGs do not depend on the (unordered) hash map iteration order.
+  const LBRAggregation::SortedCountersTy branch_counters =
+      lbr_aggregation.GetSortedBranchCounters();
+  std::vector<TranslatedBranch> translated_branches(branch_counters.size());
+  auto translate_branch = [&](int index, std::optional<int> from_bb_index,
+                              std::optional<int> to_bb_index) {
+    const auto &bcnt = branch_counters[index];
+    TranslatedBranch &translated = translated_branches[index];
     uint64_t from = bcnt.first.first;
     uint64_t to = bcnt.first.second;
     uint64_t weight = bcnt.second;
-    std::optional<int> from_bb_index =
-        FindBbHandleIndexUsingBinaryAddress(from, BranchDirection::kFrom);
-    std::optional<int> to_bb_index =
-        FindBbHandleIndexUsingBinaryAddress(to, BranchDirection::kTo);
-    if (!to_bb_index.has_value()) continue;
+    if (!to_bb_index.has_value()) return;
 
     BbHandle to_bb_handle = bb_handles_[*to_bb_index];
     BbHandle from_bb_handle = from_bb_index.has_value()
@@ -407,7 +899,7 @@ bool PropellerWholeProgramInfo::CreateEdges(
         to == GetAddress(to_bb_handle)) {
       if (to_bb_handle.bb_index != 0) {
         // Account for the fall-through between callSiteSym and toSym.
-        tmp_bb_fallthrough_counters[{*to_bb_index - 1, *to_bb_index}] += weight;
+        translated.has_callsite_fallthrough = true;
         // Reassign to_bb to be the actuall callsite symbol entry.
         --*to_bb_index;
       } else {
@@ -416,13 +908,13 @@ bool PropellerWholeProgramInfo::CreateEdges(
                      << GetName(to_bb_handle);
       }
     }
-    if (!from_bb_index.has_value()) continue;
-    if (!GetBBEntry(from_bb_handle).HasReturn &&
-        GetAddress(to_bb_handle) != to) {
-      // Jump is not a return and its target is not the beginning of a function
-      // or a basic block.
-      weight_on_dubious_edges += weight;
-    }
+    translated.branch.to_bb = *to_bb_index;
+    translated.branch.weight = weight;
+    if (!from_bb_index.has_value()) return;
+    // Jump is not a return and its target is not the beginning of a function
+    // or a basic block.
+    translated.is_dubious = !GetBBEntry(from_bb_handle).HasReturn &&
+                            GetAddress(to_bb_handle) != to;
 
     CFGEdge::Kind edge_kind = CFGEdge::Kind::kBranchOrFallthough;
     if (GetFunctionEntry(to_bb_handle).Addr == to) {
@@ -431,8 +923,79 @@ bool PropellerWholeProgramInfo::CreateEdges(
                GetBBEntry(from_bb_handle).HasReturn) {
       edge_kind = CFGEdge::Kind::kRet;
     }
-    InternalCreateEdge(from_bb_index.value(), to_bb_index.value(), weight,
-                       edge_kind, tmp_node_map, &tmp_edge_map);
+    translated.has_edge = true;
+    translated.branch.from_bb = *from_bb_index;
+    translated.branch.edge_kind = edge_kind;
+  };
+  // The counters are sorted by their source addresses, so the sources of a
+  // task are resolved in one galloping pass. Their targets are mostly close to
+  // each other too.
+  ParallelFor(num_threads,
+              (branch_counters.size() + kCountersPerTask - 1) /
+                  kCountersPerTask,
+              [&](int task) {
+                const int begin = task * kCountersPerTask;
+                const int end = std::min<int>(begin + kCountersPerTask,
+                                              branch_counters.size());
+                std::vector<uint64_t> from_addresses, to_addresses;
+                from_addresses.reserve(end - begin);
+                to_addresses.reserve(end - begin);
+                for (int i = begin; i != end; ++i) {
+                  from_addresses.push_back(branch_counters[i].first.first);
+                  to_addresses.push_back(branch_counters[i].first.second);
+                }
+                const std::vector<std::optional<int>> from_bb_indexes =
+                    FindBbHandleIndexesUsingBinaryAddresses(
+                        from_addresses, BranchDirection::kFrom);
+                const std::vector<std::optional<int>> to_bb_indexes =
+                    FindBbHandleIndexesUsingBinaryAddresses(
+                        to_addresses, BranchDirection::kTo);
+                for (int i = begin; i != end; ++i) {
+                  translate_branch(i, from_bb_indexes[i - begin],
+                                   to_bb_indexes[i - begin]);
+                }
+              });
+
+  uint64_t weight_on_dubious_edges = 0;
+  const uint64_t edges_recorded = branch_counters.size();
+  std::vector<ResolvedBranch> inter_function_branches;
+  for (const TranslatedBranch &translated : translated_branches) {
+    const ResolvedBranch &branch = translated.branch;
+    if (translated.has_callsite_fallthrough) {
+      tmp_bb_fallthrough_counters[{branch.to_bb, branch.to_bb + 1}] +=
+          branch.weight;
+    }
+    if (!translated.has_edge) continue;
+    if (translated.is_dubious) weight_on_dubious_edges += branch.weight;
+    const int from_function_index = bb_handles_[branch.from_bb].function_index;
+    if (from_function_index == bb_handles_[branch.to_bb].function_index) {
+      edges_by_function[from_function_index].branches.push_back(branch);
+    } else {
+      inter_function_branches.push_back(branch);
+    }
+  }
+
+  std::vector<IntraFunctionEdges *> function_edges;
+  function_edges.reserve(edges_by_function.size());
+  for (auto &[unused, edges] : edges_by_function)
+    function_edges.push_back(&edges);
+  ParallelFor(num_threads, function_edges.size(), [&](int i) {
+    IntraFunctionEdges &edges = *function_edges[i];
+    for (const ResolvedBranch &branch : edges.branches) {
+      InternalCreateEdge(branch.from_bb, branch.to_bb, branch.weight,
+                         branch.edge_kind, tmp_node_map, &edges.edge_map,
+                         &edges.stats);
+    }
+  });
+  for (IntraFunctionEdges *edges : function_edges) {
+    stats_ += edges->stats;
+    edges->stats = PropellerStats();
+    edges->branches.clear();
+  }
+  for (const ResolvedBranch &branch : inter_function_branches) {
+    InternalCreateEdge(branch.from_bb, branch.to_bb, branch.weight,
+                       branch.edge_kind, tmp_node_map,
+                       &inter_function_edge_map, &stats_);
   }
 
   if (weight_on_dubious_edges /
@@ -456,7 +1019,7 @@ bool PropellerWholeProgramInfo::CreateEdges(
   }
 
   CreateFallthroughs(lbr_aggregation, tmp_node_map,
-                     &tmp_bb_fallthrough_counters, &tmp_edge_map);
+                     &tmp_bb_fallthrough_counters, &edges_by_function);
   return true;
 }
 
@@ -465,44 +1028,112 @@ bool PropellerWholeProgramInfo::CreateEdges(
 // 2. calculate all symbols between "from_sym" and "to_sym", so we get the
 //    symbol path: <from_sym, internal_sym1, internal_sym2, ... , internal_symn,
 //    to_sym>.
-// 3. create edges and apply weights for the above path.
+// 3. create edges and apply weights for the above path. The weights of all the
+//    paths of a function are summed per edge first, so that every edge is
+//    looked up once.
+// Step 1 and step 3 run on `options_.cfg_creation_threads()` threads. Step 3
+// is done per function, since fallthrough paths never cross functions.
 void PropellerWholeProgramInfo::CreateFallthroughs(
     const LBRAggregation &lbr_aggregation,
     const absl::flat_hash_map<int, CFGNode *> &tmp_node_map,
     absl::flat_hash_map<std::pair<int, int>, uint64_t>
         *tmp_bb_fallthrough_counters,
-    absl::flat_hash_map<std::pair<int, int>, CFGEdge *> *tmp_edge_map) {
-  for (auto &i : lbr_aggregation.fallthrough_counters) {
-    const uint64_t cnt = i.second;
-    // A fallthrough from A to B implies a branch to A followed by a branch
-    // from B. Therefore we respectively use BranchDirection::kTo and
-    // BranchDirection::kFrom for A and B when calling
-    // `FindBbHandleIndexUsingBinaryAddress` to find their associated blocks.
-    auto from_index = FindBbHandleIndexUsingBinaryAddress(i.first.first,
-                                                          BranchDirection::kTo);
-    auto to_index = FindBbHandleIndexUsingBinaryAddress(i.first.second,
-                                                        BranchDirection::kFrom);
-    if (from_index && to_index)
-      (*tmp_bb_fallthrough_counters)[{*from_index, *to_index}] += cnt;
+    absl::flat_hash_map<int, IntraFunctionEdges> *edges_by_function) {
+  const int num_threads = std::max(options_.cfg_creation_threads(), 1u);
+  // Sorted, so that nearby fallthroughs are resolved together by the
+  // galloping lookup.
+  std::vector<std::pair<std::pair<uint64_t, uint64_t>, uint64_t>>
+      fallthrough_counters(lbr_aggregation.fallthrough_counters.begin(),
+                           lbr_aggregation.fallthrough_counters.end());
+  absl::c_sort(fallthrough_counters);
+  std::vector<std::optional<std::pair<int, int>>> fallthrough_bb_indexes(
+      fallthrough_counters.size());
+  ParallelFor(
+      num_threads,
+      (fallthrough_counters.size() + kCountersPerTask - 1) / kCountersPerTask,
+      [&](int task) {
+        const int begin = task * kCountersPerTask;
+        const int end =
+            std::min<int>(begin + kCountersPerTask, fallthrough_counters.size());
+        std::vector<uint64_t> from_addresses, to_addresses;
+        from_addresses.reserve(end - begin);
+        to_addresses.reserve(end - begin);
+        for (int i = begin; i != end; ++i) {
+          from_addresses.push_back(fallthrough_counters[i].first.first);
+          to_addresses.push_back(fallthrough_counters[i].first.second);
+        }
+        // A fallthrough from A to B implies a branch to A followed by a
+        // branch from B. Therefore we respectively use BranchDirection::kTo
+        // and BranchDirection::kFrom for A and B when calling
+        // `FindBbHandleIndexesUsingBinaryAddresses` to find their associated
+        // blocks.
+        const std::vector<std::optional<int>> from_indexes =
+            FindBbHandleIndexesUsingBinaryAddresses(from_addresses,
+                                                    BranchDirection::kTo);
+        const std::vector<std::optional<int>> to_indexes =
+            FindBbHandleIndexesUsingBinaryAddresses(to_addresses,
+                                                    BranchDirection::kFrom);
+        for (int i = begin; i != end; ++i) {
+          const std::optional<int> &from_index = from_indexes[i - begin];
+          const std::optional<int> &to_index = to_indexes[i - begin];
+          if (from_index && to_index)
+            fallthrough_bb_indexes[i].emplace(*from_index, *to_index);
+        }
+      });
+  for (int i = 0; i != fallthrough_counters.size(); ++i) {
+    if (fallthrough_bb_indexes[i].has_value()) {
+      (*tmp_bb_fallthrough_counters)[*fallthrough_bb_indexes[i]] +=
+          fallthrough_counters[i].second;
+    }
   }
 
   for (auto &i : *tmp_bb_fallthrough_counters) {
-    int fallthrough_from = i.first.first, fallthrough_to = i.first.second;
-    uint64_t weight = i.second;
-    if (fallthrough_from == fallthrough_to ||
-        !CanFallThrough(fallthrough_from, fallthrough_to))
-      continue;
+    const int function_index = bb_handles_[i.first.first].function_index;
+    (*edges_by_function)[function_index].fallthroughs.push_back(i);
+  }
 
-    for (int sym = fallthrough_from; sym <= fallthrough_to - 1; ++sym) {
-      auto *fallthrough_edge = InternalCreateEdge(
-          sym, sym + 1, weight, CFGEdge::Kind::kBranchOrFallthough,
-          tmp_node_map, tmp_edge_map);
-      if (!fallthrough_edge) break;
+  std::vector<IntraFunctionEdges *> function_edges;
+  function_edges.reserve(edges_by_function->size());
+  for (auto &[unused, edges] : *edges_by_function)
+    function_edges.push_back(&edges);
+  ParallelFor(num_threads, function_edges.size(), [&](int i) {
+    IntraFunctionEdges &edges = *function_edges[i];
+    // Every valid fallthrough path adds its weight to the edges between its
+    // consecutive blocks. The weights are accumulated in a difference array
+    // over the blocks spanned by the paths, so that every edge is created or
+    // incremented once, in the order of its blocks.
+    int first_bb = std::numeric_limits<int>::max(), last_bb = -1;
+    auto valid_end = edges.fallthroughs.begin();
+    for (const auto &fallthrough_weight : edges.fallthroughs) {
+      auto [fallthrough_from, fallthrough_to] = fallthrough_weight.first;
+      if (fallthrough_from == fallthrough_to ||
+          !CanFallThrough(fallthrough_from, fallthrough_to))
+        continue;
+      first_bb = std::min(first_bb, fallthrough_from);
+      last_bb = std::max(last_bb, fallthrough_to);
+      *valid_end++ = fallthrough_weight;
     }
-  }
+    edges.fallthroughs.erase(valid_end, edges.fallthroughs.end());
+    if (edges.fallthroughs.empty()) return;
+    // The weights wrap around, but every prefix sum is the weight of an edge.
+    std::vector<uint64_t> weight_deltas(last_bb - first_bb + 1);
+    for (const auto &[fallthrough, weight] : edges.fallthroughs) {
+      weight_deltas[fallthrough.first - first_bb] += weight;
+      weight_deltas[fallthrough.second - first_bb] -= weight;
+    }
+    uint64_t weight = 0;
+    for (int sym = first_bb; sym != last_bb; ++sym) {
+      weight += weight_deltas[sym - first_bb];
+      if (weight == 0) continue;
+      InternalCreateEdge(sym, sym + 1, weight,
+                         CFGEdge::Kind::kBranchOrFallthough, tmp_node_map,
+                         &edges.edge_map, &edges.stats);
+    }
+  });
+  for (IntraFunctionEdges *edges : function_edges) stats_ += edges->stats;
 }
 
-bool PropellerWholeProgramInfo::CanFallThrough(int from, int to) {
+bool PropellerWholeProgramInfo::CanFallThrough(int from, int to) const {
   if (from == to) return true;
   BbHandle from_bb = bb_handles_[from];
   BbHandle to_bb = bb_handles_[to];
@@ -511,7 +1142,8 @@ bool PropellerWholeProgramInfo::CanFallThrough(int from, int to) {
                     "larger than end address. ***";
     return false;
   }
-  if (!GetBBEntry(from_bb).CanFallThrough) {
+  const int next_non_fallthrough = next_non_fallthrough_bb_[from];
+  if (next_non_fallthrough == from) {
     LOG(WARNING) << "*** Skipping non-fallthrough ***" << GetName(from_bb);
     return false;
   }
@@ -522,17 +1154,14 @@ bool PropellerWholeProgramInfo::CanFallThrough(int from, int to) {
         << ") does not start and end within the same function.";
     return false;
   }
-  for (int i = from_bb.bb_index; i != to_bb.bb_index; ++i) {
-    BbHandle bb_sym(from_bb.function_index, i);
-    // (b/62827958) Sometimes LBR contains duplicate entries in the beginning
-    // of the stack which may result in false fallthrough paths. We discard
-    // the fallthrough path if any intermediate block (except the destination
-    // block) does not fall through (source block is checked before entering
-    // this loop).
-    if (!GetBBEntry(bb_sym).CanFallThrough) {
-      LOG(WARNING) << "*** Skipping non-fallthrough ***" << GetName(bb_sym);
-      return false;
-    }
+  // (b/62827958) Sometimes LBR contains duplicate entries in the beginning
+  // of the stack which may result in false fallthrough paths. We discard
+  // the fallthrough path if any intermediate block (except the destination
+  // block) does not fall through.
+  if (next_non_fallthrough < to) {
+    LOG(WARNING) << "*** Skipping non-fallthrough ***"
+                 << GetName(bb_handles_[next_non_fallthrough]);
+    return false;
   }
   // Warn about unusually-long fallthroughs.
   if (to - from >= 200) {
@@ -544,11 +1173,21 @@ bool PropellerWholeProgramInfo::CanFallThrough(int from, int to) {
 }
 
 // For each lbr record addr1->addr2, find function1/2 that contain addr1/addr2
-// and add function1/2's index into the returned set.
-absl::btree_set<int> PropellerWholeProgramInfo::CalculateHotFunctions(
+// and add function1/2's index into the returned set. The branch addresses are
+// looked up on `cfg_creation_threads` threads, which set the bits of the
+// functions they find with atomic word updates. With `hot_coverage` below 1,
+// they also add the count of each record to the weights of function1/2, and
+// only the heaviest functions whose weights cover that fraction of the total
+// weight are kept.
+FunctionIndexSet PropellerWholeProgramInfo::CalculateHotFunctions(
     const LBRAggregation &lbr_aggregation) {
-  absl::btree_set<int> hot_functions;
-  auto add_to_hot_functions = [this, &hot_functions](uint64_t binary_address) {
+  const bool by_coverage = options_.hot_coverage() < 1;
+  std::vector<std::atomic<uint64_t>> hot_words(
+      (bb_addr_map_.size() + FunctionIndexSet::kBitsPerWord - 1) /
+      FunctionIndexSet::kBitsPerWord);
+  std::vector<std::atomic<uint64_t>> weights(by_coverage ? bb_addr_map_.size()
+                                                         : 0);
+  auto add_to_hot_functions = [&](uint64_t binary_address, uint64_t count) {
     auto it =
         absl::c_upper_bound(bb_addr_map_, binary_address,
                             [](uint64_t addr, const BBAddrMap &func_entry) {
@@ -556,23 +1195,74 @@ absl::btree_set<int> PropellerWholeProgramInfo::CalculateHotFunctions(
                             });
     if (it == bb_addr_map_.begin()) return;
     it = std::prev(it);
+    const int function_index = it - bb_addr_map_.begin();
     // We know the address is bigger than or equal to the function address. Make
     // sure that it doesn't point beyond the last basic block.
     if (binary_address >=
-        it->Addr + it->BBEntries.back().Offset + it->BBEntries.back().Size)
+        it->Addr + encoded_bb_entries_[function_index].end_offset)
       return;
-    hot_functions.insert(it - bb_addr_map_.begin());
+    hot_words[function_index / FunctionIndexSet::kBitsPerWord].fetch_or(
+        uint64_t{1} << (function_index % FunctionIndexSet::kBitsPerWord),
+        std::memory_order_relaxed);
+    if (by_coverage)
+      weights[function_index].fetch_add(count, std::memory_order_relaxed);
   };
+  std::vector<uint64_t> branch_addresses;
+  branch_addresses.reserve(2 * lbr_aggregation.branch_counters.size());
+  // The count of the record of every pair of addresses, with `hot_coverage`.
+  std::vector<uint64_t> branch_counts;
+  if (by_coverage)
+    branch_counts.reserve(lbr_aggregation.branch_counters.size());
   for (const auto &bcnt : lbr_aggregation.branch_counters) {
-    add_to_hot_functions(bcnt.first.first);
-    add_to_hot_functions(bcnt.first.second);
+    branch_addresses.push_back(bcnt.first.first);
+    branch_addresses.push_back(bcnt.first.second);
+    if (by_coverage) branch_counts.push_back(bcnt.second);
+  }
+  const int num_tasks =
+      (branch_addresses.size() + kCountersPerTask - 1) / kCountersPerTask;
+  ParallelFor(options_.cfg_creation_threads(), num_tasks, [&](int task) {
+    const int end = std::min<int>((task + 1) * kCountersPerTask,
+                                  branch_addresses.size());
+    for (int i = task * kCountersPerTask; i != end; ++i) {
+      add_to_hot_functions(branch_addresses[i],
+                           by_coverage ? branch_counts[i / 2] : 0);
+    }
+  });
+
+  std::vector<uint64_t> words;
+  words.reserve(hot_words.size());
+  for (const std::atomic<uint64_t> &word : hot_words)
+    words.push_back(word.load(std::memory_order_relaxed));
+  FunctionIndexSet hot_functions(bb_addr_map_.size(), std::move(words));
+  if (by_coverage) {
+    // Ties are broken by index, so the selection is deterministic.
+    std::vector<int> ranked(hot_functions.begin(), hot_functions.end());
+    uint64_t total_weight = 0;
+    for (int function_index : ranked)
+      total_weight += weights[function_index].load(std::memory_order_relaxed);
+    absl::c_stable_sort(ranked, [&](int a, int b) {
+      return weights[a].load(std::memory_order_relaxed) >
+             weights[b].load(std::memory_order_relaxed);
+    });
+    FunctionIndexSet covering_functions(bb_addr_map_.size());
+    uint64_t covered_weight = 0;
+    for (int function_index : ranked) {
+      if (covered_weight >= options_.hot_coverage() * total_weight) break;
+      covering_functions.insert(function_index);
+      covered_weight += weights[function_index].load(std::memory_order_relaxed);
+    }
+    LOG(INFO) << "Kept " << covering_functions.size() << " of "
+              << ranked.size() << " hot functions, which cover "
+              << covered_weight << " of the branch count of " << total_weight
+              << ".";
+    hot_functions = std::move(covering_functions);
   }
   stats_.hot_functions = hot_functions.size();
   return hot_functions;
 }
 
 void PropellerWholeProgramInfo::DropNonSelectedFunctions(
-    const absl::btree_set<int> &selected_functions) {
+    const FunctionIndexSet &selected_functions) {
   for (int i = 0; i != bb_addr_map_.size(); ++i) {
     if (selected_functions.contains(i)) continue;
     bb_addr_map_[i].BBEntries.clear();
@@ -583,38 +1273,30 @@ void PropellerWholeProgramInfo::DropNonSelectedFunctions(
 }
 
 void PropellerWholeProgramInfo::FilterNoNameFunctions(
-    absl::btree_set<int> &selected_functions) const {
-  for (auto it = selected_functions.begin(); it != selected_functions.end();) {
-    if (!function_index_to_names_map_.contains(*it)) {
-      LOG(WARNING) << "Hot function at address: 0x"
-                   << absl::StrCat(absl::Hex(bb_addr_map_[*it].Addr))
-                   << " does not have an associated symbol name.";
-      it = selected_functions.erase(it);
-    } else {
-      ++it;
-    }
-  }
+    FunctionIndexSet &selected_functions) const {
+  selected_functions.EraseIf([this](int function_index) {
+    if (function_index_to_names_map_.contains(function_index)) return false;
+    LOG(WARNING) << "Hot function at address: 0x"
+                 << absl::StrCat(absl::Hex(bb_addr_map_[function_index].Addr))
+                 << " does not have an associated symbol name.";
+    return true;
+  });
 }
 
 void PropellerWholeProgramInfo::FilterNonTextFunctions(
-    absl::btree_set<int> &selected_functions) const {
-  for (auto func_it = selected_functions.begin();
-       func_it != selected_functions.end();) {
-    int function_index = *func_it;
+    FunctionIndexSet &selected_functions) const {
+  selected_functions.EraseIf([this](int function_index) {
     llvm::object::SymbolRef symbol_ref =
         symtab_.at(bb_addr_map_[function_index].Addr).front();
     StringRef section_name =
         llvm::cantFail(llvm::cantFail(symbol_ref.getSection())->getName());
-    if (section_name.startswith(".text")) {
-      ++func_it;
-    } else {
-      LOG(WARNING)
-          << "Skipped symbol in none '.text.*' section '" << section_name.str()
-          << "': "
-          << function_index_to_names_map_.at(function_index).front().str();
-      func_it = selected_functions.erase(func_it);
-    }
-  }
+    if (section_name.startswith(".text")) return false;
+    LOG(WARNING)
+        << "Skipped symbol in none '.text.*' section '" << section_name.str()
+        << "': "
+        << function_index_to_names_map_.at(function_index).front().str();
+    return true;
+  });
 }
 
 // Without '-funique-internal-linkage-names', if multiple functions have the
@@ -623,7 +1305,7 @@ void PropellerWholeProgramInfo::FilterNonTextFunctions(
 // This function removes all such functions which have the same name as other
 // functions in the binary.
 int PropellerWholeProgramInfo::FilterDuplicateNameFunctions(
-    absl::btree_set<int> &selected_functions) const {
+    FunctionIndexSet &selected_functions) const {
   int duplicate_symbols = 0;
   absl::flat_hash_map<StringRef, std::vector<int>> name_to_function_index;
   for (int func_index : selected_functions) {
@@ -668,16 +1350,40 @@ int PropellerWholeProgramInfo::FilterDuplicateNameFunctions(
   return duplicate_symbols;
 }
 
-absl::btree_set<int> PropellerWholeProgramInfo::SelectFunctions(
+void PropellerWholeProgramInfo::DecodeBbEntries(
+    const FunctionIndexSet &functions) {
+  // The encoded entries are released after the first call.
+  CHECK_EQ(encoded_bb_entries_.size(), bb_addr_map_.size());
+  const std::vector<int> function_indexes(functions.begin(), functions.end());
+  const bool is_little_endian =
+      binary_perf_info_.binary_info.object_file->isLittleEndian();
+  ParallelFor(options_.cfg_creation_threads(), function_indexes.size(),
+              [&](int i) {
+                const int function_index = function_indexes[i];
+                bb_addr_map_[function_index].BBEntries =
+                    DecodeEncodedBbEntries(encoded_bb_entries_[function_index],
+                                           is_little_endian);
+              });
+  encoded_bb_entries_.clear();
+  encoded_bb_entries_.shrink_to_fit();
+}
+
+FunctionIndexSet PropellerWholeProgramInfo::SelectFunctions(
     CfgCreationMode cfg_creation_mode, const LBRAggregation *lbr_aggregation) {
-  absl::btree_set<int> selected_functions;
+  FunctionIndexSet selected_functions;
 
   if (cfg_creation_mode == CfgCreationMode::kOnlyHotFunctions) {
     CHECK_NE(lbr_aggregation, nullptr);
     selected_functions = CalculateHotFunctions(*lbr_aggregation);
   } else {
-    for (int i = 0; i != bb_addr_map_.size(); ++i) selected_functions.insert(i);
+    selected_functions = FunctionIndexSet(bb_addr_map_.size(), /*all=*/true);
+    if (options_.compact_cold_functions()) {
+      functions_with_cfgs_ = lbr_aggregation != nullptr
+                                 ? CalculateHotFunctions(*lbr_aggregation)
+                                 : FunctionIndexSet(bb_addr_map_.size());
+    }
   }
+  DecodeBbEntries(selected_functions);
 
   FilterNoNameFunctions(selected_functions);
   FilterNonTextFunctions(selected_functions);
@@ -694,6 +1400,8 @@ absl::btree_set<int> PropellerWholeProgramInfo::SelectFunctions(
       bb_handles_.push_back({function_index, bb_index});
     last_function_address = function_bb_addr_map.Addr;
   }
+  BuildBbAddressIndex();
+  BuildFallthroughIndex();
 
   return selected_functions;
 }
@@ -703,7 +1411,8 @@ absl::Status PropellerWholeProgramInfo::ReadBinaryInfo() {
   LOG(INFO) << "Started reading the binary info from: "
             << binary_info.file_name;
   symtab_ = ReadSymbolTable(binary_info);
-  ASSIGN_OR_RETURN(bb_addr_map_, ReadBbAddrMap(binary_info));
+  ASSIGN_OR_RETURN(bb_addr_map_,
+                   IndexBbAddrMap(binary_info, encoded_bb_entries_));
   function_index_to_names_map_ =
       SetFunctionIndexToNamesMap(symtab_, bb_addr_map_);
   stats_.bbaddrmap_function_does_not_have_symtab_entry +=
@@ -715,23 +1424,35 @@ absl::Status PropellerWholeProgramInfo::ReadBinaryInfo() {
 
 // "CreateCfgs" steps:
 //   1.a ReadSymbolTable
-//   1.b ReadBbAddrMap
+//   1.b IndexBbAddrMap
 //   1.c ParsePerfData
-//   2. CalculateHotFunctions or mark all functions as hot
+//   2. CalculateHotFunctions or mark all functions as hot, then decode the
+//      BB entries of the selected functions
 //   3. DoCreateCfgs
 absl::Status PropellerWholeProgramInfo::CreateCfgs(
     CfgCreationMode cfg_creation_mode) {
   absl::Status read_binary_info_status;
   std::thread read_binary_info_thread([this, &read_binary_info_status]() {
+    ScopedStageTimer timer("ReadBinaryInfo");
     read_binary_info_status = ReadBinaryInfo();
   });
 
-  absl::StatusOr<LBRAggregation> lbr_aggregation = ParsePerfData();
+  absl::StatusOr<LBRAggregation> lbr_aggregation = [this]() {
+    ScopedStageTimer timer("ParsePerfData");
+    return ParsePerfData();
+  }();
 
   read_binary_info_thread.join();
   if (!read_binary_info_status.ok())
     return read_binary_info_status;
 
+  return CreateCfgsFromLbrAggregation(cfg_creation_mode,
+                                      std::move(lbr_aggregation));
+}
+
+absl::Status PropellerWholeProgramInfo::CreateCfgsFromLbrAggregation(
+    CfgCreationMode cfg_creation_mode,
+    absl::StatusOr<LBRAggregation> lbr_aggregation) {
   if (status_provider_) status_provider_->SetProgress(20);
 
   if (cfg_creation_mode == CfgCreationMode::kOnlyHotFunctions &&
@@ -739,15 +1460,112 @@ absl::Status PropellerWholeProgramInfo::CreateCfgs(
     return lbr_aggregation.status();
   }
 
-  absl::btree_set<int> selected_functions = SelectFunctions(
-      cfg_creation_mode, lbr_aggregation.ok() ? &*lbr_aggregation : nullptr);
+  FunctionIndexSet selected_functions;
+  {
+    ScopedStageTimer timer("SelectFunctions");
+    selected_functions = SelectFunctions(
+        cfg_creation_mode, lbr_aggregation.ok() ? &*lbr_aggregation : nullptr);
+  }
   if (status_provider_) status_provider_->SetProgress(50);
 
   // This must be done only after both PopulateSymbolMaps and ParsePerfData
   // finish. Note: opt_lbr_aggregation is released afterwards.
-  absl::Status status =
-      DoCreateCfgs(std::move(*lbr_aggregation), std::move(selected_functions));
+  absl::Status status;
+  {
+    ScopedStageTimer timer("DoCreateCfgs");
+    status = DoCreateCfgs(std::move(*lbr_aggregation),
+                          std::move(selected_functions));
+  }
   if (status_provider_) status_provider_->SetDone();
   return status;
 }
+
+absl::Status PropellerWholeProgramInfo::CreateCfgsOfBinaries(
+    absl::Span<PropellerWholeProgramInfo *const> whole_program_infos,
+    PerfDataProvider &perf_data_provider, CfgCreationMode cfg_creation_mode) {
+  const int num_binaries = whole_program_infos.size();
+  std::vector<absl::Status> read_binary_info_statuses(num_binaries);
+  std::vector<std::thread> read_binary_info_threads;
+  read_binary_info_threads.reserve(num_binaries);
+  for (int i = 0; i != num_binaries; ++i) {
+    read_binary_info_threads.emplace_back(
+        [whole_program_info = whole_program_infos[i],
+         &read_binary_info_status = read_binary_info_statuses[i]]() {
+          ScopedStageTimer timer("ReadBinaryInfo");
+          read_binary_info_status = whole_program_info->ReadBinaryInfo();
+        });
+  }
+
+  std::vector<std::string> match_mmap_names;
+  match_mmap_names.reserve(num_binaries);
+  for (PropellerWholeProgramInfo *whole_program_info : whole_program_infos)
+    match_mmap_names.push_back(whole_program_info->GetMatchMmapName());
+
+  // Every perf data file is read once, its samples are selected for all the
+  // binaries and aggregated into their own counters.
+  std::vector<LBRAggregation> lbr_aggregations(num_binaries);
+  absl::Status perf_data_status;
+  {
+    ScopedStageTimer timer("ParsePerfData");
+    while (true) {
+      absl::StatusOr<std::optional<PerfDataProvider::BufferHandle>> perf_data =
+          perf_data_provider.GetNext();
+      if (!perf_data.ok()) {
+        perf_data_status = perf_data.status();
+        break;
+      }
+      if (!perf_data->has_value()) break;
+
+      std::string description = (*perf_data)->description;
+      const int64_t perf_data_size = (*perf_data)->buffer->getBufferSize();
+      ScopedTraceSpan trace_span("ParsePerfData", {{"bytes", perf_data_size}});
+      LOG(INFO) << "Parsing " << description << " for " << num_binaries
+                << " binaries ...";
+      std::vector<BinaryPerfInfo> file_perf_infos(num_binaries);
+      std::vector<BinaryPerfInfo *> file_perf_info_ptrs;
+      file_perf_info_ptrs.reserve(num_binaries);
+      for (int i = 0; i != num_binaries; ++i) {
+        file_perf_infos[i].binary_info =
+            whole_program_infos[i]->binary_perf_info_.binary_info
+                .CopyMetadata();
+        file_perf_info_ptrs.push_back(&file_perf_infos[i]);
+      }
+      const bool selected = PerfDataReader().SelectPerfInfos(
+          std::move(**perf_data), match_mmap_names, file_perf_info_ptrs);
+      for (PropellerWholeProgramInfo *whole_program_info : whole_program_infos)
+        if (whole_program_info->status_provider_)
+          whole_program_info->status_provider_->AddBytesParsed(perf_data_size);
+      if (!selected) {
+        LOG(WARNING) << "Skipped profile " << description
+                     << ", because reading file failed.";
+        continue;
+      }
+      for (int i = 0; i != num_binaries; ++i) {
+        if (file_perf_infos[i].binary_mmaps.empty()) {
+          LOG(WARNING) << "Skipped profile " << description << " for '"
+                       << whole_program_infos[i]->options_.binary_name()
+                       << "', because no matching mmap found.";
+          continue;
+        }
+        whole_program_infos[i]->AggregatePerfInfo(file_perf_infos[i],
+                                                  lbr_aggregations[i]);
+        // Release the samples of this binary.
+        file_perf_infos[i].ResetPerfInfo();
+      }
+    }
+  }
+
+  for (std::thread &t : read_binary_info_threads) t.join();
+  if (!perf_data_status.ok()) return perf_data_status;
+
+  for (int i = 0; i != num_binaries; ++i) {
+    if (!read_binary_info_statuses[i].ok()) return read_binary_info_statuses[i];
+    PropellerWholeProgramInfo &whole_program_info = *whole_program_infos[i];
+    absl::Status status = whole_program_info.CreateCfgsFromLbrAggregation(
+        cfg_creation_mode,
+        whole_program_info.FinishParsePerfData(std::move(lbr_aggregations[i])));
+    if (!status.ok()) return status;
+  }
+  return absl::OkStatus();
+}
 }  // namespace devtools_crosstool_autofdo
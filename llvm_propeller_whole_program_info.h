@@ -3,6 +3,7 @@
 
 #if defined(HAVE_LLVM)
 
+#include <array>
 #include <future>  // NOLINT(build/c++11)
 #include <list>
 #include <map>
@@ -14,15 +15,18 @@
 
 #include "llvm_propeller_abstract_whole_program_info.h"
 #include "llvm_propeller_cfg.h"
+#include "llvm_propeller_function_index_set.h"
 #include "llvm_propeller_options.pb.h"
 #include "llvm_propeller_perf_data_provider.h"
 #include "llvm_propeller_statistics.h"
 #include "perfdata_reader.h"
+#include "sample_subsampling.h"
 #include "status_provider.h"
-#include "third_party/abseil/absl/container/btree_set.h"
+#include "third_party/abseil/absl/container/flat_hash_map.h"
 #include "third_party/abseil/absl/status/status.h"
 #include "third_party/abseil/absl/status/statusor.h"
 #include "third_party/abseil/absl/strings/str_cat.h"
+#include "third_party/abseil/absl/types/span.h"
 #include "llvm/ADT/StringRef.h"
 #include "llvm/Object/ELFTypes.h"
 #include "llvm/Object/ObjectFile.h"
@@ -50,14 +54,11 @@ class PropellerWholeProgramInfo : public AbstractPropellerWholeProgramInfo {
   using SymTabTy =
       std::map<uint64_t, llvm::SmallVector<llvm::object::SymbolRef, 2>>;
 
-  // <from_address, to_address> -> branch counter.
-  // Note all addresses are binary addresses, not runtime addresses.
-  using BranchCountersTy = std::map<std::pair<uint64_t, uint64_t>, uint64_t>;
+  // See LBRAggregation::BranchCountersTy.
+  using BranchCountersTy = LBRAggregation::BranchCountersTy;
 
-  // <fallthrough_from, fallthrough_to> -> fallthrough counter.
-  // Note all addresses are symbol address, not virtual addresses.
-  using FallthroughCountersTy =
-      std::map<std::pair<uint64_t, uint64_t>, uint64_t>;
+  // See LBRAggregation::FallthroughCountersTy.
+  using FallthroughCountersTy = LBRAggregation::FallthroughCountersTy;
 
   static std::unique_ptr<PropellerWholeProgramInfo> Create(
       const PropellerOptions &options,
@@ -134,21 +135,85 @@ class PropellerWholeProgramInfo : public AbstractPropellerWholeProgramInfo {
   std::optional<int> FindBbHandleIndexUsingBinaryAddress(
       uint64_t address, BranchDirection direction) const;
 
+  // Like `FindBbHandleIndexUsingBinaryAddress`, for every address in
+  // `addresses`, returning the results in the same order. Each lookup gallops
+  // from the position of the previous one, so that resolving sorted (or mostly
+  // sorted) addresses takes amortized constant time per address.
+  std::vector<std::optional<int>> FindBbHandleIndexesUsingBinaryAddresses(
+      absl::Span<const uint64_t> addresses, BranchDirection direction) const;
+
   absl::StatusOr<LBRAggregation> ParsePerfData();
 
-  // Reads bb_addr_map_ and symtab_ from the binary. Also constructs
-  // the function_index_to_names_ map.
+  // Returns the file name the perf mmap events of this binary are matched
+  // against, or "" to match them by the binary's build id.
+  std::string GetMatchMmapName() const;
+
+  // Aggregates the LBR samples of `file_perf_info`, selected from one perf data
+  // file for this binary, into `lbr_aggregation` and updates the stats.
+  void AggregatePerfInfo(const BinaryPerfInfo &file_perf_info,
+                         LBRAggregation &lbr_aggregation);
+
+  // Updates the stats with the counters of `lbr_aggregation`, which holds the
+  // samples of all perf data files, and returns it. Fails if no perf data file
+  // was parsed.
+  absl::StatusOr<LBRAggregation> FinishParsePerfData(
+      LBRAggregation &&lbr_aggregation);
+
+  // Reads perf data files from `perf_data_provider_` on
+  // `options_.perf_parse_threads()` threads. Each thread aggregates the files
+  // it processes into its own partial LBRAggregation, and the partial results
+  // are merged pairwise in a reduction tree.
+  absl::StatusOr<LBRAggregation> ParsePerfDataInParallel(
+      const std::string &match_mmap_name);
+
+  // Location of one function's encoded basic block entries in the
+  // .llvm_bb_addr_map section. The entries are only decoded for the functions
+  // kept by `SelectFunctions`.
+  struct EncodedBbEntries {
+    // Contents of the section holding the entries. This points into the
+    // binary's buffer.
+    llvm::StringRef section_contents;
+    // Offset of the first entry in `section_contents`.
+    uint64_t offset = 0;
+    // Encoding version of the entries.
+    uint8_t version = 0;
+    uint32_t num_blocks = 0;
+    // End of the last basic block, relative to the function address.
+    uint32_t end_offset = 0;
+  };
+
+  // Reads symtab_ from the binary and indexes its BB address map into
+  // bb_addr_map_ (with empty BB entries) and encoded_bb_entries_. Also
+  // constructs the function_index_to_names_ map.
   absl::Status ReadBinaryInfo();
 
+  // Decodes the BB entries of `functions` (indexes into `bb_addr_map_`) into
+  // `bb_addr_map_`. May only be called once, after `ReadBinaryInfo`.
+  void DecodeBbEntries(const FunctionIndexSet &functions);
+
   // Creates the CFGs. Only creates CFGs for hot functions if
   // `cfg_creation_mode==kOnlyHotFunctions`.
   absl::Status CreateCfgs(CfgCreationMode cfg_creation_mode) override;
 
+  // Like `CreateCfgs`, but for several binaries profiled in the same perf
+  // data. Every file of `perf_data_provider` is read only once, and its samples
+  // are demultiplexed by mmap into the binaries of `whole_program_infos`, whose
+  // own perf data providers are not used.
+  static absl::Status CreateCfgsOfBinaries(
+      absl::Span<PropellerWholeProgramInfo *const> whole_program_infos,
+      PerfDataProvider &perf_data_provider, CfgCreationMode cfg_creation_mode);
+
+  // Creates the CFGs from `lbr_aggregation`, the result of parsing the perf
+  // data. Must be called after `ReadBinaryInfo`.
+  absl::Status CreateCfgsFromLbrAggregation(
+      CfgCreationMode cfg_creation_mode,
+      absl::StatusOr<LBRAggregation> lbr_aggregation);
+
   // Returns a list of hot functions based on profiles. This must be called
   // after "ReadSymbolTable()", which initializes symtab_ and "ParsePerfData()"
-  // which provides "lbr_aggregation". The returned btree_set specifies the
+  // which provides "lbr_aggregation". The returned set specifies the
   // hot functions by their index in `bb_addr_map()`.
-  absl::btree_set<int> CalculateHotFunctions(
+  FunctionIndexSet CalculateHotFunctions(
       const LBRAggregation &lbr_aggregation);
 
   // Removes unwanted functions from the BB address map and symbol table, and
@@ -156,21 +221,23 @@ class PropellerWholeProgramInfo : public AbstractPropellerWholeProgramInfo {
   // This function removes all non-text functions, functions without associated
   // names, and those with duplicate names. If
   // `cfg_creation_mode=kOnlyHotFunctions` it also captures and removes all cold
-  // functions.
+  // functions. With `cfg_creation_mode=kAllFunctions` and
+  // `options_.compact_cold_functions()`, the cold functions are kept but only
+  // the hot ones will get a cfg.
   // `lbr_aggregation` may only be null if `cfg_creation_mode=kAllFunctions`.
-  absl::btree_set<int> SelectFunctions(CfgCreationMode cfg_creation_mode,
+  FunctionIndexSet SelectFunctions(CfgCreationMode cfg_creation_mode,
                                        const LBRAggregation *lbr_aggregation);
 
   // Creates profile CFGs for functions in `selected_functions`, using the LBR
   // profile in `lbr_aggregation`. `selected functions` must be a set of
   // indexes into `bb_addr_map_`.
   absl::Status DoCreateCfgs(LBRAggregation &&lbr_aggregation,
-                            absl::btree_set<int> &&selected_functions);
+                            FunctionIndexSet &&selected_functions);
 
   // Removes all functions that are not included (selected) in the
   // `selected_functions` set. Clears their associated BB entries from
   // `bb_addr_map_` and also removes their associated entries from `symtab_`.
-  void DropNonSelectedFunctions(const absl::btree_set<int> &selected_functions);
+  void DropNonSelectedFunctions(const FunctionIndexSet &selected_functions);
 
   // Returns the full function's BB address map associated with the given
   // `bb_handle`.
@@ -207,47 +274,107 @@ class PropellerWholeProgramInfo : public AbstractPropellerWholeProgramInfo {
       : AbstractPropellerWholeProgramInfo(options),
         binary_perf_info_(std::move(bpi)),
         perf_data_provider_(std::move(perf_data_provider)),
-        status_provider_(status_provider) {}
+        status_provider_(status_provider) {
+    StratifiedSampleSelector selector(options.lbr_sample_fraction(),
+                                      options.lbr_sample_seed());
+    if (!selector.keeps_all()) {
+      lbr_subsampling_.emplace(selector);
+      if (options.estimate_lbr_sample_fraction_error())
+        lbr_subsampling_->halves = &lbr_subsample_halves_;
+    }
+  }
+
+  // Returns the subsampling of the LBR samples, or nullptr if every sample is
+  // aggregated.
+  const LbrSubsampling *lbr_subsampling() const {
+    return lbr_subsampling_.has_value() ? &*lbr_subsampling_ : nullptr;
+  }
 
   // Removes all functions without associated symbol names from the given
   // function indices.
-  void FilterNoNameFunctions(absl::btree_set<int> &selected_functions) const;
+  void FilterNoNameFunctions(FunctionIndexSet &selected_functions) const;
 
   // This removes all functions in non-text sections from the specified set of
   // function indices.
-  void FilterNonTextFunctions(absl::btree_set<int> &selected_functions) const;
+  void FilterNonTextFunctions(FunctionIndexSet &selected_functions) const;
 
   // Removes all functions with duplicate names from the specified function
   // indices. Must be called after `FilterNoNameFunctions`.
   int FilterDuplicateNameFunctions(
-      absl::btree_set<int> &selected_functions) const;
+      FunctionIndexSet &selected_functions) const;
+
+  // Builds `bb_addresses_` and the page index over it from `bb_handles_`.
+  void BuildBbAddressIndex();
+
+  // Builds `next_non_fallthrough_bb_` from `bb_handles_`.
+  void BuildFallthroughIndex();
+
+  // Returns the index of the first element of `bb_addresses_` greater than
+  // `address`, using the page index.
+  int BbAddressUpperBound(uint64_t address) const;
+
+  // Like `BbAddressUpperBound`, but gallops from `finger`, the result of a
+  // lookup of a nearby address.
+  int BbAddressUpperBoundFrom(int finger, uint64_t address) const;
+
+  // Returns the result of `FindBbHandleIndexUsingBinaryAddress` given
+  // `upper_bound`, the result of `BbAddressUpperBound(address)`.
+  std::optional<int> ResolveBbHandleIndex(int upper_bound, uint64_t address,
+                                          BranchDirection direction) const;
+
+  // A branch between two basic blocks, specified by their symbol ordinals.
+  struct ResolvedBranch {
+    int from_bb;
+    int to_bb;
+    uint64_t weight;
+    CFGEdge::Kind edge_kind;
+  };
+
+  // The branches and fallthroughs within one function, from which `CreateEdges`
+  // creates the function's intra-function edges on a single worker thread.
+  struct IntraFunctionEdges {
+    // Branches in the order of their branch addresses.
+    std::vector<ResolvedBranch> branches;
+    // Fallthrough paths <from_bb, to_bb> and their counts. The invalid paths
+    // are dropped when their edges are created.
+    std::vector<std::pair<std::pair<int, int>, uint64_t>> fallthroughs;
+    // Edges created so far in this function, keyed by `{from_bb, to_bb}`.
+    absl::flat_hash_map<std::pair<int, int>, CFGEdge *> edge_map;
+    // Stats of the edges created in this function, merged into `stats_` by
+    // the calling thread.
+    PropellerStats stats;
+  };
 
   // Creates and returns an edge from `from_bb` to `to_bb` (specified by their
   // symbol_ordinal) with the given `weight` and `edge_kind` and associates it
   // to the corresponding nodes specified by `tmp_node_map`. Finally inserts the
   // edge into `tmp_edge_map` with the key being the pair `{from_bb, to_bb}`.
+  // Records the created edge in `stats`.
   CFGEdge *InternalCreateEdge(
       int from_bb, int to_bb, uint64_t weight, CFGEdge::Kind edge_kind,
       const absl::flat_hash_map<int, CFGNode *> &tmp_node_map,
-      absl::flat_hash_map<std::pair<int, int>, CFGEdge *> *tmp_edge_map);
+      absl::flat_hash_map<std::pair<int, int>, CFGEdge *> *tmp_edge_map,
+      PropellerStats *stats) const;
 
   // Helper method that creates edges and assign edge weights using
   // branch_counters_. Details in .cc.
   bool CreateEdges(const LBRAggregation &lbr_aggregation,
                    const absl::flat_hash_map<int, CFGNode *> &tmp_node_map);
 
-  // Helper method that creates edges and assign edge weights using
-  // branch_counters_. Details in .cc.
+  // Helper method that creates edges for fallthroughs and adds their weights,
+  // using the fallthrough counters of `lbr_aggregation` and
+  // `tmp_bb_fallthrough_counters`. `edges_by_function` maps every function
+  // index to the state of its intra-function edges. Details in .cc.
   void CreateFallthroughs(
       const LBRAggregation &lbr_aggregation,
       const absl::flat_hash_map<int, CFGNode *> &tmp_node_map,
       absl::flat_hash_map<std::pair<int, int>, uint64_t>
           *tmp_bb_fallthrough_counters,
-      absl::flat_hash_map<std::pair<int, int>, CFGEdge *> *tmp_edge_map);
+      absl::flat_hash_map<int, IntraFunctionEdges> *edges_by_function);
 
   // Returns whether the `from` basic block can fallthrough to the `to` basic
   // block. `from` and `to` should be indices into the `bb_handles()` vector.
-  bool CanFallThrough(int from, int to);
+  bool CanFallThrough(int from, int to) const;
 
   // Handler to PerfDataReader handler.
   PerfDataReader perf_data_reader_;
@@ -274,8 +401,31 @@ class PropellerWholeProgramInfo : public AbstractPropellerWholeProgramInfo {
   // ...
   std::vector<BbHandle> bb_handles_;
 
-  // Handle to .llvm_bb_addr_map section.
+  // Binary address of every element of `bb_handles_`, in the same order.
+  std::vector<uint64_t> bb_addresses_;
+  // Page index over `bb_addresses_`: `bb_page_starts_[p]` is the index of the
+  // first block at or above the page `bb_first_page_ + p`. The last element is
+  // `bb_addresses_.size()`. Empty if the blocks span too many pages for the
+  // index to be compact, in which case lookups fall back to binary search.
+  uint64_t bb_first_page_ = 0;
+  std::vector<int> bb_page_starts_;
+
+  // `next_non_fallthrough_bb_[i]` is the index of the first block at or after
+  // `bb_handles_[i]` in the same function which can not fall through, or the
+  // index after the last block of the function if there is none. This makes
+  // `CanFallThrough` constant time.
+  std::vector<int> next_non_fallthrough_bb_;
+
+  // Handle to .llvm_bb_addr_map section. The BB entries of a function are
+  // empty until they are decoded by `SelectFunctions`.
   std::vector<llvm::object::BBAddrMap> bb_addr_map_;
+  // Where to decode the BB entries of each function from, indexed like
+  // `bb_addr_map_`. Released once the selected functions are decoded.
+  std::vector<EncodedBbEntries> encoded_bb_entries_;
+  // The selected functions which get a cfg, if not all of them do with
+  // `options_.compact_cold_functions()`. The others are added to
+  // `cold_functions_` by `DoCreateCfgs`.
+  std::optional<FunctionIndexSet> functions_with_cfgs_;
   // See SymTabTy definition. Deleted after "CreateCfgs()".
   SymTabTy symtab_;
 
@@ -287,6 +437,13 @@ class PropellerWholeProgramInfo : public AbstractPropellerWholeProgramInfo {
   uint64_t last_symbol_ordinal_ = 0;
 
   DefaultStatusProvider *status_provider_ = nullptr;
+
+  // See `options_.lbr_sample_fraction()`. Unset if every LBR sample is
+  // aggregated.
+  std::optional<LbrSubsampling> lbr_subsampling_;
+  // The aggregated samples of the two halves of the subsampled LBR samples,
+  // if `options_.estimate_lbr_sample_fraction_error()`.
+  std::array<LBRAggregation, 2> lbr_subsample_halves_;
 };
 }  // namespace devtools_crosstool_autofdo
 
@@ -6,14 +6,18 @@
 #include <numeric>
 #include <set>
 #include <string>
+#include <tuple>
 #include <utility>
 #include <vector>
 
 #include "llvm_propeller_abstract_whole_program_info.h"
 #include "llvm_propeller_cfg.h"
+#include "llvm_propeller_file_perf_data_provider.h"
+#include "llvm_propeller_function_index_set.h"
 #include "llvm_propeller_mock_whole_program_info.h"
 #include "llvm_propeller_options.pb.h"
 #include "llvm_propeller_options_builder.h"
+#include "llvm_propeller_synthetic_workload.h"
 #include "perfdata_reader.h"
 #include "gmock/gmock.h"
 #include "gtest/gtest.h"
@@ -37,17 +41,23 @@ using ::devtools_crosstool_autofdo::BranchDirection;
 using ::devtools_crosstool_autofdo::CfgCreationMode;
 using ::devtools_crosstool_autofdo::CFGEdge;
 using ::devtools_crosstool_autofdo::CFGNode;
+using ::devtools_crosstool_autofdo::ColdFunctions;
 using ::devtools_crosstool_autofdo::ControlFlowGraph;
+using ::devtools_crosstool_autofdo::FilePerfDataProvider;
+using ::devtools_crosstool_autofdo::FunctionIndexSet;
 using ::devtools_crosstool_autofdo::MockPropellerWholeProgramInfo;
 using ::devtools_crosstool_autofdo::MultiStatusProvider;
 using ::devtools_crosstool_autofdo::PropellerOptions;
 using ::devtools_crosstool_autofdo::PropellerOptionsBuilder;
 using ::devtools_crosstool_autofdo::PropellerWholeProgramInfo;
+using ::devtools_crosstool_autofdo::SyntheticPropellerWholeProgramInfo;
+using ::devtools_crosstool_autofdo::SyntheticWorkloadOptions;
 
 using ::testing::_;
 using ::testing::AllOf;
 using ::testing::Contains;
 using ::testing::ElementsAre;
+using ::testing::ElementsAreArray;
 using ::testing::Field;
 using ::testing::FieldsAre;
 using ::testing::IsEmpty;
@@ -126,6 +136,10 @@ TEST(LlvmPropellerWholeProgramInfo, CreateCFG) {
   EXPECT_EQ(status.GetProgress(), 1);
   ASSERT_OK(wpi->CreateCfgs(CfgCreationMode::kAllFunctions));
   EXPECT_TRUE(status.IsDone());
+  EXPECT_GT(status.GetCounters().bytes_parsed, 0);
+  EXPECT_GT(status.GetCounters().samples_processed, 0);
+  EXPECT_GT(status.GetCounters().memory_bytes, 0);
+  EXPECT_GT(wpi->stats().cfg_bytes, 0);
   // Test resources are released after CreateCFG.
   EXPECT_THAT(wpi->binary_mmaps(), IsEmpty());
 
@@ -150,6 +164,54 @@ TEST(LlvmPropellerWholeProgramInfo, CreateCFG) {
   EXPECT_GT(compute_flag->inter_edges().front()->weight(), 100);
 }
 
+TEST(LlvmPropellerWholeProgramInfo, CompactColdFunctions) {
+  auto create_cfgs = [](bool compact_cold_functions) {
+    const PropellerOptions options(
+        PropellerOptionsBuilder()
+            .SetBinaryName(GetAutoFdoTestDataFilePath("propeller_sample.bin"))
+            .AddPerfNames(
+                GetAutoFdoTestDataFilePath("propeller_sample.perfdata"))
+            .SetProfiledBinaryName("propeller_sample.bin")
+            .SetCompactColdFunctions(compact_cold_functions));
+    std::unique_ptr<PropellerWholeProgramInfo> wpi =
+        PropellerWholeProgramInfo::Create(options);
+    EXPECT_NE(wpi, nullptr);
+    EXPECT_OK(wpi->CreateCfgs(CfgCreationMode::kAllFunctions));
+    return wpi;
+  };
+
+  std::unique_ptr<PropellerWholeProgramInfo> full = create_cfgs(false);
+  std::unique_ptr<PropellerWholeProgramInfo> compact = create_cfgs(true);
+  EXPECT_TRUE(full->cold_functions().empty());
+  EXPECT_THAT(compact->cfgs(), Contains(Pair("main", _)));
+  EXPECT_THAT(compact->cfgs(), Not(Contains(Pair("this_is_very_code", _))));
+  EXPECT_EQ(compact->cfgs().size() + compact->cold_functions().size(),
+            full->cfgs().size());
+  EXPECT_EQ(compact->GetHotCfgs().size(), full->GetHotCfgs().size());
+
+  // Every cold function keeps the names, ordinals and basic block sizes of its
+  // cfg.
+  const ColdFunctions &cold_functions = compact->cold_functions();
+  bool found_this_is_very_code = false;
+  for (int i = 0; i != cold_functions.size(); ++i) {
+    const ControlFlowGraph *cfg = full->FindCfg(cold_functions.names(i)[0]);
+    ASSERT_NE(cfg, nullptr);
+    EXPECT_FALSE(cfg->IsHot());
+    EXPECT_THAT(cfg->names(), ElementsAreArray(cold_functions.names(i)));
+    ASSERT_EQ(cfg->nodes().size(), cold_functions.bb_sizes(i).size());
+    for (int bb_index = 0; bb_index != cfg->nodes().size(); ++bb_index) {
+      const CFGNode &node = *cfg->nodes()[bb_index];
+      EXPECT_EQ(node.symbol_ordinal(),
+                cold_functions.first_ordinal(i) + bb_index);
+      EXPECT_EQ(node.size(), cold_functions.bb_sizes(i)[bb_index]);
+      EXPECT_EQ(node.is_landing_pad(),
+                cold_functions.is_landing_pad(i, bb_index));
+    }
+    found_this_is_very_code |= cfg->GetPrimaryName() == "this_is_very_code";
+  }
+  EXPECT_TRUE(found_this_is_very_code);
+}
+
 // This test checks that the mock can load a CFG from the serialized format
 // correctly.
 TEST(LlvmPropellerMockWholeProgramInfo, CreateCFGFromProto) {
@@ -176,6 +238,37 @@ TEST(LlvmPropellerMockWholeProgramInfo, CreateCFGFromProto) {
             edge.sink()->inter_ins().end());
 }
 
+// This test checks that the synthetic whole program info creates the cfgs
+// and call edges of the program it is asked for.
+TEST(LlvmPropellerSyntheticWholeProgramInfo, CreateCfgs) {
+  SyntheticWorkloadOptions workload_options;
+  workload_options.num_functions = 100;
+  workload_options.inlining_depth = 1;
+  SyntheticPropellerWholeProgramInfo wpi(PropellerOptions(), workload_options);
+  ASSERT_OK(wpi.CreateCfgs(CfgCreationMode::kAllFunctions));
+  EXPECT_EQ(wpi.cfgs().size(), 100);
+
+  // The first half of the functions calls the second half.
+  const ControlFlowGraph *caller = wpi.FindCfg("synthetic_function_0");
+  ASSERT_NE(caller, nullptr);
+  ASSERT_THAT(caller->inter_edges(), Not(IsEmpty()));
+  EXPECT_TRUE(caller->inter_edges().front()->IsCall());
+  const ControlFlowGraph *callee =
+      caller->inter_edges().front()->sink()->cfg();
+  EXPECT_NE(callee, caller);
+  ASSERT_THAT(callee->inter_edges(), Not(IsEmpty()));
+  EXPECT_TRUE(callee->inter_edges().front()->IsReturn());
+  EXPECT_GT(caller->nodes().front()->freq(), 0);
+
+  // The same options always describe the same program.
+  SyntheticPropellerWholeProgramInfo other_wpi(PropellerOptions(),
+                                               workload_options);
+  ASSERT_OK(other_wpi.CreateCfgs(CfgCreationMode::kAllFunctions));
+  EXPECT_EQ(other_wpi.stats().nodes_created, wpi.stats().nodes_created);
+  EXPECT_EQ(other_wpi.stats().total_edge_weight_by_kind,
+            wpi.stats().total_edge_weight_by_kind);
+}
+
 TEST(LlvmPropellerWholeProgramInfoBbAddrMapTest, BbAddrMapExist) {
   const std::string binary =
       absl::StrCat(FLAGS_test_srcdir,
@@ -516,7 +609,10 @@ TEST(LlvmPropellerWholeProgramInfo, CheckNoHotFunctionsInSymtab) {
   devtools_crosstool_autofdo::LBRAggregation lbr_aggregation = std::move(pd.value());
   ASSERT_OK(wpi->ReadBinaryInfo());
 
-  wpi->DropNonSelectedFunctions(wpi->CalculateHotFunctions(lbr_aggregation));
+  const FunctionIndexSet hot_functions =
+      wpi->CalculateHotFunctions(lbr_aggregation);
+  wpi->DecodeBbEntries(hot_functions);
+  wpi->DropNonSelectedFunctions(hot_functions);
 
   // "sample1_func" is cold, and should not exists in symtab.
   for (const auto &i : wpi->symtab())
@@ -533,6 +629,229 @@ TEST(LlvmPropellerWholeProgramInfo, CheckNoHotFunctionsInSymtab) {
                     Contains(Pair("sample1_func", BbAddrMapIs(_, IsEmpty())))));
 }
 
+TEST(LlvmPropellerWholeProgramInfo, FunctionIndexSet) {
+  FunctionIndexSet set(200);
+  EXPECT_TRUE(set.empty());
+  for (int i : {130, 0, 63, 64, 199}) set.insert(i);
+  EXPECT_EQ(set.size(), 5);
+  EXPECT_THAT(set, ElementsAre(0, 63, 64, 130, 199));
+  EXPECT_FALSE(set.contains(1));
+  EXPECT_FALSE(set.contains(200));
+
+  std::vector<int> visited;
+  set.EraseIf([&visited](int i) {
+    visited.push_back(i);
+    return i % 2 == 1;
+  });
+  EXPECT_THAT(visited, ElementsAre(0, 63, 64, 130, 199));
+  EXPECT_THAT(set, ElementsAre(0, 64, 130));
+
+  EXPECT_EQ(FunctionIndexSet(70, /*all=*/true).size(), 70);
+}
+
+TEST(LlvmPropellerWholeProgramInfo, ParallelPerfDataParsingMatchesSerial) {
+  auto parse_perf_data = [](int lbr_aggregation_threads,
+                            int perf_parse_threads) {
+    const PropellerOptions options = PropellerOptions(
+        PropellerOptionsBuilder()
+            .SetBinaryName(GetAutoFdoTestDataFilePath("propeller_sample_1.bin"))
+            .AddPerfNames(
+                GetAutoFdoTestDataFilePath("propeller_sample_1.perfdata1"))
+            .AddPerfNames(
+                GetAutoFdoTestDataFilePath("propeller_sample_1.perfdata2"))
+            .SetLbrAggregationThreads(lbr_aggregation_threads)
+            .SetPerfParseThreads(perf_parse_threads));
+    std::unique_ptr<PropellerWholeProgramInfo> wpi =
+        PropellerWholeProgramInfo::Create(options);
+    EXPECT_NE(wpi.get(), nullptr);
+    auto lbr_aggregation = wpi->ParsePerfData();
+    EXPECT_OK(lbr_aggregation);
+    return std::move(lbr_aggregation.value());
+  };
+
+  devtools_crosstool_autofdo::LBRAggregation serial = parse_perf_data(1, 1);
+  EXPECT_THAT(serial.branch_counters, Not(IsEmpty()));
+  for (auto [lbr_aggregation_threads, perf_parse_threads] :
+       {std::make_pair(4, 1), std::make_pair(1, 3), std::make_pair(2, 2)}) {
+    devtools_crosstool_autofdo::LBRAggregation parallel =
+        parse_perf_data(lbr_aggregation_threads, perf_parse_threads);
+    EXPECT_EQ(serial.branch_counters, parallel.branch_counters);
+    EXPECT_EQ(serial.fallthrough_counters, parallel.fallthrough_counters);
+  }
+}
+
+TEST(LlvmPropellerWholeProgramInfo, CachedPerfDataParsingMatchesUncached) {
+  const std::string cache_dir =
+      absl::StrCat(FLAGS_test_tmpdir, "/lbr_aggregation_cache");
+  auto parse_perf_data = [](const std::string &cache_dir) {
+    const PropellerOptions options = PropellerOptions(
+        PropellerOptionsBuilder()
+            .SetBinaryName(GetAutoFdoTestDataFilePath("propeller_sample_1.bin"))
+            .AddPerfNames(
+                GetAutoFdoTestDataFilePath("propeller_sample_1.perfdata1"))
+            .AddPerfNames(
+                GetAutoFdoTestDataFilePath("propeller_sample_1.perfdata2"))
+            .SetLbrAggregationCacheDir(cache_dir));
+    std::unique_ptr<PropellerWholeProgramInfo> wpi =
+        PropellerWholeProgramInfo::Create(options);
+    EXPECT_NE(wpi.get(), nullptr);
+    auto lbr_aggregation = wpi->ParsePerfData();
+    EXPECT_OK(lbr_aggregation);
+    EXPECT_EQ(wpi->stats().perf_file_parsed, 2);
+    return std::move(lbr_aggregation.value());
+  };
+
+  devtools_crosstool_autofdo::LBRAggregation uncached = parse_perf_data("");
+  EXPECT_THAT(uncached.branch_counters, Not(IsEmpty()));
+  // The first run writes the cache and the second one reads it.
+  for (int run = 0; run < 2; ++run) {
+    devtools_crosstool_autofdo::LBRAggregation cached =
+        parse_perf_data(cache_dir);
+    EXPECT_EQ(uncached.branch_counters, cached.branch_counters);
+    EXPECT_EQ(uncached.fallthrough_counters, cached.fallthrough_counters);
+  }
+}
+
+TEST(LlvmPropellerWholeProgramInfo, ParallelCfgCreationMatchesSerial) {
+  auto create_cfgs = [](int cfg_creation_threads) {
+    const PropellerOptions options(
+        PropellerOptionsBuilder()
+            .SetBinaryName(
+                GetAutoFdoTestDataFilePath("propeller_clang_labels.binary"))
+            .AddPerfNames(
+                GetAutoFdoTestDataFilePath("propeller_clang_labels.perfdata"))
+            .SetProfiledBinaryName("clang-12")
+            .SetCfgCreationThreads(cfg_creation_threads));
+    std::unique_ptr<PropellerWholeProgramInfo> wpi =
+        PropellerWholeProgramInfo::Create(options);
+    EXPECT_NE(wpi, nullptr);
+    EXPECT_OK(wpi->CreateCfgs(CfgCreationMode::kAllFunctions));
+    return wpi;
+  };
+
+  // Edges must match in order, not only as sets.
+  auto edge_fields = [](const std::vector<CFGEdge *> &edges) {
+    std::vector<std::tuple<uint64_t, uint64_t, uint64_t, CFGEdge::Kind>>
+        fields;
+    for (const CFGEdge *edge : edges) {
+      fields.emplace_back(edge->src()->symbol_ordinal(),
+                          edge->sink()->symbol_ordinal(), edge->weight(),
+                          edge->kind());
+    }
+    return fields;
+  };
+
+  std::unique_ptr<PropellerWholeProgramInfo> serial = create_cfgs(1);
+  std::unique_ptr<PropellerWholeProgramInfo> parallel = create_cfgs(4);
+  EXPECT_EQ(serial->stats().total_edges_created(),
+            parallel->stats().total_edges_created());
+  EXPECT_EQ(serial->stats().total_edge_weight_created(),
+            parallel->stats().total_edge_weight_created());
+  ASSERT_EQ(serial->cfgs().size(), parallel->cfgs().size());
+  for (const auto &[name, serial_cfg] : serial->cfgs()) {
+    ASSERT_THAT(parallel->cfgs(), Contains(Pair(name, _)));
+    const ControlFlowGraph &parallel_cfg = *parallel->cfgs().at(name);
+    ASSERT_EQ(serial_cfg->nodes().size(), parallel_cfg.nodes().size());
+    for (int i = 0; i != serial_cfg->nodes().size(); ++i) {
+      const CFGNode &n1 = *serial_cfg->nodes()[i];
+      const CFGNode &n2 = *parallel_cfg.nodes()[i];
+      EXPECT_EQ(n1.symbol_ordinal(), n2.symbol_ordinal());
+      EXPECT_EQ(n1.freq(), n2.freq()) << n1.GetName();
+      EXPECT_EQ(edge_fields(n1.intra_outs()), edge_fields(n2.intra_outs()))
+          << n1.GetName();
+      EXPECT_EQ(edge_fields(n1.intra_ins()), edge_fields(n2.intra_ins()))
+          << n1.GetName();
+      EXPECT_EQ(edge_fields(n1.inter_outs()), edge_fields(n2.inter_outs()))
+          << n1.GetName();
+      EXPECT_EQ(edge_fields(n1.inter_ins()), edge_fields(n2.inter_ins()))
+          << n1.GetName();
+    }
+  }
+}
+
+TEST(LlvmPropellerWholeProgramInfo, HotCoverageKeepsHottestFunctions) {
+  auto create_cfgs = [](double hot_coverage) {
+    const PropellerOptions options(
+        PropellerOptionsBuilder()
+            .SetBinaryName(
+                GetAutoFdoTestDataFilePath("propeller_clang_labels.binary"))
+            .AddPerfNames(
+                GetAutoFdoTestDataFilePath("propeller_clang_labels.perfdata"))
+            .SetProfiledBinaryName("clang-12")
+            .SetHotCoverage(hot_coverage));
+    std::unique_ptr<PropellerWholeProgramInfo> wpi =
+        PropellerWholeProgramInfo::Create(options);
+    EXPECT_NE(wpi, nullptr);
+    EXPECT_OK(wpi->CreateCfgs(CfgCreationMode::kOnlyHotFunctions));
+    return wpi;
+  };
+
+  std::unique_ptr<PropellerWholeProgramInfo> all = create_cfgs(1);
+  std::unique_ptr<PropellerWholeProgramInfo> covering = create_cfgs(0.5);
+  EXPECT_GT(covering->stats().hot_functions, 0);
+  EXPECT_LT(covering->stats().hot_functions, all->stats().hot_functions);
+  EXPECT_LT(covering->cfgs().size(), all->cfgs().size());
+  for (const auto &[name, cfg] : covering->cfgs())
+    EXPECT_THAT(all->cfgs(), Contains(Pair(name, _)));
+}
+
+TEST(LlvmPropellerWholeProgramInfo, CreateCfgsOfBinariesMatchesSingleBinary) {
+  const PropellerOptions sample_options(
+      PropellerOptionsBuilder()
+          .SetBinaryName(GetAutoFdoTestDataFilePath("propeller_sample_1.bin"))
+          .AddPerfNames(
+              GetAutoFdoTestDataFilePath("propeller_sample_1.perfdata1")));
+  const PropellerOptions clang_options(
+      PropellerOptionsBuilder()
+          .SetBinaryName(
+              GetAutoFdoTestDataFilePath("propeller_clang_labels.binary"))
+          .AddPerfNames(
+              GetAutoFdoTestDataFilePath("propeller_clang_labels.perfdata"))
+          .SetProfiledBinaryName("clang-12"));
+
+  std::vector<std::unique_ptr<PropellerWholeProgramInfo>> single_wpis;
+  for (const PropellerOptions &options : {sample_options, clang_options}) {
+    single_wpis.push_back(PropellerWholeProgramInfo::Create(options));
+    ASSERT_NE(single_wpis.back(), nullptr);
+    EXPECT_OK(
+        single_wpis.back()->CreateCfgs(CfgCreationMode::kOnlyHotFunctions));
+  }
+
+  // Each binary only has samples in its own perf data file.
+  std::vector<std::unique_ptr<PropellerWholeProgramInfo>> batch_wpis;
+  std::vector<PropellerWholeProgramInfo *> batch_wpi_ptrs;
+  for (const PropellerOptions &options : {sample_options, clang_options}) {
+    batch_wpis.push_back(PropellerWholeProgramInfo::Create(options));
+    ASSERT_NE(batch_wpis.back(), nullptr);
+    batch_wpi_ptrs.push_back(batch_wpis.back().get());
+  }
+  FilePerfDataProvider perf_data_provider(
+      {sample_options.perf_names(0), clang_options.perf_names(0)});
+  EXPECT_OK(PropellerWholeProgramInfo::CreateCfgsOfBinaries(
+      batch_wpi_ptrs, perf_data_provider, CfgCreationMode::kOnlyHotFunctions));
+
+  for (int b = 0; b != 2; ++b) {
+    const PropellerWholeProgramInfo &single = *single_wpis[b];
+    const PropellerWholeProgramInfo &batch = *batch_wpis[b];
+    EXPECT_EQ(batch.stats().perf_file_parsed, 1);
+    EXPECT_EQ(single.stats().binary_mmap_num, batch.stats().binary_mmap_num);
+    EXPECT_EQ(single.stats().br_counters_accumulated,
+              batch.stats().br_counters_accumulated);
+    EXPECT_EQ(single.stats().total_edge_weight_created(),
+              batch.stats().total_edge_weight_created());
+    ASSERT_EQ(single.cfgs().size(), batch.cfgs().size());
+    for (const auto &[name, single_cfg] : single.cfgs()) {
+      ASSERT_THAT(batch.cfgs(), Contains(Pair(name, _)));
+      const ControlFlowGraph &batch_cfg = *batch.cfgs().at(name);
+      ASSERT_EQ(single_cfg->nodes().size(), batch_cfg.nodes().size());
+      for (int i = 0; i != single_cfg->nodes().size(); ++i) {
+        EXPECT_EQ(single_cfg->nodes()[i]->freq(), batch_cfg.nodes()[i]->freq())
+            << single_cfg->nodes()[i]->GetName();
+      }
+    }
+  }
+}
+
 // Generates 2 cfg sets, one with "only_for_hot_functions" set to true, the
 // other false and compare the two cfg sets.
 TEST(LlvmPropellerWholeProgramInfo,
@@ -652,5 +971,27 @@ TEST(LlvmPropellerWholeProgramInfo, FindBbHandleIndexUsingBinaryAddress) {
   EXPECT_THAT(wpi->FindBbHandleIndexUsingBinaryAddress(0x1e63500,
                                                        BranchDirection::kFrom),
               Optional(ResultOf(bb_index_from_handle_index, 1)));
+
+  // The batch lookup agrees with the single lookups, for sorted as well as
+  // unsorted addresses, including ones outside of any block. Branches from
+  // 0x1b3d0a8 are not possible, since all blocks there are empty.
+  const std::vector<uint64_t> from_addresses = {
+      0x0,       0x1b3f5b0, 0x1b3f5b4, 0x1e63500,   0x1e63504,
+      0x1e63500, 0x1b3f5b0, 0x1e63500, ~uint64_t{0}};
+  std::vector<uint64_t> to_addresses = from_addresses;
+  to_addresses.insert(to_addresses.begin() + 1, {0x1b3d0a8, 0x1b3d0a9});
+  to_addresses.push_back(0x1b3d0a8);
+  for (auto [direction, addresses] :
+       {std::make_pair(BranchDirection::kFrom, from_addresses),
+        std::make_pair(BranchDirection::kTo, to_addresses)}) {
+    std::vector<std::optional<int>> expected;
+    for (uint64_t address : addresses) {
+      expected.push_back(
+          wpi->FindBbHandleIndexUsingBinaryAddress(address, direction));
+    }
+    EXPECT_EQ(
+        wpi->FindBbHandleIndexesUsingBinaryAddresses(addresses, direction),
+        expected);
+  }
 }
 }  // namespace
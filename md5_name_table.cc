@@ -0,0 +1,48 @@
+// Class to replace function names by their MD5 while keeping the names.
+
+#include "md5_name_table.h"
+
+#include <cstdint>
+#include <string>
+
+#include "name_interner.h"
+#include "third_party/abseil/absl/strings/numbers.h"
+#include "third_party/abseil/absl/strings/string_view.h"
+#include "third_party/abseil/absl/synchronization/mutex.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/MD5.h"
+
+namespace devtools_crosstool_autofdo {
+
+Md5NameTable &Md5NameTable::Global() {
+  static Md5NameTable *table = new Md5NameTable();
+  return *table;
+}
+
+const char *Md5NameTable::GetMd5Name(absl::string_view name) {
+  const uint64_t guid =
+      llvm::MD5Hash(llvm::StringRef(name.data(), name.size()));
+  {
+    absl::MutexLock lock(&mutex_);
+    // The first name wins if two names have the same MD5, as they would once
+    // LLVM hashes them.
+    if (!names_.contains(guid))
+      names_.emplace(guid, NameInterner::Global().InternName(name));
+  }
+  return NameInterner::Global().InternName(std::to_string(guid));
+}
+
+const char *Md5NameTable::GetName(absl::string_view md5_name) const {
+  uint64_t guid;
+  if (!absl::SimpleAtoi(md5_name, &guid)) return nullptr;
+  absl::MutexLock lock(&mutex_);
+  auto it = names_.find(guid);
+  return it == names_.end() ? nullptr : it->second;
+}
+
+bool Md5NameTable::empty() const {
+  absl::MutexLock lock(&mutex_);
+  return names_.empty();
+}
+
+}  // namespace devtools_crosstool_autofdo
@@ -0,0 +1,55 @@
+// Class to replace function names by their MD5 while keeping the names.
+
+#ifndef AUTOFDO_MD5_NAME_TABLE_H_
+#define AUTOFDO_MD5_NAME_TABLE_H_
+
+#include <cstddef>
+#include <cstdint>
+
+#include "base/macros.h"
+#include "third_party/abseil/absl/base/thread_annotations.h"
+#include "third_party/abseil/absl/container/flat_hash_map.h"
+#include "third_party/abseil/absl/strings/string_view.h"
+#include "third_party/abseil/absl/synchronization/mutex.h"
+
+namespace devtools_crosstool_autofdo {
+
+// Maps function names to their MD5 names, the decimal GUIDs that LLVM gives
+// the functions of profiles with MD5 name tables, and back. Readers that
+// produce MD5 based profiles key their symbols by the MD5 names, which are
+// at most 20 characters long, so that the symbol map, callsite and call target
+// maps neither copy nor hash long mangled names. Writers map the MD5 names
+// back to the names, which LLVM hashes itself.
+//
+// Names and MD5 names are kept in NameInterner::Global(), so the returned
+// pointers live as long as the process. This class is thread-safe.
+class Md5NameTable {
+ public:
+  Md5NameTable() = default;
+
+  // The table shared by the whole process. It is never destroyed.
+  static Md5NameTable &Global();
+
+  // Returns the MD5 name of NAME and remembers NAME for it.
+  const char *GetMd5Name(absl::string_view name) ABSL_LOCKS_EXCLUDED(mutex_);
+
+  // Returns the name whose MD5 name is MD5_NAME, or null if MD5_NAME was not
+  // returned by GetMd5Name.
+  const char *GetName(absl::string_view md5_name) const
+      ABSL_LOCKS_EXCLUDED(mutex_);
+
+  // Returns true if GetMd5Name was never called, which lets writers skip the
+  // lookups.
+  bool empty() const ABSL_LOCKS_EXCLUDED(mutex_);
+
+ private:
+  mutable absl::Mutex mutex_;
+  // Maps each GUID to its name.
+  absl::flat_hash_map<uint64_t, const char *> names_ ABSL_GUARDED_BY(mutex_);
+
+  DISALLOW_COPY_AND_ASSIGN(Md5NameTable);
+};
+
+}  // namespace devtools_crosstool_autofdo
+
+#endif  // AUTOFDO_MD5_NAME_TABLE_H_
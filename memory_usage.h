@@ -0,0 +1,47 @@
+// This file contains estimates of the heap memory held by containers, for the
+// MemoryUsage() estimators of the larger data structures. They count the
+// memory the containers allocate for their elements, not the memory that the
+// elements themselves point to.
+
+#ifndef AUTOFDO_MEMORY_USAGE_H_
+#define AUTOFDO_MEMORY_USAGE_H_
+
+#include <cstdint>
+#include <string>
+
+namespace devtools_crosstool_autofdo {
+
+// A std::string keeps up to 15 characters inline.
+inline uint64_t StringBytes(const std::string &s) {
+  return s.capacity() > 15 ? s.capacity() + 1 : 0;
+}
+
+// A std::vector allocates `capacity()` elements.
+template <typename Vector>
+uint64_t VectorBytes(const Vector &v) {
+  return v.capacity() * sizeof(typename Vector::value_type);
+}
+
+// A flat_hash_map takes one slot and one control byte per bucket.
+template <typename HashMap>
+uint64_t HashTableBytes(const HashMap &map) {
+  return map.capacity() * (sizeof(typename HashMap::value_type) + 1);
+}
+
+// A std::map or std::set allocates a node with three pointers and a color per
+// element.
+template <typename Tree>
+uint64_t TreeBytes(const Tree &tree) {
+  return tree.size() * (sizeof(typename Tree::value_type) + 32);
+}
+
+// A btree_map or btree_set packs its elements into nodes which are about 3/4
+// full after random insertions.
+template <typename Btree>
+uint64_t BtreeBytes(const Btree &btree) {
+  return btree.size() * sizeof(typename Btree::value_type) * 4 / 3;
+}
+
+}  // namespace devtools_crosstool_autofdo
+
+#endif  // AUTOFDO_MEMORY_USAGE_H_
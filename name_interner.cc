@@ -0,0 +1,62 @@
+// Class to store function names once per process.
+
+#include "name_interner.h"
+
+#include <algorithm>
+#include <cstring>
+
+#include "base/logging.h"
+
+namespace devtools_crosstool_autofdo {
+
+namespace {
+// Names are copied into blocks of this size. Longer names get their own
+// block.
+constexpr size_t kBlockSize = 1 << 16;
+}  // namespace
+
+NameInterner &NameInterner::Global() {
+  static NameInterner *interner = new NameInterner();
+  return *interner;
+}
+
+uint32_t NameInterner::Intern(absl::string_view name) {
+  absl::MutexLock lock(&mutex_);
+  auto it = ids_.find(name);
+  if (it != ids_.end()) return it->second;
+
+  char *copy = Allocate(name.size() + 1);
+  memcpy(copy, name.data(), name.size());
+  copy[name.size()] = '\0';
+  CHECK_LT(names_.size(), UINT32_MAX);
+  const uint32_t id = names_.size();
+  names_.push_back(copy);
+  ids_.emplace(absl::string_view(copy, name.size()), id);
+  return id;
+}
+
+const char *NameInterner::GetName(uint32_t id) const {
+  absl::MutexLock lock(&mutex_);
+  CHECK_LT(id, names_.size());
+  return names_[id];
+}
+
+size_t NameInterner::size() const {
+  absl::MutexLock lock(&mutex_);
+  return names_.size();
+}
+
+char *NameInterner::Allocate(size_t size) {
+  if (size > free_size_) {
+    const size_t block_size = std::max(size, kBlockSize);
+    blocks_.push_back(std::make_unique<char[]>(block_size));
+    free_ = blocks_.back().get();
+    free_size_ = block_size;
+  }
+  char *result = free_;
+  free_ += size;
+  free_size_ -= size;
+  return result;
+}
+
+}  // namespace devtools_crosstool_autofdo
@@ -0,0 +1,67 @@
+// Class to store function names once per process.
+
+#ifndef AUTOFDO_NAME_INTERNER_H_
+#define AUTOFDO_NAME_INTERNER_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "base/macros.h"
+#include "third_party/abseil/absl/base/thread_annotations.h"
+#include "third_party/abseil/absl/container/flat_hash_map.h"
+#include "third_party/abseil/absl/strings/string_view.h"
+#include "third_party/abseil/absl/synchronization/mutex.h"
+
+namespace devtools_crosstool_autofdo {
+
+// Keeps a single NUL-terminated copy of every distinct name it is given and
+// numbers the names densely from 0. The copies live in large blocks that
+// are never freed or moved, so the returned pointers stay valid as long as
+// the interner does, and two names are equal iff their pointers are.
+//
+// Profile readers and SymbolMap use Global() for function names, so that
+// symbols do not depend on the lifetime of the reader that created them.
+// This class is thread-safe.
+class NameInterner {
+ public:
+  NameInterner() = default;
+
+  // The interner shared by the whole process. It is never destroyed.
+  static NameInterner &Global();
+
+  // Returns the id of NAME, adding NAME if it is new.
+  uint32_t Intern(absl::string_view name) ABSL_LOCKS_EXCLUDED(mutex_);
+
+  // Returns the stored copy of NAME, adding NAME if it is new.
+  const char *InternName(absl::string_view name) ABSL_LOCKS_EXCLUDED(mutex_) {
+    return GetName(Intern(name));
+  }
+
+  // Returns the name with ID, which must have been returned by Intern.
+  const char *GetName(uint32_t id) const ABSL_LOCKS_EXCLUDED(mutex_);
+
+  // Returns the number of distinct names.
+  size_t size() const ABSL_LOCKS_EXCLUDED(mutex_);
+
+ private:
+  // Returns SIZE bytes of storage that stay valid until destruction.
+  char *Allocate(size_t size) ABSL_EXCLUSIVE_LOCKS_REQUIRED(mutex_);
+
+  mutable absl::Mutex mutex_;
+  // Keys point into blocks_.
+  absl::flat_hash_map<absl::string_view, uint32_t> ids_
+      ABSL_GUARDED_BY(mutex_);
+  std::vector<const char *> names_ ABSL_GUARDED_BY(mutex_);
+  std::vector<std::unique_ptr<char[]>> blocks_ ABSL_GUARDED_BY(mutex_);
+  // Unused bytes at the end of blocks_.back().
+  char *free_ ABSL_GUARDED_BY(mutex_) = nullptr;
+  size_t free_size_ ABSL_GUARDED_BY(mutex_) = 0;
+
+  DISALLOW_COPY_AND_ASSIGN(NameInterner);
+};
+
+}  // namespace devtools_crosstool_autofdo
+
+#endif  // AUTOFDO_NAME_INTERNER_H_
@@ -0,0 +1,60 @@
+#include "name_interner.h"
+
+#include <string>
+#include <thread>  // NOLINT(build/c++11)
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "third_party/abseil/absl/strings/str_cat.h"
+
+namespace {
+
+using ::devtools_crosstool_autofdo::NameInterner;
+
+TEST(NameInternerTest, InternsEachNameOnce) {
+  NameInterner interner;
+  std::string name = "_Z3fooi";
+  const uint32_t id = interner.Intern(name);
+  EXPECT_EQ(interner.Intern("_Z3bari"), id + 1);
+  EXPECT_EQ(interner.Intern(name), id);
+  EXPECT_EQ(interner.size(), 2);
+
+  const char *copy = interner.InternName(name);
+  EXPECT_EQ(copy, interner.GetName(id));
+  EXPECT_NE(copy, name.data());
+  name = "overwritten";
+  EXPECT_STREQ(copy, "_Z3fooi");
+}
+
+TEST(NameInternerTest, NamesStayValidAcrossBlocks) {
+  NameInterner interner;
+  const std::string long_name(100000, 'x');
+  std::vector<const char *> names;
+  for (int i = 0; i < 10000; ++i) {
+    names.push_back(interner.InternName(absl::StrCat("name", i)));
+  }
+  const char *long_copy = interner.InternName(long_name);
+  for (int i = 0; i < 10000; ++i) {
+    EXPECT_STREQ(names[i], absl::StrCat("name", i).c_str());
+  }
+  EXPECT_EQ(long_copy, long_name);
+  EXPECT_EQ(interner.InternName(""), interner.InternName(""));
+}
+
+TEST(NameInternerTest, ConcurrentInterning) {
+  NameInterner interner;
+  std::vector<std::vector<const char *>> names(4);
+  std::vector<std::thread> threads;
+  for (int t = 0; t < names.size(); ++t) {
+    threads.emplace_back([&, t]() {
+      for (int i = 0; i < 1000; ++i) {
+        names[t].push_back(interner.InternName(absl::StrCat("f", i)));
+      }
+    });
+  }
+  for (std::thread &thread : threads) thread.join();
+  EXPECT_EQ(interner.size(), 1000);
+  for (int t = 1; t < names.size(); ++t) EXPECT_EQ(names[t], names[0]);
+}
+
+}  // namespace
@@ -0,0 +1,83 @@
+#include "parallel_for.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <thread>  // NOLINT(build/c++11)
+#include <utility>
+#include <vector>
+
+#include "stage_metrics.h"
+#include "trace_events.h"
+#include "third_party/abseil/absl/flags/commandlineflag.h"
+#include "third_party/abseil/absl/flags/flag.h"
+#include "third_party/abseil/absl/functional/function_ref.h"
+#include "third_party/abseil/absl/strings/string_view.h"
+#include "third_party/abseil/absl/time/clock.h"
+#include "third_party/abseil/absl/time/time.h"
+
+ABSL_FLAG(uint32_t, jobs, 0,
+          "Number of threads used by every parallel stage whose own thread "
+          "count flag is left at its default. 0 keeps the default of every "
+          "stage.");
+
+namespace devtools_crosstool_autofdo {
+
+int GetStageThreads(const absl::Flag<uint32_t> &stage_threads) {
+  const uint32_t jobs = absl::GetFlag(FLAGS_jobs);
+  const absl::CommandLineFlag &flag =
+      absl::GetFlagReflectionHandle(stage_threads);
+  if (jobs == 0 || flag.CurrentValue() != flag.DefaultValue())
+    return absl::GetFlag(stage_threads);
+  return jobs;
+}
+
+void ParallelFor(int num_threads, int n, absl::FunctionRef<void(int)> func) {
+  ParallelFor(/*stage=*/"", num_threads, n,
+              [func](int i, int /*thread*/) { func(i); });
+}
+
+void ParallelFor(absl::string_view stage, int num_threads, int n,
+                 absl::FunctionRef<void(int i, int thread)> func) {
+  num_threads = std::max(std::min(num_threads, n), 1);
+  const absl::Time start = absl::Now();
+  // Named stages record a trace span for every task.
+  TraceRecorder &trace = TraceRecorder::GetInstance();
+  auto run = [&](int i, int thread) {
+    if (stage.empty() || !trace.enabled()) return func(i, thread);
+    const int64_t begin_ns = TraceRecorder::NowNanos();
+    func(i, thread);
+    trace.AddSpan(stage, begin_ns, TraceRecorder::NowNanos(), {{"task", i}});
+  };
+  // Time from `start` until each thread found no more indexes to run.
+  std::vector<absl::Duration> busy_times(num_threads);
+  if (num_threads == 1) {
+    for (int i = 0; i != n; ++i) run(i, 0);
+    busy_times[0] = absl::Now() - start;
+  } else {
+    std::atomic<int> next_index = 0;
+    std::vector<std::thread> workers;
+    workers.reserve(num_threads);
+    for (int t = 0; t != num_threads; ++t) {
+      workers.emplace_back([&, t]() {
+        for (int i = next_index++; i < n; i = next_index++) run(i, t);
+        busy_times[t] = absl::Now() - start;
+      });
+    }
+    for (std::thread &worker : workers) worker.join();
+  }
+  if (stage.empty()) return;
+
+  StageMetrics metrics;
+  metrics.stage = std::string(stage);
+  metrics.wall_time = absl::Now() - start;
+  metrics.rss_bytes = GetCurrentRssBytes();
+  metrics.peak_rss_bytes = GetPeakRssBytes();
+  metrics.num_threads = num_threads;
+  metrics.num_tasks = n;
+  for (absl::Duration busy_time : busy_times) metrics.busy_time += busy_time;
+  StageMetricsRegistry::GetInstance().Record(std::move(metrics));
+}
+
+}  // namespace devtools_crosstool_autofdo
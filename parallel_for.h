@@ -0,0 +1,43 @@
+// This file contains ParallelFor, the worker pool shared by the parallel
+// stages of the tools, and the --jobs flag which sets their default number of
+// threads.
+
+#ifndef AUTOFDO_PARALLEL_FOR_H_
+#define AUTOFDO_PARALLEL_FOR_H_
+
+#include <cstdint>
+
+#include "third_party/abseil/absl/flags/declare.h"
+#include "third_party/abseil/absl/flags/flag.h"
+#include "third_party/abseil/absl/functional/function_ref.h"
+#include "third_party/abseil/absl/strings/string_view.h"
+
+ABSL_DECLARE_FLAG(uint32_t, jobs);
+
+namespace devtools_crosstool_autofdo {
+
+// Returns the number of threads of the stage configured by `stage_threads`:
+// its value if it differs from its default, --jobs otherwise. If --jobs is 0,
+// this is always the value of `stage_threads`.
+int GetStageThreads(const absl::Flag<uint32_t> &stage_threads);
+
+// Calls `func(i)` for every `i` in [0, `n`) on up to `num_threads` threads.
+// Indexes are handed out through a shared counter, so that a few expensive
+// calls do not hold up the others. The calls with num_threads <= 1 run on the
+// calling thread, in increasing order of `i`.
+void ParallelFor(int num_threads, int n, absl::FunctionRef<void(int)> func);
+
+// Like above, but also passes the worker thread running the call, in
+// [0, `num_threads`), to `func(i, thread)` for per-thread state. Which thread
+// runs an index is not deterministic, so results must be stored by index and
+// per-thread state must be merged in an order-independent way. If `stage` is
+// not empty, the wall time, the number of threads and tasks and the time the
+// threads were busy are recorded as the metrics of `stage` in
+// StageMetricsRegistry, and every task is recorded as a span in
+// TraceRecorder.
+void ParallelFor(absl::string_view stage, int num_threads, int n,
+                 absl::FunctionRef<void(int i, int thread)> func);
+
+}  // namespace devtools_crosstool_autofdo
+
+#endif  // AUTOFDO_PARALLEL_FOR_H_
@@ -0,0 +1,223 @@
+#include "perf_data_decompressor.h"
+
+#include <zlib.h>
+#if defined(HAVE_ZSTD)
+#include <zstd.h>
+#endif
+
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <string>
+
+#include "third_party/abseil/absl/status/status.h"
+#include "third_party/abseil/absl/status/statusor.h"
+#include "third_party/abseil/absl/strings/str_cat.h"
+#include "third_party/abseil/absl/strings/string_view.h"
+
+namespace devtools_crosstool_autofdo {
+namespace {
+// Number of bytes of output added to the buffer before each decompression
+// step, and of input read from a file at a time.
+constexpr size_t kChunkSize = 1 << 20;
+
+class GzipDecompressor : public StreamingDecompressor {
+ public:
+  GzipDecompressor() {
+    memset(&stream_, 0, sizeof(stream_));
+    // 16 selects the gzip format.
+    initialized_ = inflateInit2(&stream_, MAX_WBITS + 16) == Z_OK;
+  }
+
+  ~GzipDecompressor() override {
+    if (initialized_) inflateEnd(&stream_);
+  }
+
+  absl::Status Decompress(absl::string_view input, std::string &out) override {
+    if (!initialized_) return absl::InternalError("Cannot initialize zlib.");
+    stream_.next_in =
+        reinterpret_cast<Bytef *>(const_cast<char *>(input.data()));
+    stream_.avail_in = input.size();
+    // Output may be left to flush once all input is consumed, while the last
+    // step filled the buffer.
+    bool output_full = false;
+    while (stream_.avail_in > 0 || (output_full && !at_member_end_)) {
+      // A new member follows the end of the previous one, as in the
+      // concatenation of gzip files.
+      if (at_member_end_) {
+        if (inflateReset(&stream_) != Z_OK)
+          return absl::InternalError("Cannot reset zlib.");
+        at_member_end_ = false;
+      }
+      const size_t size = out.size();
+      out.resize(size + kChunkSize);
+      stream_.next_out = reinterpret_cast<Bytef *>(out.data() + size);
+      stream_.avail_out = kChunkSize;
+      const int result = inflate(&stream_, Z_NO_FLUSH);
+      output_full = stream_.avail_out == 0;
+      out.resize(size + kChunkSize - stream_.avail_out);
+      if (result == Z_STREAM_END) {
+        at_member_end_ = true;
+      } else if (result != Z_OK && result != Z_BUF_ERROR) {
+        return absl::DataLossError(absl::StrCat(
+            "Corrupt gzip data: ", stream_.msg ? stream_.msg : "unknown"));
+      }
+    }
+    started_ = true;
+    return absl::OkStatus();
+  }
+
+  absl::Status Finish() override {
+    if (!started_ || !at_member_end_)
+      return absl::DataLossError("Truncated gzip data.");
+    return absl::OkStatus();
+  }
+
+ private:
+  z_stream stream_;
+  bool initialized_ = false;
+  bool started_ = false;
+  bool at_member_end_ = false;
+};
+
+#if defined(HAVE_ZSTD)
+class ZstdDecompressor : public StreamingDecompressor {
+ public:
+  ZstdDecompressor() : context_(ZSTD_createDStream()) {}
+
+  ~ZstdDecompressor() override { ZSTD_freeDStream(context_); }
+
+  absl::Status Decompress(absl::string_view input, std::string &out) override {
+    if (context_ == nullptr)
+      return absl::InternalError("Cannot initialize zstd.");
+    ZSTD_inBuffer in = {input.data(), input.size(), 0};
+    // Output may be left to flush once all input is consumed, while the last
+    // step filled the buffer.
+    bool output_full = false;
+    while (in.pos < in.size || output_full) {
+      const size_t size = out.size();
+      out.resize(size + kChunkSize);
+      ZSTD_outBuffer output = {out.data() + size, kChunkSize, 0};
+      // Returns 0 at the end of a frame, which the next frame may follow.
+      last_result_ = ZSTD_decompressStream(context_, &output, &in);
+      output_full = output.pos == kChunkSize;
+      out.resize(size + output.pos);
+      if (ZSTD_isError(last_result_)) {
+        return absl::DataLossError(absl::StrCat(
+            "Corrupt zstd data: ", ZSTD_getErrorName(last_result_)));
+      }
+    }
+    return absl::OkStatus();
+  }
+
+  absl::Status Finish() override {
+    if (last_result_ != 0) return absl::DataLossError("Truncated zstd data.");
+    return absl::OkStatus();
+  }
+
+ private:
+  ZSTD_DStream *context_;
+  // Result of the last ZSTD_decompressStream, non-zero before any input.
+  size_t last_result_ = 1;
+};
+#endif
+}  // namespace
+
+CompressionFormat DetectCompressionFormat(absl::string_view prefix) {
+  if (prefix.size() >= 2 && prefix[0] == '\x1f' && prefix[1] == '\x8b')
+    return CompressionFormat::kGzip;
+  if (prefix.size() >= 4 && prefix.substr(0, 4) == "\x28\xb5\x2f\xfd")
+    return CompressionFormat::kZstd;
+  return CompressionFormat::kNone;
+}
+
+absl::StatusOr<std::unique_ptr<StreamingDecompressor>>
+StreamingDecompressor::Create(CompressionFormat format) {
+  switch (format) {
+    case CompressionFormat::kGzip:
+      return std::make_unique<GzipDecompressor>();
+    case CompressionFormat::kZstd:
+#if defined(HAVE_ZSTD)
+      return std::make_unique<ZstdDecompressor>();
+#else
+      return absl::UnimplementedError(
+          "zstd compressed data is not supported without zstd.");
+#endif
+    case CompressionFormat::kNone:
+      break;
+  }
+  return absl::InvalidArgumentError("Data is not compressed.");
+}
+
+absl::StatusOr<std::string> DecompressData(absl::string_view data,
+                                           CompressionFormat format) {
+  absl::StatusOr<std::unique_ptr<StreamingDecompressor>> decompressor =
+      StreamingDecompressor::Create(format);
+  if (!decompressor.ok()) return decompressor.status();
+  std::string out;
+  // Perf data usually compresses by a factor of 4 to 10.
+  out.reserve(data.size() * 4);
+  absl::Status status = (*decompressor)->Decompress(data, out);
+  if (!status.ok()) return status;
+  status = (*decompressor)->Finish();
+  if (!status.ok()) return status;
+  return out;
+}
+
+absl::StatusOr<bool> IsCompressedFile(const std::string &file_name) {
+  FILE *file = fopen(file_name.c_str(), "rb");
+  if (file == nullptr) {
+    return absl::NotFoundError(
+        absl::StrCat("Cannot open ", file_name, ": ", strerror(errno)));
+  }
+  char magic[4];
+  const size_t size = fread(magic, 1, sizeof(magic), file);
+  fclose(file);
+  return DetectCompressionFormat(absl::string_view(magic, size)) !=
+         CompressionFormat::kNone;
+}
+
+absl::StatusOr<std::string> ReadDecompressedFile(const std::string &file_name) {
+  FILE *file = fopen(file_name.c_str(), "rb");
+  if (file == nullptr) {
+    return absl::NotFoundError(
+        absl::StrCat("Cannot open ", file_name, ": ", strerror(errno)));
+  }
+  std::unique_ptr<FILE, int (*)(FILE *)> closer(file, &fclose);
+  std::string input(kChunkSize, '\0');
+  size_t size = fread(input.data(), 1, input.size(), file);
+  const CompressionFormat format =
+      DetectCompressionFormat(absl::string_view(input.data(), size));
+  std::string out;
+  if (format == CompressionFormat::kNone) {
+    while (size > 0) {
+      out.append(input.data(), size);
+      size = fread(input.data(), 1, input.size(), file);
+    }
+  } else {
+    absl::StatusOr<std::unique_ptr<StreamingDecompressor>> decompressor =
+        StreamingDecompressor::Create(format);
+    if (!decompressor.ok()) return decompressor.status();
+    while (size > 0) {
+      absl::Status status = (*decompressor)->Decompress(
+          absl::string_view(input.data(), size), out);
+      if (!status.ok())
+        return absl::Status(status.code(),
+                            absl::StrCat(file_name, ": ", status.message()));
+      size = fread(input.data(), 1, input.size(), file);
+    }
+    absl::Status status = (*decompressor)->Finish();
+    if (!status.ok())
+      return absl::Status(status.code(),
+                          absl::StrCat(file_name, ": ", status.message()));
+  }
+  if (ferror(file)) {
+    return absl::InternalError(
+        absl::StrCat("Error reading ", file_name, ": ", strerror(errno)));
+  }
+  return out;
+}
+
+}  // namespace devtools_crosstool_autofdo
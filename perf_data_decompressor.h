@@ -0,0 +1,54 @@
+#ifndef AUTOFDO_PERF_DATA_DECOMPRESSOR_H_
+#define AUTOFDO_PERF_DATA_DECOMPRESSOR_H_
+
+#include <memory>
+#include <string>
+
+#include "third_party/abseil/absl/status/status.h"
+#include "third_party/abseil/absl/status/statusor.h"
+#include "third_party/abseil/absl/strings/string_view.h"
+
+namespace devtools_crosstool_autofdo {
+
+// Formats in which perf.data files may be compressed. zstd is only supported
+// when built with HAVE_ZSTD.
+enum class CompressionFormat { kNone, kGzip, kZstd };
+
+// Returns the format of the data starting with `prefix`, detected from its
+// magic number. At least 4 bytes are needed to detect a compressed format.
+CompressionFormat DetectCompressionFormat(absl::string_view prefix);
+
+// Decompresses a stream of gzip members or zstd frames as its compressed bytes
+// arrive, appending the output to a buffer grown as needed, so that the
+// compressed data never needs to be held as a whole.
+class StreamingDecompressor {
+ public:
+  // Returns a decompressor of `format`, which must not be kNone.
+  static absl::StatusOr<std::unique_ptr<StreamingDecompressor>> Create(
+      CompressionFormat format);
+
+  virtual ~StreamingDecompressor() = default;
+
+  // Decompresses the next bytes `input` of the stream, appending their output
+  // to `out`.
+  virtual absl::Status Decompress(absl::string_view input,
+                                  std::string &out) = 0;
+
+  // Returns `DataLossError` if the stream ended within a member or frame.
+  virtual absl::Status Finish() = 0;
+};
+
+// Returns the decompressed contents of `data`, which are in `format`.
+absl::StatusOr<std::string> DecompressData(absl::string_view data,
+                                           CompressionFormat format);
+
+// Returns whether the file `file_name` is gzip or zstd compressed.
+absl::StatusOr<bool> IsCompressedFile(const std::string &file_name);
+
+// Returns the contents of the file `file_name`, decompressed as they are read
+// if it is gzip or zstd compressed.
+absl::StatusOr<std::string> ReadDecompressedFile(const std::string &file_name);
+
+}  // namespace devtools_crosstool_autofdo
+
+#endif  // AUTOFDO_PERF_DATA_DECOMPRESSOR_H_
@@ -0,0 +1,97 @@
+#include "perf_data_decompressor.h"
+
+#include <zlib.h>
+
+#include <cstring>
+#include <fstream>
+#include <string>
+
+#include "base/logging.h"
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+#include "third_party/abseil/absl/status/status.h"
+#include "third_party/abseil/absl/strings/str_cat.h"
+#include "third_party/abseil/absl/strings/string_view.h"
+
+#define FLAGS_test_tmpdir std::string(testing::UnitTest::GetInstance()->original_working_dir())
+
+namespace devtools_crosstool_autofdo {
+namespace {
+
+using ::testing::HasSubstr;
+using ::testing::status::IsOkAndHolds;
+using ::testing::status::StatusIs;
+
+// Returns `data` as a gzip member.
+std::string Gzip(absl::string_view data) {
+  z_stream stream;
+  memset(&stream, 0, sizeof(stream));
+  CHECK_EQ(deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+                        MAX_WBITS + 16, 8, Z_DEFAULT_STRATEGY),
+           Z_OK);
+  std::string out(deflateBound(&stream, data.size()) + 32, '\0');
+  stream.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(data.data()));
+  stream.avail_in = data.size();
+  stream.next_out = reinterpret_cast<Bytef *>(out.data());
+  stream.avail_out = out.size();
+  CHECK_EQ(deflate(&stream, Z_FINISH), Z_STREAM_END);
+  out.resize(stream.total_out);
+  deflateEnd(&stream);
+  return out;
+}
+
+// Returns perf data like contents of `size` bytes.
+std::string Contents(int size) {
+  std::string contents = "PERFILE2";
+  while (contents.size() < size)
+    absl::StrAppend(&contents, contents.size() % 251, ",");
+  contents.resize(size);
+  return contents;
+}
+
+TEST(PerfDataDecompressor, DetectsFormats) {
+  EXPECT_EQ(DetectCompressionFormat(Gzip("x")), CompressionFormat::kGzip);
+  EXPECT_EQ(DetectCompressionFormat("\x28\xb5\x2f\xfd\x00"),
+            CompressionFormat::kZstd);
+  EXPECT_EQ(DetectCompressionFormat("PERFILE2"), CompressionFormat::kNone);
+  EXPECT_EQ(DetectCompressionFormat(""), CompressionFormat::kNone);
+}
+
+TEST(PerfDataDecompressor, DecompressesConcatenatedGzipMembers) {
+  // The contents are larger than the output chunk, so the output is flushed
+  // after all input is consumed.
+  const std::string first = Contents(3 << 20), second = Contents(1000);
+  EXPECT_THAT(DecompressData(absl::StrCat(Gzip(first), Gzip(second)),
+                             CompressionFormat::kGzip),
+              IsOkAndHolds(absl::StrCat(first, second)));
+}
+
+TEST(PerfDataDecompressor, ReportsTruncatedGzipData) {
+  const std::string compressed = Gzip(Contents(10000));
+  EXPECT_THAT(DecompressData(absl::string_view(compressed).substr(
+                                 0, compressed.size() - 4),
+                             CompressionFormat::kGzip),
+              StatusIs(absl::StatusCode::kDataLoss, HasSubstr("Truncated")));
+}
+
+TEST(PerfDataDecompressor, ReadsCompressedAndPlainFiles) {
+  const std::string contents = Contents(5 << 20);
+  const std::string compressed_file =
+      absl::StrCat(FLAGS_test_tmpdir, "/PerfDataDecompressor.perf.gz");
+  const std::string plain_file =
+      absl::StrCat(FLAGS_test_tmpdir, "/PerfDataDecompressor.perf");
+  {
+    std::ofstream(compressed_file, std::ios::binary) << Gzip(contents);
+    std::ofstream(plain_file, std::ios::binary) << contents;
+  }
+  EXPECT_THAT(IsCompressedFile(compressed_file), IsOkAndHolds(true));
+  EXPECT_THAT(IsCompressedFile(plain_file), IsOkAndHolds(false));
+  EXPECT_THAT(ReadDecompressedFile(compressed_file), IsOkAndHolds(contents));
+  EXPECT_THAT(ReadDecompressedFile(plain_file), IsOkAndHolds(contents));
+  EXPECT_THAT(
+      ReadDecompressedFile(absl::StrCat(FLAGS_test_tmpdir, "/does_not_exist")),
+      StatusIs(absl::StatusCode::kNotFound));
+}
+
+}  // namespace
+}  // namespace devtools_crosstool_autofdo
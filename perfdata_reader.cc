@@ -1,13 +1,31 @@
 #include "perfdata_reader.h"
 
+#include <algorithm>
+#include <array>
+#include <atomic>
 #include <functional>
+#include <iterator>
+#include <limits>
 #include <list>
+#include <map>
+#include <memory>
+#include <optional>
 #include <string>
+#include <thread>  // NOLINT(build/c++11)
 #include <utility>
+#include <vector>
 
+#include "instruction_decoder.h"
+#include "intel_pt_decoder.h"
 #include "llvm_propeller_perf_data_provider.h"
+#include "parallel_for.h"
+#include "third_party/abseil/absl/container/flat_hash_map.h"
+#include "third_party/abseil/absl/container/flat_hash_set.h"
+#include "third_party/abseil/absl/flags/flag.h"
+#include "third_party/abseil/absl/functional/function_ref.h"
 #include "third_party/abseil/absl/status/status.h"
 #include "third_party/abseil/absl/strings/str_format.h"
+#include "third_party/abseil/absl/types/span.h"
 #include "llvm/ADT/ArrayRef.h"
 #include "llvm/BinaryFormat/ELF.h"
 #include "llvm/Object/ObjectFile.h"
@@ -19,6 +37,10 @@
 #include "quipper/perf_parser.h"
 #include "quipper/perf_reader.h"
 
+ABSL_FLAG(uint32_t, intel_pt_decode_threads, 1,
+          "Number of threads used to decode the segments of the Intel PT "
+          "traces in the perf data. The counts do not depend on it.");
+
 namespace {
 // Convert binary data stored in data[...] into text representation.
 std::string BinaryDataToAscii(const std::string &data) {
@@ -229,16 +251,92 @@ bool PerfDataReader::SelectBinaryInfo(const std::string &binary_file_name,
 
   return elf_file_util->ReadLoadableSegments(binary_info);
 }
-bool PerfDataReader::SelectPerfInfo(PerfDataProvider::BufferHandle perf_data,
-                                    const std::string &match_mmap_name,
-                                    BinaryPerfInfo *binary_perf_info) const {
-  // "binary_info" must already be initialized.
-  if (!(binary_perf_info->binary_info.file_content)) return false;
+
+namespace {
+// Returns true if [load_addr, load_addr + load_size) overlaps any of "mmaps",
+// which do not overlap each other. Only the mmaps right before and at or
+// after "load_addr" need to be checked.
+bool Overlaps(const std::set<MMapEntry> &mmaps, uint64_t load_addr,
+              uint64_t load_size) {
+  auto next = mmaps.lower_bound({load_addr, 0, 0, ""});
+  if (next != mmaps.end() && next->load_addr < load_addr + load_size)
+    return true;
+  if (next == mmaps.begin()) return false;
+  const MMapEntry &prev = *std::prev(next);
+  return load_addr < prev.load_addr + prev.load_size;
+}
+
+// Removes the samples of "lbr_samples" whose pid is not in "binary_mmaps".
+void RetainSamplesOfBinaryMMaps(const BinaryMMaps &binary_mmaps,
+                                LbrSamples &lbr_samples) {
+  int64_t n_kept = 0;
+  uint64_t n_kept_branches = 0;
+  for (int64_t s = 0; s != lbr_samples.size(); ++s) {
+    if (binary_mmaps.find(lbr_samples.pids[s]) == binary_mmaps.end()) continue;
+    const uint64_t begin = lbr_samples.offsets[s];
+    const uint64_t end = lbr_samples.offsets[s + 1];
+    std::copy(lbr_samples.branches.begin() + begin,
+              lbr_samples.branches.begin() + end,
+              lbr_samples.branches.begin() + n_kept_branches);
+    n_kept_branches += end - begin;
+    lbr_samples.pids[n_kept] = lbr_samples.pids[s];
+    lbr_samples.ips[n_kept] = lbr_samples.ips[s];
+    lbr_samples.offsets[++n_kept] = n_kept_branches;
+  }
+  lbr_samples.pids.resize(n_kept);
+  lbr_samples.ips.resize(n_kept);
+  lbr_samples.offsets.resize(n_kept + 1);
+  lbr_samples.branches.resize(n_kept_branches);
+  lbr_samples.pids.shrink_to_fit();
+  lbr_samples.ips.shrink_to_fit();
+  lbr_samples.offsets.shrink_to_fit();
+  lbr_samples.branches.shrink_to_fit();
+}
+
+// Appends the samples of "lbr_samples" whose pid is in "binary_mmaps" to
+// "result".
+void CopySamplesOfBinaryMMaps(const BinaryMMaps &binary_mmaps,
+                              const LbrSamples &lbr_samples,
+                              LbrSamples &result) {
+  for (int64_t s = 0; s != lbr_samples.size(); ++s) {
+    if (binary_mmaps.find(lbr_samples.pids[s]) == binary_mmaps.end()) continue;
+    result.branches.insert(
+        result.branches.end(),
+        lbr_samples.branches.begin() + lbr_samples.offsets[s],
+        lbr_samples.branches.begin() + lbr_samples.offsets[s + 1]);
+    result.pids.push_back(lbr_samples.pids[s]);
+    result.ips.push_back(lbr_samples.ips[s]);
+    result.offsets.push_back(result.branches.size());
+  }
+}
+
+}  // namespace
+
+bool PerfDataReader::ReadPerfData(
+    PerfDataProvider::BufferHandle perf_data, LbrSamples &lbr_samples,
+    absl::FunctionRef<bool(const quipper::PerfReader &,
+                           const quipper::PerfParser &)>
+        select_mmaps) const {
+  // The mmaps of the binary can only be selected once the whole file has been
+  // read (the build-id section follows the events), so the branch stacks of
+  // all samples are kept in a compact form and filtered afterwards. This makes
+  // this the only pass over the perf data.
+  auto process_event = [&](const quipper::PerfDataProto::SampleEvent &event) {
+    if (!event.has_pid()) return;
+    const auto &brstack = event.branch_stack();
+    if (brstack.empty()) return;
+    lbr_samples.pids.push_back(event.pid());
+    lbr_samples.ips.push_back(event.ip());
+    for (const auto &be : brstack)
+      lbr_samples.branches.emplace_back(be.from_ip(), be.to_ip());
+    lbr_samples.offsets.push_back(lbr_samples.branches.size());
+  };
 
   quipper::PerfReader perf_reader;
-  // Ignore SAMPLE events for now to reduce memory usage. They will be needed
-  // only in AggregateLBR, which will do a separate pass over the profiles.
+  // SAMPLE events are not serialized to reduce memory usage, their branch
+  // stacks are collected by "process_event" instead.
   perf_reader.SetEventTypesToSkipWhenSerializing({quipper::PERF_RECORD_SAMPLE});
+  perf_reader.SetSampleCallback(process_event);
   if (!perf_reader.ReadFromPointer(perf_data.buffer->getBufferStart(),
                                    perf_data.buffer->getBufferSize())) {
     LOG(ERROR) << "Failed to read perf data file: " << perf_data.description;
@@ -251,11 +349,204 @@ bool PerfDataReader::SelectPerfInfo(PerfDataProvider::BufferHandle perf_data,
                << perf_data.description << "'.";
     return false;
   }
+  return select_mmaps(perf_reader, perf_parser);
+}
 
-  binary_perf_info->perf_data = std::move(perf_data);
+bool PerfDataReader::SelectPerfInfo(PerfDataProvider::BufferHandle perf_data,
+                                    const std::string &match_mmap_name,
+                                    BinaryPerfInfo *binary_perf_info) const {
+  // "binary_info" must already be initialized, either by SelectBinaryInfo or
+  // by BinaryInfo::CopyMetadata.
+  if (binary_perf_info->binary_info.file_name.empty()) return false;
+
+  LbrSamples &lbr_samples = binary_perf_info->lbr_samples;
+  return ReadPerfData(
+      std::move(perf_data), lbr_samples,
+      [&](const quipper::PerfReader &perf_reader,
+          const quipper::PerfParser &perf_parser) {
+        if (!SelectMMaps(binary_perf_info, perf_reader, perf_parser,
+                         match_mmap_name))
+          return false;
+        RetainSamplesOfBinaryMMaps(binary_perf_info->binary_mmaps,
+                                   lbr_samples);
+        DecodeIntelPtTraces(perf_reader, binary_perf_info);
+        return true;
+      });
+}
+
+bool PerfDataReader::SelectPerfInfos(
+    PerfDataProvider::BufferHandle perf_data,
+    absl::Span<const std::string> match_mmap_names,
+    absl::Span<BinaryPerfInfo *const> binary_perf_infos) const {
+  CHECK_EQ(match_mmap_names.size(), binary_perf_infos.size());
+  for (const BinaryPerfInfo *binary_perf_info : binary_perf_infos)
+    if (binary_perf_info->binary_info.file_name.empty()) return false;
+
+  LbrSamples lbr_samples;
+  return ReadPerfData(
+      std::move(perf_data), lbr_samples,
+      [&](const quipper::PerfReader &perf_reader,
+          const quipper::PerfParser &perf_parser) {
+        for (int i = 0; i != binary_perf_infos.size(); ++i) {
+          BinaryPerfInfo *binary_perf_info = binary_perf_infos[i];
+          if (!SelectMMaps(binary_perf_info, perf_reader, perf_parser,
+                           match_mmap_names[i])) {
+            // The perf data has no samples for this binary.
+            binary_perf_info->binary_mmaps.clear();
+            continue;
+          }
+          CopySamplesOfBinaryMMaps(binary_perf_info->binary_mmaps,
+                                   lbr_samples, binary_perf_info->lbr_samples);
+          DecodeIntelPtTraces(perf_reader, binary_perf_info);
+        }
+        return true;
+      });
+}
+
+void PerfDataReader::DecodeIntelPtTraces(
+    const quipper::PerfReader &perf_reader, BinaryPerfInfo *info) const {
+  // The trace of every AUX buffer, by buffer index, is split over the
+  // AUXTRACE events of the buffer.
+  struct Trace {
+    uint32_t tid;
+    std::string data;
+  };
+  std::map<uint32_t, Trace> traces;
+  absl::flat_hash_map<uint32_t, uint32_t> pid_of_tid;
+  for (const quipper::PerfDataProto_PerfEvent &event : perf_reader.events()) {
+    switch (event.event_type_case()) {
+      case quipper::PerfDataProto_PerfEvent::kCommEvent:
+        pid_of_tid[event.comm_event().tid()] = event.comm_event().pid();
+        break;
+      case quipper::PerfDataProto_PerfEvent::kForkEvent:
+        pid_of_tid[event.fork_event().tid()] = event.fork_event().pid();
+        break;
+      case quipper::PerfDataProto_PerfEvent::kAuxtraceEvent: {
+        const quipper::PerfDataProto_AuxtraceEvent &auxtrace =
+            event.auxtrace_event();
+        Trace &trace = traces[auxtrace.idx()];
+        trace.tid = auxtrace.tid();
+        trace.data += auxtrace.trace_data();
+        break;
+      }
+      default:
+        break;
+    }
+  }
+  if (traces.empty() || info->binary_mmaps.empty()) return;
+
+  // The traces of CPUs do not tell which process ran, so they are only
+  // decoded if all the processes of the binary have the same mmaps.
+  const auto &[first_pid, first_mmaps] = *info->binary_mmaps.begin();
+  bool same_mmaps = true;
+  for (const auto &[pid, mmaps] : info->binary_mmaps)
+    same_mmaps = same_mmaps && mmaps == first_mmaps;
+  struct Segment {
+    const std::string *trace;
+    uint64_t pid;
+    int64_t begin;
+    int64_t end;
+  };
+  std::vector<Segment> segments;
+  int cpu_traces_skipped = 0;
+  for (const auto &[idx, trace] : traces) {
+    uint64_t pid;
+    if (trace.tid == static_cast<uint32_t>(-1)) {
+      if (!same_mmaps) {
+        ++cpu_traces_skipped;
+        continue;
+      }
+      pid = first_pid;
+    } else {
+      auto it = pid_of_tid.find(trace.tid);
+      pid = it != pid_of_tid.end() ? it->second : trace.tid;
+      if (info->binary_mmaps.find(pid) == info->binary_mmaps.end()) continue;
+    }
+    const std::vector<int64_t> offsets = FindPsbOffsets(trace.data);
+    for (int i = 0; i < offsets.size(); ++i) {
+      segments.push_back(
+          {&trace.data, pid, offsets[i],
+           i + 1 < offsets.size() ? offsets[i + 1]
+                                  : static_cast<int64_t>(trace.data.size())});
+    }
+  }
+  if (cpu_traces_skipped != 0) {
+    LOG(WARNING) << cpu_traces_skipped << " Intel PT traces of CPUs are not "
+                 << "decoded, as the processes of '"
+                 << info->binary_info.file_name
+                 << "' have different mmaps. Record the traces per thread.";
+  }
+  if (segments.empty()) return;
+
+  std::unique_ptr<InstructionDecoder> decoder =
+      InstructionDecoder::Create(info->binary_info.file_name);
+  if (decoder == nullptr) {
+    LOG(ERROR) << "Failed to create the instruction decoder of '"
+               << info->binary_info.file_name
+               << "', its Intel PT traces are not decoded.";
+    return;
+  }
 
-  return SelectMMaps(binary_perf_info, perf_reader, perf_parser,
-                     match_mmap_name);
+  // Segments are decoded independently on the worker threads, each with its
+  // own address translator, control transfers and counts, and the counts are
+  // summed at the end.
+  struct WorkerState {
+    std::unique_ptr<BinaryAddressTranslator> translator;
+    // The control transfers found from binary addresses.
+    absl::flat_hash_map<uint64_t, std::optional<ControlTransfer>> transfers;
+    absl::flat_hash_map<uint64_t, TraceCounts> counts;
+    IntelPtDecodeStats stats;
+  };
+  const int num_threads = GetStageThreads(FLAGS_intel_pt_decode_threads);
+  std::vector<WorkerState> workers(num_threads);
+  ParallelFor(
+      "DecodeIntelPt", num_threads, segments.size(), [&](int i, int thread) {
+        WorkerState &worker = workers[thread];
+        if (worker.translator == nullptr) {
+          worker.translator =
+              std::make_unique<BinaryAddressTranslator>(*this, *info);
+        }
+        const Segment &segment = segments[i];
+        auto read_control_transfer =
+            [&](uint64_t ip) -> std::optional<ControlTransfer> {
+          const uint64_t addr = worker.translator->Translate(segment.pid, ip);
+          if (addr == kInvalidAddress) return std::nullopt;
+          auto [it, inserted] = worker.transfers.try_emplace(addr);
+          if (inserted) it->second = decoder->FindNextControlTransfer(addr);
+          std::optional<ControlTransfer> transfer = it->second;
+          // The transfer and the target of a direct branch are mapped like
+          // the code at "ip".
+          if (transfer.has_value()) {
+            transfer->address += ip - addr;
+            transfer->target += ip - addr;
+          }
+          return transfer;
+        };
+        TraceCounts &counts = worker.counts[segment.pid];
+        auto add_run =
+            [&](absl::Span<const std::pair<uint64_t, uint64_t>> run) {
+          for (int b = 0; b < run.size(); ++b) {
+            ++counts.branches[run[b]];
+            if (b + 1 < run.size())
+              ++counts.fallthroughs[{run[b].second, run[b + 1].first}];
+          }
+        };
+        worker.stats += DecodeIntelPtSegment(*segment.trace, segment.begin,
+                                             segment.end, read_control_transfer,
+                                             add_run);
+      });
+
+  IntelPtDecodeStats stats;
+  for (WorkerState &worker : workers) {
+    for (const auto &[pid, counts] : worker.counts)
+      info->trace_counts[pid].MergeFrom(counts);
+    stats += worker.stats;
+  }
+  LOG(INFO) << "Decoded " << stats.segments << " Intel PT segments of '"
+            << info->binary_info.file_name << "' into " << stats.branches
+            << " branches in " << stats.runs << " runs, " << stats.desyncs
+            << " segments stopped early and " << stats.overflows
+            << " overflows.";
 }
 
 // Find the set of file names in perf.data file which has the same build id as
@@ -321,12 +612,37 @@ bool PerfDataReader::SelectMMaps(BinaryPerfInfo *info,
         std::set<std::string>({match_mmap_name}));
   }
 
+  // The events are in time order, so forks copy the mmaps their parent has at
+  // that time. A forked process that execs drops the mmaps it inherited.
+  absl::flat_hash_set<uint64_t> inherited_pids;
   for (const auto &pe : perf_parser.parsed_events()) {
-    quipper::PerfDataProto_PerfEvent *event_ptr = pe.event_ptr;
-    if (event_ptr->event_type_case() !=
+    const quipper::PerfDataProto_PerfEvent &event = *pe.event_ptr;
+    if (event.event_type_case() ==
+        quipper::PerfDataProto_PerfEvent::kForkEvent) {
+      const quipper::PerfDataProto_ForkEvent &fork = event.fork_event();
+      // A new thread shares the mmaps of its process. A reused pid keeps the
+      // mmaps of its earlier process, as mmaps are not tracked over time.
+      if (fork.pid() == fork.ppid() ||
+          info->binary_mmaps.count(fork.pid()) != 0)
+        continue;
+      auto parent = info->binary_mmaps.find(fork.ppid());
+      if (parent == info->binary_mmaps.end()) continue;
+      std::set<MMapEntry> mmaps = parent->second;
+      info->binary_mmaps.emplace(fork.pid(), std::move(mmaps));
+      inherited_pids.insert(fork.pid());
+      continue;
+    }
+    if (event.event_type_case() ==
+        quipper::PerfDataProto_PerfEvent::kCommEvent) {
+      if ((event.header().misc() & PERF_RECORD_MISC_COMM_EXEC) &&
+          inherited_pids.erase(event.comm_event().pid()))
+        info->binary_mmaps.erase(event.comm_event().pid());
+      continue;
+    }
+    if (event.event_type_case() !=
         quipper::PerfDataProto_PerfEvent::kMmapEvent)
       continue;
-    const quipper::PerfDataProto_MMapEvent &mmap_evt = event_ptr->mmap_event();
+    const quipper::PerfDataProto_MMapEvent &mmap_evt = event.mmap_event();
     if (!mmap_evt.has_filename() || mmap_evt.filename().empty() ||
         !mmap_evt.has_start() || !mmap_evt.has_len() || !mmap_evt.has_pid())
       continue;
@@ -337,34 +653,31 @@ bool PerfDataReader::SelectMMaps(BinaryPerfInfo *info,
     uint64_t load_size = mmap_evt.len();
     uint64_t page_offset = mmap_evt.has_pgoff() ? mmap_evt.pgoff() : 0;
 
-    bool entry_exists = false;
-    auto existing_mmaps = info->binary_mmaps.find(mmap_evt.pid());
-    if (existing_mmaps != info->binary_mmaps.end()) {
-      for (const MMapEntry &e : existing_mmaps->second) {
-        if (e.load_addr == load_addr && e.load_size == load_size &&
-            e.page_offset == page_offset) {
-          entry_exists = true;
-          continue;
-        }
-        if (!((load_addr + load_size <= e.load_addr) ||
-              (e.load_addr + e.load_size <= load_addr))) {
-          std::stringstream ss;
-          ss << "Found conflict mmap event: "
-             << MMapEntry{load_addr, load_size, page_offset,
-                          info->binary_info.file_name}
-             << ". Existing mmap entries: " << std::endl;
-          for (auto &me : existing_mmaps->second) ss << "\t" << me << std::endl;
-          LOG(ERROR) << ss.str();
-          return false;
-        }
-      }
-      if (!entry_exists)
-        existing_mmaps->second.emplace(load_addr, load_size, page_offset,
-                                       mmap_evt.filename());
-    } else {
-      info->binary_mmaps[mmap_evt.pid()].emplace(
-          load_addr, load_size, page_offset, mmap_evt.filename());
+    std::set<MMapEntry> &mmaps = info->binary_mmaps[mmap_evt.pid()];
+    auto next = mmaps.lower_bound({load_addr, 0, 0, ""});
+    if (next != mmaps.end() && next->load_addr == load_addr &&
+        next->load_size == load_size && next->page_offset == page_offset)
+      continue;
+    // A process mapping the binary over the mmaps it inherited has replaced
+    // its image without an exec event, so those are dropped.
+    if (inherited_pids.contains(mmap_evt.pid()) &&
+        Overlaps(mmaps, load_addr, load_size)) {
+      inherited_pids.erase(mmap_evt.pid());
+      mmaps.clear();
+      next = mmaps.end();
+    }
+    if (Overlaps(mmaps, load_addr, load_size)) {
+      std::stringstream ss;
+      ss << "Found conflict mmap event: "
+         << MMapEntry{load_addr, load_size, page_offset,
+                      info->binary_info.file_name}
+         << ". Existing mmap entries: " << std::endl;
+      for (auto &me : mmaps) ss << "\t" << me << std::endl;
+      LOG(ERROR) << ss.str();
+      return false;
     }
+    mmaps.emplace_hint(next, load_addr, load_size, page_offset,
+                       mmap_evt.filename());
   }  // End of iterating perf mmap events.
 
   if (info->binary_mmaps.empty()) {
@@ -372,13 +685,18 @@ bool PerfDataReader::SelectMMaps(BinaryPerfInfo *info,
                << "'.";
     return false;
   }
+  uint64_t num_mmaps = 0;
   for (auto &mpid : info->binary_mmaps) {
+    num_mmaps += mpid.second.size();
+    if (!VLOG_IS_ON(1)) continue;
     std::stringstream ss;
     ss << "Found mmap: pid=" << std::noshowbase << std::dec << mpid.first
        << std::endl;
     for (auto &mm : mpid.second) ss << "\t" << mm << std::endl;
-    LOG(INFO) << ss.str();
+    VLOG(1) << ss.str();
   }
+  LOG(INFO) << "Found " << num_mmaps << " mmaps matching '" << match_fn
+            << "' in " << info->binary_mmaps.size() << " processes.";
   return true;
 }
 
@@ -395,10 +713,13 @@ uint64_t PerfDataReader::RuntimeAddressToBinaryAddress(
     uint64_t pid, uint64_t addr, const BinaryPerfInfo &bpi) const {
   auto i = bpi.binary_mmaps.find(pid);
   if (i == bpi.binary_mmaps.end()) return kInvalidAddress;
-  const MMapEntry *mmap = nullptr;
-  for (const MMapEntry &p : i->second)
-    if (p.load_addr <= addr && addr < p.load_addr + p.load_size) mmap = &p;
-  if (!mmap) return kInvalidAddress;
+  // The mmaps of a pid do not overlap, so only the last one starting at or
+  // before "addr" can cover it.
+  auto next = i->second.upper_bound(
+      {addr, std::numeric_limits<uint64_t>::max(), 0, ""});
+  if (next == i->second.begin()) return kInvalidAddress;
+  const MMapEntry *mmap = &*std::prev(next);
+  if (addr >= mmap->load_addr + mmap->load_size) return kInvalidAddress;
   if (!bpi.binary_info.is_pie) return addr;
 
   uint64_t file_offset = addr - mmap->load_addr + mmap->page_offset;
@@ -415,50 +736,218 @@ uint64_t PerfDataReader::RuntimeAddressToBinaryAddress(
   return kInvalidAddress;
 }
 
-void PerfDataReader::AggregateLBR(const BinaryPerfInfo &binary_perf_info,
-                                  LBRAggregation *result) const {
-  auto process_event = [&](const quipper::PerfDataProto::SampleEvent &event) {
-    if (!event.has_pid() || binary_perf_info.binary_mmaps.find(event.pid()) ==
-                                binary_perf_info.binary_mmaps.end())
-      return;
+BinaryAddressTranslator::BinaryAddressTranslator(
+    const PerfDataReader &reader, const BinaryPerfInfo &binary_perf_info)
+    : reader_(reader), binary_perf_info_(binary_perf_info) {
+  const BinaryInfo &binary_info = binary_perf_info.binary_info;
+  for (const auto &[pid, mmaps] : binary_perf_info.binary_mmaps) {
+    std::vector<Interval> &intervals = intervals_by_pid_[pid];
+    for (const MMapEntry &mmap : mmaps) {
+      if (!binary_info.is_pie) {
+        intervals.push_back({mmap.load_addr, mmap.load_addr + mmap.load_size,
+                             /*delta=*/0});
+        continue;
+      }
+      // Intersect the file range of this mmap with each segment's, so that
+      // within one interval: binary address = runtime address - load_addr +
+      // page_offset - segment.offset + segment.vaddr.
+      const uint64_t mmap_file_end = mmap.page_offset + mmap.load_size;
+      for (const BinaryInfo::Segment &segment : binary_info.segments) {
+        uint64_t file_begin = std::max(mmap.page_offset, segment.offset);
+        uint64_t file_end =
+            std::min(mmap_file_end, segment.offset + segment.memsz);
+        if (file_begin >= file_end) continue;
+        intervals.push_back(
+            {file_begin - mmap.page_offset + mmap.load_addr,
+             file_end - mmap.page_offset + mmap.load_addr,
+             mmap.page_offset - mmap.load_addr - segment.offset +
+                 segment.vaddr});
+      }
+    }
+    std::sort(intervals.begin(), intervals.end(),
+              [](const Interval &a, const Interval &b) {
+                return a.start < b.start;
+              });
+  }
+}
 
-    uint64_t pid = event.pid();
-    const auto &brstack = event.branch_stack();
-    if (brstack.empty()) return;
-    uint64_t last_from = kInvalidAddress;
-    uint64_t last_to = kInvalidAddress;
-    for (int p = brstack.size() - 1; p >= 0; --p) {
-      const auto &be = brstack.Get(p);
-      uint64_t from =
-          RuntimeAddressToBinaryAddress(pid, be.from_ip(), binary_perf_info);
-      uint64_t to =
-          RuntimeAddressToBinaryAddress(pid, be.to_ip(), binary_perf_info);
-      // NOTE(shenhan): LBR sometimes duplicates the first entry by mistake (*).
-      // For now we treat these to be true entries.
-      // (*)  (p == 0 && from == lastFrom && to == lastTo) ==> true
-
-      result->branch_counters[std::make_pair(from, to)]++;
-      if (last_to != kInvalidAddress && last_to <= from)
-        result->fallthrough_counters[std::make_pair(last_to, from)]++;
-      last_to = to;
-      last_from = from;
+uint64_t BinaryAddressTranslator::Translate(uint64_t pid, uint64_t addr) {
+  if (pid == last_pid_ && last_interval_.start <= addr &&
+      addr < last_interval_.end) {
+    ++stats_.cache_hits;
+    return addr + last_interval_.delta;
+  }
+  ++stats_.cache_misses;
+  auto it = intervals_by_pid_.find(pid);
+  if (it == intervals_by_pid_.end()) return PerfDataReader::kInvalidAddress;
+  const std::vector<Interval> &intervals = it->second;
+  auto interval = std::upper_bound(
+      intervals.begin(), intervals.end(), addr,
+      [](uint64_t a, const Interval &i) { return a < i.start; });
+  if (interval != intervals.begin() && addr < std::prev(interval)->end) {
+    last_pid_ = pid;
+    last_interval_ = *std::prev(interval);
+    return addr + last_interval_.delta;
+  }
+  // Not covered by any interval. Defer to the reader, which reports addresses
+  // inside an mmap but outside of any loadable segment.
+  return reader_.RuntimeAddressToBinaryAddress(pid, addr, binary_perf_info_);
+}
+
+namespace {
+// Accumulates one LBR stack of "n" entries "weight" times into the counters
+// of "result". "get_entry(p)" returns the <from_ip, to_ip> runtime
+// address pair of the p-th entry, entries are visited from the oldest (the
+// last one) to the newest (the first one).
+template <typename GetEntryFn>
+void AccumulateBranchStack(BinaryAddressTranslator &translator, uint64_t pid,
+                           int n, GetEntryFn get_entry, uint64_t weight,
+                           LBRAggregation &result) {
+  uint64_t last_to = PerfDataReader::kInvalidAddress;
+  for (int p = n - 1; p >= 0; --p) {
+    const std::pair<uint64_t, uint64_t> entry = get_entry(p);
+    uint64_t from = translator.Translate(pid, entry.first);
+    uint64_t to = translator.Translate(pid, entry.second);
+    // NOTE(shenhan): LBR sometimes duplicates the first entry by mistake (*).
+    // For now we treat these to be true entries.
+    // (*)  (p == 0 && from == lastFrom && to == lastTo) ==> true
+
+    result.branch_counters[std::make_pair(from, to)] += weight;
+    if (last_to != PerfDataReader::kInvalidAddress && last_to <= from)
+      result.fallthrough_counters[std::make_pair(last_to, from)] += weight;
+    last_to = to;
+  }
+}
+
+// Accumulates samples "[begin, end)" of "lbr_samples" kept by "subsampling",
+// or all of them if it is null, into "result", and the kept samples of each
+// half into "halves" if it is not null.
+void AccumulateLbrSamples(BinaryAddressTranslator &translator,
+                          const LbrSamples &lbr_samples, int64_t begin,
+                          int64_t end, const LbrSubsampling *subsampling,
+                          LBRAggregation &result,
+                          std::array<LBRAggregation, 2> *halves) {
+  for (int64_t s = begin; s != end; ++s) {
+    uint64_t weight = 1;
+    if (subsampling != nullptr) {
+      if (!subsampling->selector.Keep(s)) continue;
+      weight = subsampling->selector.stride();
     }
-  };
+    const uint64_t offset = lbr_samples.offsets[s];
+    auto get_entry = [&lbr_samples, offset](int p) {
+      return lbr_samples.branches[offset + p];
+    };
+    const int n = lbr_samples.offsets[s + 1] - offset;
+    AccumulateBranchStack(translator, lbr_samples.pids[s], n, get_entry,
+                          weight, result);
+    if (halves != nullptr) {
+      AccumulateBranchStack(translator, lbr_samples.pids[s], n, get_entry,
+                            2 * weight,
+                            (*halves)[subsampling->selector.Half(s)]);
+    }
+  }
+}
 
-  quipper::PerfReader perf_reader;
-  // We don't need to serialise anything here, so let's exclude all major event
-  // types.
-  perf_reader.SetEventTypesToSkipWhenSerializing(
-      {quipper::PERF_RECORD_SAMPLE, quipper::PERF_RECORD_MMAP,
-       quipper::PERF_RECORD_FORK, quipper::PERF_RECORD_COMM});
-  perf_reader.SetSampleCallback(process_event);
-  CHECK(binary_perf_info.perf_data.has_value());
-  if (!perf_reader.ReadFromPointer(
-          binary_perf_info.perf_data->buffer->getBufferStart(),
-          binary_perf_info.perf_data->buffer->getBufferSize())) {
-    LOG(FATAL) << "Failed to read perf data file: "
-               << binary_perf_info.perf_data->description;
+// Accumulates the counts decoded from the Intel PT traces of
+// "binary_perf_info" into "result", translated to binary addresses.
+void AccumulateTraceCounts(BinaryAddressTranslator &translator,
+                           const BinaryPerfInfo &binary_perf_info,
+                           LBRAggregation &result) {
+  for (const auto &[pid, counts] : binary_perf_info.trace_counts) {
+    for (const auto &[branch, count] : counts.branches) {
+      result.branch_counters[std::make_pair(
+          translator.Translate(pid, branch.first),
+          translator.Translate(pid, branch.second))] += count;
+    }
+    for (const auto &[fallthrough, count] : counts.fallthroughs) {
+      const uint64_t begin = translator.Translate(pid, fallthrough.first);
+      const uint64_t end = translator.Translate(pid, fallthrough.second);
+      if (begin != PerfDataReader::kInvalidAddress && begin <= end)
+        result.fallthrough_counters[std::make_pair(begin, end)] += count;
+    }
+  }
+}
+
+// Number of samples a worker of AggregateLBRInParallel takes at a time.
+constexpr int64_t kLbrSamplesPerTask = 4096;
+}  // namespace
+
+AddressTranslationStats PerfDataReader::AggregateLBR(
+    const BinaryPerfInfo &binary_perf_info, LBRAggregation *result,
+    int num_threads, const LbrSubsampling *subsampling) const {
+  std::array<LBRAggregation, 2> *halves =
+      subsampling != nullptr ? subsampling->halves : nullptr;
+  AddressTranslationStats stats;
+  if (num_threads > 1) {
+    stats = AggregateLBRInParallel(binary_perf_info, result, num_threads,
+                                   subsampling);
+  } else {
+    BinaryAddressTranslator translator(*this, binary_perf_info);
+    AccumulateLbrSamples(translator, binary_perf_info.lbr_samples, 0,
+                         binary_perf_info.lbr_samples.size(), subsampling,
+                         *result, halves);
+    stats = translator.stats();
+  }
+
+  // The trace counts are exact, so each half gets all of them.
+  if (!binary_perf_info.trace_counts.empty()) {
+    BinaryAddressTranslator translator(*this, binary_perf_info);
+    AccumulateTraceCounts(translator, binary_perf_info, *result);
+    if (halves != nullptr) {
+      for (LBRAggregation &half : *halves)
+        AccumulateTraceCounts(translator, binary_perf_info, half);
+    }
+    stats += translator.stats();
+  }
+  return stats;
+}
+
+// Workers take fixed-size slices of the collected samples and accumulate them
+// into their own counters. Address translation and counting dominate the
+// aggregation time. The per-worker counters are summed into "result" at the
+// end, which makes the result independent of how slices were distributed.
+AddressTranslationStats PerfDataReader::AggregateLBRInParallel(
+    const BinaryPerfInfo &binary_perf_info, LBRAggregation *result,
+    int num_threads, const LbrSubsampling *subsampling) const {
+  const LbrSamples &lbr_samples = binary_perf_info.lbr_samples;
+  const bool with_halves =
+      subsampling != nullptr && subsampling->halves != nullptr;
+  std::vector<LBRAggregation> worker_counters(num_threads);
+  std::vector<std::array<LBRAggregation, 2>> worker_halves(
+      with_halves ? num_threads : 0);
+  std::vector<AddressTranslationStats> worker_stats(num_threads);
+  std::atomic<int64_t> next_begin = 0;
+
+  std::vector<std::thread> workers;
+  workers.reserve(num_threads);
+  for (int i = 0; i != num_threads; ++i) {
+    workers.emplace_back([&, i]() {
+      BinaryAddressTranslator translator(*this, binary_perf_info);
+      for (int64_t begin = next_begin.fetch_add(kLbrSamplesPerTask);
+           begin < lbr_samples.size();
+           begin = next_begin.fetch_add(kLbrSamplesPerTask)) {
+        AccumulateLbrSamples(
+            translator, lbr_samples, begin,
+            std::min(begin + kLbrSamplesPerTask, lbr_samples.size()),
+            subsampling, worker_counters[i],
+            with_halves ? &worker_halves[i] : nullptr);
+      }
+      worker_stats[i] = translator.stats();
+    });
+  }
+  for (std::thread &worker : workers) worker.join();
+
+  AddressTranslationStats stats;
+  for (int i = 0; i != num_threads; ++i) {
+    result->MergeFrom(worker_counters[i]);
+    worker_counters[i] = LBRAggregation();
+    if (with_halves) {
+      for (int h = 0; h < 2; ++h)
+        (*subsampling->halves)[h].MergeFrom(worker_halves[i][h]);
+    }
+    stats += worker_stats[i];
   }
+  return stats;
 }
 
 bool PerfDataReader::GetBuildIdNames(const quipper::PerfReader &perf_reader,
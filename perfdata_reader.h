@@ -1,6 +1,8 @@
 #ifndef AUTOFDO_PERFDATA_READER_H_
 #define AUTOFDO_PERFDATA_READER_H_
 
+#include <algorithm>
+#include <array>
 #include <map>
 #include <memory>
 #include <optional>
@@ -11,6 +13,11 @@
 #include <vector>
 
 #include "llvm_propeller_perf_data_provider.h"
+#include "memory_usage.h"
+#include "sample_subsampling.h"
+#include "third_party/abseil/absl/container/flat_hash_map.h"
+#include "third_party/abseil/absl/functional/function_ref.h"
+#include "third_party/abseil/absl/types/span.h"
 #include "llvm/BinaryFormat/ELF.h"
 #include "llvm/Object/ELFObjectFile.h"
 #include "llvm/Object/ELFTypes.h"
@@ -71,22 +78,79 @@ struct BinaryInfo {
         is_pie(bi.is_pie),
         segments(std::move(bi.segments)),
         build_id(std::move(bi.build_id)) {}
+  BinaryInfo &operator=(BinaryInfo &&bi) = default;
+
+  // Returns a copy of everything but the file content and the object file.
+  // This is all that is needed to select mmaps from and translate addresses of
+  // a perf data file, so each perf data file can be processed with its own
+  // copy.
+  BinaryInfo CopyMetadata() const {
+    BinaryInfo bi;
+    bi.file_name = file_name;
+    bi.is_pie = is_pie;
+    bi.segments = segments;
+    bi.build_id = build_id;
+    return bi;
+  }
 };
 
-// MMaps indexed by pid.
+// MMaps indexed by pid, sorted by load address. The mmaps of a pid do not
+// overlap, and a forked process has a copy of the mmaps of its parent.
 using BinaryMMaps = std::map<uint64_t, std::set<MMapEntry>>;
 
+// Branch stacks of the LBR samples of one perf data file, in file order. The
+// branch stack of the i-th sample is "branches[offsets[i], offsets[i + 1])".
+struct LbrSamples {
+  int64_t size() const { return pids.size(); }
+
+  void Clear() {
+    pids.clear();
+    ips.clear();
+    offsets.assign(1, 0);
+    branches.clear();
+  }
+
+  std::vector<uint64_t> pids;
+  // The runtime address of the sampled instruction of each sample.
+  std::vector<uint64_t> ips;
+  std::vector<uint64_t> offsets = {0};
+  // <from_ip, to_ip> runtime address pairs.
+  std::vector<std::pair<uint64_t, uint64_t>> branches;
+};
+
+// Counts of the branches decoded from the processor traces of one process, by
+// <from_ip, to_ip> runtime address pairs, and of the fallthroughs, the
+// sequential code from the target of a branch to the source of the next
+// branch, by <to_ip, from_ip> pairs.
+struct TraceCounts {
+  void MergeFrom(const TraceCounts &other) {
+    for (const auto &[key, count] : other.branches) branches[key] += count;
+    for (const auto &[key, count] : other.fallthroughs)
+      fallthroughs[key] += count;
+  }
+
+  absl::flat_hash_map<std::pair<uint64_t, uint64_t>, uint64_t> branches;
+  absl::flat_hash_map<std::pair<uint64_t, uint64_t>, uint64_t> fallthroughs;
+};
+
 struct BinaryPerfInfo {
   BinaryMMaps binary_mmaps;
   BinaryInfo binary_info;
-  std::optional<PerfDataProvider::BufferHandle> perf_data;
+  // LBR samples collected while selecting the mmaps, so the perf data does not
+  // need to be read again for aggregation.
+  LbrSamples lbr_samples;
+  // Counts decoded from the Intel PT traces of the binary, by pid. Every
+  // decoded branch is counted once, unlike the branches of the LBR samples,
+  // which are counted once per sample that has them.
+  absl::flat_hash_map<uint64_t, TraceCounts> trace_counts;
 
   BinaryPerfInfo() = default;
   BinaryPerfInfo(const BinaryPerfInfo &) = delete;
   BinaryPerfInfo(BinaryPerfInfo &&bpi) = default;
 
   void ResetPerfInfo() {
-    perf_data.reset();
+    lbr_samples.Clear();
+    trace_counts.clear();
     binary_mmaps.clear();
   }
 };
@@ -94,12 +158,19 @@ struct BinaryPerfInfo {
 struct LBRAggregation {
   // <from_address, to_address> -> branch counter.
   // Note all addresses are binary addresses, not runtime addresses.
-  using BranchCountersTy = std::map<std::pair<uint64_t, uint64_t>, uint64_t>;
+  // The counters are unordered, use GetSortedBranchCounters() where a
+  // deterministic iteration order is required.
+  using BranchCountersTy =
+      absl::flat_hash_map<std::pair<uint64_t, uint64_t>, uint64_t>;
 
   // <fallthrough_from, fallthrough_to> -> fallthrough counter.
   // Note all addresses are symbol address, not virtual addresses.
   using FallthroughCountersTy =
-      std::map<std::pair<uint64_t, uint64_t>, uint64_t>;
+      absl::flat_hash_map<std::pair<uint64_t, uint64_t>, uint64_t>;
+
+  // Counters sorted by their <from, to> address pairs.
+  using SortedCountersTy =
+      std::vector<std::pair<std::pair<uint64_t, uint64_t>, uint64_t>>;
 
   LBRAggregation() = default;
   ~LBRAggregation() = default;
@@ -117,11 +188,88 @@ struct LBRAggregation {
   LBRAggregation(const LBRAggregation &) = delete;
   LBRAggregation &operator=(const LBRAggregation &) = delete;
 
+  // Adds all the branch and fallthrough counters of "other" to this.
+  void MergeFrom(const LBRAggregation &other) {
+    for (const auto &[key, count] : other.branch_counters)
+      branch_counters[key] += count;
+    for (const auto &[key, count] : other.fallthrough_counters)
+      fallthrough_counters[key] += count;
+  }
+
+  // Returns the overlap between the branch counters of this and "other",
+  // sum(min(count_1 / total_1, count_2 / total_2)) over all branches, like
+  // SymbolMap::Overlap. It is 1 for proportional counters and 0 for disjoint
+  // ones.
+  double BranchOverlap(const LBRAggregation &other) const {
+    uint64_t total = 0, other_total = 0;
+    for (const auto &[key, count] : branch_counters) total += count;
+    for (const auto &[key, count] : other.branch_counters)
+      other_total += count;
+    if (total == 0 || other_total == 0) return 0;
+    double overlap = 0;
+    for (const auto &[key, count] : branch_counters) {
+      auto it = other.branch_counters.find(key);
+      if (it == other.branch_counters.end()) continue;
+      overlap += std::min(static_cast<double>(count) / total,
+                          static_cast<double>(it->second) / other_total);
+    }
+    return overlap;
+  }
+
+  // Returns an estimate of the bytes held by the counters.
+  uint64_t MemoryUsage() const {
+    return HashTableBytes(branch_counters) +
+           HashTableBytes(fallthrough_counters);
+  }
+
+  // Returns the branch counters ordered by <from_address, to_address>.
+  SortedCountersTy GetSortedBranchCounters() const {
+    return GetSortedCounters(branch_counters);
+  }
+
+  // Returns the fallthrough counters ordered by <fallthrough_from,
+  // fallthrough_to>.
+  SortedCountersTy GetSortedFallthroughCounters() const {
+    return GetSortedCounters(fallthrough_counters);
+  }
+
   // See BranchCountersTy.
   BranchCountersTy branch_counters;
 
   // See FallthroughCountersTy.
   FallthroughCountersTy fallthrough_counters;
+
+ private:
+  template <typename CountersTy>
+  static SortedCountersTy GetSortedCounters(const CountersTy &counters) {
+    SortedCountersTy sorted(counters.begin(), counters.end());
+    std::sort(sorted.begin(), sorted.end());
+    return sorted;
+  }
+};
+
+// Hit and miss counts of the last-hit cache of BinaryAddressTranslator.
+struct AddressTranslationStats {
+  uint64_t cache_hits = 0;
+  uint64_t cache_misses = 0;
+
+  AddressTranslationStats &operator+=(const AddressTranslationStats &s) {
+    cache_hits += s.cache_hits;
+    cache_misses += s.cache_misses;
+    return *this;
+  }
+};
+
+// Makes PerfDataReader::AggregateLBR aggregate only the LBR samples of a
+// BinaryPerfInfo kept by "selector", scaled by selector.stride().
+struct LbrSubsampling {
+  explicit LbrSubsampling(const StratifiedSampleSelector &selector)
+      : selector(selector) {}
+
+  StratifiedSampleSelector selector;
+  // If set, the kept samples of each half are also aggregated into the
+  // corresponding element, scaled by twice the stride.
+  std::array<LBRAggregation, 2> *halves = nullptr;
 };
 
 class PerfDataReader {
@@ -150,14 +298,40 @@ class PerfDataReader {
   // When match_mmap_name is "", SelectBinaryPerfInfo will automatically use the
   // build-id name, if build id is present, otherwise, it falls back to use
   // binary_file_name.
+  //
+  // The branch stacks of all LBR samples are collected into
+  // "binary_perf_info->lbr_samples" in the same pass. Which mmaps (and thus
+  // which samples) are relevant is only known once the whole file, including
+  // its build-id section, has been read. The Intel PT traces of the binary,
+  // if any, are decoded into "binary_perf_info->trace_counts".
   bool SelectPerfInfo(PerfDataProvider::BufferHandle perf_data,
                       const std::string &match_mmap_name,
                       BinaryPerfInfo *binary_perf_info) const;
 
-  // Parse LBR events that are matched by mmaps in perf_parse and store the data
-  // in the aggregated counters.
-  void AggregateLBR(const BinaryPerfInfo &binary_perf_info,
-                    LBRAggregation *result) const;
+  // Like SelectPerfInfo, for several binaries profiled in the same perf data,
+  // which is read only once. The samples of every binary are selected by its
+  // own mmaps, matched with the corresponding element of "match_mmap_names",
+  // and appended to its "lbr_samples". A binary without matching mmaps is left
+  // with empty "binary_mmaps". Returns false if the perf data cannot be read.
+  bool SelectPerfInfos(
+      PerfDataProvider::BufferHandle perf_data,
+      absl::Span<const std::string> match_mmap_names,
+      absl::Span<BinaryPerfInfo *const> binary_perf_infos) const;
+
+  // Aggregates the LBR samples collected by SelectPerfInfo whose pids are
+  // matched by the selected mmaps and stores the data in the aggregated
+  // counters.
+  // When "num_threads" > 1, samples are handed out in chunks to "num_threads"
+  // worker threads, each accumulating into its own counters, which
+  // are merged into "result" once all samples are processed. The result is
+  // identical to the single-threaded aggregation.
+  // If "subsampling" is given, only the samples it keeps are aggregated.
+  // The counts decoded from Intel PT traces are added on the calling thread,
+  // and not subsampled.
+  // Returns the statistics of the runtime address translation.
+  AddressTranslationStats AggregateLBR(
+      const BinaryPerfInfo &binary_perf_info, LBRAggregation *result,
+      int num_threads = 1, const LbrSubsampling *subsampling = nullptr) const;
 
   // "binary address" vs. "runtime address":
   //   binary address:  the address we get from "nm -n" or "readelf -s".
@@ -175,13 +349,78 @@ class PerfDataReader {
   static const uint64_t kInvalidAddress = static_cast<uint64_t>(-1);
 
  private:
+  // Reads "perf_data", collecting the branch stacks of its samples into
+  // "lbr_samples", and then calls "select_mmaps" with the reader and parser of
+  // the perf data. Returns false if the perf data cannot be read or
+  // "select_mmaps" returns false.
+  bool ReadPerfData(PerfDataProvider::BufferHandle perf_data,
+                    LbrSamples &lbr_samples,
+                    absl::FunctionRef<bool(const quipper::PerfReader &,
+                                           const quipper::PerfParser &)>
+                        select_mmaps) const;
+
+  // Decodes the Intel PT traces of the AUXTRACE events of "perf_reader" in
+  // the processes of the selected mmaps of "info" into "info->trace_counts".
+  // The traces are split at their PSB packets, and the segments are decoded
+  // on --intel_pt_decode_threads threads.
+  void DecodeIntelPtTraces(const quipper::PerfReader &perf_reader,
+                           BinaryPerfInfo *info) const;
+
+  // Multi-threaded implementation of AggregateLBR.
+  AddressTranslationStats AggregateLBRInParallel(
+      const BinaryPerfInfo &binary_perf_info, LBRAggregation *result,
+      int num_threads, const LbrSubsampling *subsampling) const;
+
   // Select mmap events from perfdata file by comparing the mmap event's
-  // filename against "match_mmap_name".
+  // filename against "match_mmap_name". The mmap, fork and exec events are
+  // applied in one pass in time order.
   bool SelectMMaps(BinaryPerfInfo *info, const quipper::PerfReader &perf_reader,
                    const quipper::PerfParser &perf_parser,
                    const std::string &match_mmap_name) const;
 };
 
+// Translates runtime addresses to binary addresses for one BinaryPerfInfo in
+// the same way as PerfDataReader::RuntimeAddressToBinaryAddress. The mmaps of
+// every pid are flattened once into address intervals sorted by their runtime
+// start, each interval covering the part of an mmap that falls into a single
+// loadable segment. The interval of the last translation is remembered; since
+// consecutive LBR entries almost always hit the same process and mapping, most
+// translations cost a few comparisons.
+//
+// Not thread-safe, each thread must use its own instance.
+class BinaryAddressTranslator {
+ public:
+  BinaryAddressTranslator(const PerfDataReader &reader,
+                          const BinaryPerfInfo &binary_perf_info);
+
+  BinaryAddressTranslator(const BinaryAddressTranslator &) = delete;
+  BinaryAddressTranslator &operator=(const BinaryAddressTranslator &) = delete;
+
+  // Returns the binary address of runtime address "addr" in process "pid", or
+  // PerfDataReader::kInvalidAddress if it cannot be translated.
+  uint64_t Translate(uint64_t pid, uint64_t addr);
+
+  const AddressTranslationStats &stats() const { return stats_; }
+
+ private:
+  // Runtime addresses in [start, end) are translated by adding "delta"
+  // (modulo 2^64).
+  struct Interval {
+    uint64_t start;
+    uint64_t end;
+    uint64_t delta;
+  };
+
+  const PerfDataReader &reader_;
+  const BinaryPerfInfo &binary_perf_info_;
+  // Intervals of each pid, sorted by start address.
+  absl::flat_hash_map<uint64_t, std::vector<Interval>> intervals_by_pid_;
+  // The last pid and its interval that translated an address.
+  uint64_t last_pid_ = PerfDataReader::kInvalidAddress;
+  Interval last_interval_ = {0, 0, 0};
+  AddressTranslationStats stats_;
+};
+
 // Utility class that wraps utility functions that need templated
 // ELFFile<ELFT> support.
 class ELFFileUtilBase {
@@ -1,5 +1,6 @@
 #include "perfdata_reader.h"
 
+#include <array>
 #include <string>
 
 #include "gmock/gmock.h"
@@ -113,6 +114,115 @@ TEST(PerfdataReaderTest, TestSharedLibrary) {
   EXPECT_EQ(addr, foo_sym_addr + 0x60);
 }
 
+TEST(PerfdataReaderTest, AddressTranslatorMatchesReader) {
+  const std::string binary =
+      absl::StrCat(FLAGS_test_srcdir,
+                   "/testdata/"
+                   "libro_sample.so");
+  const std::string perfdata =
+      absl::StrCat(FLAGS_test_srcdir,
+                   "/testdata/"
+                   "ro_sample.perf");
+  auto reader = devtools_crosstool_autofdo::PerfDataReader();
+  devtools_crosstool_autofdo::BinaryPerfInfo binary_perf_info;
+  reader.SelectBinaryInfo(binary, &binary_perf_info.binary_info);
+  EXPECT_TRUE(reader.SelectPerfInfo(perfdata, "", &binary_perf_info));
+
+  devtools_crosstool_autofdo::BinaryAddressTranslator translator(
+      reader, binary_perf_info);
+  const uint64_t pid = 902132;
+  const uint64_t runtime_addrs[] = {0x7fedfd0306a0, 0x7fedfd0306a4,
+                                    0x7fedfd030580, 0x7fedfd030000, 0x1000};
+  for (uint64_t addr : runtime_addrs) {
+    EXPECT_EQ(translator.Translate(pid, addr),
+              reader.RuntimeAddressToBinaryAddress(pid, addr,
+                                                   binary_perf_info))
+        << std::hex << addr;
+  }
+  // Unknown pid.
+  EXPECT_EQ(translator.Translate(pid + 1, 0x7fedfd0306a0),
+            devtools_crosstool_autofdo::PerfDataReader::kInvalidAddress);
+  // The second address falls into the interval of the first one.
+  EXPECT_GE(translator.stats().cache_hits, 1);
+  EXPECT_EQ(
+      translator.stats().cache_hits + translator.stats().cache_misses, 6);
+}
+
+TEST(PerfdataReaderTest, LbrSamplesOfSelectedMMaps) {
+  const std::string binary =
+      absl::StrCat(FLAGS_test_srcdir,
+                   "/testdata/"
+                   "libro_sample.so");
+  const std::string perfdata =
+      absl::StrCat(FLAGS_test_srcdir,
+                   "/testdata/"
+                   "ro_sample.perf");
+  auto reader = devtools_crosstool_autofdo::PerfDataReader();
+  devtools_crosstool_autofdo::BinaryPerfInfo binary_perf_info;
+  reader.SelectBinaryInfo(binary, &binary_perf_info.binary_info);
+  EXPECT_TRUE(reader.SelectPerfInfo(perfdata, "", &binary_perf_info));
+
+  // Only samples of pids with a selected mmap are kept.
+  const devtools_crosstool_autofdo::LbrSamples &lbr_samples =
+      binary_perf_info.lbr_samples;
+  ASSERT_EQ(lbr_samples.offsets.size(), lbr_samples.size() + 1);
+  EXPECT_EQ(lbr_samples.offsets.back(), lbr_samples.branches.size());
+  for (uint64_t pid : lbr_samples.pids)
+    EXPECT_EQ(binary_perf_info.binary_mmaps.count(pid), 1) << pid;
+
+  binary_perf_info.ResetPerfInfo();
+  EXPECT_EQ(lbr_samples.size(), 0);
+  EXPECT_TRUE(lbr_samples.branches.empty());
+}
+
+TEST(PerfdataReaderTest, AggregateSubsampledLbr) {
+  const std::string binary =
+      absl::StrCat(FLAGS_test_srcdir,
+                   "/testdata/"
+                   "libro_sample.so");
+  const std::string perfdata =
+      absl::StrCat(FLAGS_test_srcdir,
+                   "/testdata/"
+                   "ro_sample.perf");
+  auto reader = devtools_crosstool_autofdo::PerfDataReader();
+  devtools_crosstool_autofdo::BinaryPerfInfo binary_perf_info;
+  reader.SelectBinaryInfo(binary, &binary_perf_info.binary_info);
+  EXPECT_TRUE(reader.SelectPerfInfo(perfdata, "", &binary_perf_info));
+
+  // A fraction of 1 keeps every sample.
+  devtools_crosstool_autofdo::LBRAggregation full, unsampled;
+  reader.AggregateLBR(binary_perf_info, &full);
+  devtools_crosstool_autofdo::LbrSubsampling keep_all(
+      devtools_crosstool_autofdo::StratifiedSampleSelector(1, 0));
+  reader.AggregateLBR(binary_perf_info, &unsampled, 1, &keep_all);
+  EXPECT_EQ(unsampled.GetSortedBranchCounters(),
+            full.GetSortedBranchCounters());
+
+  devtools_crosstool_autofdo::LbrSubsampling subsampling(
+      devtools_crosstool_autofdo::StratifiedSampleSelector(0.5, 7));
+  std::array<devtools_crosstool_autofdo::LBRAggregation, 2> halves;
+  subsampling.halves = &halves;
+  devtools_crosstool_autofdo::LBRAggregation sampled;
+  reader.AggregateLBR(binary_perf_info, &sampled, 1, &subsampling);
+  EXPECT_GT(sampled.BranchOverlap(full), 0.5);
+
+  // The halves split the kept samples, each with twice their weight.
+  devtools_crosstool_autofdo::LBRAggregation merged_halves;
+  merged_halves.MergeFrom(halves[0]);
+  merged_halves.MergeFrom(halves[1]);
+  for (const auto &[branch, count] : sampled.branch_counters)
+    EXPECT_EQ(merged_halves.branch_counters[branch], 2 * count);
+
+  // The same samples are kept by the parallel aggregation.
+  devtools_crosstool_autofdo::LBRAggregation parallel_sampled;
+  devtools_crosstool_autofdo::LbrSubsampling parallel_subsampling(
+      subsampling.selector);
+  reader.AggregateLBR(binary_perf_info, &parallel_sampled, 4,
+                      &parallel_subsampling);
+  EXPECT_EQ(parallel_sampled.GetSortedBranchCounters(),
+            sampled.GetSortedBranchCounters());
+}
+
 TEST(PerfdataReaderTest, FirstLoadableSegmentNoneExecutable) {
   const std::string binary =
       absl::StrCat(absl::GetFlag(FLAGS_test_srcdir),
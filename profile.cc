@@ -4,74 +4,231 @@
 // Class to represent source level profile.
 #include "profile.h"
 
+#include <algorithm>
+#include <atomic>
 #include <cstdint>
 #include <map>
+#include <memory>
 #include <string>
+#include <thread>  // NOLINT(build/c++11)
+#include <type_traits>
 #include <utility>
 #include <vector>
 
 #include "base/commandlineflags.h"
 #include "base/logging.h"
+#include "addr2line.h"
 #include "instruction_map.h"
+#include "parallel_for.h"
 #include "sample_reader.h"
 #include "symbol_map.h"
 #include "third_party/abseil/absl/flags/flag.h"
 #include "third_party/abseil/absl/strings/match.h"
 #include "third_party/abseil/absl/strings/strip.h"
+#include "third_party/abseil/absl/types/span.h"
 
 ABSL_FLAG(bool, use_lbr, true,
             "Whether to use lbr profile.");
 ABSL_FLAG(bool, llc_misses, false, "The profile represents llc misses.");
+ABSL_FLAG(uint32_t, compute_profile_threads, 1,
+          "Number of threads used to build the per-function profiles. Values "
+          "above 1 take effect only if the symbolizer supports concurrent "
+          "queries.");
+ABSL_FLAG(bool, sparse_instruction_map, false,
+          "Symbolize only the sampled instructions of each function. This "
+          "is faster for large, mostly cold functions, but the cold lines no "
+          "longer show up in the profile with a zero count.");
+ABSL_FLAG(bool, decode_instruction_boundaries, false,
+          "Decode the instructions of the sampled functions, so that only "
+          "instruction start addresses, instead of all bytes, are counted as "
+          "instructions and get counts from LBR ranges.");
 
 namespace devtools_crosstool_autofdo {
-Profile::ProfileMaps *Profile::GetProfileMaps(uint64_t addr) {
-  const std::string *name;
-  uint64_t start_addr, end_addr;
-  if (symbol_map_->GetSymbolInfoByAddr(addr, &name,
-                                       &start_addr, &end_addr)) {
-    std::pair<SymbolProfileMaps::iterator, bool> ret =
-        symbol_profile_maps_.insert(
-            SymbolProfileMaps::value_type(*name, nullptr));
-    if (ret.second) {
-      ret.first->second = new ProfileMaps(start_addr, end_addr);
-    }
-    return ret.first->second;
+std::vector<std::pair<uint64_t, uint64_t>> Profile::SampledRanges(
+    const ProfileMaps &maps, bool use_lbr) {
+  std::vector<std::pair<uint64_t, uint64_t>> ranges;
+  auto add = [&](uint64_t begin, uint64_t end) {
+    if (begin < maps.start_addr || begin >= maps.end_addr || end <= begin)
+      return;
+    ranges.emplace_back(begin, std::min(end, maps.end_addr));
+  };
+  if (use_lbr) {
+    for (const auto &[range, count] : maps.range_count_map) {
+      if (range.second >= range.first) add(range.first, range.second + 1);
+    }
   } else {
-    return nullptr;
+    for (const auto &[address, count] : maps.address_count_map)
+      add(address, address + 1);
   }
-}
+  for (const auto &[branch, count] : maps.branch_count_map)
+    add(branch.first, branch.first + 1);
 
-void Profile::AggregatePerFunctionProfile() {
-  uint64_t start = symbol_map_->base_addr();
-  const AddressCountMap *count_map = &sample_reader_->address_count_map();
-  for (const auto &[addr, count] : *count_map) {
-    ProfileMaps *maps = GetProfileMaps(addr + start);
-    if (maps != nullptr) {
-      maps->address_count_map[addr + start] += count;
+  std::sort(ranges.begin(), ranges.end());
+  size_t merged = 0;
+  for (const auto &range : ranges) {
+    if (merged != 0 && range.first <= ranges[merged - 1].second) {
+      ranges[merged - 1].second =
+          std::max(ranges[merged - 1].second, range.second);
+    } else {
+      ranges[merged++] = range;
     }
   }
-  const RangeCountMap *range_map = &sample_reader_->range_count_map();
-  for (const auto &[range, count] : *range_map) {
-    ProfileMaps *maps = GetProfileMaps(range.first + start);
-    if (maps != nullptr) {
-      maps->range_count_map[std::make_pair(range.first + start,
-                                           range.second + start)] += count;
+  ranges.resize(merged);
+  return ranges;
+}
+
+namespace {
+// Calls "add_span(i, begin, end)" for every symbol i of "symbol_map" with
+// samples in "map", whose keys are (ranges or branches starting at) addresses
+// relative to the base address of the binary. [begin, end) are the samples
+// that GetSymbolInfoByAddr attributes to symbol i. Both the samples and the
+// symbols are sorted by address, so they are merged in a single sweep which
+// skips the samples outside of any symbol.
+template <typename Map, typename AddSpanFn>
+void ForEachSymbolSpan(const Map &map, const SymbolMap &symbol_map,
+                       AddSpanFn add_span) {
+  using Key = typename Map::key_type;
+  auto lower_bound = [&map](uint64_t addr) {
+    if constexpr (std::is_same_v<Key, uint64_t>) {
+      return map.lower_bound(addr);
+    } else {
+      return map.lower_bound(Key(addr, 0));
     }
-  }
-  const BranchCountMap *branch_map = &sample_reader_->branch_count_map();
-  for (const auto &[branch, count] : *branch_map) {
-    ProfileMaps *maps = GetProfileMaps(branch.first + start);
-    if (maps != nullptr) {
-      maps->branch_count_map[std::make_pair(branch.first + start,
-                                            branch.second + start)] += count;
+  };
+  auto address_of = [](const Key &key) -> uint64_t {
+    if constexpr (std::is_same_v<Key, uint64_t>) {
+      return key;
+    } else {
+      return key.first;
     }
+  };
+  const uint64_t base = symbol_map.base_addr();
+  const absl::Span<const uint64_t> starts = symbol_map.symbol_start_addrs();
+  const absl::Span<const uint64_t> ends = symbol_map.symbol_end_addrs();
+  if (starts.empty()) return;
+  size_t i = 0;
+  for (auto iter = map.begin(); iter != map.end();) {
+    const uint64_t addr = address_of(iter->first) + base;
+    // Find the last symbol that starts at or before addr.
+    if (i + 1 < starts.size() && starts[i + 1] <= addr) {
+      i = std::upper_bound(starts.begin() + i + 1, starts.end(), addr) -
+          starts.begin() - 1;
+    }
+    if (addr < starts[i]) {
+      iter = lower_bound(starts[i] - base);
+      continue;
+    }
+    if (addr >= ends[i]) {
+      if (i + 1 == starts.size()) break;
+      iter = lower_bound(starts[i + 1] - base);
+      continue;
+    }
+    const uint64_t span_end =
+        i + 1 < starts.size() ? std::min(ends[i], starts[i + 1]) : ends[i];
+    const auto end = lower_bound(span_end - base);
+    add_span(i, iter, end);
+    iter = end;
   }
+}
+}  // namespace
+
+void Profile::AggregatePerFunctionProfile() {
+  const absl::Span<const uint64_t> starts = symbol_map_->symbol_start_addrs();
+  const absl::Span<const uint64_t> ends = symbol_map_->symbol_end_addrs();
+  const absl::Span<const std::string *const> names =
+      symbol_map_->symbol_names();
+  // The profile maps of every symbol, by its index in the symbol map.
+  std::vector<ProfileMaps *> symbol_maps(starts.size(), nullptr);
+  auto get_profile_maps = [&](size_t i) {
+    if (symbol_maps[i] == nullptr) {
+      auto [iter, inserted] =
+          symbol_profile_maps_.try_emplace(*names[i], nullptr);
+      if (inserted)
+        iter->second = std::make_unique<ProfileMaps>(starts[i], ends[i]);
+      symbol_maps[i] = iter->second.get();
+    }
+    return symbol_maps[i];
+  };
+  // A symbol which shares its name with an earlier one does not get samples:
+  // they would be outside of the instruction map of the earlier symbol.
+  auto add_span = [&](auto span_field) {
+    return [&, span_field](size_t i, auto begin, auto end) {
+      ProfileMaps *maps = get_profile_maps(i);
+      if (maps->start_addr == starts[i])
+        maps->*span_field = {begin, end, symbol_map_->base_addr()};
+    };
+  };
+  ForEachSymbolSpan(sample_reader_->address_count_map(), *symbol_map_,
+                    add_span(&ProfileMaps::address_count_map));
+  ForEachSymbolSpan(sample_reader_->range_count_map(), *symbol_map_,
+                    add_span(&ProfileMaps::range_count_map));
+  ForEachSymbolSpan(sample_reader_->branch_count_map(), *symbol_map_,
+                    add_span(&ProfileMaps::branch_count_map));
 
   // Add an entry for each symbol so that later we can decide if the hot and
   // cold parts together need to be emitted.
-  for (const auto &[name, addr] : symbol_map_->GetNameAddrMap()) {
-    CHECK(GetProfileMaps(addr));
+  for (size_t i = 0; i < starts.size(); ++i) get_profile_maps(i);
+  aggregated_ = true;
+}
+
+absl::flat_hash_map<absl::string_view, uint64_t> Profile::GetFunctionCounts()
+    const {
+  absl::flat_hash_map<absl::string_view, uint64_t> counts;
+  for (const auto &[name, profile] : symbol_profile_maps_) {
+    counts[absl::StripSuffix(name, ".cold")] += profile->GetAggregatedCount();
+  }
+  return counts;
+}
+
+bool Profile::IsSelected(absl::string_view name) const {
+  return !selected_functions_.has_value() ||
+         selected_functions_->contains(absl::StripSuffix(name, ".cold"));
+}
+
+SampledFunctions Profile::SelectHotFunctions(double coverage) {
+  if (!aggregated_) AggregatePerFunctionProfile();
+  const absl::flat_hash_map<absl::string_view, uint64_t> counts =
+      GetFunctionCounts();
+  std::vector<std::pair<uint64_t, absl::string_view>> ranked;
+  uint64_t total = 0;
+  for (const auto &[name, count] : counts) {
+    total += count;
+    if (count > 0) ranked.emplace_back(count, name);
   }
+  // Ties are broken by name, so the selection does not depend on the order
+  // of the hash map.
+  std::sort(ranked.begin(), ranked.end(), [](const auto &a, const auto &b) {
+    return a.first != b.first ? a.first > b.first : a.second < b.second;
+  });
+  selected_functions_.emplace();
+  uint64_t covered = 0;
+  for (const auto &[count, name] : ranked) {
+    if (covered >= coverage * total) break;
+    selected_functions_->emplace(name);
+    covered += count;
+  }
+  LOG(INFO) << "Selected " << selected_functions_->size() << " of "
+            << ranked.size() << " sampled functions, which cover " << covered
+            << " of the aggregated count of " << total << ".";
+
+  std::vector<SampledFunctions::Function> functions;
+  for (const auto &[name, maps] : symbol_profile_maps_) {
+    if (IsSelected(name))
+      functions.emplace_back(maps->start_addr,
+                             maps->end_addr - maps->start_addr);
+  }
+  // Aliases share their start address, the largest size is kept.
+  std::sort(functions.begin(), functions.end(),
+            [](const auto &a, const auto &b) {
+              return a.first != b.first ? a.first < b.first
+                                        : a.second > b.second;
+            });
+  functions.erase(std::unique(functions.begin(), functions.end(),
+                              [](const auto &a, const auto &b) {
+                                return a.first == b.first;
+                              }),
+                  functions.end());
+  return SampledFunctions(std::move(functions));
 }
 
 uint64_t Profile::ProfileMaps::GetAggregatedCount() const {
@@ -90,70 +247,190 @@ uint64_t Profile::ProfileMaps::GetAggregatedCount() const {
 }
 
 void Profile::ProcessPerFunctionProfile(const std::string &func_name,
-                                        const ProfileMaps &maps) {
-  InstructionMap inst_map(addr2line_, symbol_map_);
-  inst_map.BuildPerFunctionInstructionMap(func_name, maps.start_addr,
-                                          maps.end_addr);
+                                        const ProfileMaps &maps,
+                                        SymbolMap *symbol_map,
+                                        AddressCountMap *addr_count_map) {
+  symbol_map->AddSymbol(func_name);
+  InstructionMap inst_map(addr2line_, symbol_map);
+  const std::vector<uint64_t> *instruction_starts = nullptr;
+#if defined(HAVE_LLVM)
+  if (instruction_decoder_ != nullptr) {
+    instruction_starts = &instruction_decoder_->GetInstructionStarts(
+        maps.start_addr, maps.end_addr);
+    if (instruction_starts->empty()) instruction_starts = nullptr;
+  }
+#endif
+  inst_map.set_instruction_starts(instruction_starts);
+  if (absl::GetFlag(FLAGS_sparse_instruction_map)) {
+    inst_map.BuildPerFunctionInstructionMap(
+        func_name, SampledRanges(maps, absl::GetFlag(FLAGS_use_lbr)));
+  } else {
+    inst_map.BuildPerFunctionInstructionMap(func_name, maps.start_addr,
+                                            maps.end_addr);
+  }
+
+  // Adds the counts of ADDRESS_COUNTS, which maps addresses of the function
+  // to their counts, and of the branches of the function to the profile.
+  auto add_counts = [&](const auto &address_counts) {
+    // The discriminator encoding is selected once for the loops below.
+    WithDiscriminatorEncoding(
+        absl::GetFlag(FLAGS_use_discriminator_encoding), [&](auto encoding) {
+          using Encoding = decltype(encoding);
+          for (const auto &[address, count] : address_counts) {
+            const InstructionMap::InstInfo *info = inst_map.lookup(address);
+            if (info == nullptr) {
+              continue;
+            }
+            const SourceStack &source_stack = inst_map.source_stack(*info);
+            if (!source_stack.empty()) {
+              symbol_map->AddSourceCount<Encoding>(
+                  func_name, source_stack, count, 0,
+                  Encoding::DuplicationFactor(source_stack[0]),
+                  SymbolMap::PERFDATA);
+            }
+          }
+
+          for (const auto &[branch, count] : maps.branch_count_map) {
+            const InstructionMap::InstInfo *info =
+                inst_map.lookup(branch.first);
+            if (info == nullptr) {
+              continue;
+            }
+            const std::string *callee =
+                symbol_map_->GetSymbolNameByStartAddr(branch.second);
+            if (!callee) {
+              continue;
+            }
+            if (symbol_map_->map().count(*callee)) {
+              symbol_map->AddSymbol(*callee);
+              symbol_map->AddSymbolEntryCount(*callee, count);
+              symbol_map->AddIndirectCallTarget<Encoding>(
+                  func_name, inst_map.source_stack(*info), *callee, count,
+                  SymbolMap::PERFDATA);
+            }
+          }
+        });
+
+    if (addr_count_map != nullptr) {
+      for (const auto &[addr, count] : address_counts) {
+        (*addr_count_map)[addr] = count;
+      }
+    }
+  };
 
-  AddressCountMap map;
-  const AddressCountMap *map_ptr;
   if (absl::GetFlag(FLAGS_use_lbr)) {
     if (maps.range_count_map.empty()) {
       LOG(WARNING) << "use_lbr was enabled but range_count_map was empty!";
       return;
     }
+    AddressCountMap map;
+    // Fold the ranges into difference arrays over the function's mapped
+    // instructions, so that overlapping ranges cost O(1) each. "covers"
+    // counts the ranges over each address: an address covered only by ranges
+    // of count 0 still gets an entry. A range never extends past the run of
+    // mapped addresses it starts in. With instruction starts, only those get
+    // entries.
+    const uint64_t size = inst_map.size();
+    std::vector<uint64_t> count_deltas(size + 1);
+    std::vector<int64_t> cover_deltas(size + 1);
     for (const auto &[range, count] : maps.range_count_map) {
-      for (uint64_t addr = range.first;
-           inst_map.lookup(addr) && addr <= range.second; ++addr) {
-        map[addr] += count;
+      uint64_t begin, run_end;
+      if (range.second < range.first ||
+          !inst_map.FindIndex(range.first, &begin, &run_end))
+        continue;
+      const uint64_t end =
+          begin + (std::min(range.second + 1, run_end) - range.first);
+      count_deltas[begin] += count;
+      count_deltas[end] -= count;
+      ++cover_deltas[begin];
+      --cover_deltas[end];
+    }
+    uint64_t running_count = 0;
+    int64_t running_covers = 0;
+    std::vector<uint64_t>::const_iterator next_start;
+    if (instruction_starts != nullptr)
+      next_start = instruction_starts->begin();
+    for (const InstructionMap::Run &run : inst_map.runs()) {
+      for (uint64_t addr = run.start_addr; addr < run.end_addr; ++addr) {
+        const uint64_t i = run.first_index + (addr - run.start_addr);
+        running_count += count_deltas[i];
+        running_covers += cover_deltas[i];
+        if (running_covers <= 0) continue;
+        if (instruction_starts != nullptr) {
+          while (next_start != instruction_starts->end() && *next_start < addr)
+            ++next_start;
+          if (next_start == instruction_starts->end() || *next_start != addr)
+            continue;
+        }
+        map.emplace_hint(map.end(), addr, running_count);
       }
     }
-    map_ptr = &map;
+    add_counts(map);
   } else {
-    map_ptr = &maps.address_count_map;
+    add_counts(maps.address_count_map);
   }
+}
 
-  for (const auto &[address, count] : *map_ptr) {
-    const InstructionMap::InstInfo *info = inst_map.lookup(address);
-    if (info == nullptr) {
-      continue;
-    }
-    if (!info->source_stack.empty()) {
-      symbol_map_->AddSourceCount(func_name, info->source_stack, count, 0,
-                                  info->source_stack[0].DuplicationFactor(),
-                                  SymbolMap::PERFDATA);
-    }
+void Profile::ProcessPerFunctionProfilesInParallel(
+    const std::vector<const std::string *> &func_names, int num_threads) {
+  // Every function is processed by exactly one worker. The only updates a
+  // function makes to other symbols are entry counts, which are additive, so
+  // merging the partial maps gives the same profile as the serial run.
+  std::vector<std::unique_ptr<SymbolMap>> partial_maps(num_threads);
+  std::vector<AddressCountMap> partial_addr_count_maps(
+      addr_count_map_ != nullptr ? num_threads : 0);
+  std::atomic<size_t> next_func{0};
+  std::vector<std::thread> workers;
+  workers.reserve(num_threads);
+  for (int i = 0; i < num_threads; ++i) {
+    partial_maps[i] = std::make_unique<SymbolMap>();
+    workers.emplace_back([&, i]() {
+      for (size_t f = next_func++; f < func_names.size(); f = next_func++) {
+        const ProfileMaps &maps = *symbol_profile_maps_.at(*func_names[f]);
+        ProcessPerFunctionProfile(
+            *func_names[f], maps, partial_maps[i].get(),
+            addr_count_map_ != nullptr ? &partial_addr_count_maps[i]
+                                       : nullptr);
+        ReleaseInstructionStarts(maps.start_addr);
+      }
+    });
   }
+  for (std::thread &worker : workers) worker.join();
 
-  for (const auto &[branch, count] : maps.branch_count_map) {
-    const InstructionMap::InstInfo *info = inst_map.lookup(branch.first);
-    if (info == nullptr) {
-      continue;
-    }
-    const std::string *callee =
-        symbol_map_->GetSymbolNameByStartAddr(branch.second);
-    if (!callee) {
-      continue;
-    }
-    if (symbol_map_->map().count(*callee)) {
-      symbol_map_->AddSymbolEntryCount(*callee, count);
-      symbol_map_->AddIndirectCallTarget(func_name, info->source_stack, *callee,
-                                         count, SymbolMap::PERFDATA);
+  for (int i = 0; i < num_threads; ++i) {
+    symbol_map_->MergeProfilesFrom(partial_maps[i].get());
+    partial_maps[i].reset();
+    if (addr_count_map_ != nullptr) {
+      for (const auto &[addr, count] : partial_addr_count_maps[i]) {
+        (*addr_count_map_)[addr] = count;
+      }
     }
   }
+}
 
-  for (const auto &[addr, count] : *map_ptr) {
-    global_addr_count_map_[addr] = count;
-  }
+void Profile::ReleaseInstructionStarts(uint64_t start_addr) {
+#if defined(HAVE_LLVM)
+  if (instruction_decoder_ != nullptr)
+    instruction_decoder_->Release(start_addr);
+#endif
 }
 
 void Profile::ComputeProfile() {
   symbol_map_->CalculateThresholdFromTotalCount(
       sample_reader_->GetTotalCount());
-  AggregatePerFunctionProfile();
+  if (!aggregated_) AggregatePerFunctionProfile();
+#if defined(HAVE_LLVM)
+  if (absl::GetFlag(FLAGS_decode_instruction_boundaries)) {
+    instruction_decoder_ = InstructionDecoder::Create(binary_name_);
+  }
+#else
+  LOG_IF(WARNING, absl::GetFlag(FLAGS_decode_instruction_boundaries))
+      << "--decode_instruction_boundaries needs LLVM, ignored.";
+#endif
 
   if (absl::GetFlag(FLAGS_llc_misses)) {
     for (const auto &[func_name, maps] : symbol_profile_maps_) {
+      if (!IsSelected(func_name)) continue;
       std::map<uint64_t, uint64_t> counts;
       for (const auto &[pc, count] : maps->address_count_map) {
         DCHECK(maps->start_addr <= pc && pc <= maps->end_addr);
@@ -170,42 +447,76 @@ void Profile::ComputeProfile() {
                                            count);
       }
     }
+    if (releasable_sample_reader_ != nullptr)
+      releasable_sample_reader_->ReleaseSamples();
     symbol_map_->ElideSuffixesAndMerge();
   } else {
     // Precompute the aggregated counts of hot and cold parts. Both function
     // parts are emitted only if their total sample count is above the required
     // threshold.
-    absl::flat_hash_map<absl::string_view, uint64_t> symbol_counts;
-    for (const auto &[name, profile] : symbol_profile_maps_) {
-      symbol_counts[absl::StripSuffix(name, ".cold")] +=
-          profile->GetAggregatedCount();
-    }
+    const absl::flat_hash_map<absl::string_view, uint64_t> symbol_counts =
+        GetFunctionCounts();
+    auto should_emit = [&](const std::string &name) {
+      return IsSelected(name) &&
+             symbol_map_->ShouldEmit(
+                 symbol_counts.at(absl::StripSuffix(name, ".cold")));
+    };
 
     // First add all symbols that needs to be outputted to the symbol_map_. We
     // need to do this before hand because ProcessPerFunctionProfile will call
     // AddSymbolEntryCount for other symbols, which may or may not had been
     // processed by ProcessPerFunctionProfile.
     for (const auto &[name, ignored] : symbol_profile_maps_) {
-      const uint64_t count = symbol_counts.at(absl::StripSuffix(name, ".cold"));
-      if (symbol_map_->ShouldEmit(count)) {
+      if (should_emit(name)) {
         symbol_map_->AddSymbol(name);
       }
     }
 
+    // The functions are processed in address order, so that the samples of
+    // each function can be released right after it.
+    std::vector<std::pair<uint64_t, const std::string *>> sorted_funcs;
     for (const auto &[name, profile] : symbol_profile_maps_) {
-      const uint64_t count = symbol_counts.at(absl::StripSuffix(name, ".cold"));
-      if (symbol_map_->ShouldEmit(count)) {
-        ProcessPerFunctionProfile(name, *profile);
+      if (should_emit(name)) {
+        sorted_funcs.emplace_back(profile->start_addr, &name);
+      }
+    }
+    std::sort(sorted_funcs.begin(), sorted_funcs.end(),
+              [](const auto &a, const auto &b) {
+                return a.first != b.first ? a.first < b.first
+                                          : *a.second < *b.second;
+              });
+    std::vector<const std::string *> func_names;
+    func_names.reserve(sorted_funcs.size());
+    for (const auto &[start_addr, name] : sorted_funcs)
+      func_names.push_back(name);
+
+    const int num_threads = std::min<size_t>(
+        GetStageThreads(FLAGS_compute_profile_threads), func_names.size());
+    if (num_threads > 1 && addr2line_->PrepareForConcurrentQueries()) {
+      // The workers share the sample maps, which cannot be changed while they
+      // run, so the samples are released at the end.
+      ProcessPerFunctionProfilesInParallel(func_names, num_threads);
+    } else {
+      for (size_t f = 0; f < func_names.size(); ++f) {
+        std::unique_ptr<ProfileMaps> &maps =
+            symbol_profile_maps_.at(*func_names[f]);
+        ProcessPerFunctionProfile(*func_names[f], *maps, symbol_map_,
+                                  addr_count_map_);
+        ReleaseInstructionStarts(maps->start_addr);
+        maps.reset();
+        // The remaining functions only have samples at or above their start
+        // addresses, which are relative to the base address in the maps.
+        if (releasable_sample_reader_ != nullptr && f + 1 < func_names.size()) {
+          releasable_sample_reader_->ReleaseSamplesBefore(
+              sorted_funcs[f + 1].first - symbol_map_->base_addr());
+        }
       }
     }
+    symbol_profile_maps_.clear();
+    if (releasable_sample_reader_ != nullptr)
+      releasable_sample_reader_->ReleaseSamples();
     symbol_map_->ElideSuffixesAndMerge();
     symbol_map_->ComputeWorkingSets();
   }
 }
-
-Profile::~Profile() {
-  for (auto &[symbol, maps] : symbol_profile_maps_) {
-    delete maps;
-  }
-}
 }  // namespace devtools_crosstool_autofdo
@@ -7,13 +7,25 @@
 #define AUTOFDO_PROFILE_H_
 
 #include <cstdint>
+#include <memory>
+#include <optional>
 #include <set>
 #include <string>
+#include <utility>
+#include <vector>
 
 #include "base/integral_types.h"
+#include "base/logging.h"
 #include "base/macros.h"
+#if defined(HAVE_LLVM)
+#include "instruction_decoder.h"
+#endif
 #include "sample_reader.h"
+#include "symbolize/sampled_functions.h"
+#include "third_party/abseil/absl/container/flat_hash_map.h"
+#include "third_party/abseil/absl/container/flat_hash_set.h"
 #include "third_party/abseil/absl/container/node_hash_map.h"
+#include "third_party/abseil/absl/strings/string_view.h"
 
 namespace devtools_crosstool_autofdo {
 
@@ -37,43 +49,161 @@ class Profile {
         addr2line_(addr2line),
         symbol_map_(symbol_map) {}
 
-  ~Profile();
+  // Makes ComputeProfile also collect the counts of the instructions of the
+  // processed functions into ADDR_COUNT_MAP, by address.
+  void set_addr_count_map(AddressCountMap *addr_count_map) {
+    addr_count_map_ = addr_count_map;
+  }
+
+  // Makes ComputeProfile free the samples of SAMPLE_READER, which must be the
+  // sample reader of this profile, as soon as they are consumed. The
+  // functions are processed in address order, so the samples below the next
+  // function are released after each one.
+  void set_release_samples(SampleReader *sample_reader) {
+    CHECK(sample_reader == sample_reader_);
+    releasable_sample_reader_ = sample_reader;
+  }
+
+  // Sets the addr2line that ComputeProfile symbolizes with, e.g. once it is
+  // created for the functions returned by SelectHotFunctions.
+  void set_addr2line(Addr2line *addr2line) { addr2line_ = addr2line; }
+
+  // Selects the fewest functions, by decreasing aggregated count, whose
+  // counts add up to at least COVERAGE of the aggregated count of all
+  // functions. ComputeProfile then only builds the profiles of those. Returns
+  // the address ranges of the selected functions and of their .cold parts,
+  // e.g. to only read their debug info.
+  SampledFunctions SelectHotFunctions(double coverage);
+
+  // Makes ComputeProfile only build the profiles of the functions NAMES,
+  // without .cold suffixes, e.g. those selected for the profile of all
+  // samples, for the profile of a subset of the samples.
+  void set_selected_functions(absl::flat_hash_set<std::string> names) {
+    selected_functions_ = std::move(names);
+  }
+
+  // The functions selected by SelectHotFunctions or set_selected_functions.
+  const std::optional<absl::flat_hash_set<std::string>> &selected_functions()
+      const {
+    return selected_functions_;
+  }
 
   // Builds the source level profile.
   void ComputeProfile();
 
  private:
-  // Internal data structure that aggregates profile for each symbol.
+  // A view of the contiguous samples of one function in a sample map of the
+  // sample reader. The addresses of the samples are rebased by the base
+  // address of the binary when they are read.
+  template <typename Map>
+  class SampleSpan {
+   public:
+    using Key = typename Map::key_type;
+
+    class Iterator {
+     public:
+      Iterator(typename Map::const_iterator iter, uint64_t base)
+          : iter_(iter), base_(base) {}
+      std::pair<Key, uint64_t> operator*() const {
+        return {Rebase(iter_->first), iter_->second};
+      }
+      Iterator &operator++() {
+        ++iter_;
+        return *this;
+      }
+      bool operator!=(const Iterator &other) const {
+        return iter_ != other.iter_;
+      }
+
+     private:
+      uint64_t Rebase(uint64_t addr) const { return addr + base_; }
+      std::pair<uint64_t, uint64_t> Rebase(
+          const std::pair<uint64_t, uint64_t> &addrs) const {
+        return {addrs.first + base_, addrs.second + base_};
+      }
+
+      typename Map::const_iterator iter_;
+      uint64_t base_;
+    };
+
+    SampleSpan() = default;
+    SampleSpan(typename Map::const_iterator begin,
+               typename Map::const_iterator end, uint64_t base)
+        : begin_(begin), end_(end), base_(base) {}
+
+    Iterator begin() const { return Iterator(begin_, base_); }
+    Iterator end() const { return Iterator(end_, base_); }
+    bool empty() const { return begin_ == end_; }
+
+   private:
+    typename Map::const_iterator begin_{};
+    typename Map::const_iterator end_{};
+    uint64_t base_ = 0;
+  };
+
+  // Internal data structure that holds the profile of each symbol.
   struct ProfileMaps {
     ProfileMaps(uint64_t start, uint64_t end)
         : start_addr(start), end_addr(end) {}
     uint64_t GetAggregatedCount() const;
     uint64_t start_addr;
     uint64_t end_addr;
-    AddressCountMap address_count_map;
-    RangeCountMap range_count_map;
-    BranchCountMap branch_count_map;
+    SampleSpan<AddressCountMap> address_count_map;
+    SampleSpan<RangeCountMap> range_count_map;
+    SampleSpan<BranchCountMap> branch_count_map;
   };
-  typedef absl::node_hash_map<std::string, ProfileMaps *> SymbolProfileMaps;
+  typedef absl::node_hash_map<std::string, std::unique_ptr<ProfileMaps>>
+      SymbolProfileMaps;
 
-  // Returns the profile maps for a give function.
-  ProfileMaps *GetProfileMaps(uint64_t addr);
+  // Returns the sorted, disjoint address ranges of the function of MAPS which
+  // are touched by a sample.
+  static std::vector<std::pair<uint64_t, uint64_t>> SampledRanges(
+      const ProfileMaps &maps, bool use_lbr);
 
-  // Aggregates raw profile for each symbol.
+  // Slices the raw profile into the spans of each symbol.
   void AggregatePerFunctionProfile();
 
+  // Returns the aggregated counts of the functions, including their .cold
+  // parts, by name without the .cold suffix.
+  absl::flat_hash_map<absl::string_view, uint64_t> GetFunctionCounts() const;
+
+  // Returns whether the profile of the function NAME, which may be a .cold
+  // part, is built.
+  bool IsSelected(absl::string_view name) const;
+
   // Builds function level profile for specified function:
   //   1. Traverses all instructions to build instruction map.
   //   2. Unwinds the inline stack to add symbol count to each inlined symbol.
+  // The profile is written to "symbol_map", which is either symbol_map_ or a
+  // partial symbol map of a worker thread, and the per-address counts to
+  // "addr_count_map" unless it is null.
   void ProcessPerFunctionProfile(const std::string &func_name,
-                                 const ProfileMaps &map);
+                                 const ProfileMaps &map, SymbolMap *symbol_map,
+                                 AddressCountMap *addr_count_map);
+
+  // Runs ProcessPerFunctionProfile for "func_names" on "num_threads" worker
+  // threads, each writing to its own partial symbol map, then merges the
+  // partial symbol maps into symbol_map_.
+  void ProcessPerFunctionProfilesInParallel(
+      const std::vector<const std::string *> &func_names, int num_threads);
+
+  // Frees the instructions decoded for the function starting at START_ADDR,
+  // once it is processed.
+  void ReleaseInstructionStarts(uint64_t start_addr);
 
   const SampleReader *sample_reader_;
   const std::string binary_name_;
   Addr2line *addr2line_;
   SymbolMap *symbol_map_;
-  AddressCountMap global_addr_count_map_;
+  AddressCountMap *addr_count_map_ = nullptr;
+  SampleReader *releasable_sample_reader_ = nullptr;
   SymbolProfileMaps symbol_profile_maps_;
+  bool aggregated_ = false;
+  std::optional<absl::flat_hash_set<std::string>> selected_functions_;
+#if defined(HAVE_LLVM)
+  // Set with --decode_instruction_boundaries.
+  std::unique_ptr<InstructionDecoder> instruction_decoder_;
+#endif
 
   DISALLOW_COPY_AND_ASSIGN(Profile);
 };
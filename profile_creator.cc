@@ -7,9 +7,13 @@
 
 #include <inttypes.h>
 
+#include <algorithm>
 #include <cstdint>
 #include <memory>
+#include <numeric>
 #include <string>
+#include <thread>  // NOLINT(build/c++11)
+#include <vector>
 
 #include "base/commandlineflags.h"
 #include "base/integral_types.h"
@@ -18,21 +22,40 @@
 #include "gcov.h"
 #if defined(HAVE_LLVM)
 #include "llvm_profile_writer.h"
+#include "parallel_for.h"
 #include "profile_symbol_list.h"
 #endif
 #include "profile.h"
 #include "profile_writer.h"
 #include "sample_reader.h"
+#include "sample_subsampling.h"
+#include "stage_metrics.h"
 #include "symbol_map.h"
+#include "trace_events.h"
+#include "third_party/abseil/absl/container/flat_hash_map.h"
 #include "third_party/abseil/absl/flags/flag.h"
 #include "third_party/abseil/absl/memory/memory.h"
+#include "third_party/abseil/absl/strings/str_cat.h"
 #include "util/symbolize/elf_reader.h"
 
 ABSL_FLAG(std::string, focus_binary_re, "",
               "RE for the focused binary file name");
 
+ABSL_FLAG(double, hot_coverage, 1.0,
+          "Fraction of the sampled count to cover with the profiled functions. "
+          "Below 1, only the fewest hottest functions that cover it are "
+          "symbolized and profiled, which is faster for binaries with many "
+          "lukewarm functions. For Propeller, only those functions get a "
+          "CFG.");
+
 #if defined(HAVE_LLVM)
 AUTOFDO_PROFILE_SYMBOL_LIST_FLAGS;
+ABSL_FLAG(bool, read_lbr_samples_by_build_id, true,
+          "Read the LBR samples of perf data files with the reader of "
+          "Propeller, which selects the mmaps of the binary by its build id "
+          "and only keeps the branch stacks of the samples. Ignored with "
+          "--focus_binary_re. Profiles that can not be read this way are read "
+          "with the perf event parser.");
 #endif
 
 namespace {
@@ -44,6 +67,19 @@ struct PrefetchHint {
 
 typedef std::vector<PrefetchHint> PrefetchHints;
 
+// The function and inline stack of a prefetch hint.
+struct SymbolizedPrefetchHint {
+  // The name of the function, or nullptr if the address is in none.
+  const std::string *name = nullptr;
+  // The number of earlier hints at the same address.
+  uint8_t prefetch_index = 0;
+  size_t stack_index = 0;
+};
+
+// Consecutive hints of a function whose addresses are at most this far apart
+// are symbolized with one range query.
+constexpr uint64_t kMaxPrefetchHintGap = 64;
+
 // Experimental support for providing cache prefetch hints.
 // Currently, the format is a simple csv format, with no superfluous spaces or
 // markers (e.g. quotes).
@@ -106,15 +142,83 @@ bool ProfileCreator::CreateProfile(const std::string &input_profile_name,
                                    ProfileWriter *writer,
                                    const std::string &output_profile_name,
                                    bool store_sym_list_in_profile) {
-  SymbolMap symbol_map(binary_);
+  // Keep the binary open while the symbol map, the sample reader and
+  // addr2line read it, so that they share one ElfReader.
+  elf_reader_ = ElfReader::GetShared(binary_);
+  if (profiler == "prefetch") {
+    SymbolMap symbol_map(binary_);
+    return CreateProfileWithSymbolMap(input_profile_name, profiler, writer,
+                                      output_profile_name, &symbol_map,
+                                      store_sym_list_in_profile);
+  }
+
+  // The symbols of the binary are read while the samples are read, as they
+  // are independent until the samples are symbolized. The sample reader is
+  // created first, since it reads the build id from the ElfReader, which the
+  // symbol map then reads on its own.
+  if (!CreateSampleReader(input_profile_name, profiler)) return false;
+  std::unique_ptr<SymbolMap> symbol_map;
+  std::thread load_binary_thread([this, &symbol_map]() {
+    ScopedStageTimer timer("LoadBinary");
+    symbol_map = std::make_unique<SymbolMap>(binary_);
+#if defined(HAVE_LLVM)
+    // LLVMAddr2line does not filter by sampled functions, so it is created
+    // without the samples. The legacy addr2line needs them to skip the debug
+    // info of the functions without samples, and it reads the binary through
+    // the ElfReader, so ComputeProfile creates it.
+    CheckAndAssignAddr2Line(symbol_map.get(), Addr2line::Create(binary_));
+#endif
+  });
+  bool read_ok;
+  {
+    ScopedStageTimer timer("ReadSample");
+    read_ok = sample_reader_->ReadAndSetTotalCount();
+  }
+  load_binary_thread.join();
+  if (!read_ok) {
+    LOG(ERROR) << "Error reading profile.";
+    return false;
+  }
 
-  writer->setSymbolMap(&symbol_map);
+  writer->setSymbolMap(symbol_map.get());
+  {
+    ScopedStageTimer timer("ComputeProfile");
+    if (!ComputeProfile(symbol_map.get())) return false;
+  }
+  return WriteProfile(writer, output_profile_name, symbol_map.get(),
+                      store_sym_list_in_profile);
+}
+
+bool ProfileCreator::CreateProfileWithSymbolMap(
+    const std::string &input_profile_name, const std::string &profiler,
+    ProfileWriter *writer, const std::string &output_profile_name,
+    SymbolMap *symbol_map, bool store_sym_list_in_profile) {
+  writer->setSymbolMap(symbol_map);
   if (profiler == "prefetch") {
-    symbol_map.set_ignore_thresholds(true);
-    if (!ConvertPrefetchHints(input_profile_name, &symbol_map)) return false;
+    symbol_map->set_ignore_thresholds(true);
+    if (!ConvertPrefetchHints(input_profile_name, symbol_map)) return false;
   } else {
-    if (!ReadSample(input_profile_name, profiler)) return false;
-    if (!ComputeProfile(&symbol_map)) return false;
+    {
+      ScopedStageTimer timer("ReadSample");
+      if (!ReadSample(input_profile_name, profiler)) return false;
+    }
+    ScopedStageTimer timer("ComputeProfile");
+    if (!ComputeProfile(symbol_map)) return false;
+  }
+  return WriteProfile(writer, output_profile_name, symbol_map,
+                      store_sym_list_in_profile);
+}
+
+bool ProfileCreator::WriteProfile(ProfileWriter *writer,
+                                  const std::string &output_profile_name,
+                                  SymbolMap *symbol_map,
+                                  bool store_sym_list_in_profile) {
+  if (base_profile_ != nullptr) {
+    ScopedStageTimer timer("MergeBaseProfile");
+    symbol_map->AddProfilesFrom(base_profile_);
+    // The threshold of the samples alone is too low for the merged profile.
+    symbol_map->set_count_threshold(0);
+    symbol_map->CalculateThreshold();
   }
 
 #if defined(HAVE_LLVM)
@@ -125,9 +229,12 @@ bool ProfileCreator::CreateProfile(const std::string &input_profile_name,
   NameSizeList name_size_list;
   if (store_sym_list_in_profile) {
     prof_sym_list = std::make_unique<llvm::sampleprof::ProfileSymbolList>();
-    name_size_list = symbol_map.collectNamesForProfSymList();
-    fillProfileSymbolList(prof_sym_list.get(), name_size_list, &symbol_map,
-                          absl::GetFlag(FLAGS_symbol_list_size_coverage_ratio));
+    ScopedStageTimer timer("CollectSymbolList");
+    const int num_threads = GetStageThreads(FLAGS_symbol_list_threads);
+    name_size_list = symbol_map->collectNamesForProfSymList(num_threads);
+    fillProfileSymbolList(prof_sym_list.get(), name_size_list, symbol_map,
+                          absl::GetFlag(FLAGS_symbol_list_size_coverage_ratio),
+                          num_threads);
     prof_sym_list->setToCompress(absl::GetFlag(FLAGS_compress_symbol_list));
     auto *llvm_profile_writer = static_cast<LLVMProfileWriter *>(writer);
     auto *sample_profile_writer =
@@ -137,11 +244,22 @@ bool ProfileCreator::CreateProfile(const std::string &input_profile_name,
   }
 #endif
 
+  ScopedStageTimer timer("WriteProfile");
   return writer->WriteToFile(output_profile_name);
 }
 
 bool ProfileCreator::ReadSample(const std::string &input_profile_name,
                                 const std::string &profiler) {
+  if (!CreateSampleReader(input_profile_name, profiler)) return false;
+  if (!sample_reader_->ReadAndSetTotalCount()) {
+    LOG(ERROR) << "Error reading profile.";
+    return false;
+  }
+  return true;
+}
+
+bool ProfileCreator::CreateSampleReader(const std::string &input_profile_name,
+                                        const std::string &profiler) {
   if (profiler == "perf") {
     std::string focus_binary_re;
     std::string build_id;
@@ -159,42 +277,88 @@ bool ProfileCreator::ReadSample(const std::string &input_profile_name,
       focus_binary_re = std::string(".*/") + file_base_name + "$";
       free(dup_name);
 
-      ElfReader reader(binary_);
+      std::shared_ptr<ElfReader> reader = ElfReader::GetShared(binary_);
       // Quipper (and other parts of google3's perf infrastructure) pads build
       // ids--if present--to 40 characters hex. Match that behavior here. See
       // quipper/perf_data_utils.h and b/21597512 for more info.
       const size_t kMinPerfBuildIDStringLength = 40;
-      build_id = reader.GetBuildId();
+      build_id = reader->GetBuildId();
       if (build_id.length() > 0 &&
           build_id.length() < kMinPerfBuildIDStringLength)
         build_id.resize(kMinPerfBuildIDStringLength, '0');
     }
 
-    sample_reader_ = new PerfDataSampleReader(
+    auto *perf_data_reader = new PerfDataSampleReader(
         input_profile_name, focus_binary_re, build_id);
+#if defined(HAVE_LLVM)
+    if (absl::GetFlag(FLAGS_focus_binary_re).empty() &&
+        absl::GetFlag(FLAGS_read_lbr_samples_by_build_id))
+      perf_data_reader->set_binary(binary_);
+#endif
+    sample_reader_ = perf_data_reader;
   } else if (profiler == "text") {
     sample_reader_ = new TextSampleReaderWriter(input_profile_name);
+  } else if (profiler == "binary") {
+    sample_reader_ = new BinarySampleReaderWriter(input_profile_name);
   } else {
     LOG(ERROR) << "Unsupported profiler type: " << profiler;
     return false;
   }
-  if (!sample_reader_->ReadAndSetTotalCount()) {
-    LOG(ERROR) << "Error reading profile.";
-    return false;
-  }
   return true;
 }
 bool ProfileCreator::ComputeProfile(SymbolMap *symbol_map) {
-  std::set<uint64_t> sampled_addrs = sample_reader_->GetSampledAddresses();
-  std::map<uint64_t, uint64_t> sampled_functions =
-      symbol_map->GetSampledSymbolStartAddressSizeMap(sampled_addrs);
-  if (!CheckAndAssignAddr2Line(
+  // The profiles of the halves of subsampled samples are computed into copies
+  // of the binary's symbols, made before the profile is added to them.
+  std::unique_ptr<SymbolMap> half_maps[2];
+  if (sample_reader_->subsample_half(0) != nullptr) {
+    for (auto &half_map : half_maps)
+      half_map = symbol_map->CopyBinarySymbols();
+  }
+  Profile profile(sample_reader_, binary_, symbol_map->get_addr2line(),
+                  symbol_map);
+  // With --hot_coverage, only the debug info of the selected functions is
+  // read.
+  const double hot_coverage = absl::GetFlag(FLAGS_hot_coverage);
+  const SampledFunctions sampled_functions =
+      hot_coverage < 1 ? profile.SelectHotFunctions(hot_coverage)
+                       : symbol_map->GetSampledFunctions(
+                             sample_reader_->GetSampledAddresses());
+  if (symbol_map->get_addr2line() == nullptr &&
+      !CheckAndAssignAddr2Line(
           symbol_map,
           Addr2line::CreateWithSampledFunctions(binary_, &sampled_functions)))
     return false;
-  Profile profile(sample_reader_, binary_, symbol_map->get_addr2line(),
-                  symbol_map);
+  profile.set_addr2line(symbol_map->get_addr2line());
+  profile.set_release_samples(sample_reader_);
   profile.ComputeProfile();
+  const int64_t symbol_map_bytes = symbol_map->MemoryUsage();
+  const int64_t addr2line_bytes = symbol_map->get_addr2line()->MemoryUsage();
+  LOG(INFO) << "Estimated memory: symbol map " << symbol_map_bytes
+            << " bytes, addr2line " << addr2line_bytes << " bytes.";
+  TraceRecorder::GetInstance().AddCounters(
+      "MemoryUsage", {{"symbol_map_bytes", symbol_map_bytes},
+                      {"addr2line_bytes", addr2line_bytes}});
+
+  if (half_maps[0] != nullptr) {
+    // The samples of the halves are a subset of the samples, so the addr2line
+    // created for the sampled functions covers them.
+    for (int i = 0; i < 2; ++i) {
+      SampleReader *half = sample_reader_->subsample_half(i);
+      half->ReadAndSetTotalCount();
+      Profile half_profile(half, binary_, symbol_map->get_addr2line(),
+                           half_maps[i].get());
+      half_profile.set_release_samples(half);
+      if (profile.selected_functions().has_value())
+        half_profile.set_selected_functions(*profile.selected_functions());
+      half_profile.ComputeProfile();
+    }
+    const float half_overlap = half_maps[0]->Overlap(*half_maps[1]);
+    LOG(INFO) << "Overlap of the profiles of the two subsample halves: "
+              << half_overlap << ", estimated overlap with the profile of "
+              << "all samples: "
+              << StratifiedSampleSelector::EstimateOverlapWithFull(
+                     half_overlap);
+  }
   return true;
 }
 
@@ -207,32 +371,85 @@ bool ProfileCreator::ConvertPrefetchHints(const std::string &profile_file,
   if (!CheckAndAssignAddr2Line(symbol_map, Addr2line::Create(binary_)))
     return false;
   PrefetchHints hints = ReadPrefetchHints(profile_file);
-  std::map<uint64_t, uint8_t> repeated_prefetches_indices;
-  for (auto &hint : hints) {
-    uint64_t pc = hint.address;
-    int64_t delta = hint.delta;
+
+  // The hints are symbolized in the order of their addresses, so that a run
+  // of close hints in a function shares one symbol lookup and one range query
+  // of the inline stacks. They are then added in the order of the file, since
+  // a later hint replaces the count of an earlier one with the same target.
+  std::vector<size_t> order(hints.size());
+  std::iota(order.begin(), order.end(), 0);
+  std::stable_sort(order.begin(), order.end(), [&hints](size_t a, size_t b) {
+    return hints[a].address < hints[b].address;
+  });
+  std::vector<SymbolizedPrefetchHint> symbolized(hints.size());
+  std::vector<SourceStack> stacks;
+  for (size_t i = 0; i < order.size();) {
+    const uint64_t begin = hints[order[i]].address;
     const std::string *name = nullptr;
-    if (!symbol_map->GetSymbolInfoByAddr(pc, &name, nullptr, nullptr)) {
-      LOG(INFO) << "Instruction address not found:" << std::hex << pc;
+    uint64_t func_end = 0;
+    if (!symbol_map->GetSymbolInfoByAddr(begin, &name, nullptr, &func_end)) {
+      LOG(INFO) << "Instruction address not found:" << std::hex << begin;
+      ++i;
       continue;
     }
-    uint8_t prefetch_index = repeated_prefetches_indices[pc]++;
-
-    SourceStack stack;
-    symbol_map->get_addr2line()->GetInlineStack(pc, &stack);
+    size_t run_end = i + 1;
+    uint64_t end = begin + 1;
+    for (; run_end < order.size(); ++run_end) {
+      const uint64_t pc = hints[order[run_end]].address;
+      if (pc >= func_end || pc >= end + kMaxPrefetchHintGap) break;
+      end = pc + 1;
+    }
+    // Repeated hints at the same address are numbered in the order of the
+    // file and share the stack of the address.
+    uint8_t prefetch_index = 0;
+    for (size_t j = i; j < run_end; ++j) {
+      if (j > i && hints[order[j]].address == hints[order[j - 1]].address) {
+        prefetch_index++;
+      } else {
+        prefetch_index = 0;
+        stacks.emplace_back();
+      }
+      symbolized[order[j]] = {name, prefetch_index, stacks.size() - 1};
+    }
+    size_t j = i;
+    symbol_map->get_addr2line()->GetInlineStacksForRange(
+        begin, end,
+        [&](uint64_t range_begin, uint64_t range_end,
+            const SourceStack &stack) {
+          for (; j < run_end && hints[order[j]].address < range_end; ++j) {
+            const SymbolizedPrefetchHint &hint = symbolized[order[j]];
+            if (hints[order[j]].address >= range_begin &&
+                hint.prefetch_index == 0)
+              stacks[hint.stack_index] = stack;
+          }
+        });
+    i = run_end;
+  }
 
-    if (!symbol_map->EnsureEntryInFuncForSymbol(*name, pc))
-        continue;
+  // The synthetic target names by hint type and index.
+  absl::flat_hash_map<std::string, std::vector<std::string>> target_names;
+  for (size_t i = 0; i < hints.size(); ++i) {
+    const PrefetchHint &hint = hints[i];
+    const SymbolizedPrefetchHint &symbolized_hint = symbolized[i];
+    if (symbolized_hint.name == nullptr) continue;
+    if (!symbol_map->EnsureEntryInFuncForSymbol(*symbolized_hint.name,
+                                                hint.address))
+      continue;
 
+    std::vector<std::string> &names = target_names[hint.type];
+    while (names.size() <= symbolized_hint.prefetch_index) {
+      names.push_back(
+          absl::StrCat("__prefetch_", hint.type, "_", names.size()));
+    }
     // Currently, the profile format expects unsigned values, corresponding to
     // number of collected samples. We're hacking support for prefetch hints on
     // top of that, and prefetch hints are signed. For now, we'll explicitly
     // cast to unsigned.
     if (!symbol_map->AddIndirectCallTarget(
-            *name, stack,
-            "__prefetch_" + hint.type + "_" + std::to_string(prefetch_index),
-            static_cast<uint64_t>(delta))) {
-      LOG(WARNING) << "Ignoring address " << std::hex << pc
+            *symbolized_hint.name, stacks[symbolized_hint.stack_index],
+            names[symbolized_hint.prefetch_index],
+            static_cast<uint64_t>(hint.delta))) {
+      LOG(WARNING) << "Ignoring address " << std::hex << hint.address
                    << ". Could not add an indirect call target. Likely the "
                       "inline stack is empty for this address.";
     }
@@ -249,26 +466,84 @@ uint64_t ProfileCreator::TotalSamples() {
   }
 }
 
-bool MergeSample(const std::string &input_file,
-                 const std::string &input_profiler, const std::string &binary,
-                 const std::string &output_file) {
-  TextSampleReaderWriter writer(output_file);
-  if (writer.IsFileExist()) {
-    if (!writer.ReadAndSetTotalCount()) {
+namespace {
+// Merges the samples of "input_file" into the samples already in "writer"'s
+// file, if any, and writes the result back.
+template <typename SampleReaderWriter>
+bool MergeSampleInto(const std::string &input_file,
+                     const std::string &input_profiler,
+                     const std::string &binary, SampleReaderWriter *writer) {
+  if (writer->IsFileExist()) {
+    if (!writer->ReadAndSetTotalCount()) {
       return false;
     }
   }
 
   ProfileCreator creator(binary);
-  if (creator.ReadSample(input_file, input_profiler)) {
-    writer.Merge(creator.sample_reader());
-    if (writer.Write(nullptr)) {
-      return true;
+  if (!creator.ReadSample(input_file, input_profiler)) {
+    return false;
+  }
+  writer->Merge(creator.sample_reader());
+  return writer->Write();
+}
+}  // namespace
+
+bool MergeSample(const std::string &input_file,
+                 const std::string &input_profiler, const std::string &binary,
+                 const std::string &output_file,
+                 const std::string &output_format) {
+  if (output_format == "text") {
+    TextSampleReaderWriter writer(output_file);
+    return MergeSampleInto(input_file, input_profiler, binary, &writer);
+  } else if (output_format == "binary") {
+    BinarySampleReaderWriter writer(output_file);
+    return MergeSampleInto(input_file, input_profiler, binary, &writer);
+  }
+  LOG(ERROR) << "Unsupported output format: " << output_format;
+  return false;
+}
+
+bool MergeSamplesWithSpilling(const std::vector<std::string> &input_files,
+                              const std::string &input_profiler,
+                              const std::string &binary,
+                              const std::string &output_file,
+                              const std::string &output_format,
+                              const std::string &spill_dir,
+                              uint64_t memory_budget) {
+  if (output_format != "text" && output_format != "binary") {
+    LOG(ERROR) << "Unsupported output format: " << output_format;
+    return false;
+  }
+  SpillingSampleAggregator aggregator(spill_dir, memory_budget);
+  TextSampleReaderWriter text_writer(output_file);
+  if (text_writer.IsFileExist()) {
+    if (output_format == "binary") {
+      // The samples of the existing binary file are merged from disk.
+      aggregator.AddBinaryFile(output_file);
     } else {
+      if (!text_writer.ReadAndSetTotalCount() ||
+          !aggregator.Add(text_writer)) {
+        return false;
+      }
+      text_writer.Clear();
+    }
+  }
+
+  for (const std::string &input_file : input_files) {
+    ProfileCreator creator(binary);
+    if (!creator.ReadSample(input_file, input_profiler) ||
+        !aggregator.Add(creator.sample_reader())) {
       return false;
     }
-  } else {
-    return false;
   }
+  LOG(INFO) << "Spilled " << aggregator.num_spilled_runs()
+            << " runs of samples";
+
+  if (output_format == "binary") return aggregator.WriteBinary(output_file);
+  CountedSampleReader samples;
+  if (!aggregator.MergeInto(&samples)) return false;
+  text_writer.Merge(samples);
+  samples.Clear();
+  return text_writer.Write();
 }
 }  // namespace devtools_crosstool_autofdo
@@ -7,12 +7,19 @@
 #define AUTOFDO_PROFILE_CREATOR_H_
 
 #include <cstdint>
+#include <memory>
 #include <string>
+#include <vector>
 
 #include "addr2line.h"
 #include "profile_writer.h"
 #include "sample_reader.h"
 #include "symbol_map.h"
+#include "symbolize/elf_reader.h"
+#include "third_party/abseil/absl/flags/declare.h"
+
+// Also used for the Propeller profiles of create_llvm_prof.
+ABSL_DECLARE_FLAG(double, hot_coverage);
 
 namespace devtools_crosstool_autofdo {
 
@@ -36,6 +43,24 @@ class ProfileCreator {
                      const std::string &output_profile_name,
                      bool store_sym_list_in_profile = false);
 
+  // Like CreateProfile, but computes the profile into SYMBOL_MAP, which holds
+  // the symbols of the binary and no profile yet. If SYMBOL_MAP has an
+  // addr2line, it is used instead of reading the debug info again.
+  bool CreateProfileWithSymbolMap(
+      const std::string &input_profile_name, const std::string &profiler,
+      devtools_crosstool_autofdo::ProfileWriter *writer,
+      const std::string &output_profile_name,
+      devtools_crosstool_autofdo::SymbolMap *symbol_map,
+      bool store_sym_list_in_profile = false);
+
+  // Makes CreateProfile add BASE_PROFILE, the symbols of a profile previously
+  // created for the same binary, to the profile of the input samples. This
+  // updates a profile with new samples at the cost of symbolizing only the
+  // new samples. BASE_PROFILE is left empty by CreateProfile.
+  void set_base_profile(devtools_crosstool_autofdo::SymbolMap *base_profile) {
+    base_profile_ = base_profile;
+  }
+
   // Reads samples from the input profile.
   bool ReadSample(const std::string &input_profile_name,
                   const std::string &profiler);
@@ -49,21 +74,52 @@ class ProfileCreator {
   }
 
   // Computes the profile and updates the given symbol map and addr2line
-  // instance.
+  // instance. Reads the debug info unless the symbol map has an addr2line
+  // already.
+  // The samples are freed as they are consumed, so only the statistics of the
+  // sample reader, e.g. TotalSamples, remain available afterwards.
   bool ComputeProfile(devtools_crosstool_autofdo::SymbolMap *symbol_map);
 
  private:
+  // Creates sample_reader_ for the input profile, without reading it yet.
+  bool CreateSampleReader(const std::string &input_profile_name,
+                          const std::string &profiler);
+
+  // Adds the base profile, if any, to the profile in SYMBOL_MAP and writes it
+  // to OUTPUT_PROFILE_NAME.
+  bool WriteProfile(devtools_crosstool_autofdo::ProfileWriter *writer,
+                    const std::string &output_profile_name,
+                    devtools_crosstool_autofdo::SymbolMap *symbol_map,
+                    bool store_sym_list_in_profile);
+
   bool ConvertPrefetchHints(const std::string &profile_file,
                             SymbolMap *symbol_map);
   bool CheckAndAssignAddr2Line(SymbolMap *symbol_map, Addr2line *addr2line);
 
   SampleReader *sample_reader_;
+  SymbolMap *base_profile_ = nullptr;
   std::string binary_;
+  std::shared_ptr<ElfReader> elf_reader_;
 };
 
+// Merges the samples of "input_file" into "output_file", which is in
+// "output_format", either "text" or "binary".
 bool MergeSample(const std::string &input_file,
                  const std::string &input_profiler, const std::string &binary,
-                 const std::string &output_file);
+                 const std::string &output_file,
+                 const std::string &output_format = "text");
+
+// Merges the samples of "input_files" into "output_file" like MergeSample, but
+// sums them within about "memory_budget" bytes, spilling sorted runs to
+// "spill_dir". The samples of each input file are still read into memory one
+// file at a time, and a text "output_file" is written from memory.
+bool MergeSamplesWithSpilling(const std::vector<std::string> &input_files,
+                              const std::string &input_profiler,
+                              const std::string &binary,
+                              const std::string &output_file,
+                              const std::string &output_format,
+                              const std::string &spill_dir,
+                              uint64_t memory_budget);
 }  // namespace devtools_crosstool_autofdo
 
 #endif  // AUTOFDO_PROFILE_CREATOR_H_
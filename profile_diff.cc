@@ -1,5 +1,6 @@
 // Diff two .afdo files.
 
+#include <cstdint>
 #include <map>
 #include <string>
 #include <utility>
@@ -8,14 +9,24 @@
 #include "base/commandlineflags.h"
 #include "base/logging.h"
 #include "llvm_profile_reader.h"
+#include "parallel_for.h"
 #include "symbol_map.h"
-#include "third_party/abseil/absl/container/node_hash_set.h"
+#include "third_party/abseil/absl/container/flat_hash_set.h"
 #include "third_party/abseil/absl/flags/flag.h"
 #include "third_party/abseil/absl/flags/parse.h"
 #include "third_party/abseil/absl/flags/usage.h"
 
 ABSL_FLAG(bool, compare_function, false,
           "whether to compare function level profile");
+ABSL_FLAG(double, overlap_threshold, -1,
+          "If in [0,1], only check whether the overlap reaches this "
+          "threshold: print the result and exit with 1 if it does not. "
+          "The comparison stops as soon as the outcome is known.");
+ABSL_FLAG(uint32_t, read_threads, 1,
+          "Number of threads used to convert the functions of each profile.");
+ABSL_FLAG(std::vector<std::string>, functions, {},
+          "If not empty, only compare the outline functions of this "
+          "comma-separated list.");
 
 int main(int argc, char **argv) {
   const char use[] =
@@ -31,9 +42,15 @@ int main(int argc, char **argv) {
     LOG(FATAL) << "Please specify two files to compare";
   }
 
-  absl::node_hash_set<std::string> names;
-  devtools_crosstool_autofdo::LLVMProfileReader reader_1(&symbol_map_1, names);
-  devtools_crosstool_autofdo::LLVMProfileReader reader_2(&symbol_map_2, names);
+  devtools_crosstool_autofdo::LLVMProfileReader reader_1(&symbol_map_1);
+  devtools_crosstool_autofdo::LLVMProfileReader reader_2(&symbol_map_2);
+  const std::vector<std::string> functions = absl::GetFlag(FLAGS_functions);
+  for (auto *reader : {&reader_1, &reader_2}) {
+    reader->set_num_threads(
+        devtools_crosstool_autofdo::GetStageThreads(FLAGS_read_threads));
+    reader->set_functions_to_read(
+        absl::flat_hash_set<std::string>(functions.begin(), functions.end()));
+  }
   reader_1.ReadFromFile(argv[1]);
   reader_2.ReadFromFile(argv[2]);
 
@@ -41,6 +58,13 @@ int main(int argc, char **argv) {
     symbol_map_1.DumpFuncLevelProfileCompare(symbol_map_2);
   }
 
+  const double threshold = absl::GetFlag(FLAGS_overlap_threshold);
+  if (threshold >= 0) {
+    const bool similar = symbol_map_1.OverlapAtLeast(symbol_map_2, threshold);
+    printf("overlap %s %.4f\n", similar ? ">=" : "<", threshold);
+    return similar ? 0 : 1;
+  }
+
   printf("%.4f\n", symbol_map_1.Overlap(symbol_map_2));
   return 0;
 }
@@ -0,0 +1,154 @@
+#include "profile_index.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <numeric>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "base/logging.h"
+#include "third_party/abseil/absl/strings/string_view.h"
+
+namespace devtools_crosstool_autofdo {
+
+namespace {
+constexpr char kMagic[8] = {'a', 'f', 'd', 'o', 'i', 'd', 'x', '1'};
+
+struct Header {
+  char magic[8];
+  uint64_t profile_size;
+  uint64_t num_entries;
+};
+}  // namespace
+
+struct ProfileIndex::Record {
+  uint64_t offset;
+  uint64_t total_count;
+  uint32_t name_offset;
+  uint32_t name_size;
+};
+
+bool ProfileIndex::Write(const std::string &index_file, uint64_t profile_size,
+                         std::vector<Entry> entries) {
+  std::sort(entries.begin(), entries.end(),
+            [](const Entry &a, const Entry &b) { return a.name < b.name; });
+  Header header;
+  memcpy(header.magic, kMagic, sizeof(kMagic));
+  header.profile_size = profile_size;
+  header.num_entries = entries.size();
+  std::vector<Record> records;
+  records.reserve(entries.size());
+  std::string names;
+  for (const Entry &entry : entries) {
+    CHECK_LE(names.size() + entry.name.size(), UINT32_MAX)
+        << "Too many function names to index.";
+    records.push_back({.offset = entry.offset,
+                       .total_count = entry.total_count,
+                       .name_offset = static_cast<uint32_t>(names.size()),
+                       .name_size = static_cast<uint32_t>(entry.name.size())});
+    names += entry.name;
+  }
+  std::ofstream out(index_file, std::ios::binary);
+  out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+  out.write(reinterpret_cast<const char *>(records.data()),
+            records.size() * sizeof(Record));
+  out.write(names.data(), names.size());
+  return static_cast<bool>(out);
+}
+
+std::unique_ptr<ProfileIndex> ProfileIndex::Open(const std::string &index_file,
+                                                 uint64_t profile_size) {
+  const int fd = open(index_file.c_str(), O_RDONLY);
+  if (fd < 0) return nullptr;
+  struct stat st;
+  if (fstat(fd, &st) != 0 ||
+      st.st_size < static_cast<off_t>(sizeof(Header))) {
+    close(fd);
+    return nullptr;
+  }
+  void *data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) return nullptr;
+  // Takes over the mapping, so that it is unmapped on the failures below.
+  const Header &header = *static_cast<const Header *>(data);
+  const size_t max_entries = (st.st_size - sizeof(Header)) / sizeof(Record);
+  std::unique_ptr<ProfileIndex> index(new ProfileIndex(
+      static_cast<const char *>(data), st.st_size,
+      std::min<uint64_t>(header.num_entries, max_entries)));
+  if (memcmp(header.magic, kMagic, sizeof(kMagic)) != 0 ||
+      header.profile_size != profile_size ||
+      header.num_entries > max_entries) {
+    return nullptr;
+  }
+  const size_t names_size = st.st_size - sizeof(Header) -
+                            header.num_entries * sizeof(Record);
+  for (size_t i = 0; i < index->size(); ++i) {
+    const Record &record = index->record(i);
+    if (static_cast<uint64_t>(record.name_offset) + record.name_size >
+        names_size)
+      return nullptr;
+  }
+  return index;
+}
+
+ProfileIndex::~ProfileIndex() {
+  munmap(const_cast<char *>(data_), size_);
+}
+
+const ProfileIndex::Record &ProfileIndex::record(size_t i) const {
+  return reinterpret_cast<const Record *>(data_ + sizeof(Header))[i];
+}
+
+absl::string_view ProfileIndex::name(size_t i) const {
+  const char *names = data_ + sizeof(Header) + num_entries_ * sizeof(Record);
+  const Record &r = record(i);
+  return absl::string_view(names + r.name_offset, r.name_size);
+}
+
+uint64_t ProfileIndex::offset(size_t i) const { return record(i).offset; }
+
+uint64_t ProfileIndex::total_count(size_t i) const {
+  return record(i).total_count;
+}
+
+std::optional<size_t> ProfileIndex::Find(absl::string_view name) const {
+  size_t begin = 0, end = num_entries_;
+  while (begin < end) {
+    const size_t mid = begin + (end - begin) / 2;
+    const absl::string_view mid_name = this->name(mid);
+    if (mid_name == name) return mid;
+    if (mid_name < name) {
+      begin = mid + 1;
+    } else {
+      end = mid;
+    }
+  }
+  return std::nullopt;
+}
+
+std::vector<size_t> ProfileIndex::TopEntries(size_t n) const {
+  std::vector<size_t> entries(num_entries_);
+  std::iota(entries.begin(), entries.end(), 0);
+  n = std::min(n, entries.size());
+  // Ties are broken by name, so the result does not depend on the sort.
+  std::partial_sort(entries.begin(), entries.begin() + n, entries.end(),
+                    [this](size_t a, size_t b) {
+                      if (total_count(a) != total_count(b))
+                        return total_count(a) > total_count(b);
+                      return a < b;
+                    });
+  entries.resize(n);
+  return entries;
+}
+
+}  // namespace devtools_crosstool_autofdo
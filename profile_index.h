@@ -0,0 +1,86 @@
+// An index of the top-level function records of an AutoFDO profile, which is
+// written next to the profile and lets readers load single functions, or the
+// hottest ones, without scanning the whole profile.
+
+#ifndef AUTOFDO_PROFILE_INDEX_H_
+#define AUTOFDO_PROFILE_INDEX_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "third_party/abseil/absl/strings/string_view.h"
+
+namespace devtools_crosstool_autofdo {
+
+// The index is a binary file in host byte order, like the profile:
+//   magic "afdoidx1"
+//   profile size (uint64)
+//   number of entries (uint64)
+//   entries, sorted by name:
+//     record offset (uint64), total count (uint64),
+//     name offset (uint32), name size (uint32)
+//   names, each at its name offset from the start of the names
+// It is mapped into memory, so a lookup only touches the pages it binary
+// searches and the index can be shared by concurrent readers.
+class ProfileIndex {
+ public:
+  struct Entry {
+    std::string name;
+    // The offset of the function record from the start of the profile.
+    uint64_t offset;
+    uint64_t total_count;
+  };
+
+  // Returns the index file written next to PROFILE_FILE.
+  static std::string FileFor(const std::string &profile_file) {
+    return profile_file + ".idx";
+  }
+
+  // Writes ENTRIES as the index of a profile of PROFILE_SIZE bytes to
+  // INDEX_FILE. Returns false if the file can not be written.
+  static bool Write(const std::string &index_file, uint64_t profile_size,
+                    std::vector<Entry> entries);
+
+  // Maps INDEX_FILE. Returns null if it can not be read, is malformed, or is
+  // not the index of a profile of PROFILE_SIZE bytes, e.g. because the
+  // profile was rewritten after the index.
+  static std::unique_ptr<ProfileIndex> Open(const std::string &index_file,
+                                            uint64_t profile_size);
+
+  ~ProfileIndex();
+
+  ProfileIndex(const ProfileIndex &) = delete;
+  ProfileIndex &operator=(const ProfileIndex &) = delete;
+
+  size_t size() const { return num_entries_; }
+  absl::string_view name(size_t i) const;
+  uint64_t offset(size_t i) const;
+  uint64_t total_count(size_t i) const;
+
+  // Returns the entry of the function NAME, if it is in the index.
+  std::optional<size_t> Find(absl::string_view name) const;
+
+  // Returns the indexes of the N functions with the largest total counts, by
+  // decreasing total count.
+  std::vector<size_t> TopEntries(size_t n) const;
+
+ private:
+  struct Record;
+
+  ProfileIndex(const char *data, size_t size, size_t num_entries)
+      : data_(data), size_(size), num_entries_(num_entries) {}
+
+  const Record &record(size_t i) const;
+
+  const char *data_;
+  size_t size_;
+  size_t num_entries_;
+};
+
+}  // namespace devtools_crosstool_autofdo
+
+#endif  // AUTOFDO_PROFILE_INDEX_H_
@@ -1,8 +1,12 @@
 // Merge the .afdo files.
 
+#include <algorithm>
+#include <atomic>
+#include <cmath>
 #include <map>
 #include <memory>
 #include <string>
+#include <thread>  // NOLINT(build/c++11)
 #include <utility>
 #include <vector>
 
@@ -11,13 +15,15 @@
 #include "gcov.h"
 #include "llvm_profile_reader.h"
 #include "llvm_profile_writer.h"
+#include "parallel_for.h"
 #include "profile_reader.h"
 #include "profile_writer.h"
 #include "symbol_map.h"
 #include "third_party/abseil/absl/base/macros.h"
-#include "third_party/abseil/absl/container/node_hash_set.h"
 #include "third_party/abseil/absl/flags/flag.h"
 #include "third_party/abseil/absl/memory/memory.h"
+#include "third_party/abseil/absl/strings/numbers.h"
+#include "third_party/abseil/absl/synchronization/mutex.h"
 #include "llvm/Config/llvm-config.h"
 #include "third_party/abseil/absl/flags/parse.h"
 #include "third_party/abseil/absl/flags/usage.h"
@@ -53,6 +59,10 @@ ABSL_FLAG(bool, compress, false,
 ABSL_FLAG(bool, use_md5, false,
           "Use md5 names in name table. The option can only be enabled "
           "when --format=extbinary. ");
+ABSL_FLAG(bool, read_md5_names, true,
+          "With --use_md5, key the functions of the LLVM input profiles by "
+          "their MD5 names while merging, which saves memory. Only used "
+          "without --strip_symbols_regex, which matches names.");
 ABSL_FLAG(bool, partial_profile, false,
           "Specify the output to be a partial profile. The option can "
           "only be enabled when --format=extbinary. ");
@@ -62,6 +72,12 @@ ABSL_FLAG(bool, split_layout, false,
 ABSL_FLAG(std::string, strip_symbols_regex, "",
           "Strip outline symbols "
           "matching the regular expression in the merged profile. ");
+ABSL_FLAG(uint32_t, merge_threads, 1,
+          "Number of threads used to read and merge the input profiles and "
+          "to throttle the inline instances of the merged profile. AFDO "
+          "profiles are read concurrently; LLVM profiles (--is_llvm) are read "
+          "one at a time, because the LLVM profile readers share global "
+          "state, and the functions of each are converted concurrently.");
 
 namespace {
 // Some sepcial symbols or symbol patterns we are going to handle.
@@ -125,6 +141,97 @@ bool verifyProperFlags(bool has_prof_sym_list) {
   }
   return true;
 }
+
+using devtools_crosstool_autofdo::AutoFDOProfileReader;
+using devtools_crosstool_autofdo::GetStageThreads;
+using devtools_crosstool_autofdo::SymbolMap;
+
+// An input profile and the weight its counts are scaled by while it is read.
+struct WeightedInput {
+  std::string filename;
+  double weight = 1;
+};
+
+// Parses the input arguments, each either a profile name or
+// "<profile name>:<weight>", e.g. "web.afdo:0.25" to weight a profile by its
+// share of the queries. A suffix which is not a number is part of the name.
+std::vector<WeightedInput> ParseWeightedInputs(int argc, char **argv) {
+  std::vector<WeightedInput> inputs;
+  inputs.reserve(argc - 1);
+  for (int i = 1; i < argc; i++) {
+    WeightedInput &input = inputs.emplace_back();
+    input.filename = argv[i];
+    const size_t colon = input.filename.rfind(':');
+    double weight;
+    if (colon == std::string::npos ||
+        !absl::SimpleAtod(input.filename.substr(colon + 1), &weight))
+      continue;
+    if (!std::isfinite(weight) || weight < 0)
+      LOG(FATAL) << "Invalid weight of input " << argv[i];
+    input.filename.resize(colon);
+    input.weight = weight;
+  }
+  return inputs;
+}
+
+// Reads the AFDO profiles INPUTS with NUM_THREADS workers and merges them
+// into SYMBOL_MAP. Every input is read into a private SymbolMap, which is
+// merged with any other finished map right away, so at most about two maps
+// per worker are alive at a time.
+void ReadAutoFDOProfilesInParallel(const std::vector<WeightedInput> &inputs,
+                                   int num_threads, SymbolMap *symbol_map) {
+  using devtools_crosstool_autofdo::gcov_working_set_info;
+  // Working sets are not simply added, so they are replayed below in the
+  // order of the inputs.
+  std::vector<std::vector<gcov_working_set_info>> working_sets(inputs.size());
+  std::vector<uint64_t> gcov_versions(inputs.size());
+  absl::Mutex mutex;
+  std::unique_ptr<SymbolMap> finished_map;
+  std::atomic<size_t> next_file{0};
+  std::vector<std::thread> workers;
+  workers.reserve(num_threads);
+  for (int i = 0; i < num_threads; ++i) {
+    workers.emplace_back([&]() {
+      for (size_t f = next_file++; f < inputs.size(); f = next_file++) {
+        auto map = std::make_unique<SymbolMap>();
+        AutoFDOProfileReader reader(map.get(), true);
+        reader.set_weight(inputs[f].weight);
+        reader.ReadFromFile(inputs[f].filename);
+        gcov_versions[f] = reader.gcov_version();
+        const gcov_working_set_info *working_set = map->GetWorkingSets();
+        working_sets[f].assign(working_set,
+                               working_set + NUM_GCOV_WORKING_SETS);
+        // Merge with finished maps until there is none left to take.
+        while (true) {
+          std::unique_ptr<SymbolMap> other;
+          {
+            absl::MutexLock lock(&mutex);
+            if (finished_map == nullptr) {
+              finished_map = std::move(map);
+              break;
+            }
+            other = std::move(finished_map);
+          }
+          map->AddProfilesFrom(other.get());
+        }
+      }
+    });
+  }
+  for (std::thread &worker : workers) worker.join();
+
+  if (finished_map != nullptr) symbol_map->AddProfilesFrom(finished_map.get());
+  for (const auto &working_set : working_sets) {
+    for (int i = 0; i < NUM_GCOV_WORKING_SETS; ++i) {
+      symbol_map->UpdateWorkingSet(i, working_set[i].num_counters,
+                                   working_set[i].min_counter);
+    }
+  }
+  // Every reader sets --gcov_version; keep the one of the last input as a
+  // serial run would.
+  if (!gcov_versions.empty()) {
+    absl::SetFlag(&FLAGS_gcov_version, gcov_versions.back());
+  }
+}
 }  // namespace
 
 int main(int argc, char **argv) {
@@ -135,6 +242,8 @@ int main(int argc, char **argv) {
   if (argc < 2) {
     LOG(FATAL) << "Please at least specify an input profile";
   }
+  // The counts of every input are scaled by its weight as it is read.
+  const std::vector<WeightedInput> inputs = ParseWeightedInputs(argc, argv);
 
   if (absl::GetFlag(FLAGS_include_symbol_list) &&
       absl::GetFlag(FLAGS_format) != "extbinary") {
@@ -147,18 +256,20 @@ int main(int argc, char **argv) {
       strip_all, ABSL_ARRAYSIZE(strip_all), keep_sole,
       ABSL_ARRAYSIZE(keep_sole), keep_cold, ABSL_ARRAYSIZE(keep_cold));
 
-  absl::node_hash_set<std::string> names;
-
   if (!absl::GetFlag(FLAGS_is_llvm)) {
-    using devtools_crosstool_autofdo::AutoFDOProfileReader;
-    typedef std::unique_ptr<AutoFDOProfileReader> AutoFDOProfileReaderPtr;
-    std::unique_ptr<AutoFDOProfileReaderPtr[]> readers(
-        new AutoFDOProfileReaderPtr[argc - 1]);
-    // TODO(dehao): merge profile reader/writer into a single class
-    for (int i = 1; i < argc; i++) {
-      readers[i - 1] =
-          std::make_unique<AutoFDOProfileReader>(&symbol_map, true);
-      readers[i - 1]->ReadFromFile(argv[i]);
+    std::vector<std::unique_ptr<AutoFDOProfileReader>> readers(argc - 1);
+    const int num_threads =
+        std::min<int>(GetStageThreads(FLAGS_merge_threads), argc - 1);
+    if (num_threads > 1) {
+      ReadAutoFDOProfilesInParallel(inputs, num_threads, &symbol_map);
+    } else {
+      // TODO(dehao): merge profile reader/writer into a single class
+      for (int i = 1; i < argc; i++) {
+        readers[i - 1] =
+            std::make_unique<AutoFDOProfileReader>(&symbol_map, true);
+        readers[i - 1]->set_weight(inputs[i - 1].weight);
+        readers[i - 1]->ReadFromFile(inputs[i - 1].filename);
+      }
     }
 
     symbol_map.CalculateThreshold();
@@ -181,11 +292,21 @@ int main(int argc, char **argv) {
     int numFSDProfiles = 0;
 #endif
 
+    // The output only keeps the MD5 of the names, so the profiles may be
+    // merged by the MD5 names, which are mapped back to the names on writing.
+    const bool read_md5_names =
+        absl::GetFlag(FLAGS_use_md5) && absl::GetFlag(FLAGS_read_md5_names) &&
+        absl::GetFlag(FLAGS_format) == "extbinary" &&
+        absl::GetFlag(FLAGS_strip_symbols_regex).empty();
     for (int i = 1; i < argc; i++) {
       auto reader = std::make_unique<LLVMProfileReader>(
-          &symbol_map, names,
+          &symbol_map,
           absl::GetFlag(FLAGS_merge_special_syms) ? nullptr : &special_syms);
-      CHECK(reader->ReadFromFile(argv[i])) << "when reading " << argv[i];
+      reader->set_num_threads(GetStageThreads(FLAGS_merge_threads));
+      reader->set_use_md5_names(read_md5_names);
+      reader->set_weight(inputs[i - 1].weight);
+      CHECK(reader->ReadFromFile(inputs[i - 1].filename))
+          << "when reading " << inputs[i - 1].filename;
 
 #if LLVM_VERSION_MAJOR >= 12
       if (reader->ProfileIsFS()) {
@@ -264,10 +385,13 @@ int main(int argc, char **argv) {
     // at the same location after profile merging. This is to control ThinLTO
     // importing cost. This is placed here so that it can be used in the
     // standalone tool as well.
-    symbol_map.throttleInlineInstancesAtSameLocation();
+    symbol_map.throttleInlineInstancesAtSameLocation(
+        GetStageThreads(FLAGS_merge_threads));
 
-    writer->setSymbolMap(&symbol_map);
-    if (!writer->WriteToFile(absl::GetFlag(FLAGS_output_file))) {
+    // The symbol map is not needed after writing, so let the writer free
+    // every symbol once it has been converted.
+    if (!writer->WriteToFileAndRelease(absl::GetFlag(FLAGS_output_file),
+                                       &symbol_map)) {
       LOG(FATAL) << "Error writing to " << absl::GetFlag(FLAGS_output_file);
     }
   }
@@ -1,46 +1,101 @@
 #include "profile_reader.h"
 
+#include <cstddef>
 #include <cstdint>
 #include <string>
+#include <vector>
 
 #include "base/commandlineflags.h"
 #include "base/logging.h"
 #include "addr2line.h"
 #include "gcov.h"
+#include "name_interner.h"
 #include "symbol_map.h"
+#include "third_party/abseil/absl/container/flat_hash_set.h"
 #include "third_party/abseil/absl/flags/flag.h"
+#include "third_party/abseil/absl/strings/string_view.h"
 
 namespace devtools_crosstool_autofdo {
 
 void AutoFDOProfileReader::ReadModuleGroup() {
-  CHECK_EQ(gcov_read_unsigned(), GCOV_TAG_MODULE_GROUPING);
+  CHECK_EQ(gcov_.ReadUnsigned(), GCOV_TAG_MODULE_GROUPING);
   // Length of the section. Always 0.
-  gcov_read_unsigned();
+  gcov_.ReadUnsigned();
   // Number of modules. Always 0.
-  gcov_read_unsigned();
+  gcov_.ReadUnsigned();
 }
 
-void AutoFDOProfileReader::ReadFunctionProfile() {
-  CHECK_EQ(gcov_read_unsigned(), GCOV_TAG_AFDO_FUNCTION);
-  gcov_read_unsigned();
-  uint32_t num_functions = gcov_read_unsigned();
+void AutoFDOProfileReader::ReadFunctionProfile(
+    const absl::flat_hash_set<std::string> *functions) {
+  CHECK_EQ(gcov_.ReadUnsigned(), GCOV_TAG_AFDO_FUNCTION);
+  gcov_.ReadUnsigned();
+  uint32_t num_functions = gcov_.ReadUnsigned();
   SourceStack stack;
   for (uint32_t i = 0; i < num_functions; i++) {
+    if (functions != nullptr && !functions->contains(PeekFunctionName())) {
+      SkipSymbolProfile(true);
+      continue;
+    }
     ReadSymbolProfile(stack, true);
   }
 }
 
+absl::string_view AutoFDOProfileReader::PeekFunctionName() {
+  // The name follows the head count.
+  const size_t record_offset = gcov_.read_offset();
+  gcov_.ReadCounter();
+  const char *name = names_.at(gcov_.ReadUnsigned());
+  gcov_.SeekRead(record_offset);
+  return name;
+}
+
+void AutoFDOProfileReader::StreamFunction(const FunctionCallback &callback) {
+  SymbolMap symbol_map;
+  SymbolMap *const saved_symbol_map = symbol_map_;
+  symbol_map_ = &symbol_map;
+  ReadSymbolProfile(SourceStack(), true);
+  symbol_map_ = saved_symbol_map;
+  callback(symbol_map);
+}
+
+uint64_t AutoFDOProfileReader::SkipSymbolProfile(bool top_level) {
+  if (top_level) {
+    // head_count
+    gcov_.ReadCounter();
+  }
+  // name
+  gcov_.ReadUnsigned();
+  uint32_t num_pos_counts = gcov_.ReadUnsigned();
+  uint32_t num_callsites = gcov_.ReadUnsigned();
+  uint64_t total_count = 0;
+  for (uint32_t i = 0; i < num_pos_counts; i++) {
+    // offset
+    gcov_.ReadUnsigned();
+    uint32_t num_targets = gcov_.ReadUnsigned();
+    total_count += gcov_.ReadCounter();
+    // type, target name * 2, target count * 2
+    gcov_.SeekRead(gcov_.read_offset() +
+                   20 * static_cast<size_t>(num_targets));
+  }
+  for (uint32_t i = 0; i < num_callsites; i++) {
+    // offset
+    gcov_.ReadUnsigned();
+    total_count += SkipSymbolProfile(false);
+  }
+  return total_count;
+}
+
 void AutoFDOProfileReader::ReadSymbolProfile(const SourceStack &stack,
                                              bool update) {
   uint64_t head_count;
   if (stack.size() == 0) {
-    head_count = gcov_read_counter();
+    head_count = ScaleCount(gcov_.ReadCounter());
   } else {
     head_count = 0;
   }
-  const char *name = names_.at(gcov_read_unsigned()).c_str();
-  uint32_t num_pos_counts = gcov_read_unsigned();
-  uint32_t num_callsites = gcov_read_unsigned();
+  const char *name = names_.at(gcov_.ReadUnsigned());
+  uint32_t num_pos_counts = gcov_.ReadUnsigned();
+  uint32_t num_callsites = gcov_.ReadUnsigned();
   if (stack.size() == 0) {
     symbol_map_->AddSymbol(name);
     if (!force_update_ && symbol_map_->GetSymbolByName(name)->total_count > 0) {
@@ -51,9 +106,9 @@ void AutoFDOProfileReader::ReadSymbolProfile(const SourceStack &stack,
     }
   }
   for (int i = 0; i < num_pos_counts; i++) {
-    uint32_t offset = gcov_read_unsigned();
-    uint32_t num_targets = gcov_read_unsigned();
-    uint64_t count = gcov_read_counter();
+    uint32_t offset = gcov_.ReadUnsigned();
+    uint32_t num_targets = gcov_.ReadUnsigned();
+    uint64_t count = ScaleCount(gcov_.ReadCounter());
     SourceInfo info(name, "", "", 0, offset >> 16, offset & 0xffff);
     SourceStack new_stack;
     new_stack.push_back(info);
@@ -64,9 +119,9 @@ void AutoFDOProfileReader::ReadSymbolProfile(const SourceStack &stack,
     }
     for (int j = 0; j < num_targets; j++) {
       // Only indirect call target histogram is supported now.
-      CHECK_EQ(gcov_read_unsigned(), HIST_TYPE_INDIR_CALL_TOPN);
-      const std::string &target_name = names_.at(gcov_read_counter());
-      uint64_t target_count = gcov_read_counter();
+      CHECK_EQ(gcov_.ReadUnsigned(), HIST_TYPE_INDIR_CALL_TOPN);
+      const std::string target_name = names_.at(gcov_.ReadCounter());
+      uint64_t target_count = ScaleCount(gcov_.ReadCounter());
       if (force_update_ || update) {
         symbol_map_->AddIndirectCallTarget(
             new_stack[new_stack.size() - 1].func_name,
@@ -78,7 +133,7 @@ void AutoFDOProfileReader::ReadSymbolProfile(const SourceStack &stack,
     // offset is encoded as:
     //   higher 16 bits: line offset to the start of the function.
     //   lower 16 bits: discriminator.
-    uint32_t offset = gcov_read_unsigned();
+    uint32_t offset = gcov_.ReadUnsigned();
     SourceInfo info(name, "", "", 0, offset >> 16, offset & 0xffff);
     SourceStack new_stack;
     new_stack.push_back(info);
@@ -88,39 +143,108 @@ void AutoFDOProfileReader::ReadSymbolProfile(const SourceStack &stack,
 }
 
 void AutoFDOProfileReader::ReadNameTable() {
-  CHECK_EQ(gcov_read_unsigned(), GCOV_TAG_AFDO_FILE_NAMES);
-  gcov_read_unsigned();
-  uint32_t name_vector_size = gcov_read_unsigned();
+  CHECK_EQ(gcov_.ReadUnsigned(), GCOV_TAG_AFDO_FILE_NAMES);
+  gcov_.ReadUnsigned();
+  uint32_t name_vector_size = gcov_.ReadUnsigned();
   for (uint32_t i = 0; i < name_vector_size; i++) {
-    names_.push_back(gcov_read_string());
+    const char *name = gcov_.ReadString();
+    CHECK(name != nullptr) << "Truncated name table";
+    names_.push_back(NameInterner::Global().InternName(name));
   }
 }
 
 void AutoFDOProfileReader::ReadWorkingSet() {
-  CHECK_EQ(gcov_read_unsigned(), GCOV_TAG_AFDO_WORKING_SET);
-  gcov_read_unsigned();
+  CHECK_EQ(gcov_.ReadUnsigned(), GCOV_TAG_AFDO_WORKING_SET);
+  gcov_.ReadUnsigned();
   for (uint32_t i = 0; i < NUM_GCOV_WORKING_SETS; i++) {
-    uint32_t num_counters = gcov_read_unsigned();
-    uint64_t min_counter = gcov_read_counter();
+    uint32_t num_counters = gcov_.ReadUnsigned();
+    uint64_t min_counter = gcov_.ReadCounter();
     symbol_map_->UpdateWorkingSet(
         i, num_counters * WORKING_SET_INSN_PER_BB, min_counter);
   }
 }
 
 bool AutoFDOProfileReader::ReadFromFile(const std::string &output_file) {
-  CHECK_NE(gcov_open(output_file.c_str(), 1), -1);
+  return ReadFile(output_file, nullptr);
+}
+
+bool AutoFDOProfileReader::ReadFunctionsFromFile(
+    const std::string &input_file,
+    const absl::flat_hash_set<std::string> &functions) {
+  return ReadFile(input_file, &functions);
+}
+
+bool AutoFDOProfileReader::ReadFunctionRecords(
+    const std::string &input_file, std::vector<FunctionRecord> *records) {
+  ReadHeader(input_file);
+  CHECK_EQ(gcov_.ReadUnsigned(), GCOV_TAG_AFDO_FUNCTION);
+  gcov_.ReadUnsigned();
+  uint32_t num_functions = gcov_.ReadUnsigned();
+  records->reserve(records->size() + num_functions);
+  for (uint32_t i = 0; i < num_functions; i++) {
+    const size_t offset = gcov_.read_offset();
+    const std::string name(PeekFunctionName());
+    records->push_back({name, offset, SkipSymbolProfile(true)});
+  }
+  CHECK(!gcov_.Close());
+  return true;
+}
+
+bool AutoFDOProfileReader::StreamFunctionsFromFile(
+    const std::string &input_file,
+    const std::function<bool(absl::string_view name)> &filter,
+    const FunctionCallback &callback) {
+  ReadHeader(input_file);
+  CHECK_EQ(gcov_.ReadUnsigned(), GCOV_TAG_AFDO_FUNCTION);
+  gcov_.ReadUnsigned();
+  uint32_t num_functions = gcov_.ReadUnsigned();
+  for (uint32_t i = 0; i < num_functions; i++) {
+    if (filter(PeekFunctionName())) {
+      StreamFunction(callback);
+    } else {
+      SkipSymbolProfile(true);
+    }
+  }
+  CHECK(!gcov_.Close());
+  return true;
+}
+
+bool AutoFDOProfileReader::StreamFunctionsAtOffsets(
+    const std::string &input_file, const std::vector<size_t> &offsets,
+    const FunctionCallback &callback) {
+  ReadHeader(input_file);
+  for (size_t offset : offsets) {
+    gcov_.SeekRead(offset);
+    StreamFunction(callback);
+  }
+  CHECK(!gcov_.Close());
+  return true;
+}
+
+void AutoFDOProfileReader::ReadHeader(const std::string &input_file) {
+  CHECK(gcov_.Open(input_file.c_str(), 1)) << input_file;
 
   // Read tags
-  CHECK_EQ(gcov_read_unsigned(), GCOV_DATA_MAGIC) << output_file;
-  absl::SetFlag(&FLAGS_gcov_version, gcov_read_unsigned());
-  gcov_read_unsigned();
+  CHECK_EQ(gcov_.ReadUnsigned(), GCOV_DATA_MAGIC) << input_file;
+  // Strings are encoded as expected by the version in the header. Tools
+  // that write the profile back, e.g. profile_merger, keep that version.
+  gcov_.set_version(gcov_.ReadUnsigned());
+  absl::SetFlag(&FLAGS_gcov_version, gcov_.version());
+  gcov_.ReadUnsigned();
 
+  names_.clear();
   ReadNameTable();
-  ReadFunctionProfile();
+}
+
+bool AutoFDOProfileReader::ReadFile(
+    const std::string &input_file,
+    const absl::flat_hash_set<std::string> *functions) {
+  ReadHeader(input_file);
+  ReadFunctionProfile(functions);
   ReadModuleGroup();
   ReadWorkingSet();
 
-  CHECK(!gcov_close());
+  CHECK(!gcov_.Close());
 
   return true;
 }
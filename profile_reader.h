@@ -4,11 +4,17 @@
 #ifndef AUTOFDO_PROFILE_READER_H_
 #define AUTOFDO_PROFILE_READER_H_
 
+#include <cstddef>
+#include <cstdint>
+#include <functional>
 #include <string>
 #include <vector>
 
 #include "base_profile_reader.h"
+#include "gcov.h"
 #include "symbol_map.h"
+#include "third_party/abseil/absl/container/flat_hash_set.h"
+#include "third_party/abseil/absl/strings/string_view.h"
 
 namespace devtools_crosstool_autofdo {
 
@@ -25,6 +31,47 @@ class AutoFDOProfileReader : public ProfileReader {
 
   bool ReadFromFile(const std::string &output_file) override;
 
+  // Same as ReadFromFile, but only the top-level functions named in
+  // FUNCTIONS are read into the symbol map. The records of the other
+  // functions are skipped over without being decoded.
+  bool ReadFunctionsFromFile(const std::string &input_file,
+                             const absl::flat_hash_set<std::string> &functions);
+
+  // A top-level function record of a profile file.
+  struct FunctionRecord {
+    std::string name;
+    // The offset of the record from the start of the file.
+    size_t offset;
+    // The sum of the counts of the function and its inline instances.
+    uint64_t total_count;
+  };
+
+  // Lists the top-level function records of INPUT_FILE in file order,
+  // without decoding them.
+  bool ReadFunctionRecords(const std::string &input_file,
+                           std::vector<FunctionRecord> *records);
+
+  // Called with an otherwise empty symbol map holding one top-level function.
+  using FunctionCallback = std::function<void(const SymbolMap &symbol_map)>;
+
+  // Reads the top-level functions of INPUT_FILE whose names pass FILTER one
+  // at a time, in file order, and calls CALLBACK for each. Only one function
+  // is held in memory at a time, and the other records are skipped without
+  // being decoded. The symbol map passed to the constructor is not used.
+  bool StreamFunctionsFromFile(
+      const std::string &input_file,
+      const std::function<bool(absl::string_view name)> &filter,
+      const FunctionCallback &callback);
+
+  // Same as StreamFunctionsFromFile, but reads only the records at OFFSETS,
+  // as returned by ReadFunctionRecords for the same file.
+  bool StreamFunctionsAtOffsets(const std::string &input_file,
+                                const std::vector<size_t> &offsets,
+                                const FunctionCallback &callback);
+
+  // Returns the gcov version found in the header of the last file read.
+  uint64_t gcov_version() const { return gcov_.version(); }
+
  private:
   void ReadWorkingSet();
   // Reads the module grouping info into the gcda file.
@@ -42,7 +89,19 @@ class AutoFDOProfileReader : public ProfileReader {
   // Length of the section (will always be 0)
   // Number of modules (will always be 0)
   void ReadModuleGroup();
-  void ReadFunctionProfile();
+  // Reads all the top-level functions if FUNCTIONS is null, and only those
+  // named in FUNCTIONS otherwise.
+  void ReadFunctionProfile(const absl::flat_hash_set<std::string> *functions);
+  bool ReadFile(const std::string &input_file,
+                const absl::flat_hash_set<std::string> *functions);
+  // Opens INPUT_FILE and reads everything before the function profiles.
+  void ReadHeader(const std::string &input_file);
+  // Returns the name of the top-level function record at the read offset,
+  // without moving it.
+  absl::string_view PeekFunctionName();
+  // Reads the top-level function record at the read offset into a new
+  // symbol map and passes it to CALLBACK.
+  void StreamFunction(const FunctionCallback &callback);
   // Reads in profile recursively. Updates the symbol_map_ if update or
   // force_update_ is true. Otherwise just read in and dump the data.
   // The reason we need "update" is because during profile_update, we first
@@ -54,11 +113,17 @@ class AutoFDOProfileReader : public ProfileReader {
   // where symbol_map was built purely from profile thus alias symbol info
   // is not available. In that case, we should always update the symbol.
   void ReadSymbolProfile(const SourceStack &stack, bool update);
+  // Moves past one symbol profile, including its inlined callees, without
+  // decoding it. Returns the sum of its counts.
+  uint64_t SkipSymbolProfile(bool top_level);
   void ReadNameTable();
 
   SymbolMap *symbol_map_;
   bool force_update_;
-  std::vector<std::string> names_;
+  // The name table of the profile, interned in NameInterner::Global().
+  std::vector<const char *> names_;
+  // The input file, one per reader.
+  GcovStream gcov_;
 };
 
 }  // namespace devtools_crosstool_autofdo
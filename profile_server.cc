@@ -0,0 +1,259 @@
+#if defined(HAVE_LLVM)
+#include "profile_server.h"
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <utility>
+
+#include "base/logging.h"
+#include "addr2line.h"
+#include "llvm_profile_writer.h"
+#include "profile_creator.h"
+#include "status_consumer_registry.h"
+#include "symbol_map.h"
+#include "symbolize/elf_reader.h"
+#include "third_party/abseil/absl/status/status.h"
+#include "third_party/abseil/absl/status/statusor.h"
+#include "third_party/abseil/absl/strings/ascii.h"
+#include "third_party/abseil/absl/strings/match.h"
+#include "third_party/abseil/absl/strings/str_cat.h"
+#include "third_party/abseil/absl/strings/str_split.h"
+#include "third_party/abseil/absl/strings/string_view.h"
+#include "third_party/abseil/absl/synchronization/mutex.h"
+#include "llvm/ProfileData/SampleProf.h"
+
+namespace devtools_crosstool_autofdo {
+namespace {
+// Request line that stops ServeUnixSocket.
+constexpr absl::string_view kShutdownRequest = "shutdown";
+
+absl::StatusOr<llvm::sampleprof::SampleProfileFormat> GetOutputFormat(
+    absl::string_view format) {
+  if (format == "text") return llvm::sampleprof::SPF_Text;
+  if (format == "binary") return llvm::sampleprof::SPF_Binary;
+  if (format == "extbinary") return llvm::sampleprof::SPF_Ext_Binary;
+  return absl::InvalidArgumentError(
+      absl::StrCat("format=", format,
+                   " is not supported by the profile server. Use one of "
+                   "'text', 'binary' or 'extbinary'."));
+}
+
+// Closes the socket when it goes out of scope.
+struct ScopedSocket {
+  ~ScopedSocket() {
+    if (fd >= 0) close(fd);
+  }
+  int fd = -1;
+};
+
+// Stops the status consumers when it goes out of scope, see RegistryStopper in
+// llvm_propeller_profile_writer.cc.
+struct ScopedStatusConsumers {
+  ~ScopedStatusConsumers() {
+    if (registry) registry->Stop();
+  }
+  StatusConsumerRegistry *registry = nullptr;
+};
+}  // namespace
+
+absl::StatusOr<ProfileRequest> ParseProfileRequest(absl::string_view line) {
+  ProfileRequest request;
+  for (absl::string_view field :
+       absl::StrSplit(line, absl::ByAnyChar(" \t\r\n"), absl::SkipEmpty())) {
+    std::pair<absl::string_view, absl::string_view> key_value =
+        absl::StrSplit(field, absl::MaxSplits('=', 1));
+    const absl::string_view key = key_value.first;
+    const std::string value(key_value.second);
+    if (key == "binary") {
+      request.binary = value;
+    } else if (key == "profile") {
+      request.profile = value;
+    } else if (key == "profiler") {
+      request.profiler = value;
+    } else if (key == "out") {
+      request.out = value;
+    } else if (key == "format") {
+      request.format = value;
+    } else if (key == "prof_sym_list") {
+      if (value != "true" && value != "false") {
+        return absl::InvalidArgumentError(
+            absl::StrCat("prof_sym_list must be true or false, not '", value,
+                         "'."));
+      }
+      request.prof_sym_list = value == "true";
+    } else {
+      return absl::InvalidArgumentError(
+          absl::StrCat("Unknown request field '", field, "'."));
+    }
+  }
+  if (request.binary.empty() || request.out.empty()) {
+    return absl::InvalidArgumentError(
+        "A request needs a binary and an out file name.");
+  }
+  return request;
+}
+
+absl::StatusOr<ProfileServer::BinaryState *> ProfileServer::GetBinaryState(
+    const std::string &binary) {
+  std::shared_ptr<ElfReader> elf_reader = ElfReader::GetShared(binary);
+  std::string key = elf_reader->GetBuildId();
+  if (key.empty()) key = absl::StrCat("file:", binary);
+  ++use_counter_;
+
+  auto it = binaries_.find(key);
+  if (it != binaries_.end()) {
+    ++num_warm_requests_;
+    it->second->last_use = use_counter_;
+    return it->second.get();
+  }
+
+  auto state = std::make_unique<BinaryState>();
+  state->elf_reader = std::move(elf_reader);
+  state->addr2line.reset(Addr2line::Create(binary));
+  if (state->addr2line == nullptr) {
+    return absl::FailedPreconditionError(
+        absl::StrCat("Error reading binary ", binary));
+  }
+  state->binary_symbols = std::make_unique<SymbolMap>(binary);
+  state->last_use = use_counter_;
+
+  if (binaries_.size() >= options_.max_binaries) {
+    auto least_recently_used = binaries_.begin();
+    for (auto i = binaries_.begin(); i != binaries_.end(); ++i) {
+      if (i->second->last_use < least_recently_used->second->last_use)
+        least_recently_used = i;
+    }
+    LOG(INFO) << "Dropping the state of a binary to make room for " << binary;
+    binaries_.erase(least_recently_used);
+  }
+  return binaries_.emplace(std::move(key), std::move(state))
+      .first->second.get();
+}
+
+absl::Status ProfileServer::CreateProfile(const ProfileRequest &request) {
+  absl::StatusOr<llvm::sampleprof::SampleProfileFormat> format =
+      GetOutputFormat(request.format);
+  if (!format.ok()) return format.status();
+  if (request.prof_sym_list && *format != llvm::sampleprof::SPF_Ext_Binary) {
+    return absl::InvalidArgumentError(
+        "prof_sym_list is only supported with format=extbinary.");
+  }
+
+  absl::MutexLock lock(&mutex_);
+  absl::StatusOr<BinaryState *> state = GetBinaryState(request.binary);
+  if (!state.ok()) return state.status();
+  std::unique_ptr<SymbolMap> symbol_map =
+      (*state)->binary_symbols->CopyBinarySymbols();
+  symbol_map->set_addr2line((*state)->addr2line);
+
+  LLVMProfileWriter writer(*format);
+  ProfileCreator creator(request.binary);
+  if (!creator.CreateProfileWithSymbolMap(request.profile, request.profiler,
+                                          &writer, request.out,
+                                          symbol_map.get(),
+                                          request.prof_sym_list)) {
+    return absl::InternalError(absl::StrCat(
+        "Failed to create the profile of ", request.binary, " from ",
+        request.profile, "."));
+  }
+  status_.AddSamplesProcessed(creator.TotalSamples());
+  return absl::OkStatus();
+}
+
+void ProfileServer::HandleConnection(int connection, bool &shutdown) {
+  std::string line;
+  char buffer[4096];
+  while (!absl::StrContains(line, '\n')) {
+    ssize_t n = read(connection, buffer, sizeof(buffer));
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) break;
+    line.append(buffer, n);
+  }
+  line = line.substr(0, line.find('\n'));
+
+  std::string reply = "OK\n";
+  if (absl::StripAsciiWhitespace(line) == kShutdownRequest) {
+    shutdown = true;
+  } else {
+    absl::StatusOr<ProfileRequest> request = ParseProfileRequest(line);
+    absl::Status status =
+        request.ok() ? CreateProfile(*request) : request.status();
+    if (!status.ok()) {
+      LOG(ERROR) << status;
+      reply = absl::StrCat("ERROR ", status.message(), "\n");
+    }
+  }
+  for (absl::string_view rest = reply; !rest.empty();) {
+    ssize_t n = write(connection, rest.data(), rest.size());
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) break;
+    rest.remove_prefix(n);
+  }
+}
+
+absl::Status ProfileServer::ServeUnixSocket(const std::string &socket_path) {
+  sockaddr_un address = {};
+  address.sun_family = AF_UNIX;
+  if (socket_path.size() >= sizeof(address.sun_path)) {
+    return absl::InvalidArgumentError(
+        absl::StrCat("Socket path ", socket_path, " is too long."));
+  }
+  strncpy(address.sun_path, socket_path.c_str(), sizeof(address.sun_path) - 1);
+
+  ScopedSocket listener;
+  listener.fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (listener.fd < 0) {
+    return absl::InternalError(
+        absl::StrCat("Cannot create a socket: ", strerror(errno)));
+  }
+  unlink(socket_path.c_str());
+  if (bind(listener.fd, reinterpret_cast<const sockaddr *>(&address),
+           sizeof(address)) < 0 ||
+      listen(listener.fd, SOMAXCONN) < 0) {
+    return absl::InternalError(absl::StrCat("Cannot listen on ", socket_path,
+                                            ": ", strerror(errno)));
+  }
+
+  // "consumers" must be declared after "listener", so the consumers are
+  // stopped before the socket is closed.
+  ScopedStatusConsumers consumers;
+  if (options_.http) {
+    consumers.registry = &StatusConsumerRegistry::GetInstance();
+    consumers.registry->Start(status_);
+  }
+  LOG(INFO) << "Serving profile requests on " << socket_path;
+  bool shutdown = false;
+  while (!shutdown) {
+    ScopedSocket connection;
+    connection.fd = accept(listener.fd, nullptr, nullptr);
+    if (connection.fd < 0) {
+      if (errno == EINTR) continue;
+      return absl::InternalError(
+          absl::StrCat("Cannot accept a connection: ", strerror(errno)));
+    }
+    HandleConnection(connection.fd, shutdown);
+  }
+  status_.SetDone();
+  unlink(socket_path.c_str());
+  return absl::OkStatus();
+}
+
+int ProfileServer::num_resident_binaries() const {
+  absl::MutexLock lock(&mutex_);
+  return binaries_.size();
+}
+
+int64_t ProfileServer::num_warm_requests() const {
+  absl::MutexLock lock(&mutex_);
+  return num_warm_requests_;
+}
+
+}  // namespace devtools_crosstool_autofdo
+#endif  // HAVE_LLVM
@@ -0,0 +1,123 @@
+// Long-running server that creates AutoFDO profiles on request, keeping the
+// symbolization state of the binaries it has seen resident between requests.
+
+#ifndef AUTOFDO_PROFILE_SERVER_H_
+#define AUTOFDO_PROFILE_SERVER_H_
+
+#if defined(HAVE_LLVM)
+#include <cstdint>
+#include <memory>
+#include <string>
+
+#include "addr2line.h"
+#include "status_provider.h"
+#include "symbol_map.h"
+#include "symbolize/elf_reader.h"
+#include "third_party/abseil/absl/base/thread_annotations.h"
+#include "third_party/abseil/absl/container/flat_hash_map.h"
+#include "third_party/abseil/absl/status/status.h"
+#include "third_party/abseil/absl/status/statusor.h"
+#include "third_party/abseil/absl/strings/string_view.h"
+#include "third_party/abseil/absl/synchronization/mutex.h"
+
+namespace devtools_crosstool_autofdo {
+
+// Asks the server to create the profile of `binary` from the samples in
+// `profile`, as create_llvm_prof does with the flags of the same names.
+struct ProfileRequest {
+  std::string binary;
+  std::string profile;
+  std::string profiler = "perf";
+  std::string out;
+  // One of "text", "binary" or "extbinary".
+  std::string format = "text";
+  bool prof_sym_list = false;
+};
+
+// Parses a request from `line`, which holds space-separated `key=value` pairs
+// whose keys are the fields of ProfileRequest, e.g.
+//   binary=/path/a.out profile=/path/perf.data out=/path/a.afdo
+// Only `binary` and `out` are required.
+absl::StatusOr<ProfileRequest> ParseProfileRequest(absl::string_view line);
+
+struct ProfileServerOptions {
+  // Maximum number of binaries whose state is kept resident. The state of the
+  // least recently used binary is dropped to make room for a new one.
+  int max_binaries = 8;
+  // Whether to report the status of the server to StatusConsumerRegistry
+  // while serving, as --http does for a single run.
+  bool http = false;
+};
+
+// Creates profiles with only the per-request work: reading the samples,
+// computing the profile and writing it. The symbols and the debug info of
+// every binary are read once, on the first request for the binary's build id,
+// and reused by the later requests.
+//
+// Requests are processed one at a time, since the symbolization state and
+// parts of the profile computation are not safe to use concurrently.
+class ProfileServer {
+ public:
+  explicit ProfileServer(const ProfileServerOptions &options)
+      : options_(options), status_("profile server") {}
+
+  ProfileServer(const ProfileServer &) = delete;
+  ProfileServer &operator=(const ProfileServer &) = delete;
+
+  // Creates the profile asked for by `request`.
+  absl::Status CreateProfile(const ProfileRequest &request)
+      ABSL_LOCKS_EXCLUDED(mutex_);
+
+  // Listens on the Unix domain socket `socket_path` until a client sends
+  // "shutdown". Every connection sends one request line, as parsed by
+  // ParseProfileRequest, and reads back "OK" or "ERROR <message>" once the
+  // profile is written.
+  absl::Status ServeUnixSocket(const std::string &socket_path)
+      ABSL_LOCKS_EXCLUDED(mutex_);
+
+  // Returns the number of binaries whose state is resident.
+  int num_resident_binaries() const ABSL_LOCKS_EXCLUDED(mutex_);
+
+  // Returns the number of requests whose binary state was already resident.
+  int64_t num_warm_requests() const ABSL_LOCKS_EXCLUDED(mutex_);
+
+ private:
+  // The state of one binary reused by all the requests for it.
+  struct BinaryState {
+    // Keeps the binary open, so the symbol maps and the sample readers of the
+    // requests share it.
+    std::shared_ptr<ElfReader> elf_reader;
+    // The symbols of the binary, without any profile. Every request computes
+    // its profile into a copy.
+    std::unique_ptr<SymbolMap> binary_symbols;
+    // Reads the debug info lazily and caches it, so later requests symbolize
+    // the addresses of the functions seen before without reading it again.
+    std::shared_ptr<Addr2line> addr2line;
+    // Value of `use_counter_` at the last request for the binary.
+    uint64_t last_use = 0;
+  };
+
+  // Returns the state of `binary`, creating it if its build id is not
+  // resident yet.
+  absl::StatusOr<BinaryState *> GetBinaryState(const std::string &binary)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(mutex_);
+
+  // Replies to the request sent on the socket `connection`. Sets `shutdown`
+  // if the client asked the server to stop.
+  void HandleConnection(int connection, bool &shutdown)
+      ABSL_LOCKS_EXCLUDED(mutex_);
+
+  const ProfileServerOptions options_;
+  DefaultStatusProvider status_;
+  mutable absl::Mutex mutex_;
+  // Keyed by build id, or by file name for binaries without a build id.
+  absl::flat_hash_map<std::string, std::unique_ptr<BinaryState>> binaries_
+      ABSL_GUARDED_BY(mutex_);
+  uint64_t use_counter_ ABSL_GUARDED_BY(mutex_) = 0;
+  int64_t num_warm_requests_ ABSL_GUARDED_BY(mutex_) = 0;
+};
+
+}  // namespace devtools_crosstool_autofdo
+
+#endif  // HAVE_LLVM
+#endif  // AUTOFDO_PROFILE_SERVER_H_
@@ -0,0 +1,102 @@
+#include "profile_server.h"
+
+#include <fstream>
+#include <sstream>
+#include <string>
+
+#include "llvm_profile_writer.h"
+#include "profile_creator.h"
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+#include "third_party/abseil/absl/status/status.h"
+#include "third_party/abseil/absl/status/statusor.h"
+#include "third_party/abseil/absl/strings/str_cat.h"
+#include "llvm/ProfileData/SampleProf.h"
+
+#define FLAGS_test_tmpdir std::string(testing::UnitTest::GetInstance()->original_working_dir())
+
+#define FLAGS_test_srcdir std::string(testing::UnitTest::GetInstance()->original_working_dir())
+
+namespace devtools_crosstool_autofdo {
+namespace {
+
+std::string ReadFile(const std::string &file_name) {
+  std::ifstream in(file_name);
+  std::stringstream contents;
+  contents << in.rdbuf();
+  return contents.str();
+}
+
+TEST(ProfileServerTest, ParseProfileRequest) {
+  absl::StatusOr<ProfileRequest> request = ParseProfileRequest(
+      "binary=a.out  profile=perf.data out=a.afdo format=extbinary "
+      "prof_sym_list=true\n");
+  ASSERT_TRUE(request.ok()) << request.status();
+  EXPECT_EQ(request->binary, "a.out");
+  EXPECT_EQ(request->profile, "perf.data");
+  EXPECT_EQ(request->profiler, "perf");
+  EXPECT_EQ(request->out, "a.afdo");
+  EXPECT_EQ(request->format, "extbinary");
+  EXPECT_TRUE(request->prof_sym_list);
+
+  EXPECT_EQ(ParseProfileRequest("binary=a.out out=a.afdo color=red")
+                .status()
+                .code(),
+            absl::StatusCode::kInvalidArgument);
+  EXPECT_EQ(ParseProfileRequest("profile=perf.data out=a.afdo").status().code(),
+            absl::StatusCode::kInvalidArgument);
+}
+
+TEST(ProfileServerTest, WarmRequestsCreateTheSameProfile) {
+  const std::string binary =
+      absl::StrCat(FLAGS_test_srcdir, "/testdata/llvm_function_samples.binary");
+  const std::string profile = absl::StrCat(
+      FLAGS_test_srcdir, "/testdata/llvm_function_samples_perf.data");
+
+  const std::string expected_out =
+      absl::StrCat(FLAGS_test_tmpdir, "/profile_server_test.expected.afdo");
+  {
+    LLVMProfileWriter writer(llvm::sampleprof::SPF_Text);
+    ProfileCreator creator(binary);
+    ASSERT_TRUE(creator.CreateProfile(profile, "perf", &writer, expected_out));
+  }
+  const std::string expected = ReadFile(expected_out);
+  ASSERT_FALSE(expected.empty());
+
+  ProfileServer server(ProfileServerOptions{});
+  ProfileRequest request;
+  request.binary = binary;
+  request.profile = profile;
+  for (int i = 0; i < 2; ++i) {
+    request.out =
+        absl::StrCat(FLAGS_test_tmpdir, "/profile_server_test.", i, ".afdo");
+    absl::Status status = server.CreateProfile(request);
+    ASSERT_TRUE(status.ok()) << status;
+    EXPECT_EQ(ReadFile(request.out), expected);
+  }
+  EXPECT_EQ(server.num_resident_binaries(), 1);
+  EXPECT_EQ(server.num_warm_requests(), 1);
+}
+
+TEST(ProfileServerTest, DropsLeastRecentlyUsedBinary) {
+  ProfileServerOptions options;
+  options.max_binaries = 1;
+  ProfileServer server(options);
+  ProfileRequest request;
+  request.binary =
+      absl::StrCat(FLAGS_test_srcdir, "/testdata/llvm_function_samples.binary");
+  request.profile = absl::StrCat(FLAGS_test_srcdir,
+                                 "/testdata/llvm_function_samples_perf.data");
+  request.out = absl::StrCat(FLAGS_test_tmpdir, "/profile_server_test.afdo");
+  ASSERT_TRUE(server.CreateProfile(request).ok());
+
+  // test.binary has no samples in the perf data, which fails the request
+  // after its state is created.
+  request.binary = absl::StrCat(FLAGS_test_srcdir, "/testdata/test.binary");
+  server.CreateProfile(request).IgnoreError();
+  EXPECT_EQ(server.num_resident_binaries(), 1);
+  EXPECT_EQ(server.num_warm_requests(), 0);
+}
+
+}  // namespace
+}  // namespace devtools_crosstool_autofdo
@@ -5,8 +5,10 @@
 #include <functional>
 #include <numeric>
 #include <string>
+#include <utility>
 #include <vector>
 
+#include "parallel_for.h"
 #include "symbol_map.h"
 #include "third_party/abseil/absl/flags/flag.h"
 #include "llvm/ProfileData/SampleProf.h"
@@ -26,10 +28,13 @@ bool IsValid(double ratio) { return ratio >= 0.0 && ratio <= 1.0; }
 // Precondition: one of `symbol_list_size_coverage_ratio` and the
 // FLAGS_symbol_list_size_coverage_ratio must be -1.0, the other one must be a
 // valid value in range [0.0, 1.0].
+//
+// The original names of the symbols are computed on up to num_threads threads.
 void fillProfileSymbolList(llvm::sampleprof::ProfileSymbolList *prof_sym_list,
                            const NameSizeList &name_size_list,
                            const SymbolMap *symbol_map,
-                           double symbol_list_size_coverage_ratio) {
+                           double symbol_list_size_coverage_ratio,
+                           int num_threads) {
   if (name_size_list.empty()) {
     return;
   }
@@ -66,16 +71,41 @@ void fillProfileSymbolList(llvm::sampleprof::ProfileSymbolList *prof_sym_list,
   uint64_t cutoff = sizes[std::distance(psum.begin(), lower)];
 
   // Add symbol names with size larger than or equal to the cutoff into
-  // prof_sym_list.
-  for (const auto &symbol_entry : name_size_list) {
-    if (symbol_entry.second >= cutoff) {
-      const llvm::StringRef &name = symbol_entry.first;
+  // prof_sym_list. Names with an elided suffix are added as their original
+  // names, which are computed for chunks of the list on separate threads.
+  // The list is then streamed into prof_sym_list in order, and every
+  // original name is only copied into it once.
+  constexpr size_t kNamesPerChunk = 1 << 12;
+  const int num_chunks =
+      (name_size_list.size() + kNamesPerChunk - 1) / kNamesPerChunk;
+  // The original names of each chunk that differ from the names in the list,
+  // by position in the list.
+  std::vector<std::vector<std::pair<size_t, std::string>>> original_names(
+      num_chunks);
+  ParallelFor(num_threads, num_chunks, [&](int chunk) {
+    const size_t end =
+        std::min(name_size_list.size(), (chunk + 1) * kNamesPerChunk);
+    for (size_t i = chunk * kNamesPerChunk; i < end; ++i) {
+      if (name_size_list[i].second < cutoff) continue;
+      const llvm::StringRef &name = name_size_list[i].first;
       std::string original_name = symbol_map->GetOriginalName(name.data());
-      if (original_name == name) {
-        prof_sym_list->add(name);
+      if (original_name != name)
+        original_names[chunk].emplace_back(i, std::move(original_name));
+    }
+  });
+  for (int chunk = 0; chunk < num_chunks; ++chunk) {
+    auto original = original_names[chunk].begin();
+    const size_t end =
+        std::min(name_size_list.size(), (chunk + 1) * kNamesPerChunk);
+    for (size_t i = chunk * kNamesPerChunk; i < end; ++i) {
+      if (name_size_list[i].second < cutoff) continue;
+      if (original == original_names[chunk].end() || original->first != i) {
+        prof_sym_list->add(name_size_list[i].first);
         continue;
       }
-      prof_sym_list->add(original_name, true);
+      if (!prof_sym_list->contains(original->second))
+        prof_sym_list->add(original->second, true);
+      ++original;
     }
   }
 }
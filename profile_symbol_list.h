@@ -22,7 +22,9 @@
       "different values for different targets -- the flag will override "  \
       "them with a single value. ");                                       \
   ABSL_FLAG(bool, compress_symbol_list, true,                              \
-            "whether to compress the symbol list.");
+            "whether to compress the symbol list.");                       \
+  ABSL_FLAG(uint32_t, symbol_list_threads, 1,                              \
+            "Number of threads used to collect the symbol list.");
 
 namespace devtools_crosstool_autofdo {
 
@@ -32,7 +34,8 @@ using SymbolList = std::vector<std::pair<llvm::StringRef, uint64_t>>;
 void fillProfileSymbolList(llvm::sampleprof::ProfileSymbolList *prof_sym_list,
                            const NameSizeList &name_size_list,
                            const SymbolMap *symbol_map,
-                           double symbol_list_size_coverage_ratio = -1.0);
+                           double symbol_list_size_coverage_ratio = -1.0,
+                           int num_threads = 1);
 
 }  // namespace devtools_crosstool_autofdo
 
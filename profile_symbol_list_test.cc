@@ -1,9 +1,12 @@
 #include "profile_symbol_list.h"
 
 #include <memory>
+#include <string>
+#include <vector>
 
 #include "gmock/gmock.h"
 #include "third_party/abseil/absl/memory/memory.h"
+#include "third_party/abseil/absl/strings/str_cat.h"
 
 #define FLAGS_test_tmpdir std::string(testing::UnitTest::GetInstance()->original_working_dir())
 
@@ -61,5 +64,27 @@ TEST(ProfileSymbolListTest, Threshold001Size0) {
   EXPECT_EQ(list->size(), 0);
 }
 
+TEST(ProfileSymbolListTest, OriginalNamesDoNotDependOnThreads) {
+  SymbolMap map;
+  map.set_suffix_elision_policy("selected");
+  // Enough names for several chunks, whose suffixes are elided.
+  std::vector<std::string> names;
+  for (int i = 0; i < 10000; ++i)
+    names.push_back(absl::StrCat("f", i / 2, ".llvm.", i));
+  names.push_back("g");
+  NameSizeList name_size_list;
+  for (const std::string &name : names) name_size_list.emplace_back(name, 1);
+  for (int num_threads : {1, 4}) {
+    auto list = std::make_unique<llvm::sampleprof::ProfileSymbolList>();
+    fillProfileSymbolList(list.get(), name_size_list, &map,
+                          /*size_threshold_frac=*/1.0, num_threads);
+    EXPECT_EQ(list->size(), 5001);
+    EXPECT_TRUE(list->contains("f0"));
+    EXPECT_TRUE(list->contains("f4999"));
+    EXPECT_TRUE(list->contains("g"));
+    EXPECT_FALSE(list->contains("f0.llvm.0"));
+  }
+}
+
 }  // namespace
 }  // namespace devtools_crosstool_autofdo
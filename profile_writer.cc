@@ -8,10 +8,12 @@
 #include <stdio.h>
 
 #include <algorithm>
+#include <atomic>
 #include <cstdint>
 #include <map>
 #include <set>
 #include <string>
+#include <thread>  // NOLINT(build/c++11)
 #include <utility>
 #include <vector>
 
@@ -19,9 +21,12 @@
 #include "base/integral_types.h"
 #include "base/logging.h"
 #include "gcov.h"
+#include "parallel_for.h"
 #include "profile.h"
+#include "profile_index.h"
 #include "symbol_map.h"
 #include "third_party/abseil/absl/flags/flag.h"
+#include "third_party/abseil/absl/strings/match.h"
 #include "third_party/abseil/absl/strings/str_format.h"
 
 // sizeof(gcov_unsigned_t)
@@ -29,30 +34,58 @@
 
 ABSL_FLAG(bool, debug_dump, false,
             "If set, emit additional debugging dumps to stderr.");
+ABSL_FLAG(uint32_t, profile_writer_threads, 1,
+          "Number of threads used to encode the function records of an "
+          "AutoFDO profile, or to convert the functions of an LLVM profile. "
+          "The output does not depend on it.");
+ABSL_FLAG(bool, write_profile_index, false,
+          "If set, AutoFDO profiles are written along with an index of their "
+          "function records, in <profile>.idx, which lets dump_gcov read "
+          "single functions or the hottest ones without a scan of the "
+          "profile.");
 
 namespace devtools_crosstool_autofdo {
 // Opens the output file, and writes the header.
 bool AutoFDOProfileWriter::WriteHeader(const std::string &output_filename) {
-  if (gcov_open(output_filename.c_str(), -1) == -1) {
+  if (!gcov_.Open(output_filename.c_str(), -1)) {
     LOG(FATAL) << "Cannot open file " << output_filename;
     return false;
   }
 
-  gcov_write_unsigned(GCOV_DATA_MAGIC);
-  gcov_write_unsigned(gcov_version_);
-  gcov_write_unsigned(0);
+  gcov_.WriteUnsigned(GCOV_DATA_MAGIC);
+  gcov_.WriteUnsigned(gcov_version_);
+  gcov_.WriteUnsigned(0);
   return true;
 }
 
 // Finishes writing, closes the output file.
 bool AutoFDOProfileWriter::WriteFinish() {
-  if (gcov_close()) {
+  if (gcov_.Close()) {
     LOG(ERROR) << "Cannot close the gcov file.";
     return false;
   }
   return true;
 }
 
+namespace {
+// Returns NAME as it is written to the name table of the profile.
+std::string GetNameInProfile(const std::string &name) {
+  std::string c = name;
+  const int len = c.size();
+  // Workaround https://gcc.gnu.org/bugzilla/show_bug.cgi?id=64346
+  // We should not have D4Ev in our profile because it does not exist
+  // in symbol table and would lead to undefined symbols during linking.
+  if (len > 5 && (absl::EndsWith(c, "D4Ev") || absl::EndsWith(c, "C4Ev"))) {
+    c[len - 3] = '2';
+  } else if (len > 7 && absl::EndsWith(c, "C4EPKc")) {
+    c[len - 5] = '2';
+  } else if (len > 12 && absl::EndsWith(c, "C4EPKcRKS2_")) {
+    c[len - 10] = '2';
+  }
+  return c;
+}
+}  // namespace
+
 class SourceProfileLengther: public SymbolTraverser {
  public:
   explicit SourceProfileLengther(const SymbolMap &symbol_map)
@@ -87,41 +120,75 @@ class SourceProfileLengther: public SymbolTraverser {
   DISALLOW_COPY_AND_ASSIGN(SourceProfileLengther);
 };
 
+// Encodes gcov words into memory, in the same layout as GcovStream.
+class GcovRecord {
+ public:
+  void WriteUnsigned(uint32 value) {
+    data_.append(reinterpret_cast<const char *>(&value), 4);
+  }
+  void WriteCounter(uint64 value) {
+    WriteUnsigned(static_cast<uint32>(value));
+    WriteUnsigned(static_cast<uint32>(value >> 32));
+  }
+  std::string *mutable_data() { return &data_; }
+
+ private:
+  std::string data_;
+};
+
 class SourceProfileWriter: public SymbolTraverser {
  public:
-  static void Write(const SymbolMap &symbol_map, const StringIndexMap &map) {
-    SourceProfileWriter writer(map);
-    writer.Start(symbol_map);
+  // Encodes the symbol profile of every function in FUNCTIONS, each into its
+  // own buffer of RECORDS. The functions are encoded by NUM_THREADS threads.
+  static void Write(
+      const std::vector<const NameSymbolMap::value_type *> &functions,
+      const StringIndexMap &map, int num_threads,
+      std::vector<std::string> *records) {
+    records->assign(functions.size(), std::string());
+    std::atomic<size_t> next_function{0};
+    auto encode = [&]() {
+      SourceProfileWriter writer(map);
+      for (size_t f = next_function++; f < functions.size();
+           f = next_function++) {
+        writer.VisitTopSymbol(functions[f]->first, functions[f]->second);
+        writer.Traverse(functions[f]->second);
+        (*records)[f].swap(*writer.gcov_.mutable_data());
+      }
+    };
+    num_threads = std::max(
+        1, static_cast<int>(std::min<size_t>(num_threads, functions.size())));
+    std::vector<std::thread> workers;
+    for (int i = 1; i < num_threads; ++i) workers.emplace_back(encode);
+    encode();
+    for (std::thread &worker : workers) worker.join();
   }
 
  protected:
   virtual void Visit(const Symbol *node) {
-    gcov_write_unsigned(node->pos_counts.size());
-    gcov_write_unsigned(node->callsites.size());
+    gcov_.WriteUnsigned(node->pos_counts.size());
+    gcov_.WriteUnsigned(node->callsites.size());
     for (const auto &pos_count : node->pos_counts) {
       uint64_t value = pos_count.first;
-      gcov_write_unsigned(SourceInfo::GenerateCompressedOffset(value));
-      gcov_write_unsigned(pos_count.second.target_map.size());
-      gcov_write_counter(pos_count.second.count);
-      TargetCountPairs target_counts;
-      GetSortedTargetCountPairs(pos_count.second.target_map, &target_counts);
+      gcov_.WriteUnsigned(SourceInfo::GenerateCompressedOffset(value));
+      gcov_.WriteUnsigned(pos_count.second.target_map.size());
+      gcov_.WriteCounter(pos_count.second.count);
       for (const auto &target_count : pos_count.second.target_map) {
-        gcov_write_unsigned(HIST_TYPE_INDIR_CALL_TOPN);
-        gcov_write_counter(GetStringIndex(target_count.first));
-        gcov_write_counter(target_count.second);
+        gcov_.WriteUnsigned(HIST_TYPE_INDIR_CALL_TOPN);
+        gcov_.WriteCounter(GetStringIndex(target_count.first));
+        gcov_.WriteCounter(target_count.second);
       }
     }
   }
 
   virtual void VisitTopSymbol(const std::string &name, const Symbol *node) {
-    gcov_write_counter(node->head_count);
-    gcov_write_unsigned(GetStringIndex(Symbol::Name(name.c_str())));
+    gcov_.WriteCounter(node->head_count);
+    gcov_.WriteUnsigned(GetStringIndex(Symbol::Name(name.c_str())));
   }
 
   virtual void VisitCallsite(const Callsite &callsite) {
     uint64_t value = callsite.first;
-    gcov_write_unsigned(SourceInfo::GenerateCompressedOffset(value));
-    gcov_write_unsigned(GetStringIndex(Symbol::Name(callsite.second)));
+    gcov_.WriteUnsigned(SourceInfo::GenerateCompressedOffset(value));
+    gcov_.WriteUnsigned(GetStringIndex(Symbol::Name(callsite.second)));
   }
 
  private:
@@ -134,6 +201,7 @@ class SourceProfileWriter: public SymbolTraverser {
   }
 
   const StringIndexMap &map_;
+  GcovRecord gcov_;
   DISALLOW_COPY_AND_ASSIGN(SourceProfileWriter);
 };
 
@@ -156,50 +224,61 @@ void AutoFDOProfileWriter::WriteFunctionProfile() {
   length_4bytes += 1;
 
   // Writes the GCOV_TAG_AFDO_FILE_NAMES section.
-  gcov_write_unsigned(GCOV_TAG_AFDO_FILE_NAMES);
-  gcov_write_unsigned(length_4bytes);
-  gcov_write_unsigned(string_index_map.size());
+  gcov_.WriteUnsigned(GCOV_TAG_AFDO_FILE_NAMES);
+  gcov_.WriteUnsigned(length_4bytes);
+  gcov_.WriteUnsigned(string_index_map.size());
   for (const auto &[name, index] : string_index_map) {
-    char *c = strdup(name.c_str());
-    int len = strlen(c);
-    // Workaround https://gcc.gnu.org/bugzilla/show_bug.cgi?id=64346
-    // We should not have D4Ev in our profile because it does not exist
-    // in symbol table and would lead to undefined symbols during linking.
-    if (len > 5 &&
-        (!strcmp(c + len - 4, "D4Ev") || !strcmp(c + len - 4, "C4Ev"))) {
-      c[len - 3] = '2';
-    } else if (len > 7 && !strcmp(c + len - 6, "C4EPKc")) {
-      c[len - 5] = '2';
-    } else if (len > 12 && !strcmp(c + len - 11, "C4EPKcRKS2_")) {
-      c[len - 10] = '2';
-    }
-    gcov_write_string(c);
-    free(c);
+    gcov_.WriteString(GetNameInProfile(name).c_str());
   }
 
-  // Compute the length of the GCOV_TAG_AFDO_FUNCTION section.
-  SourceProfileLengther length(*symbol_map_);
-  gcov_write_unsigned(GCOV_TAG_AFDO_FUNCTION);
-  gcov_write_unsigned(length.length() + 1);
-  gcov_write_unsigned(length.num_functions());
-  SourceProfileWriter::Write(*symbol_map_, string_index_map);
+  // The function records are encoded first, in name order, so that their
+  // total size gives the length of the GCOV_TAG_AFDO_FUNCTION section.
+  std::vector<const NameSymbolMap::value_type *> functions;
+  for (const auto &name_symbol : symbol_map_->map()) {
+    if (symbol_map_->ShouldEmit(name_symbol.second->total_count))
+      functions.push_back(&name_symbol);
+  }
+  std::vector<std::string> records;
+  SourceProfileWriter::Write(functions, string_index_map,
+                             GetStageThreads(FLAGS_profile_writer_threads),
+                             &records);
+  uint64_t length_4bytes_of_records = 0;
+  for (const std::string &record : records)
+    length_4bytes_of_records += record.size() / SIZEOF_UNSIGNED;
+  gcov_.WriteUnsigned(GCOV_TAG_AFDO_FUNCTION);
+  gcov_.WriteUnsigned(length_4bytes_of_records + 1);
+  gcov_.WriteUnsigned(records.size());
+
+  index_entries_.clear();
+  if (absl::GetFlag(FLAGS_write_profile_index)) {
+    index_entries_.reserve(functions.size());
+    uint64_t offset = gcov_.write_size();
+    for (size_t i = 0; i < functions.size(); ++i) {
+      index_entries_.push_back(
+          {.name = GetNameInProfile(Symbol::Name(functions[i]->first.c_str())),
+           .offset = offset,
+           .total_count = functions[i]->second->total_count});
+      offset += records[i].size();
+    }
+  }
+  gcov_.WriteBlocks(records);
 }
 
 void AutoFDOProfileWriter::WriteModuleGroup() {
-  gcov_write_unsigned(GCOV_TAG_MODULE_GROUPING);
+  gcov_.WriteUnsigned(GCOV_TAG_MODULE_GROUPING);
   // Length of the section
-  gcov_write_unsigned(0);
+  gcov_.WriteUnsigned(0);
   // Number of modules
-  gcov_write_unsigned(0);
+  gcov_.WriteUnsigned(0);
 }
 
 void AutoFDOProfileWriter::WriteWorkingSet() {
-  gcov_write_unsigned(GCOV_TAG_AFDO_WORKING_SET);
-  gcov_write_unsigned(3 * NUM_GCOV_WORKING_SETS);
+  gcov_.WriteUnsigned(GCOV_TAG_AFDO_WORKING_SET);
+  gcov_.WriteUnsigned(3 * NUM_GCOV_WORKING_SETS);
   const gcov_working_set_info *working_set = symbol_map_->GetWorkingSets();
   for (int i = 0; i < NUM_GCOV_WORKING_SETS; i++) {
-    gcov_write_unsigned(working_set[i].num_counters / WORKING_SET_INSN_PER_BB);
-    gcov_write_counter(working_set[i].min_counter);
+    gcov_.WriteUnsigned(working_set[i].num_counters / WORKING_SET_INSN_PER_BB);
+    gcov_.WriteCounter(working_set[i].min_counter);
   }
 }
 
@@ -213,9 +292,19 @@ bool AutoFDOProfileWriter::WriteToFile(const std::string &output_filename) {
   WriteFunctionProfile();
   WriteModuleGroup();
   WriteWorkingSet();
+  const uint64_t profile_size = gcov_.write_size();
   if (!WriteFinish()) {
     return false;
   }
+  if (absl::GetFlag(FLAGS_write_profile_index)) {
+    const std::string index_file = ProfileIndex::FileFor(output_filename);
+    if (!ProfileIndex::Write(index_file, profile_size,
+                             std::move(index_entries_))) {
+      LOG(ERROR) << "Cannot write the profile index " << index_file;
+      return false;
+    }
+    index_entries_.clear();
+  }
   return true;
 }
 
@@ -8,7 +8,10 @@
 
 #include <cstdint>
 #include <string>
+#include <vector>
 
+#include "gcov.h"
+#include "profile_index.h"
 #include "symbol_map.h"
 
 namespace devtools_crosstool_autofdo {
@@ -34,9 +37,11 @@ class AutoFDOProfileWriter : public ProfileWriter {
  public:
   explicit AutoFDOProfileWriter(const SymbolMap *symbol_map,
                                 uint32_t gcov_version)
-      : ProfileWriter(symbol_map), gcov_version_(gcov_version) {}
+      : ProfileWriter(symbol_map),
+        gcov_version_(gcov_version),
+        gcov_(gcov_version) {}
   explicit AutoFDOProfileWriter(uint32_t gcov_version)
-      : gcov_version_(gcov_version) {}
+      : gcov_version_(gcov_version), gcov_(gcov_version) {}
 
   bool WriteToFile(const std::string &output_file) override;
 
@@ -108,6 +113,10 @@ class AutoFDOProfileWriter : public ProfileWriter {
   void WriteWorkingSet();
 
   uint32_t gcov_version_;
+  // The output file, one per writer.
+  GcovStream gcov_;
+  // The function records of the file being written, for --write_profile_index.
+  std::vector<ProfileIndex::Entry> index_entries_;
 };
 
 class SymbolTraverser {
@@ -128,9 +137,6 @@ class SymbolTraverser {
   virtual void VisitTopSymbol(const std::string &name, const Symbol *node) {}
   virtual void Visit(const Symbol *node) = 0;
   virtual void VisitCallsite(const Callsite &offset) {}
-  int level_;
-
- private:
   void Traverse(const Symbol *node) {
     level_++;
     Visit(node);
@@ -140,6 +146,9 @@ class SymbolTraverser {
     }
     level_--;
   }
+  int level_;
+
+ private:
   DISALLOW_COPY_AND_ASSIGN(SymbolTraverser);
 };
 
@@ -3,26 +3,49 @@
 
 // Main function to merge different type of profile into txt profile.
 
+#include <cstdint>
+#include <string>
+#include <vector>
+
 #include "base/commandlineflags.h"
 #include "profile_creator.h"
 #include "third_party/abseil/absl/flags/flag.h"
 #include "third_party/abseil/absl/flags/parse.h"
 #include "third_party/abseil/absl/flags/usage.h"
+#include "third_party/abseil/absl/strings/str_split.h"
 
-ABSL_FLAG(std::string, profile, "data.profile", "Profile file name");
+ABSL_FLAG(std::string, profile, "data.profile",
+          "Profile file name. With --spill_dir, a comma-separated list of "
+          "profile file names.");
 ABSL_FLAG(std::string, profiler, "perf", "Profile type");
 ABSL_FLAG(std::string, output_file, "data.txt", "Merged profile file name");
+ABSL_FLAG(std::string, output_format, "text",
+          "Format of the merged profile file, either text or binary");
 ABSL_FLAG(std::string, binary, "data.binary", "Binary file name");
+ABSL_FLAG(std::string, spill_dir, "",
+          "If not empty, sum the samples within --sample_memory_budget_mb, "
+          "spilling sorted runs of samples to files in this directory.");
+ABSL_FLAG(uint64_t, sample_memory_budget_mb, 4096,
+          "Memory in MiB for the samples summed in memory with --spill_dir.");
 
 int main(int argc, char **argv) {
   absl::SetProgramUsageMessage(argv[0]);
   absl::ParseCommandLine(argc, argv);
 
-  if (devtools_crosstool_autofdo::MergeSample(
-          absl::GetFlag(FLAGS_profile), absl::GetFlag(FLAGS_profiler),
-          absl::GetFlag(FLAGS_binary), absl::GetFlag(FLAGS_output_file))) {
-    return 0;
+  bool ok;
+  if (absl::GetFlag(FLAGS_spill_dir).empty()) {
+    ok = devtools_crosstool_autofdo::MergeSample(
+        absl::GetFlag(FLAGS_profile), absl::GetFlag(FLAGS_profiler),
+        absl::GetFlag(FLAGS_binary), absl::GetFlag(FLAGS_output_file),
+        absl::GetFlag(FLAGS_output_format));
   } else {
-    return -1;
+    const std::vector<std::string> profiles =
+        absl::StrSplit(absl::GetFlag(FLAGS_profile), ',', absl::SkipEmpty());
+    ok = devtools_crosstool_autofdo::MergeSamplesWithSpilling(
+        profiles, absl::GetFlag(FLAGS_profiler), absl::GetFlag(FLAGS_binary),
+        absl::GetFlag(FLAGS_output_file), absl::GetFlag(FLAGS_output_format),
+        absl::GetFlag(FLAGS_spill_dir),
+        absl::GetFlag(FLAGS_sample_memory_budget_mb) << 20);
   }
+  return ok ? 0 : -1;
 }
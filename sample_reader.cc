@@ -5,34 +5,809 @@
 
 #include "sample_reader.h"
 
+#include <fcntl.h>
 #include <inttypes.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
+#include <algorithm>
+#include <cctype>
 #include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iterator>
 #include <list>
+#include <map>
 #include <memory>
+#include <optional>
+#include <queue>
 #include <set>
 #include <string>
+#include <thread>  // NOLINT(build/c++11)
+#include <tuple>
+#include <type_traits>
 #include <utility>
+#include <vector>
 
 #include "base/commandlineflags.h"
 #include "base/logging.h"
 #include "base/port.h"
+#include "memory_usage.h"
+#include "parallel_for.h"
+#include "perf_data_decompressor.h"
+#include "third_party/abseil/absl/container/flat_hash_map.h"
+#include "third_party/abseil/absl/container/node_hash_map.h"
 #include "third_party/abseil/absl/flags/flag.h"
+#include "third_party/abseil/absl/status/statusor.h"
+#include "third_party/abseil/absl/strings/str_cat.h"
 #include "third_party/abseil/absl/strings/str_format.h"
+#include "third_party/abseil/absl/strings/match.h"
 #include "third_party/abseil/absl/strings/str_join.h"
+#include "third_party/abseil/absl/strings/string_view.h"
 #include "quipper/perf_parser.h"
 #include "quipper/perf_reader.h"
+#if defined(HAVE_LLVM)
+#include "llvm_propeller_file_perf_data_provider.h"
+#include "llvm_propeller_perf_data_provider.h"
+#include "perfdata_reader.h"
+#include "util/symbolize/elf_reader.h"
+#endif
 
 ABSL_FLAG(uint64_t, strip_dup_backedge_stride_limit, 0x1000,
           "Controls the limit of backedge stride hold by the heuristic "
           "to strip duplicated entries in LBR stack. ");
 
+ABSL_FLAG(uint32_t, text_sample_parse_threads, 1,
+          "Number of threads used to parse each section of a text sample "
+          "file.");
+
+ABSL_FLAG(bool, stream_perf_data_samples, false,
+          "Count the samples of perf data files while they are read instead "
+          "of parsing all events into memory first. Memory use is then "
+          "bounded by the number of distinct sampled addresses. Samples are "
+          "mapped with the final mmap layout of each process.");
+
+ABSL_FLAG(double, sample_fraction, 1.0,
+          "Fraction of the samples of perf data files to count, rounded to "
+          "1/N for an integer N. The samples are split into strata of N "
+          "consecutive samples and one sample of each stratum is counted N "
+          "times. 1 counts every sample.");
+
+ABSL_FLAG(uint64_t, sample_fraction_seed, 0,
+          "Seed selecting which sample of each stratum is counted with "
+          "--sample_fraction.");
+
+ABSL_FLAG(bool, estimate_sample_fraction_error, false,
+          "With --sample_fraction, also count the samples of even and odd "
+          "strata separately, and report how much the profile of the counted "
+          "samples is estimated to differ from the profile of all samples.");
+
 namespace devtools_crosstool_autofdo {
+namespace {
+// A read-only memory mapping of a whole file.
+class MappedFile {
+ public:
+  MappedFile() = default;
+  MappedFile(const MappedFile &) = delete;
+  MappedFile &operator=(const MappedFile &) = delete;
+
+  ~MappedFile() {
+    if (size_ > 0) munmap(const_cast<char *>(data_), size_);
+    if (fd_ >= 0) close(fd_);
+  }
+
+  // Maps the file at "path". Returns false if it cannot be opened.
+  bool Open(const std::string &path) {
+    fd_ = open(path.c_str(), O_RDONLY);
+    if (fd_ < 0) return false;
+    struct stat st;
+    if (fstat(fd_, &st) != 0) return false;
+    if (st.st_size == 0) return true;
+    void *data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd_, 0);
+    if (data == MAP_FAILED) return false;
+    data_ = static_cast<const char *>(data);
+    size_ = st.st_size;
+    return true;
+  }
+
+  const char *data() const { return data_; }
+  size_t size() const { return size_; }
+
+ private:
+  int fd_ = -1;
+  const char *data_ = nullptr;
+  size_t size_ = 0;
+};
+
+// Parses the text sample format from a buffer. It accepts the same input as
+// the fscanf patterns it replaces: numbers may be preceded by whitespace, hex
+// numbers may have a "0x" prefix and separators must follow immediately.
+class TextSampleParser {
+ public:
+  TextSampleParser(const char *begin, const char *end)
+      : pos_(begin), end_(end) {}
+
+  bool ParseDecimal(uint64_t *value) {
+    SkipWhitespace();
+    const char *start = pos_;
+    uint64_t v = 0;
+    for (; pos_ != end_ && *pos_ >= '0' && *pos_ <= '9'; ++pos_)
+      v = v * 10 + (*pos_ - '0');
+    *value = v;
+    return pos_ != start;
+  }
+
+  bool ParseHex(uint64_t *value) {
+    SkipWhitespace();
+    if (end_ - pos_ > 2 && pos_[0] == '0' && (pos_[1] | 0x20) == 'x' &&
+        HexDigit(pos_[2]) >= 0)
+      pos_ += 2;
+    const char *start = pos_;
+    uint64_t v = 0;
+    for (int d; pos_ != end_ && (d = HexDigit(*pos_)) >= 0; ++pos_)
+      v = (v << 4) | d;
+    *value = v;
+    return pos_ != start;
+  }
+
+  // Consumes "literal" if the input continues with it.
+  bool Consume(absl::string_view literal) {
+    if (static_cast<size_t>(end_ - pos_) < literal.size() ||
+        memcmp(pos_, literal.data(), literal.size()) != 0)
+      return false;
+    pos_ += literal.size();
+    return true;
+  }
+
+  void SkipWhitespace() {
+    while (pos_ != end_ && isspace(static_cast<unsigned char>(*pos_))) ++pos_;
+  }
+
+  bool AtEnd() const { return pos_ == end_; }
+  const char *pos() const { return pos_; }
+  const char *end() const { return end_; }
+  void set_pos(const char *pos) { pos_ = pos; }
+
+ private:
+  static int HexDigit(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    c |= 0x20;
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    return -1;
+  }
+
+  const char *pos_;
+  const char *end_;
+};
+
+bool ParseRangeRecord(TextSampleParser *parser, Range *range,
+                      uint64_t *count) {
+  return parser->ParseHex(&range->first) && parser->Consume("-") &&
+         parser->ParseHex(&range->second) && parser->Consume(":") &&
+         parser->ParseDecimal(count);
+}
+
+bool ParseAddressRecord(TextSampleParser *parser, uint64_t *addr,
+                        uint64_t *count) {
+  return parser->ParseHex(addr) && parser->Consume(":") &&
+         parser->ParseDecimal(count);
+}
+
+bool ParseBranchRecord(TextSampleParser *parser, Branch *branch,
+                       uint64_t *count) {
+  return parser->ParseHex(&branch->first) && parser->Consume("->") &&
+         parser->ParseHex(&branch->second) && parser->Consume(":") &&
+         parser->ParseDecimal(count);
+}
+
+// Adds "count" to the counter of "key". Records written by
+// TextSampleReaderWriter::Write are sorted, so appending is the common case.
+template <typename Map>
+void AddCount(const typename Map::key_type &key, uint64_t count, Map *map) {
+  map->emplace_hint(map->end(), key, 0)->second += count;
+}
+
+// Sections with fewer records are always parsed on the calling thread.
+constexpr uint64_t kMinRecordsToParseInParallel = 1 << 16;
+
+// Parses the "num_records" records that start at the parser's position on
+// "num_threads" threads, assuming one record per line. Returns false, without
+// updating "map", if the records do not have that layout.
+template <typename Map, typename ParseRecordFn>
+bool ParseRecordsInParallel(TextSampleParser *parser, uint64_t num_records,
+                            int num_threads, ParseRecordFn parse_record,
+                            Map *map) {
+  parser->SkipWhitespace();
+  const char *const begin = parser->pos();
+  const char *section_end = begin;
+  for (uint64_t i = 0; i < num_records; ++i) {
+    if (section_end == parser->end()) return false;
+    const char *eol = static_cast<const char *>(
+        memchr(section_end, '\n', parser->end() - section_end));
+    section_end = eol ? eol + 1 : parser->end();
+  }
+
+  // Split the section into chunks of about the same size that end after a
+  // newline.
+  std::vector<const char *> chunk_ends;
+  for (int i = 1; i < num_threads; ++i) {
+    const char *split = begin + (section_end - begin) * i / num_threads;
+    if (!chunk_ends.empty() && split < chunk_ends.back())
+      split = chunk_ends.back();
+    const char *eol =
+        static_cast<const char *>(memchr(split, '\n', section_end - split));
+    chunk_ends.push_back(eol ? eol + 1 : section_end);
+  }
+  chunk_ends.push_back(section_end);
+
+  using Record = std::pair<typename Map::key_type, uint64_t>;
+  std::vector<std::vector<Record>> chunk_records(chunk_ends.size());
+  std::vector<char> chunk_ok(chunk_ends.size(), true);
+  std::vector<std::thread> workers;
+  for (int i = 0; i < chunk_ends.size(); ++i) {
+    workers.emplace_back([&, i]() {
+      TextSampleParser chunk_parser(i == 0 ? begin : chunk_ends[i - 1],
+                                    chunk_ends[i]);
+      for (chunk_parser.SkipWhitespace(); !chunk_parser.AtEnd();
+           chunk_parser.SkipWhitespace()) {
+        Record record;
+        if (!parse_record(&chunk_parser, &record.first, &record.second)) {
+          chunk_ok[i] = false;
+          return;
+        }
+        chunk_records[i].push_back(record);
+      }
+    });
+  }
+  for (std::thread &worker : workers) worker.join();
+
+  uint64_t parsed_records = 0;
+  for (int i = 0; i < chunk_ends.size(); ++i) {
+    if (!chunk_ok[i]) return false;
+    parsed_records += chunk_records[i].size();
+  }
+  if (parsed_records != num_records) return false;
+  for (const std::vector<Record> &records : chunk_records) {
+    for (const auto &[key, count] : records) AddCount(key, count, map);
+  }
+  parser->set_pos(section_end);
+  return true;
+}
+
+// Parses a section, i.e. the number of records followed by the records, and
+// adds the records to "map".
+template <typename Map, typename ParseRecordFn>
+bool ParseSection(TextSampleParser *parser, int num_threads,
+                  ParseRecordFn parse_record, Map *map) {
+  uint64_t num_records;
+  if (!parser->ParseDecimal(&num_records)) return false;
+  if (num_threads > 1 && num_records >= kMinRecordsToParseInParallel &&
+      ParseRecordsInParallel(parser, num_records, num_threads, parse_record,
+                             map)) {
+    return true;
+  }
+  for (uint64_t i = 0; i < num_records; ++i) {
+    typename Map::key_type key;
+    uint64_t count;
+    if (!parse_record(parser, &key, &count)) return false;
+    AddCount(key, count, map);
+  }
+  return true;
+}
+
+constexpr absl::string_view kBinarySampleMagic = "AFDOSMP1";
+enum BinarySampleSectionKind : uint8_t {
+  kRangeSection = 1,
+  kAddressSection = 2,
+  kBranchSection = 3,
+};
+
+void AppendVarint(uint64_t value, std::string *out) {
+  while (value >= 0x80) {
+    out->push_back(static_cast<char>(value | 0x80));
+    value >>= 7;
+  }
+  out->push_back(static_cast<char>(value));
+}
+
+// Maps the signed difference "to - from" to an unsigned value, with small
+// differences of either sign mapped to small values.
+uint64_t ZigZagDelta(uint64_t from, uint64_t to) {
+  const int64_t delta = static_cast<int64_t>(to - from);
+  return (static_cast<uint64_t>(delta) << 1) ^
+         static_cast<uint64_t>(delta >> 63);
+}
+
+uint64_t UnZigZagDelta(uint64_t from, uint64_t zigzag) {
+  return from + ((zigzag >> 1) ^ (0 - (zigzag & 1)));
+}
+
+// Reads LEB128 varints from a buffer.
+class VarintReader {
+ public:
+  VarintReader(const char *begin, const char *end) : pos_(begin), end_(end) {}
+
+  bool Read(uint64_t *value) {
+    uint64_t v = 0;
+    for (int shift = 0; shift < 64 && pos_ != end_; shift += 7) {
+      const uint8_t byte = *pos_++;
+      v |= static_cast<uint64_t>(byte & 0x7f) << shift;
+      if (byte < 0x80) {
+        *value = v;
+        return true;
+      }
+    }
+    return false;
+  }
+
+  bool ReadByte(uint8_t *value) {
+    if (pos_ == end_) return false;
+    *value = *pos_++;
+    return true;
+  }
+
+  // Splits off the next "size" bytes into their own reader.
+  bool Split(uint64_t size, VarintReader *reader) {
+    if (static_cast<uint64_t>(end_ - pos_) < size) return false;
+    *reader = VarintReader(pos_, pos_ + size);
+    pos_ += size;
+    return true;
+  }
+
+  bool AtEnd() const { return pos_ == end_; }
+
+ private:
+  const char *pos_;
+  const char *end_;
+};
+
+// Appends a section of "kind" with the records of "map", which may be any
+// sorted container of key and count pairs, to "out".
+// "encode_record(prev_key, key, count, &payload)" encodes one record.
+template <typename Map, typename EncodeRecordFn>
+void AppendBinarySection(BinarySampleSectionKind kind, const Map &map,
+                         EncodeRecordFn encode_record, std::string *out) {
+  std::string payload;
+  std::remove_const_t<typename Map::value_type::first_type> prev_key{};
+  for (const auto &[key, count] : map) {
+    encode_record(prev_key, key, count, &payload);
+    prev_key = key;
+  }
+  out->push_back(kind);
+  AppendVarint(map.size(), out);
+  AppendVarint(payload.size(), out);
+  out->append(payload);
+}
+
+// Decodes "num_records" records from "payload" into "map".
+// "decode_record(prev_key, &payload, &key, &count)" decodes one record.
+template <typename Map, typename DecodeRecordFn>
+bool ReadBinarySection(VarintReader payload, uint64_t num_records,
+                       DecodeRecordFn decode_record, Map *map) {
+  typename Map::key_type prev_key{};
+  for (uint64_t i = 0; i < num_records; ++i) {
+    typename Map::key_type key;
+    uint64_t count;
+    if (!decode_record(prev_key, &payload, &key, &count)) return false;
+    AddCount(key, count, map);
+    prev_key = key;
+  }
+  return payload.AtEnd();
+}
+
+void EncodeRangeOrBranch(const std::pair<uint64_t, uint64_t> &prev,
+                         const std::pair<uint64_t, uint64_t> &key,
+                         uint64_t count, std::string *out) {
+  AppendVarint(key.first - prev.first, out);
+  AppendVarint(ZigZagDelta(key.first, key.second), out);
+  AppendVarint(count, out);
+}
+
+bool DecodeRangeOrBranch(const std::pair<uint64_t, uint64_t> &prev,
+                         VarintReader *in, std::pair<uint64_t, uint64_t> *key,
+                         uint64_t *count) {
+  uint64_t first_delta, second_zigzag;
+  if (!in->Read(&first_delta) || !in->Read(&second_zigzag) || !in->Read(count))
+    return false;
+  key->first = prev.first + first_delta;
+  key->second = UnZigZagDelta(key->first, second_zigzag);
+  return true;
+}
+
+void EncodeAddress(uint64_t prev, uint64_t addr, uint64_t count,
+                   std::string *out) {
+  AppendVarint(addr - prev, out);
+  AppendVarint(count, out);
+}
+
+bool DecodeAddress(uint64_t prev, VarintReader *in, uint64_t *addr,
+                   uint64_t *count) {
+  uint64_t delta;
+  if (!in->Read(&delta) || !in->Read(count)) return false;
+  *addr = prev + delta;
+  return true;
+}
+
+// Appends a section of "kind" with the records of the hash table "counts" to
+// "out", and clears "counts".
+template <typename HashMap, typename EncodeRecordFn>
+void AppendSortedSection(BinarySampleSectionKind kind, HashMap *counts,
+                         EncodeRecordFn encode_record, std::string *out) {
+  std::vector<std::pair<typename HashMap::key_type, uint64_t>> records(
+      counts->begin(), counts->end());
+  *counts = HashMap();
+  std::sort(records.begin(), records.end());
+  AppendBinarySection(kind, records, encode_record, out);
+}
+
+struct BinarySampleSection {
+  uint8_t kind;
+  uint64_t num_records;
+  VarintReader payload;
+};
+
+// A binary sample file, mapped into memory and split into its sections.
+struct BinarySampleFile {
+  MappedFile file;
+  std::vector<BinarySampleSection> sections;
+};
+
+// Maps the binary sample file "profile_file" and splits it into sections.
+bool OpenBinarySampleFile(const std::string &profile_file,
+                          BinarySampleFile *sample_file) {
+  MappedFile &file = sample_file->file;
+  if (!file.Open(profile_file)) {
+    LOG(ERROR) << "Cannot open " << profile_file << " to read";
+    return false;
+  }
+  if (!absl::StartsWith(absl::string_view(file.data(), file.size()),
+                        kBinarySampleMagic)) {
+    LOG(ERROR) << profile_file << " is not a binary sample file";
+    return false;
+  }
+  VarintReader reader(file.data() + kBinarySampleMagic.size(),
+                      file.data() + file.size());
+  while (!reader.AtEnd()) {
+    BinarySampleSection section = {0, 0, VarintReader(nullptr, nullptr)};
+    uint64_t payload_size;
+    if (!reader.ReadByte(&section.kind) || !reader.Read(&section.num_records) ||
+        !reader.Read(&payload_size) ||
+        !reader.Split(payload_size, &section.payload)) {
+      LOG(ERROR) << "Error reading from " << profile_file;
+      return false;
+    }
+    sample_file->sections.push_back(section);
+  }
+  return true;
+}
+
+// Decodes the records of one section in order.
+template <typename Key, typename DecodeRecordFn>
+class BinarySectionCursor {
+ public:
+  BinarySectionCursor(const BinarySampleSection &section,
+                      DecodeRecordFn decode_record)
+      : payload_(section.payload),
+        remaining_(section.num_records),
+        decode_record_(decode_record) {}
+
+  // Decodes the next record. Returns false at the end of the section, or if
+  // the record is corrupt, which sets error().
+  bool Next() {
+    if (remaining_ == 0) {
+      error_ = !payload_.AtEnd();
+      return false;
+    }
+    const Key prev_key = key_;
+    if (!decode_record_(prev_key, &payload_, &key_, &count_)) {
+      error_ = true;
+      return false;
+    }
+    --remaining_;
+    return true;
+  }
+
+  const Key &key() const { return key_; }
+  uint64_t count() const { return count_; }
+  bool error() const { return error_; }
+
+ private:
+  VarintReader payload_;
+  uint64_t remaining_;
+  DecodeRecordFn decode_record_;
+  Key key_{};
+  uint64_t count_ = 0;
+  bool error_ = false;
+};
+
+// Calls "emit(key, count)" for each key in the sections of "kind" of "files",
+// in order, with the sum of its counts. Returns false if a section is corrupt.
+template <typename Key, typename DecodeRecordFn, typename EmitFn>
+bool MergeBinarySections(
+    const std::vector<std::unique_ptr<BinarySampleFile>> &files,
+    BinarySampleSectionKind kind, DecodeRecordFn decode_record, EmitFn emit) {
+  std::vector<BinarySectionCursor<Key, DecodeRecordFn>> cursors;
+  for (const auto &file : files) {
+    for (const BinarySampleSection &section : file->sections) {
+      if (section.kind == kind) cursors.emplace_back(section, decode_record);
+    }
+  }
+  // A min-heap of the cursors by their current key.
+  auto greater = [&cursors](int a, int b) {
+    return cursors[a].key() > cursors[b].key();
+  };
+  std::priority_queue<int, std::vector<int>, decltype(greater)> heap(greater);
+  for (int i = 0; i < static_cast<int>(cursors.size()); ++i) {
+    if (cursors[i].Next()) {
+      heap.push(i);
+    } else if (cursors[i].error()) {
+      return false;
+    }
+  }
+  while (!heap.empty()) {
+    const Key key = cursors[heap.top()].key();
+    uint64_t count = 0;
+    while (!heap.empty() && cursors[heap.top()].key() == key) {
+      const int i = heap.top();
+      heap.pop();
+      count += cursors[i].count();
+      if (cursors[i].Next()) {
+        heap.push(i);
+      } else if (cursors[i].error()) {
+        return false;
+      }
+    }
+    emit(key, count);
+  }
+  return true;
+}
+
+// Number of bytes of a merged section buffered before they are written.
+constexpr size_t kMergedSectionBufferSize = 1 << 20;
+
+// Writes the section of "kind" that merges the sections of "files" to "fp".
+// The sections are merged twice, first to size the merged section and then to
+// write it, so that it is never held in memory.
+template <typename Key, typename DecodeRecordFn, typename EncodeRecordFn>
+bool WriteMergedSection(
+    const std::vector<std::unique_ptr<BinarySampleFile>> &files,
+    BinarySampleSectionKind kind, DecodeRecordFn decode_record,
+    EncodeRecordFn encode_record, FILE *fp) {
+  uint64_t num_records = 0, payload_size = 0;
+  std::string buffer;
+  Key prev_key{};
+  auto size_record = [&](const Key &key, uint64_t count) {
+    buffer.clear();
+    encode_record(prev_key, key, count, &buffer);
+    prev_key = key;
+    ++num_records;
+    payload_size += buffer.size();
+  };
+  if (!MergeBinarySections<Key>(files, kind, decode_record, size_record))
+    return false;
+
+  buffer.clear();
+  buffer.push_back(kind);
+  AppendVarint(num_records, &buffer);
+  AppendVarint(payload_size, &buffer);
+  prev_key = Key{};
+  bool write_ok = true;
+  auto write_record = [&](const Key &key, uint64_t count) {
+    encode_record(prev_key, key, count, &buffer);
+    prev_key = key;
+    if (buffer.size() >= kMergedSectionBufferSize) {
+      write_ok &= fwrite(buffer.data(), 1, buffer.size(), fp) == buffer.size();
+      buffer.clear();
+    }
+  };
+  if (!MergeBinarySections<Key>(files, kind, decode_record, write_record))
+    return false;
+  write_ok &= fwrite(buffer.data(), 1, buffer.size(), fp) == buffer.size();
+  return write_ok;
+}
+
+// Opens each of "profile_files" into "files".
+bool OpenBinarySampleFiles(
+    const std::vector<std::string> &profile_files,
+    std::vector<std::unique_ptr<BinarySampleFile>> *files) {
+  for (const std::string &profile_file : profile_files) {
+    files->push_back(std::make_unique<BinarySampleFile>());
+    if (!OpenBinarySampleFile(profile_file, files->back().get())) return false;
+  }
+  return true;
+}
+
+// The pid of the kernel mmap events.
+constexpr uint32_t kKernelPid = static_cast<uint32_t>(-1);
+
+// The samples of a perf data file aggregated by pid and runtime addresses.
+struct RawSampleCounts {
+  // (pid, ip) -> count.
+  absl::flat_hash_map<std::pair<uint32_t, uint64_t>, uint64_t> ips;
+  // (pid, from, to) of the newest LBR entry -> count.
+  absl::flat_hash_map<std::tuple<uint32_t, uint64_t, uint64_t>, uint64_t>
+      newest_branches;
+  // (pid, from of the newer entry, to, from) of every other LBR entry ->
+  // count. The newer entry's source ends the range which starts at "to".
+  absl::flat_hash_map<std::tuple<uint32_t, uint64_t, uint64_t, uint64_t>,
+                      uint64_t>
+      older_branches;
+};
+
+// Counts "event" "weight" times.
+void CountRawSample(const quipper::PerfDataProto::SampleEvent &event,
+                    uint64_t stride_limit, uint64_t weight,
+                    RawSampleCounts *counts) {
+  const uint32_t pid = event.pid();
+  counts->ips[{pid, event.ip()}] += weight;
+  const auto &brstack = event.branch_stack();
+  if (brstack.empty()) return;
+  counts->newest_branches[{pid, brstack.Get(0).from_ip(),
+                           brstack.Get(0).to_ip()}] += weight;
+  for (int i = 1; i < brstack.size(); ++i) {
+    // The duplicate LBR head workaround of PerfDataSampleReader::Append, on
+    // runtime addresses. They differ from the binary offsets by the same
+    // amount as long as both entries are in the same mapping.
+    if (i == 1 && brstack.Get(0).from_ip() == brstack.Get(1).from_ip() &&
+        brstack.Get(0).to_ip() == brstack.Get(1).to_ip() &&
+        brstack.Get(0).from_ip() - brstack.Get(0).to_ip() > stride_limit)
+      continue;
+    counts->older_branches[{pid, brstack.Get(i - 1).from_ip(),
+                            brstack.Get(i).to_ip(),
+                            brstack.Get(i).from_ip()}] += weight;
+  }
+}
+
+// Maps that samples are counted into, each sample "weight" times.
+struct SampleCountMaps {
+  AddressCountMap *addresses;
+  RangeCountMap *ranges;
+  BranchCountMap *branches;
+  uint64_t weight;
+};
+
+// The file mappings of the processes in a perf data file as of the end of the
+// profile. Later mmaps replace the overlapping parts of earlier ones, and a
+// forked process starts with a copy of its parent's mappings.
+class ProcessMappings {
+ public:
+  explicit ProcessMappings(
+      absl::node_hash_map<std::string, quipper::DSOInfo> *dsos)
+      : dsos_(dsos) {}
+
+  // Applies the mmap and fork events of "reader" in timestamp order.
+  void AddEvents(const quipper::PerfReader &reader) {
+    std::vector<const quipper::PerfDataProto::PerfEvent *> events;
+    for (const auto &event : reader.events()) {
+      if (event.has_mmap_event() || event.has_fork_event())
+        events.push_back(&event);
+    }
+    std::stable_sort(events.begin(), events.end(),
+                     [](const quipper::PerfDataProto::PerfEvent *a,
+                        const quipper::PerfDataProto::PerfEvent *b) {
+                       return a->timestamp() < b->timestamp();
+                     });
+    for (const quipper::PerfDataProto::PerfEvent *event : events) {
+      if (event->has_fork_event()) {
+        const auto &fork = event->fork_event();
+        // A new thread shares the mappings of its process.
+        if (fork.pid() == fork.ppid()) continue;
+        auto parent = processes_.find(fork.ppid());
+        if (parent == processes_.end()) {
+          processes_.erase(fork.pid());
+          continue;
+        }
+        AddressSpace inherited = parent->second;
+        processes_[fork.pid()] = std::move(inherited);
+        continue;
+      }
+      const auto &mmap = event->mmap_event();
+      if (mmap.len() == 0) continue;
+      auto dso = dsos_->try_emplace(mmap.filename());
+      if (dso.second) dso.first->second.name = mmap.filename();
+      Insert(mmap.start(),
+             {mmap.start() + mmap.len(), mmap.pgoff(), &dso.first->second},
+             mmap.pid() == kKernelPid ? &kernel_ : &processes_[mmap.pid()]);
+    }
+  }
+
+  // Returns the file mapped at "address" in process "pid" and the offset of
+  // "address" in it, or an empty DSOAndOffset if nothing is mapped there.
+  quipper::ParsedEvent::DSOAndOffset Map(uint32_t pid,
+                                         uint64_t address) const {
+    quipper::ParsedEvent::DSOAndOffset result;
+    auto mapping = Find(kernel_, address);
+    if (mapping == kernel_.end()) {
+      auto process = processes_.find(pid);
+      if (process == processes_.end()) return result;
+      mapping = Find(process->second, address);
+      if (mapping == process->second.end()) return result;
+    }
+    result.dso_info_ = mapping->second.dso;
+    result.offset_ = address - mapping->first + mapping->second.pgoff;
+    return result;
+  }
+
+ private:
+  struct Mapping {
+    uint64_t end;
+    uint64_t pgoff;
+    const quipper::DSOInfo *dso;
+  };
+  // Non-overlapping mappings keyed by start address.
+  using AddressSpace = std::map<uint64_t, Mapping>;
+
+  static AddressSpace::const_iterator Find(const AddressSpace &space,
+                                           uint64_t address) {
+    auto it = space.upper_bound(address);
+    if (it == space.begin()) return space.end();
+    --it;
+    return address < it->second.end ? it : space.end();
+  }
+
+  // Maps [start, mapping.end) in "space", trimming what was mapped there.
+  static void Insert(uint64_t start, const Mapping &mapping,
+                     AddressSpace *space) {
+    auto it = space->lower_bound(start);
+    if (it != space->begin()) {
+      auto prev = std::prev(it);
+      if (prev->second.end > start) {
+        if (prev->second.end > mapping.end) {
+          Mapping tail = prev->second;
+          tail.pgoff += mapping.end - prev->first;
+          space->emplace(mapping.end, tail);
+        }
+        prev->second.end = start;
+      }
+    }
+    while (it != space->end() && it->first < mapping.end) {
+      if (it->second.end > mapping.end) {
+        Mapping tail = it->second;
+        tail.pgoff += mapping.end - it->first;
+        space->erase(it);
+        space->emplace(mapping.end, tail);
+        break;
+      }
+      it = space->erase(it);
+    }
+    (*space)[start] = mapping;
+  }
+
+  absl::node_hash_map<std::string, quipper::DSOInfo> *dsos_;
+  absl::flat_hash_map<uint32_t, AddressSpace> processes_;
+  AddressSpace kernel_;
+};
+
+// Reads the perf.data file `profile_file` into `reader`. A gzip or zstd
+// compressed file is decompressed into memory as it is read.
+bool ReadPerfFile(const std::string &profile_file,
+                  quipper::PerfReader *reader) {
+  absl::StatusOr<bool> compressed = IsCompressedFile(profile_file);
+  if (!compressed.ok() || !*compressed) return reader->ReadFile(profile_file);
+  absl::StatusOr<std::string> contents = ReadDecompressedFile(profile_file);
+  if (!contents.ok()) {
+    LOG(ERROR) << contents.status();
+    return false;
+  }
+  return reader->ReadFromString(*contents);
+}
+}  // namespace
 
 PerfDataSampleReader::PerfDataSampleReader(const std::string &profile_file,
                                            const std::string &re,
                                            const std::string &build_id)
-    : FileSampleReader(profile_file), build_id_(build_id), re_(re.c_str()) {}
+    : FileSampleReader(profile_file),
+      build_id_(build_id),
+      re_(re.c_str()),
+      selector_(absl::GetFlag(FLAGS_sample_fraction),
+                absl::GetFlag(FLAGS_sample_fraction_seed)) {
+  if (!selector_.keeps_all() &&
+      absl::GetFlag(FLAGS_estimate_sample_fraction_error)) {
+    for (auto &half : halves_) half = std::make_unique<CountedSampleReader>();
+  }
+}
 
 PerfDataSampleReader::~PerfDataSampleReader() {}
 
@@ -40,26 +815,16 @@ PerfDataSampleReader::~PerfDataSampleReader() {}
 // focus_bins_, or focus_bins_ is empty and name matches re_.
 bool PerfDataSampleReader::MatchBinary(
     const quipper::ParsedEvent::DSOAndOffset &dso_and_offset) {
-  if (focus_bins_.empty()) {
-    // If we already know whether we've accepted the given dso before, return
-    // the cached result.
-    auto re_cache_it = re_cache_.find(dso_and_offset.dso_info_);
-    if (re_cache_it != re_cache_.end()) {
-      return re_cache_it->second;
-    }
-
-    bool is_found = std::regex_search(dso_and_offset.dso_name().c_str(), re_);
-    re_cache_[dso_and_offset.dso_info_] = is_found;
-    return is_found;
-  } else {
-    std::string name = dso_and_offset.dso_name();
-    for (const auto &binary_path : focus_bins_) {
-      if (name == binary_path) {
-        return true;
-      }
-    }
-    return false;
+  // Each distinct dso is matched once per profile; every later lookup is a
+  // single probe of dso_match_cache_.
+  auto [it, inserted] =
+      dso_match_cache_.try_emplace(dso_and_offset.dso_info_, false);
+  if (inserted) {
+    const std::string &name = dso_and_offset.dso_name();
+    it->second = focus_bins_.empty() ? std::regex_search(name.c_str(), re_)
+                                     : focus_bins_.count(name) != 0;
   }
+  return it->second;
 }
 
 // Stores matching binary paths to focus_bins_ for a given build_id_.
@@ -96,15 +861,18 @@ void PerfDataSampleReader::GetFileNameFromBuildID(const quipper::PerfReader*
   }
 }
 
-std::set<uint64_t> SampleReader::GetSampledAddresses() const {
-  std::set<uint64_t> addrs;
+std::vector<uint64_t> SampleReader::GetSampledAddresses() const {
+  // The maps are sorted, so only adjacent start addresses can repeat.
+  std::vector<uint64_t> addrs;
+  addrs.reserve(statistics().num_sampled_addresses);
   if (range_count_map_.size() > 0) {
     for (const auto &[range, count] : range_count_map_) {
-      addrs.insert(range.first);
+      if (addrs.empty() || addrs.back() != range.first)
+        addrs.push_back(range.first);
     }
   } else {
     for (const auto &[addr, count] : address_count_map_) {
-      addrs.insert(addr);
+      addrs.push_back(addr);
     }
   }
   return addrs;
@@ -119,113 +887,121 @@ uint64_t SampleReader::GetSampleCountOrZero(uint64_t addr) const {
 }
 
 uint64_t SampleReader::GetTotalSampleCount() const {
-  uint64_t ret = 0;
-
-  if (range_count_map_.size() > 0) {
-    for (const auto &[range, count] : range_count_map_) {
-      ret += count;
-    }
-  } else {
-    for (const auto &[addr, count] : address_count_map_) {
-      ret += count;
-    }
-  }
-  return ret;
+  return statistics().total_sample_count;
 }
 
 bool SampleReader::ReadAndSetTotalCount() {
   if (!Read()) {
     return false;
   }
-  if (range_count_map_.size() > 0) {
-    for (const auto &[range, count] : range_count_map_) {
-      total_count_ += count * (1 + range.second - range.first);
-    }
-  } else {
-    for (const auto &[addr, count] : address_count_map_) {
-      total_count_ += count;
-    }
-  }
+  // Read may fill the maps any way, so the statistics are computed again.
+  InvalidateStatistics();
+  total_count_ += statistics().weighted_count;
   return true;
 }
 
-bool FileSampleReader::Read() {
-  return Append(profile_file_);
+const SampleStatistics &SampleReader::statistics() const {
+  if (!statistics_valid_) ComputeStatistics();
+  return range_count_map_.empty() ? address_statistics_ : range_statistics_;
 }
 
-bool TextSampleReaderWriter::Append(const std::string &profile_file) {
-  FILE *fp = fopen(profile_file.c_str(), "r");
-  if (fp == nullptr) {
-    LOG(ERROR) << "Cannot open " << profile_file << " to read";
-    return false;
-  }
-  uint64_t num_records;
+void SampleReader::AddRangeCount(const Range &range, uint64_t count) {
+  auto [iter, inserted] = range_count_map_.try_emplace(range, 0);
+  iter->second += count;
+  if (!statistics_valid_) return;
+  // The ranges are sorted, so those with the same start are adjacent.
+  bool new_start = inserted;
+  if (new_start && iter != range_count_map_.begin())
+    new_start = std::prev(iter)->first.first != range.first;
+  if (new_start && std::next(iter) != range_count_map_.end())
+    new_start = std::next(iter)->first.first != range.first;
+  CountRange(range, count, new_start);
+}
 
-  // Reads in the range_count_map
-  if (1 != fscanf(fp, "%" SCNu64 "\n", &num_records)) {
-    LOG(ERROR) << "Error reading from " << profile_file;
-    fclose(fp);
-    return false;
-  }
-  for (int i = 0; i < num_records; i++) {
-    uint64_t from, to, count;
-    if (3 != fscanf(fp, "%" SCNx64 "-%" SCNx64 ":%" SCNu64 "\n", &from, &to,
-                    &count)) {
-      LOG(ERROR) << "Error reading from " << profile_file;
-      fclose(fp);
-      return false;
-    }
-    range_count_map_[Range(from, to)] += count;
-  }
+void SampleReader::AddAddressCount(uint64_t addr, uint64_t count) {
+  auto [iter, inserted] = address_count_map_.try_emplace(addr, 0);
+  iter->second += count;
+  if (!statistics_valid_) return;
+  address_statistics_.total_sample_count += count;
+  address_statistics_.weighted_count += count;
+  if (inserted) ++address_statistics_.num_sampled_addresses;
+}
 
-  // Reads in the addr_count_map
-  if (1 != fscanf(fp, "%" SCNu64 "\n", &num_records)) {
-    LOG(ERROR) << "Error reading from " << profile_file;
-    fclose(fp);
-    return false;
-  }
-  for (int i = 0; i < num_records; i++) {
-    uint64_t addr, count;
-    if (2 != fscanf(fp, "%" SCNx64 ":%" SCNu64 "\n", &addr, &count)) {
-      LOG(ERROR) << "Error reading from " << profile_file;
-      fclose(fp);
-      return false;
-    }
-    address_count_map_[addr] += count;
-  }
+void SampleReader::CountRange(const Range &range, uint64_t count,
+                              bool new_start) const {
+  const uint64_t length = 1 + range.second - range.first;
+  int bucket = 0;
+  while (bucket < 64 && (length >> bucket) != 0) ++bucket;
+  range_statistics_.total_sample_count += count;
+  range_statistics_.weighted_count += count * length;
+  range_statistics_.range_length_histogram[bucket] += count;
+  if (new_start) ++range_statistics_.num_sampled_addresses;
+}
 
-  // Reads in the branch_count_map
-  if (1 != fscanf(fp, "%" SCNu64 "\n", &num_records)) {
-    LOG(ERROR) << "Error reading from " << profile_file;
-    fclose(fp);
-    return false;
+void SampleReader::ComputeStatistics() const {
+  range_statistics_ = address_statistics_ = SampleStatistics();
+  uint64_t prev_start = 0;
+  for (const auto &[range, count] : range_count_map_) {
+    CountRange(range, count,
+               range_statistics_.num_sampled_addresses == 0 ||
+                   range.first != prev_start);
+    prev_start = range.first;
   }
-  for (int i = 0; i < num_records; i++) {
-    uint64_t from, to, count;
-    if (3 != fscanf(fp, "%" SCNx64 "->%" SCNx64 ":%" SCNu64 "\n", &from, &to,
-                    &count)) {
-      LOG(ERROR) << "Error reading from " << profile_file;
-      fclose(fp);
-      return false;
-    }
-    branch_count_map_[Branch(from, to)] += count;
+  for (const auto &[addr, count] : address_count_map_) {
+    address_statistics_.total_sample_count += count;
+    address_statistics_.weighted_count += count;
   }
-  fclose(fp);
-  return true;
+  address_statistics_.num_sampled_addresses = address_count_map_.size();
+  statistics_valid_ = true;
 }
 
-void TextSampleReaderWriter::Merge(const SampleReader &reader) {
+bool FileSampleReader::Read() {
+  return Append(profile_file_);
+}
+
+void FileSampleReader::Merge(const SampleReader &reader) {
   for (const auto &[range, count] : reader.range_count_map()) {
-    range_count_map_[range] += count;
+    AddRangeCount(range, count);
   }
   for (const auto &[addr, count] : reader.address_count_map()) {
-    address_count_map_[addr] += count;
+    AddAddressCount(addr, count);
   }
   for (const auto &[branch, count] : reader.branch_count_map()) {
     branch_count_map_[branch] += count;
   }
 }
 
+bool FileSampleReader::IsFileExist() const {
+  FILE *fp = fopen(profile_file_.c_str(), "r");
+  if (fp == nullptr) {
+    return false;
+  } else {
+    fclose(fp);
+    return true;
+  }
+}
+
+bool TextSampleReaderWriter::Append(const std::string &profile_file) {
+  InvalidateStatistics();
+  MappedFile file;
+  if (!file.Open(profile_file)) {
+    LOG(ERROR) << "Cannot open " << profile_file << " to read";
+    return false;
+  }
+  const int num_threads = GetStageThreads(FLAGS_text_sample_parse_threads);
+  TextSampleParser parser(file.data(), file.data() + file.size());
+  if (!ParseSection(&parser, num_threads, ParseRangeRecord,
+                    &range_count_map_) ||
+      !ParseSection(&parser, num_threads, ParseAddressRecord,
+                    &address_count_map_) ||
+      !ParseSection(&parser, num_threads, ParseBranchRecord,
+                    &branch_count_map_)) {
+    LOG(ERROR) << "Error reading from " << profile_file;
+    return false;
+  }
+  return true;
+}
+
 bool TextSampleReaderWriter::Write(const char *aux_info) {
   FILE *fp = fopen(profile_file_.c_str(), "w");
   if (fp == nullptr) {
@@ -233,66 +1009,315 @@ bool TextSampleReaderWriter::Write(const char *aux_info) {
     return false;
   }
 
-  fprintf(fp, "%" PRIuS "\n", range_count_map_.size());
+  // Records are formatted into a large buffer that is written out in one
+  // call whenever it fills up.
+  constexpr size_t kFlushThreshold = 1 << 20;
+  std::string buffer;
+  buffer.reserve(kFlushThreshold + 64);
+  bool write_ok = true;
+  auto flush = [&](size_t threshold) {
+    if (buffer.size() < threshold) return;
+    write_ok &= fwrite(buffer.data(), 1, buffer.size(), fp) == buffer.size();
+    buffer.clear();
+  };
+
+  absl::StrAppendFormat(&buffer, "%u\n", range_count_map_.size());
   for (const auto &[range, count] : range_count_map_) {
-    absl::FPrintF(fp, "%x-%x:%u\n", range.first, range.second, count);
+    absl::StrAppendFormat(&buffer, "%x-%x:%u\n", range.first, range.second,
+                          count);
+    flush(kFlushThreshold);
   }
-  fprintf(fp, "%" PRIuS "\n", address_count_map_.size());
+  absl::StrAppendFormat(&buffer, "%u\n", address_count_map_.size());
   for (const auto &[addr, count] : address_count_map_) {
-    absl::FPrintF(fp, "%x:%u\n", addr, count);
+    absl::StrAppendFormat(&buffer, "%x:%u\n", addr, count);
+    flush(kFlushThreshold);
   }
-  fprintf(fp, "%" PRIuS "\n", branch_count_map_.size());
+  absl::StrAppendFormat(&buffer, "%u\n", branch_count_map_.size());
   for (const auto &[branch, count] : branch_count_map_) {
-    absl::FPrintF(fp, "%x->%x:%u\n", branch.first, branch.second, count);
+    absl::StrAppendFormat(&buffer, "%x->%x:%u\n", branch.first, branch.second,
+                          count);
+    flush(kFlushThreshold);
   }
   if (aux_info) {
-    fprintf(fp, "%s", aux_info);
+    buffer.append(aux_info);
+  }
+  flush(0);
+  write_ok &= fclose(fp) == 0;
+  if (!write_ok) {
+    LOG(ERROR) << "Error writing to " << profile_file_;
+  }
+  return write_ok;
+}
+
+bool BinarySampleReaderWriter::Append(const std::string &profile_file) {
+  InvalidateStatistics();
+  BinarySampleFile file;
+  if (!OpenBinarySampleFile(profile_file, &file)) return false;
+  for (const BinarySampleSection &section : file.sections) {
+    bool ok = true;
+    switch (section.kind) {
+      case kRangeSection:
+        ok = ReadBinarySection(section.payload, section.num_records,
+                               DecodeRangeOrBranch, &range_count_map_);
+        break;
+      case kAddressSection:
+        ok = ReadBinarySection(section.payload, section.num_records,
+                               DecodeAddress, &address_count_map_);
+        break;
+      case kBranchSection:
+        ok = ReadBinarySection(section.payload, section.num_records,
+                               DecodeRangeOrBranch, &branch_count_map_);
+        break;
+      default:
+        break;
+    }
+    if (!ok) {
+      LOG(ERROR) << "Error reading from " << profile_file;
+      return false;
+    }
   }
-  fclose(fp);
   return true;
 }
 
-bool TextSampleReaderWriter::IsFileExist() const {
-  FILE *fp = fopen(profile_file_.c_str(), "r");
+bool BinarySampleReaderWriter::Write() {
+  std::string contents(kBinarySampleMagic);
+  AppendBinarySection(kRangeSection, range_count_map_, EncodeRangeOrBranch,
+                      &contents);
+  AppendBinarySection(kAddressSection, address_count_map_, EncodeAddress,
+                      &contents);
+  AppendBinarySection(kBranchSection, branch_count_map_, EncodeRangeOrBranch,
+                      &contents);
+
+  FILE *fp = fopen(profile_file_.c_str(), "wb");
   if (fp == nullptr) {
+    LOG(ERROR) << "Cannot open " << profile_file_ << " to write";
     return false;
-  } else {
-    fclose(fp);
+  }
+  bool write_ok =
+      fwrite(contents.data(), 1, contents.size(), fp) == contents.size();
+  write_ok &= fclose(fp) == 0;
+  if (!write_ok) {
+    LOG(ERROR) << "Error writing to " << profile_file_;
+  }
+  return write_ok;
+}
+
+SpillingSampleAggregator::~SpillingSampleAggregator() {
+  for (const std::string &run : spilled_runs_) remove(run.c_str());
+}
+
+bool SpillingSampleAggregator::Add(const SampleReader &reader) {
+  for (const auto &[range, count] : reader.range_count_map()) {
+    range_counts_[range] += count;
+    if (MemoryUsage() > memory_budget_ && !Spill()) return false;
+  }
+  for (const auto &[addr, count] : reader.address_count_map()) {
+    address_counts_[addr] += count;
+    if (MemoryUsage() > memory_budget_ && !Spill()) return false;
+  }
+  for (const auto &[branch, count] : reader.branch_count_map()) {
+    branch_counts_[branch] += count;
+    if (MemoryUsage() > memory_budget_ && !Spill()) return false;
+  }
+  return true;
+}
+
+void SpillingSampleAggregator::AddBinaryFile(const std::string &profile_file) {
+  runs_.push_back(profile_file);
+}
+
+bool SpillingSampleAggregator::MergeInto(CountedSampleReader *reader) {
+  if (runs_.empty()) {
+    for (const auto &[range, count] : range_counts_)
+      (*reader->mutable_range_count_map())[range] += count;
+    for (const auto &[addr, count] : address_counts_)
+      (*reader->mutable_address_count_map())[addr] += count;
+    for (const auto &[branch, count] : branch_counts_)
+      (*reader->mutable_branch_count_map())[branch] += count;
+    range_counts_.clear();
+    address_counts_.clear();
+    branch_counts_.clear();
     return true;
   }
+  if (MemoryUsage() > 0 && !Spill()) return false;
+  std::vector<std::unique_ptr<BinarySampleFile>> files;
+  if (!OpenBinarySampleFiles(runs_, &files)) return false;
+  const bool ok =
+      MergeBinarySections<Range>(
+          files, kRangeSection, DecodeRangeOrBranch,
+          [reader](const Range &range, uint64_t count) {
+            AddCount(range, count, reader->mutable_range_count_map());
+          }) &&
+      MergeBinarySections<uint64_t>(
+          files, kAddressSection, DecodeAddress,
+          [reader](uint64_t addr, uint64_t count) {
+            AddCount(addr, count, reader->mutable_address_count_map());
+          }) &&
+      MergeBinarySections<Branch>(
+          files, kBranchSection, DecodeRangeOrBranch,
+          [reader](const Branch &branch, uint64_t count) {
+            AddCount(branch, count, reader->mutable_branch_count_map());
+          });
+  if (!ok) LOG(ERROR) << "Error merging the runs of spilled samples";
+  return ok;
 }
 
-bool PerfDataSampleReader::Append(const std::string &profile_file) {
-  quipper::PerfReader reader;
-  quipper::PerfParser parser(&reader);
-  if (!reader.ReadFile(profile_file) || !parser.ParseRawEvents()) {
+bool SpillingSampleAggregator::WriteBinary(const std::string &profile_file) {
+  if (runs_.empty()) {
+    FILE *fp = fopen(profile_file.c_str(), "wb");
+    if (fp == nullptr) {
+      LOG(ERROR) << "Cannot open " << profile_file << " to write";
+      return false;
+    }
+    if (!WriteCounts(fp)) {
+      LOG(ERROR) << "Error writing to " << profile_file;
+      return false;
+    }
+    return true;
+  }
+  if (MemoryUsage() > 0 && !Spill()) return false;
+  std::vector<std::unique_ptr<BinarySampleFile>> files;
+  if (!OpenBinarySampleFiles(runs_, &files)) return false;
+
+  // The output is renamed into place once written, as it may be one of the
+  // runs.
+  const std::string temp_file = absl::StrCat(profile_file, ".tmp");
+  FILE *fp = fopen(temp_file.c_str(), "wb");
+  if (fp == nullptr) {
+    LOG(ERROR) << "Cannot open " << temp_file << " to write";
     return false;
   }
+  bool write_ok = fwrite(kBinarySampleMagic.data(), 1,
+                         kBinarySampleMagic.size(),
+                         fp) == kBinarySampleMagic.size();
+  write_ok = write_ok &&
+             WriteMergedSection<Range>(files, kRangeSection,
+                                       DecodeRangeOrBranch,
+                                       EncodeRangeOrBranch, fp) &&
+             WriteMergedSection<uint64_t>(files, kAddressSection,
+                                          DecodeAddress, EncodeAddress, fp) &&
+             WriteMergedSection<Branch>(files, kBranchSection,
+                                        DecodeRangeOrBranch,
+                                        EncodeRangeOrBranch, fp);
+  write_ok &= fclose(fp) == 0;
+  write_ok = write_ok && rename(temp_file.c_str(), profile_file.c_str()) == 0;
+  if (!write_ok) {
+    LOG(ERROR) << "Error writing to " << profile_file;
+    remove(temp_file.c_str());
+  }
+  return write_ok;
+}
+
+uint64_t SpillingSampleAggregator::MemoryUsage() const {
+  return HashTableBytes(range_counts_) + HashTableBytes(address_counts_) +
+         HashTableBytes(branch_counts_);
+}
 
+bool SpillingSampleAggregator::Spill() {
+  std::string run = absl::StrCat(spill_dir_, "/afdo_samples_XXXXXX");
+  const int fd = mkstemp(run.data());
+  if (fd < 0) {
+    LOG(ERROR) << "Cannot create a run of samples in " << spill_dir_;
+    return false;
+  }
+  spilled_runs_.push_back(run);
+  runs_.push_back(run);
+  FILE *fp = fdopen(fd, "wb");
+  if (fp == nullptr) {
+    close(fd);
+    LOG(ERROR) << "Cannot open " << run << " to write";
+    return false;
+  }
+  if (!WriteCounts(fp)) {
+    LOG(ERROR) << "Error writing to " << run;
+    return false;
+  }
+  return true;
+}
+
+bool SpillingSampleAggregator::WriteCounts(FILE *fp) {
+  std::string contents(kBinarySampleMagic);
+  AppendSortedSection(kRangeSection, &range_counts_, EncodeRangeOrBranch,
+                      &contents);
+  AppendSortedSection(kAddressSection, &address_counts_, EncodeAddress,
+                      &contents);
+  AppendSortedSection(kBranchSection, &branch_counts_, EncodeRangeOrBranch,
+                      &contents);
+  bool write_ok =
+      fwrite(contents.data(), 1, contents.size(), fp) == contents.size();
+  write_ok &= fclose(fp) == 0;
+  return write_ok;
+}
+
+bool PerfDataSampleReader::SelectFocusBinaries(
+    const quipper::PerfReader *reader) {
+  // The dsos of a previous profile are gone, and focus_bins_ may change.
+  dso_match_cache_.clear();
   // If we can find build_id from binary, and the exact build_id was found
   // in the profile, then we use focus_bins to match samples. Otherwise,
   // focus_binary_re_ is used to match the binary name with the samples.
   if (build_id_ != "") {
-    GetFileNameFromBuildID(&reader);
+    GetFileNameFromBuildID(reader);
     if (focus_bins_.empty())
       return false;
   } else {
     LOG(ERROR) << "No buildid found in binary";
   }
+  return true;
+}
+
+bool PerfDataSampleReader::Append(const std::string &profile_file) {
+  InvalidateStatistics();
+#if defined(HAVE_LLVM)
+  if (!binary_.empty()) {
+    if (AppendLbrSamples(profile_file)) return true;
+    LOG(WARNING) << "Reading the samples of '" << binary_ << "' in "
+                 << profile_file << " with the perf event parser.";
+  }
+#endif
+  if (absl::GetFlag(FLAGS_stream_perf_data_samples))
+    return AppendStreaming(profile_file);
+
+  quipper::PerfReader reader;
+  quipper::PerfParser parser(&reader);
+  if (!ReadPerfFile(profile_file, &reader) || !parser.ParseRawEvents()) {
+    return false;
+  }
+  if (!SelectFocusBinaries(&reader)) return false;
 
   for (const auto &event : parser.parsed_events()) {
     if (!event.event_ptr ||
         event.event_ptr->header().type() != quipper::PERF_RECORD_SAMPLE) {
       continue;
     }
+    const uint64_t sample_index = sample_index_++;
+    if (!selector_.Keep(sample_index)) continue;
+    // The sample is counted into this reader and, if the halves are counted,
+    // into its half, which has half the samples and thus twice the weight.
+    SampleCountMaps targets[2] = {{&address_count_map_, &range_count_map_,
+                                   &branch_count_map_, selector_.stride()}};
+    int num_targets = 1;
+    if (halves_[0] != nullptr) {
+      CountedSampleReader *half = halves_[selector_.Half(sample_index)].get();
+      targets[num_targets++] = {
+          half->mutable_address_count_map(), half->mutable_range_count_map(),
+          half->mutable_branch_count_map(), 2 * selector_.stride()};
+    }
+    auto count_branch = [&](uint64_t from, uint64_t to) {
+      for (int t = 0; t < num_targets; ++t)
+        (*targets[t].branches)[Branch(from, to)] += targets[t].weight;
+    };
+
     if (MatchBinary(event.dso_and_offset)) {
-      address_count_map_[event.dso_and_offset.offset()]++;
+      for (int t = 0; t < num_targets; ++t)
+        (*targets[t].addresses)[event.dso_and_offset.offset()] +=
+            targets[t].weight;
     }
     if (event.branch_stack.size() > 0 &&
         MatchBinary(event.branch_stack[0].to) &&
         MatchBinary(event.branch_stack[0].from)) {
-      branch_count_map_[Branch(event.branch_stack[0].from.offset(),
-                               event.branch_stack[0].to.offset())]++;
+      count_branch(event.branch_stack[0].from.offset(),
+                   event.branch_stack[0].to.offset());
     }
     for (int i = 1; i < event.branch_stack.size(); i++) {
       if (!MatchBinary(event.branch_stack[i].to)) {
@@ -322,11 +1347,216 @@ bool PerfDataSampleReader::Append(const std::string &profile_file) {
         LOG(WARNING) << "Bogus LBR data: " << begin << "->" << end;
         continue;
       }
-      range_count_map_[Range(begin, end)]++;
+      for (int t = 0; t < num_targets; ++t)
+        (*targets[t].ranges)[Range(begin, end)] += targets[t].weight;
       if (MatchBinary(event.branch_stack[i].from)) {
-        branch_count_map_[Branch(event.branch_stack[i].from.offset(),
-                                 event.branch_stack[i].to.offset())]++;
+        count_branch(event.branch_stack[i].from.offset(),
+                     event.branch_stack[i].to.offset());
+      }
+    }
+  }
+  return true;
+}
+
+#if defined(HAVE_LLVM)
+bool PerfDataSampleReader::AppendLbrSamples(const std::string &profile_file) {
+  PerfDataReader perf_data_reader;
+  if (binary_info_ == nullptr) {
+    auto binary_info = std::make_unique<BinaryInfo>();
+    if (!perf_data_reader.SelectBinaryInfo(binary_, binary_info.get()))
+      return false;
+    binary_info_ = std::move(binary_info);
+    binary_base_addr_ =
+        ElfReader::GetShared(binary_)->VaddrOfFirstLoadSegment();
+  }
+  absl::StatusOr<std::optional<PerfDataProvider::BufferHandle>> perf_data =
+      FilePerfDataProvider({profile_file}).GetNext();
+  if (!perf_data.ok()) {
+    LOG(ERROR) << perf_data.status();
+    return false;
+  }
+  if (!perf_data->has_value()) return false;
+  BinaryPerfInfo binary_perf_info;
+  binary_perf_info.binary_info = binary_info_->CopyMetadata();
+  // The mmaps are selected by the build id of the binary.
+  if (!perf_data_reader.SelectPerfInfo(std::move(**perf_data),
+                                       /*match_mmap_name=*/"",
+                                       &binary_perf_info) ||
+      (binary_perf_info.lbr_samples.size() == 0 &&
+       binary_perf_info.trace_counts.empty()))
+    return false;
+
+  // The samples are counted with the offsets of their addresses relative to
+  // the first loadable segment, like the offsets of the dsos that the perf
+  // event parser maps them to.
+  BinaryAddressTranslator translator(perf_data_reader, binary_perf_info);
+  auto to_offset = [&](uint64_t pid,
+                       uint64_t address) -> std::optional<uint64_t> {
+    const uint64_t binary_address = translator.Translate(pid, address);
+    if (binary_address == PerfDataReader::kInvalidAddress ||
+        binary_address < binary_base_addr_)
+      return std::nullopt;
+    return binary_address - binary_base_addr_;
+  };
+  const uint64_t stride_limit =
+      absl::GetFlag(FLAGS_strip_dup_backedge_stride_limit);
+  const LbrSamples &lbr_samples = binary_perf_info.lbr_samples;
+  for (int64_t s = 0; s != lbr_samples.size(); ++s) {
+    const uint64_t sample_index = sample_index_++;
+    if (!selector_.Keep(sample_index)) continue;
+    SampleCountMaps targets[2] = {{&address_count_map_, &range_count_map_,
+                                   &branch_count_map_, selector_.stride()}};
+    int num_targets = 1;
+    if (halves_[0] != nullptr) {
+      CountedSampleReader *half = halves_[selector_.Half(sample_index)].get();
+      targets[num_targets++] = {
+          half->mutable_address_count_map(), half->mutable_range_count_map(),
+          half->mutable_branch_count_map(), 2 * selector_.stride()};
+    }
+    const uint64_t pid = lbr_samples.pids[s];
+    if (std::optional<uint64_t> ip = to_offset(pid, lbr_samples.ips[s])) {
+      for (int t = 0; t < num_targets; ++t)
+        (*targets[t].addresses)[*ip] += targets[t].weight;
+    }
+    // The branch stack of the sample, from the newest entry, translated to
+    // offsets.
+    const uint64_t begin = lbr_samples.offsets[s];
+    const int n = lbr_samples.offsets[s + 1] - begin;
+    std::vector<std::optional<uint64_t>> from(n), to(n);
+    for (int i = 0; i < n; ++i) {
+      from[i] = to_offset(pid, lbr_samples.branches[begin + i].first);
+      to[i] = to_offset(pid, lbr_samples.branches[begin + i].second);
+    }
+    auto count_branch = [&](int i) {
+      if (!from[i].has_value() || !to[i].has_value()) return;
+      for (int t = 0; t < num_targets; ++t)
+        (*targets[t].branches)[Branch(*from[i], *to[i])] += targets[t].weight;
+    };
+    if (n > 0) count_branch(0);
+    for (int i = 1; i < n; ++i) {
+      if (!to[i].has_value()) continue;
+      // The duplicate LBR head workaround of Append.
+      if (i == 1 && from[0] == from[1] && to[0] == to[1] &&
+          from[0].has_value() && *from[0] - *to[0] > stride_limit)
+        continue;
+      const uint64_t range_begin = *to[i];
+      const uint64_t range_end = from[i - 1].value_or(0);
+      // The interval between two taken branches should not be too large.
+      if (range_end < range_begin || range_end - range_begin > (1 << 20)) {
+        LOG(WARNING) << "Bogus LBR data: " << range_begin << "->"
+                     << range_end;
+        continue;
       }
+      for (int t = 0; t < num_targets; ++t)
+        (*targets[t].ranges)[Range(range_begin, range_end)] +=
+            targets[t].weight;
+      count_branch(i);
+    }
+  }
+
+  // The counts decoded from Intel PT traces are exact, so they are neither
+  // subsampled nor scaled, and each half gets all of them.
+  std::vector<SampleCountMaps> trace_targets = {
+      {&address_count_map_, &range_count_map_, &branch_count_map_, 1}};
+  for (const std::unique_ptr<CountedSampleReader> &half : halves_) {
+    if (half == nullptr) continue;
+    trace_targets.push_back({half->mutable_address_count_map(),
+                             half->mutable_range_count_map(),
+                             half->mutable_branch_count_map(), 1});
+  }
+  for (const auto &[pid, counts] : binary_perf_info.trace_counts) {
+    for (const auto &[branch, count] : counts.branches) {
+      const std::optional<uint64_t> from = to_offset(pid, branch.first);
+      const std::optional<uint64_t> to = to_offset(pid, branch.second);
+      if (!from.has_value() || !to.has_value()) continue;
+      for (const SampleCountMaps &target : trace_targets)
+        (*target.branches)[Branch(*from, *to)] += count;
+    }
+    for (const auto &[fallthrough, count] : counts.fallthroughs) {
+      const std::optional<uint64_t> begin = to_offset(pid, fallthrough.first);
+      const std::optional<uint64_t> end = to_offset(pid, fallthrough.second);
+      if (!begin.has_value() || !end.has_value() || *end < *begin ||
+          *end - *begin > (1 << 20))
+        continue;
+      for (const SampleCountMaps &target : trace_targets)
+        (*target.ranges)[Range(*begin, *end)] += count;
+    }
+  }
+  return true;
+}
+#endif
+
+bool PerfDataSampleReader::AppendStreaming(const std::string &profile_file) {
+  RawSampleCounts raw_counts;
+  // The raw counts of the halves of the subset, if they are counted.
+  RawSampleCounts half_raw_counts[2];
+  const uint64_t stride_limit =
+      absl::GetFlag(FLAGS_strip_dup_backedge_stride_limit);
+  quipper::PerfReader reader;
+  // Samples are counted as they are read and never kept. The events left in
+  // the proto are mostly mmap, fork and comm events.
+  reader.SetEventTypesToSkipWhenSerializing({quipper::PERF_RECORD_SAMPLE});
+  reader.SetSampleCallback(
+      [&](const quipper::PerfDataProto::SampleEvent &event) {
+        const uint64_t sample_index = sample_index_++;
+        if (!selector_.Keep(sample_index)) return;
+        CountRawSample(event, stride_limit, selector_.stride(), &raw_counts);
+        if (halves_[0] != nullptr) {
+          CountRawSample(event, stride_limit, 2 * selector_.stride(),
+                         &half_raw_counts[selector_.Half(sample_index)]);
+        }
+      });
+  if (!ReadPerfFile(profile_file, &reader)) return false;
+  if (!SelectFocusBinaries(&reader)) return false;
+
+  ProcessMappings mappings(&streamed_dsos_);
+  mappings.AddEvents(reader);
+
+  // Adds "raw" to "maps". The weights are already part of the raw counts.
+  auto add_raw_counts = [&](const RawSampleCounts &raw,
+                            const SampleCountMaps &maps) {
+    for (const auto &[pid_and_ip, count] : raw.ips) {
+      const quipper::ParsedEvent::DSOAndOffset ip =
+          mappings.Map(pid_and_ip.first, pid_and_ip.second);
+      if (MatchBinary(ip)) (*maps.addresses)[ip.offset()] += count;
+    }
+    for (const auto &[key, count] : raw.newest_branches) {
+      const auto &[pid, from_ip, to_ip] = key;
+      const quipper::ParsedEvent::DSOAndOffset from =
+          mappings.Map(pid, from_ip);
+      const quipper::ParsedEvent::DSOAndOffset to = mappings.Map(pid, to_ip);
+      if (MatchBinary(to) && MatchBinary(from))
+        (*maps.branches)[Branch(from.offset(), to.offset())] += count;
+    }
+    for (const auto &[key, count] : raw.older_branches) {
+      const auto &[pid, range_end_ip, to_ip, from_ip] = key;
+      const quipper::ParsedEvent::DSOAndOffset to = mappings.Map(pid, to_ip);
+      if (!MatchBinary(to)) continue;
+      uint64_t begin = to.offset();
+      uint64_t end = mappings.Map(pid, range_end_ip).offset();
+      // The interval between two taken branches should not be too large.
+      if (end < begin || end - begin > (1 << 20)) {
+        // The halves hold a subset of the same samples, so bogus data is only
+        // reported once.
+        if (&raw == &raw_counts)
+          LOG(WARNING) << "Bogus LBR data: " << begin << "->" << end;
+        continue;
+      }
+      (*maps.ranges)[Range(begin, end)] += count;
+      const quipper::ParsedEvent::DSOAndOffset from =
+          mappings.Map(pid, from_ip);
+      if (MatchBinary(from))
+        (*maps.branches)[Branch(from.offset(), to.offset())] += count;
+    }
+  };
+  add_raw_counts(raw_counts, {&address_count_map_, &range_count_map_,
+                              &branch_count_map_, 1});
+  if (halves_[0] != nullptr) {
+    for (int h = 0; h < 2; ++h) {
+      add_raw_counts(half_raw_counts[h],
+                     {halves_[h]->mutable_address_count_map(),
+                      halves_[h]->mutable_range_count_map(),
+                      halves_[h]->mutable_branch_count_map(), 1});
     }
   }
   return true;
@@ -6,16 +6,22 @@
 #ifndef AUTOFDO_SAMPLE_READER_H_
 #define AUTOFDO_SAMPLE_READER_H_
 
+#include <array>
 #include <cstdint>
+#include <cstdio>
 #include <map>
+#include <memory>
 #include <regex>  // NOLINT
 #include <set>
 #include <string>
 #include <utility>
+#include <vector>
 
 #include "base/integral_types.h"
 #include "base/macros.h"
+#include "sample_subsampling.h"
 #include "third_party/abseil/absl/container/flat_hash_map.h"
+#include "third_party/abseil/absl/container/node_hash_map.h"
 #include "quipper/perf_parser.h"
 
 namespace quipper {
@@ -28,6 +34,10 @@ union perf_event;
 
 namespace devtools_crosstool_autofdo {
 
+#if defined(HAVE_LLVM)
+struct BinaryInfo;
+#endif
+
 // All counter type is using uint64 instead of int64 because GCC's gcov
 // functions only takes unsigned variables.
 typedef std::map<uint64_t, uint64_t> AddressCountMap;
@@ -36,6 +46,22 @@ typedef std::map<Range, uint64_t> RangeCountMap;
 typedef std::pair<uint64_t, uint64_t> Branch;
 typedef std::map<Branch, uint64_t> BranchCountMap;
 
+// Statistics of the samples of a SampleReader. Like the total count, they are
+// of the ranges if there are any, and of the addresses otherwise.
+struct SampleStatistics {
+  // Number of samples.
+  uint64_t total_sample_count = 0;
+  // Number of samples, each weighted by the length of its range, which is the
+  // total count of the profile.
+  uint64_t weighted_count = 0;
+  // Number of addresses returned by GetSampledAddresses.
+  uint64_t num_sampled_addresses = 0;
+  // Element i is the number of range samples whose range length, to + 1 -
+  // from, is in [2^(i-1), 2^i). Element 0 counts the wrapped ranges of
+  // length 0.
+  std::array<uint64_t, 65> range_length_histogram = {};
+};
+
 // Reads in the profile data, and represent it in address_count_map_.
 class SampleReader {
  public:
@@ -56,7 +82,14 @@ class SampleReader {
     return branch_count_map_;
   }
 
-  std::set<uint64_t> GetSampledAddresses() const;
+  // Returns the sorted, distinct start addresses of the sampled ranges, or the
+  // sampled addresses if there are no ranges.
+  std::vector<uint64_t> GetSampledAddresses() const;
+
+  // Returns the statistics of the samples. They are computed in one pass over
+  // the maps when first needed after the maps change, and kept up to date
+  // when samples are added one at a time, e.g. by FileSampleReader::Merge.
+  const SampleStatistics &statistics() const;
 
   // Returns the sample count for a given instruction.
   uint64_t GetSampleCountOrZero(uint64_t addr) const;
@@ -69,16 +102,76 @@ class SampleReader {
     address_count_map_.clear();
     range_count_map_.clear();
     branch_count_map_.clear();
+    range_statistics_ = address_statistics_ = SampleStatistics();
+    statistics_valid_ = true;
+  }
+  // Frees the samples at addresses below ADDR, or all of them, once they are
+  // consumed. Unlike Clear, this keeps the statistics, so that they still
+  // describe all the samples read.
+  void ReleaseSamplesBefore(uint64_t addr) {
+    address_count_map_.erase(address_count_map_.begin(),
+                             address_count_map_.lower_bound(addr));
+    range_count_map_.erase(range_count_map_.begin(),
+                           range_count_map_.lower_bound(Range(addr, 0)));
+    branch_count_map_.erase(branch_count_map_.begin(),
+                            branch_count_map_.lower_bound(Branch(addr, 0)));
+  }
+  void ReleaseSamples() {
+    address_count_map_.clear();
+    range_count_map_.clear();
+    branch_count_map_.clear();
   }
+  // Returns the samples of one half, 0 or 1, of the samples kept by
+  // --sample_fraction, or nullptr if the halves are not counted. Their total
+  // count is set by calling ReadAndSetTotalCount on them.
+  virtual SampleReader *subsample_half(int half) { return nullptr; }
 
  protected:
   // Virtual read function to read from different types of profiles.
   virtual bool Read() = 0;
 
+  // Marks the statistics as out of date, once the maps are changed directly.
+  void InvalidateStatistics() { statistics_valid_ = false; }
+  // Add "count" samples to the maps, updating the statistics.
+  void AddRangeCount(const Range &range, uint64_t count);
+  void AddAddressCount(uint64_t addr, uint64_t count);
+
   uint64_t total_count_;
   AddressCountMap address_count_map_;
   RangeCountMap range_count_map_;
   BranchCountMap branch_count_map_;
+
+ private:
+  // Counts "count" samples of "range" into range_statistics_. "new_start" is
+  // whether no other range starts at its start address.
+  void CountRange(const Range &range, uint64_t count, bool new_start) const;
+  void ComputeStatistics() const;
+
+  // The statistics of the ranges and of the addresses, which are only up to
+  // date if statistics_valid_.
+  mutable SampleStatistics range_statistics_;
+  mutable SampleStatistics address_statistics_;
+  mutable bool statistics_valid_ = true;
+};
+
+// Holds the samples another reader counts into it, e.g. one half of the
+// samples kept by --sample_fraction.
+class CountedSampleReader : public SampleReader {
+ public:
+  // The statistics are out of date once the maps are changed through these.
+  AddressCountMap *mutable_address_count_map() {
+    InvalidateStatistics();
+    return &address_count_map_;
+  }
+  RangeCountMap *mutable_range_count_map() {
+    InvalidateStatistics();
+    return &range_count_map_;
+  }
+  BranchCountMap *mutable_branch_count_map() { return &branch_count_map_; }
+
+ protected:
+  // The samples are already counted.
+  bool Read() override { return true; }
 };
 
 // Base class that reads in the profile from a sample data file.
@@ -88,6 +181,9 @@ class FileSampleReader : public SampleReader {
       : profile_file_(profile_file) {}
 
   virtual bool Append(const std::string &profile_file) = 0;
+  // Adds the samples of "reader" to this reader's samples.
+  void Merge(const SampleReader &reader);
+  bool IsFileExist() const;
 
  protected:
   bool Read() override;
@@ -114,16 +210,22 @@ class TextSampleReaderWriter : public FileSampleReader {
       : FileSampleReader(profile_file) {}
   explicit TextSampleReaderWriter() : FileSampleReader("") { }
   bool Append(const std::string &profile_file) override;
-  void Merge(const SampleReader &reader);
   // Writes the profile to file, and appending aux_info at the end.
-  bool Write(const char *aux_info);
-  bool IsFileExist() const;
+  bool Write(const char *aux_info = nullptr);
   void SetAddressCountMap(const AddressCountMap &map) {
     address_count_map_ = map;
+    InvalidateStatistics();
   }
-  void IncAddress(uint64_t addr) { address_count_map_[addr]++; }
+  void SetRangeCountMap(const RangeCountMap &map) {
+    range_count_map_ = map;
+    InvalidateStatistics();
+  }
+  void SetBranchCountMap(const BranchCountMap &map) {
+    branch_count_map_ = map;
+  }
+  void IncAddress(uint64_t addr) { AddAddressCount(addr, 1); }
   void IncRange(uint64_t start, uint64_t end) {
-    range_count_map_[Range(start, end)]++;
+    AddRangeCount(Range(start, end), 1);
   }
   void IncBranch(uint64_t from, uint64_t to) {
     branch_count_map_[Branch(from, to)]++;
@@ -134,13 +236,102 @@ class TextSampleReaderWriter : public FileSampleReader {
   DISALLOW_COPY_AND_ASSIGN(TextSampleReaderWriter);
 };
 
+// Reads/Writes sample data from/to a compact binary file. The file starts with
+// the magic "AFDOSMP1", followed by sections. Each section is a one byte kind,
+// the number of records and the payload size in bytes as LEB128 varints, and
+// the payload. Records are sorted, and the first address of a record is
+// stored as the delta from the previous record's:
+//   kind 1 (range_count_map):   from delta, zigzag(to - from), count
+//   kind 2 (address_count_map): addr delta, count
+//   kind 3 (branch_count_map):  from delta, zigzag(to - from), count
+// Sections of unknown kinds are skipped by the reader.
+class BinarySampleReaderWriter : public FileSampleReader {
+ public:
+  explicit BinarySampleReaderWriter(const std::string &profile_file)
+      : FileSampleReader(profile_file) {}
+  bool Append(const std::string &profile_file) override;
+  // Writes the profile to file.
+  bool Write();
+
+ private:
+  DISALLOW_COPY_AND_ASSIGN(BinarySampleReaderWriter);
+};
+
+// Sums the samples of many readers within a memory budget. The counts are
+// accumulated in hash tables, which are sorted and written to disk as a run in
+// the binary sample format whenever they take more than the budget. The runs
+// are then merged k-way, holding one record of each run in memory at a time.
+class SpillingSampleAggregator {
+ public:
+  // Spills runs into files in "spill_dir" once the hash tables take about
+  // "memory_budget" bytes.
+  SpillingSampleAggregator(const std::string &spill_dir,
+                           uint64_t memory_budget)
+      : spill_dir_(spill_dir), memory_budget_(memory_budget) {}
+  // Removes the spilled runs.
+  ~SpillingSampleAggregator();
+
+  // Adds the samples of "reader". Returns false if a run cannot be written.
+  bool Add(const SampleReader &reader);
+  // Adds the samples of the binary sample file "profile_file" as a run, which
+  // is only read when merging. The file must exist until then.
+  void AddBinaryFile(const std::string &profile_file);
+
+  // Adds the sum of all samples to the maps of "reader", which then hold all
+  // of them in memory.
+  bool MergeInto(CountedSampleReader *reader);
+  // Writes the sum of all samples to the binary sample file "profile_file",
+  // which may be one of the added files.
+  bool WriteBinary(const std::string &profile_file);
+
+  int num_spilled_runs() const { return spilled_runs_.size(); }
+
+ private:
+  // Approximate number of bytes taken by the hash tables.
+  uint64_t MemoryUsage() const;
+  // Writes the hash tables to a new run and clears them.
+  bool Spill();
+  // Writes the hash tables to "fp" as a binary sample file, clears them and
+  // closes "fp".
+  bool WriteCounts(FILE *fp);
+
+  const std::string spill_dir_;
+  const uint64_t memory_budget_;
+  absl::flat_hash_map<Range, uint64_t> range_counts_;
+  absl::flat_hash_map<uint64_t, uint64_t> address_counts_;
+  absl::flat_hash_map<Branch, uint64_t> branch_counts_;
+  // All runs to merge, including the added binary sample files.
+  std::vector<std::string> runs_;
+  // The runs written by Spill, removed by the destructor.
+  std::vector<std::string> spilled_runs_;
+
+  DISALLOW_COPY_AND_ASSIGN(SpillingSampleAggregator);
+};
+
 // Reads in the sample data from 'perf -g' output file.
+//
+// With --sample_fraction, only a stratified subset of the samples (see
+// StratifiedSampleSelector) is counted, and their counts are scaled to stand
+// for all the samples. With --estimate_sample_fraction_error, the two halves
+// of the subset are also counted separately, see subsample_half.
 class PerfDataSampleReader : public FileSampleReader {
  public:
   PerfDataSampleReader(const std::string &profile_file, const std::string &re,
                        const std::string &build_id);
   ~PerfDataSampleReader() override;
   bool Append(const std::string &profile_file) override;
+  SampleReader *subsample_half(int half) override {
+    return halves_[half].get();
+  }
+
+#if defined(HAVE_LLVM)
+  // Reads the LBR samples of the profiles with PerfDataReader, which maps the
+  // files into memory, selects the mmaps of "binary" by its build id and only
+  // keeps the branch stacks of the samples, instead of parsing all the events
+  // with quipper::PerfParser. Profiles that can not be read this way, such as
+  // those without branch stacks or build ids, are still read with the parser.
+  void set_binary(const std::string &binary) { binary_ = binary; }
+#endif
 
  protected:
   virtual bool MatchBinary(
@@ -150,9 +341,39 @@ class PerfDataSampleReader : public FileSampleReader {
   const std::string build_id_;
 
  private:
+  // Fills focus_bins_ from the build ids of "reader". Returns false if a build
+  // id is given but no binary in the profile has it.
+  bool SelectFocusBinaries(const quipper::PerfReader *reader);
+  // Implements Append for --stream_perf_data_samples: samples are folded into
+  // per-process counts as they are read, and only mapped to binary offsets
+  // once all the mmap events are known.
+  bool AppendStreaming(const std::string &profile_file);
+#if defined(HAVE_LLVM)
+  // Implements Append for the profiles of binary_, see set_binary. Returns
+  // false, without counting any sample, if the profile can not be read this
+  // way.
+  bool AppendLbrSamples(const std::string &profile_file);
+#endif
+
   std::set<std::string> focus_bins_;
-  absl::flat_hash_map<const quipper::DSOInfo *, bool> re_cache_;
+  // Whether MatchBinary accepts a dso, for the dsos of the current profile.
+  absl::flat_hash_map<const quipper::DSOInfo *, bool> dso_match_cache_;
+  // The files mapped by the profiles read with AppendStreaming, keyed by name.
+  // Nodes are stable, so their addresses can be keys of dso_match_cache_.
+  absl::node_hash_map<std::string, quipper::DSOInfo> streamed_dsos_;
   const std::regex re_;
+  const StratifiedSampleSelector selector_;
+  // Index of the next sample event, counted across all appended profiles.
+  uint64_t sample_index_ = 0;
+  // The samples of each half of the subset, if they are counted.
+  std::unique_ptr<CountedSampleReader> halves_[2];
+#if defined(HAVE_LLVM)
+  std::string binary_;
+  // The segments and build id of binary_, read by the first AppendLbrSamples.
+  std::unique_ptr<BinaryInfo> binary_info_;
+  // The binary address that the offsets of the samples are relative to.
+  uint64_t binary_base_addr_ = 0;
+#endif
 
   DISALLOW_COPY_AND_ASSIGN(PerfDataSampleReader);
 };
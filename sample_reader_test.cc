@@ -8,6 +8,8 @@
 
 #include "sample_reader.h"
 
+#include <cstdint>
+#include <cstdio>
 #include <string>
 #include <utility>
 
@@ -18,6 +20,10 @@
 #include "third_party/abseil/absl/strings/str_cat.h"
 
 ABSL_DECLARE_FLAG(uint64_t, strip_dup_backedge_stride_limit);
+ABSL_DECLARE_FLAG(uint32_t, text_sample_parse_threads);
+ABSL_DECLARE_FLAG(bool, stream_perf_data_samples);
+ABSL_DECLARE_FLAG(double, sample_fraction);
+ABSL_DECLARE_FLAG(bool, estimate_sample_fraction_error);
 
 #define FLAGS_test_tmpdir std::string(testing::UnitTest::GetInstance()->original_working_dir())
 
@@ -68,6 +74,47 @@ TEST_F(SampleReaderTest, ReadLBR) {
   EXPECT_EQ(reader.GetTotalCount(), 5383657);
 }
 
+TEST_F(SampleReaderTest, ReadLBRStreaming) {
+  devtools_crosstool_autofdo::PerfDataSampleReader reader(
+      FLAGS_test_srcdir + kTestDataDir + "test.lbr",
+      "test.binary", "");
+  ASSERT_TRUE(reader.ReadAndSetTotalCount());
+
+  absl::SetFlag(&FLAGS_stream_perf_data_samples, true);
+  devtools_crosstool_autofdo::PerfDataSampleReader streaming_reader(
+      FLAGS_test_srcdir + kTestDataDir + "test.lbr",
+      "test.binary", "");
+  ASSERT_TRUE(streaming_reader.ReadAndSetTotalCount());
+  absl::SetFlag(&FLAGS_stream_perf_data_samples, false);
+
+  EXPECT_EQ(streaming_reader.address_count_map(), reader.address_count_map());
+  EXPECT_EQ(streaming_reader.range_count_map(), reader.range_count_map());
+  EXPECT_EQ(streaming_reader.branch_count_map(), reader.branch_count_map());
+  EXPECT_EQ(streaming_reader.GetTotalCount(), 5383657);
+}
+
+TEST_F(SampleReaderTest, ReadSubsampledLBR) {
+  absl::SetFlag(&FLAGS_sample_fraction, 0.25);
+  absl::SetFlag(&FLAGS_estimate_sample_fraction_error, true);
+  devtools_crosstool_autofdo::PerfDataSampleReader reader(
+      FLAGS_test_srcdir + kTestDataDir + "test.lbr",
+      "test.binary", "");
+  ASSERT_TRUE(reader.ReadAndSetTotalCount());
+  absl::SetFlag(&FLAGS_sample_fraction, 1.0);
+  absl::SetFlag(&FLAGS_estimate_sample_fraction_error, false);
+
+  // Every count stands for 4 samples.
+  for (const auto &[addr, count] : reader.address_count_map())
+    EXPECT_EQ(count % 4, 0) << addr;
+  // The halves split the counted samples, each with twice their weight.
+  uint64_t half_total = 0;
+  for (int half = 0; half < 2; ++half) {
+    ASSERT_NE(reader.subsample_half(half), nullptr);
+    half_total += reader.subsample_half(half)->GetTotalSampleCount();
+  }
+  EXPECT_EQ(half_total, 2 * reader.GetTotalSampleCount());
+}
+
 TEST_F(SampleReaderTest, ReadText) {
   devtools_crosstool_autofdo::PerfDataSampleReader lbr_reader(
       FLAGS_test_srcdir + kTestDataDir + "test.lbr",
@@ -87,6 +134,167 @@ TEST_F(SampleReaderTest, ReadText) {
   EXPECT_EQ(reader.GetTotalCount(), 5383657);
 }
 
+TEST_F(SampleReaderTest, ReadTextInParallel) {
+  // Enough records for the range section to be split between threads.
+  devtools_crosstool_autofdo::TextSampleReaderWriter writer(
+      FLAGS_test_tmpdir + "parallel.txt");
+  for (uint64_t i = 0; i < 100000; ++i) {
+    writer.IncRange(i * 0x10, i * 0x10 + 8);
+    writer.IncAddress(i);
+  }
+  writer.IncBranch(0x10, 0x100);
+  EXPECT_TRUE(writer.Write(nullptr));
+
+  absl::SetFlag(&FLAGS_text_sample_parse_threads, 4);
+  devtools_crosstool_autofdo::TextSampleReaderWriter reader(
+      FLAGS_test_tmpdir + "parallel.txt");
+  ASSERT_TRUE(reader.ReadAndSetTotalCount());
+  absl::SetFlag(&FLAGS_text_sample_parse_threads, 1);
+  EXPECT_EQ(reader.range_count_map(), writer.range_count_map());
+  EXPECT_EQ(reader.address_count_map(), writer.address_count_map());
+  EXPECT_EQ(reader.branch_count_map(), writer.branch_count_map());
+}
+
+TEST_F(SampleReaderTest, ReadWriteBinary) {
+  devtools_crosstool_autofdo::TextSampleReaderWriter samples;
+  samples.IncRange(0x1000, 0x1010);
+  samples.IncRange(0x1000, 0x1010);
+  samples.IncRange(0x1020, 0x1000);
+  samples.IncRange(0xffffffffffff0000, 0xffffffffffff0100);
+  samples.IncAddress(0x1005);
+  samples.IncAddress(0x400000);
+  samples.IncBranch(0x1010, 0x1020);
+  samples.IncBranch(0x1030, 0x10);
+
+  devtools_crosstool_autofdo::BinarySampleReaderWriter writer(
+      FLAGS_test_tmpdir + "test.bin");
+  writer.Merge(samples);
+  EXPECT_TRUE(writer.Write());
+
+  devtools_crosstool_autofdo::BinarySampleReaderWriter reader(
+      FLAGS_test_tmpdir + "test.bin");
+  ASSERT_TRUE(reader.ReadAndSetTotalCount());
+  EXPECT_EQ(reader.range_count_map(), samples.range_count_map());
+  EXPECT_EQ(reader.address_count_map(), samples.address_count_map());
+  EXPECT_EQ(reader.branch_count_map(), samples.branch_count_map());
+
+  // Appending the same file again doubles the counts.
+  ASSERT_TRUE(reader.Append(FLAGS_test_tmpdir + "test.bin"));
+  EXPECT_EQ(reader.range_count_map().at({0x1000, 0x1010}), 4);
+
+  // Text sample files are rejected.
+  devtools_crosstool_autofdo::TextSampleReaderWriter text_writer(
+      FLAGS_test_tmpdir + "test_for_binary.txt");
+  text_writer.Merge(samples);
+  EXPECT_TRUE(text_writer.Write());
+  devtools_crosstool_autofdo::BinarySampleReaderWriter text_reader(
+      FLAGS_test_tmpdir + "test_for_binary.txt");
+  EXPECT_FALSE(text_reader.ReadAndSetTotalCount());
+}
+
+TEST_F(SampleReaderTest, StatisticsFollowAddedSamples) {
+  devtools_crosstool_autofdo::TextSampleReaderWriter samples;
+  samples.IncAddress(0x1005);
+  EXPECT_EQ(samples.statistics().total_sample_count, 1);
+  EXPECT_EQ(samples.statistics().num_sampled_addresses, 1);
+
+  // Once there are ranges, the statistics are of the ranges.
+  samples.IncRange(0x1000, 0x1000);
+  samples.IncRange(0x1000, 0x100f);
+  samples.IncRange(0x1000, 0x100f);
+  samples.IncRange(0x1020, 0x1000);
+  const devtools_crosstool_autofdo::SampleStatistics &statistics =
+      samples.statistics();
+  EXPECT_EQ(statistics.total_sample_count, 4);
+  EXPECT_EQ(statistics.weighted_count, 1 + 2 * 16 + (1 + 0x1000 - 0x1020));
+  EXPECT_EQ(statistics.num_sampled_addresses, 2);
+  EXPECT_EQ(statistics.range_length_histogram[1], 1);
+  EXPECT_EQ(statistics.range_length_histogram[5], 2);
+  EXPECT_EQ(statistics.range_length_histogram[64], 1);
+
+  // Merging keeps the statistics equal to those computed from the maps.
+  devtools_crosstool_autofdo::TextSampleReaderWriter merged(
+      FLAGS_test_tmpdir + "statistics.txt");
+  merged.IncRange(0x1000, 0x1004);
+  merged.Merge(samples);
+  merged.Merge(samples);
+  const devtools_crosstool_autofdo::SampleStatistics merged_statistics =
+      merged.statistics();
+  ASSERT_TRUE(merged.Write());
+  devtools_crosstool_autofdo::TextSampleReaderWriter reader(
+      FLAGS_test_tmpdir + "statistics.txt");
+  ASSERT_TRUE(reader.ReadAndSetTotalCount());
+  EXPECT_EQ(reader.statistics().total_sample_count,
+            merged_statistics.total_sample_count);
+  EXPECT_EQ(reader.statistics().weighted_count,
+            merged_statistics.weighted_count);
+  EXPECT_EQ(reader.statistics().num_sampled_addresses,
+            merged_statistics.num_sampled_addresses);
+  EXPECT_EQ(reader.statistics().range_length_histogram,
+            merged_statistics.range_length_histogram);
+  EXPECT_EQ(reader.GetTotalCount(), merged_statistics.weighted_count);
+  EXPECT_EQ(reader.GetSampledAddresses().size(), 2);
+}
+
+TEST_F(SampleReaderTest, AggregateWithSpilling) {
+  devtools_crosstool_autofdo::CountedSampleReader expected;
+  // A budget this small spills a run for nearly every sample.
+  devtools_crosstool_autofdo::SpillingSampleAggregator aggregator(
+      FLAGS_test_tmpdir, 1024);
+  for (int i = 0; i < 10; ++i) {
+    devtools_crosstool_autofdo::TextSampleReaderWriter samples;
+    for (uint64_t j = 0; j < 100; ++j) {
+      const uint64_t addr = 0x1000 + (i * 37 + j * 11) % 256;
+      samples.IncRange(addr, addr + j % 16);
+      samples.IncAddress(addr);
+      samples.IncBranch(addr + 4, addr - j);
+    }
+    for (const auto &[range, count] : samples.range_count_map())
+      (*expected.mutable_range_count_map())[range] += count;
+    for (const auto &[addr, count] : samples.address_count_map())
+      (*expected.mutable_address_count_map())[addr] += count;
+    for (const auto &[branch, count] : samples.branch_count_map())
+      (*expected.mutable_branch_count_map())[branch] += count;
+    ASSERT_TRUE(aggregator.Add(samples));
+  }
+  EXPECT_GT(aggregator.num_spilled_runs(), 1);
+
+  const std::string merged_file = FLAGS_test_tmpdir + "spilled.bin";
+  ASSERT_TRUE(aggregator.WriteBinary(merged_file));
+  devtools_crosstool_autofdo::BinarySampleReaderWriter reader(merged_file);
+  ASSERT_TRUE(reader.ReadAndSetTotalCount());
+  EXPECT_EQ(reader.range_count_map(), expected.range_count_map());
+  EXPECT_EQ(reader.address_count_map(), expected.address_count_map());
+  EXPECT_EQ(reader.branch_count_map(), expected.branch_count_map());
+
+  // The merged file is merged again, with itself, into memory.
+  devtools_crosstool_autofdo::SpillingSampleAggregator merger(
+      FLAGS_test_tmpdir, 1024);
+  merger.AddBinaryFile(merged_file);
+  merger.AddBinaryFile(merged_file);
+  devtools_crosstool_autofdo::CountedSampleReader merged;
+  ASSERT_TRUE(merger.MergeInto(&merged));
+  EXPECT_EQ(merged.address_count_map().size(),
+            expected.address_count_map().size());
+  for (const auto &[addr, count] : expected.address_count_map())
+    EXPECT_EQ(merged.address_count_map().at(addr), 2 * count);
+}
+
+TEST_F(SampleReaderTest, ReadTextWithHexPrefixAndWhitespace) {
+  const std::string file = FLAGS_test_tmpdir + "hex_prefix.txt";
+  FILE *fp = fopen(file.c_str(), "w");
+  ASSERT_NE(fp, nullptr);
+  fputs("2\n 0x10-0X20:5\n30-40:6\n1\n  ff:7\n1\n1->2:3", fp);
+  fclose(fp);
+
+  devtools_crosstool_autofdo::TextSampleReaderWriter reader(file);
+  ASSERT_TRUE(reader.ReadAndSetTotalCount());
+  EXPECT_EQ(reader.range_count_map().at({0x10, 0x20}), 5);
+  EXPECT_EQ(reader.range_count_map().at({0x30, 0x40}), 6);
+  EXPECT_EQ(reader.address_count_map().at(0xff), 7);
+  EXPECT_EQ(reader.branch_count_map().at({0x1, 0x2}), 3);
+}
+
 TEST_F(SampleReaderTest, ReadLBRWithDupEntries) {
   devtools_crosstool_autofdo::PerfDataSampleReader reader(
       FLAGS_test_srcdir + kTestDataDir + "dup.lbr", "dup.binary",
@@ -106,6 +314,27 @@ TEST_F(SampleReaderTest, ReadLBRWithDupEntries) {
   EXPECT_EQ(range_map.find(range2), range_map.end());
 }
 
+TEST_F(SampleReaderTest, ReleaseSamplesKeepsStatistics) {
+  devtools_crosstool_autofdo::PerfDataSampleReader reader(
+      FLAGS_test_srcdir + kTestDataDir + "test.lbr",
+      "test.binary", "");
+  ASSERT_TRUE(reader.ReadAndSetTotalCount());
+
+  reader.ReleaseSamplesBefore(0x1000);
+  EXPECT_EQ(reader.GetSampleCountOrZero(0xfe0), 0);
+  EXPECT_EQ(reader.GetSampleCountOrZero(0x1005), 18);
+  for (const auto &[range, count] : reader.range_count_map())
+    EXPECT_GE(range.first, 0x1000);
+  for (const auto &[branch, count] : reader.branch_count_map())
+    EXPECT_GE(branch.first, 0x1000);
+
+  reader.ReleaseSamples();
+  EXPECT_TRUE(reader.address_count_map().empty());
+  EXPECT_TRUE(reader.range_count_map().empty());
+  EXPECT_TRUE(reader.branch_count_map().empty());
+  EXPECT_EQ(reader.GetTotalSampleCount(), 134622);
+}
+
 TEST_F(SampleReaderTest, ReadKernelKallsymsProfile) {
   // Verify that the perf reader counts branches mapped to
   // [kernel.kallsyms]_stext when the kernel dso name is [kernel.kallsyms].
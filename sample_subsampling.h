@@ -0,0 +1,71 @@
+// Selects a deterministic fraction of the samples of a profile.
+
+#ifndef AUTOFDO_SAMPLE_SUBSAMPLING_H_
+#define AUTOFDO_SAMPLE_SUBSAMPLING_H_
+
+#include <cmath>
+#include <cstdint>
+
+namespace devtools_crosstool_autofdo {
+
+// Selects a stratified subset of a sequence of samples. The samples are split
+// into strata of stride() consecutive samples, and one sample of each stratum
+// is kept, at an offset derived from the seed and the stratum index. A kept
+// sample stands for all the samples of its stratum, so its counts are scaled
+// by stride(). The same fraction, seed and sample order always select the same
+// samples.
+//
+// The kept samples of even and odd strata form two disjoint halves of the
+// subset. How much the profiles of the two halves differ tells how much the
+// profile of the subset differs from the profile of all the samples.
+class StratifiedSampleSelector {
+ public:
+  // Keeps about "fraction" of the samples, rounded to 1 / stride() for an
+  // integer stride. A fraction outside of (0, 1) keeps every sample.
+  StratifiedSampleSelector(double fraction, uint64_t seed)
+      : stride_(fraction > 0 && fraction < 1
+                    ? static_cast<uint64_t>(std::llround(1 / fraction))
+                    : 1),
+        seed_(seed) {}
+
+  // Returns whether every sample is kept.
+  bool keeps_all() const { return stride_ == 1; }
+
+  // Returns the number of samples each kept sample stands for.
+  uint64_t stride() const { return stride_; }
+
+  // Returns whether the sample at "index" in the sequence is kept.
+  bool Keep(uint64_t index) const {
+    if (stride_ == 1) return true;
+    return index % stride_ == Mix(seed_ ^ (index / stride_)) % stride_;
+  }
+
+  // Returns the half, 0 or 1, the sample at "index" belongs to.
+  int Half(uint64_t index) const { return (index / stride_) % 2; }
+
+  // Estimates the overlap between the profile of the kept samples and the
+  // profile of all the samples from "half_overlap", the overlap between the
+  // profiles of the two halves. Each half has half the samples and thus twice
+  // the variance of the subset, so the two halves differ about twice as much
+  // as the subset differs from the full profile.
+  static double EstimateOverlapWithFull(double half_overlap) {
+    return 1 - (1 - half_overlap) / 2;
+  }
+
+ private:
+  // The splitmix64 finalizer. Unlike absl::Hash, it is the same in every
+  // process, so a seed always selects the same samples.
+  static uint64_t Mix(uint64_t x) {
+    x += 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+  }
+
+  uint64_t stride_;
+  uint64_t seed_;
+};
+
+}  // namespace devtools_crosstool_autofdo
+
+#endif  // AUTOFDO_SAMPLE_SUBSAMPLING_H_
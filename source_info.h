@@ -35,33 +35,10 @@ struct SourceInfo {
         discriminator(discriminator) {
   }
 
-  uint64_t Offset(bool use_discriminator_encoding) const {
-#if defined(HAVE_LLVM)
-    bool use_base_discriminator;
-    if (use_fs_discriminator)
-      use_base_discriminator = use_base_only_in_fs_discriminator;
-    else
-      use_base_discriminator = use_discriminator_encoding;
-    return GenerateOffset(
-        line - start_line,
-        (use_base_discriminator
-             ? llvm::DILocation::getBaseDiscriminatorFromDiscriminator(
-                   discriminator)
-             : discriminator));
-#else
-    return (static_cast<uint64_t>(line - start_line) << 32) | discriminator;
-#endif
-  }
+  // Returns the offset of the position, see WithDiscriminatorEncoding.
+  uint64_t Offset(bool use_discriminator_encoding) const;
 
-  uint32_t DuplicationFactor() const {
-#if defined(HAVE_LLVM)
-    if (use_fs_discriminator) return 1;
-    return llvm::DILocation::getDuplicationFactorFromDiscriminator(
-        discriminator);
-#else
-    return 1;
-#endif
-  }
+  uint32_t DuplicationFactor() const;
 
   bool HasInvalidInfo() const {
     if (start_line == 0 || line == 0) return true;
@@ -106,6 +83,71 @@ struct SourceInfo {
 };
 
 typedef std::vector<SourceInfo> SourceStack;
+
+// Encodes the positions of SourceInfo into offsets and duplication factors in
+// one fixed way, so that loops instantiated for an encoding test no flag per
+// position.
+//   kUseBaseDiscriminator: offsets only keep the base discriminator.
+//   kFsDiscriminator: discriminators are flow sensitive, without duplication
+//     factors.
+template <bool kUseBaseDiscriminator, bool kFsDiscriminator>
+struct DiscriminatorEncoding {
+  static uint64_t Offset(const SourceInfo &info) {
+#if defined(HAVE_LLVM)
+    return SourceInfo::GenerateOffset(
+        info.line - info.start_line,
+        (kUseBaseDiscriminator
+             ? llvm::DILocation::getBaseDiscriminatorFromDiscriminator(
+                   info.discriminator)
+             : info.discriminator));
+#else
+    return (static_cast<uint64_t>(info.line - info.start_line) << 32) |
+           info.discriminator;
+#endif
+  }
+
+  static uint32_t DuplicationFactor(const SourceInfo &info) {
+#if defined(HAVE_LLVM)
+    if (kFsDiscriminator) return 1;
+    return llvm::DILocation::getDuplicationFactorFromDiscriminator(
+        info.discriminator);
+#else
+    return 1;
+#endif
+  }
+};
+
+// Calls "fn" with the DiscriminatorEncoding of the discriminator mode set by
+// SymbolMap, where "use_discriminator_encoding" is the value of
+// --use_discriminator_encoding, and returns its result. "fn" is a generic
+// lambda, instantiated for each encoding, so the mode is tested once per call
+// rather than once per position.
+template <typename Fn>
+decltype(auto) WithDiscriminatorEncoding(bool use_discriminator_encoding,
+                                         Fn &&fn) {
+#if defined(HAVE_LLVM)
+  if (SourceInfo::use_fs_discriminator) {
+    if (SourceInfo::use_base_only_in_fs_discriminator)
+      return fn(DiscriminatorEncoding<true, true>());
+    return fn(DiscriminatorEncoding<false, true>());
+  }
+  if (use_discriminator_encoding)
+    return fn(DiscriminatorEncoding<true, false>());
+#endif
+  return fn(DiscriminatorEncoding<false, false>());
+}
+
+inline uint64_t SourceInfo::Offset(bool use_discriminator_encoding) const {
+  return WithDiscriminatorEncoding(
+      use_discriminator_encoding,
+      [this](auto encoding) { return decltype(encoding)::Offset(*this); });
+}
+
+inline uint32_t SourceInfo::DuplicationFactor() const {
+  return WithDiscriminatorEncoding(false, [this](auto encoding) {
+    return decltype(encoding)::DuplicationFactor(*this);
+  });
+}
 }  // namespace devtools_crosstool_autofdo
 
 #endif  // AUTOFDO_SOURCE_INFO_H_
@@ -0,0 +1,93 @@
+#include "stage_metrics.h"
+
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "trace_events.h"
+#include "third_party/abseil/absl/strings/str_cat.h"
+#include "third_party/abseil/absl/synchronization/mutex.h"
+#include "third_party/abseil/absl/time/clock.h"
+#include "third_party/abseil/absl/time/time.h"
+
+namespace devtools_crosstool_autofdo {
+
+int64_t GetCurrentRssBytes() {
+  // The second field of /proc/self/statm is the resident set size in pages.
+  std::ifstream statm("/proc/self/statm");
+  int64_t total_pages = 0, resident_pages = 0;
+  if (!(statm >> total_pages >> resident_pages)) return 0;
+  return resident_pages * sysconf(_SC_PAGESIZE);
+}
+
+int64_t GetPeakRssBytes() {
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) != 0) return 0;
+  // ru_maxrss is in kilobytes on Linux.
+  return static_cast<int64_t>(usage.ru_maxrss) * 1024;
+}
+
+StageMetricsRegistry &StageMetricsRegistry::GetInstance() {
+  static StageMetricsRegistry *registry = new StageMetricsRegistry();
+  return *registry;
+}
+
+void StageMetricsRegistry::Record(StageMetrics metrics) {
+  absl::MutexLock lock(&mutex_);
+  metrics_.push_back(std::move(metrics));
+}
+
+std::vector<StageMetrics> StageMetricsRegistry::GetMetrics() const {
+  absl::MutexLock lock(&mutex_);
+  return metrics_;
+}
+
+void StageMetricsRegistry::Clear() {
+  absl::MutexLock lock(&mutex_);
+  metrics_.clear();
+}
+
+std::string StageMetricsRegistry::ToJson() const {
+  std::string json = "[";
+  for (const StageMetrics &metrics : GetMetrics()) {
+    if (json.size() > 1) json += ",\n ";
+    absl::StrAppend(&json, "{\"stage\": \"", metrics.stage,
+                    "\", \"wall_time_seconds\": ",
+                    absl::ToDoubleSeconds(metrics.wall_time),
+                    ", \"rss_bytes\": ", metrics.rss_bytes,
+                    ", \"peak_rss_bytes\": ", metrics.peak_rss_bytes);
+    if (metrics.num_threads != 0) {
+      absl::StrAppend(&json, ", \"threads\": ", metrics.num_threads,
+                      ", \"tasks\": ", metrics.num_tasks,
+                      ", \"utilization\": ", metrics.utilization());
+    }
+    json += "}";
+  }
+  json += "]\n";
+  return json;
+}
+
+bool StageMetricsRegistry::WriteJson(const std::string &file_name) const {
+  std::ofstream out(file_name);
+  out << ToJson();
+  return static_cast<bool>(out);
+}
+
+ScopedStageTimer::~ScopedStageTimer() {
+  StageMetrics metrics;
+  metrics.stage = stage_;
+  const absl::Time end = absl::Now();
+  metrics.wall_time = end - start_;
+  metrics.rss_bytes = GetCurrentRssBytes();
+  metrics.peak_rss_bytes = GetPeakRssBytes();
+  StageMetricsRegistry::GetInstance().Record(std::move(metrics));
+  TraceRecorder::GetInstance().AddSpan(stage_, absl::ToUnixNanos(start_),
+                                       absl::ToUnixNanos(end));
+}
+
+}  // namespace devtools_crosstool_autofdo
@@ -0,0 +1,99 @@
+#ifndef AUTOFDO_STAGE_METRICS_H_
+#define AUTOFDO_STAGE_METRICS_H_
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "third_party/abseil/absl/base/thread_annotations.h"
+#include "third_party/abseil/absl/strings/string_view.h"
+#include "third_party/abseil/absl/synchronization/mutex.h"
+#include "third_party/abseil/absl/time/clock.h"
+#include "third_party/abseil/absl/time/time.h"
+
+namespace devtools_crosstool_autofdo {
+
+// Time and memory spent in one pipeline stage.
+struct StageMetrics {
+  std::string stage;
+  absl::Duration wall_time;
+  // Resident set size of the process when the stage finished.
+  int64_t rss_bytes = 0;
+  // Peak resident set size of the process up to the end of the stage. This is
+  // a process-wide high-water mark, so it also covers earlier stages and the
+  // stages running concurrently.
+  int64_t peak_rss_bytes = 0;
+  // For the stages run through ParallelFor, the number of threads and tasks,
+  // and the sum of the times the threads were busy. 0 for other stages.
+  int num_threads = 0;
+  int64_t num_tasks = 0;
+  absl::Duration busy_time;
+
+  // Returns the fraction of the thread time of a ParallelFor stage during
+  // which its threads were busy, or 0 for other stages.
+  double utilization() const {
+    if (num_threads == 0 || wall_time == absl::ZeroDuration()) return 0;
+    return busy_time / (wall_time * num_threads);
+  }
+};
+
+// Returns the current resident set size of the process, or 0 if unknown.
+int64_t GetCurrentRssBytes();
+
+// Returns the peak resident set size of the process, or 0 if unknown.
+int64_t GetPeakRssBytes();
+
+// Collects the metrics of all stages of the process, in the order in which
+// they finished. Thread-safe.
+class StageMetricsRegistry {
+ public:
+  // Retrieve the global registry instance.
+  static StageMetricsRegistry &GetInstance();
+  StageMetricsRegistry() = default;
+
+  StageMetricsRegistry(const StageMetricsRegistry &) = delete;
+  StageMetricsRegistry(StageMetricsRegistry &&) = delete;
+  StageMetricsRegistry &operator=(const StageMetricsRegistry &) = delete;
+  StageMetricsRegistry &operator=(StageMetricsRegistry &&) = delete;
+
+  void Record(StageMetrics metrics) ABSL_LOCKS_EXCLUDED(mutex_);
+  std::vector<StageMetrics> GetMetrics() const ABSL_LOCKS_EXCLUDED(mutex_);
+  void Clear() ABSL_LOCKS_EXCLUDED(mutex_);
+
+  // Returns the metrics as a JSON array with one object per stage, for
+  // example:
+  //   [{"stage": "ReadSample", "wall_time_seconds": 1.5,
+  //     "rss_bytes": 1048576, "peak_rss_bytes": 2097152}]
+  // ParallelFor stages also have "threads", "tasks" and "utilization".
+  // This is also what a status consumer serves next to the progress.
+  std::string ToJson() const ABSL_LOCKS_EXCLUDED(mutex_);
+
+  // Writes ToJson() to `file_name`. Returns false if the file can not be
+  // written.
+  bool WriteJson(const std::string &file_name) const;
+
+ private:
+  mutable absl::Mutex mutex_;
+  std::vector<StageMetrics> metrics_ ABSL_GUARDED_BY(mutex_);
+};
+
+// Records the wall time and the memory usage of the enclosing scope as the
+// metrics of `stage` into StageMetricsRegistry::GetInstance(), and as a span
+// into TraceRecorder::GetInstance(). Stage names are emitted into JSON
+// verbatim and must not need escaping.
+class ScopedStageTimer {
+ public:
+  explicit ScopedStageTimer(absl::string_view stage)
+      : stage_(stage), start_(absl::Now()) {}
+  ~ScopedStageTimer();
+
+  ScopedStageTimer(const ScopedStageTimer &) = delete;
+  ScopedStageTimer &operator=(const ScopedStageTimer &) = delete;
+
+ private:
+  const std::string stage_;
+  const absl::Time start_;
+};
+
+}  // namespace devtools_crosstool_autofdo
+#endif  // AUTOFDO_STAGE_METRICS_H_
@@ -27,4 +27,11 @@ int MultiStatusProvider::GetProgress() const {
   return (finished_weight + static_cast<float>(w) * p / 100) * 100 /
          total_weight_;
 }
+
+StatusCounters MultiStatusProvider::GetCounters() const {
+  StatusCounters counters;
+  for (const WeightedStatusProvider &p : weighted_statuses_)
+    counters += p.status_provider->GetCounters();
+  return counters;
+}
 }  // namespace devtools_crosstool_autofdo
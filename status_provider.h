@@ -2,17 +2,42 @@
 #define AUTOFDO_STATUS_PROVIDER_H_
 
 #include <algorithm>
+#include <atomic>
+#include <cstdint>
 #include <functional>
 #include <memory>
 #include <string>
 #include <utility>
+#include <vector>
 
 #include "third_party/abseil/absl/algorithm/container.h"
 #include "third_party/abseil/absl/strings/string_view.h"
 
 namespace devtools_crosstool_autofdo {
 
-// Defines an interface that provides status upon request.
+// A snapshot of the fine-grained counters of a job. Together with the elapsed
+// time, consumers can derive throughput (e.g., samples/sec) from these.
+struct StatusCounters {
+  // Number of perf samples aggregated.
+  int64_t samples_processed = 0;
+  // Number of bytes of profile data parsed.
+  int64_t bytes_parsed = 0;
+  // Number of functions whose layout has been computed.
+  int64_t functions_laid_out = 0;
+  // Estimated bytes held by the data structures built by the job.
+  int64_t memory_bytes = 0;
+
+  StatusCounters &operator+=(const StatusCounters &other) {
+    samples_processed += other.samples_processed;
+    bytes_parsed += other.bytes_parsed;
+    functions_laid_out += other.functions_laid_out;
+    memory_bytes += other.memory_bytes;
+    return *this;
+  }
+};
+
+// Defines an interface that provides status upon request. Status may be
+// requested from a different thread than the one running the job.
 class StatusProvider {
  public:
   virtual ~StatusProvider() = default;
@@ -20,11 +45,14 @@ class StatusProvider {
   virtual std::string GetJob() const = 0;
   // Returns the percentage done, in the range of [0, 100].
   virtual int GetProgress() const = 0;
+  // Returns the current counters of the job.
+  virtual StatusCounters GetCounters() const = 0;
   virtual bool IsDone() const = 0;
   virtual void SetDone() = 0;
 };
 
-// Defines a default status provider that represents a single job.
+// Defines a default status provider that represents a single job. All setters
+// are lock-free and may be called concurrently from worker threads.
 class DefaultStatusProvider : public StatusProvider {
  public:
   explicit DefaultStatusProvider(absl::string_view job)
@@ -36,15 +64,44 @@ class DefaultStatusProvider : public StatusProvider {
   DefaultStatusProvider & operator=(DefaultStatusProvider &&) = delete;
 
   std::string GetJob() const override { return job_; }
-  int GetProgress() const override { return progress_; }
-  bool IsDone() const override { return progress_ >= 100; }
+  int GetProgress() const override {
+    return progress_.load(std::memory_order_relaxed);
+  }
+  StatusCounters GetCounters() const override {
+    StatusCounters counters;
+    counters.samples_processed =
+        samples_processed_.load(std::memory_order_relaxed);
+    counters.bytes_parsed = bytes_parsed_.load(std::memory_order_relaxed);
+    counters.functions_laid_out =
+        functions_laid_out_.load(std::memory_order_relaxed);
+    counters.memory_bytes = memory_bytes_.load(std::memory_order_relaxed);
+    return counters;
+  }
+  bool IsDone() const override { return GetProgress() >= 100; }
 
-  void SetProgress(int p) { progress_ = p; }
+  void SetProgress(int p) { progress_.store(p, std::memory_order_relaxed); }
   void SetDone() override { SetProgress(100); }
 
+  void AddSamplesProcessed(int64_t n) {
+    samples_processed_.fetch_add(n, std::memory_order_relaxed);
+  }
+  void AddBytesParsed(int64_t n) {
+    bytes_parsed_.fetch_add(n, std::memory_order_relaxed);
+  }
+  void AddFunctionsLaidOut(int64_t n) {
+    functions_laid_out_.fetch_add(n, std::memory_order_relaxed);
+  }
+  void SetMemoryBytes(int64_t n) {
+    memory_bytes_.store(n, std::memory_order_relaxed);
+  }
+
  private:
   const std::string job_;
-  int progress_;
+  std::atomic<int> progress_;
+  std::atomic<int64_t> samples_processed_ = 0;
+  std::atomic<int64_t> bytes_parsed_ = 0;
+  std::atomic<int64_t> functions_laid_out_ = 0;
+  std::atomic<int64_t> memory_bytes_ = 0;
 };
 
 // MultiStatusProvider reports status based on multiple sub-statuses. Suppose
@@ -73,6 +130,8 @@ class MultiStatusProvider : public StatusProvider {
 
   std::string GetJob() const override;
   int GetProgress() const override;
+  // Returns the sum of the counters of all sub status providers.
+  StatusCounters GetCounters() const override;
   bool IsDone() const override {
     return FindWorkingStatusProvider() == nullptr;
   }
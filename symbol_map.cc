@@ -5,29 +5,36 @@
 #include <elf.h>
 
 #include <algorithm>
+#include <atomic>
 #include <cstdint>
+#include <functional>
 #include <map>
 #include <memory>
-#include <set>
+#include <string>
+#include <thread>  // NOLINT(build/c++11)
+#include <utility>
+#include <vector>
 
 #include "base/commandlineflags.h"
 #include "base/logging.h"
 #include "addr2line.h"
+#include "memory_usage.h"
+#include "name_interner.h"
+#include "parallel_for.h"
 #include "third_party/abseil/absl/container/flat_hash_map.h"
 #include "third_party/abseil/absl/container/flat_hash_set.h"
 #include "third_party/abseil/absl/container/node_hash_map.h"
 #include "third_party/abseil/absl/debugging/internal/demangle.h"
 #include "third_party/abseil/absl/flags/flag.h"
+#include "third_party/abseil/absl/functional/function_ref.h"
 #include "third_party/abseil/absl/memory/memory.h"
 #include "third_party/abseil/absl/strings/match.h"
 #include "third_party/abseil/absl/strings/str_format.h"
+#include "third_party/abseil/absl/synchronization/mutex.h"
+#include "third_party/abseil/absl/types/span.h"
 #include <regex>
 #include "util/symbolize/elf_reader.h"
 
-#if defined(HAVE_LLVM)
-#include "llvm/ADT/StringSet.h"
-#endif
-
 ABSL_FLAG(int32_t, dump_cutoff_percent, 2,
           "functions that has total count lower than this percentage of "
           "the max function count will not show in the dump");
@@ -57,36 +64,47 @@ ABSL_FLAG(uint64_t, inline_instances_at_same_loc_cutoff, -1,
           "apparent benefit. ");
 
 namespace {
-// Prints some blank space for identation.
-void Identation(int ident) {
-  for (int i = 0; i < ident; i++) {
-    printf(" ");
-  }
-}
-
 using devtools_crosstool_autofdo::SourceInfo;
 
-void PrintSourceLocation(uint32_t start_line, uint64_t offset, int ident) {
-  Identation(ident);
+// Appends the source location of OFFSET, indented by IDENT spaces, to OUT.
+void AppendSourceLocation(uint32_t start_line, uint64_t offset, int ident,
+                          std::string *out) {
+  out->append(ident, ' ');
   uint32_t line = SourceInfo::GetLineNumberFromOffset(offset);
   uint32_t discriminator = SourceInfo::GetDiscriminatorFromOffset(offset);
   if (discriminator) {
-    printf("%u.%u: ", line + start_line, discriminator);
+    absl::StrAppendFormat(out, "%u.%u: ", line + start_line, discriminator);
   } else {
-    printf("%u: ", line + start_line);
+    absl::StrAppendFormat(out, "%u: ", line + start_line);
   }
 }
 
 static const char *selectedSuffixes[] = {".cold", ".llvm.", ".lto_priv.", ".part.", ".isra."};
 
-std::string getPrintName(const char *name) {
-  char tmp_buf[1024];
+// Returns NAME, demangled if --demangle_symbol_names is set. The demangled
+// names are cached by interned name id, so that a function which appears in
+// many callsites and call targets is demangled only once.
+const char *getPrintName(const char *name) {
   if (!absl::GetFlag(FLAGS_demangle_symbol_names)) return name;
-  if (!absl::debugging_internal::Demangle(name, tmp_buf, sizeof(tmp_buf))) {
-    LOG(WARNING) << "Demangle failed: " << std::string(name);
-    return "";
+  static absl::Mutex mutex(absl::kConstInit);
+  static auto *demangled_names = new std::vector<const char *>();
+  devtools_crosstool_autofdo::NameInterner &interner =
+      devtools_crosstool_autofdo::NameInterner::Global();
+  const uint32_t id = interner.Intern(name);
+  absl::MutexLock lock(&mutex);
+  if (id >= demangled_names->size())
+    demangled_names->resize(id + 1, nullptr);
+  const char *&demangled = (*demangled_names)[id];
+  if (demangled == nullptr) {
+    char tmp_buf[1024];
+    if (absl::debugging_internal::Demangle(name, tmp_buf, sizeof(tmp_buf))) {
+      demangled = interner.InternName(tmp_buf);
+    } else {
+      LOG(WARNING) << "Demangle failed: " << std::string(name);
+      demangled = "";
+    }
   }
-  return tmp_buf;
+  return demangled;
 }
 }  // namespace
 
@@ -123,12 +141,83 @@ bool SymbolMap::IsLLVMCompiler(const std::string &path) {
   return absl::StrContains(path, "-llvm-");
 }
 
+namespace {
+// Hands out storage for Symbols. Storage is taken from blocks of
+// kSymbolsPerBlock symbols, and freed storage is kept on a free list for the
+// next allocation. Blocks are never returned to the system.
+class SymbolPool {
+ public:
+  static SymbolPool &Global() {
+    static SymbolPool *pool = new SymbolPool();
+    return *pool;
+  }
+
+  void *Allocate() ABSL_LOCKS_EXCLUDED(mutex_) {
+    absl::MutexLock lock(&mutex_);
+    if (free_list_ != nullptr) {
+      FreeSymbol *result = free_list_;
+      free_list_ = result->next;
+      return result;
+    }
+    if (num_unused_ == 0) {
+      blocks_.push_back(std::make_unique<Storage[]>(kSymbolsPerBlock));
+      num_unused_ = kSymbolsPerBlock;
+    }
+    return &blocks_.back()[kSymbolsPerBlock - num_unused_--];
+  }
+
+  void Free(void *ptr) ABSL_LOCKS_EXCLUDED(mutex_) {
+    absl::MutexLock lock(&mutex_);
+    FreeSymbol *symbol = static_cast<FreeSymbol *>(ptr);
+    symbol->next = free_list_;
+    free_list_ = symbol;
+  }
+
+ private:
+  static constexpr size_t kSymbolsPerBlock = 1024;
+  struct FreeSymbol {
+    FreeSymbol *next;
+  };
+  struct Storage {
+    alignas(Symbol) char bytes[sizeof(Symbol)];
+  };
+
+  absl::Mutex mutex_;
+  std::vector<std::unique_ptr<Storage[]>> blocks_ ABSL_GUARDED_BY(mutex_);
+  // Number of never used symbols at the end of blocks_.back().
+  size_t num_unused_ ABSL_GUARDED_BY(mutex_) = 0;
+  FreeSymbol *free_list_ ABSL_GUARDED_BY(mutex_) = nullptr;
+};
+}  // namespace
+
+void *Symbol::operator new(size_t size) {
+  if (size != sizeof(Symbol)) return ::operator new(size);
+  return SymbolPool::Global().Allocate();
+}
+
+void Symbol::operator delete(void *ptr, size_t size) {
+  if (ptr == nullptr) return;
+  if (size != sizeof(Symbol)) {
+    ::operator delete(ptr);
+    return;
+  }
+  SymbolPool::Global().Free(ptr);
+}
+
 Symbol::~Symbol() {
   for (auto &callsite_symbol : callsites) {
     delete callsite_symbol.second;
   }
 }
 
+void Symbol::ReleaseProfile() {
+  for (auto &callsite_symbol : callsites) {
+    delete callsite_symbol.second;
+  }
+  CallsiteMap().swap(callsites);
+  PositionCountMap().swap(pos_counts);
+}
+
 void Symbol::Merge(const Symbol *other) {
   total_count += other->total_count;
   head_count += other->head_count;
@@ -152,6 +241,38 @@ void Symbol::Merge(const Symbol *other) {
   }
 }
 
+void Symbol::Merge(Symbol &&other) {
+  total_count += other.total_count;
+  head_count += other.head_count;
+  if (info.file_name.empty()) {
+    info.file_name = other.info.file_name;
+    info.dir_name = other.info.dir_name;
+  }
+  if (pos_counts.empty()) {
+    pos_counts.swap(other.pos_counts);
+  } else {
+    for (auto &[pos, pos_info] : other.pos_counts) {
+      auto [it, inserted] = pos_counts.try_emplace(pos, std::move(pos_info));
+      if (!inserted) it->second += pos_info;
+    }
+  }
+  if (callsites.empty()) {
+    callsites.swap(other.callsites);
+  } else {
+    // Callees this symbol lacks are spliced in whole, and are no longer owned
+    // by "other".
+    for (auto &[callsite, callee] : other.callsites) {
+      auto [it, inserted] = callsites.try_emplace(callsite, callee);
+      if (inserted) {
+        callee = nullptr;
+      } else {
+        it->second->Merge(std::move(*callee));
+      }
+    }
+  }
+  other.ReleaseProfile();
+}
+
 struct CallsiteLessThan {
   bool operator()(const Callsite& c1, const Callsite& c2) const {
     if (c1.first != c2.first)
@@ -251,6 +372,15 @@ void SymbolMap::set_suffix_elision_policy(const std::string &policy) {
     suffix_elision_policy_ = ElideNone;
   else
     LOG(FATAL) << "suffix elision policy " << policy << " not supported.";
+  // Names that had nothing to elide may have a suffix under the new policy.
+  {
+    absl::MutexLock lock(&original_name_mutex_);
+    original_name_ids_.clear();
+  }
+  names_to_elide_.clear();
+  for (const auto &name_symbol : map_) {
+    names_to_elide_.push_back(&name_symbol.first);
+  }
 }
 
 // Strip the suffix literally and keep the parts before and after the
@@ -282,6 +412,73 @@ static bool StripSuffixWithTwoDots(std::string &input,
 }
 
 std::string SymbolMap::GetOriginalName(const char *name) const {
+  if (suffix_elision_policy_ == ElideNone) return name;
+  NameInterner &interner = NameInterner::Global();
+  return interner.GetName(GetOriginalNameId(interner.Intern(name)));
+}
+
+uint32_t SymbolMap::GetOriginalNameId(uint32_t name_id) const {
+  {
+    absl::MutexLock lock(&original_name_mutex_);
+    if (name_id < original_name_ids_.size() &&
+        original_name_ids_[name_id] != kUnknownNameId)
+      return original_name_ids_[name_id];
+  }
+  NameInterner &interner = NameInterner::Global();
+  const uint32_t original_id =
+      interner.Intern(ComputeOriginalName(interner.GetName(name_id)));
+  absl::MutexLock lock(&original_name_mutex_);
+  if (name_id >= original_name_ids_.size())
+    original_name_ids_.resize(name_id + 1, kUnknownNameId);
+  original_name_ids_[name_id] = original_id;
+  return original_id;
+}
+
+void SymbolMap::CacheOriginalNames(
+    const std::vector<uint32_t> &name_ids) const {
+  std::vector<uint32_t> missing_ids;
+  {
+    absl::MutexLock lock(&original_name_mutex_);
+    for (uint32_t id : name_ids) {
+      if (id >= original_name_ids_.size() ||
+          original_name_ids_[id] == kUnknownNameId)
+        missing_ids.push_back(id);
+    }
+  }
+  if (missing_ids.empty()) return;
+
+  // The names are elided on separate threads, and then interned at once,
+  // since the interner takes a lock for every name.
+  NameInterner &interner = NameInterner::Global();
+  std::vector<std::string> original_names(missing_ids.size());
+  constexpr size_t kMinNamesPerThread = 1 << 14;
+  const size_t num_chunks = std::max<size_t>(
+      1, std::min<size_t>(std::thread::hardware_concurrency(),
+                          missing_ids.size() / kMinNamesPerThread));
+  auto elide_chunk = [&](size_t chunk) {
+    const size_t end = missing_ids.size() * (chunk + 1) / num_chunks;
+    for (size_t i = missing_ids.size() * chunk / num_chunks; i < end; ++i)
+      original_names[i] = ComputeOriginalName(interner.GetName(missing_ids[i]));
+  };
+  std::vector<std::thread> workers;
+  for (size_t chunk = 1; chunk < num_chunks; ++chunk)
+    workers.emplace_back(elide_chunk, chunk);
+  elide_chunk(0);
+  for (std::thread &worker : workers) worker.join();
+
+  std::vector<uint32_t> original_ids;
+  original_ids.reserve(original_names.size());
+  for (const std::string &original_name : original_names)
+    original_ids.push_back(interner.Intern(original_name));
+  absl::MutexLock lock(&original_name_mutex_);
+  for (size_t i = 0; i < missing_ids.size(); ++i) {
+    if (missing_ids[i] >= original_name_ids_.size())
+      original_name_ids_.resize(missing_ids[i] + 1, kUnknownNameId);
+    original_name_ids_[missing_ids[i]] = original_ids[i];
+  }
+}
+
+std::string SymbolMap::ComputeOriginalName(const char *name) const {
   if (suffix_elision_policy_ == ElideNone) {
     return name;
   } else if (suffix_elision_policy_ == ElideAll) {
@@ -319,51 +516,99 @@ std::string SymbolMap::GetOriginalName(const char *name) const {
 }
 
 void SymbolMap::ElideSuffixesAndMerge() {
-  std::vector<std::string> suffix_elide_set;
-  for (auto &name_symbol : map_) {
-    std::string orig_name = GetOriginalName(name_symbol.first.c_str());
-    if (orig_name != name_symbol.first)
-      suffix_elide_set.push_back(name_symbol.first.c_str());
-  }
-  for (const auto &name : suffix_elide_set) {
-    std::string orig_name = GetOriginalName(name.c_str());
+  // Only names added since the last call can still have a suffix. They are
+  // visited in name order, as a scan of map_ would.
+  std::vector<const std::string *> new_names;
+  new_names.swap(names_to_elide_);
+  std::sort(new_names.begin(), new_names.end(),
+            [](const std::string *a, const std::string *b) { return *a < *b; });
+  if (suffix_elision_policy_ == ElideNone) return;
+  NameInterner &interner = NameInterner::Global();
+  std::vector<uint32_t> name_ids;
+  name_ids.reserve(new_names.size());
+  for (const std::string *name : new_names)
+    name_ids.push_back(interner.Intern(*name));
+  CacheOriginalNames(name_ids);
+  // Interned names are equal iff their ids are.
+  std::vector<std::pair<std::string, uint32_t>> suffix_elide_set;
+  for (size_t i = 0; i < new_names.size(); ++i) {
+    const uint32_t original_id = GetOriginalNameId(name_ids[i]);
+    if (original_id != name_ids[i])
+      suffix_elide_set.emplace_back(*new_names[i], original_id);
+  }
+  if (suffix_elide_set.empty()) return;
+
+  // Maps each merged symbol to the symbol it was merged into. The other names
+  // of a merged symbol are redirected once at the end rather than by a scan
+  // of map_ per merge.
+  absl::flat_hash_map<Symbol *, Symbol *> merged_into;
+  auto resolve = [&merged_into](Symbol *sym) {
+    for (auto it = merged_into.find(sym); it != merged_into.end();
+         it = merged_into.find(sym)) {
+      sym = it->second;
+    }
+    return sym;
+  };
+  for (const auto &[name, original_id] : suffix_elide_set) {
+    const std::string orig_name = interner.GetName(original_id);
     auto iter = map_.find(name);
     CHECK(iter != map_.end());
-    Symbol *sym = iter->second;
+    Symbol *sym = resolve(iter->second);
     map_.erase(iter);
 
     std::pair<NameSymbolMap::iterator, bool> ret =
         map_.insert(NameSymbolMap::value_type(orig_name, nullptr));
-    if (ret.second || sym == ret.first->second) {
+    if (ret.second) names_to_elide_.push_back(&ret.first->first);
+    Symbol *merged = ret.second ? nullptr : resolve(ret.first->second);
+    if (merged == nullptr || merged == sym) {
       unique_symbols_.push_back(
           std::make_unique<Symbol>(ret.first->first.c_str(), "", "", 0));
-      ret.first->second = unique_symbols_.back().get();
-    }
-
-    ret.first->second->Merge(sym);
-    for (auto &n_s : map_) {
-      if (n_s.second == sym)
-        n_s.second = ret.first->second;
+      merged = unique_symbols_.back().get();
     }
+    ret.first->second = merged;
+    merged->Merge(sym);
+    merged_into[sym] = merged;
   }
+  for (auto &n_s : map_) n_s.second = resolve(n_s.second);
 }
 
 void SymbolMap::AddSymbol(const std::string &name) {
   std::pair<NameSymbolMap::iterator, bool> ret = map_.insert(
       NameSymbolMap::value_type(name, nullptr));
   if (ret.second) {
+    names_to_elide_.push_back(&ret.first->first);
     unique_symbols_.push_back(
         std::make_unique<Symbol>(ret.first->first.c_str(), "", "", 0));
     ret.first->second = unique_symbols_.back().get();
     NameAliasMap::const_iterator alias_iter = name_alias_map_.find(name);
     if (alias_iter != name_alias_map_.end()) {
       for (const auto &name : alias_iter->second) {
-        map_[name] = ret.first->second;
+        SetSymbol(name, ret.first->second);
       }
     }
   }
 }
 
+void SymbolMap::MergeProfilesFrom(SymbolMap *other) {
+  absl::flat_hash_set<Symbol *> merged;
+  for (const auto &[name, symbol] : other->map_) {
+    if (!merged.insert(symbol).second) continue;
+    auto it = map_.find(name);
+    CHECK(it != map_.end()) << name << " is not in the symbol map.";
+    it->second->Merge(std::move(*symbol));
+  }
+  other->map_.clear();
+  other->names_to_elide_.clear();
+  other->unique_symbols_.clear();
+}
+
+void SymbolMap::AddProfilesFrom(SymbolMap *other) {
+  for (const auto &[name, symbol] : other->map_) {
+    AddSymbol(name);
+  }
+  MergeProfilesFrom(other);
+}
+
 void SymbolMap::AddSymbolMappings(const NameSymbolMap &new_map) {
   absl::flat_hash_set<Symbol *> new_symbols;
   for (const auto &name_symbol : new_map) {
@@ -371,10 +616,15 @@ void SymbolMap::AddSymbolMappings(const NameSymbolMap &new_map) {
     if (ret.second) {
       unique_symbols_.push_back(absl::WrapUnique(name_symbol.second));
     }
-    map_[name_symbol.first] = name_symbol.second;
+    SetSymbol(name_symbol.first, name_symbol.second);
   }
 }
 
+void SymbolMap::SetSymbol(const std::string &name, Symbol *symbol) {
+  auto [it, inserted] = map_.insert_or_assign(name, symbol);
+  if (inserted) names_to_elide_.push_back(&it->first);
+}
+
 void SymbolMap::CalculateThresholdFromTotalCount(int64_t total_count) {
   count_threshold_ = total_count * absl::GetFlag(FLAGS_sample_threshold_frac);
   if (count_threshold_ < kMinSamples) {
@@ -402,25 +652,47 @@ const bool SymbolMap::GetSymbolInfoByAddr(uint64_t addr,
                                           const std::string **name,
                                           uint64_t *start_addr,
                                           uint64_t *end_addr) const {
-  AddressSymbolMap::const_iterator ret = address_symbol_map_.upper_bound(addr);
-  if (ret == address_symbol_map_.begin()) {
+  size_t n = symbol_start_addrs_.size();
+  if (n == 0 || addr < symbol_start_addrs_[0]) {
     return false;
   }
-  ret--;
-  if (addr >= ret->first && addr < ret->first + ret->second.second) {
-    if (name) {
-      *name = &ret->second.first;
-    }
-    if (start_addr) {
-      *start_addr = ret->first;
-    }
-    if (end_addr) {
-      *end_addr = ret->first + ret->second.second;
-    }
-    return true;
-  } else {
+  // Branchless search for the last symbol that starts at or before addr. The
+  // loop runs exactly ceil(log2(n)) times and the comparison compiles to a
+  // conditional move, so there are no mispredicted branches.
+  const uint64_t *base = symbol_start_addrs_.data();
+  while (n > 1) {
+    const size_t half = n / 2;
+    base = (base[half] <= addr) ? base + half : base;
+    n -= half;
+  }
+  const size_t i = base - symbol_start_addrs_.data();
+  if (addr >= symbol_end_addrs_[i]) {
     return false;
   }
+  if (name) {
+    *name = symbol_names_[i];
+  }
+  if (start_addr) {
+    *start_addr = symbol_start_addrs_[i];
+  }
+  if (end_addr) {
+    *end_addr = symbol_end_addrs_[i];
+  }
+  return true;
+}
+
+void SymbolMap::BuildAddressSymbolIndex() {
+  symbol_start_addrs_.clear();
+  symbol_end_addrs_.clear();
+  symbol_names_.clear();
+  symbol_start_addrs_.reserve(address_symbol_map_.size());
+  symbol_end_addrs_.reserve(address_symbol_map_.size());
+  symbol_names_.reserve(address_symbol_map_.size());
+  for (const auto &[addr, symbol] : address_symbol_map_) {
+    symbol_start_addrs_.push_back(addr);
+    symbol_end_addrs_.push_back(addr + symbol.second);
+    symbol_names_.push_back(&symbol.first);
+  }
 }
 
 const std::string *SymbolMap::GetSymbolNameByStartAddr(uint64_t addr) const {
@@ -431,29 +703,86 @@ const std::string *SymbolMap::GetSymbolNameByStartAddr(uint64_t addr) const {
   return &ret->second.first;
 }
 
+namespace {
+// A function symbol of the symbol table. The name points into the string
+// table of the binary, which stays mapped while the ElfReader exists.
+struct SymbolTableEntry {
+  uint64_t address;
+  uint64_t size;
+  const char *name;
+};
+
+// Stable-sorts entries by address. Large tables are sorted in chunks on
+// separate threads, and the sorted chunks are then merged.
+void SortSymbolTableEntries(std::vector<SymbolTableEntry> *entries) {
+  auto by_address = [](const SymbolTableEntry &a, const SymbolTableEntry &b) {
+    return a.address < b.address;
+  };
+  constexpr size_t kMinEntriesPerThread = 1 << 16;
+  const size_t num_chunks = std::max<size_t>(
+      1, std::min<size_t>(std::thread::hardware_concurrency(),
+                          entries->size() / kMinEntriesPerThread));
+  std::vector<size_t> bounds;
+  for (size_t i = 0; i <= num_chunks; ++i)
+    bounds.push_back(entries->size() * i / num_chunks);
+  auto sort_chunk = [&](size_t chunk) {
+    std::stable_sort(entries->begin() + bounds[chunk],
+                     entries->begin() + bounds[chunk + 1], by_address);
+  };
+  std::vector<std::thread> workers;
+  for (size_t chunk = 1; chunk < num_chunks; ++chunk)
+    workers.emplace_back(sort_chunk, chunk);
+  sort_chunk(0);
+  for (std::thread &worker : workers) worker.join();
+  for (size_t width = 1; width < num_chunks; width *= 2) {
+    for (size_t i = 0; i + width < num_chunks; i += 2 * width) {
+      std::inplace_merge(entries->begin() + bounds[i],
+                         entries->begin() + bounds[i + width],
+                         entries->begin() +
+                             bounds[std::min(i + 2 * width, num_chunks)],
+                         by_address);
+    }
+  }
+}
+}  // namespace
+
+// Collects the symbols into a flat array, to be sorted and turned into
+// the address and alias maps at once rather than one tree insertion per
+// symbol.
 class SymbolReader : public ElfReader::SymbolSink {
  public:
-  explicit SymbolReader(NameAliasMap *name_alias_map,
-                        AddressSymbolMap *address_symbol_map)
-      : name_alias_map_(name_alias_map),
-        address_symbol_map_(address_symbol_map) { }
+  SymbolReader() {}
   void AddSymbol(const char *name, uint64_t address, uint64_t size, int binding,
                  int type, int section) override {
     if (strcmp(name, SymbolMap::get_fs_discriminator_symbol()) == 0)
       use_fs_discriminaor_ = true;
-    std::pair<AddressSymbolMap::iterator, bool> ret =
-        address_symbol_map_->insert(
-            std::make_pair(address, std::make_pair(std::string(name), size)));
-    if (!ret.second) {
-      (*name_alias_map_)[ret.first->second.first].insert(name);
-    }
+    entries_.push_back({address, size, name});
   }
   virtual ~SymbolReader() { }
   bool use_fs_discriminaor() const { return use_fs_discriminaor_; }
 
+  // Adds the symbols to address_symbol_map. The first symbol visited at an
+  // address gives its name and size, and the others become its aliases in
+  // name_alias_map.
+  void BuildMaps(NameAliasMap *name_alias_map,
+                 AddressSymbolMap *address_symbol_map) {
+    SortSymbolTableEntries(&entries_);
+    for (size_t i = 0; i < entries_.size();) {
+      const SymbolTableEntry &first = entries_[i];
+      auto ret = address_symbol_map->emplace_hint(
+          address_symbol_map->end(), first.address,
+          std::make_pair(std::string(first.name), first.size));
+      for (++i; i < entries_.size() && entries_[i].address == first.address;
+           ++i) {
+        (*name_alias_map)[ret->second.first].insert(entries_[i].name);
+      }
+    }
+    entries_.clear();
+    entries_.shrink_to_fit();
+  }
+
  private:
-  NameAliasMap *name_alias_map_;
-  AddressSymbolMap *address_symbol_map_;
+  std::vector<SymbolTableEntry> entries_;
   bool use_fs_discriminaor_ = false;
 
   DISALLOW_COPY_AND_ASSIGN(SymbolReader);
@@ -461,28 +790,47 @@ class SymbolReader : public ElfReader::SymbolSink {
 
 
 // TODO(shenhan): cl/394265532 not pulled in.
-void SymbolMap::BuildSymbolMap() {
-  ElfReader elf_reader(binary_);
-  base_addr_ = elf_reader.VaddrOfFirstLoadSegment();
+SymbolMap::SymbolMap(const SymbolMap *binary_symbols)
+    : name_alias_map_(binary_symbols->name_alias_map_),
+      address_symbol_map_(binary_symbols->address_symbol_map_),
+      binary_(binary_symbols->binary_),
+      base_addr_(binary_symbols->base_addr_),
+      count_threshold_(0),
+      ignore_thresholds_(false),
+      suffix_elision_policy_(binary_symbols->suffix_elision_policy_),
+      uses_fs_discriminator_(binary_symbols->uses_fs_discriminator_) {
+  SetFsDiscriminatorMode();
+  BuildNameAddressMap();
+  BuildAddressSymbolIndex();
+}
+
+std::unique_ptr<SymbolMap> SymbolMap::CopyBinarySymbols() const {
+  return absl::WrapUnique(new SymbolMap(this));
+}
+
+void SymbolMap::SetFsDiscriminatorMode() const {
 #if defined(HAVE_LLVM)
-  SourceInfo::use_fs_discriminator = false;
-  SourceInfo::use_base_only_in_fs_discriminator = false;
+  SourceInfo::use_fs_discriminator =
+      uses_fs_discriminator_ || absl::GetFlag(FLAGS_use_fs_discriminator);
+  SourceInfo::use_base_only_in_fs_discriminator =
+      absl::GetFlag(FLAGS_use_base_only_in_fs_discriminator);
 #endif
-  SymbolReader symbol_reader(&name_alias_map_, &address_symbol_map_);
+}
+
+void SymbolMap::BuildSymbolMap() {
+  std::shared_ptr<ElfReader> elf_reader = ElfReader::GetShared(binary_);
+  base_addr_ = elf_reader->VaddrOfFirstLoadSegment();
+  SymbolReader symbol_reader;
   symbol_reader.filter = [](const char *name, uint64 address, uint64 size,
                             int binding, int type, int section) {
     if (strcmp(name, get_fs_discriminator_symbol()) == 0) return true;
     return (size != 0 && (type == STT_FUNC || absl::EndsWith(name, ".cold")) &&
             strcmp(name + strlen(name) - 4, "@plt") != 0);
   };
-  elf_reader.VisitSymbols(&symbol_reader);
-#if defined(HAVE_LLVM)
-  if (symbol_reader.use_fs_discriminaor() ||
-      absl::GetFlag(FLAGS_use_fs_discriminator))
-    SourceInfo::use_fs_discriminator = true;
-  if (absl::GetFlag(FLAGS_use_base_only_in_fs_discriminator))
-    SourceInfo::use_base_only_in_fs_discriminator = true;
-#endif
+  elf_reader->VisitSymbols(&symbol_reader);
+  symbol_reader.BuildMaps(&name_alias_map_, &address_symbol_map_);
+  uses_fs_discriminator_ = symbol_reader.use_fs_discriminaor();
+  SetFsDiscriminatorMode();
 }
 
 void SymbolMap::AddSymbolEntryCount(const std::string &symbol_name,
@@ -492,12 +840,21 @@ void SymbolMap::AddSymbolEntryCount(const std::string &symbol_name,
   symbol->total_count += total_count;
 }
 
+Symbol *SymbolMap::TraverseInlineStack(const std::string &symbol_name,
+                                       const SourceStack &src, uint64_t count,
+                                       DataSource data_source) {
+  return WithDiscriminatorEncoding(
+      absl::GetFlag(FLAGS_use_discriminator_encoding), [&](auto encoding) {
+        return TraverseInlineStack<decltype(encoding)>(symbol_name, src, count,
+                                                       data_source);
+      });
+}
+
+template <typename Encoding>
 Symbol *SymbolMap::TraverseInlineStack(const std::string &symbol_name,
                                        const SourceStack &src, uint64_t count,
                                        DataSource data_source) {
   if (src.empty()) return nullptr;
-  bool use_discriminator_encoding =
-      absl::GetFlag(FLAGS_use_discriminator_encoding);
   Symbol *symbol = map_.find(symbol_name)->second;
   symbol->total_count += count;
   const SourceInfo &info = src[src.size() - 1];
@@ -509,18 +866,21 @@ Symbol *SymbolMap::TraverseInlineStack(const std::string &symbol_name,
     if ((data_source == PERFDATA || data_source == AFDOPROTO) &&
         src[i].HasInvalidInfo())
       break;
-    std::pair<CallsiteMap::iterator, bool> ret =
-        symbol->callsites.insert(CallsiteMap::value_type(
-            Callsite(src[i].Offset(use_discriminator_encoding),
-                     src[i - 1].func_name),
-            nullptr));
-    if (ret.second) {
-      ret.first->second = new Symbol(src[i - 1].func_name,
-                                     src[i - 1].dir_name,
-                                     src[i - 1].file_name,
-                                     src[i - 1].start_line);
+    Callsite callsite(Encoding::Offset(src[i]), src[i - 1].func_name);
+    CallsiteMap::iterator it = symbol->callsites.find(callsite);
+    if (it == symbol->callsites.end()) {
+      // Keep the callee name independent of the lifetime of SRC.
+      if (callsite.second != nullptr) {
+        callsite.second = NameInterner::Global().InternName(callsite.second);
+      }
+      it = symbol->callsites
+               .emplace(callsite, new Symbol(callsite.second,
+                                             src[i - 1].dir_name,
+                                             src[i - 1].file_name,
+                                             src[i - 1].start_line))
+               .first;
     }
-    symbol = ret.first->second;
+    symbol = it->second;
     symbol->total_count += count;
   }
   return symbol;
@@ -530,16 +890,27 @@ void SymbolMap::AddSourceCount(const std::string &symbol_name,
                                const SourceStack &src, uint64_t count,
                                uint64_t num_inst, uint32_t duplication,
                                DataSource data_source) {
-  bool use_discriminator_encoding =
-      absl::GetFlag(FLAGS_use_discriminator_encoding);
+  WithDiscriminatorEncoding(
+      absl::GetFlag(FLAGS_use_discriminator_encoding), [&](auto encoding) {
+        AddSourceCount<decltype(encoding)>(symbol_name, src, count, num_inst,
+                                           duplication, data_source);
+      });
+}
+
+template <typename Encoding>
+void SymbolMap::AddSourceCount(const std::string &symbol_name,
+                               const SourceStack &src, uint64_t count,
+                               uint64_t num_inst, uint32_t duplication,
+                               DataSource data_source) {
   if (duplication != 1 &&
       absl::GetFlag(FLAGS_use_discriminator_multiply_factor))
     count *= duplication;
-  Symbol *symbol = TraverseInlineStack(symbol_name, src, count, data_source);
+  Symbol *symbol =
+      TraverseInlineStack<Encoding>(symbol_name, src, count, data_source);
   if (!symbol) return;
   bool need_conversion = (data_source == PERFDATA || data_source == AFDOPROTO);
   if (need_conversion && src[0].HasInvalidInfo()) return;
-  uint64_t offset = src[0].Offset(use_discriminator_encoding);
+  uint64_t offset = Encoding::Offset(src[0]);
   // If it is to convert perf data or afdoproto to afdo profile, select the
   // MAX count if there are multiple records mapping to the same offset.
   // If it is just to read afdo profile, merge those counts.
@@ -557,51 +928,48 @@ bool SymbolMap::AddIndirectCallTarget(const std::string &symbol_name,
                                       const SourceStack &src,
                                       const std::string &target, uint64_t count,
                                       DataSource data_source) {
-  bool use_discriminator_encoding =
-      absl::GetFlag(FLAGS_use_discriminator_encoding);
-  Symbol *symbol = TraverseInlineStack(symbol_name, src, 0, data_source);
+  return WithDiscriminatorEncoding(
+      absl::GetFlag(FLAGS_use_discriminator_encoding), [&](auto encoding) {
+        return AddIndirectCallTarget<decltype(encoding)>(
+            symbol_name, src, target, count, data_source);
+      });
+}
+
+template <typename Encoding>
+bool SymbolMap::AddIndirectCallTarget(const std::string &symbol_name,
+                                      const SourceStack &src,
+                                      const std::string &target, uint64_t count,
+                                      DataSource data_source) {
+  Symbol *symbol =
+      TraverseInlineStack<Encoding>(symbol_name, src, 0, data_source);
   if (!symbol) return false;
   if ((data_source == PERFDATA || data_source == AFDOPROTO) &&
       src[0].HasInvalidInfo())
     return false;
-  symbol->pos_counts[src[0].Offset(use_discriminator_encoding)]
+  symbol->pos_counts[Encoding::Offset(src[0])]
       .target_map[GetOriginalName(target.c_str())] = count;
   return true;
 }
 
-// Compute total_count_incl of current symbol and total_count_incls of all the
-// inline instances.
-void Symbol::ComputeTotalCountIncl(const NameSymbolMap &nsmap,
-                                   std::vector<Symbol *> *stacksyms,
-                                   absl::flat_hash_set<Symbol *> *scc) {
-  for (const auto &pos_count : pos_counts) {
-    for (const auto &target_count : pos_count.second.target_map) {
-      auto iter = nsmap.find(target_count.first);
-      if (iter == nsmap.end()) continue;
-      Symbol *callee = iter->second;
-      if (scc->count(callee)) continue;
-      uint64_t calltimes = callee->head_count ? callee->head_count : 1;
-      // callee_time is the time spent on calling this callee and all its
-      // decendents.
-      uint64_t callee_time =
-          static_cast<uint64_t>(static_cast<float>(callee->total_count_incl) /
-                                calltimes * target_count.second);
-      for (auto *parent_sym : *stacksyms)
-        parent_sym->total_count_incl += callee_time;
-    }
-  }
-
-  std::vector<Callsite> calls;
-  for (const auto &pair : callsites) {
-    Symbol *inline_instance = pair.second;
-    inline_instance->total_count_incl = inline_instance->total_count;
-    stacksyms->push_back(inline_instance);
-    inline_instance->ComputeTotalCountIncl(nsmap, stacksyms, scc);
-    stacksyms->pop_back();
-  }
-}
-
-void Symbol::DumpBody(int ident, bool for_analysis) const {
+// The members templated on the discriminator encoding are used by Profile,
+// so they are instantiated here for every encoding.
+#define INSTANTIATE_FOR_ENCODING(...)                                         \
+  template void SymbolMap::AddSourceCount<__VA_ARGS__>(                       \
+      const std::string &, const SourceStack &, uint64_t, uint64_t, uint32_t, \
+      SymbolMap::DataSource);                                                 \
+  template bool SymbolMap::AddIndirectCallTarget<__VA_ARGS__>(                \
+      const std::string &, const SourceStack &, const std::string &,          \
+      uint64_t, SymbolMap::DataSource);                                       \
+  template Symbol *SymbolMap::TraverseInlineStack<__VA_ARGS__>(               \
+      const std::string &, const SourceStack &, uint64_t,                     \
+      SymbolMap::DataSource);
+INSTANTIATE_FOR_ENCODING(DiscriminatorEncoding<false, false>)
+INSTANTIATE_FOR_ENCODING(DiscriminatorEncoding<true, false>)
+INSTANTIATE_FOR_ENCODING(DiscriminatorEncoding<false, true>)
+INSTANTIATE_FOR_ENCODING(DiscriminatorEncoding<true, true>)
+#undef INSTANTIATE_FOR_ENCODING
+
+void Symbol::DumpBody(int ident, bool for_analysis, std::string *out) const {
   std::vector<uint64_t> positions;
   for (const auto &pos_count : pos_counts)
     positions.push_back(pos_count.first);
@@ -609,16 +977,17 @@ void Symbol::DumpBody(int ident, bool for_analysis) const {
   for (const auto &pos : positions) {
     PositionCountMap::const_iterator ret = pos_counts.find(pos);
     DCHECK(ret != pos_counts.end());
-    PrintSourceLocation(info.start_line, pos, ident + 2);
-    absl::PrintF("%u", ret->second.count);
+    AppendSourceLocation(info.start_line, pos, ident + 2, out);
+    absl::StrAppendFormat(out, "%u", ret->second.count);
     TargetCountPairs target_count_pairs;
     GetSortedTargetCountPairs(ret->second.target_map,
                               &target_count_pairs);
     for (const auto &target_count : target_count_pairs) {
-      const std::string printed_name = getPrintName(target_count.first.data());
-      absl::PrintF("  %s:%u", printed_name, target_count.second);
+      const char *printed_name = getPrintName(target_count.first.data());
+      absl::StrAppendFormat(out, "  %s:%u", printed_name,
+                            target_count.second);
     }
-    printf("\n");
+    out->push_back('\n');
   }
   std::vector<Callsite> calls;
   for (const auto &pos_symbol : callsites) {
@@ -626,37 +995,49 @@ void Symbol::DumpBody(int ident, bool for_analysis) const {
   }
   std::sort(calls.begin(), calls.end(), CallsiteLessThan());
   for (const auto &callsite : calls) {
-    PrintSourceLocation(info.start_line, callsite.first, ident + 2);
+    AppendSourceLocation(info.start_line, callsite.first, ident + 2, out);
     if (for_analysis)
-      callsites.find(callsite)->second->DumpForAnalysis(ident + 2);
+      callsites.find(callsite)->second->DumpForAnalysis(ident + 2, out);
     else
-      callsites.find(callsite)->second->Dump(ident + 2);
+      callsites.find(callsite)->second->Dump(ident + 2, out);
   }
 }
 
-void Symbol::Dump(int ident) const {
-  const std::string printed_name = getPrintName(info.func_name);
+void Symbol::Dump(int ident, std::string *out) const {
+  const char *printed_name = getPrintName(info.func_name);
   if (ident == 0) {
-    absl::PrintF("%s total:%u head:%u\n", printed_name, total_count,
-                 head_count);
+    absl::StrAppendFormat(out, "%s total:%u head:%u\n", printed_name,
+                          total_count, head_count);
   } else {
-    absl::PrintF("%s total:%u\n", printed_name, total_count);
+    absl::StrAppendFormat(out, "%s total:%u\n", printed_name, total_count);
   }
-  DumpBody(ident, false);
+  DumpBody(ident, false, out);
 }
 
-void Symbol::DumpForAnalysis(int ident) const {
-  const std::string printed_name = getPrintName(info.func_name);
+void Symbol::DumpForAnalysis(int ident, std::string *out) const {
+  const char *printed_name = getPrintName(info.func_name);
   if (ident == 0) {
-    absl::PrintF(
-        "%s total:%u head:%u total_incl:%u total_incl_per_iter:%.2f\n",
+    absl::StrAppendFormat(
+        out, "%s total:%u head:%u total_incl:%u total_incl_per_iter:%.2f\n",
         printed_name, total_count, head_count, total_count_incl,
         head_count ? static_cast<float>(total_count_incl) / head_count : 0);
   } else {
-    absl::PrintF("%s total:%u total_incl:%u\n", printed_name, total_count,
-                 total_count_incl);
+    absl::StrAppendFormat(out, "%s total:%u total_incl:%u\n", printed_name,
+                          total_count, total_count_incl);
   }
-  DumpBody(ident, true);
+  DumpBody(ident, true, out);
+}
+
+void Symbol::Dump(int ident) const {
+  std::string out;
+  Dump(ident, &out);
+  fwrite(out.data(), 1, out.size(), stdout);
+}
+
+void Symbol::DumpForAnalysis(int ident) const {
+  std::string out;
+  DumpForAnalysis(ident, &out);
+  fwrite(out.data(), 1, out.size(), stdout);
 }
 
 void Symbol::UpdateWithRatio(double ratio) {
@@ -701,290 +1082,380 @@ uint64_t Symbol::EntryCount() const {
   return entry_count;
 }
 
-struct SCCNode {
-  union {
-    unsigned index = 0;
-    unsigned pre_visited;
-  };
-  union {
-    unsigned lowlink = 0;
-    unsigned post_visited;
-  };
-  absl::flat_hash_set<Symbol *> syms;
-  absl::flat_hash_set<SCCNode *> callees;
-  static void InsertCallEdge(SCCNode *caller, SCCNode *callee) {
-    caller->callees.insert(callee);
-  }
-  void Dump() { LOG(INFO) << *this; }
-  friend std::ostream &operator<<(std::ostream &os, const SCCNode &node);
-};
+uint64_t Symbol::MemoryUsage() const {
+  uint64_t bytes =
+      sizeof(Symbol) + HashTableBytes(callsites) + BtreeBytes(pos_counts);
+  for (const auto &[pos, info] : pos_counts)
+    bytes += BtreeBytes(info.target_map);
+  for (const auto &[callsite, callee] : callsites)
+    bytes += callee->MemoryUsage();
+  return bytes;
+}
 
-std::ostream &operator<<(std::ostream &os, const SCCNode &node) {
-  os << "node<";
-  for (auto *sym : node.syms) {
-    if (sym == *(node.syms.begin()))
-      os << sym->name();
-    else
-      os << ", " << sym->name();
-  }
-  os << ">";
-  return os;
+uint64_t SymbolMap::MemoryUsage() const {
+  uint64_t bytes = VectorBytes(unique_symbols_) + TreeBytes(map_) +
+                   VectorBytes(names_to_elide_) + TreeBytes(name_addr_map_) +
+                   TreeBytes(address_symbol_map_) +
+                   VectorBytes(symbol_start_addrs_) +
+                   VectorBytes(symbol_end_addrs_) + VectorBytes(symbol_names_);
+  for (const std::unique_ptr<Symbol> &symbol : unique_symbols_)
+    bytes += symbol->MemoryUsage();
+  for (const auto &[name, symbol] : map_) bytes += StringBytes(name);
+  for (const auto &[name, aliases] : name_alias_map_)
+    bytes += sizeof(*name_alias_map_.begin()) + HashTableBytes(aliases);
+  return bytes;
 }
 
-class CallGraph {
+namespace {
+// The call graph of the symbols of a SymbolMap. Symbols are identified by
+// dense ids, and the callees of each symbol are stored in CSR form.
+class CompactCallGraph {
  public:
-  CallGraph() = default;
-  ~CallGraph() {
-    for (auto *node : nodes) delete node;
-    for (auto *node : delete_nodes) delete node;
-  }
-  using NodeStack = std::vector<SCCNode *>;
-  using SCCMap = absl::flat_hash_map<SCCNode *, SCCNode *>;
-  void ReverseTopoSort(std::vector<SCCNode *> *sorted);
-  SCCNode *FindOrCreateSCCNode(Symbol *sym);
-  void FindAndCollapseSCC();
-  void Dump();
-
- private:
-  void TopoVisit(SCCNode *node, absl::flat_hash_set<SCCNode *> *workingset,
-                 std::vector<SCCNode *> *sorted);
-  SCCNode *CreateSCCNode(Symbol *sym);
-  void StrongConnect(SCCNode *node, unsigned index, NodeStack *stack,
-                     SCCMap *sccmap);
-  void CollapseSCC(SCCMap *sccmap);
-
-  absl::flat_hash_set<SCCNode *> nodes;
-  absl::flat_hash_set<SCCNode *> delete_nodes;
-  absl::flat_hash_map<Symbol *, SCCNode *> sym_scc_map;
-  DISALLOW_COPY_AND_ASSIGN(CallGraph);
-};
+  // An inline instance of a symbol, or the symbol itself.
+  struct InlineNode {
+    Symbol *symbol;
+    // Index of the inline instance this one is inlined into, -1 for the
+    // symbol itself.
+    int parent;
+  };
+  // An indirect call target of an inline node.
+  struct Call {
+    int node;
+    int callee;
+    uint64_t count;
+  };
 
-// Visit all the nodes using DFS and return in reverse-topological order.
-void CallGraph::TopoVisit(SCCNode *node,
-                          absl::flat_hash_set<SCCNode *> *workingset,
-                          std::vector<SCCNode *> *sorted) {
-  if (node->post_visited) return;
-  if (node->pre_visited) LOG(FATAL) << "Found a Loop";
-  node->pre_visited = 1;
-  for (auto *callee : node->callees) TopoVisit(callee, workingset, sorted);
-  node->post_visited = 1;
-  workingset->erase(node);
-  sorted->push_back(node);
-}
-
-// Reverse-topologically sort all the nodes in the CallGraph, and save
-// the result in the vector sorted.
-void CallGraph::ReverseTopoSort(std::vector<SCCNode *> *sorted) {
-  std::for_each(nodes.begin(), nodes.end(), [](SCCNode *node) {
-    node->pre_visited = 0;
-    node->post_visited = 0;
-  });
-  absl::flat_hash_set<SCCNode *> workingset = nodes;
-  while (!workingset.empty()) {
-    TopoVisit(*workingset.begin(), &workingset, sorted);
-  }
-}
-
-SCCNode *CallGraph::CreateSCCNode(Symbol *sym) {
-  SCCNode *new_node = new SCCNode();
-  new_node->syms.insert(sym);
-  nodes.insert(new_node);
-  sym_scc_map.insert({sym, new_node});
-  return new_node;
-}
-
-SCCNode *CallGraph::FindOrCreateSCCNode(Symbol *sym) {
-  auto it = sym_scc_map.find(sym);
-  if (it != sym_scc_map.end()) return it->second;
-  return CreateSCCNode(sym);
-}
-
-// Find the strongly connected component using DFS. sccmap is the map mapping
-// each node to the root node of the SCC where node belongs to.
-void CallGraph::StrongConnect(SCCNode *node, unsigned index, NodeStack *stack,
-                              SCCMap *sccmap) {
-  node->index = index;
-  node->lowlink = index;
-  index++;
-  stack->push_back(node);
-
-  for (auto *callee : node->callees) {
-    if (!callee->index) {
-      StrongConnect(callee, index, stack, sccmap);
-      node->lowlink = std::min(node->lowlink, callee->lowlink);
-    } else if (std::find(stack->begin(), stack->end(), callee) !=
-               stack->end()) {
-      node->lowlink = std::min(node->lowlink, callee->lowlink);
+  explicit CompactCallGraph(const NameSymbolMap &nsmap) {
+    for (const auto &name_symbol : nsmap) {
+      if (ids_.try_emplace(name_symbol.second, symbols_.size()).second)
+        symbols_.push_back(name_symbol.second);
+    }
+    callee_begin_.push_back(0);
+    node_begin_.push_back(0);
+    call_begin_.push_back(0);
+    for (Symbol *symbol : symbols_) {
+      const size_t first_call = calls_.size();
+      AddInlineNode(nsmap, symbol, /*parent=*/-1);
+      for (size_t c = first_call; c < calls_.size(); ++c)
+        callees_.push_back(calls_[c].callee);
+      std::sort(callees_.begin() + callee_begin_.back(), callees_.end());
+      callees_.erase(std::unique(callees_.begin() + callee_begin_.back(),
+                                 callees_.end()),
+                     callees_.end());
+      callee_begin_.push_back(callees_.size());
+      node_begin_.push_back(nodes_.size());
+      call_begin_.push_back(calls_.size());
     }
   }
 
-  if (node->index == node->lowlink) {
-    SCCNode *member = nullptr;
-    do {
-      member = stack->back();
-      stack->pop_back();
-      sccmap->insert({member, node});
-    } while (member != node);
-  }
-}
-
-// Collapse the strongly connected nodes into one SCC node. Before CollapseSCC,
-// each SCCNode only contains one symbol. After CollapseSCC, each SCCNode
-// contains all the symbols belong to the same SCC.
-void CallGraph::CollapseSCC(SCCMap *sccmap) {
-  for (auto *node : nodes) {
-    auto *sccroot = (*sccmap)[node];
-    if (node != sccroot) {
-      sccroot->syms.insert(node->syms.begin(), node->syms.end());
-      for (auto *callee : node->callees) {
-        if ((*sccmap)[callee] != sccroot)
-          sccroot->callees.insert((*sccmap)[callee]);
-      }
-      delete_nodes.insert(node);
-    } else {
-      absl::flat_hash_set<SCCNode *> to_erase;
-      for (auto *callee : node->callees) {
-        if (callee != (*sccmap)[callee]) to_erase.insert(callee);
-      }
-      for (auto *erase_node : to_erase) {
-        node->callees.erase(erase_node);
-        node->callees.insert((*sccmap)[erase_node]);
+  int num_symbols() const { return symbols_.size(); }
+  Symbol *symbol(int id) const { return symbols_[id]; }
+  absl::Span<const int> callees(int id) const {
+    return absl::MakeConstSpan(callees_).subspan(
+        callee_begin_[id], callee_begin_[id + 1] - callee_begin_[id]);
+  }
+  // The inline nodes of symbol ID in preorder, starting with the symbol.
+  absl::Span<const InlineNode> nodes(int id) const {
+    return absl::MakeConstSpan(nodes_).subspan(
+        node_begin_[id], node_begin_[id + 1] - node_begin_[id]);
+  }
+  // The calls of the inline nodes of symbol ID. Call::node indexes nodes(ID).
+  absl::Span<const Call> calls(int id) const {
+    return absl::MakeConstSpan(calls_).subspan(
+        call_begin_[id], call_begin_[id + 1] - call_begin_[id]);
+  }
+
+  // Returns the strongly connected component of every symbol. Components
+  // are numbered in reverse topological order: a component only calls
+  // components with smaller numbers. Uses an iterative Tarjan's algorithm,
+  // so the depth of the call graph is not limited by the stack.
+  std::vector<int> FindSccs(int *num_sccs) const {
+    const int n = num_symbols();
+    std::vector<int> scc(n, -1), index(n, -1), lowlink(n);
+    std::vector<char> on_stack(n, false);
+    std::vector<int> stack;
+    // Symbols being visited, with the position of their next callee.
+    std::vector<std::pair<int, int>> visits;
+    int next_index = 0;
+    *num_sccs = 0;
+    auto start_visit = [&](int id) {
+      index[id] = lowlink[id] = next_index++;
+      stack.push_back(id);
+      on_stack[id] = true;
+      visits.push_back({id, callee_begin_[id]});
+    };
+    for (int root = 0; root < n; ++root) {
+      if (index[root] != -1) continue;
+      start_visit(root);
+      while (!visits.empty()) {
+        const int id = visits.back().first;
+        if (visits.back().second < callee_begin_[id + 1]) {
+          const int callee = callees_[visits.back().second++];
+          if (index[callee] == -1) {
+            start_visit(callee);
+          } else if (on_stack[callee]) {
+            lowlink[id] = std::min(lowlink[id], index[callee]);
+          }
+          continue;
+        }
+        if (lowlink[id] == index[id]) {
+          int member;
+          do {
+            member = stack.back();
+            stack.pop_back();
+            on_stack[member] = false;
+            scc[member] = *num_sccs;
+          } while (member != id);
+          ++*num_sccs;
+        }
+        visits.pop_back();
+        if (!visits.empty()) {
+          const int caller = visits.back().first;
+          lowlink[caller] = std::min(lowlink[caller], lowlink[id]);
+        }
       }
-      node->callees.erase(node);
     }
+    return scc;
   }
-  for (auto pair : sym_scc_map) pair.second = (*sccmap)[pair.second];
-  for (auto *node : delete_nodes) nodes.erase(node);
-}
-
-void CallGraph::FindAndCollapseSCC() {
-  unsigned index = 1;
-  NodeStack stack;
-  SCCMap sccmap;
-  for (auto *node : nodes) {
-    if (!node->index) StrongConnect(node, index, &stack, &sccmap);
-  }
-  CollapseSCC(&sccmap);
-}
 
-void CallGraph::Dump() {
-  LOG(INFO) << "====== Dump CallGraph: ======";
-  for (auto *node : nodes) {
-    LOG(INFO) << *node << " calls";
-    for (auto *callee : node->callees) {
-      LOG(INFO) << "  " << *callee;
+ private:
+  void AddInlineNode(const NameSymbolMap &nsmap, Symbol *symbol,
+                     int parent) {
+    const int node = nodes_.size() - node_begin_.back();
+    nodes_.push_back({symbol, parent});
+    for (const auto &pos_count : symbol->pos_counts) {
+      for (const auto &target_count : pos_count.second.target_map) {
+        auto iter = nsmap.find(target_count.first);
+        if (iter == nsmap.end()) continue;
+        calls_.push_back({node, ids_.at(iter->second), target_count.second});
+      }
     }
-    LOG(INFO) << "\n";
-  }
-}
+    for (const auto &pair : symbol->callsites)
+      AddInlineNode(nsmap, pair.second, node);
+  }
+
+  std::vector<Symbol *> symbols_;
+  absl::flat_hash_map<const Symbol *, int> ids_;
+  std::vector<int> callee_begin_;
+  std::vector<int> callees_;
+  std::vector<int> node_begin_;
+  std::vector<InlineNode> nodes_;
+  std::vector<int> call_begin_;
+  std::vector<Call> calls_;
+};
 
-void Symbol::BuildCallGraph(const NameSymbolMap &nsmap, SCCNode *callerSCC,
-                            CallGraph *callgraph) {
-  for (const auto &pos_count : pos_counts) {
-    for (const auto &target_count : pos_count.second.target_map) {
-      auto iter = nsmap.find(target_count.first);
-      if (iter == nsmap.end()) continue;
-      Symbol *callee = iter->second;
-      SCCNode *calleeSCC = callgraph->FindOrCreateSCCNode(callee);
-      SCCNode::InsertCallEdge(callerSCC, calleeSCC);
+// Computes total_count_incl of MEMBERS, the symbols of strongly connected
+// component SCC, and of their inline instances. All the members get the
+// total of the component. The components called by SCC must already be
+// computed. EXTRA is scratch space.
+void ComputeSccTotalCountIncl(const CompactCallGraph &callgraph,
+                              absl::Span<const int> members,
+                              const std::vector<int> &scc_of, int scc,
+                              std::vector<uint64_t> *extra) {
+  uint64_t scc_total_count_incl = 0;
+  for (int id : members) {
+    absl::Span<const CompactCallGraph::InlineNode> nodes = callgraph.nodes(id);
+    // extra[k] is the time spent in the callees of inline node k and of the
+    // nodes inlined into it.
+    extra->assign(nodes.size(), 0);
+    for (const CompactCallGraph::Call &call : callgraph.calls(id)) {
+      if (scc_of[call.callee] == scc) continue;
+      const Symbol *callee = callgraph.symbol(call.callee);
+      uint64_t calltimes = callee->head_count ? callee->head_count : 1;
+      // callee_time is the time spent on calling this callee and all its
+      // decendents.
+      uint64_t callee_time =
+          static_cast<uint64_t>(static_cast<float>(callee->total_count_incl) /
+                                calltimes * call.count);
+      (*extra)[call.node] += callee_time;
     }
+    // Children follow their parents in preorder.
+    for (int k = nodes.size() - 1; k > 0; --k)
+      (*extra)[nodes[k].parent] += (*extra)[k];
+    for (int k = 0; k < nodes.size(); ++k) {
+      nodes[k].symbol->total_count_incl =
+          nodes[k].symbol->total_count + (*extra)[k];
+    }
+    scc_total_count_incl += nodes[0].symbol->total_count_incl;
   }
-  for (const auto &pair : callsites) {
-    Symbol *inline_instance = pair.second;
-    inline_instance->BuildCallGraph(nsmap, callerSCC, callgraph);
-  }
-}
-
-void SymbolMap::BuildCallGraph(CallGraph *callgraph) {
-  for (const auto &pair : map_) {
-    Symbol *sym = pair.second;
-    SCCNode *callerSCC = callgraph->FindOrCreateSCCNode(sym);
-    sym->BuildCallGraph(map_, callerSCC, callgraph);
-  }
+  for (int id : members)
+    callgraph.symbol(id)->total_count_incl = scc_total_count_incl;
 }
+}  // namespace
 
 // Compute total_count_incl of all the function symbols in the symbol map.
 // Unlike total_count, total_count_incl includes the sample count of all
 // decendents called by the function symbol. It represents the accumulated
 // sample counts on the way from entering the function to exiting the function.
 // symbols have to be computed in the reverse topological order of callgraph.
-void SymbolMap::ComputeTotalCountIncl() {
-  CallGraph callgraph;
-  std::vector<SCCNode *> sorted;
-
-  // Build callgraph, collapse cycles into SCC node and get the reverse
-  // topological order of all the SCC nodes.
-  BuildCallGraph(&callgraph);
-  callgraph.FindAndCollapseSCC();
-  callgraph.ReverseTopoSort(&sorted);
-
-  // Compute the total_count_incl. Every symbol in the same SCC node has the
-  // same total_count_incl.
-  std::vector<Symbol *> stacksyms;
-  for (auto *node : sorted) {
-    unsigned scc_total_count_incl = 0;
-    for (auto *sym : node->syms) {
-      sym->total_count_incl = sym->total_count;
-      stacksyms.push_back(sym);
-      sym->ComputeTotalCountIncl(map_, &stacksyms, &node->syms);
-      stacksyms.pop_back();
-      scc_total_count_incl += sym->total_count_incl;
-    }
-    for (auto *sym : node->syms) sym->total_count_incl = scc_total_count_incl;
-  }
-}
-
-void SymbolMap::Dump(bool dump_for_analysis) const {
-  std::map<uint64_t, std::set<std::string> > count_names_map;
-  for (const auto &name_symbol : map_) {
-    if (name_symbol.second->total_count > 0) {
-      count_names_map[~name_symbol.second->total_count].insert(
-          name_symbol.first);
+void SymbolMap::ComputeTotalCountIncl(int num_threads) {
+  // Build callgraph, and find its strongly connected components in reverse
+  // topological order.
+  const CompactCallGraph callgraph(map_);
+  int num_sccs = 0;
+  const std::vector<int> scc_of = callgraph.FindSccs(&num_sccs);
+
+  // The members of every component, and its level: the length of the
+  // longest call chain from it. Components of the same level do not call
+  // each other, so each level can be computed in parallel.
+  std::vector<int> member_begin(num_sccs + 1, 0);
+  for (int scc : scc_of) member_begin[scc + 1]++;
+  for (int scc = 0; scc < num_sccs; ++scc)
+    member_begin[scc + 1] += member_begin[scc];
+  std::vector<int> members(scc_of.size());
+  {
+    std::vector<int> next_member(member_begin.begin(), member_begin.end() - 1);
+    for (int id = 0; id < scc_of.size(); ++id)
+      members[next_member[scc_of[id]]++] = id;
+  }
+  std::vector<int> level(num_sccs, 0);
+  int num_levels = 0;
+  for (int scc = 0; scc < num_sccs; ++scc) {
+    for (int m = member_begin[scc]; m < member_begin[scc + 1]; ++m) {
+      for (int callee : callgraph.callees(members[m])) {
+        if (scc_of[callee] != scc)
+          level[scc] = std::max(level[scc], level[scc_of[callee]] + 1);
+      }
     }
-  }
-  for (const auto &count_names : count_names_map) {
-    for (const auto &name : count_names.second) {
-      Symbol *symbol = map_.find(name)->second;
-      if (dump_for_analysis)
-        symbol->DumpForAnalysis(0);
-      else
-        symbol->Dump(0);
+    num_levels = std::max(num_levels, level[scc] + 1);
+  }
+  std::vector<std::vector<int>> sccs_by_level(num_levels);
+  for (int scc = 0; scc < num_sccs; ++scc)
+    sccs_by_level[level[scc]].push_back(scc);
+
+  auto compute = [&](const std::vector<int> &sccs, std::atomic<size_t> *next) {
+    std::vector<uint64_t> extra;
+    for (size_t i = (*next)++; i < sccs.size(); i = (*next)++) {
+      const int scc = sccs[i];
+      ComputeSccTotalCountIncl(
+          callgraph,
+          absl::MakeConstSpan(members).subspan(
+              member_begin[scc], member_begin[scc + 1] - member_begin[scc]),
+          scc_of, scc, &extra);
     }
+  };
+  // Levels with few components are not worth starting threads for.
+  constexpr size_t kMinSccsPerThread = 256;
+  for (const std::vector<int> &sccs : sccs_by_level) {
+    std::atomic<size_t> next{0};
+    const int level_threads = std::max<size_t>(
+        1, std::min<size_t>(num_threads, sccs.size() / kMinSccsPerThread));
+    std::vector<std::thread> workers;
+    for (int t = 1; t < level_threads; ++t)
+      workers.emplace_back(compute, std::cref(sccs), &next);
+    compute(sccs, &next);
+    for (std::thread &worker : workers) worker.join();
+  }
+}
+
+void SymbolMap::Dump(bool dump_for_analysis, int num_threads) const {
+  // The symbols are dumped by decreasing total count, and by name for equal
+  // counts. Symbols without samples are left out before any formatting.
+  std::vector<std::pair<const std::string *, const Symbol *>> symbols;
+  for (const auto &[name, symbol] : map_) {
+    if (symbol->total_count > 0) symbols.emplace_back(&name, symbol);
+  }
+  std::sort(symbols.begin(), symbols.end(),
+            [](const auto &a, const auto &b) {
+              if (a.second->total_count != b.second->total_count)
+                return a.second->total_count > b.second->total_count;
+              return *a.first < *b.first;
+            });
+
+  // Batches of symbols are formatted into reusable buffers on NUM_THREADS
+  // threads, and a window of batches is written in order before the next
+  // window is formatted, which bounds the memory held by the buffers.
+  constexpr int kSymbolsPerBatch = 64;
+  num_threads = std::max(num_threads, 1);
+  const int batches_per_window = 4 * num_threads;
+  std::vector<std::string> buffers(batches_per_window);
+  const int num_batches =
+      (symbols.size() + kSymbolsPerBatch - 1) / kSymbolsPerBatch;
+  for (int window = 0; window < num_batches; window += batches_per_window) {
+    const int window_size = std::min(batches_per_window, num_batches - window);
+    ParallelFor(num_threads, window_size, [&](int i) {
+      std::string &buffer = buffers[i];
+      buffer.clear();
+      const size_t begin = static_cast<size_t>(window + i) * kSymbolsPerBatch;
+      const size_t end = std::min(begin + kSymbolsPerBatch, symbols.size());
+      for (size_t s = begin; s < end; ++s) {
+        if (dump_for_analysis)
+          symbols[s].second->DumpForAnalysis(0, &buffer);
+        else
+          symbols[s].second->Dump(0, &buffer);
+      }
+    });
+    for (int i = 0; i < window_size; ++i)
+      fwrite(buffers[i].data(), 1, buffers[i].size(), stdout);
   }
 }
 
-float SymbolMap::Overlap(const SymbolMap &map) const {
-  std::map<std::string, std::pair<uint64_t, uint64_t> > overlap_map;
-
-  // Prepare for overlap_map
+namespace {
+// Slack for the rounding of the float sum when deciding early that an
+// overlap cannot reach its threshold.
+constexpr double kOverlapTolerance = 1e-4;
+
+// Returns the overlap of MAP_1 and MAP_2, see SymbolMap::Overlap. Both maps
+// are sorted by name, so they are joined by merging rather than by lookups;
+// names in only one map add nothing. If STOP_AT is not null, stops as soon
+// as the overlap is known to be at least *STOP_AT, or known to stay below
+// it, and returns the partial sum.
+float MergeOverlap(const NameSymbolMap &map_1, const NameSymbolMap &map_2,
+                   const float *stop_at) {
   uint64_t total_1 = 0;
   uint64_t total_2 = 0;
-  for (const auto &name_symbol : map_) {
+  for (const auto &name_symbol : map_1)
     total_1 += name_symbol.second->total_count;
-    overlap_map[name_symbol.first].first = name_symbol.second->total_count;
-    overlap_map[name_symbol.first].second = 0;
-  }
-  for (const auto &name_symbol : map.map()) {
-    if (overlap_map.find(name_symbol.first) == overlap_map.end()) {
-      overlap_map[name_symbol.first].first = 0;
-    }
+  for (const auto &name_symbol : map_2)
     total_2 += name_symbol.second->total_count;
-    overlap_map[name_symbol.first].second = name_symbol.second->total_count;
-  }
 
   if (total_1 == 0 || total_2 == 0) {
     return 0.0;
   }
 
-  // Calculate the overlap
+  // The counts of the names which have not been joined yet.
+  uint64_t rest_1 = total_1;
+  uint64_t rest_2 = total_2;
   float overlap = 0.0;
-  for (const auto &name_counts : overlap_map) {
-    overlap += std::min(
-        static_cast<float>(name_counts.second.first) / total_1,
-        static_cast<float>(name_counts.second.second) / total_2);
+  auto it_1 = map_1.begin();
+  auto it_2 = map_2.begin();
+  while (it_1 != map_1.end() && it_2 != map_2.end()) {
+    const int order = it_1->first.compare(it_2->first);
+    if (order < 0) {
+      rest_1 -= (it_1++)->second->total_count;
+      continue;
+    }
+    if (order > 0) {
+      rest_2 -= (it_2++)->second->total_count;
+      continue;
+    }
+    const uint64_t count_1 = (it_1++)->second->total_count;
+    const uint64_t count_2 = (it_2++)->second->total_count;
+    overlap += std::min(static_cast<float>(count_1) / total_1,
+                        static_cast<float>(count_2) / total_2);
+    rest_1 -= count_1;
+    rest_2 -= count_2;
+    if (stop_at == nullptr) continue;
+    // Each name adds at most the smaller of its two shares.
+    const double max_rest =
+        std::min(static_cast<double>(rest_1) / total_1,
+                 static_cast<double>(rest_2) / total_2);
+    if (overlap >= *stop_at ||
+        overlap + max_rest < *stop_at - kOverlapTolerance) {
+      break;
+    }
   }
   return overlap;
 }
+}  // namespace
+
+float SymbolMap::Overlap(const SymbolMap &map) const {
+  return MergeOverlap(map_, map.map(), nullptr);
+}
+
+bool SymbolMap::OverlapAtLeast(const SymbolMap &map, float threshold) const {
+  return MergeOverlap(map_, map.map(), &threshold) >= threshold;
+}
 
 void SymbolMap::DumpFuncLevelProfileCompare(const SymbolMap &map) const {
   uint64_t max_1 = 0;
@@ -1024,7 +1495,7 @@ void SymbolMap::DumpFuncLevelProfileCompare(const SymbolMap &map) const {
       printf("%3.4f%% %3.4f%% %s\n",
              100 * static_cast<double>(symbol->total_count) / max_1,
              100 * static_cast<double>(compare_count) / max_2,
-             getPrintName(name.c_str()).c_str());
+             getPrintName(name.c_str()));
     }
   }
 
@@ -1058,73 +1529,170 @@ void SymbolMap::DumpFuncLevelProfileCompare(const SymbolMap &map) const {
       printf("%3.4f%% %3.4f%% %s\n",
              100 * static_cast<double>(compare_count) / max_1,
              100 * static_cast<double>(symbol->total_count) / max_2,
-             getPrintName(name.c_str()).c_str());
+             getPrintName(name.c_str()));
     }
   }
 }
 
-typedef std::map<uint64_t, uint64_t> Histogram;
+// The counts of a profile are grouped into buckets numbered in the order of
+// the counts: counts below 16 have a bucket each, and larger counts have eight
+// buckets per power of two.
+constexpr int kNumCountBuckets = 16 + 60 * 8;
 
-static uint64_t AddSymbolProfileToHistogram(const Symbol *symbol,
-                                            Histogram *histogram) {
-  uint64_t total_count = 0;
-  for (const auto &pos_count : symbol->pos_counts) {
-    std::pair<Histogram::iterator, bool> ret =
-        histogram->insert(Histogram::value_type(pos_count.second.count, 0));
-    ret.first->second += pos_count.second.num_inst;
-    total_count += pos_count.second.count * pos_count.second.num_inst;
-  }
-  for (const auto &callsite_symbol : symbol->callsites) {
-    total_count += AddSymbolProfileToHistogram(callsite_symbol.second,
-                                               histogram);
-  }
-  return total_count;
+static int CountBucket(uint64_t count) {
+  if (count < 16) return count;
+  const int width = 64 - __builtin_clzll(count);
+  return 16 + (width - 5) * 8 + ((count >> (width - 4)) & 7);
+}
+
+// The number of instructions with a count in one bucket and their total count.
+struct CountBucketTotals {
+  uint64_t num_inst = 0;
+  uint64_t count = 0;
+};
+
+// Calls "visit(count, num_inst)" for every position of "symbol" and of its
+// inline instances.
+template <typename VisitFn>
+static void VisitPositionCounts(const Symbol *symbol, VisitFn &visit) {
+  for (const auto &pos_count : symbol->pos_counts)
+    visit(pos_count.second.count, pos_count.second.num_inst);
+  for (const auto &callsite_symbol : symbol->callsites)
+    VisitPositionCounts(callsite_symbol.second, visit);
 }
 
 void SymbolMap::ComputeWorkingSets() {
-  Histogram histogram;
-  uint64_t total_count = 0;
+  // Rather than sorting the histogram of all counts, the instructions and
+  // counts of each bucket of counts are summed first, which tells the buckets
+  // each working set boundary falls in. Only the counts of those buckets are
+  // then histogrammed and sorted, and the other buckets are accumulated as a
+  // whole, which gives the working sets of the sorted histogram. Both passes
+  // process chunks of the symbols on separate threads.
+  constexpr size_t kMinSymbolsPerThread = 1 << 10;
+  const size_t num_chunks = std::max<size_t>(
+      1, std::min<size_t>(std::thread::hardware_concurrency(),
+                          unique_symbols_.size() / kMinSymbolsPerThread));
+  auto for_each_chunk = [&](auto visit_chunk) {
+    auto visit_symbols = [&](size_t chunk) {
+      const size_t end = unique_symbols_.size() * (chunk + 1) / num_chunks;
+      for (size_t i = unique_symbols_.size() * chunk / num_chunks; i < end;
+           ++i) {
+        if (unique_symbols_[i]->total_count != 0)
+          visit_chunk(chunk, unique_symbols_[i].get());
+      }
+    };
+    std::vector<std::thread> workers;
+    for (size_t chunk = 1; chunk < num_chunks; ++chunk)
+      workers.emplace_back(visit_symbols, chunk);
+    visit_symbols(0);
+    for (std::thread &worker : workers) worker.join();
+  };
 
-  // Step 1. Compute histogram.
-  for (const auto &symbol : unique_symbols_) {
-    if (symbol->total_count == 0) {
-      continue;
+  // Step 1. Sum the instructions and counts of each bucket of counts.
+  std::vector<std::vector<CountBucketTotals>> chunk_totals(
+      num_chunks, std::vector<CountBucketTotals>(kNumCountBuckets));
+  for_each_chunk([&](size_t chunk, const Symbol *symbol) {
+    std::vector<CountBucketTotals> &totals = chunk_totals[chunk];
+    auto add_to_bucket = [&totals](uint64_t count, uint64_t num_inst) {
+      CountBucketTotals &bucket = totals[CountBucket(count)];
+      bucket.num_inst += num_inst;
+      bucket.count += count * num_inst;
+    };
+    VisitPositionCounts(symbol, add_to_bucket);
+  });
+  std::vector<CountBucketTotals> totals(kNumCountBuckets);
+  uint64_t total_count = 0;
+  for (const auto &chunk : chunk_totals) {
+    for (int b = 0; b < kNumCountBuckets; ++b) {
+      totals[b].num_inst += chunk[b].num_inst;
+      totals[b].count += chunk[b].count;
+      total_count += chunk[b].count;
     }
-    total_count += AddSymbolProfileToHistogram(symbol.get(), &histogram);
   }
+  const uint64_t one_bucket_count = total_count / (NUM_GCOV_WORKING_SETS + 1);
+
+  // Step 2. Find the buckets of counts that working set boundaries fall in.
+  // The boundaries passed once a bucket is accumulated only depend on the
+  // accumulated count.
+  std::vector<bool> has_boundary(kNumCountBuckets);
   int bucket_num = 0;
   uint64_t accumulated_count = 0;
-  uint64_t accumulated_inst = 0;
-  uint64_t one_bucket_count = total_count / (NUM_GCOV_WORKING_SETS + 1);
-
-  // Step 2. Traverse the histogram to update the working set.
-  for (Histogram::const_reverse_iterator iter = histogram.rbegin();
-       iter != histogram.rend() && bucket_num < NUM_GCOV_WORKING_SETS; ++iter) {
-    uint64_t count = iter->first;
-    uint64_t num_inst = iter->second;
-    while (count * num_inst + accumulated_count
-           > one_bucket_count * (bucket_num + 1)
-           && bucket_num < NUM_GCOV_WORKING_SETS) {
-      int64_t offset =
-          (one_bucket_count * (bucket_num + 1) - accumulated_count) / count;
-      accumulated_inst += offset;
-      accumulated_count += offset * count;
-      num_inst -= offset;
-      working_set_[bucket_num].num_counters = accumulated_inst;
-      working_set_[bucket_num].min_counter = count;
+  for (int b = kNumCountBuckets - 1;
+       b >= 0 && bucket_num < NUM_GCOV_WORKING_SETS; --b) {
+    accumulated_count += totals[b].count;
+    while (accumulated_count > one_bucket_count * (bucket_num + 1) &&
+           bucket_num < NUM_GCOV_WORKING_SETS) {
+      has_boundary[b] = true;
       bucket_num++;
     }
-    accumulated_inst += num_inst;
-    accumulated_count += num_inst * count;
+  }
+
+  // Step 3. Compute the histogram of the counts in those buckets: a map from
+  // count to the number of instructions with that count.
+  std::vector<absl::flat_hash_map<uint64_t, uint64_t>> chunk_histograms(
+      num_chunks);
+  for_each_chunk([&](size_t chunk, const Symbol *symbol) {
+    absl::flat_hash_map<uint64_t, uint64_t> &histogram =
+        chunk_histograms[chunk];
+    auto add_to_histogram = [&](uint64_t count, uint64_t num_inst) {
+      if (has_boundary[CountBucket(count)]) histogram[count] += num_inst;
+    };
+    VisitPositionCounts(symbol, add_to_histogram);
+  });
+  for (size_t chunk = 1; chunk < num_chunks; ++chunk) {
+    for (const auto &[count, num_inst] : chunk_histograms[chunk])
+      chunk_histograms[0][count] += num_inst;
+    chunk_histograms[chunk].clear();
+  }
+  std::vector<std::pair<uint64_t, uint64_t>> sorted_histogram(
+      chunk_histograms[0].begin(), chunk_histograms[0].end());
+  chunk_histograms.clear();
+  std::sort(sorted_histogram.begin(), sorted_histogram.end(),
+            std::greater<std::pair<uint64_t, uint64_t>>());
+
+  // Step 4. Traverse the histogram from the largest count to update the
+  // working set, accumulating the buckets without boundaries as a whole.
+  bucket_num = 0;
+  accumulated_count = 0;
+  uint64_t accumulated_inst = 0;
+  auto iter = sorted_histogram.begin();
+  for (int b = kNumCountBuckets - 1;
+       b >= 0 && bucket_num < NUM_GCOV_WORKING_SETS; --b) {
+    if (!has_boundary[b]) {
+      accumulated_inst += totals[b].num_inst;
+      accumulated_count += totals[b].count;
+      continue;
+    }
+    for (; iter != sorted_histogram.end() && CountBucket(iter->first) == b &&
+           bucket_num < NUM_GCOV_WORKING_SETS;
+         ++iter) {
+      uint64_t count = iter->first;
+      uint64_t num_inst = iter->second;
+      while (count * num_inst + accumulated_count
+             > one_bucket_count * (bucket_num + 1)
+             && bucket_num < NUM_GCOV_WORKING_SETS) {
+        int64_t offset =
+            (one_bucket_count * (bucket_num + 1) - accumulated_count) / count;
+        accumulated_inst += offset;
+        accumulated_count += offset * count;
+        num_inst -= offset;
+        working_set_[bucket_num].num_counters = accumulated_inst;
+        working_set_[bucket_num].min_counter = count;
+        bucket_num++;
+      }
+      accumulated_inst += num_inst;
+      accumulated_count += num_inst * count;
+    }
   }
 }
 
-std::map<uint64_t, uint64_t> SymbolMap::GetSampledSymbolStartAddressSizeMap(
-    const std::set<uint64_t> &sampled_addrs) const {
-  // We depend on the fact that sampled_addrs is an ordered set.
-  std::map<uint64_t, uint64_t> ret;
+SampledFunctions SymbolMap::GetSampledFunctions(
+    const std::vector<uint64_t> &sampled_addrs) const {
+  // We depend on the fact that sampled_addrs is sorted, so the start addresses
+  // of the functions containing them are found in order.
+  std::vector<uint64_t> sampled_starts;
   uint64_t next_start_addr = 0;
-  for (const auto &addr : sampled_addrs) {
+  for (uint64_t addr : sampled_addrs) {
     uint64_t adjusted_addr = addr + base_addr_;
     if (adjusted_addr < next_start_addr) {
       continue;
@@ -1136,20 +1704,26 @@ std::map<uint64_t, uint64_t> SymbolMap::GetSampledSymbolStartAddressSizeMap(
       continue;
     }
     iter--;
-    ret.insert(std::make_pair(iter->first, iter->second.second));
+    if (sampled_starts.empty() || sampled_starts.back() != iter->first) {
+      sampled_starts.push_back(iter->first);
+    }
     next_start_addr = iter->first + iter->second.second;
   }
-  for (const auto &addr_symbol : address_symbol_map_) {
-    if (ret.find(addr_symbol.first) != ret.end()) {
-      continue;
-    }
-    const auto &iter = map_.find(addr_symbol.second.first);
-    if (iter != map_.end() && iter->second != nullptr
-        && iter->second->total_count > 0) {
-      ret[addr_symbol.first] = addr_symbol.second.second;
+  // The functions with samples in the profile are added in the same walk of
+  // address_symbol_map_, which keeps the result sorted.
+  std::vector<SampledFunctions::Function> functions;
+  auto sampled = sampled_starts.begin();
+  for (const auto &[start, name_size] : address_symbol_map_) {
+    while (sampled != sampled_starts.end() && *sampled < start) ++sampled;
+    bool is_sampled = sampled != sampled_starts.end() && *sampled == start;
+    if (!is_sampled) {
+      const auto &iter = map_.find(name_size.first);
+      is_sampled = iter != map_.end() && iter->second != nullptr &&
+                   iter->second->total_count > 0;
     }
+    if (is_sampled) functions.emplace_back(start, name_size.second);
   }
-  return ret;
+  return SampledFunctions(std::move(functions));
 }
 
 void SymbolMap::AddAlias(const std::string &sym, const std::string &alias) {
@@ -1314,17 +1888,67 @@ void SymbolMap::AddSymbolToMap(const Symbol & symbol) {
   }
 }
 
+void SymbolMap::BuildFromSymbols(
+    const SymbolMap &srcmap, int num_threads,
+    absl::FunctionRef<void(Symbol *, SymbolMap *)> build) {
+  // Building may modify the source symbol, so all names of a symbol are built
+  // in order by the same worker.
+  std::vector<std::vector<Symbol *>> groups;
+  absl::flat_hash_map<const Symbol *, size_t> group_of;
+  for (const auto &name_symbol : srcmap.map_) {
+    auto [it, inserted] =
+        group_of.insert({name_symbol.second, groups.size()});
+    if (inserted) groups.emplace_back();
+    groups[it->second].push_back(name_symbol.second);
+  }
+
+  constexpr size_t kMinGroupsPerThread = 256;
+  num_threads = std::max<size_t>(
+      1, std::min<size_t>(num_threads, groups.size() / kMinGroupsPerThread));
+  if (num_threads == 1) {
+    for (const std::vector<Symbol *> &group : groups)
+      for (Symbol *symbol : group) build(symbol, this);
+    return;
+  }
+
+  // Every worker builds into a map of its own. The profiles built are
+  // additive, so moving the partial maps into this one gives the same profile
+  // as the serial run.
+  std::vector<std::unique_ptr<SymbolMap>> partial_maps(num_threads);
+  std::atomic<size_t> next_group{0};
+  std::vector<std::thread> workers;
+  workers.reserve(num_threads);
+  for (int i = 0; i < num_threads; ++i) {
+    partial_maps[i] = std::make_unique<SymbolMap>();
+    workers.emplace_back([&, i]() {
+      for (size_t g = next_group++; g < groups.size(); g = next_group++)
+        for (Symbol *symbol : groups[g]) build(symbol, partial_maps[i].get());
+    });
+  }
+  for (std::thread &worker : workers) worker.join();
+
+  for (int i = 0; i < num_threads; ++i) {
+    AddProfilesFrom(partial_maps[i].get());
+    partial_maps[i].reset();
+  }
+}
+
 void SymbolMap::BuildHybridProfile(const SymbolMap &srcmap,
                                    const uint64_t threshold,
                                    uint64_t &num_callsites,
-                                   uint64_t &num_flattened) {
-  for (const auto &name_symbol : srcmap.map_) {
-    AddSymbolToMap(*name_symbol.second);
-    map_.at(name_symbol.second->info.func_name)
-        ->PopulateSymbolRetainingHotInlineStacks(*name_symbol.second, threshold,
-                                                 *this, num_callsites,
-                                                 num_flattened);
-  }
+                                   uint64_t &num_flattened, int num_threads) {
+  std::atomic<uint64_t> total_callsites{0}, total_flattened{0};
+  BuildFromSymbols(srcmap, num_threads, [&](Symbol *symbol, SymbolMap *dest) {
+    uint64_t callsites = 0, flattened = 0;
+    dest->AddSymbolToMap(*symbol);
+    dest->map_.at(symbol->info.func_name)
+        ->PopulateSymbolRetainingHotInlineStacks(*symbol, threshold, *dest,
+                                                 callsites, flattened);
+    total_callsites += callsites;
+    total_flattened += flattened;
+  });
+  num_callsites += total_callsites;
+  num_flattened += total_flattened;
 }
 
 // This function is used to flatten callsites in the srcmap as they
@@ -1335,32 +1959,34 @@ void SymbolMap::BuildHybridProfile(const SymbolMap &srcmap,
 void SymbolMap::BuildFlatProfile(const SymbolMap & srcmap,
                                  bool selectively_flatten, uint64_t threshold,
                                  uint64_t &num_total_functions,
-                                 uint64_t &num_flattened) {
-  std::vector<Symbol *> symbols;
-  for (const auto &name_symbol : srcmap.map_) {
-    ++num_total_functions;
-    if (selectively_flatten && name_symbol.second->total_count >= threshold) {
-      AddSymbolToMap(*name_symbol.second);
-      map_.at(name_symbol.second->info.func_name)->Merge(name_symbol.second);
-    } else {
-      ++num_flattened;
-      symbols.push_back(name_symbol.second);
+                                 uint64_t &num_flattened, int num_threads) {
+  std::atomic<uint64_t> total_functions{0}, total_flattened{0};
+  BuildFromSymbols(srcmap, num_threads, [&](Symbol *src, SymbolMap *dest) {
+    ++total_functions;
+    if (selectively_flatten && src->total_count >= threshold) {
+      dest->AddSymbolToMap(*src);
+      dest->map_.at(src->info.func_name)->Merge(src);
+      return;
     }
-  }
-  while (!symbols.empty()) {
-    Symbol *symbol = symbols.back();
-    symbols.pop_back();
-    AddSymbolToMap(*symbol);
-    for (const auto &pos_callsite : symbol->callsites) {
-      pos_callsite.second->EstimateHeadCount();
-      symbol->FlattenCallsite(pos_callsite.first.first, pos_callsite.second);
-      if (!selectively_flatten) {
-        // Add the callsite into current working set.
-        symbols.push_back(pos_callsite.second);
+    ++total_flattened;
+    std::vector<Symbol *> symbols = {src};
+    while (!symbols.empty()) {
+      Symbol *symbol = symbols.back();
+      symbols.pop_back();
+      dest->AddSymbolToMap(*symbol);
+      for (const auto &pos_callsite : symbol->callsites) {
+        pos_callsite.second->EstimateHeadCount();
+        symbol->FlattenCallsite(pos_callsite.first.first, pos_callsite.second);
+        if (!selectively_flatten) {
+          // Add the callsite into current working set.
+          symbols.push_back(pos_callsite.second);
+        }
       }
+      dest->map_.at(symbol->info.func_name)->FlatMerge(symbol);
     }
-    map_.at(symbol->info.func_name)->FlatMerge(symbol);
-  }
+  });
+  num_total_functions += total_functions;
+  num_flattened += total_flattened;
 }
 
 bool SymbolMap::EnsureEntryInFuncForSymbol(const std::string &func_name,
@@ -1401,119 +2027,161 @@ void SymbolMap::RemoveSymsMatchingRegex(const std::string &regex) {
 }
 
 #if defined(HAVE_LLVM)
-NameSizeList SymbolMap::collectNamesForProfSymList() {
-  llvm::StringSet<> names_in_profile = collectNamesInProfile();
+NameSizeList SymbolMap::collectNamesForProfSymList(int num_threads) {
+  const absl::flat_hash_set<absl::string_view> names_in_profile =
+      collectNamesInProfile(num_threads);
+  // The flattened address index is filtered in chunks on separate threads,
+  // and the chunks are concatenated in address order.
+  constexpr size_t kSymbolsPerChunk = 1 << 14;
+  const size_t num_symbols = symbol_names_.size();
+  const int num_chunks =
+      (num_symbols + kSymbolsPerChunk - 1) / kSymbolsPerChunk;
+  std::vector<NameSizeList> chunk_lists(num_chunks);
+  ParallelFor(num_threads, num_chunks, [&](int chunk) {
+    const size_t end = std::min(num_symbols, (chunk + 1) * kSymbolsPerChunk);
+    for (size_t i = chunk * kSymbolsPerChunk; i < end; ++i) {
+      const std::string &name = *symbol_names_[i];
+      if (names_in_profile.contains(name)) continue;
+      chunk_lists[chunk].emplace_back(
+          name, symbol_end_addrs_[i] - symbol_start_addrs_[i]);
+    }
+  });
+  size_t num_names = 0;
+  for (const NameSizeList &list : chunk_lists) num_names += list.size();
   NameSizeList name_size_list;
-  for (const auto &addr_symbol : address_symbol_map_) {
-    llvm::StringRef str = addr_symbol.second.first;
-    if (names_in_profile.count(str)) continue;
-    name_size_list.emplace_back(str, addr_symbol.second.second);
-  }
+  name_size_list.reserve(num_names);
+  for (const NameSizeList &list : chunk_lists)
+    name_size_list.insert(name_size_list.end(), list.begin(), list.end());
   return name_size_list;
 }
 
-llvm::StringSet<> SymbolMap::collectNamesInProfile() {
-  std::vector<Symbol *> symbols;
-  llvm::StringSet<> names;
+absl::flat_hash_set<absl::string_view> SymbolMap::collectNamesInProfile(
+    int num_threads) const {
+  // Multiple entries in map_ may share the same Symbol object because of
+  // alias. The alias name of each entry is kept, but every symbol is only
+  // walked once.
+  std::vector<const Symbol *> symbols;
+  absl::flat_hash_set<const Symbol *> seen;
+  absl::flat_hash_set<absl::string_view> names;
   for (const auto &name_symbol : map_) {
     if (name_symbol.second->total_count > 0) {
-      symbols.push_back(name_symbol.second);
-      // Multiple entries in map_ may share the same Symbol object
-      // because of alias. Save the alias name of each entry into
-      // names set.
       names.insert(name_symbol.first);
+      if (seen.insert(name_symbol.second).second)
+        symbols.push_back(name_symbol.second);
     }
   }
 
-  // Recursively add all the names of outline instances, inline instances
-  // and call targets into names set.
+  // Add all the names of outline instances, inline instances and call
+  // targets of the symbols, which are disjoint trees walked on separate
+  // threads. Every thread collects the names into its own set.
+  std::vector<absl::flat_hash_set<absl::string_view>> thread_names(
+      std::max(num_threads, 1));
+  auto walk = [&](int i, int thread) {
+    absl::flat_hash_set<absl::string_view> &walked = thread_names[thread];
+    std::vector<const Symbol *> stack = {symbols[i]};
+    while (!stack.empty()) {
+      const Symbol *symbol = stack.back();
+      stack.pop_back();
+      for (const auto &pos_count : symbol->pos_counts) {
+        for (const auto &target_count : pos_count.second.target_map)
+          walked.insert(target_count.first);
+      }
+      for (const auto &pos_callsite : symbol->callsites)
+        stack.push_back(pos_callsite.second);
+      // The name is taken from the symbol rather than from the copy
+      // returned by name(), so that it outlives the walk.
+      const char *name = symbol->info.func_name;
+      walked.insert(name != nullptr && *name != '\0' ? name : "noname");
+    }
+  };
+  ParallelFor(/*stage=*/"", num_threads, symbols.size(), walk);
+  for (const auto &walked : thread_names)
+    names.insert(walked.begin(), walked.end());
+  return names;
+}
+#endif
+
+namespace {
+// Deletes all but the `cutoff` hottest callsites at every location of
+// `symbol` and of the callsites kept, recursively.
+void ThrottleInlineInstances(Symbol *root, uint64_t cutoff) {
+  // Orders the callsites at a location by decreasing hotness. Callsites
+  // without a symbol come last, and ties are broken by callee name, so that
+  // the callsites kept do not depend on the order of the hash map.
+  auto hotter = [](const std::pair<Callsite, Symbol *> &a,
+                   const std::pair<Callsite, Symbol *> &b) {
+    if (a.second == nullptr || b.second == nullptr) {
+      if (a.second != b.second) return a.second != nullptr;
+    } else if (a.second->total_count != b.second->total_count) {
+      return a.second->total_count > b.second->total_count;
+    }
+    if (a.first.second == nullptr || b.first.second == nullptr)
+      return a.first.second != nullptr && b.first.second == nullptr;
+    return strcmp(a.first.second, b.first.second) < 0;
+  };
+
+  std::vector<Symbol *> symbols = {root};
+  absl::flat_hash_map<uint64_t, std::vector<std::pair<Callsite, Symbol *>>>
+      callsites_at;
   while (!symbols.empty()) {
     Symbol *symbol = symbols.back();
     symbols.pop_back();
 
-    for (const auto &pos_count : symbol->pos_counts) {
-      const auto &target_map = pos_count.second.target_map;
-      for (const auto &target_count : target_map) {
-        names.insert(target_count.first);
+    // No need to group the callsites if there are not many.
+    if (symbol->callsites.size() > cutoff) {
+      callsites_at.clear();
+      for (const auto &callsite_symbol : symbol->callsites)
+        callsites_at[callsite_symbol.first.first].push_back(callsite_symbol);
+      for (auto &location_callsites : callsites_at) {
+        auto &callsites = location_callsites.second;
+        if (callsites.size() <= cutoff) continue;
+        // Only the callsites past the cutoff are needed, in any order.
+        std::nth_element(callsites.begin(), callsites.begin() + cutoff,
+                         callsites.end(), hotter);
+        for (auto it = callsites.begin() + cutoff; it != callsites.end();
+             ++it) {
+          delete it->second;
+          symbol->callsites.erase(it->first);
+        }
       }
     }
 
-    for (const auto &pos_callsite : symbol->callsites) {
-      symbols.push_back(pos_callsite.second);
-    }
-    names.insert(symbol->name());
+    for (const auto &pos_callsite : symbol->callsites)
+      if (pos_callsite.second != nullptr)
+        symbols.push_back(pos_callsite.second);
   }
-  return names;
 }
-#endif
+}  // namespace
 
-void SymbolMap::throttleInlineInstancesAtSameLocation() {
+void SymbolMap::throttleInlineInstancesAtSameLocation(int num_threads) {
   if (absl::GetFlag(FLAGS_inline_instances_at_same_loc_cutoff) == -1) return;
+  const uint64_t cutoff =
+      absl::GetFlag(FLAGS_inline_instances_at_same_loc_cutoff);
 
+  // Several names may map to the same symbol, which must be throttled once.
   std::vector<Symbol *> symbols;
+  absl::flat_hash_set<Symbol *> seen;
   for (const auto &name_symbol : map_) {
-    if (name_symbol.second->total_count > 0) {
+    if (name_symbol.second->total_count > 0 &&
+        seen.insert(name_symbol.second).second) {
       symbols.push_back(name_symbol.second);
     }
   }
 
-  while (!symbols.empty()) {
-    Symbol *symbol = symbols.back();
-    symbols.pop_back();
-
-    // No need to sort the callsites if there are not many.
-    if (symbol->callsites.size() <=
-        absl::GetFlag(FLAGS_inline_instances_at_same_loc_cutoff))
-      continue;
-
-    std::vector<std::pair<Callsite, Symbol *>> sorted_callsites;
-    sorted_callsites.insert(sorted_callsites.begin(), symbol->callsites.begin(),
-                            symbol->callsites.end());
-    // Sort all the callsites first by locations then by hotness.
-    std::stable_sort(sorted_callsites.begin(), sorted_callsites.end(),
-                     [&](const auto &a, const auto &b) {
-                       // Compare the locations of the callsites first
-                       if (a.first.first != b.first.first)
-                         return a.first.first < b.first.first;
-                       if (a.second == nullptr || b.second == nullptr)
-                         return a.second != nullptr;
-                       // If the locations are the same, compare the hotness of
-                       // the callsites.
-                       return a.second->total_count > b.second->total_count;
-                     });
-
-    uint64_t num_inline_instances_at_same_loc = 0;
-    std::vector<std::pair<Callsite, Symbol *>> to_removed_callsites;
-    for (auto cur_iter = sorted_callsites.begin();
-         cur_iter != sorted_callsites.end(); cur_iter++) {
-      // If the number of inline instances at the same location is equal to
-      // or above the cutoff value, save it in to_removed_callsites and erase
-      // it later.
-      if (num_inline_instances_at_same_loc >=
-          absl::GetFlag(FLAGS_inline_instances_at_same_loc_cutoff))
-        to_removed_callsites.push_back(*cur_iter);
-
-      // If next callsite in sorted_callsites is at a different location, reset
-      // num_inline_instances_at_same_loc to 0.
-      auto next_iter = std::next(cur_iter);
-      if (next_iter != sorted_callsites.end() &&
-          next_iter->first.first != cur_iter->first.first) {
-        num_inline_instances_at_same_loc = 0;
-      } else {
-        num_inline_instances_at_same_loc++;
-      }
-    }
-
-    // Remove those to_removed_callsites from symbol->callsites.
-    for (const auto &callsite_sym : to_removed_callsites) {
-      delete callsite_sym.second;
-      symbol->callsites.erase(callsite_sym.first);
-    }
-
-    // Add the callsite symbols in symbol->callsites into the working set.
-    for (const auto &pos_callsite : symbol->callsites)
-      symbols.push_back(pos_callsite.second);
-  }
+  // The inline instances of different symbols are disjoint trees, so the
+  // symbols are throttled on separate threads.
+  std::atomic<size_t> next{0};
+  auto throttle = [&]() {
+    for (size_t i = next++; i < symbols.size(); i = next++)
+      ThrottleInlineInstances(symbols[i], cutoff);
+  };
+  constexpr size_t kMinSymbolsPerThread = 256;
+  const int workers_count = std::max<size_t>(
+      1, std::min<size_t>(num_threads, symbols.size() / kMinSymbolsPerThread));
+  std::vector<std::thread> workers;
+  for (int t = 1; t < workers_count; ++t) workers.emplace_back(throttle);
+  throttle();
+  for (std::thread &worker : workers) worker.join();
 }
 
 }  // namespace devtools_crosstool_autofdo
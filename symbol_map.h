@@ -6,6 +6,7 @@
 #define AUTOFDO_SYMBOL_MAP_H_
 #include <cstdint>
 #include <map>
+#include <memory>
 #include <set>
 #include <string>
 #include <unordered_set>
@@ -17,13 +18,18 @@
 #include "base/macros.h"
 #include "addr2line.h"
 #include "source_info.h"
+#include "third_party/abseil/absl/base/thread_annotations.h"
+#include "third_party/abseil/absl/container/btree_map.h"
 #include "third_party/abseil/absl/container/flat_hash_map.h"
 #include "third_party/abseil/absl/container/flat_hash_set.h"
 #include "third_party/abseil/absl/container/node_hash_map.h"
 #include "third_party/abseil/absl/flags/declare.h"
+#include "third_party/abseil/absl/functional/function_ref.h"
+#include "third_party/abseil/absl/strings/string_view.h"
+#include "third_party/abseil/absl/synchronization/mutex.h"
+#include "third_party/abseil/absl/types/span.h"
 
 #if defined(HAVE_LLVM)
-#include "llvm/ADT/StringSet.h"
 #include "llvm/ProfileData/SampleProf.h"
 #endif
 
@@ -45,7 +51,11 @@ ABSL_DECLARE_FLAG(uint64_t, inline_instances_at_same_loc_cutoff);
 
 namespace devtools_crosstool_autofdo {
 
-typedef std::map<std::string, uint64_t> CallTargetCountMap;
+// Symbols hold one of these per sampled location, so both maps below are
+// btrees: they store their entries in sorted arrays instead of allocating a
+// tree node per entry, but otherwise behave like std::map. Note that
+// inserting into them invalidates iterators and references.
+typedef absl::btree_map<std::string, uint64_t> CallTargetCountMap;
 typedef std::pair<std::string, uint64_t> TargetCountPair;
 typedef std::vector<TargetCountPair> TargetCountPairs;
 
@@ -88,7 +98,7 @@ class ProfileInfo {
 typedef std::map<const SourceStack, ProfileInfo> SourceStackCountMap;
 
 // Map from a source location (represented by offset+discriminator) to profile.
-typedef std::map<uint64_t, ProfileInfo> PositionCountMap;
+typedef absl::btree_map<uint64_t, ProfileInfo> PositionCountMap;
 
 // callsite_location, callee_name
 typedef std::pair<uint64_t, const char *> Callsite;
@@ -102,22 +112,26 @@ struct CallsiteEqual {
   bool operator()(const Callsite& c1, const Callsite& c2) const {
     if (c1.first != c2.first)
       return false;
+    // Callee names in a CallsiteMap are interned by SymbolMap, so equal
+    // names usually have equal pointers.
+    if (c1.second == c2.second)
+      return true;
     if ((c1.second == nullptr || c2.second == nullptr))
-      return c1.second == c2.second;
+      return false;
     return strcmp(c1.second, c2.second) == 0;
   }
 };
 class Symbol;
 class SymbolMap;
-// Map from a callsite to the callee symbol.
-typedef absl::node_hash_map<Callsite, Symbol *, CallsiteHash, CallsiteEqual>
+// Map from a callsite to the callee symbol. The entries are stored inline in
+// the table rather than in a heap node each, so inserting invalidates
+// iterators; the callee symbols themselves never move.
+typedef absl::flat_hash_map<Callsite, Symbol *, CallsiteHash, CallsiteEqual>
     CallsiteMap;
 // Maps function names to symbols. Symbols are not owned and multiple names can
 // map to the same symbol.
 typedef std::map<std::string, Symbol *> NameSymbolMap;
 
-struct SCCNode;
-class CallGraph;
 // Contains information about a specific symbol.
 // There are two types of symbols:
 // 1. Actual symbol: the symbol exists in the binary as a standalone function.
@@ -163,6 +177,12 @@ class Symbol {
 
   ~Symbol();
 
+  // Symbols are carved from large blocks kept by a process-wide pool, and
+  // freed symbols are reused by the next allocation. A profile holds one
+  // symbol per inline instance, so this avoids a malloc/free pair for each.
+  static void *operator new(size_t size);
+  static void operator delete(void *ptr, size_t size);
+
   static std::string Name(const char *name) {
     return (name && strlen(name) > 0) ? name : "noname";
   }
@@ -175,6 +195,11 @@ class Symbol {
 
   // Merges profile stored in src symbol with this symbol.
   void Merge(const Symbol *src);
+  // Like above, but moves the position counts and inline instances of src that
+  // this symbol does not have instead of copying them. Only the positions and
+  // callsites both symbols have are added. src is left with its total and
+  // head counts but without any profile.
+  void Merge(Symbol &&src);
 
   // Get an estimation of head count from the starting source or callsite
   // locations.
@@ -189,22 +214,27 @@ class Symbol {
   // Update each count with count * ratio inside current symbol.
   void UpdateWithRatio(double ratio);
 
-  void ComputeTotalCountIncl(const NameSymbolMap &nsmap,
-                             std::vector<Symbol *> *stacksyms,
-                             absl::flat_hash_set<Symbol *> *scc);
-  void BuildCallGraph(const NameSymbolMap &nsmap, SCCNode *callerSCC,
-                      CallGraph *callgraph);
+  // Frees the inline instances and per-location counts of the symbol. The
+  // total and head counts are kept.
+  void ReleaseProfile();
 
-  // Dumps the body of the symbol.
-  void DumpBody(int ident, bool for_analysis) const;
-  // Dumps content of the symbol with a give indentation.
-  void Dump(int indent) const;
+  // Appends the body of the symbol to OUT.
+  void DumpBody(int ident, bool for_analysis, std::string *out) const;
+  // Appends content of the symbol with a give indentation to OUT.
+  void Dump(int ident, std::string *out) const;
   // Similar as Dump, but with information for performance analysis.
+  void DumpForAnalysis(int ident, std::string *out) const;
+  // Like above, but print to stdout.
+  void Dump(int indent) const;
   void DumpForAnalysis(int ident) const;
 
   // Returns the entry count based on pos_counts and callsites.
   uint64_t EntryCount() const;
 
+  // Returns an estimate of the bytes held by the symbol and its inline
+  // instances.
+  uint64_t MemoryUsage() const;
+
   // Source information about the symbol (func_name, file_name, etc.)
   SourceInfo info;
   // The total sampled count, including all the samples collected from
@@ -250,6 +280,7 @@ class SymbolMap {
     if (!binary.empty()) {
       BuildSymbolMap();
       BuildNameAddressMap();
+      BuildAddressSymbolIndex();
     }
   }
 
@@ -260,6 +291,11 @@ class SymbolMap {
     initSuffixElisionPolicy();
   }
 
+  // Returns a symbol map of the same binary with the symbols read from the
+  // binary, but without any profile or addr2line, as SymbolMap(binary) would
+  // build it. The binary is not read again.
+  std::unique_ptr<SymbolMap> CopyBinarySymbols() const;
+
   static bool IsLLVMCompiler(const std::string &path);
 
   // Return the fs_discriminator flag variable name.
@@ -269,6 +305,11 @@ class SymbolMap {
 
   uint64_t size() const { return map_.size(); }
 
+  // Returns an estimate of the bytes held by the symbols, their profiles and
+  // the name and address maps. The addr2line, which may be shared, is not
+  // included.
+  uint64_t MemoryUsage() const;
+
   void set_count_threshold(int64_t n) { count_threshold_ = n; }
   int64_t count_threshold() const { return count_threshold_; }
 
@@ -292,7 +333,9 @@ class SymbolMap {
     ignore_thresholds_ = v;
   }
 
-  void set_addr2line(std::unique_ptr<Addr2line> addr2line) {
+  // ADDR2LINE may be shared with other symbol maps of the same binary, which
+  // must not query it concurrently.
+  void set_addr2line(std::shared_ptr<Addr2line> addr2line) {
     addr2line_ = std::move(addr2line);
   }
 
@@ -314,12 +357,35 @@ class SymbolMap {
   // that overlap with entries in new_map, will be updated to the new symbols.
   void AddSymbolMappings(const NameSymbolMap &new_map);
 
+  // Moves the profiles of all symbols in "other" into the symbols of the same
+  // names in this map, which must exist. Counts are added and inline instances
+  // missing in this map are moved over. "other" is left empty.
+  void MergeProfilesFrom(SymbolMap *other);
+
+  // Like MergeProfilesFrom, but symbols of "other" missing in this map are
+  // added first. Used to combine maps that were built independently, e.g.
+  // from different input profiles.
+  void AddProfilesFrom(SymbolMap *other);
+
   const NameSymbolMap &map() const {
     return map_;
   }
 
   const NameAddressMap &GetNameAddrMap() const { return name_addr_map_; }
 
+  // The symbols GetSymbolInfoByAddr looks up, sorted by start address: the
+  // i-th symbol starts at symbol_start_addrs()[i], ends at
+  // symbol_end_addrs()[i] and is named *symbol_names()[i].
+  absl::Span<const uint64_t> symbol_start_addrs() const {
+    return symbol_start_addrs_;
+  }
+  absl::Span<const uint64_t> symbol_end_addrs() const {
+    return symbol_end_addrs_;
+  }
+  absl::Span<const std::string *const> symbol_names() const {
+    return symbol_names_;
+  }
+
   const gcov_working_set_info *GetWorkingSets() const {
     return working_set_;
   }
@@ -347,13 +413,13 @@ class SymbolMap {
   }
 
   // Trims suffix from name, returning trimmed name (according to
-  // current suffix elision policy).
+  // current suffix elision policy). The result is cached by interned name.
   std::string GetOriginalName(const char *name) const;
 
   // Merges symbols with suffixes like .isra, .part, or .llvm as a single
   // symbol, and elides the suffixes. These suffixes are not stable between
   // compilations, and the compiler is also expected to elide them when matching
-  // profile data.
+  // profile data. Only the names added since the previous call are examined.
   void ElideSuffixesAndMerge();
 
   // Increments symbol's entry count.
@@ -384,9 +450,11 @@ class SymbolMap {
   // below the threshold, recursively. This is a fine-grained flattening
   // algorithm that allows inline calls close to the top-level function to
   // persist while their colder callees are flattened. This provides a good
-  // balance between profile size and performance.
+  // balance between profile size and performance. Different outline symbols
+  // are processed on up to NUM_THREADS threads.
   void BuildHybridProfile(const SymbolMap &srcmap, uint64_t threshold,
-                          uint64_t &num_callsites, uint64_t &num_flattened);
+                          uint64_t &num_callsites, uint64_t &num_flattened,
+                          int num_threads = 1);
 
   // Selectively convert hierarchical profiles into flat profiles.
   // Hierarchical profiles contains context information for optimization. Flat
@@ -394,10 +462,11 @@ class SymbolMap {
   // for smaller profile size (leading to smaller XFDO profiles) and lower
   // Forge/Piper costs. Selective flattening allows hot functions to retain
   // context sensitive information, while removing it from cold functions to
-  // strike a balance between optimization and Forge/Piper costs.
+  // strike a balance between optimization and Forge/Piper costs. Different
+  // outline symbols are processed on up to NUM_THREADS threads.
   void BuildFlatProfile(const SymbolMap & srcmap, bool selectively_flatten,
                         uint64_t threshold, uint64_t &num_total_functions,
-                        uint64_t &num_flattened);
+                        uint64_t &num_flattened, int num_threads = 1);
 
   void AddSymbolToMap(const Symbol & symbol);
 
@@ -430,6 +499,22 @@ class SymbolMap {
                               const SourceStack &source, uint64_t count,
                               DataSource data_source = AFDOPROFILE);
 
+  // Like the functions above, with the positions encoded by "Encoding", a
+  // DiscriminatorEncoding. Loops over many source stacks select it once with
+  // WithDiscriminatorEncoding instead of once per source stack.
+  template <typename Encoding>
+  void AddSourceCount(const std::string &symbol, const SourceStack &source,
+                      uint64_t count, uint64_t num_inst, uint32_t duplication,
+                      DataSource data_source);
+  template <typename Encoding>
+  bool AddIndirectCallTarget(const std::string &symbol, const SourceStack &src,
+                             const std::string &target, uint64_t count,
+                             DataSource data_source);
+  template <typename Encoding>
+  Symbol *TraverseInlineStack(const std::string &symbol,
+                              const SourceStack &source, uint64_t count,
+                              DataSource data_source);
+
   // Updates function name, start_addr, end_addr of a function that has a
   // given address. Returns false if no such symbol exists.
   const bool GetSymbolInfoByAddr(uint64_t addr, const std::string **name,
@@ -446,6 +531,11 @@ class SymbolMap {
   // overlap = sum(min(count_i_1/total_1, count_i_2/total_2))
   float Overlap(const SymbolMap &map) const;
 
+  // Returns whether Overlap(map) >= THRESHOLD. Stops comparing as soon as
+  // the answer is known, so similar or very different profiles are not
+  // compared in full.
+  bool OverlapAtLeast(const SymbolMap &map, float threshold) const;
+
   // Iterates the address count map to calculate the working set of the profile.
   // Working set is a map from bucket_num to total number of instructions that
   // consumes bucket_num/NUM_GCOV_WORKING_SETS of dynamic instructions. This
@@ -463,15 +553,19 @@ class SymbolMap {
   //         number.
   void ComputeWorkingSets();
 
-  // Returns a map from start addresses of functions that have been sampled to
-  // the size of the function.
-  std::map<uint64_t, uint64_t> GetSampledSymbolStartAddressSizeMap(
-      const std::set<uint64_t> &sampled_addrs) const;
+  // Returns the start addresses and sizes of the functions that contain one of
+  // the sorted "sampled_addrs", or that have samples in the profile.
+  SampledFunctions GetSampledFunctions(
+      const std::vector<uint64_t> &sampled_addrs) const;
 
-  void ComputeTotalCountIncl();
-  void BuildCallGraph(CallGraph *callgraph);
+  // Computes total_count_incl of every symbol. The strongly connected
+  // components of the call graph that do not call each other are computed
+  // on up to NUM_THREADS threads.
+  void ComputeTotalCountIncl(int num_threads = 1);
 
-  void Dump(bool dump_for_analysis = false) const;
+  // Prints the symbols with samples to stdout, by decreasing total count.
+  // The symbols are formatted on up to NUM_THREADS threads.
+  void Dump(bool dump_for_analysis = false, int num_threads = 1) const;
   void DumpFuncLevelProfileCompare(const SymbolMap &map) const;
 
   void AddAlias(const std::string &sym, const std::string &alias);
@@ -485,26 +579,46 @@ class SymbolMap {
   bool EnsureEntryInFuncForSymbol(const std::string& func_name, uint64_t pc);
 
 #if defined(HAVE_LLVM)
-  // Collect all function symbols and size in address_symbol_map_, but remove
-  // the names showing up in the profile.
-  NameSizeList collectNamesForProfSymList();
+  // Collect all function symbols and size in address_symbol_map_, in address
+  // order, but remove the names showing up in the profile. Chunks of the
+  // symbols are filtered on up to NUM_THREADS threads.
+  NameSizeList collectNamesForProfSymList(int num_threads = 1);
 
   // Collect all names including names of outline instances, inline instances
-  // and call targets in current map.
-  llvm::StringSet<> collectNamesInProfile();
+  // and call targets in current map. The names point into the map and the
+  // binary symbols. Different outline symbols are walked on up to
+  // NUM_THREADS threads.
+  absl::flat_hash_set<absl::string_view> collectNamesInProfile(
+      int num_threads = 1) const;
 #endif
 
   // There can be multiple inline instances at the same callsite location.
   // An example is multiple call targets can be inlined for the same indirect
   // call. If there are too many inline instances in the profile for the same
   // location, that can introduce excessive cost in ThinLTO importing without
-  // apparent performance benefit, and we better use some throttling.
-  void throttleInlineInstancesAtSameLocation();
+  // apparent performance benefit, and we better use some throttling. The
+  // inline instances of different outline symbols are throttled on up to
+  // NUM_THREADS threads.
+  void throttleInlineInstancesAtSameLocation(int num_threads = 1);
 
  private:
+  // See CopyBinarySymbols.
+  explicit SymbolMap(const SymbolMap *binary_symbols);
+
+  // Calls BUILD(symbol, dest) for every symbol of SRCMAP to build its profile
+  // into DEST. Up to NUM_THREADS threads build into maps of their own, whose
+  // profiles are then moved into this map; a single thread builds into this
+  // map directly.
+  void BuildFromSymbols(const SymbolMap &srcmap, int num_threads,
+                        absl::FunctionRef<void(Symbol *, SymbolMap *)> build);
+
   // Reads from the binary's elf section to build the symbol map.
   void BuildSymbolMap();
 
+  // Sets the fs-discriminator mode of SourceInfo for the binary, which uses
+  // fs-discriminators if uses_fs_discriminator_.
+  void SetFsDiscriminatorMode() const;
+
   // Initialize suffix elision policy from flags.
   void initSuffixElisionPolicy();
 
@@ -515,17 +629,54 @@ class SymbolMap {
     }
   }
 
+  // Flattens address_symbol_map_ into the sorted parallel arrays below.
+  void BuildAddressSymbolIndex();
+
+  // Returns the suffix-elided form of NAME under suffix_elision_policy_.
+  std::string ComputeOriginalName(const char *name) const;
+
+  // Returns the NameInterner::Global() id of the original name of the name
+  // with NAME_ID. Every name is elided only once per policy.
+  uint32_t GetOriginalNameId(uint32_t name_id) const
+      ABSL_LOCKS_EXCLUDED(original_name_mutex_);
+
+  // Computes the original names of NAME_IDS which are not cached yet. Large
+  // batches are elided on separate threads.
+  void CacheOriginalNames(const std::vector<uint32_t> &name_ids) const
+      ABSL_LOCKS_EXCLUDED(original_name_mutex_);
+
+  // Maps NAME to SYMBOL in map_, replacing the previous mapping if any.
+  void SetSymbol(const std::string &name, Symbol *symbol);
+
   SymbolUniquePtrVector unique_symbols_;  // Owns the symbols.
   NameSymbolMap map_;
+  // Keys of map_ added since the last ElideSuffixesAndMerge, which are the
+  // only names that may still need their suffixes elided.
+  std::vector<const std::string *> names_to_elide_;
   NameAliasMap name_alias_map_;
   NameAddressMap name_addr_map_;
   AddressSymbolMap address_symbol_map_;
+  // Immutable copy of address_symbol_map_ used by GetSymbolInfoByAddr, which
+  // is called for every sampled address. The i-th symbol starts at
+  // symbol_start_addrs_[i], ends at symbol_end_addrs_[i] and is named
+  // *symbol_names_[i], which points into address_symbol_map_.
+  std::vector<uint64_t> symbol_start_addrs_;
+  std::vector<uint64_t> symbol_end_addrs_;
+  std::vector<const std::string *> symbol_names_;
   const std::string binary_;
   uint64_t base_addr_;
   int64_t count_threshold_;
   bool ignore_thresholds_;
   uint8_t suffix_elision_policy_;
-  std::unique_ptr<Addr2line> addr2line_;
+  // Whether the binary defines get_fs_discriminator_symbol().
+  bool uses_fs_discriminator_ = false;
+  static constexpr uint32_t kUnknownNameId = ~uint32_t{0};
+  mutable absl::Mutex original_name_mutex_;
+  // original_name_ids_[id] is the interned id of the original name of the
+  // interned name with ID, or kUnknownNameId if it is not computed yet.
+  mutable std::vector<uint32_t> original_name_ids_
+      ABSL_GUARDED_BY(original_name_mutex_);
+  std::shared_ptr<Addr2line> addr2line_;
   /* working_set_[i] stores # of instructions that consumes
      i/NUM_GCOV_WORKING_SETS of total instruction counts.  */
   gcov_working_set_info working_set_[NUM_GCOV_WORKING_SETS];
@@ -6,14 +6,23 @@
 #include "symbol_map.h"
 
 #include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
 
 #include "base/logging.h"
 #include "llvm_profile_reader.h"
 #include "source_info.h"
 #include "gmock/gmock.h"
 #include "gtest/gtest.h"
-#include "third_party/abseil/absl/container/node_hash_set.h"
+#include "symbolize/elf_reader.h"
 #include "third_party/abseil/absl/flags/flag.h"
+#include "third_party/abseil/absl/strings/match.h"
+#include "third_party/abseil/absl/strings/str_cat.h"
 #include "third_party/abseil/absl/types/optional.h"
 
 #define FLAGS_test_tmpdir std::string(testing::UnitTest::GetInstance()->original_working_dir())
@@ -125,10 +134,99 @@ TEST(SymbolMapTest, TestEntryCount) {
   EXPECT_EQ(qux->EntryCount(), 100);
 }
 
+TEST(SymbolMapTest, AddProfilesFrom) {
+  SymbolMap symbol_map;
+  symbol_map.AddSymbol("foo");
+  SourceStack foo_stack = {{"foo", "", "", 0, 10, 0}};
+  symbol_map.AddSourceCount("foo", foo_stack, 100, 1);
+
+  SymbolMap other;
+  other.AddSymbol("foo");
+  other.AddSymbol("bar");
+  other.AddSourceCount("foo", foo_stack, 50, 1);
+  SourceStack inline_stack = {{"baz", "", "", 0, 5, 0},
+                              {"foo", "", "", 0, 20, 0}};
+  other.AddSourceCount("foo", inline_stack, 30, 1);
+  SourceStack bar_stack = {{"bar", "", "", 0, 1, 0}};
+  other.AddSourceCount("bar", bar_stack, 70, 1);
+
+  symbol_map.AddProfilesFrom(&other);
+  EXPECT_EQ(other.size(), 0);
+  ASSERT_EQ(symbol_map.size(), 2);
+
+  const devtools_crosstool_autofdo::Symbol *foo =
+      symbol_map.map().at("foo");
+  EXPECT_EQ(foo->total_count, 180);
+  EXPECT_EQ(foo->pos_counts.at(foo_stack[0].Offset(false)).count, 150);
+  const devtools_crosstool_autofdo::Symbol *baz =
+      foo->callsites.at(std::make_pair(inline_stack[1].Offset(false), "baz"));
+  EXPECT_EQ(baz->total_count, 30);
+
+  const devtools_crosstool_autofdo::Symbol *bar =
+      symbol_map.map().at("bar");
+  EXPECT_EQ(bar->total_count, 70);
+  EXPECT_STREQ(bar->info.func_name, "bar");
+}
+
+TEST(SymbolMapTest, MergeMovedSymbol) {
+  using ::devtools_crosstool_autofdo::Symbol;
+  Symbol foo("foo", "", "", 0);
+  foo.total_count = 10;
+  foo.pos_counts[1].count = 10;
+  Symbol *foo_bar = new Symbol("bar", "", "", 0);
+  foo_bar->pos_counts[2].count = 5;
+  foo.callsites[std::make_pair(3, "bar")] = foo_bar;
+
+  Symbol other("foo", "", "", 0);
+  other.total_count = 20;
+  other.pos_counts[1].count = 7;
+  other.pos_counts[4].count = 13;
+  Symbol *other_bar = new Symbol("bar", "", "", 0);
+  other_bar->pos_counts[2].count = 1;
+  other.callsites[std::make_pair(3, "bar")] = other_bar;
+  Symbol *other_baz = new Symbol("baz", "", "", 0);
+  other_baz->pos_counts[6].count = 2;
+  other.callsites[std::make_pair(5, "baz")] = other_baz;
+
+  foo.Merge(std::move(other));
+  EXPECT_EQ(foo.total_count, 30);
+  EXPECT_EQ(foo.pos_counts.at(1).count, 17);
+  EXPECT_EQ(foo.pos_counts.at(4).count, 13);
+  EXPECT_EQ(foo.callsites.at(std::make_pair(3, "bar")), foo_bar);
+  EXPECT_EQ(foo_bar->pos_counts.at(2).count, 6);
+  // The inline instance foo does not have is moved rather than copied.
+  EXPECT_EQ(foo.callsites.at(std::make_pair(5, "baz")), other_baz);
+  EXPECT_TRUE(other.pos_counts.empty());
+  EXPECT_TRUE(other.callsites.empty());
+}
+
+TEST(SymbolMapTest, DumpIsIndependentOfThreads) {
+  SymbolMap symbol_map;
+  // Enough symbols for several formatting batches, with ties in total count
+  // that are ordered by name.
+  for (int i = 0; i < 300; ++i) {
+    const std::string name = absl::StrCat("func_", i);
+    symbol_map.AddSymbol(name);
+    symbol_map.AddSymbolEntryCount(name, 1, 1 + i % 50);
+    symbol_map.map().at(name)->pos_counts[i].count = i;
+  }
+  symbol_map.AddSymbol("cold");
+
+  testing::internal::CaptureStdout();
+  symbol_map.Dump(/*dump_for_analysis=*/false, /*num_threads=*/1);
+  const std::string sequential = testing::internal::GetCapturedStdout();
+  testing::internal::CaptureStdout();
+  symbol_map.Dump(/*dump_for_analysis=*/false, /*num_threads=*/4);
+  const std::string parallel = testing::internal::GetCapturedStdout();
+
+  EXPECT_EQ(parallel, sequential);
+  EXPECT_TRUE(absl::StartsWith(sequential, "func_149 total:50 head:1\n"));
+  EXPECT_FALSE(absl::StrContains(sequential, "cold"));
+}
+
 TEST(SymbolMapTest, ComputeAllCounts) {
   SymbolMap symbol_map;
-  absl::node_hash_set<std::string> names;
-  devtools_crosstool_autofdo::LLVMProfileReader reader(&symbol_map, names);
+  devtools_crosstool_autofdo::LLVMProfileReader reader(&symbol_map);
   reader.ReadFromFile(FLAGS_test_srcdir + kTestDataDir +
                       "callgraph_with_cycles.txt");
 
@@ -142,6 +240,144 @@ TEST(SymbolMapTest, ComputeAllCounts) {
   EXPECT_EQ(map.find("moo")->second->total_count_incl, 50);
 }
 
+TEST(SymbolMapTest, ComputeAllCountsInParallel) {
+  // A chain of 1000 cycles of two functions each: f<i> and g<i> call each
+  // other, and g<i> calls f<i + 1>.
+  SymbolMap symbol_map;
+  constexpr int kNumCycles = 1000;
+  for (int i = 0; i < kNumCycles; ++i) {
+    const std::string f = absl::StrCat("f", i), g = absl::StrCat("g", i);
+    symbol_map.AddSymbol(f);
+    symbol_map.AddSymbol(g);
+    SourceStack f_stack = {{f.c_str(), "", "", 0, 1, 0}};
+    SourceStack g_stack = {{g.c_str(), "", "", 0, 1, 0}};
+    symbol_map.AddSourceCount(f, f_stack, 10 + i, 1);
+    symbol_map.AddSourceCount(g, g_stack, 20, 1);
+    symbol_map.AddSymbolEntryCount(f, 5);
+    symbol_map.AddIndirectCallTarget(f, f_stack, g, 3);
+    symbol_map.AddIndirectCallTarget(g, g_stack, f, 2);
+    if (i + 1 < kNumCycles) {
+      symbol_map.AddIndirectCallTarget(g, g_stack, absl::StrCat("f", i + 1),
+                                       1);
+    }
+  }
+  // Also add wide levels: functions that only call f0.
+  for (int i = 0; i < 2000; ++i) {
+    const std::string h = absl::StrCat("h", i);
+    symbol_map.AddSymbol(h);
+    SourceStack h_stack = {{h.c_str(), "", "", 0, 1, 0}};
+    symbol_map.AddSourceCount(h, h_stack, i, 1);
+    symbol_map.AddIndirectCallTarget(h, h_stack, "f0", 1);
+  }
+
+  symbol_map.ComputeTotalCountIncl();
+  std::map<std::string, uint64_t> expected;
+  for (const auto &[name, symbol] : symbol_map.map())
+    expected[name] = symbol->total_count_incl;
+  symbol_map.ComputeTotalCountIncl(/*num_threads=*/4);
+  for (const auto &[name, symbol] : symbol_map.map())
+    EXPECT_EQ(symbol->total_count_incl, expected[name]) << name;
+  EXPECT_EQ(expected["f0"], expected["g0"]);
+}
+
+TEST(SymbolMapTest, ComputeWorkingSets) {
+  // Counts spread over many buckets of counts, some counts repeated across
+  // symbols, and enough symbols to be split into several chunks.
+  SymbolMap symbol_map;
+  std::map<uint64_t, uint64_t, std::greater<uint64_t>> histogram;
+  uint64_t total_count = 0;
+  for (int i = 0; i < 5000; ++i) {
+    const std::string f = absl::StrCat("f", i);
+    symbol_map.AddSymbol(f);
+    symbol_map.AddSymbolEntryCount(f, 0, 1);
+    for (int line = 1; line <= 3; ++line) {
+      SourceStack stack = {{f.c_str(), "", "", 0, line, 0}};
+      const uint64_t count = (uint64_t{i} * 7919 % 4096) << (i % 20 + line);
+      symbol_map.AddSourceCount(f, stack, count, line);
+      histogram[count] += line;
+      total_count += count * line;
+    }
+  }
+  symbol_map.ComputeWorkingSets();
+
+  // The working sets of the sorted histogram.
+  const uint64_t one_bucket_count = total_count / (NUM_GCOV_WORKING_SETS + 1);
+  uint64_t accumulated_count = 0, accumulated_inst = 0;
+  int bucket_num = 0;
+  for (auto [count, num_inst] : histogram) {
+    while (count * num_inst + accumulated_count >
+               one_bucket_count * (bucket_num + 1) &&
+           bucket_num < NUM_GCOV_WORKING_SETS) {
+      const uint64_t offset =
+          (one_bucket_count * (bucket_num + 1) - accumulated_count) / count;
+      accumulated_inst += offset;
+      accumulated_count += offset * count;
+      num_inst -= offset;
+      EXPECT_EQ(symbol_map.GetWorkingSets()[bucket_num].num_counters,
+                accumulated_inst);
+      EXPECT_EQ(symbol_map.GetWorkingSets()[bucket_num].min_counter, count);
+      bucket_num++;
+    }
+    accumulated_inst += num_inst;
+    accumulated_count += num_inst * count;
+  }
+  EXPECT_EQ(bucket_num, NUM_GCOV_WORKING_SETS);
+}
+
+TEST(SymbolMapTest, Overlap) {
+  SymbolMap map_1, map_2;
+  SourceStack foo_stack = {{"foo", "", "", 0, 1, 0}};
+  SourceStack bar_stack = {{"bar", "", "", 0, 1, 0}};
+  SourceStack baz_stack = {{"baz", "", "", 0, 1, 0}};
+  map_1.AddSymbol("foo");
+  map_1.AddSourceCount("foo", foo_stack, 60, 1);
+  map_1.AddSymbol("bar");
+  map_1.AddSourceCount("bar", bar_stack, 40, 1);
+  map_2.AddSymbol("bar");
+  map_2.AddSourceCount("bar", bar_stack, 50, 1);
+  map_2.AddSymbol("baz");
+  map_2.AddSourceCount("baz", baz_stack, 50, 1);
+
+  // Only bar is in both: min(0.4, 0.5).
+  EXPECT_FLOAT_EQ(map_1.Overlap(map_2), 0.4);
+  EXPECT_TRUE(map_1.OverlapAtLeast(map_2, 0.3));
+  EXPECT_TRUE(map_1.OverlapAtLeast(map_2, 0.4));
+  EXPECT_FALSE(map_1.OverlapAtLeast(map_2, 0.5));
+  EXPECT_FLOAT_EQ(map_1.Overlap(map_1), 1.0);
+  EXPECT_TRUE(map_1.OverlapAtLeast(map_1, 1.0));
+}
+
+TEST(SymbolMapTest, GetSymbolInfoByAddr) {
+  SymbolMap symbol_map(FLAGS_test_srcdir + kTestDataDir + "test.binary");
+  const std::string *name = nullptr;
+  uint64_t start_addr = 0;
+  uint64_t end_addr = 0;
+
+  // init_block is at [0x4049b0, 0x404a5e), pqdownheap starts at 0x404a60.
+  ASSERT_TRUE(symbol_map.GetSymbolInfoByAddr(0x4049b0, &name, &start_addr,
+                                             &end_addr));
+  EXPECT_EQ(*name, "init_block");
+  EXPECT_EQ(start_addr, 0x4049b0);
+  EXPECT_EQ(end_addr, 0x404a5e);
+  ASSERT_TRUE(
+      symbol_map.GetSymbolInfoByAddr(0x404a5d, &name, nullptr, nullptr));
+  EXPECT_EQ(*name, "init_block");
+  EXPECT_FALSE(
+      symbol_map.GetSymbolInfoByAddr(0x404a5e, &name, nullptr, nullptr));
+  ASSERT_TRUE(
+      symbol_map.GetSymbolInfoByAddr(0x404a60, &name, nullptr, nullptr));
+  EXPECT_EQ(*name, "pqdownheap");
+
+  // Before the first and after the last symbol.
+  EXPECT_FALSE(symbol_map.GetSymbolInfoByAddr(0, &name, nullptr, nullptr));
+  EXPECT_FALSE(symbol_map.GetSymbolInfoByAddr(~0ULL, &name, nullptr, nullptr));
+
+  // An empty symbol map has no symbols.
+  SymbolMap empty_symbol_map;
+  EXPECT_FALSE(
+      empty_symbol_map.GetSymbolInfoByAddr(0x4049b0, &name, nullptr, nullptr));
+}
+
 std::string GenRandomName(const int len) {
   std::string result(len, '\0');
   static const char alpha[] = "abcdefghijklmnopqrstuvwxyz";
@@ -173,14 +409,57 @@ TEST(SymbolMapTest, TestElideSuffixesAndMerge) {
   }
 }
 
+TEST(SymbolMapTest, ElideSuffixesAndMergeOfLaterSymbols) {
+  SymbolMap symbol_map;
+  symbol_map.set_suffix_elision_policy("selected");
+  symbol_map.AddSymbol("foo");
+  symbol_map.AddSymbolEntryCount("foo", 1, 10);
+  symbol_map.AddSymbol("foo.llvm.123");
+  symbol_map.AddSymbolEntryCount("foo.llvm.123", 2, 20);
+  symbol_map.ElideSuffixesAndMerge();
+  ASSERT_EQ(symbol_map.size(), 1);
+  EXPECT_EQ(symbol_map.map().at("foo")->total_count, 30);
+
+  // Symbols added after the first pass are elided by the next one.
+  symbol_map.AddSymbol("foo.llvm.456");
+  symbol_map.AddSymbolEntryCount("foo.llvm.456", 4, 40);
+  symbol_map.AddSymbol("bar.cold");
+  symbol_map.AddSymbolEntryCount("bar.cold", 8, 80);
+  symbol_map.ElideSuffixesAndMerge();
+  ASSERT_EQ(symbol_map.size(), 2);
+  EXPECT_EQ(symbol_map.map().at("foo")->total_count, 70);
+  EXPECT_EQ(symbol_map.map().at("bar")->total_count, 80);
+
+  // A new policy applies to the symbols that are already in the map.
+  symbol_map.AddSymbol("baz.suffix");
+  symbol_map.AddSymbolEntryCount("baz.suffix", 16, 160);
+  symbol_map.ElideSuffixesAndMerge();
+  ASSERT_EQ(symbol_map.size(), 3);
+  symbol_map.set_suffix_elision_policy("all");
+  symbol_map.ElideSuffixesAndMerge();
+  ASSERT_EQ(symbol_map.size(), 3);
+  EXPECT_EQ(symbol_map.map().at("baz")->total_count, 160);
+}
+
+TEST(SymbolMapTest, GetOriginalNameFollowsPolicy) {
+  SymbolMap symbol_map;
+  symbol_map.set_suffix_elision_policy("selected");
+  EXPECT_EQ(symbol_map.GetOriginalName("foo.llvm.123"), "foo");
+  EXPECT_EQ(symbol_map.GetOriginalName("foo.suffix"), "foo.suffix");
+  // Cached original names do not outlive the policy they were computed for.
+  symbol_map.set_suffix_elision_policy("all");
+  EXPECT_EQ(symbol_map.GetOriginalName("foo.suffix"), "foo");
+  symbol_map.set_suffix_elision_policy("none");
+  EXPECT_EQ(symbol_map.GetOriginalName("foo.llvm.123"), "foo.llvm.123");
+}
+
 TEST(SymbolMapTest, TestInterestingSymbolNames) {
   const char *policies[] = { "all", "none", "selected" };
   for (auto p : policies) {
     std::string policy(p);
     SymbolMap symbol_map;
     symbol_map.set_suffix_elision_policy(policy);
-    absl::node_hash_set<std::string> names;
-    devtools_crosstool_autofdo::LLVMProfileReader reader(&symbol_map, names);
+    devtools_crosstool_autofdo::LLVMProfileReader reader(&symbol_map);
         reader.ReadFromFile(FLAGS_test_srcdir + kTestDataDir +
                             "symbols_with_fun_characters.txt");
 
@@ -355,6 +634,64 @@ TEST(SymbolMapTest, BuildHybridProfile) {
   EXPECT_EQ(num_callsites_flattened, 5);
 }
 
+TEST(SymbolMapTest, BuildProfilesInParallel) {
+  // Enough outline symbols to be split between threads, each with a hot and a
+  // cold inline instance.
+  std::vector<std::string> names;
+  for (int i = 0; i < 2000; ++i) names.push_back(absl::StrCat("fn", i));
+  auto initialize = [&](SymbolMap &sm) {
+    for (int i = 0; i < names.size(); ++i) {
+      sm.AddSymbol(names[i]);
+      const std::string &callee = names[(i + 1) % names.size()];
+      sm.AddSourceCount(names[i],
+                        {{callee.c_str(), "", "", 0, 10, 0},
+                         {names[i].c_str(), "", "", 0, 50, 0}},
+                        1000 + i, 2);
+      sm.AddSourceCount(names[i],
+                        {{"cold", "", "", 0, 10, 0},
+                         {names[i].c_str(), "", "", 0, 60, 0}},
+                        10, 2);
+    }
+  };
+
+  SymbolMap serial_src, parallel_src;
+  initialize(serial_src);
+  initialize(parallel_src);
+  SymbolMap serial, parallel;
+  uint64_t serial_callsites = 0, serial_flattened = 0;
+  uint64_t parallel_callsites = 0, parallel_flattened = 0;
+  serial.BuildHybridProfile(serial_src, 100, serial_callsites,
+                            serial_flattened);
+  parallel.BuildHybridProfile(parallel_src, 100, parallel_callsites,
+                              parallel_flattened, /*num_threads=*/4);
+  EXPECT_EQ(parallel_callsites, serial_callsites);
+  EXPECT_EQ(parallel_flattened, serial_flattened);
+  ASSERT_EQ(parallel.map().size(), serial.map().size());
+  for (const auto &[name, symbol] : serial.map()) {
+    ASSERT_EQ(parallel.map().count(name), 1) << name;
+    const auto *parallel_symbol = parallel.map().at(name);
+    EXPECT_EQ(parallel_symbol->total_count, symbol->total_count) << name;
+    EXPECT_EQ(parallel_symbol->callsites.size(), symbol->callsites.size())
+        << name;
+  }
+
+  SymbolMap serial_flat, parallel_flat;
+  uint64_t serial_functions = 0, parallel_functions = 0;
+  serial_flattened = parallel_flattened = 0;
+  serial_flat.BuildFlatProfile(serial_src, true, 1500, serial_functions,
+                               serial_flattened);
+  parallel_flat.BuildFlatProfile(parallel_src, true, 1500, parallel_functions,
+                                 parallel_flattened, /*num_threads=*/4);
+  EXPECT_EQ(parallel_functions, serial_functions);
+  EXPECT_EQ(parallel_flattened, serial_flattened);
+  ASSERT_EQ(parallel_flat.map().size(), serial_flat.map().size());
+  for (const auto &[name, symbol] : serial_flat.map()) {
+    ASSERT_EQ(parallel_flat.map().count(name), 1) << name;
+    EXPECT_EQ(parallel_flat.map().at(name)->total_count, symbol->total_count)
+        << name;
+  }
+}
+
 TEST(SymbolMapTest, FSDiscriminator) {
   absl::SetFlag(&FLAGS_use_fs_discriminator, false);
   SymbolMap symbol_map1(FLAGS_test_srcdir + kTestDataDir +
@@ -396,10 +733,31 @@ TEST(SymbolMapTest, FSDiscriminatorUseBaseOnly) {
   EXPECT_TRUE(devtools_crosstool_autofdo::SourceInfo::
                   use_base_only_in_fs_discriminator);
 }
+TEST(SymbolMapTest, FSDiscriminatorSelectsEncoding) {
+  using devtools_crosstool_autofdo::SourceInfo;
+  absl::SetFlag(&FLAGS_use_fs_discriminator, false);
+  absl::SetFlag(&FLAGS_use_base_only_in_fs_discriminator, true);
+  SymbolMap symbol_map(FLAGS_test_srcdir + kTestDataDir + "test.fs.binary");
+  const SourceInfo info("foo", "", "", 10, 12, 0x1234567);
+  const bool fs = devtools_crosstool_autofdo::WithDiscriminatorEncoding(
+      false, [](auto encoding) {
+        return std::is_same_v<
+            decltype(encoding),
+            devtools_crosstool_autofdo::DiscriminatorEncoding<true, true>>;
+      });
+  EXPECT_TRUE(fs);
+  // The encoding selected once gives the offsets of SourceInfo::Offset.
+  devtools_crosstool_autofdo::WithDiscriminatorEncoding(
+      false, [&](auto encoding) {
+        EXPECT_EQ(decltype(encoding)::Offset(info), info.Offset(false));
+        EXPECT_EQ(decltype(encoding)::DuplicationFactor(info), 1);
+      });
+  absl::SetFlag(&FLAGS_use_base_only_in_fs_discriminator, false);
+}
+
 TEST(SymbolMapTest, RemoveSymsMatchingRegex) {
   SymbolMap symbol_map;
-  absl::node_hash_set<std::string> names;
-  devtools_crosstool_autofdo::LLVMProfileReader reader(&symbol_map, names);
+  devtools_crosstool_autofdo::LLVMProfileReader reader(&symbol_map);
   reader.ReadFromFile(FLAGS_test_srcdir + kTestDataDir +
                       "strip_symbols_regex.textprof");
 
@@ -429,8 +787,7 @@ TEST(SymbolMapTest, RemoveSymsMatchingRegex) {
 
 TEST(SymbolMapTest, throttleInlineInstancesAtSameLocation) {
   SymbolMap symbol_map;
-  absl::node_hash_set<std::string> names;
-  devtools_crosstool_autofdo::LLVMProfileReader reader(&symbol_map, names);
+  devtools_crosstool_autofdo::LLVMProfileReader reader(&symbol_map);
   reader.ReadFromFile(FLAGS_test_srcdir + kTestDataDir +
                       "throttle_inline_instances.textprof");
 
@@ -492,4 +849,21 @@ TEST(SymbolMapTest, throttleInlineInstancesAtSameLocation) {
               hoo_cs_map.end());
 }
 
+TEST(SymbolMapTest, SharesElfReader) {
+  using ::devtools_crosstool_autofdo::ElfReader;
+  const std::string binary = FLAGS_test_srcdir + kTestDataDir + "test.binary";
+  std::shared_ptr<ElfReader> reader = ElfReader::GetShared(binary);
+  EXPECT_EQ(ElfReader::GetShared(binary), reader);
+
+  // The symbol map reads the binary through the same reader.
+  SymbolMap symbol_map(binary);
+  EXPECT_EQ(ElfReader::GetShared(binary), reader);
+  EXPECT_EQ(symbol_map.base_addr(), reader->VaddrOfFirstLoadSegment());
+
+  // Once nobody holds the reader, the next call opens the binary again.
+  reader.reset();
+  std::shared_ptr<ElfReader> reopened = ElfReader::GetShared(binary);
+  EXPECT_TRUE(reopened->IsElf64File());
+}
+
 }  // namespace
@@ -0,0 +1,329 @@
+// Persistent cache of the inline stacks of a binary, keyed by its build-id.
+
+#include "symbolization_cache.h"
+
+#include <elf.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "base/logging.h"
+#include "util/symbolize/elf_reader.h"
+#include "third_party/abseil/absl/container/flat_hash_map.h"
+#include "third_party/abseil/absl/strings/match.h"
+#include "third_party/abseil/absl/strings/str_cat.h"
+
+namespace devtools_crosstool_autofdo {
+
+// [begin, end) has the num_frames frames starting at first_frame.
+struct SymbolizationCache::Range {
+  uint64_t begin;
+  uint64_t end;
+  uint32_t first_frame;
+  uint32_t num_frames;
+};
+
+// A SourceInfo whose names are offsets into the string table.
+struct SymbolizationCache::Frame {
+  uint32_t func_name;
+  uint32_t dir_name;
+  uint32_t file_name;
+  uint32_t start_line;
+  uint32_t line;
+  uint32_t discriminator;
+};
+
+namespace {
+constexpr char kCacheMagic[8] = {'A', 'F', 'D', 'O', 'S', 'Y', 'M', '1'};
+constexpr uint32_t kCacheVersion = 1;
+// Stored for a null function name, to tell it apart from an empty one.
+constexpr uint32_t kNoString = UINT32_MAX;
+
+// The file starts with this header and the build-id, followed by the range
+// table, the frame table and the string table. The tables are 8-byte
+// aligned so that they can be used in place.
+struct CacheHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t build_id_size;
+  uint64_t num_ranges;
+  uint64_t num_frames;
+  uint64_t strings_size;
+};
+
+size_t AlignTo8(size_t size) { return (size + 7) & ~size_t{7}; }
+
+// Collects the start address and size of the functions in the symbol
+// table, using the same filter as SymbolMap.
+class FunctionRangeReader : public ElfReader::SymbolSink {
+ public:
+  explicit FunctionRangeReader(std::map<uint64_t, uint64_t> *functions)
+      : functions_(functions) {}
+  void AddSymbol(const char *name, uint64_t address, uint64_t size,
+                 int binding, int type, int section) override {
+    uint64_t &function_size = (*functions_)[address];
+    function_size = std::max(function_size, size);
+  }
+
+ private:
+  std::map<uint64_t, uint64_t> *functions_;
+};
+}  // namespace
+
+SymbolizationCache::~SymbolizationCache() {
+  if (data_ != nullptr) munmap(const_cast<char *>(data_), size_);
+}
+
+std::string SymbolizationCache::GetCachePath(const std::string &cache_dir,
+                                             const std::string &build_id) {
+  return absl::StrCat(cache_dir, "/", build_id, ".symcache");
+}
+
+SymbolizationCache *SymbolizationCache::Load(const std::string &cache_dir,
+                                             const std::string &binary_name) {
+  const std::string build_id = ElfReader(binary_name).GetBuildId();
+  if (build_id.empty()) return nullptr;
+  SymbolizationCache *cache = new SymbolizationCache(binary_name);
+  if (!cache->Open(GetCachePath(cache_dir, build_id), build_id)) {
+    delete cache;
+    return nullptr;
+  }
+  return cache;
+}
+
+bool SymbolizationCache::Open(const std::string &path,
+                              const std::string &build_id) {
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) return false;
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size < sizeof(CacheHeader)) {
+    close(fd);
+    return false;
+  }
+  void *data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) return false;
+  data_ = static_cast<const char *>(data);
+  size_ = st.st_size;
+
+  const CacheHeader *header = reinterpret_cast<const CacheHeader *>(data_);
+  if (memcmp(header->magic, kCacheMagic, sizeof(kCacheMagic)) != 0 ||
+      header->version != kCacheVersion ||
+      header->build_id_size != build_id.size()) {
+    LOG(WARNING) << "Ignoring stale symbolization cache " << path;
+    return false;
+  }
+  const size_t build_id_offset = sizeof(CacheHeader);
+  const size_t ranges_offset = build_id_offset + AlignTo8(build_id.size());
+  const size_t frames_offset =
+      ranges_offset + header->num_ranges * sizeof(Range);
+  const size_t strings_offset =
+      frames_offset + header->num_frames * sizeof(Frame);
+  if (header->num_ranges > size_ / sizeof(Range) ||
+      header->num_frames > size_ / sizeof(Frame) ||
+      strings_offset + header->strings_size != size_ ||
+      memcmp(data_ + build_id_offset, build_id.data(), build_id.size()) != 0) {
+    LOG(WARNING) << "Ignoring malformed symbolization cache " << path;
+    return false;
+  }
+  ranges_ = reinterpret_cast<const Range *>(data_ + ranges_offset);
+  num_ranges_ = header->num_ranges;
+  frames_ = reinterpret_cast<const Frame *>(data_ + frames_offset);
+  num_frames_ = header->num_frames;
+  strings_ = data_ + strings_offset;
+  strings_size_ = header->strings_size;
+
+  // Check the references once so that queries need not.
+  auto valid_string = [this](uint32_t offset) {
+    return offset < strings_size_ &&
+           memchr(strings_ + offset, '\0', strings_size_ - offset) != nullptr;
+  };
+  for (size_t i = 0; i < num_ranges_; ++i) {
+    const Range &range = ranges_[i];
+    if (range.begin >= range.end ||
+        (i > 0 && range.begin < ranges_[i - 1].end) ||
+        range.first_frame > num_frames_ ||
+        range.num_frames > num_frames_ - range.first_frame) {
+      LOG(WARNING) << "Ignoring malformed symbolization cache " << path;
+      return false;
+    }
+  }
+  for (size_t i = 0; i < num_frames_; ++i) {
+    const Frame &frame = frames_[i];
+    if ((frame.func_name != kNoString && !valid_string(frame.func_name)) ||
+        !valid_string(frame.dir_name) || !valid_string(frame.file_name)) {
+      LOG(WARNING) << "Ignoring malformed symbolization cache " << path;
+      return false;
+    }
+  }
+  return true;
+}
+
+bool SymbolizationCache::Save(const std::string &cache_dir,
+                              const std::string &binary_name,
+                              const Addr2line &addr2line) {
+  std::shared_ptr<ElfReader> elf_reader = ElfReader::GetShared(binary_name);
+  const std::string build_id = elf_reader->GetBuildId();
+  if (build_id.empty()) {
+    LOG(WARNING) << "Not caching the symbolization of '" << binary_name
+                 << "', which has no build-id.";
+    return false;
+  }
+  std::map<uint64_t, uint64_t> functions;
+  FunctionRangeReader function_reader(&functions);
+  function_reader.filter = [](const char *name, uint64 address, uint64 size,
+                              int binding, int type, int section) {
+    return (size != 0 && (type == STT_FUNC || absl::EndsWith(name, ".cold")) &&
+            !absl::EndsWith(name, "@plt"));
+  };
+  elf_reader->VisitSymbols(&function_reader);
+
+  std::vector<Range> ranges;
+  std::vector<Frame> frames;
+  std::string strings;
+  absl::flat_hash_map<std::string, uint32_t> string_offsets;
+  // Maps the frames of a stack, as bytes, to the first of them in frames.
+  absl::flat_hash_map<std::string, uint32_t> stack_offsets;
+  auto add_string = [&](const std::string &str) {
+    auto [it, inserted] = string_offsets.emplace(str, strings.size());
+    if (inserted) strings.append(str.c_str(), str.size() + 1);
+    return it->second;
+  };
+  auto add_range = [&](uint64_t begin, uint64_t end,
+                       const SourceStack &stack) {
+    if (stack.empty()) return;
+    std::vector<Frame> stack_frames;
+    stack_frames.reserve(stack.size());
+    for (const SourceInfo &info : stack) {
+      stack_frames.push_back(
+          {info.func_name == nullptr ? kNoString : add_string(info.func_name),
+           add_string(info.dir_name), add_string(info.file_name),
+           info.start_line, info.line, info.discriminator});
+    }
+    auto [it, inserted] = stack_offsets.emplace(
+        std::string(reinterpret_cast<const char *>(stack_frames.data()),
+                    stack_frames.size() * sizeof(Frame)),
+        frames.size());
+    if (inserted) {
+      frames.insert(frames.end(), stack_frames.begin(), stack_frames.end());
+    }
+    const uint32_t first_frame = it->second;
+    if (!ranges.empty() && ranges.back().end == begin &&
+        ranges.back().first_frame == first_frame &&
+        ranges.back().num_frames == stack.size()) {
+      ranges.back().end = end;
+    } else {
+      ranges.push_back({begin, end, first_frame,
+                        static_cast<uint32_t>(stack.size())});
+    }
+  };
+  uint64_t covered_until = 0;
+  for (const auto &[start, size] : functions) {
+    const uint64_t begin = std::max(start, covered_until);
+    const uint64_t end = start + size;
+    if (begin >= end) continue;
+    addr2line.GetInlineStacksForRange(begin, end, add_range);
+    covered_until = end;
+  }
+
+  CacheHeader header;
+  memcpy(header.magic, kCacheMagic, sizeof(kCacheMagic));
+  header.version = kCacheVersion;
+  header.build_id_size = build_id.size();
+  header.num_ranges = ranges.size();
+  header.num_frames = frames.size();
+  header.strings_size = strings.size();
+  std::string padding(AlignTo8(build_id.size()) - build_id.size(), '\0');
+
+  // Write to a temporary file first so that concurrent runs never see a
+  // partial cache.
+  const std::string path = GetCachePath(cache_dir, build_id);
+  const std::string temp_path = absl::StrCat(path, ".tmp.", getpid());
+  FILE *fp = fopen(temp_path.c_str(), "wb");
+  if (fp == nullptr) {
+    LOG(ERROR) << "Cannot open " << temp_path << " to write.";
+    return false;
+  }
+  bool ok = fwrite(&header, sizeof(header), 1, fp) == 1 &&
+            fwrite(build_id.data(), 1, build_id.size(), fp) ==
+                build_id.size() &&
+            fwrite(padding.data(), 1, padding.size(), fp) == padding.size() &&
+            fwrite(ranges.data(), sizeof(Range), ranges.size(), fp) ==
+                ranges.size() &&
+            fwrite(frames.data(), sizeof(Frame), frames.size(), fp) ==
+                frames.size() &&
+            fwrite(strings.data(), 1, strings.size(), fp) == strings.size();
+  ok = (fclose(fp) == 0) && ok;
+  if (!ok || rename(temp_path.c_str(), path.c_str()) != 0) {
+    LOG(ERROR) << "Error writing symbolization cache " << path;
+    unlink(temp_path.c_str());
+    return false;
+  }
+  return true;
+}
+
+void SymbolizationCache::GetRangeStack(const Range &range,
+                                       SourceStack *stack) const {
+  for (uint32_t i = 0; i < range.num_frames; ++i) {
+    const Frame &frame = frames_[range.first_frame + i];
+    SourceInfo info;
+    info.func_name =
+        frame.func_name == kNoString ? nullptr : strings_ + frame.func_name;
+    info.dir_name = strings_ + frame.dir_name;
+    info.file_name = strings_ + frame.file_name;
+    info.start_line = frame.start_line;
+    info.line = frame.line;
+    info.discriminator = frame.discriminator;
+    stack->push_back(info);
+  }
+}
+
+void SymbolizationCache::GetInlineStack(uint64_t address,
+                                        SourceStack *stack) const {
+  const Range *ranges_end = ranges_ + num_ranges_;
+  const Range *range = std::upper_bound(
+      ranges_, ranges_end, address,
+      [](uint64_t address, const Range &range) {
+        return address < range.begin;
+      });
+  if (range == ranges_) return;
+  --range;
+  if (address < range->end) GetRangeStack(*range, stack);
+}
+
+void SymbolizationCache::GetInlineStacksForRange(
+    uint64_t start_addr, uint64_t end_addr,
+    const InlineStackRangeCallback &callback) const {
+  const Range *ranges_end = ranges_ + num_ranges_;
+  const Range *range = std::upper_bound(
+      ranges_, ranges_end, start_addr,
+      [](uint64_t address, const Range &range) {
+        return address < range.begin;
+      });
+  if (range != ranges_ && start_addr < (range - 1)->end) --range;
+  uint64_t addr = start_addr;
+  for (; addr < end_addr && range != ranges_end; ++range) {
+    if (range->begin >= end_addr) break;
+    if (addr < range->begin) {
+      callback(addr, range->begin, SourceStack());
+      addr = range->begin;
+    }
+    const uint64_t end = std::min(range->end, end_addr);
+    SourceStack stack;
+    GetRangeStack(*range, &stack);
+    callback(addr, end, stack);
+    addr = end;
+  }
+  if (addr < end_addr) callback(addr, end_addr, SourceStack());
+}
+
+}  // namespace devtools_crosstool_autofdo
@@ -0,0 +1,77 @@
+// Persistent cache of the inline stacks of a binary, keyed by its build-id.
+#ifndef AUTOFDO_SYMBOLIZATION_CACHE_H_
+#define AUTOFDO_SYMBOLIZATION_CACHE_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#include "base/macros.h"
+#include "addr2line.h"
+
+namespace devtools_crosstool_autofdo {
+
+// An Addr2line that answers queries from a cache file written by an earlier
+// run on the same binary, instead of reading the debug info again.
+//
+// The file stores the address ranges of all functions in the symbol table
+// as a sorted, flattened table that maps every range to its inline stack.
+// All tables are accessed in place in the memory mapping of the file, so
+// loading a cache is independent of the size of the debug info.
+class SymbolizationCache : public Addr2line {
+ public:
+  ~SymbolizationCache() override;
+
+  // Returns the cache file for BINARY_NAME in CACHE_DIR, or nullptr if the
+  // binary has no build-id, or the file does not exist or does not match.
+  static SymbolizationCache *Load(const std::string &cache_dir,
+                                  const std::string &binary_name);
+
+  // Symbolizes all functions of BINARY_NAME with ADDR2LINE and writes the
+  // result to the cache file for the binary in CACHE_DIR. Returns false if
+  // the binary has no build-id or the file cannot be written.
+  static bool Save(const std::string &cache_dir,
+                   const std::string &binary_name, const Addr2line &addr2line);
+
+  // Returns the cache file name used for BUILD_ID in CACHE_DIR.
+  static std::string GetCachePath(const std::string &cache_dir,
+                                  const std::string &build_id);
+
+  bool Prepare() override { return true; }
+  // The tables are read-only after loading.
+  bool PrepareForConcurrentQueries() override { return true; }
+  void GetInlineStack(uint64_t address, SourceStack *stack) const override;
+  void GetInlineStacksForRange(
+      uint64_t start_addr, uint64_t end_addr,
+      const InlineStackRangeCallback &callback) const override;
+
+  size_t num_ranges() const { return num_ranges_; }
+
+ private:
+  struct Range;
+  struct Frame;
+
+  explicit SymbolizationCache(const std::string &binary_name)
+      : Addr2line(binary_name) {}
+
+  // Maps PATH and checks that it is a cache for BUILD_ID.
+  bool Open(const std::string &path, const std::string &build_id);
+
+  // Stores the stack of RANGE in STACK.
+  void GetRangeStack(const Range &range, SourceStack *stack) const;
+
+  const char *data_ = nullptr;
+  size_t size_ = 0;
+  const Range *ranges_ = nullptr;
+  size_t num_ranges_ = 0;
+  const Frame *frames_ = nullptr;
+  size_t num_frames_ = 0;
+  const char *strings_ = nullptr;
+  size_t strings_size_ = 0;
+
+  DISALLOW_COPY_AND_ASSIGN(SymbolizationCache);
+};
+
+}  // namespace devtools_crosstool_autofdo
+
+#endif  // AUTOFDO_SYMBOLIZATION_CACHE_H_
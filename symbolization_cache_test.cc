@@ -0,0 +1,91 @@
+// These tests check that the symbolization cache answers queries the same
+// way as the symbolizer it was built from.
+
+#include "symbolization_cache.h"
+
+#include <unistd.h>
+
+#include <cstdint>
+#include <memory>
+#include <string>
+
+#include "addr2line.h"
+#include "gtest/gtest.h"
+
+using devtools_crosstool_autofdo::Addr2line;
+using devtools_crosstool_autofdo::SourceStack;
+using devtools_crosstool_autofdo::SymbolizationCache;
+
+#define FLAGS_test_tmpdir std::string(testing::UnitTest::GetInstance()->original_working_dir())
+
+#define FLAGS_test_srcdir std::string(testing::UnitTest::GetInstance()->original_working_dir())
+
+namespace {
+
+const char kTestDataDir[] = "/testdata/";
+
+void ExpectSameStacks(const SourceStack &stack, const SourceStack &expected) {
+  ASSERT_EQ(stack.size(), expected.size());
+  for (int i = 0; i < stack.size(); ++i) {
+    EXPECT_STREQ(stack[i].func_name, expected[i].func_name);
+    EXPECT_EQ(stack[i].dir_name, expected[i].dir_name);
+    EXPECT_EQ(stack[i].file_name, expected[i].file_name);
+    EXPECT_EQ(stack[i].start_line, expected[i].start_line);
+    EXPECT_EQ(stack[i].line, expected[i].line);
+    EXPECT_EQ(stack[i].discriminator, expected[i].discriminator);
+  }
+}
+
+TEST(SymbolizationCacheTest, LoadedCacheMatchesSymbolizer) {
+  const std::string binary =
+      FLAGS_test_srcdir + kTestDataDir + "llvm_function_samples.binary";
+  const std::string cache_dir = FLAGS_test_tmpdir;
+  std::unique_ptr<Addr2line> addr2line(Addr2line::Create(binary));
+  ASSERT_NE(addr2line, nullptr);
+  ASSERT_TRUE(SymbolizationCache::Save(cache_dir, binary, *addr2line));
+  std::unique_ptr<SymbolizationCache> cache(
+      SymbolizationCache::Load(cache_dir, binary));
+  ASSERT_NE(cache, nullptr);
+  EXPECT_GT(cache->num_ranges(), 0);
+
+  // The .text section of the binary.
+  const uint64_t start_addr = 0x400600;
+  const uint64_t end_addr = 0x4008f2;
+  int num_symbolized = 0;
+  for (uint64_t addr = start_addr; addr < end_addr; ++addr) {
+    SourceStack stack, expected;
+    cache->GetInlineStack(addr, &stack);
+    addr2line->GetInlineStack(addr, &expected);
+    if (stack.empty()) continue;
+    ++num_symbolized;
+    ExpectSameStacks(stack, expected);
+  }
+  EXPECT_GT(num_symbolized, 0);
+
+  uint64_t next_addr = start_addr;
+  cache->GetInlineStacksForRange(
+      start_addr, end_addr,
+      [&](uint64_t begin, uint64_t end, const SourceStack &stack) {
+        EXPECT_EQ(begin, next_addr);
+        EXPECT_LT(begin, end);
+        next_addr = end;
+        for (uint64_t addr = begin; addr < end; ++addr) {
+          SourceStack expected;
+          cache->GetInlineStack(addr, &expected);
+          ExpectSameStacks(stack, expected);
+        }
+      });
+  EXPECT_EQ(next_addr, end_addr);
+  unlink(SymbolizationCache::GetCachePath(cache_dir, "a56e4274b3adf7c87d165ca6"
+                                          "deb66db002e72e1e").c_str());
+}
+
+TEST(SymbolizationCacheTest, BinaryWithoutBuildIdIsNotCached) {
+  const std::string binary = FLAGS_test_srcdir + kTestDataDir + "test.binary";
+  std::unique_ptr<Addr2line> addr2line(Addr2line::Create(binary));
+  ASSERT_NE(addr2line, nullptr);
+  EXPECT_FALSE(SymbolizationCache::Save(FLAGS_test_tmpdir, binary, *addr2line));
+  EXPECT_EQ(SymbolizationCache::Load(FLAGS_test_tmpdir, binary), nullptr);
+}
+
+}  // namespace
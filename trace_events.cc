@@ -0,0 +1,111 @@
+#include "trace_events.h"
+
+#include <fstream>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "base/logging.h"
+#include "third_party/abseil/absl/strings/str_cat.h"
+#include "third_party/abseil/absl/strings/string_view.h"
+#include "third_party/abseil/absl/synchronization/mutex.h"
+
+namespace devtools_crosstool_autofdo {
+
+namespace {
+// Appends `args` as a JSON object.
+void AppendArgs(const TraceRecorder::Args &args, std::string &json) {
+  json += "{";
+  for (int i = 0; i < args.size(); ++i) {
+    absl::StrAppend(&json, i == 0 ? "" : ", ", "\"", args[i].first,
+                    "\": ", args[i].second);
+  }
+  json += "}";
+}
+}  // namespace
+
+TraceRecorder &TraceRecorder::GetInstance() {
+  static TraceRecorder *recorder = new TraceRecorder();
+  return *recorder;
+}
+
+TraceRecorder::ThreadBuffer &TraceRecorder::GetThreadBuffer() {
+  // Only the global instance records events, so one buffer per thread is
+  // enough.
+  thread_local ThreadBuffer *buffer = nullptr;
+  if (buffer == nullptr) {
+    absl::MutexLock lock(&mutex_);
+    auto &new_buffer = buffers_.emplace_back(std::make_unique<ThreadBuffer>());
+    new_buffer->tid = buffers_.size();
+    buffer = new_buffer.get();
+  }
+  return *buffer;
+}
+
+void TraceRecorder::AddEvent(Event event) {
+  ThreadBuffer &buffer = GetThreadBuffer();
+  absl::MutexLock lock(&buffer.mutex);
+  if (buffer.events.size() < kMaxEventsPerThread) {
+    buffer.events.push_back(std::move(event));
+    return;
+  }
+  buffer.events[buffer.next] = std::move(event);
+  buffer.next = (buffer.next + 1) % kMaxEventsPerThread;
+  ++buffer.dropped;
+}
+
+void TraceRecorder::AddSpan(absl::string_view name, int64_t begin_ns,
+                            int64_t end_ns, Args args) {
+  if (!enabled()) return;
+  AddEvent({.name = std::string(name),
+            .phase = 'X',
+            .begin_ns = begin_ns,
+            .duration_ns = end_ns - begin_ns,
+            .args = std::move(args)});
+}
+
+void TraceRecorder::AddCounters(absl::string_view name, Args values) {
+  if (!enabled()) return;
+  AddEvent({.name = std::string(name),
+            .phase = 'C',
+            .begin_ns = NowNanos(),
+            .duration_ns = 0,
+            .args = std::move(values)});
+}
+
+std::string TraceRecorder::ToJson() const {
+  std::string json = "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [";
+  bool first = true;
+  absl::MutexLock lock(&mutex_);
+  for (const std::unique_ptr<ThreadBuffer> &buffer : buffers_) {
+    absl::MutexLock buffer_lock(&buffer->mutex);
+    if (buffer->dropped != 0) {
+      LOG(WARNING) << "Dropped the " << buffer->dropped
+                   << " oldest trace events of thread " << buffer->tid << ".";
+    }
+    for (const Event &event : buffer->events) {
+      absl::StrAppend(&json, first ? "\n " : ",\n ", "{\"name\": \"",
+                      event.name, "\", \"ph\": \"",
+                      absl::string_view(&event.phase, 1),
+                      "\", \"pid\": 1, \"tid\": ", buffer->tid,
+                      ", \"ts\": ", event.begin_ns / 1000.0);
+      if (event.phase == 'X')
+        absl::StrAppend(&json, ", \"dur\": ", event.duration_ns / 1000.0);
+      json += ", \"args\": ";
+      AppendArgs(event.args, json);
+      json += "}";
+      first = false;
+    }
+  }
+  json += "]}\n";
+  return json;
+}
+
+bool TraceRecorder::WriteJson(const std::string &file_name) const {
+  std::ofstream out(file_name);
+  out << ToJson();
+  return static_cast<bool>(out);
+}
+
+}  // namespace devtools_crosstool_autofdo
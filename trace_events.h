@@ -0,0 +1,122 @@
+#ifndef AUTOFDO_TRACE_EVENTS_H_
+#define AUTOFDO_TRACE_EVENTS_H_
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "third_party/abseil/absl/base/thread_annotations.h"
+#include "third_party/abseil/absl/strings/string_view.h"
+#include "third_party/abseil/absl/synchronization/mutex.h"
+#include "third_party/abseil/absl/time/clock.h"
+
+namespace devtools_crosstool_autofdo {
+
+// Records the spans of the pipeline stages and of their worker tasks, and
+// counters, in the Chrome trace event format, which chrome://tracing and
+// Perfetto load. Every thread records into its own ring buffer, which keeps
+// only its last kMaxEventsPerThread events. Recording is disabled until
+// Start() is called, and then costs one relaxed load per span. Thread-safe.
+class TraceRecorder {
+ public:
+  // Numeric arguments of an event.
+  using Args = std::vector<std::pair<std::string, int64_t>>;
+
+  static constexpr int kMaxEventsPerThread = 1 << 20;
+
+  // Retrieve the global recorder instance.
+  static TraceRecorder &GetInstance();
+  TraceRecorder() = default;
+
+  TraceRecorder(const TraceRecorder &) = delete;
+  TraceRecorder &operator=(const TraceRecorder &) = delete;
+
+  // Returns the current time of the trace clock, in nanoseconds.
+  static int64_t NowNanos() { return absl::GetCurrentTimeNanos(); }
+
+  // Starts recording events.
+  void Start() { enabled_.store(true, std::memory_order_relaxed); }
+  bool enabled() const { return enabled_.load(std::memory_order_relaxed); }
+
+  // Records a span of the calling thread from `begin_ns` to `end_ns`, with
+  // `args`. Does nothing unless recording.
+  void AddSpan(absl::string_view name, int64_t begin_ns, int64_t end_ns,
+               Args args = {});
+
+  // Records the values of the counters in `values` as of now. Does nothing
+  // unless recording.
+  void AddCounters(absl::string_view name, Args values);
+
+  // Returns the recorded events as a JSON object in the Chrome trace event
+  // format. Names and argument keys are emitted verbatim and must not need
+  // escaping.
+  std::string ToJson() const ABSL_LOCKS_EXCLUDED(mutex_);
+
+  // Writes ToJson() to `file_name`. Returns false if the file can not be
+  // written.
+  bool WriteJson(const std::string &file_name) const;
+
+ private:
+  struct Event {
+    std::string name;
+    // 'X' for spans, 'C' for counters.
+    char phase;
+    int64_t begin_ns;
+    int64_t duration_ns;
+    Args args;
+  };
+
+  // The events of one thread. `mutex` is only contended by ToJson().
+  struct ThreadBuffer {
+    int tid;
+    absl::Mutex mutex;
+    std::vector<Event> events ABSL_GUARDED_BY(mutex);
+    // Position of the next event in `events` once it is full.
+    int next ABSL_GUARDED_BY(mutex) = 0;
+    int64_t dropped ABSL_GUARDED_BY(mutex) = 0;
+  };
+
+  // Returns the buffer of the calling thread, registering it on first use.
+  ThreadBuffer &GetThreadBuffer() ABSL_LOCKS_EXCLUDED(mutex_);
+  void AddEvent(Event event);
+
+  std::atomic<bool> enabled_ = false;
+  mutable absl::Mutex mutex_;
+  // Buffers are never freed, so they outlive the threads recording into them.
+  std::vector<std::unique_ptr<ThreadBuffer>> buffers_ ABSL_GUARDED_BY(mutex_);
+};
+
+// Records the enclosing scope as a span of the calling thread into
+// TraceRecorder::GetInstance().
+class ScopedTraceSpan {
+ public:
+  explicit ScopedTraceSpan(absl::string_view name,
+                           TraceRecorder::Args args = {})
+      : enabled_(TraceRecorder::GetInstance().enabled()) {
+    if (!enabled_) return;
+    name_ = std::string(name);
+    args_ = std::move(args);
+    begin_ns_ = TraceRecorder::NowNanos();
+  }
+  ~ScopedTraceSpan() {
+    if (!enabled_) return;
+    TraceRecorder::GetInstance().AddSpan(name_, begin_ns_,
+                                         TraceRecorder::NowNanos(),
+                                         std::move(args_));
+  }
+
+  ScopedTraceSpan(const ScopedTraceSpan &) = delete;
+  ScopedTraceSpan &operator=(const ScopedTraceSpan &) = delete;
+
+ private:
+  const bool enabled_;
+  std::string name_;
+  TraceRecorder::Args args_;
+  int64_t begin_ns_ = 0;
+};
+
+}  // namespace devtools_crosstool_autofdo
+#endif  // AUTOFDO_TRACE_EVENTS_H_
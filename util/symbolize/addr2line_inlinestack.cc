@@ -14,6 +14,8 @@
 
 #include "symbolize/addr2line_inlinestack.h"
 
+#include <algorithm>
+#include <map>
 #include <utility>
 
 #include "base/logging.h"
@@ -184,6 +186,35 @@ void InlineStackHandler::CleanupUnusedSubprograms() {
   subprograms_by_offset_maps_.back() = new_map;
 }
 
+void InlineStackHandler::GetUnresolvedReferences(
+    std::set<uint64> *offsets) const {
+  if (subprograms_by_offset_maps_.empty()) return;
+  const SubprogramsByOffsetMap &subprograms_by_offset =
+      *subprograms_by_offset_maps_[0];
+  std::set<const SubprogramInfo *> visited;
+  std::vector<const SubprogramInfo *> worklist;
+  for (const auto &offset_subprogram : subprograms_by_offset) {
+    if (offset_subprogram.second->used()) {
+      visited.insert(offset_subprogram.second);
+      worklist.push_back(offset_subprogram.second);
+    }
+  }
+
+  while (!worklist.empty()) {
+    const SubprogramInfo *info = worklist.back();
+    worklist.pop_back();
+    for (uint64 reference : {info->specification(), info->abstract_origin()}) {
+      if (reference == 0) continue;
+      auto iter = subprograms_by_offset.find(reference);
+      if (iter == subprograms_by_offset.end()) {
+        offsets->insert(reference);
+      } else if (visited.insert(iter->second).second) {
+        worklist.push_back(iter->second);
+      }
+    }
+  }
+}
+
 bool InlineStackHandler::StartDIE(uint64 offset,
                                   enum DwarfTag tag,
                                   const AttributeList& attrs) {
@@ -218,6 +249,30 @@ bool InlineStackHandler::StartDIE(uint64 offset,
   }
 }
 
+bool InlineStackHandler::SkipChildrenOfDIE(enum DwarfTag tag) {
+  switch (tag) {
+    case DW_TAG_subprogram:
+    case DW_TAG_inlined_subroutine:
+      // Only declined with two-level line tables, see StartDIE.
+      return have_two_level_line_tables_;
+    // Types and data, whose children cannot contain subprograms. Classes,
+    // structures and unions may declare member functions, and lexical
+    // blocks and namespaces may hold subprograms, so those are read.
+    case DW_TAG_array_type:
+    case DW_TAG_enumeration_type:
+    case DW_TAG_subroutine_type:
+    case DW_TAG_variable:
+    case DW_TAG_formal_parameter:
+    case DW_TAG_call_site:
+    case DW_TAG_GNU_call_site:
+    case DW_TAG_GNU_formal_parameter_pack:
+    case DW_TAG_GNU_template_parameter_pack:
+      return true;
+    default:
+      return false;
+  }
+}
+
 void InlineStackHandler::EndDIE(uint64 offset) {
 
   DwarfTag die = die_stack_.back();
@@ -332,7 +387,7 @@ void InlineStackHandler::ProcessAttributeUnsigned(
           break;
         }
         if (sampled_functions_ != NULL) {
-          if (sampled_functions_->find(data) != sampled_functions_->end()) {
+          if (sampled_functions_->HasStart(data)) {
             subprogram_stack_.front()->set_used();
           }
         } else {
@@ -360,8 +415,7 @@ void InlineStackHandler::ProcessAttributeUnsigned(
         if (subprogram_stack_.size() == 1) {
           if (sampled_functions_ != NULL) {
             for (const auto &range : ranges) {
-              if (sampled_functions_->find(range.first)
-                  != sampled_functions_->end()) {
+              if (sampled_functions_->HasStart(range.first)) {
                 subprogram_stack_.front()->set_used();
                 break;
               }
@@ -413,15 +467,15 @@ void InlineStackHandler::ProcessAttributeUnsigned(
           const char* str_buffer = NULL;
           uint64 str_buffer_size = 0;
           if (str_section != sections_.end()) {
-            str_buffer = line_str->second.first;
-            str_buffer_size = line_str->second.second;
+            str_buffer = str_section->second.first;
+            str_buffer_size = str_section->second.second;
           }
           SectionMap::const_iterator str_offsets = sections_.find(".debug_str_offsets");
           const char* str_offsets_buffer = NULL;
           uint64 str_offsets_size = 0;
           if (str_offsets != sections_.end()) {
-            str_offsets_buffer = line_str->second.first;
-            str_offsets_size = line_str->second.second;
+            str_offsets_buffer = str_offsets->second.first;
+            str_offsets_size = str_offsets->second.second;
           }                    
           LineInfo lireader(line_sect->second.first + data, line_sect->second.second - data,
                             line_str_buffer, line_str_size,
@@ -662,6 +716,7 @@ void InlineStackHandler::PopulateSubprogramsByAddress() {
 
   // For the DIEs that are not marked bad, insert them into the
   // address based map.
+  NonOverlappingRangeMap<SubprogramInfo*> subprograms_by_address;
   for (std::vector<SubprogramInfo *>::iterator subprogs =
            subprogram_insert_order_.begin();
        subprogs != subprogram_insert_order_.end();
@@ -669,10 +724,30 @@ void InlineStackHandler::PopulateSubprogramsByAddress() {
     SubprogramInfo *subprog = *subprogs;
 
     if (bad_subprograms.find(subprog) == bad_subprograms.end())
-      subprograms_by_address_.InsertRangeList(
+      subprograms_by_address.InsertRangeList(
           *subprog->address_ranges(), subprog);
   }
 
+  // Freeze the map into sorted intervals, and resolve the inline stack
+  // of every subprogram that owns one, so that lookups do not need to
+  // follow the declaration and abstract origin references.
+  std::map<const SubprogramInfo *, uint32> stack_index;
+  for (NonOverlappingRangeMap<SubprogramInfo*>::ConstIterator iter =
+           subprograms_by_address.Begin();
+       iter != subprograms_by_address.End(); ++iter) {
+    const SubprogramInfo *subprog = iter->second;
+    std::pair<std::map<const SubprogramInfo *, uint32>::iterator, bool>
+        inserted = stack_index.insert(
+            std::make_pair(subprog, stack_subprograms_.size()));
+    if (inserted.second) {
+      AddInlineStack(subprog);
+    }
+    interval_starts_.push_back(iter->first.first);
+    interval_ends_.push_back(iter->first.second);
+    interval_stacks_.push_back(inserted.first->second);
+  }
+  stack_begins_.push_back(inline_frames_.size());
+
   // Clear this vector to save some memory
   subprogram_insert_order_.clear();
   if (overlap_count_ > 0) {
@@ -680,6 +755,57 @@ void InlineStackHandler::PopulateSubprogramsByAddress() {
   }
 }
 
+void InlineStackHandler::MergeFrom(InlineStackHandler *other) {
+  CHECK(other->subprogram_stack_.empty());
+  // Subprograms of a compilation unit without DW_AT_comp_dir pick up
+  // the directory of the previous unit when read serially.
+  const char *inherited_comp_dir = NULL;
+  if (other->compilation_unit_comp_dir_.empty() &&
+      !compilation_unit_comp_dir_.empty()) {
+    inherited_comp_dir = compilation_unit_comp_dir_.back()->c_str();
+  }
+
+  for (int i = 0; i < other->subprograms_by_offset_maps_.size(); ++i) {
+    // The binary's own map is shared; every DWO gets a map of its own.
+    int input_file_index;
+    if (i == 0 && !subprograms_by_offset_maps_.empty()) {
+      input_file_index = 0;
+    } else {
+      input_file_index = subprograms_by_offset_maps_.size();
+      subprograms_by_offset_maps_.push_back(new SubprogramsByOffsetMap);
+    }
+    SubprogramsByOffsetMap *subprograms_by_offset =
+        subprograms_by_offset_maps_[input_file_index];
+    SubprogramsByOffsetMap *other_subprograms_by_offset =
+        other->subprograms_by_offset_maps_[i];
+    for (const auto &offset_subprogram : *other_subprograms_by_offset) {
+      SubprogramInfo *subprog = offset_subprogram.second;
+      subprog->set_input_file_index(input_file_index);
+      if (inherited_comp_dir != NULL && subprog->comp_directory() == NULL) {
+        subprog->set_comp_directory(inherited_comp_dir);
+      }
+      subprograms_by_offset->insert(offset_subprogram);
+    }
+    delete other_subprograms_by_offset;
+  }
+  if (input_file_index_ == -1 && !subprograms_by_offset_maps_.empty()) {
+    input_file_index_ = 0;
+  }
+  other->subprograms_by_offset_maps_.clear();
+  other->input_file_index_ = -1;
+
+  subprogram_insert_order_.insert(subprogram_insert_order_.end(),
+                                  other->subprogram_insert_order_.begin(),
+                                  other->subprogram_insert_order_.end());
+  other->subprogram_insert_order_.clear();
+  compilation_unit_comp_dir_.insert(compilation_unit_comp_dir_.end(),
+                                    other->compilation_unit_comp_dir_.begin(),
+                                    other->compilation_unit_comp_dir_.end());
+  other->compilation_unit_comp_dir_.clear();
+  overlap_count_ += other->overlap_count_;
+  other->overlap_count_ = 0;
+}
+
 AddressRangeList::RangeList InlineStackHandler::SortAndMerge(
     AddressRangeList::RangeList rangelist) {
   AddressRangeList::RangeList merged;
@@ -700,55 +826,138 @@ AddressRangeList::RangeList InlineStackHandler::SortAndMerge(
   return merged;
 }
 
+void InlineStackHandler::AddInlineStack(const SubprogramInfo *subprog) {
+  stack_begins_.push_back(inline_frames_.size());
+  stack_subprograms_.push_back(subprog);
+
+  const SubprogramInfo *declaration = GetDeclaration(subprog);
+  InlineFrame frame = {declaration->name().c_str(), NULL, NULL,
+                       GetAbstractOrigin(subprog)->callsite_line(), 0, 0};
+  if (frame.start_line == 0)
+    frame.start_line = declaration->callsite_line();
+  inline_frames_.push_back(frame);
+
+  while (subprog->inlined()) {
+    CHECK(subprog->parent() != NULL);
+    const SubprogramInfo *canonical_parent =
+        GetDeclaration(subprog->parent());
+    InlineFrame caller = {
+        canonical_parent->name().c_str(),
+        subprog->callsite_directory(),
+        subprog->callsite_filename(),
+        GetAbstractOrigin(subprog->parent())->callsite_line(),
+        subprog->callsite_line(),
+        subprog->callsite_discr()};
+    if (caller.start_line == 0)
+      caller.start_line = canonical_parent->callsite_line();
+    if (caller.start_line == 0)
+      caller.start_line = subprog->callsite_line();
+    inline_frames_.push_back(caller);
+    subprog = subprog->parent();
+  }
+}
+
+int InlineStackHandler::FindInterval(uint64 address) const {
+  std::vector<uint64>::const_iterator iter = std::upper_bound(
+      interval_starts_.begin(), interval_starts_.end(), address);
+  if (iter == interval_starts_.begin())
+    return -1;
+  const int interval = iter - interval_starts_.begin() - 1;
+  if (address >= interval_ends_[interval])
+    return -1;
+  return interval;
+}
+
 const SubprogramInfo *InlineStackHandler::GetSubprogramForAddress(
-    uint64 address) {
-  NonOverlappingRangeMap<SubprogramInfo*>::ConstIterator iter =
-      subprograms_by_address_.Find(address);
-  if (iter != subprograms_by_address_.End())
-    return iter->second;
-  else
+    uint64 address) const {
+  const int interval = FindInterval(address);
+  if (interval < 0)
+    return NULL;
+  return stack_subprograms_[interval_stacks_[interval]];
+}
+
+const InlineStackHandler::InlineFrame *InlineStackHandler::GetInlineStack(
+    uint64 address, int *num_frames) const {
+  const int interval = FindInterval(address);
+  if (interval < 0) {
+    *num_frames = 0;
+    return NULL;
+  }
+  const uint32 stack = interval_stacks_[interval];
+  *num_frames = stack_begins_[stack + 1] - stack_begins_[stack];
+  return &inline_frames_[stack_begins_[stack]];
+}
+
+const SubprogramInfo *InlineStackHandler::FindSubprogram(
+    int input_file_index, uint64 offset) const {
+  CHECK(input_file_index < subprograms_by_offset_maps_.size());
+  const SubprogramsByOffsetMap *subprograms_by_offset =
+      subprograms_by_offset_maps_[input_file_index];
+  SubprogramsByOffsetMap::const_iterator iter =
+      subprograms_by_offset->find(offset);
+  if (iter == subprograms_by_offset->end())
     return NULL;
+  return iter->second;
 }
 
 const SubprogramInfo *InlineStackHandler::GetDeclaration(
     const SubprogramInfo *subprog) const {
   const int input_file_index = subprog->input_file_index();
   const SubprogramInfo *declaration = subprog;
-  CHECK(input_file_index < subprograms_by_offset_maps_.size());
-  SubprogramsByOffsetMap* subprograms_by_offset =
-      subprograms_by_offset_maps_[input_file_index];
   while (declaration->name().empty() || declaration->callsite_line() == 0) {
-    uint64 specification = declaration->specification();
-    if (specification) {
-      declaration = subprograms_by_offset->find(specification)->second;
-    } else {
-      uint64 abstract_origin = declaration->abstract_origin();
-      if (abstract_origin)
-        declaration = subprograms_by_offset->find(abstract_origin)->second;
-      else
-        break;
-    }
+    uint64 reference = declaration->specification();
+    if (!reference)
+      reference = declaration->abstract_origin();
+    if (!reference)
+      break;
+    // Stop at references to subprograms that were not read.
+    const SubprogramInfo *next = FindSubprogram(input_file_index, reference);
+    if (next == NULL)
+      break;
+    declaration = next;
   }
   return declaration;
 }
 
 const SubprogramInfo *InlineStackHandler::GetAbstractOrigin(
     const SubprogramInfo *subprog) const {
-  const int input_file_index = subprog->input_file_index();
-  CHECK(input_file_index < subprograms_by_offset_maps_.size());
-  SubprogramsByOffsetMap* subprograms_by_offset =
-      subprograms_by_offset_maps_[input_file_index];
-  if (subprog->abstract_origin())
-    return subprograms_by_offset->find(subprog->abstract_origin())->second;
-  else
-    return subprog;
+  if (subprog->abstract_origin()) {
+    const SubprogramInfo *origin = FindSubprogram(
+        subprog->input_file_index(), subprog->abstract_origin());
+    if (origin != NULL)
+      return origin;
+  }
+  return subprog;
 }
 
 void InlineStackHandler::GetSubprogramAddresses(std::set<uint64> *addrs) {
-  for (auto it = subprograms_by_address_.Begin();
-       it != subprograms_by_address_.End(); ++it) {
-    addrs->insert(it->first.first);
+  addrs->insert(interval_starts_.begin(), interval_starts_.end());
+}
+
+uint64 InlineStackHandler::MemoryUsage() const {
+  // A std::map node holds three pointers and a color besides the value.
+  const uint64 kMapNodeBytes =
+      sizeof(SubprogramsByOffsetMap::value_type) + 4 * sizeof(void *);
+  uint64 bytes = sizeof(*this) +
+      subprogram_insert_order_.capacity() * sizeof(SubprogramInfo *) +
+      interval_starts_.capacity() * sizeof(uint64) +
+      interval_ends_.capacity() * sizeof(uint64) +
+      interval_stacks_.capacity() * sizeof(uint32) +
+      stack_begins_.capacity() * sizeof(uint32) +
+      stack_subprograms_.capacity() * sizeof(const SubprogramInfo *) +
+      inline_frames_.capacity() * sizeof(InlineFrame);
+  for (const SubprogramsByOffsetMap *map : subprograms_by_offset_maps_) {
+    bytes += sizeof(*map) + map->size() * kMapNodeBytes;
+    for (const auto &offset_subprog : *map) {
+      const SubprogramInfo *subprog = offset_subprog.second;
+      bytes += sizeof(*subprog) + subprog->name().capacity() +
+               subprog->address_ranges()->capacity() *
+                   sizeof(AddressRangeList::Range);
+    }
   }
+  for (const string *comp_dir : compilation_unit_comp_dir_)
+    bytes += sizeof(*comp_dir) + comp_dir->capacity();
+  return bytes;
 }
 
 InlineStackHandler::~InlineStackHandler() {
@@ -25,6 +25,7 @@
 #include "symbolize/dwarf2reader.h"
 #include "symbolize/dwarf3ranges.h"
 #include "symbolize/nonoverlapping_range_map.h"
+#include "symbolize/sampled_functions.h"
 
 namespace devtools_crosstool_autofdo {
 
@@ -59,6 +60,7 @@ class SubprogramInfo {
         used_(false) { }
 
   const int input_file_index() const { return input_file_index_; }
+  void set_input_file_index(int index) { input_file_index_ = index; }
 
   const uint64 offset() const { return offset_; }
   const SubprogramInfo *parent() const { return parent_; }
@@ -153,6 +155,16 @@ class SubprogramInfo {
 // compilation unit.
 class InlineStackHandler: public Dwarf2Handler {
  public:
+  // One frame of the inline stack of a subprogram, see GetInlineStack.
+  struct InlineFrame {
+    const char *function_name;
+    const char *callsite_directory;
+    const char *callsite_filename;
+    uint32 start_line;
+    uint32 callsite_line;
+    uint32 callsite_discr;
+  };
+
   InlineStackHandler(
       AddressRangeList *address_ranges,
       const SectionMap& sections,
@@ -167,7 +179,7 @@ class InlineStackHandler: public Dwarf2Handler {
       AddressRangeList *address_ranges,
       const SectionMap& sections,
       ByteReader *reader,
-      const std::map<uint64_t, uint64_t> *sampled_functions,
+      const SampledFunctions *sampled_functions,
       uint64 vaddr_of_first_load_segment)
       : directory_names_(NULL), file_names_(NULL), line_handler_(NULL),
         sections_(sections), reader_(reader),
@@ -193,6 +205,8 @@ class InlineStackHandler: public Dwarf2Handler {
   virtual bool StartDIE(uint64 offset, enum DwarfTag tag,
                         const AttributeList& attrs);
 
+  bool SkipChildrenOfDIE(enum DwarfTag tag) override;
+
   virtual void EndDIE(uint64 offset);
 
   virtual void ProcessAttributeString(uint64 offset,
@@ -227,7 +241,15 @@ class InlineStackHandler: public Dwarf2Handler {
     address_ranges_ = address_ranges;
   }
 
-  const SubprogramInfo *GetSubprogramForAddress(uint64 address);
+  const SubprogramInfo *GetSubprogramForAddress(uint64 address) const;
+
+  // Returns the inline stack of the innermost subprogram that contains
+  // address, and sets *num_frames to its length, or returns NULL if
+  // there is none. The first frame has the name and start line of that
+  // subprogram and no callsite; every other frame is a caller, with the
+  // callsite of the call into the frame before it.  The stacks are
+  // built by PopulateSubprogramsByAddress.
+  const InlineFrame *GetInlineStack(uint64 address, int *num_frames) const;
 
   const SubprogramInfo *GetDeclaration(const SubprogramInfo *subprog) const;
 
@@ -239,8 +261,21 @@ class InlineStackHandler: public Dwarf2Handler {
   // Cleans up memory consumed by subprograms that are not used.
   void CleanupUnusedSubprograms();
 
+  // Puts the .debug_info offsets that used subprograms refer to, directly
+  // or through other subprograms, but that have not been read into the set.
+  void GetUnresolvedReferences(std::set<uint64> *offsets) const;
+
   void PopulateSubprogramsByAddress();
 
+  // Takes ownership of the subprograms collected by other, which must
+  // have read the compilation units that follow the ones read by this
+  // handler. Must be called before PopulateSubprogramsByAddress.
+  void MergeFrom(InlineStackHandler *other);
+
+  // Returns an estimate of the bytes held by the subprograms and the inline
+  // stacks.
+  uint64 MemoryUsage() const;
+
   ~InlineStackHandler();
 
  private:
@@ -254,6 +289,16 @@ class InlineStackHandler: public Dwarf2Handler {
   AddressRangeList::RangeList SortAndMerge(
       AddressRangeList::RangeList rangelist);
 
+  // Returns the subprogram at offset in the given input file, or NULL.
+  const SubprogramInfo *FindSubprogram(int input_file_index,
+                                       uint64 offset) const;
+
+  // Appends the inline stack of subprog to inline_frames_.
+  void AddInlineStack(const SubprogramInfo *subprog);
+
+  // Returns the index of the interval that contains address, or -1.
+  int FindInterval(uint64 address) const;
+
   const DirectoryVector *directory_names_;
   const FileVector *file_names_;
   LineInfoHandler *line_handler_;
@@ -269,7 +314,17 @@ class InlineStackHandler: public Dwarf2Handler {
   int input_file_index_;
   std::vector<SubprogramsByOffsetMap*> subprograms_by_offset_maps_;
   std::vector<SubprogramInfo *> subprogram_insert_order_;
-  NonOverlappingRangeMap<SubprogramInfo*> subprograms_by_address_;
+  // The subprograms flattened into non-overlapping intervals, in which
+  // every address belongs to its innermost subprogram. Interval i is
+  // [interval_starts_[i], interval_ends_[i]) and has the inline stack
+  // interval_stacks_[i]. Stack s is the frames from stack_begins_[s] to
+  // stack_begins_[s + 1] in inline_frames_, for stack_subprograms_[s].
+  std::vector<uint64> interval_starts_;
+  std::vector<uint64> interval_ends_;
+  std::vector<uint32> interval_stacks_;
+  std::vector<uint32> stack_begins_;
+  std::vector<const SubprogramInfo *> stack_subprograms_;
+  std::vector<InlineFrame> inline_frames_;
   uint64 compilation_unit_offset_;
   uint64 compilation_unit_base_;
   // The comp dir name may come from a .dwo file's string table, which
@@ -278,7 +333,7 @@ class InlineStackHandler: public Dwarf2Handler {
   // directories that we've seen, because SubprogramInfo keeps
   // StringPiece objects pointing to these copies.
   std::vector<string*> compilation_unit_comp_dir_;
-  const std::map<uint64_t, uint64_t> *sampled_functions_;
+  const SampledFunctions *sampled_functions_;
   int overlap_count_;
   bool have_two_level_line_tables_;
   bool subprogram_added_by_cu_;
@@ -16,6 +16,11 @@
 #define AUTOFDO_SYMBOLIZE_BYTEREADER_INL_H__
 
 #include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#if defined(__BMI2__)
+#include <immintrin.h>
+#endif
 
 #include "base/common.h"
 #include "symbolize/bytereader.h"
@@ -83,7 +88,16 @@ inline uint64 ByteReader::ReadEightBytes(const char* buffer) const {
 
 inline uint64 ByteReader::ReadUnsignedLEB128(const char* buffer,
                                              size_t* len) const {
-  uint64 result = 0;
+  // Most numbers, e.g. abbreviation codes and forms, fit in one byte.
+  if (!(buffer[0] & 0x80)) {
+    *len = 1;
+    return static_cast<unsigned char>(buffer[0]);
+  }
+  uint64 result;
+  if (ReadLEB128Word(buffer, len, &result))
+    return result;
+
+  result = 0;
   size_t num_read = 0;
   unsigned int shift = 0;
   unsigned char byte;
@@ -92,7 +106,8 @@ inline uint64 ByteReader::ReadUnsignedLEB128(const char* buffer,
     byte = *buffer++;
     num_read++;
 
-    result |= (static_cast<uint64>(byte & 0x7f)) << shift;
+    if (shift < 64)
+      result |= (static_cast<uint64>(byte & 0x7f)) << shift;
 
     shift += 7;
   } while (byte & 0x80);
@@ -107,6 +122,17 @@ inline uint64 ByteReader::ReadUnsignedLEB128(const char* buffer,
 
 inline int64 ByteReader::ReadSignedLEB128(const char* buffer,
                                           size_t* len) const {
+  if (!(buffer[0] & 0x80)) {
+    *len = 1;
+    // Sign-extend the 7 bits of the byte.
+    return static_cast<int64>(static_cast<uint64>(buffer[0]) << 57) >> 57;
+  }
+  uint64 bits;
+  if (ReadLEB128Word(buffer, len, &bits)) {
+    const int shift = 64 - 7 * *len;
+    return static_cast<int64>(bits << shift) >> shift;
+  }
+
   int64 result = 0;
   int shift = 0;
   size_t num_read = 0;
@@ -115,7 +141,8 @@ inline int64 ByteReader::ReadSignedLEB128(const char* buffer,
   do {
       byte = *buffer++;
       num_read++;
-      result |= (static_cast<uint64>(byte & 0x7f) << shift);
+      if (shift < 64)
+        result |= (static_cast<uint64>(byte & 0x7f) << shift);
       shift += 7;
   } while (byte & 0x80);
 
@@ -125,6 +152,58 @@ inline int64 ByteReader::ReadSignedLEB128(const char* buffer,
   return result;
 }
 
+inline size_t ByteReader::ReadUnsignedLEB128s(const char* buffer, int count,
+                                              uint64* values) const {
+  size_t total = 0;
+  for (int i = 0; i < count; i++) {
+    size_t len;
+    values[i] = ReadUnsignedLEB128(buffer + total, &len);
+    total += len;
+  }
+  return total;
+}
+
+inline bool ByteReader::ReadLEB128Word(const char* buffer, size_t* len,
+                                       uint64* bits) {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__ && \
+    !defined(ADDRESS_SANITIZER) && !defined(__SANITIZE_ADDRESS__)
+  // The 8 bytes may extend past the end of the buffer, so only load them
+  // if they lie in the same page as the first byte, which can always be
+  // read.
+  const size_t kPageSize = 4096;
+  if ((reinterpret_cast<uintptr_t>(buffer) & (kPageSize - 1)) >
+      kPageSize - 8)
+    return false;
+  uint64 word;
+  memcpy(&word, buffer, sizeof(word));
+  // The number ends at the first byte whose high bit is clear.
+  const uint64 ends = ~word & 0x8080808080808080ULL;
+  if (ends == 0)
+    return false;
+  const int num_bytes = (__builtin_ctzll(ends) >> 3) + 1;
+  if (num_bytes < 8)
+    word &= (1ULL << (8 * num_bytes)) - 1;
+#if defined(__BMI2__)
+  *bits = _pext_u64(word, 0x7f7f7f7f7f7f7f7fULL);
+#else
+  // Pack the 7 bit groups of adjacent bytes, then of adjacent pairs, and
+  // then of adjacent quads.
+  word &= 0x7f7f7f7f7f7f7f7fULL;
+  word = (word & 0x007f007f007f007fULL) |
+         ((word & 0x7f007f007f007f00ULL) >> 1);
+  word = (word & 0x00003fff00003fffULL) |
+         ((word & 0x3fff00003fff0000ULL) >> 2);
+  word = (word & 0x000000000fffffffULL) |
+         ((word & 0x0fffffff00000000ULL) >> 4);
+  *bits = word;
+#endif
+  *len = num_bytes;
+  return true;
+#else
+  return false;
+#endif
+}
+
 inline uint64 ByteReader::ReadOffset(const char* buffer) const {
   CHECK(this->offset_reader_);
   return (this->*offset_reader_)(buffer);
@@ -86,6 +86,11 @@ class ByteReader {
   // signed 64 bit integer.  LEN is set to the length read.
   int64 ReadSignedLEB128(const char* buffer, size_t* len) const;
 
+  // Read COUNT consecutive unsigned LEB128 numbers from BUFFER into
+  // VALUES, and return the total length read.
+  size_t ReadUnsignedLEB128s(const char* buffer, int count,
+                             uint64* values) const;
+
   // Read an offset from BUFFER and return it as an unsigned 64 bit
   // integer.  DWARF2/3 define offsets as either 4 or 8 bytes,
   // generally depending on the amount of DWARF2/3 info present.
@@ -102,6 +107,12 @@ class ByteReader {
   uint64 ReadInitialLength(const char* start, size_t* len);
 
  private:
+  // Decodes a LEB128 number of at most 8 bytes at BUFFER by loading the
+  // bytes as one word. Sets BITS to the 7 * LEN bits of payload and LEN
+  // to the length read. Returns false if the number is longer, or the
+  // word cannot be loaded safely.
+  static bool ReadLEB128Word(const char* buffer, size_t* len, uint64* bits);
+
   // Function pointer type for our address and offset readers.
   typedef uint64 (ByteReader::*AddressReader)(const char*) const;
 
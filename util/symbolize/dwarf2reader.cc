@@ -38,30 +38,28 @@ CompilationUnit::CompilationUnit(const string& path,
                                  ByteReader* reader, Dwarf2Handler* handler)
     : path_(path), offset_from_section_start_(offset), reader_(reader),
       sections_(sections), handler_(handler), abbrevs_(NULL),
+      abbrev_cache_(NULL),
       string_buffer_(NULL), string_buffer_length_(0),
       str_offsets_buffer_(NULL), str_offsets_buffer_length_(0),
       addr_buffer_(NULL), addr_buffer_length_(0),
       is_split_dwarf_(false), dwo_name_(),
-      skeleton_dwo_id_(0), have_checked_for_dwp_(false), dwp_path_(),
-      dwp_byte_reader_(NULL), dwp_reader_(NULL), malformed_(false) {}
+      skeleton_dwo_id_(0), dwp_path_(), dwp_file_(NULL),
+      malformed_(false) {}
 
 CompilationUnit::CompilationUnit(const string& path, const string& dwp_path,
                                  const SectionMap& sections, uint64 offset,
                                  ByteReader* reader, Dwarf2Handler* handler)
     : path_(path), offset_from_section_start_(offset), reader_(reader),
-      sections_(sections), handler_(handler), abbrevs_(),
+      sections_(sections), handler_(handler), abbrevs_(NULL),
+      abbrev_cache_(NULL),
       string_buffer_(NULL), string_buffer_length_(0),
       str_offsets_buffer_(NULL), str_offsets_buffer_length_(0),
       addr_buffer_(NULL), addr_buffer_length_(0),
       is_split_dwarf_(false), dwo_name_(),
-      skeleton_dwo_id_(0), have_checked_for_dwp_(false), dwp_path_(dwp_path),
-      dwp_byte_reader_(NULL), dwp_reader_(NULL), malformed_(false) {}
+      skeleton_dwo_id_(0), dwp_path_(dwp_path), dwp_file_(NULL),
+      malformed_(false) {}
 
-CompilationUnit::~CompilationUnit() {
-  if (abbrevs_) delete abbrevs_;
-  if (dwp_reader_) delete dwp_reader_;
-  if (dwp_byte_reader_) delete dwp_byte_reader_;
-}
+CompilationUnit::~CompilationUnit() {}
 
 // Initialize a compilation unit from a .dwo or .dwp file.
 // In this case, we need the .debug_addr section from the
@@ -87,31 +85,20 @@ void CompilationUnit::SetSplitDwarf(const char* addr_buffer,
 // zero for the form.  The entire abbreviation section is terminated
 // by a zero for the code.
 
-void CompilationUnit::ReadAbbrevs() {
-  if (abbrevs_)
-    return;
-
-  // First get the debug_abbrev section
-  SectionMap::const_iterator iter = sections_.find(".debug_abbrev");
-  CHECK(iter != sections_.end());
-
-  if (abbrevs_) {
-    delete abbrevs_;
-  }
-  abbrevs_ = new vector<Abbrev>;
-  abbrevs_->resize(1);
+AbbrevTable::AbbrevTable(const char* data, uint64 length,
+                         ByteReader* reader) {
+  abbrevs_.resize(1);
 
   // The only way to CHECK whether we are reading over the end of the
   // buffer would be to first compute the size of the leb128 data by
   // reading it, then go back and read it again.
-  const char* abbrev_start = iter->second.first +
-                                      header_.abbrev_offset;
+  const char* abbrev_start = data;
   const char* abbrevptr = abbrev_start;
-  const uint64 abbrev_length = iter->second.second - header_.abbrev_offset;
+  const uint64 abbrev_length = length;
   while (1) {
-    CompilationUnit::Abbrev abbrev;
+    Abbrev abbrev;
     size_t len;
-    const uint32 number = reader_->ReadUnsignedLEB128(abbrevptr, &len);
+    const uint32 number = reader->ReadUnsignedLEB128(abbrevptr, &len);
 
     if (number == 0)
       break;
@@ -119,22 +106,28 @@ void CompilationUnit::ReadAbbrevs() {
     abbrevptr += len;
 
     DCHECK(abbrevptr < abbrev_start + abbrev_length);
-    const uint32 tag = reader_->ReadUnsignedLEB128(abbrevptr, &len);
+    const uint32 tag = reader->ReadUnsignedLEB128(abbrevptr, &len);
     abbrevptr += len;
     abbrev.tag = static_cast<enum DwarfTag>(tag);
 
     DCHECK(abbrevptr < abbrev_start + abbrev_length);
-    abbrev.has_children = reader_->ReadOneByte(abbrevptr);
+    abbrev.has_children = reader->ReadOneByte(abbrevptr);
     abbrevptr += 1;
 
     DCHECK(abbrevptr < abbrev_start + abbrev_length);
 
+    abbrev.first_attribute = attribute_specs_.size();
+    abbrev.has_fixed_size = true;
+    abbrev.fixed_size = 0;
+    abbrev.num_address_forms = 0;
+    abbrev.num_offset_forms = 0;
+    abbrev.sibling_attribute = -1;
     while (1) {
-      const uint32 nametemp = reader_->ReadUnsignedLEB128(abbrevptr, &len);
+      const uint32 nametemp = reader->ReadUnsignedLEB128(abbrevptr, &len);
       abbrevptr += len;
 
       DCHECK(abbrevptr < abbrev_start + abbrev_length);
-      const uint32 formtemp = reader_->ReadUnsignedLEB128(abbrevptr, &len);
+      const uint32 formtemp = reader->ReadUnsignedLEB128(abbrevptr, &len);
       abbrevptr += len;
       if (nametemp == 0 && formtemp == 0)
         break;
@@ -145,7 +138,7 @@ void CompilationUnit::ReadAbbrevs() {
       uint32 value = 0;
       if (form == DW_FORM_implicit_const) {
           DCHECK(abbrevptr < abbrev_start + abbrev_length);
-          value = reader_->ReadUnsignedLEB128(abbrevptr, &len);
+          value = reader->ReadUnsignedLEB128(abbrevptr, &len);
           abbrevptr += len;
       }
 
@@ -154,24 +147,179 @@ void CompilationUnit::ReadAbbrevs() {
       spec.form = form;
       spec.value = value;
 
-      abbrev.attributes.push_back(spec);
+      if (name == DW_AT_sibling &&
+          (form == DW_FORM_ref1 || form == DW_FORM_ref2 ||
+           form == DW_FORM_ref4 || form == DW_FORM_ref8 ||
+           form == DW_FORM_ref_udata)) {
+        abbrev.sibling_attribute =
+            attribute_specs_.size() - abbrev.first_attribute;
+      }
+      AddFormSize(form, &abbrev);
+      attribute_specs_.push_back(spec);
     }
-    CHECK(abbrev.number == abbrevs_->size());
-    abbrevs_->push_back(abbrev);
+    abbrev.end_attribute = attribute_specs_.size();
+    CHECK(abbrev.number == abbrevs_.size());
+    abbrevs_.push_back(abbrev);
+  }
+}
+
+void AbbrevTable::AddFormSize(enum DwarfForm form, Abbrev* abbrev) {
+  switch (form) {
+    case DW_FORM_implicit_const:
+    case DW_FORM_flag_present:
+      break;
+    case DW_FORM_data1:
+    case DW_FORM_flag:
+    case DW_FORM_ref1:
+    case DW_FORM_strx1:
+    case DW_FORM_addrx1:
+      abbrev->fixed_size += 1;
+      break;
+    case DW_FORM_ref2:
+    case DW_FORM_data2:
+    case DW_FORM_strx2:
+    case DW_FORM_addrx2:
+      abbrev->fixed_size += 2;
+      break;
+    case DW_FORM_strx3:
+    case DW_FORM_addrx3:
+      abbrev->fixed_size += 3;
+      break;
+    case DW_FORM_ref4:
+    case DW_FORM_data4:
+    case DW_FORM_strx4:
+    case DW_FORM_addrx4:
+    case DW_FORM_ref_sup4:
+      abbrev->fixed_size += 4;
+      break;
+    case DW_FORM_ref8:
+    case DW_FORM_ref_sig8:
+    case DW_FORM_data8:
+    case DW_FORM_ref_sup8:
+      abbrev->fixed_size += 8;
+      break;
+    case DW_FORM_data16:
+      abbrev->fixed_size += 16;
+      break;
+    case DW_FORM_addr:
+      abbrev->num_address_forms++;
+      break;
+    case DW_FORM_strp:
+    case DW_FORM_strp_sup:
+    case DW_FORM_sec_offset:
+      abbrev->num_offset_forms++;
+      break;
+    default:
+      // Variable sizes, and DW_FORM_ref_addr, whose size depends on the
+      // version of the unit.
+      abbrev->has_fixed_size = false;
+      break;
+  }
+}
+
+const AbbrevTable* AbbrevTableCache::Get(const char* data, uint64 length,
+                                         ByteReader* reader) {
+  std::unique_ptr<AbbrevTable>& table = tables_[data];
+  if (table == NULL)
+    table.reset(new AbbrevTable(data, length, reader));
+  return table.get();
+}
+
+void CompilationUnit::ReadAbbrevs() {
+  if (abbrevs_)
+    return;
+
+  // First get the debug_abbrev section
+  SectionMap::const_iterator iter = sections_.find(".debug_abbrev");
+  CHECK(iter != sections_.end());
+
+  const char* abbrev_start = iter->second.first + header_.abbrev_offset;
+  const uint64 abbrev_length = iter->second.second - header_.abbrev_offset;
+  if (abbrev_cache_ != NULL) {
+    abbrevs_ = abbrev_cache_->Get(abbrev_start, abbrev_length, reader_);
+  } else {
+    owned_abbrevs_.reset(
+        new AbbrevTable(abbrev_start, abbrev_length, reader_));
+    abbrevs_ = owned_abbrevs_.get();
   }
 }
 
 // Skips a single DIE's attributes.
 const char* CompilationUnit::SkipDIE(const char* start,
                                               const Abbrev& abbrev) {
-  for (AttributeList::const_iterator i = abbrev.attributes.begin();
-       i != abbrev.attributes.end();
+  if (abbrev.has_fixed_size) {
+    return start + abbrev.fixed_size +
+           abbrev.num_address_forms * reader_->AddressSize() +
+           abbrev.num_offset_forms * reader_->OffsetSize();
+  }
+  const AttributeList attributes = abbrevs_->attributes(abbrev);
+  for (AttributeList::const_iterator i = attributes.begin();
+       i != attributes.end();
        i++)  {
     start = SkipAttribute(start, i->form);
   }
   return start;
 }
 
+// Skips a DIE and its children.
+const char* CompilationUnit::SkipDIESubtree(const char* start,
+                                            const Abbrev& abbrev) {
+  // The end of the unit, as in ProcessDIEs.
+  const char* end =
+      buffer_ + (reader_->OffsetSize() == 8 ? 12 : 4) + header_.length;
+  if (abbrev.sibling_attribute >= 0) {
+    const AttributeList attributes = abbrevs_->attributes(abbrev);
+    const char* ptr = start;
+    for (int32 i = 0; i < abbrev.sibling_attribute; i++)
+      ptr = SkipAttribute(ptr, attributes.begin()[i].form);
+    uint64 sibling;
+    size_t len;
+    switch (attributes.begin()[abbrev.sibling_attribute].form) {
+      case DW_FORM_ref1:
+        sibling = reader_->ReadOneByte(ptr);
+        break;
+      case DW_FORM_ref2:
+        sibling = reader_->ReadTwoBytes(ptr);
+        break;
+      case DW_FORM_ref4:
+        sibling = reader_->ReadFourBytes(ptr);
+        break;
+      case DW_FORM_ref8:
+        sibling = reader_->ReadEightBytes(ptr);
+        break;
+      default:
+        sibling = reader_->ReadUnsignedLEB128(ptr, &len);
+        break;
+    }
+    // The sibling is relative to the start of the unit. Only trust it if
+    // it lies after the attributes of the DIE.
+    if (sibling > static_cast<uint64>(ptr - buffer_) &&
+        sibling <= static_cast<uint64>(end - buffer_))
+      return buffer_ + sibling;
+  }
+
+  const char* ptr = SkipDIE(start, abbrev);
+  int depth = 1;
+  // Like ProcessDIEs, stop at the end of the unit even if some children
+  // lists are not terminated.
+  while (depth > 0 && ptr < end) {
+    size_t len;
+    const uint64 abbrev_num = reader_->ReadUnsignedLEB128(ptr, &len);
+    ptr += len;
+    if (abbrev_num == 0) {
+      depth--;
+      continue;
+    }
+    const Abbrev* child = abbrevs_->Find(abbrev_num);
+    if (child == NULL)
+      return NULL;
+    ptr = SkipDIE(ptr, *child);
+    if (child->has_children)
+      depth++;
+  }
+  return ptr;
+}
+
 // Skips a single attribute form's data.
 const char* CompilationUnit::SkipAttribute(const char* start, enum DwarfForm form) {
   size_t len;
@@ -461,10 +609,8 @@ bool CompilationUnit::ReadAbbrevOffset(const char** headerptr) {
 
 uint64 CompilationUnit::Start(uint64 offset) {
   // Reset all members except for construction parameters and *dwp*.
-  if (abbrevs_) {
-    delete abbrevs_;
-  }
   abbrevs_ = NULL;
+  owned_abbrevs_.reset();
 
   offset_from_section_start_ = offset;
 
@@ -850,8 +996,9 @@ void CompilationUnit::ProcessAttributeUnsigned(uint64 offset,
 const char* CompilationUnit::ProcessDIE(uint64 dieoffset,
                                         const char* start,
                                         const Abbrev& abbrev) {
-  for (AttributeList::const_iterator i = abbrev.attributes.begin();
-       i != abbrev.attributes.end();
+  const AttributeList attributes = abbrevs_->attributes(abbrev);
+  for (AttributeList::const_iterator i = attributes.begin();
+       i != attributes.end();
        i++)  {
       start = ProcessAttribute (
           dieoffset, start, i->name, i->form,
@@ -912,10 +1059,25 @@ void CompilationUnit::ProcessDIEs() {
       continue;
     }
 
-    const Abbrev& abbrev = abbrevs_->at(abbrev_num);
+    const Abbrev* abbrev_ptr = abbrevs_->Find(abbrev_num);
+    if (abbrev_ptr == NULL) {
+      malformed_ = true;
+      break;
+    }
+    const Abbrev& abbrev = *abbrev_ptr;
     const enum DwarfTag tag = abbrev.tag;
 
-    if (!handler_->StartDIE(absolute_offset, tag, abbrev.attributes)) {
+    if (!handler_->StartDIE(absolute_offset, tag,
+                            abbrevs_->attributes(abbrev))) {
+      if (abbrev.has_children && handler_->SkipChildrenOfDIE(tag)) {
+        dieptr = SkipDIESubtree(dieptr, abbrev);
+        if (dieptr == NULL) {
+          malformed_ = true;
+          break;
+        }
+        handler_->EndDIE(absolute_offset);
+        continue;
+      }
 
       dieptr = SkipDIE(dieptr, abbrev);
     } else {
@@ -947,41 +1109,33 @@ inline int GetElfWidth(const ElfReader& elf) {
 void CompilationUnit::ProcessSplitDwarf() {
   struct stat statbuf;
 
-  if (!have_checked_for_dwp_) {
-    have_checked_for_dwp_ = true;
+  if (dwp_file_ == NULL) {
     if (dwp_path_.empty()) {
       // Look for a .dwp file in the same directory as the executable.
       dwp_path_ = path_ + ".dwp";
     }
-    if (stat(dwp_path_.c_str(), &statbuf) == 0) {
-      ElfReader* elf = new ElfReader(dwp_path_);
-      int width = GetElfWidth(*elf);
-      if (width != 0) {
-        dwp_byte_reader_ = new ByteReader(ENDIANNESS_NATIVE);
-        dwp_byte_reader_->SetAddressSize(width);
-        dwp_reader_ = new DwpReader(*dwp_byte_reader_, elf);
-        dwp_reader_->Initialize();
-      } else {
-        LOG(WARNING) << "File '" << dwp_path_ << "' is not an ELF file.";
-        delete elf;
-      }
-    }
+    owned_dwp_file_.reset(new DwpFile(dwp_path_));
+    dwp_file_ = owned_dwp_file_.get();
   }
   bool found_in_dwp = false;
-  if (dwp_reader_ != NULL) {
-    // If we have a .dwp file, read the debug sections for the requested CU.
-    SectionMap sections;
-    dwp_reader_->ReadDebugSectionsForCU(header_.dwo_id, &sections);
-    if (!sections.empty()) {
-      found_in_dwp = true;
-      CompilationUnit dwp_comp_unit(dwp_path_, sections, 0,
-                                    dwp_byte_reader_, handler_);
-      dwp_comp_unit.SetSplitDwarf(addr_buffer_, addr_buffer_length_, header_.dwo_id);
-      dwp_comp_unit.Start();
-      if (dwp_comp_unit.malformed())
-        LOG(WARNING) << "File '" << dwp_path_ << "' has mangled "
-                     << ".debug_info.dwo section.";
-    }
+  // If we have a .dwp file, read the debug sections for the requested CU.
+  SectionMap dwp_sections;
+  int dwp_width;
+  const bool have_dwp = dwp_file_->ReadDebugSectionsForCU(
+      header_.dwo_id, &dwp_sections, &dwp_width);
+  if (!dwp_sections.empty()) {
+    found_in_dwp = true;
+    // The reader keeps the offset size of the unit, so every unit
+    // needs its own.
+    ByteReader dwp_byte_reader(ENDIANNESS_NATIVE);
+    dwp_byte_reader.SetAddressSize(dwp_width);
+    CompilationUnit dwp_comp_unit(dwp_file_->path(), dwp_sections, 0,
+                                  &dwp_byte_reader, handler_);
+    dwp_comp_unit.SetSplitDwarf(addr_buffer_, addr_buffer_length_, header_.dwo_id);
+    dwp_comp_unit.Start();
+    if (dwp_comp_unit.malformed())
+      LOG(WARNING) << "File '" << dwp_file_->path() << "' has mangled "
+                   << ".debug_info.dwo section.";
   }
   if (!found_in_dwp) {
     // If no .dwp file, try to open the .dwo file.
@@ -1026,7 +1180,7 @@ void CompilationUnit::ProcessSplitDwarf() {
       } else {
         LOG(WARNING) << "File '" << dwo_name_ << "' is not an ELF file.";
       }
-    } else if (dwp_reader_ == NULL) {
+    } else if (!have_dwp) {
       LOG(WARNING) << "Cannot open file '" << dwo_name_ << "'.";
     }
   }
@@ -1053,6 +1207,41 @@ void CompilationUnit::ReadDebugSectionsFromDwo(ElfReader* elf_reader,
   }
 }
 
+DwpFile::DwpFile(const string& path)
+    : path_(path), have_checked_(false), width_(0) {}
+
+DwpFile::~DwpFile() {}
+
+void DwpFile::Open() {
+  have_checked_ = true;
+  struct stat statbuf;
+  if (stat(path_.c_str(), &statbuf) != 0)
+    return;
+  ElfReader* elf = new ElfReader(path_);
+  width_ = GetElfWidth(*elf);
+  if (width_ == 0) {
+    LOG(WARNING) << "File '" << path_ << "' is not an ELF file.";
+    delete elf;
+    return;
+  }
+  byte_reader_.reset(new ByteReader(ENDIANNESS_NATIVE));
+  byte_reader_->SetAddressSize(width_);
+  reader_.reset(new DwpReader(*byte_reader_, elf));
+  reader_->Initialize();
+}
+
+bool DwpFile::ReadDebugSectionsForCU(uint64 dwo_id, SectionMap* sections,
+                                     int* width) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (!have_checked_)
+    Open();
+  if (reader_ == NULL)
+    return false;
+  reader_->ReadDebugSectionsForCU(dwo_id, sections);
+  *width = width_;
+  return true;
+}
+
 DwpReader::DwpReader(const ByteReader& byte_reader, ElfReader* elf_reader)
     : elf_reader_(elf_reader), byte_reader_(byte_reader),
       cu_index_(NULL), cu_index_size_(0), string_buffer_(NULL),
@@ -1563,22 +1752,14 @@ void LineInfo::ReadHeader() {
           return;
         }
 
-        uint64 dirindex = reader_->ReadUnsignedLEB128(lineptr, &len);
-        if (!AdvanceLinePtr(len, &lineptr)) {
-          return;
-        }
-
-        uint64 mod_time = reader_->ReadUnsignedLEB128(lineptr, &len);
+        // The directory index, modification time and file length.
+        uint64 values[3];
+        len = reader_->ReadUnsignedLEB128s(lineptr, 3, values);
         if (!AdvanceLinePtr(len, &lineptr)) {
           return;
         }
-
-        uint64 filelength = reader_->ReadUnsignedLEB128(lineptr, &len);
-        if (!AdvanceLinePtr(len, &lineptr)) {
-          return;
-        }
-        handler_->DefineFile(filename, fileindex, dirindex, mod_time,
-                             filelength);
+        handler_->DefineFile(filename, fileindex, values[0], values[1],
+                             values[2]);
         fileindex++;
       }
     }
@@ -2011,19 +2192,12 @@ bool LineInfo::ProcessOneOpcode(
           templen = strlen(filename) + 1;
           start += templen;
 
-          uint64 dirindex = reader->ReadUnsignedLEB128(start, &templen);
-          start += templen;
-
-          const uint64 mod_time = reader->ReadUnsignedLEB128(start,
-                                                             &templen);
-          start += templen;
-
-          const uint64 filelength = reader->ReadUnsignedLEB128(start,
-                                                               &templen);
-          start += templen;
+          // The directory index, modification time and file length.
+          uint64 values[3];
+          start += reader->ReadUnsignedLEB128s(start, 3, values);
           if (handler) {
-            handler->DefineFile(filename, -1, dirindex, mod_time,
-                                filelength);
+            handler->DefineFile(filename, -1, values[0], values[1],
+                                values[2]);
           }
         }
           break;
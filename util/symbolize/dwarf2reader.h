@@ -26,7 +26,7 @@
 #include <stddef.h>
 #include <stdint.h>
 #include <map>
-#include <list>
+#include <mutex>
 #include <string>
 #include <utility>
 #include <vector>
@@ -42,6 +42,7 @@ class ByteReader;
 class Dwarf2Handler;
 class LineInfoHandler;
 class DwpReader;
+class DwpFile;
 
 
 struct AttributeSpec {
@@ -55,8 +56,26 @@ struct AttributeSpec {
 // This maps from a string naming a section to a pair containing a
 // the data for the section, and the size of the section.
 typedef map<string, pair<const char*, uint64> > SectionMap;
-typedef std::list<AttributeSpec> AttributeList;
-typedef AttributeList::iterator AttributeIterator;
+
+// The attribute specs of an abbreviation. They are stored contiguously in
+// the abbreviation table, and the list only refers to them.
+class AttributeList {
+ public:
+  typedef const AttributeSpec* const_iterator;
+
+  AttributeList(const AttributeSpec* begin, const AttributeSpec* end)
+      : begin_(begin), end_(end) {}
+
+  const_iterator begin() const { return begin_; }
+  const_iterator end() const { return end_; }
+  size_t size() const { return end_ - begin_; }
+  bool empty() const { return begin_ == end_; }
+
+ private:
+  const AttributeSpec* begin_;
+  const AttributeSpec* end_;
+};
+typedef AttributeList::const_iterator AttributeIterator;
 typedef AttributeList::const_iterator ConstAttributeIterator;
 
 // A vector containing directory names
@@ -378,6 +397,12 @@ class Dwarf2Handler {
   virtual bool StartDIE(uint64 offset, enum DwarfTag tag,
                         const AttributeList& attrs) { return false; }
 
+  // Called when StartDIE declined a DIE with TAG that has children.
+  // Return true if the children are of no interest either: the whole
+  // subtree is then skipped without calling the handler, except for the
+  // EndDIE of the declined DIE.
+  virtual bool SkipChildrenOfDIE(enum DwarfTag tag) { return false; }
+
   // Called when we have an attribute with unsigned data to give to
   // our handler.  The attribute is for the DIE at OFFSET from the
   // beginning of compilation unit, has a name of ATTR, a form of
@@ -467,6 +492,76 @@ class Dwarf2Handler {
 // requires reading of the .debug_abbrev section to say what the data
 // means.
 
+// The DWARF2/3 abbreviations of one compilation unit, as decoded from
+// .debug_abbrev.
+class AbbrevTable {
+ public:
+  // This struct represents a single DWARF2/3 abbreviation
+  // The abbreviation tells how to read a DWARF2/3 DIE, and consist of a
+  // tag and a list of attributes, as well as the data form of each attribute.
+  struct Abbrev {
+    uint32 number;
+    enum DwarfTag tag;
+    bool has_children;
+    // The attributes are attribute_specs_[first_attribute, end_attribute).
+    uint32 first_attribute;
+    uint32 end_attribute;
+    // Set if the size of every attribute is fixed once the address and
+    // offset sizes are known: the attributes then take fixed_size bytes,
+    // plus the address size for each of num_address_forms and the offset
+    // size for each of num_offset_forms.
+    bool has_fixed_size;
+    uint32 fixed_size;
+    uint32 num_address_forms;
+    uint32 num_offset_forms;
+    // The index of the DW_AT_sibling attribute among the attributes, if it
+    // refers to the unit itself, or -1.
+    int32 sibling_attribute;
+  };
+
+  // Decodes the table at the start of DATA, which holds LENGTH bytes.
+  AbbrevTable(const char* data, uint64 length, ByteReader* reader);
+
+  // Returns the abbreviation with NUMBER, or NULL if there is none.
+  const Abbrev* Find(uint64 number) const {
+    return number != 0 && number < abbrevs_.size() ? &abbrevs_[number] : NULL;
+  }
+
+  AttributeList attributes(const Abbrev& abbrev) const {
+    return AttributeList(attribute_specs_.data() + abbrev.first_attribute,
+                         attribute_specs_.data() + abbrev.end_attribute);
+  }
+
+ private:
+  // Accounts for the size of an attribute of FORM in ABBREV.
+  static void AddFormSize(enum DwarfForm form, Abbrev* abbrev);
+
+  // Indexed by abbreviation number, which means that abbrevs_[0] is not
+  // valid.
+  std::vector<Abbrev> abbrevs_;
+  // The attributes of all abbreviations, in abbreviation order.
+  std::vector<AttributeSpec> attribute_specs_;
+
+  DISALLOW_COPY_AND_ASSIGN(AbbrevTable);
+};
+
+// Abbreviation tables shared by the compilation units that refer to the
+// same table, which is common after LTO. Tables are keyed by their address
+// in the section data, so the cache must not outlive the sections. Not
+// thread-safe.
+class AbbrevTableCache {
+ public:
+  AbbrevTableCache() {}
+
+  // Returns the table at DATA, decoding it on first use.
+  const AbbrevTable* Get(const char* data, uint64 length, ByteReader* reader);
+
+ private:
+  std::map<const char*, std::unique_ptr<AbbrevTable> > tables_;
+
+  DISALLOW_COPY_AND_ASSIGN(AbbrevTableCache);
+};
+
 // As a warning to the user, it should be noted that the reason for
 // using absolute offsets from the beginning of .debug_info is that
 // DWARF2/3 support referencing DIE's from other DIE's by their offset
@@ -504,6 +599,14 @@ class CompilationUnit {
 
   bool malformed() const {return malformed_;}
 
+  // Makes the unit take its abbreviation table from CACHE instead of
+  // decoding its own copy. CACHE must outlive the unit.
+  void set_abbrev_cache(AbbrevTableCache* cache) { abbrev_cache_ = cache; }
+
+  // Makes the unit read split DWARF from FILE instead of opening the
+  // .dwp file itself. FILE must outlive the unit.
+  void set_dwp_file(DwpFile* file) { dwp_file_ = file; }
+
   // Begin reading a Dwarf2 compilation unit, and calling the
   // callbacks in the Dwarf2Handler
   // Return the offset of the end of the compilation unit - the passed
@@ -516,15 +619,7 @@ class CompilationUnit {
   uint64 Start(uint64 offset);
 
  private:
-  // This struct represents a single DWARF2/3 abbreviation
-  // The abbreviation tells how to read a DWARF2/3 DIE, and consist of a
-  // tag and a list of attributes, as well as the data form of each attribute.
-  struct Abbrev {
-    uint32 number;
-    enum DwarfTag tag;
-    bool has_children;
-    AttributeList attributes;
-  };
+  typedef AbbrevTable::Abbrev Abbrev;
 
   // A DWARF2/3 compilation unit header.  This is not the same size as
   // in the actual file, as the one in the file may have a 32 bit or
@@ -635,6 +730,12 @@ class CompilationUnit {
   // START, and return the new place to position the stream to.
   const char* SkipDIE(const char* start, const Abbrev& abbrev);
 
+  // Skips the die with attributes specified in ABBREV starting at START
+  // together with all its children, and returns the position after them,
+  // or NULL if the children are malformed. Jumps to the DW_AT_sibling of
+  // the DIE if it has one.
+  const char* SkipDIESubtree(const char* start, const Abbrev& abbrev);
+
   // Skips the attribute starting at START, with FORM, and return the
   // new place to position the stream to.
   const char* SkipAttribute(const char* start, enum DwarfForm form);
@@ -669,10 +770,11 @@ class CompilationUnit {
   // The associated handler to call processing functions in
   Dwarf2Handler* handler_;
 
-  // Set of DWARF2/3 abbreviations for this compilation unit.  Indexed
-  // by abbreviation number, which means that abbrevs_[0] is not
-  // valid.
-  std::vector<Abbrev>* abbrevs_;
+  // Set of DWARF2/3 abbreviations for this compilation unit, either
+  // owned_abbrevs_ or a table of abbrev_cache_.
+  const AbbrevTable* abbrevs_;
+  std::unique_ptr<AbbrevTable> owned_abbrevs_;
+  AbbrevTableCache* abbrev_cache_;
 
   // String section buffer and length, if we have a string section.
   // This is here to avoid doing a section lookup for strings in
@@ -706,17 +808,13 @@ class CompilationUnit {
   // from the skeleton CU.
   uint64 skeleton_dwo_id_;
 
-  // True if we have already looked for a .dwp file.
-  bool have_checked_for_dwp_;
-
   // Path to the .dwp file.
   string dwp_path_;
 
-  // ByteReader for the DWP file.
-  ByteReader* dwp_byte_reader_;
-
-  // DWP reader.
-  DwpReader* dwp_reader_;
+  // The .dwp file, either shared through set_dwp_file or owned by this
+  // unit in owned_dwp_file_.
+  DwpFile* dwp_file_;
+  std::unique_ptr<DwpFile> owned_dwp_file_;
 
   bool malformed_;
   DISALLOW_EVIL_CONSTRUCTORS(CompilationUnit);
@@ -810,6 +908,45 @@ class DwpReader {
   size_t str_offsets_size_;
 };
 
+// A .dwp file, opened on first use, so that the compilation units of
+// a binary can share it instead of each opening it again. Its methods
+// may be called from several threads at once.
+class DwpFile {
+ public:
+  explicit DwpFile(const string& path);
+
+  ~DwpFile();
+
+  const string& path() const { return path_; }
+
+  // Reads the debug sections for the given dwo_id, and sets *width to
+  // the address size of the file. Returns false if there is no usable
+  // .dwp file, and leaves sections empty if the dwo_id is not in it.
+  bool ReadDebugSectionsForCU(uint64 dwo_id, SectionMap* sections,
+                              int* width);
+
+ private:
+  // Opens the file and reads its index, if it exists.
+  void Open();
+
+  const string path_;
+
+  // Guards everything below, and the DwpReader, whose ElfReader maps
+  // sections as they are requested.
+  std::mutex mutex_;
+
+  // True if we have already looked for the file.
+  bool have_checked_;
+
+  // The address size of the file.
+  int width_;
+
+  std::unique_ptr<ByteReader> byte_reader_;
+  std::unique_ptr<DwpReader> reader_;
+
+  DISALLOW_EVIL_CONSTRUCTORS(DwpFile);
+};
+
 }  // namespace devtools_crosstool_autofdo
 
 #endif  // AUTOFDO_SYMBOLIZE_DWARF2READER_H__
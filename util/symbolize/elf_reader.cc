@@ -47,15 +47,26 @@
 #include <fcntl.h>
 #include <elf.h>
 #include <string.h>
+#include <zlib.h>
+#if defined(HAVE_ZSTD)
+#include <zstd.h>
+#endif
 
 #include <algorithm>
 #include <map>
+#include <memory>
+#include <mutex>  // NOLINT(build/c++11)
 #include <string>
+#include <thread>  // NOLINT(build/c++11)
 #include <vector>
 
 #include "symbolize/elf_reader.h"
 #include "base/common.h"
 
+#ifndef ELFCOMPRESS_ZSTD
+#define ELFCOMPRESS_ZSTD 2
+#endif
+
 namespace {
 
 // The lowest bit of an ARM symbol value is used to indicate a Thumb address.
@@ -66,6 +77,34 @@ template <typename T>
 T AdjustARMThumbSymbolValue(const T& symbol_table_value) {
   return symbol_table_value & ~(1 << kARMThumbBitOffset);
 }
+
+// Decompresses the zlib stream of size bytes at data into the
+// output_size bytes at output. Returns false if the stream is corrupt
+// or does not decompress to exactly output_size bytes.
+bool ZlibDecompress(const char *data, size_t size, char *output,
+                    size_t output_size) {
+  uLongf length = output_size;
+  return uncompress(reinterpret_cast<Bytef *>(output), &length,
+                    reinterpret_cast<const Bytef *>(data), size) == Z_OK &&
+         length == output_size;
+}
+
+// Like ZlibDecompress, for a zstd frame. Always fails if zstd support
+// was not built in.
+bool ZstdDecompress(const char *data, size_t size, char *output,
+                    size_t output_size) {
+#if defined(HAVE_ZSTD)
+  const size_t length = ZSTD_decompress(output, output_size, data, size);
+  return !ZSTD_isError(length) && length == output_size;
+#else
+  return false;
+#endif
+}
+
+// Returns true if name is that of a GNU compressed debug section.
+bool IsZdebugName(const char *name) {
+  return name != NULL && strncmp(name, ".zdebug_", strlen(".zdebug_")) == 0;
+}
 }  // namespace
 
 namespace devtools_crosstool_autofdo {
@@ -83,6 +122,7 @@ class Elf32 {
   typedef Elf32_Phdr Phdr;
   typedef Elf32_Word Word;
   typedef Elf32_Sym Sym;
+  typedef Elf32_Chdr Chdr;
 
   // What should be in the EI_CLASS header.
   static const int kElfClass = ELFCLASS32;
@@ -105,6 +145,7 @@ class Elf64 {
   typedef Elf64_Phdr Phdr;
   typedef Elf64_Word Word;
   typedef Elf64_Sym Sym;
+  typedef Elf64_Chdr Chdr;
 
   // What should be in the EI_CLASS header.
   static const int kElfClass = ELFCLASS64;
@@ -125,11 +166,17 @@ class Elf64 {
 // The motivation for mmaping individual sections of the file is that
 // many Google executables are large enough when unstripped that we
 // have to worry about running out of virtual address space.
+//
+// Compressed sections, with SHF_COMPRESSED or in the older .zdebug
+// format, are decompressed into memory instead, and their contents and
+// size are those of the decompressed bytes.  If a section cannot be
+// decompressed, its contents are NULL and its size is 0.
 template<class ElfArch>
 class ElfSectionReader {
  public:
   ElfSectionReader(const string &path, int fd,
-                   const typename ElfArch::Shdr &section_header)
+                   const typename ElfArch::Shdr &section_header,
+                   bool is_zdebug)
       : header_(section_header) {
     // Back up to the beginning of the page we're interested in.
     const size_t additional = header_.sh_offset % getpagesize();
@@ -143,10 +190,19 @@ class ElfSectionReader {
     // Set where the offset really should begin.
     contents_ = reinterpret_cast<const char*>(contents_aligned_) +
                 (header_.sh_offset - offset_aligned);
+    if (IsCompressed(header_, is_zdebug))
+      Decompress(path, is_zdebug);
   }
 
   ~ElfSectionReader() {
-    munmap(contents_aligned_, size_aligned_);
+    if (contents_aligned_ != NULL)
+      munmap(contents_aligned_, size_aligned_);
+  }
+
+  // Returns true if the section would be decompressed.
+  static bool IsCompressed(const typename ElfArch::Shdr &section_header,
+                           bool is_zdebug) {
+    return (section_header.sh_flags & SHF_COMPRESSED) != 0 || is_zdebug;
   }
 
   // Return the section header for this section.
@@ -162,6 +218,56 @@ class ElfSectionReader {
   size_t section_size() const { return section_size_; }
 
  private:
+  // Replaces the mapped section by its decompressed contents.
+  void Decompress(const string &path, bool is_zdebug) {
+    const char *data = contents_;
+    size_t size = section_size_;
+    uint64 output_size = 0;
+    uint32 type = ELFCOMPRESS_ZLIB;
+    if (is_zdebug) {
+      // "ZLIB" followed by the big-endian 64-bit decompressed size.
+      if (size >= 12 && memcmp(data, "ZLIB", 4) == 0) {
+        for (int i = 4; i < 12; ++i)
+          output_size = (output_size << 8) | static_cast<uint8>(data[i]);
+        data += 12;
+        size -= 12;
+      } else {
+        type = 0;
+      }
+    } else if (size >= sizeof(typename ElfArch::Chdr)) {
+      typename ElfArch::Chdr chdr;
+      memcpy(&chdr, data, sizeof(chdr));
+      type = chdr.ch_type;
+      output_size = chdr.ch_size;
+      data += sizeof(chdr);
+      size -= sizeof(chdr);
+    } else {
+      type = 0;
+    }
+
+    decompressed_.reset(new char[output_size]);
+    bool ok;
+    if (type == ELFCOMPRESS_ZLIB) {
+      ok = ZlibDecompress(data, size, decompressed_.get(), output_size);
+    } else if (type == ELFCOMPRESS_ZSTD) {
+      ok = ZstdDecompress(data, size, decompressed_.get(), output_size);
+    } else {
+      ok = false;
+    }
+    munmap(contents_aligned_, size_aligned_);
+    contents_aligned_ = NULL;
+    if (ok) {
+      contents_ = decompressed_.get();
+      section_size_ = output_size;
+    } else {
+      LOG(WARNING) << "Could not decompress a section of type " << type
+                   << " in " << path;
+      decompressed_.reset();
+      contents_ = NULL;
+      section_size_ = 0;
+    }
+  }
+
   // page-aligned file contents
   void *contents_aligned_;
   // pointer within contents_aligned_ to where the section data begins
@@ -170,6 +276,8 @@ class ElfSectionReader {
   size_t size_aligned_;
   // size of contents.
   size_t section_size_;
+  // The decompressed contents, if the section is compressed.
+  std::unique_ptr<char[]> decompressed_;
   const typename ElfArch::Shdr header_;
 
   DISALLOW_EVIL_CONSTRUCTORS(ElfSectionReader);
@@ -409,6 +517,40 @@ class ElfReaderImpl {
     return NULL;
   }
 
+  // Reads the sections with the given names, decompressing the
+  // compressed ones on a thread each.
+  void LoadSections(const std::vector<string> &section_names) {
+    std::vector<int> compressed;
+    for (int shndx = 0; shndx < GetNumSections(); ++shndx) {
+      if (sections_[shndx] != NULL)
+        continue;
+      const char *name = GetSectionNameByIndex(shndx);
+      if (name == NULL ||
+          !ElfSectionReader<ElfArch>::IsCompressed(section_headers_[shndx],
+                                                   IsZdebugName(name)))
+        continue;
+      for (const string &section_name : section_names) {
+        if (ElfReader::SectionNamesMatch(section_name, name)) {
+          compressed.push_back(shndx);
+          break;
+        }
+      }
+    }
+    // Every thread fills its own slot in sections_, which is not
+    // resized.
+    std::vector<std::thread> threads;
+    threads.reserve(compressed.size());
+    for (int shndx : compressed) {
+      const bool is_zdebug = IsZdebugName(GetSectionNameByIndex(shndx));
+      threads.emplace_back([this, shndx, is_zdebug]() {
+        sections_[shndx] = new ElfSectionReader<ElfArch>(
+            path_, fd_, section_headers_[shndx], is_zdebug);
+      });
+    }
+    for (std::thread &thread : threads)
+      thread.join();
+  }
+
   // This is like GetSectionContentsByName() but it returns a lot of extra
   // information about the section.
   const char *GetSectionInfoByName(const string &section_name,
@@ -428,7 +570,7 @@ class ElfReaderImpl {
           info->flags = section->header().sh_flags;
           info->addr = section->header().sh_addr;
           info->offset = section->header().sh_offset;
-          info->size = section->header().sh_size;
+          info->size = section->section_size();
           info->link = section->header().sh_link;
           info->info = section->header().sh_info;
           info->addralign = section->header().sh_addralign;
@@ -546,7 +688,8 @@ class ElfReaderImpl {
     ElfSectionReader<ElfArch> *& reader = sections_[num];
     if (reader == NULL)
       reader = new ElfSectionReader<ElfArch>(path_, fd_,
-                                             section_headers_[num]);
+                                             section_headers_[num],
+                                             IsZdebugName(name));
     return reader;
   }
 
@@ -689,6 +832,20 @@ ElfReader::ElfReader(const string &path)
   }
 }
 
+std::shared_ptr<ElfReader> ElfReader::GetShared(const string &path) {
+  static std::mutex *mutex = new std::mutex;
+  static map<string, std::weak_ptr<ElfReader> > *readers =
+      new map<string, std::weak_ptr<ElfReader> >;
+  std::lock_guard<std::mutex> lock(*mutex);
+  std::weak_ptr<ElfReader> &shared = (*readers)[path];
+  std::shared_ptr<ElfReader> reader = shared.lock();
+  if (reader == NULL) {
+    reader = std::make_shared<ElfReader>(path);
+    shared = reader;
+  }
+  return reader;
+}
+
 ElfReader::~ElfReader() {
   if (fd_ != -1)
     close(fd_);
@@ -814,6 +971,16 @@ const char *ElfReader::GetSectionByName(const string &section_name,
   }
 }
 
+void ElfReader::LoadSections(const std::vector<string> &section_names) {
+  if (IsElf32File()) {
+    GetImpl32()->LoadSections(section_names);
+  } else if (IsElf64File()) {
+    GetImpl64()->LoadSections(section_names);
+  } else {
+    LOG(ERROR) << "not an elf binary: " << path_;
+  }
+}
+
 const char *ElfReader::GetSectionInfoByName(const string &section_name,
                                             SectionInfo *info) {
   if (IsElf32File()) {
@@ -26,7 +26,9 @@
 #define AUTOFDO_SYMBOLIZE_ELF_READER_H__
 
 #include <functional>
+#include <memory>
 #include <string>
+#include <vector>
 #include "base/common.h"
 
 namespace devtools_crosstool_autofdo {
@@ -41,6 +43,13 @@ class ElfReader {
   explicit ElfReader(const string &path);
   ~ElfReader();
 
+  // Returns a reader of "path" that is shared with every other caller
+  // holding one, so that a binary that several components read is
+  // opened, and its headers and sections are read, only once for as
+  // long as one of them holds the reader.  The reader itself is not
+  // thread-safe.
+  static std::shared_ptr<ElfReader> GetShared(const string &path);
+
   // Parse the ELF prologue of this file and return whether it was
   // successfully parsed and matches the word size and byte order of
   // the current process.
@@ -108,6 +117,11 @@ class ElfReader {
   // destroyed.
   const char *GetSectionByName(const string &section_name, size_t *size);
 
+  // Reads the sections named in "section_names" ahead of their use.
+  // Compressed sections, which GetSectionByName and GetSectionByIndex
+  // return decompressed, are decompressed in parallel.
+  void LoadSections(const std::vector<string> &section_names);
+
   // Gets the buildid of the binary.
   string GetBuildId();
 
@@ -45,7 +45,7 @@ CULineInfoHandler::CULineInfoHandler(
     FileVector* files,
     DirectoryVector* dirs,
     AddressToLineMap* linemap,
-    const std::map<uint64_t, uint64_t> *sampled_functions)
+    const SampledFunctions *sampled_functions)
     : linemap_(linemap), files_(files), dirs_(dirs),
       sampled_functions_(sampled_functions) {
   Init();
@@ -75,13 +75,7 @@ bool CULineInfoHandler::ShouldAddAddress(uint64 address) const {
   if (sampled_functions_ == NULL) {
     return true;
   }
-  std::map<uint64_t, uint64_t>::const_iterator iter =
-      sampled_functions_->upper_bound(address);
-  if (iter == sampled_functions_->begin()) {
-    return false;
-  }
-  --iter;
-  return address < iter->first + iter->second;
+  return sampled_functions_->Contains(address);
 }
 
 void CULineInfoHandler::DefineDir(const char *name, uint32 dir_num) {
@@ -21,13 +21,16 @@
 #ifndef AUTOFDO_SYMBOLIZE_FUNCTIONINFO_H__
 #define AUTOFDO_SYMBOLIZE_FUNCTIONINFO_H__
 
+#include <algorithm>
 #include <map>
 #include <string>
 #include <utility>
+#include <vector>
 
 #include "base/common.h"
 #include "symbolize/bytereader.h"
 #include "symbolize/dwarf2reader.h"
+#include "symbolize/sampled_functions.h"
 
 namespace devtools_crosstool_autofdo {
 
@@ -72,6 +75,9 @@ struct LineIdentifier {
 // inline call stack, the context field from LineIdentifier
 // can be used to fetch the logical row for the calling
 // context.
+// The line rows are appended while the line tables are read, and
+// Freeze sorts them into a compact array once all of them were added.
+// Lookups are only valid after Freeze.
 class AddressToLineMap {
  public:
   // A vector containing Subprogram entries.
@@ -82,13 +88,15 @@ class AddressToLineMap {
   };
   typedef std::vector<struct SubprogInfo> SubprogVector;
 
-  // Map an address to a logical row number.
-  typedef std::map<uint64_t, uint32_t> AddressToLogical;
+  // Map an address to a logical row number, sorted by address once
+  // frozen.
+  typedef std::pair<uint64_t, uint32_t> AddressLogical;
+  typedef std::vector<AddressLogical> AddressToLogical;
   typedef AddressToLogical::const_iterator const_iterator;
 
   AddressToLineMap()
     : subprogs_(), logical_lines_(), line_map_(), logical_map_(),
-      subprog_bias_(0) { }
+      subprog_bias_(0), frozen_(true) { }
 
   void StartCU() {
     subprog_bias_ = subprogs_.size();
@@ -105,7 +113,7 @@ class AddressToLineMap {
   // Adds both a logical entry and an actual entry.
   void AddLine(uint64 addr, LineIdentifier line_id) {
     logical_lines_.push_back(line_id);
-    line_map_[addr] = logical_lines_.size();
+    AddActual(addr, logical_lines_.size());
   }
 
   // Resize the per-CU logical map to the size of the CU's
@@ -143,20 +151,88 @@ class AddressToLineMap {
     return new_logical_num;
   }
 
+  // Maps addr to logical_num. A later row for the same address
+  // replaces the earlier ones.
   void AddActual(uint64 addr, uint64 logical_num) {
-    line_map_[addr] = logical_num;
+    line_map_.push_back(AddressLogical(addr, logical_num));
+    frozen_ = false;
+  }
+
+  // Sorts the rows by address, keeping the last row added for each
+  // address, and drops every row that maps to the same logical as the
+  // row before it, since lookups resolve either one to that logical.
+  void Freeze() {
+    if (frozen_) return;
+    std::stable_sort(line_map_.begin(), line_map_.end(),
+                     [](const AddressLogical &a, const AddressLogical &b) {
+                       return a.first < b.first;
+                     });
+    AddressToLogical::iterator out = line_map_.begin();
+    for (AddressToLogical::const_iterator it = line_map_.begin();
+         it != line_map_.end(); ++it) {
+      AddressToLogical::const_iterator next = it + 1;
+      if (next != line_map_.end() && next->first == it->first) continue;
+      if (out != line_map_.begin() && (out - 1)->second == it->second) {
+        continue;
+      }
+      *out++ = *it;
+    }
+    line_map_.erase(out, line_map_.end());
+    line_map_.shrink_to_fit();
+    frozen_ = true;
+  }
+
+  // Appends the lines and subprograms of other, which must have been
+  // built from the compilation units that follow the ones in this map,
+  // and leaves other empty. The result is the same as if both sets of
+  // compilation units had been read into this map in order.
+  void MergeFrom(AddressToLineMap *other) {
+    const uint32 subprog_bias = subprogs_.size();
+    const uint32 logical_bias = logical_lines_.size();
+    subprogs_.insert(subprogs_.end(), other->subprogs_.begin(),
+                     other->subprogs_.end());
+    logical_lines_.reserve(logical_lines_.size() +
+                           other->logical_lines_.size());
+    for (LineIdentifier line_id : other->logical_lines_) {
+      if (line_id.context > 0) {
+        line_id.context += logical_bias;
+      }
+      if (line_id.subprog_num > 0) {
+        line_id.subprog_num += subprog_bias;
+      }
+      logical_lines_.push_back(line_id);
+    }
+    line_map_.reserve(line_map_.size() + other->line_map_.size());
+    for (const AddressLogical &addr_logical : other->line_map_) {
+      line_map_.push_back(AddressLogical(
+          addr_logical.first,
+          addr_logical.second > 0 ? addr_logical.second + logical_bias : 0));
+    }
+    frozen_ = line_map_.empty();
+    subprog_bias_ = subprogs_.size();
+    other->subprogs_.clear();
+    other->logical_lines_.clear();
+    other->line_map_.clear();
+    other->logical_map_.clear();
+    other->subprog_bias_ = 0;
+    other->frozen_ = true;
   }
 
   const_iterator begin() const {
+    DCHECK(frozen_);
     return line_map_.begin();
   }
 
   const_iterator end() const {
+    DCHECK(frozen_);
     return line_map_.end();
   }
 
   const_iterator upper_bound(uint64 addr) const {
-    return line_map_.upper_bound(addr);
+    DCHECK(frozen_);
+    return std::upper_bound(
+        line_map_.begin(), line_map_.end(), addr,
+        [](uint64 a, const AddressLogical &b) { return a < b.first; });
   }
 
   const LineIdentifier& GetLogical(uint32 logical_num) const {
@@ -171,6 +247,14 @@ class AddressToLineMap {
     return subprogs_[subprog_num - 1];
   }
 
+  // Returns an estimate of the bytes held by the line tables.
+  uint64 MemoryUsage() const {
+    return sizeof(*this) + subprogs_.capacity() * sizeof(SubprogInfo) +
+           logical_lines_.capacity() * sizeof(LineIdentifier) +
+           line_map_.capacity() * sizeof(AddressLogical) +
+           logical_map_.capacity() * sizeof(uint32);
+  }
+
  private:
   SubprogVector subprogs_;
   std::vector<LineIdentifier> logical_lines_;
@@ -187,6 +271,9 @@ class AddressToLineMap {
   // to keep track of the first subprogram for the current CU, and adjust
   // all references into these arrays by this amount.
   uint32 subprog_bias_;
+
+  // Whether line_map_ is sorted and free of duplicate addresses.
+  bool frozen_;
 };
 
 static int strcmp_maybe_null(const char *a, const char *b) {
@@ -243,7 +330,7 @@ class CULineInfoHandler: public LineInfoHandler {
   CULineInfoHandler(FileVector* files,
                     DirectoryVector* dirs,
                     AddressToLineMap* linemap,
-                    const map<uint64_t, uint64_t> *sampled_functions);
+                    const SampledFunctions *sampled_functions);
   virtual ~CULineInfoHandler() { }
 
   // Called at the start of each CU.
@@ -291,7 +378,7 @@ class CULineInfoHandler: public LineInfoHandler {
   AddressToLineMap* linemap_;
   FileVector* files_;
   DirectoryVector* dirs_;
-  const map<uint64_t, uint64_t> *sampled_functions_;
+  const SampledFunctions *sampled_functions_;
   DISALLOW_EVIL_CONSTRUCTORS(CULineInfoHandler);
 };
 
@@ -0,0 +1,73 @@
+// This file contains SampledFunctions, the set of functions that have samples,
+// which is used to skip the debug information of the functions without.
+
+#ifndef AUTOFDO_SYMBOLIZE_SAMPLED_FUNCTIONS_H_
+#define AUTOFDO_SYMBOLIZE_SAMPLED_FUNCTIONS_H_
+
+#include <algorithm>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+namespace devtools_crosstool_autofdo {
+
+// The start addresses and sizes of the sampled functions, in a vector sorted
+// by start address. The queries are binary searches, which unlike a std::map
+// need no node per function.
+class SampledFunctions {
+ public:
+  // A function's start address and size.
+  typedef std::pair<uint64_t, uint64_t> Function;
+
+  SampledFunctions() = default;
+  // FUNCTIONS must be sorted by start address, without duplicate starts.
+  explicit SampledFunctions(std::vector<Function> functions)
+      : functions_(std::move(functions)) {}
+
+  // Returns true if a sampled function starts at ADDRESS.
+  bool HasStart(uint64_t address) const {
+    auto iter = std::lower_bound(
+        functions_.begin(), functions_.end(), address,
+        [](const Function &f, uint64_t addr) { return f.first < addr; });
+    return iter != functions_.end() && iter->first == address;
+  }
+
+  // Returns true if ADDRESS is within the last sampled function that starts
+  // at or before it.
+  bool Contains(uint64_t address) const {
+    auto iter = std::upper_bound(
+        functions_.begin(), functions_.end(), address,
+        [](uint64_t addr, const Function &f) { return addr < f.first; });
+    if (iter == functions_.begin()) return false;
+    --iter;
+    return address < iter->first + iter->second;
+  }
+
+  // Returns true if [BEGIN, END) overlaps the last sampled function that
+  // starts before END.
+  bool Overlaps(uint64_t begin, uint64_t end) const {
+    auto iter = LastStartingBefore(end);
+    return iter != functions_.end() && iter->first + iter->second > begin;
+  }
+
+  const std::vector<Function> &functions() const { return functions_; }
+  size_t size() const { return functions_.size(); }
+
+ private:
+  // Returns the last function that starts before ADDRESS, or end() if there
+  // is none.
+  std::vector<Function>::const_iterator LastStartingBefore(
+      uint64_t address) const {
+    auto iter = std::lower_bound(
+        functions_.begin(), functions_.end(), address,
+        [](const Function &f, uint64_t addr) { return f.first < addr; });
+    if (iter == functions_.begin()) return functions_.end();
+    return --iter;
+  }
+
+  std::vector<Function> functions_;
+};
+
+}  // namespace devtools_crosstool_autofdo
+
+#endif  // AUTOFDO_SYMBOLIZE_SAMPLED_FUNCTIONS_H_